@@ -30,6 +30,10 @@
 #include <string.h>
 #include <inttypes.h>
 
+#if defined( _MSC_VER )
+#include <intrin.h>
+#endif // #if defined( _MSC_VER )
+
 #if defined( _MSC_VER )
 #pragma warning(push)
 #pragma warning(disable:4996)
@@ -97,6 +101,14 @@
 #define NEXT_MATCH_DATA_RESEND_TIME                                  10.0
 #define NEXT_MATCH_DATA_FLUSH_RESEND_TIME                             1.0
 #define NEXT_SERVER_FLUSH_TIMEOUT                                    30.0
+#define NEXT_MAX_SERVER_RECEIVE_THREADS                                16
+#define NEXT_SERVER_RECEIVE_RING_SIZE                                 256
+#define NEXT_SERVER_RECEIVE_COMMAND_QUEUE_LENGTH                     4096
+#define NEXT_SERVER_RECEIVE_EVENT_QUEUE_LENGTH                       4096
+#define NEXT_SERVER_MAINTENANCE_INTERVAL                              0.1
+#define NEXT_SERVER_MAINTENANCE_BUDGET                              0.001
+#define NEXT_SERVER_MAINTENANCE_BATCH                                  16
+#define NEXT_SERVER_SESSION_TIMER_RESOLUTION                         0.01
 
 #define NEXT_CLIENT_COUNTER_OPEN_SESSION                                0
 #define NEXT_CLIENT_COUNTER_CLOSE_SESSION                               1
@@ -197,6 +209,10 @@
 #define NEXT_UDP_HEADER_BYTES                                           8
 #define NEXT_HEADER_BYTES                                              33
 
+#define NEXT_DIRECT_PACKET_HEADER_BYTES                                25
+#define NEXT_SERVER_TO_CLIENT_PACKET_HEADER_BYTES     ( 1 + 15 + NEXT_HEADER_BYTES )
+#define NEXT_PACKET_TRAILER_BYTES                                       2
+
 static uint8_t next_server_backend_public_key[] =
 {
      76,  97, 202, 140,  71, 135,  62, 212,
@@ -386,6 +402,12 @@ extern next_platform_socket_t * next_platform_socket_create( void * context, nex
 
 extern void next_platform_socket_destroy( next_platform_socket_t * socket );
 
+extern bool next_platform_socket_enable_segmentation( next_platform_socket_t * socket );
+
+#if NEXT_PLATFORM == NEXT_PLATFORM_LINUX
+extern void next_platform_socket_send_packets( next_platform_socket_t * socket, const next_address_t * to, void ** packet_data, int * packet_bytes, int num_packets );
+#endif // #if NEXT_PLATFORM == NEXT_PLATFORM_LINUX
+
 extern void next_platform_socket_send_packet( next_platform_socket_t * socket, const next_address_t * to, const void * packet_data, int packet_bytes );
 
 extern int next_platform_socket_receive_packet( next_platform_socket_t * socket, next_address_t * from, void * packet_data, int max_packet_size );
@@ -412,6 +434,14 @@ extern void next_platform_mutex_release( next_platform_mutex_t * mutex );
 
 extern void next_platform_mutex_destroy( next_platform_mutex_t * mutex );
 
+extern int next_platform_semaphore_create( next_platform_semaphore_t * semaphore );
+
+extern void next_platform_semaphore_signal( next_platform_semaphore_t * semaphore );
+
+extern bool next_platform_semaphore_wait( next_platform_semaphore_t * semaphore, double timeout_seconds );
+
+extern void next_platform_semaphore_destroy( next_platform_semaphore_t * semaphore );
+
 struct next_platform_mutex_helper_t
 {
     next_platform_mutex_t * mutex;
@@ -477,6 +507,96 @@ void next_sleep( double time_seconds )
     next_platform_sleep( time_seconds );
 }
 
+// -------------------------------------------------------------
+
+// atomics for state shared between the application thread(s), the internal server thread and its receive workers
+
+#if defined( _MSC_VER )
+
+uint32_t next_atomic_load_32( uint32_t * value )
+{
+    return (uint32_t) _InterlockedOr( (volatile long*) value, 0 );
+}
+
+void next_atomic_store_32( uint32_t * value, uint32_t new_value )
+{
+    _InterlockedExchange( (volatile long*) value, (long) new_value );
+}
+
+uint32_t next_atomic_exchange_32( uint32_t * value, uint32_t new_value )
+{
+    return (uint32_t) _InterlockedExchange( (volatile long*) value, (long) new_value );
+}
+
+uint32_t next_atomic_add_32( uint32_t * value, int32_t delta )
+{
+    return (uint32_t) ( _InterlockedExchangeAdd( (volatile long*) value, (long) delta ) + delta );
+}
+
+// IMPORTANT: 64 bit ops are built on compare exchange because that's the only 64 bit interlocked intrinsic on 32 bit x86
+
+uint64_t next_atomic_load_64( uint64_t * value )
+{
+    return (uint64_t) _InterlockedCompareExchange64( (volatile __int64*) value, 0, 0 );
+}
+
+uint64_t next_atomic_fetch_add_64( uint64_t * value, uint64_t delta )
+{
+    __int64 previous = (__int64) next_atomic_load_64( value );
+    while ( true )
+    {
+        const __int64 result = _InterlockedCompareExchange64( (volatile __int64*) value, previous + (__int64) delta, previous );
+        if ( result == previous )
+            return (uint64_t) previous;
+        previous = result;
+    }
+}
+
+void next_atomic_fence()
+{
+    long barrier = 0;
+    _InterlockedOr( &barrier, 0 );
+}
+
+#else // #if defined( _MSC_VER )
+
+uint32_t next_atomic_load_32( uint32_t * value )
+{
+    return __atomic_load_n( value, __ATOMIC_ACQUIRE );
+}
+
+void next_atomic_store_32( uint32_t * value, uint32_t new_value )
+{
+    __atomic_store_n( value, new_value, __ATOMIC_RELEASE );
+}
+
+uint32_t next_atomic_exchange_32( uint32_t * value, uint32_t new_value )
+{
+    return __atomic_exchange_n( value, new_value, __ATOMIC_ACQ_REL );
+}
+
+uint32_t next_atomic_add_32( uint32_t * value, int32_t delta )
+{
+    return __atomic_add_fetch( value, (uint32_t) delta, __ATOMIC_ACQ_REL );
+}
+
+uint64_t next_atomic_load_64( uint64_t * value )
+{
+    return __atomic_load_n( value, __ATOMIC_ACQUIRE );
+}
+
+uint64_t next_atomic_fetch_add_64( uint64_t * value, uint64_t delta )
+{
+    return __atomic_fetch_add( value, delta, __ATOMIC_RELAXED );
+}
+
+void next_atomic_fence()
+{
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+}
+
+#endif // #if defined( _MSC_VER )
+
 static int log_quiet = 0;
 
 void next_quiet( NEXT_BOOL flag )
@@ -3507,10 +3627,10 @@ bool next_advanced_packet_filter( const uint8_t * data, const uint8_t * magic, c
 
 // --------------------------------------------------
 
-int next_write_direct_packet( uint8_t * packet_data, uint8_t open_session_sequence, uint64_t send_sequence, const uint8_t * game_packet_data, int game_packet_bytes, const uint8_t * magic, const uint8_t * from_address, int from_address_bytes, uint16_t from_port, const uint8_t * to_address, int to_address_bytes, uint16_t to_port )
+int next_write_direct_packet_in_place( uint8_t * packet_data, uint8_t open_session_sequence, uint64_t send_sequence, int game_packet_bytes, const uint8_t * magic, const uint8_t * from_address, int from_address_bytes, uint16_t from_port, const uint8_t * to_address, int to_address_bytes, uint16_t to_port )
 {
+    // the game packet is already at packet_data + NEXT_DIRECT_PACKET_HEADER_BYTES. only the bytes around it are written
     next_assert( packet_data );
-    next_assert( game_packet_data );
     next_assert( game_packet_bytes >= 0 );
     next_assert( game_packet_bytes <= NEXT_MTU );
     uint8_t * p = packet_data;
@@ -3518,7 +3638,8 @@ int next_write_direct_packet( uint8_t * packet_data, uint8_t open_session_sequen
     uint8_t * a = p; p += 15;
     next_write_uint8( &p, open_session_sequence );
     next_write_uint64( &p, send_sequence );
-    next_write_bytes( &p, game_packet_data, game_packet_bytes );
+    next_assert( p - packet_data == NEXT_DIRECT_PACKET_HEADER_BYTES );
+    p += game_packet_bytes;
     uint8_t * b = p; p += 2;
     int packet_length = p - packet_data;
     next_generate_chonkle( a, magic, from_address, from_address_bytes, from_port, to_address, to_address_bytes, to_port, packet_length );
@@ -3526,6 +3647,16 @@ int next_write_direct_packet( uint8_t * packet_data, uint8_t open_session_sequen
     return packet_length;
 }
 
+int next_write_direct_packet( uint8_t * packet_data, uint8_t open_session_sequence, uint64_t send_sequence, const uint8_t * game_packet_data, int game_packet_bytes, const uint8_t * magic, const uint8_t * from_address, int from_address_bytes, uint16_t from_port, const uint8_t * to_address, int to_address_bytes, uint16_t to_port )
+{
+    next_assert( packet_data );
+    next_assert( game_packet_data );
+    next_assert( game_packet_bytes >= 0 );
+    next_assert( game_packet_bytes <= NEXT_MTU );
+    memcpy( packet_data + NEXT_DIRECT_PACKET_HEADER_BYTES, game_packet_data, game_packet_bytes );
+    return next_write_direct_packet_in_place( packet_data, open_session_sequence, send_sequence, game_packet_bytes, magic, from_address, from_address_bytes, from_port, to_address, to_address_bytes, to_port );
+}
+
 int next_write_route_request_packet( uint8_t * packet_data, const uint8_t * token_data, int token_bytes, const uint8_t * magic, const uint8_t * from_address, int from_address_bytes, uint16_t from_port, const uint8_t * to_address, int to_address_bytes, uint16_t to_port )
 {
     uint8_t * p = packet_data;
@@ -3656,11 +3787,11 @@ int next_write_client_to_server_packet( uint8_t * packet_data, uint64_t send_seq
     return packet_length;
 }
 
-int next_write_server_to_client_packet( uint8_t * packet_data, uint64_t send_sequence, uint64_t session_id, uint8_t session_version, const uint8_t * private_key, const uint8_t * game_packet_data, int game_packet_bytes, const uint8_t * magic, const uint8_t * from_address, int from_address_bytes, uint16_t from_port, const uint8_t * to_address, int to_address_bytes, uint16_t to_port )
+int next_write_server_to_client_packet_in_place( uint8_t * packet_data, uint64_t send_sequence, uint64_t session_id, uint8_t session_version, const uint8_t * private_key, int game_packet_bytes, const uint8_t * magic, const uint8_t * from_address, int from_address_bytes, uint16_t from_port, const uint8_t * to_address, int to_address_bytes, uint16_t to_port )
 {
+    // the game packet is already at packet_data + NEXT_SERVER_TO_CLIENT_PACKET_HEADER_BYTES. only the bytes around it are written
     next_assert( packet_data );
     next_assert( private_key );
-    next_assert( game_packet_data );
     next_assert( game_packet_bytes >= 0 );
     next_assert( game_packet_bytes <= NEXT_MTU );
     uint8_t * p = packet_data;
@@ -3670,7 +3801,8 @@ int next_write_server_to_client_packet( uint8_t * packet_data, uint64_t send_seq
     send_sequence |= uint64_t(1) << 63;
     if ( next_write_header( NEXT_DIRECTION_SERVER_TO_CLIENT, NEXT_SERVER_TO_CLIENT_PACKET, send_sequence, session_id, session_version, private_key, b ) != NEXT_OK )
         return 0;
-    next_write_bytes( &p, game_packet_data, game_packet_bytes );
+    next_assert( p - packet_data == NEXT_SERVER_TO_CLIENT_PACKET_HEADER_BYTES );
+    p += game_packet_bytes;
     uint8_t * c = p; p += 2;
     int packet_length = p - packet_data;
     next_generate_chonkle( a, magic, from_address, from_address_bytes, from_port, to_address, to_address_bytes, to_port, packet_length );
@@ -3678,6 +3810,16 @@ int next_write_server_to_client_packet( uint8_t * packet_data, uint64_t send_seq
     return packet_length;
 }
 
+int next_write_server_to_client_packet( uint8_t * packet_data, uint64_t send_sequence, uint64_t session_id, uint8_t session_version, const uint8_t * private_key, const uint8_t * game_packet_data, int game_packet_bytes, const uint8_t * magic, const uint8_t * from_address, int from_address_bytes, uint16_t from_port, const uint8_t * to_address, int to_address_bytes, uint16_t to_port )
+{
+    next_assert( packet_data );
+    next_assert( game_packet_data );
+    next_assert( game_packet_bytes >= 0 );
+    next_assert( game_packet_bytes <= NEXT_MTU );
+    memcpy( packet_data + NEXT_SERVER_TO_CLIENT_PACKET_HEADER_BYTES, game_packet_data, game_packet_bytes );
+    return next_write_server_to_client_packet_in_place( packet_data, send_sequence, session_id, session_version, private_key, game_packet_bytes, magic, from_address, from_address_bytes, from_port, to_address, to_address_bytes, to_port );
+}
+
 int next_write_ping_packet( uint8_t * packet_data, uint64_t send_sequence, uint64_t session_id, uint8_t session_version, const uint8_t * private_key, uint64_t ping_sequence, const uint8_t * magic, const uint8_t * from_address, int from_address_bytes, uint16_t from_port, const uint8_t * to_address, int to_address_bytes, uint16_t to_port )
 {
     next_assert( packet_data );
@@ -4132,6 +4274,8 @@ struct next_config_internal_t
     bool disable_autodetect;
     bool force_passthrough_direct;
     bool high_priority_threads;
+    int server_receive_threads;
+    bool udp_segmentation;
 };
 
 static next_config_internal_t next_global_config;
@@ -4147,6 +4291,8 @@ void next_default_config( next_config_t * config )
     config->high_priority_threads = NEXT_TRUE;
 }
 
+bool next_hash_key_init();
+
 int next_init( void * context, next_config_t * config_in )
 {
     next_assert( next_global_context == NULL );
@@ -4165,6 +4311,12 @@ int next_init( void * context, next_config_t * config_in )
         return NEXT_ERROR;
     }
 
+    if ( !next_hash_key_init() )
+    {
+        next_printf( NEXT_LOG_LEVEL_ERROR, "failed to initialize hash key" );
+        return NEXT_ERROR;
+    }
+
     const char * log_level_override = next_platform_getenv( "NEXT_LOG_LEVEL" );
     if ( log_level_override )
     {
@@ -4251,6 +4403,8 @@ int next_init( void * context, next_config_t * config_in )
     {
         config.socket_send_buffer_size = config_in->socket_send_buffer_size;
         config.socket_receive_buffer_size = config_in->socket_receive_buffer_size;
+        config.server_receive_threads = config_in->server_receive_threads;
+        config.udp_segmentation = config_in->udp_segmentation;
     }
 
     config.disable_network_next = config_in ? config_in->disable_network_next : false;
@@ -4409,6 +4563,31 @@ int next_init( void * context, next_config_t * config_in )
         next_printf( NEXT_LOG_LEVEL_INFO, "high priority threads overridden to %d", config.high_priority_threads );
     }
 
+    const char * server_receive_threads_override = next_platform_getenv( "NEXT_SERVER_RECEIVE_THREADS" );
+    if ( server_receive_threads_override )
+    {
+        config.server_receive_threads = atoi( server_receive_threads_override );
+        next_printf( NEXT_LOG_LEVEL_INFO, "server receive threads overridden to %d", config.server_receive_threads );
+    }
+
+    if ( config.server_receive_threads < 0 )
+    {
+        config.server_receive_threads = 0;
+    }
+
+    if ( config.server_receive_threads > NEXT_MAX_SERVER_RECEIVE_THREADS )
+    {
+        next_printf( NEXT_LOG_LEVEL_WARN, "server receive threads clamped to %d", NEXT_MAX_SERVER_RECEIVE_THREADS );
+        config.server_receive_threads = NEXT_MAX_SERVER_RECEIVE_THREADS;
+    }
+
+    const char * udp_segmentation_override = next_platform_getenv( "NEXT_UDP_SEGMENTATION" );
+    if ( udp_segmentation_override )
+    {
+        config.udp_segmentation = ( atoi( udp_segmentation_override ) > 0 ) ? true : false;
+        next_printf( NEXT_LOG_LEVEL_INFO, "udp segmentation overridden to %d", config.udp_segmentation );
+    }
+
     next_global_config = config;
 
     next_signed_packets[NEXT_UPGRADE_REQUEST_PACKET] = 1;
@@ -9104,2193 +9283,4019 @@ void next_address_anonymize( next_address_t * address )
 
 // ---------------------------------------------------------------
 
-struct next_pending_session_entry_t
-{
-    NEXT_DECLARE_SENTINEL(0)
+/*
+    Keyed hash for every table indexed by client controlled keys (addresses, session ids).
 
-    next_address_t address;
-    uint64_t session_id;
-    uint64_t user_hash;
-    uint64_t tags[NEXT_MAX_TAGS];
-    int num_tags;
-    double upgrade_time;
-    double last_packet_send_time;
-    uint8_t private_key[NEXT_CRYPTO_SECRETBOX_KEYBYTES];
-    uint8_t upgrade_token[NEXT_UPGRADE_TOKEN_BYTES];
+    SipHash-1-3 over whole 64 bit words, with a random key chosen once per process. Without the key an attacker
+    cannot pick addresses that collide into one probe chain. Hash values differ between processes, so they must
+    never be stored or sent anywhere.
+*/
 
-    NEXT_DECLARE_SENTINEL(1)
-};
+static uint64_t next_hash_key[2];
+static bool next_hash_key_initialized;
 
-void next_pending_session_entry_initialize_sentinels( next_pending_session_entry_t * entry )
+#define NEXT_SIPROUND( v0, v1, v2, v3 )                                                         \
+    do                                                                                          \
+    {                                                                                           \
+        v0 += v1; v1 = ( v1 << 13 ) | ( v1 >> 51 ); v1 ^= v0; v0 = ( v0 << 32 ) | ( v0 >> 32 ); \
+        v2 += v3; v3 = ( v3 << 16 ) | ( v3 >> 48 ); v3 ^= v2;                                    \
+        v0 += v3; v3 = ( v3 << 21 ) | ( v3 >> 43 ); v3 ^= v0;                                    \
+        v2 += v1; v1 = ( v1 << 17 ) | ( v1 >> 47 ); v1 ^= v2; v2 = ( v2 << 32 ) | ( v2 >> 32 ); \
+    } while (0)
+
+uint64_t next_siphash13( const uint64_t key[2], const uint64_t * words, int num_words )
 {
-    (void) entry;
-    next_assert( entry );
-    NEXT_INITIALIZE_SENTINEL( entry, 0 )
-    NEXT_INITIALIZE_SENTINEL( entry, 1 )
+    next_assert( key );
+    next_assert( num_words >= 0 );
+
+    // same result as siphash-1-3 over the little endian bytes of the words
+
+    uint64_t v0 = key[0] ^ 0x736F6D6570736575ULL;
+    uint64_t v1 = key[1] ^ 0x646F72616E646F6DULL;
+    uint64_t v2 = key[0] ^ 0x6C7967656E657261ULL;
+    uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+
+    for ( int i = 0; i < num_words; ++i )
+    {
+        v3 ^= words[i];
+        NEXT_SIPROUND( v0, v1, v2, v3 );
+        v0 ^= words[i];
+    }
+
+    const uint64_t last = uint64_t( num_words * 8 ) << 56;
+
+    v3 ^= last;
+    NEXT_SIPROUND( v0, v1, v2, v3 );
+    v0 ^= last;
+
+    v2 ^= 0xFF;
+    NEXT_SIPROUND( v0, v1, v2, v3 );
+    NEXT_SIPROUND( v0, v1, v2, v3 );
+    NEXT_SIPROUND( v0, v1, v2, v3 );
+
+    return v0 ^ v1 ^ v2 ^ v3;
 }
 
-void next_pending_session_entry_verify_sentinels( next_pending_session_entry_t * entry )
+bool next_hash_key_init()
 {
-    (void) entry;
-    next_assert( entry );
-    NEXT_VERIFY_SENTINEL( entry, 0 )
-    NEXT_VERIFY_SENTINEL( entry, 1 )
+    // called from next_init, and by anything that builds hashed tables before that. the key never changes afterwards
+
+    if ( next_hash_key_initialized )
+        return true;
+
+    if ( next_crypto_init() == -1 )
+        return false;
+
+    next_random_bytes( (uint8_t*) next_hash_key, sizeof(next_hash_key) );
+
+    next_hash_key_initialized = true;
+
+    return true;
 }
 
-struct next_pending_session_manager_t
+void next_hash_get_key( uint64_t key[2] )
 {
-    NEXT_DECLARE_SENTINEL(0)
+    key[0] = next_hash_key[0];
+    key[1] = next_hash_key[1];
+}
 
-    void * context;
-    int size;
-    int max_entry_index;
-    next_address_t * addresses;
-    next_pending_session_entry_t * entries;
+void next_hash_set_key( const uint64_t key[2] )
+{
+    // tests only. every table hashed with the previous key is invalid after this
 
-    NEXT_DECLARE_SENTINEL(1)
-};
+    next_hash_key[0] = key[0];
+    next_hash_key[1] = key[1];
+    next_hash_key_initialized = true;
+}
 
-void next_pending_session_manager_initialize_sentinels( next_pending_session_manager_t * session_manager )
+uint64_t next_hash_words( const uint64_t * words, int num_words )
 {
-    (void) session_manager;
-    next_assert( session_manager );
-    NEXT_INITIALIZE_SENTINEL( session_manager, 0 )
-    NEXT_INITIALIZE_SENTINEL( session_manager, 1 )
+    return next_siphash13( next_hash_key, words, num_words );
 }
 
-void next_pending_session_manager_verify_sentinels( next_pending_session_manager_t * session_manager )
+uint32_t next_address_hash( const next_address_t * address )
 {
-    (void) session_manager;
-#if NEXT_ENABLE_MEMORY_CHECKS
-    next_assert( session_manager );
-    NEXT_VERIFY_SENTINEL( session_manager, 0 )
-    NEXT_VERIFY_SENTINEL( session_manager, 1 )
-    const int size = session_manager->size;
-    for ( int i = 0; i < size; ++i )
+    next_assert( address );
+
+    uint64_t words[3];
+
+    words[0] = ( uint64_t( address->type ) << 48 ) | ( uint64_t( address->port ) << 32 );
+
+    if ( address->type == NEXT_ADDRESS_IPV4 )
     {
-        if ( session_manager->addresses[i].type != 0 )
-        {
-            next_pending_session_entry_verify_sentinels( &session_manager->entries[i] );
-        }
+        words[0] |= ( uint64_t( address->data.ipv4[0] ) << 24 ) | ( uint64_t( address->data.ipv4[1] ) << 16 ) | ( uint64_t( address->data.ipv4[2] ) << 8 ) | uint64_t( address->data.ipv4[3] );
+        return uint32_t( next_hash_words( words, 1 ) );
     }
-#endif // #if NEXT_ENABLE_MEMORY_CHECKS
-}
 
-void next_pending_session_manager_destroy( next_pending_session_manager_t * pending_session_manager );
+    if ( address->type == NEXT_ADDRESS_IPV6 )
+    {
+        words[1] = ( uint64_t( address->data.ipv6[0] ) << 48 ) | ( uint64_t( address->data.ipv6[1] ) << 32 ) | ( uint64_t( address->data.ipv6[2] ) << 16 ) | uint64_t( address->data.ipv6[3] );
+        words[2] = ( uint64_t( address->data.ipv6[4] ) << 48 ) | ( uint64_t( address->data.ipv6[5] ) << 32 ) | ( uint64_t( address->data.ipv6[6] ) << 16 ) | uint64_t( address->data.ipv6[7] );
+        return uint32_t( next_hash_words( words, 3 ) );
+    }
 
-next_pending_session_manager_t * next_pending_session_manager_create( void * context, int initial_size )
+    return uint32_t( next_hash_words( words, 1 ) );
+}
+
+uint32_t next_session_id_hash( uint64_t session_id )
 {
-    next_pending_session_manager_t * pending_session_manager = (next_pending_session_manager_t*) next_malloc( context, sizeof(next_pending_session_manager_t) );
+    return uint32_t( next_hash_words( &session_id, 1 ) );
+}
 
-    next_assert( pending_session_manager );
-    if ( !pending_session_manager )
-        return NULL;
+// ---------------------------------------------------------------
 
-    memset( pending_session_manager, 0, sizeof(next_pending_session_manager_t) );
+/*
+    Open addressed index from a key hash to an entry index in a manager's arrays.
 
-    next_pending_session_manager_initialize_sentinels( pending_session_manager );
+    Keys stay in the manager, so a lookup walks the probe sequence for the hash and the caller
+    compares its key against each candidate entry. Removal uses backward shift, so there are no tombstones.
+*/
 
-    pending_session_manager->context = context;
-    pending_session_manager->size = initial_size;
-    pending_session_manager->addresses = (next_address_t*) next_malloc( context, initial_size * sizeof(next_address_t) );
-    pending_session_manager->entries = (next_pending_session_entry_t*) next_malloc( context, initial_size * sizeof(next_pending_session_entry_t) );
+struct next_hash_index_t
+{
+    void * context;
+    int capacity;
+    uint32_t * hashes;
+    int * entries;
+};
 
-    next_assert( pending_session_manager->addresses );
-    next_assert( pending_session_manager->entries );
+bool next_hash_index_create( void * context, next_hash_index_t * index, int max_entries )
+{
+    next_assert( index );
+    next_assert( max_entries > 0 );
 
-    if ( pending_session_manager->addresses == NULL || pending_session_manager->entries == NULL )
+    // keep the load factor at or below one half
+
+    int capacity = 16;
+    while ( capacity < max_entries * 2 )
     {
-        next_pending_session_manager_destroy( pending_session_manager );
-        return NULL;
+        capacity *= 2;
     }
 
-    memset( pending_session_manager->addresses, 0, initial_size * sizeof(next_address_t) );
-    memset( pending_session_manager->entries, 0, initial_size * sizeof(next_pending_session_entry_t) );
+    index->context = context;
+    index->capacity = capacity;
+    index->hashes = (uint32_t*) next_malloc( context, size_t(capacity) * sizeof(uint32_t) );
+    index->entries = (int*) next_malloc( context, size_t(capacity) * sizeof(int) );
 
-    for ( int i = 0; i < initial_size; i++ )
-        next_pending_session_entry_initialize_sentinels( &pending_session_manager->entries[i] );
+    if ( index->hashes == NULL || index->entries == NULL )
+    {
+        next_free( context, index->hashes );
+        next_free( context, index->entries );
+        memset( index, 0, sizeof(next_hash_index_t) );
+        return false;
+    }
 
-    next_pending_session_manager_verify_sentinels( pending_session_manager );
+    memset( index->hashes, 0, size_t(capacity) * sizeof(uint32_t) );
 
-    return pending_session_manager;
+    for ( int i = 0; i < capacity; ++i )
+    {
+        index->entries[i] = -1;
+    }
+
+    return true;
 }
 
-void next_pending_session_manager_destroy( next_pending_session_manager_t * pending_session_manager )
+void next_hash_index_destroy( next_hash_index_t * index )
 {
-    next_pending_session_manager_verify_sentinels( pending_session_manager );
+    next_assert( index );
 
-    next_free( pending_session_manager->context, pending_session_manager->addresses );
-    next_free( pending_session_manager->context, pending_session_manager->entries );
+    if ( index->hashes )
+    {
+        next_free( index->context, index->hashes );
+    }
 
-    clear_and_free( pending_session_manager->context, pending_session_manager, sizeof(next_pending_session_manager_t) );
+    if ( index->entries )
+    {
+        next_free( index->context, index->entries );
+    }
+
+    memset( index, 0, sizeof(next_hash_index_t) );
 }
 
-bool next_pending_session_manager_expand( next_pending_session_manager_t * pending_session_manager )
+void next_hash_index_insert( next_hash_index_t * index, uint32_t hash, int entry_index )
 {
-    next_pending_session_manager_verify_sentinels( pending_session_manager );
-
-    int new_size = pending_session_manager->size * 2;
+    next_assert( index );
+    next_assert( index->entries );
+    next_assert( entry_index >= 0 );
 
-    next_address_t * new_addresses = (next_address_t*) next_malloc( pending_session_manager->context, new_size * sizeof(next_address_t) );
-
-    next_pending_session_entry_t * new_entries = (next_pending_session_entry_t*) next_malloc( pending_session_manager->context, new_size * sizeof(next_pending_session_entry_t) );
+    const int mask = index->capacity - 1;
 
-    next_assert( pending_session_manager->addresses );
-    next_assert( pending_session_manager->entries );
+    int slot = int( hash & uint32_t( mask ) );
 
-    if ( pending_session_manager->addresses == NULL || pending_session_manager->entries == NULL )
+    while ( index->entries[slot] != -1 )
     {
-        next_free( pending_session_manager->context, new_addresses );
-        next_free( pending_session_manager->context, new_entries );
-        return false;
+        next_assert( index->entries[slot] != entry_index );
+        slot = ( slot + 1 ) & mask;
     }
 
-    memset( new_addresses, 0, new_size * sizeof(next_address_t) );
-    memset( new_entries, 0, new_size * sizeof(next_pending_session_entry_t) );
+    index->hashes[slot] = hash;
+    index->entries[slot] = entry_index;
+}
 
-    for ( int i = 0; i < new_size; ++i )
-        next_pending_session_entry_initialize_sentinels( &new_entries[i] );
+void next_hash_index_remove( next_hash_index_t * index, uint32_t hash, int entry_index )
+{
+    next_assert( index );
+    next_assert( index->entries );
 
-    int index = 0;
-    const int current_size = pending_session_manager->size;
-    for ( int i = 0; i < current_size; ++i )
+    const int mask = index->capacity - 1;
+
+    int slot = int( hash & uint32_t( mask ) );
+
+    while ( index->entries[slot] != entry_index )
     {
-        if ( pending_session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
-        {
-            memcpy( &new_addresses[index], &pending_session_manager->addresses[i], sizeof(next_address_t) );
-            memcpy( &new_entries[index], &pending_session_manager->entries[i], sizeof(next_pending_session_entry_t) );
-            index++;
-        }
+        if ( index->entries[slot] == -1 )
+            return;
+        slot = ( slot + 1 ) & mask;
     }
 
-    next_free( pending_session_manager->context, pending_session_manager->addresses );
-    next_free( pending_session_manager->context, pending_session_manager->entries );
+    // shift later entries in the same cluster back, so probe sequences stay unbroken
 
-    pending_session_manager->addresses = new_addresses;
-    pending_session_manager->entries = new_entries;
-    pending_session_manager->size = new_size;
-    pending_session_manager->max_entry_index = index - 1;
+    int next_slot = ( slot + 1 ) & mask;
 
-    next_pending_session_manager_verify_sentinels( pending_session_manager );
+    while ( index->entries[next_slot] != -1 )
+    {
+        const int home_slot = int( index->hashes[next_slot] & uint32_t( mask ) );
 
-    return true;
+        if ( ( ( next_slot - home_slot ) & mask ) >= ( ( next_slot - slot ) & mask ) )
+        {
+            index->hashes[slot] = index->hashes[next_slot];
+            index->entries[slot] = index->entries[next_slot];
+            slot = next_slot;
+        }
+
+        next_slot = ( next_slot + 1 ) & mask;
+    }
+
+    index->hashes[slot] = 0;
+    index->entries[slot] = -1;
 }
 
-next_pending_session_entry_t * next_pending_session_manager_add( next_pending_session_manager_t * pending_session_manager, const next_address_t * address, uint64_t session_id, const uint8_t * private_key, const uint8_t * upgrade_token, double current_time )
+int next_hash_index_probe( const next_hash_index_t * index, uint32_t hash, int * probe )
 {
-    next_pending_session_manager_verify_sentinels( pending_session_manager );
+    // returns the next entry index with a matching hash, or -1. start with *probe = -1
 
-    next_assert( session_id != 0 );
-    next_assert( address );
-    next_assert( address->type != NEXT_ADDRESS_NONE );
+    next_assert( index );
+    next_assert( probe );
 
-    // first scan existing entries and see if we can insert there
+    const int mask = index->capacity - 1;
 
-    const int size = pending_session_manager->size;
+    int slot = ( *probe < 0 ) ? int( hash & uint32_t( mask ) ) : ( ( *probe + 1 ) & mask );
 
-    for ( int i = 0; i < size; ++i )
+    while ( index->entries[slot] != -1 )
     {
-        if ( pending_session_manager->addresses[i].type == NEXT_ADDRESS_NONE )
+        if ( index->hashes[slot] == hash )
         {
-            pending_session_manager->addresses[i] = *address;
-            next_pending_session_entry_t * entry = &pending_session_manager->entries[i];
-            entry->address = *address;
-            entry->session_id = session_id;
-            entry->upgrade_time = current_time;
-            entry->last_packet_send_time = -1000.0;
-            memcpy( entry->private_key, private_key, NEXT_CRYPTO_SECRETBOX_KEYBYTES );
-            memcpy( entry->upgrade_token, upgrade_token, NEXT_UPGRADE_TOKEN_BYTES );
-            if ( i > pending_session_manager->max_entry_index )
-            {
-                pending_session_manager->max_entry_index = i;
-            }
-            return entry;
+            *probe = slot;
+            return index->entries[slot];
         }
+        slot = ( slot + 1 ) & mask;
     }
 
-    // ok, we need to grow, expand and add at the end (expand compacts existing entries)
+    *probe = slot;
 
-    if ( !next_pending_session_manager_expand( pending_session_manager ) )
-        return NULL;
+    return -1;
+}
 
-    const int i = ++pending_session_manager->max_entry_index;
-    pending_session_manager->addresses[i] = *address;
-    next_pending_session_entry_t * entry = &pending_session_manager->entries[i];
-    entry->address = *address;
-    entry->session_id = session_id;
-    entry->upgrade_time = current_time;
-    entry->last_packet_send_time = -1000.0;
-    memcpy( entry->private_key, private_key, NEXT_CRYPTO_SECRETBOX_KEYBYTES );
-    memcpy( entry->upgrade_token, upgrade_token, NEXT_UPGRADE_TOKEN_BYTES );
+// ---------------------------------------------------------------
 
-    next_pending_session_manager_verify_sentinels( pending_session_manager );
+/*
+    Hierarchical timer wheel.
 
-    return entry;
-}
+    Timers are identified by a caller owned index in [0,max_timers), usually the index of an entry in a manager's arrays,
+    so each subsystem keeps its own deadlines and only pays for the timers that come due. Level 0 covers the next 64 ticks
+    at the wheel resolution, and each level above covers 64 times the range of the level below. Timers in an upper level
+    cascade down as the wheel reaches their bucket, and a timer past the range of the top level is re-inserted when its
+    top level bucket comes up.
 
-void next_pending_session_manager_remove_at_index( next_pending_session_manager_t * pending_session_manager, int index )
+    A timer fires on the first advance at or after its deadline, at most one tick late. Expired timers wait in a list
+    until the caller pops them, so the caller can stop partway and pick up the rest later.
+*/
+
+#define NEXT_TIMER_WHEEL_LEVELS                                         4
+#define NEXT_TIMER_WHEEL_BITS                                           6
+#define NEXT_TIMER_WHEEL_SLOTS               ( 1 << NEXT_TIMER_WHEEL_BITS )
+#define NEXT_TIMER_WHEEL_BUCKETS  ( NEXT_TIMER_WHEEL_LEVELS * NEXT_TIMER_WHEEL_SLOTS )
+#define NEXT_TIMER_WHEEL_EXPIRED                 NEXT_TIMER_WHEEL_BUCKETS
+
+struct next_timer_wheel_t
 {
-    next_pending_session_manager_verify_sentinels( pending_session_manager );
+    NEXT_DECLARE_SENTINEL(0)
 
-    next_assert( index >= 0 );
-    next_assert( index <= pending_session_manager->max_entry_index );
+    void * context;
+    double resolution;
+    uint64_t current_tick;
+    int max_timers;
+    int num_timers;
+    uint64_t * expire_ticks;
+    int * buckets;
+    int * next;
+    int * prev;
+    int heads[NEXT_TIMER_WHEEL_BUCKETS+1];
+    int level_timers[NEXT_TIMER_WHEEL_LEVELS];
 
-    const int max_index = pending_session_manager->max_entry_index;
+    NEXT_DECLARE_SENTINEL(1)
+};
 
-    pending_session_manager->addresses[index].type = NEXT_ADDRESS_NONE;
+void next_timer_wheel_initialize_sentinels( next_timer_wheel_t * wheel )
+{
+    (void) wheel;
+    next_assert( wheel );
+    NEXT_INITIALIZE_SENTINEL( wheel, 0 )
+    NEXT_INITIALIZE_SENTINEL( wheel, 1 )
+}
 
-    if ( index == max_index )
-    {
-        while ( index > 0 && pending_session_manager->addresses[index].type == NEXT_ADDRESS_NONE )
-        {
-            index--;
-        }
-        pending_session_manager->max_entry_index = index;
-    }
+void next_timer_wheel_verify_sentinels( next_timer_wheel_t * wheel )
+{
+    (void) wheel;
+    next_assert( wheel );
+    NEXT_VERIFY_SENTINEL( wheel, 0 )
+    NEXT_VERIFY_SENTINEL( wheel, 1 )
 }
 
-void next_pending_session_manager_remove_by_address( next_pending_session_manager_t * pending_session_manager, const next_address_t * address )
+void next_timer_wheel_destroy( next_timer_wheel_t * wheel );
+
+bool next_timer_wheel_expand( next_timer_wheel_t * wheel, int max_timers )
 {
-    next_pending_session_manager_verify_sentinels( pending_session_manager );
+    next_timer_wheel_verify_sentinels( wheel );
 
-    next_assert( address );
+    if ( max_timers <= wheel->max_timers )
+        return true;
 
-    const int max_index = pending_session_manager->max_entry_index;
+    uint64_t * new_expire_ticks = (uint64_t*) next_malloc( wheel->context, size_t(max_timers) * sizeof(uint64_t) );
+    int * new_buckets = (int*) next_malloc( wheel->context, size_t(max_timers) * sizeof(int) );
+    int * new_next = (int*) next_malloc( wheel->context, size_t(max_timers) * sizeof(int) );
+    int * new_prev = (int*) next_malloc( wheel->context, size_t(max_timers) * sizeof(int) );
 
-    for ( int i = 0; i <= max_index; ++i )
+    if ( new_expire_ticks == NULL || new_buckets == NULL || new_next == NULL || new_prev == NULL )
     {
-        if ( next_address_equal( address, &pending_session_manager->addresses[i] ) == 1 )
-        {
-            next_pending_session_manager_remove_at_index( pending_session_manager, i );
-            return;
-        }
+        next_free( wheel->context, new_expire_ticks );
+        next_free( wheel->context, new_buckets );
+        next_free( wheel->context, new_next );
+        next_free( wheel->context, new_prev );
+        return false;
     }
-}
 
-next_pending_session_entry_t * next_pending_session_manager_find( next_pending_session_manager_t * pending_session_manager, const next_address_t * address )
-{
-    next_pending_session_manager_verify_sentinels( pending_session_manager );
+    // links are timer indices, so existing timers stay in their buckets when the arrays move
 
-    next_assert( address );
+    const int old_max_timers = wheel->max_timers;
 
-    const int max_index = pending_session_manager->max_entry_index;
+    if ( old_max_timers > 0 )
+    {
+        memcpy( new_expire_ticks, wheel->expire_ticks, size_t(old_max_timers) * sizeof(uint64_t) );
+        memcpy( new_buckets, wheel->buckets, size_t(old_max_timers) * sizeof(int) );
+        memcpy( new_next, wheel->next, size_t(old_max_timers) * sizeof(int) );
+        memcpy( new_prev, wheel->prev, size_t(old_max_timers) * sizeof(int) );
+        next_free( wheel->context, wheel->expire_ticks );
+        next_free( wheel->context, wheel->buckets );
+        next_free( wheel->context, wheel->next );
+        next_free( wheel->context, wheel->prev );
+    }
 
-    for ( int i = 0; i <= max_index; ++i )
+    for ( int i = old_max_timers; i < max_timers; ++i )
     {
-        if ( next_address_equal( address, &pending_session_manager->addresses[i] ) == 1 )
-        {
-            return &pending_session_manager->entries[i];
-        }
+        new_expire_ticks[i] = 0;
+        new_buckets[i] = -1;
+        new_next[i] = -1;
+        new_prev[i] = -1;
     }
 
-    return NULL;
+    wheel->expire_ticks = new_expire_ticks;
+    wheel->buckets = new_buckets;
+    wheel->next = new_next;
+    wheel->prev = new_prev;
+    wheel->max_timers = max_timers;
+
+    return true;
 }
 
-int next_pending_session_manager_num_entries( next_pending_session_manager_t * pending_session_manager )
+next_timer_wheel_t * next_timer_wheel_create( void * context, int max_timers, double resolution, double current_time )
 {
-    next_pending_session_manager_verify_sentinels( pending_session_manager );
+    next_assert( max_timers > 0 );
+    next_assert( resolution > 0.0 );
 
-    int num_entries = 0;
+    next_timer_wheel_t * wheel = (next_timer_wheel_t*) next_malloc( context, sizeof(next_timer_wheel_t) );
+    if ( !wheel )
+        return NULL;
 
-    const int max_index = pending_session_manager->max_entry_index;
+    memset( wheel, 0, sizeof(next_timer_wheel_t) );
 
-    for ( int i = 0; i <= max_index; ++i )
+    next_timer_wheel_initialize_sentinels( wheel );
+
+    wheel->context = context;
+    wheel->resolution = resolution;
+    wheel->current_tick = ( current_time > 0.0 ) ? uint64_t( floor( current_time / resolution ) ) : 0;
+
+    for ( int i = 0; i <= NEXT_TIMER_WHEEL_BUCKETS; ++i )
     {
-        if ( pending_session_manager->addresses[i].type != 0 )
-        {
-            num_entries++;
-        }
+        wheel->heads[i] = -1;
     }
 
-    return num_entries;
-}
-
-// ---------------------------------------------------------------
+    if ( !next_timer_wheel_expand( wheel, max_timers ) )
+    {
+        next_timer_wheel_destroy( wheel );
+        return NULL;
+    }
 
-struct next_proxy_session_entry_t
-{
-    NEXT_DECLARE_SENTINEL(0)
+    next_timer_wheel_verify_sentinels( wheel );
 
-    next_address_t address;
-    uint64_t session_id;
+    return wheel;
+}
 
-    NEXT_DECLARE_SENTINEL(1)
+void next_timer_wheel_destroy( next_timer_wheel_t * wheel )
+{
+    next_timer_wheel_verify_sentinels( wheel );
 
-    next_bandwidth_limiter_t send_bandwidth;
+    next_free( wheel->context, wheel->expire_ticks );
+    next_free( wheel->context, wheel->buckets );
+    next_free( wheel->context, wheel->next );
+    next_free( wheel->context, wheel->prev );
 
-    NEXT_DECLARE_SENTINEL(2)
-};
+    clear_and_free( wheel->context, wheel, sizeof(next_timer_wheel_t) );
+}
 
-void next_proxy_session_entry_initialize_sentinels( next_proxy_session_entry_t * entry )
+static void next_timer_wheel_link( next_timer_wheel_t * wheel, int timer, int bucket )
 {
-    (void) entry;
-    next_assert( entry );
-    NEXT_INITIALIZE_SENTINEL( entry, 0 )
-    NEXT_INITIALIZE_SENTINEL( entry, 1 )
-    NEXT_INITIALIZE_SENTINEL( entry, 2 )
+    const int head = wheel->heads[bucket];
+    wheel->buckets[timer] = bucket;
+    wheel->prev[timer] = -1;
+    wheel->next[timer] = head;
+    if ( head >= 0 )
+    {
+        wheel->prev[head] = timer;
+    }
+    wheel->heads[bucket] = timer;
+    if ( bucket < NEXT_TIMER_WHEEL_BUCKETS )
+    {
+        wheel->level_timers[bucket / NEXT_TIMER_WHEEL_SLOTS]++;
+    }
 }
 
-void next_proxy_session_entry_verify_sentinels( next_proxy_session_entry_t * entry )
+static void next_timer_wheel_unlink( next_timer_wheel_t * wheel, int timer )
 {
-    (void) entry;
-    next_assert( entry );
-    NEXT_VERIFY_SENTINEL( entry, 0 )
-    NEXT_VERIFY_SENTINEL( entry, 1 )
-    NEXT_VERIFY_SENTINEL( entry, 2 )
+    const int bucket = wheel->buckets[timer];
+    next_assert( bucket >= 0 );
+    const int next = wheel->next[timer];
+    const int prev = wheel->prev[timer];
+    if ( prev >= 0 )
+    {
+        wheel->next[prev] = next;
+    }
+    else
+    {
+        wheel->heads[bucket] = next;
+    }
+    if ( next >= 0 )
+    {
+        wheel->prev[next] = prev;
+    }
+    wheel->buckets[timer] = -1;
+    wheel->next[timer] = -1;
+    wheel->prev[timer] = -1;
+    if ( bucket < NEXT_TIMER_WHEEL_BUCKETS )
+    {
+        wheel->level_timers[bucket / NEXT_TIMER_WHEEL_SLOTS]--;
+    }
 }
 
-struct next_proxy_session_manager_t
+static void next_timer_wheel_place( next_timer_wheel_t * wheel, int timer )
 {
-    NEXT_DECLARE_SENTINEL(0)
+    // current_tick is the next tick to run, so a timer due at or before it goes straight to the expired list
 
-    void * context;
-    int size;
-    int max_entry_index;
-    next_address_t * addresses;
-    next_proxy_session_entry_t * entries;
+    const uint64_t expire_tick = wheel->expire_ticks[timer];
 
-    NEXT_DECLARE_SENTINEL(1)
-};
+    if ( expire_tick < wheel->current_tick )
+    {
+        next_timer_wheel_link( wheel, timer, NEXT_TIMER_WHEEL_EXPIRED );
+        return;
+    }
 
-void next_proxy_session_manager_initialize_sentinels( next_proxy_session_manager_t * session_manager )
-{
-    (void) session_manager;
-    next_assert( session_manager );
-    NEXT_INITIALIZE_SENTINEL( session_manager, 0 )
-    NEXT_INITIALIZE_SENTINEL( session_manager, 1 )
-}
+    uint64_t delta = expire_tick - wheel->current_tick;
+    uint64_t tick = expire_tick;
 
-void next_proxy_session_manager_verify_sentinels( next_proxy_session_manager_t * session_manager )
-{
-    (void) session_manager;
-#if NEXT_ENABLE_MEMORY_CHECKS
-    next_assert( session_manager );
-    NEXT_VERIFY_SENTINEL( session_manager, 0 )
-    NEXT_VERIFY_SENTINEL( session_manager, 1 )
-    const int size = session_manager->size;
-    for ( int i = 0; i < size; ++i )
+    const uint64_t max_delta = ( uint64_t(1) << ( NEXT_TIMER_WHEEL_BITS * NEXT_TIMER_WHEEL_LEVELS ) ) - 1;
+    if ( delta > max_delta )
     {
-        if ( session_manager->addresses[i].type != 0 )
-        {
-            next_proxy_session_entry_verify_sentinels( &session_manager->entries[i] );
-        }
+        delta = max_delta;
+        tick = wheel->current_tick + max_delta;
     }
-#endif // #if NEXT_ENABLE_MEMORY_CHECKS
-}
 
-void next_proxy_session_manager_destroy( next_proxy_session_manager_t * session_manager );
+    int level = 0;
+    while ( level < NEXT_TIMER_WHEEL_LEVELS - 1 && delta >= ( uint64_t(1) << ( NEXT_TIMER_WHEEL_BITS * ( level + 1 ) ) ) )
+    {
+        level++;
+    }
 
-next_proxy_session_manager_t * next_proxy_session_manager_create( void * context, int initial_size )
+    const int slot = int( ( tick >> ( NEXT_TIMER_WHEEL_BITS * level ) ) & ( NEXT_TIMER_WHEEL_SLOTS - 1 ) );
+
+    next_timer_wheel_link( wheel, timer, level * NEXT_TIMER_WHEEL_SLOTS + slot );
+}
+
+void next_timer_wheel_cancel( next_timer_wheel_t * wheel, int timer )
 {
-    next_proxy_session_manager_t * session_manager = (next_proxy_session_manager_t*) next_malloc( context, sizeof(next_proxy_session_manager_t) );
+    next_assert( wheel );
+    next_assert( timer >= 0 );
 
-    next_assert( session_manager );
+    if ( timer >= wheel->max_timers || wheel->buckets[timer] < 0 )
+        return;
 
-    if ( !session_manager )
-        return NULL;
+    next_timer_wheel_unlink( wheel, timer );
 
-    memset( session_manager, 0, sizeof(next_proxy_session_manager_t) );
+    wheel->num_timers--;
+}
 
-    next_proxy_session_manager_initialize_sentinels( session_manager );
+bool next_timer_wheel_scheduled( const next_timer_wheel_t * wheel, int timer )
+{
+    next_assert( wheel );
+    next_assert( timer >= 0 );
+    return timer < wheel->max_timers && wheel->buckets[timer] >= 0;
+}
 
-    session_manager->context = context;
-    session_manager->size = initial_size;
-    session_manager->addresses = (next_address_t*) next_malloc( context, initial_size * sizeof(next_address_t) );
-    session_manager->entries = (next_proxy_session_entry_t*) next_malloc( context, initial_size * sizeof(next_proxy_session_entry_t) );
+void next_timer_wheel_schedule( next_timer_wheel_t * wheel, int timer, double time )
+{
+    next_assert( wheel );
+    next_assert( timer >= 0 );
+    next_assert( timer < wheel->max_timers );
 
-    next_assert( session_manager->addresses );
-    next_assert( session_manager->entries );
+    next_timer_wheel_cancel( wheel, timer );
 
-    if ( session_manager->addresses == NULL || session_manager->entries == NULL )
-    {
-        next_proxy_session_manager_destroy( session_manager );
-        return NULL;
-    }
+    // round up, so a timer never fires before its deadline
 
-    memset( session_manager->addresses, 0, initial_size * sizeof(next_address_t) );
-    memset( session_manager->entries, 0, initial_size * sizeof(next_proxy_session_entry_t) );
+    const double ticks = ceil( time / wheel->resolution );
 
-    for ( int i = 0; i < initial_size; ++i )
-        next_proxy_session_entry_initialize_sentinels( &session_manager->entries[i] );
+    wheel->expire_ticks[timer] = ( ticks > 0.0 ) ? uint64_t( ticks ) : 0;
 
-    next_proxy_session_manager_verify_sentinels( session_manager );
+    next_timer_wheel_place( wheel, timer );
 
-    return session_manager;
+    wheel->num_timers++;
 }
 
-void next_proxy_session_manager_destroy( next_proxy_session_manager_t * session_manager )
+void next_timer_wheel_schedule_earliest( next_timer_wheel_t * wheel, int timer, double time )
 {
-    next_proxy_session_manager_verify_sentinels( session_manager );
+    // moves the timer earlier, but never later than where it is already scheduled
 
-    next_free( session_manager->context, session_manager->addresses );
-    next_free( session_manager->context, session_manager->entries );
+    next_assert( wheel );
+    next_assert( timer >= 0 );
+    next_assert( timer < wheel->max_timers );
 
-    clear_and_free( session_manager->context, session_manager, sizeof(next_proxy_session_manager_t) );
+    if ( wheel->buckets[timer] >= 0 )
+    {
+        const double ticks = ceil( time / wheel->resolution );
+        const uint64_t expire_tick = ( ticks > 0.0 ) ? uint64_t( ticks ) : 0;
+        if ( wheel->buckets[timer] == NEXT_TIMER_WHEEL_EXPIRED || wheel->expire_ticks[timer] <= expire_tick )
+            return;
+    }
+
+    next_timer_wheel_schedule( wheel, timer, time );
 }
 
-bool next_proxy_session_manager_expand( next_proxy_session_manager_t * session_manager )
+static void next_timer_wheel_cascade( next_timer_wheel_t * wheel, int bucket )
 {
-    next_proxy_session_manager_verify_sentinels( session_manager );
+    int timer = wheel->heads[bucket];
+    while ( timer >= 0 )
+    {
+        const int next = wheel->next[timer];
+        next_timer_wheel_unlink( wheel, timer );
+        next_timer_wheel_place( wheel, timer );
+        timer = next;
+    }
+}
 
-    int new_size = session_manager->size * 2;
-    next_address_t * new_addresses = (next_address_t*) next_malloc( session_manager->context, new_size * sizeof(next_address_t) );
-    next_proxy_session_entry_t * new_entries = (next_proxy_session_entry_t*) next_malloc( session_manager->context, new_size * sizeof(next_proxy_session_entry_t) );
+void next_timer_wheel_advance( next_timer_wheel_t * wheel, double current_time )
+{
+    next_timer_wheel_verify_sentinels( wheel );
 
-    next_assert( session_manager->addresses );
-    next_assert( session_manager->entries );
+    const double ticks = floor( current_time / wheel->resolution );
 
-    if ( session_manager->addresses == NULL || session_manager->entries == NULL )
+    if ( ticks < 0.0 )
+        return;
+
+    const uint64_t target_tick = uint64_t( ticks );
+
+    while ( wheel->current_tick <= target_tick )
     {
-        next_free( session_manager->context, new_addresses );
-        next_free( session_manager->context, new_entries );
-        return false;
-    }
+        // skip the ticks where nothing can happen. while the lowest levels are empty, the next thing to
+        // do is the cascade of the first level that has timers in it
 
-    memset( new_addresses, 0, new_size * sizeof(next_address_t) );
-    memset( new_entries, 0, new_size * sizeof(next_proxy_session_entry_t) );
+        int empty_levels = 0;
+        while ( empty_levels < NEXT_TIMER_WHEEL_LEVELS && wheel->level_timers[empty_levels] == 0 )
+        {
+            empty_levels++;
+        }
 
-    for ( int i = 0; i < new_size; ++i )
-        next_proxy_session_entry_initialize_sentinels( &new_entries[i] );
+        if ( empty_levels == NEXT_TIMER_WHEEL_LEVELS )
+        {
+            wheel->current_tick = target_tick + 1;
+            break;
+        }
 
-    int index = 0;
-    const int current_size = session_manager->size;
-    for ( int i = 0; i < current_size; ++i )
-    {
-        if ( session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
+        if ( empty_levels > 0 )
         {
-            memcpy( &new_addresses[index], &session_manager->addresses[i], sizeof(next_address_t) );
-            memcpy( &new_entries[index], &session_manager->entries[i], sizeof(next_proxy_session_entry_t) );
-            index++;
+            const uint64_t mask = ( uint64_t(1) << ( NEXT_TIMER_WHEEL_BITS * empty_levels ) ) - 1;
+            const uint64_t cascade_tick = ( wheel->current_tick + mask ) & ~mask;
+            if ( cascade_tick > target_tick )
+            {
+                wheel->current_tick = target_tick + 1;
+                break;
+            }
+            wheel->current_tick = cascade_tick;
         }
-    }
 
-    next_free( session_manager->context, session_manager->addresses );
-    next_free( session_manager->context, session_manager->entries );
+        const uint64_t tick = wheel->current_tick;
 
-    session_manager->addresses = new_addresses;
-    session_manager->entries = new_entries;
-    session_manager->size = new_size;
-    session_manager->max_entry_index = index - 1;
+        // when a level wraps, pull the matching bucket down from the level above
 
-    next_proxy_session_manager_verify_sentinels( session_manager );
+        for ( int level = 1; level < NEXT_TIMER_WHEEL_LEVELS; ++level )
+        {
+            if ( ( tick & ( ( uint64_t(1) << ( NEXT_TIMER_WHEEL_BITS * level ) ) - 1 ) ) != 0 )
+                break;
+            const int slot = int( ( tick >> ( NEXT_TIMER_WHEEL_BITS * level ) ) & ( NEXT_TIMER_WHEEL_SLOTS - 1 ) );
+            next_timer_wheel_cascade( wheel, level * NEXT_TIMER_WHEEL_SLOTS + slot );
+        }
 
-    return true;
+        // everything in this level 0 bucket is due now
+
+        const int bucket = int( tick & ( NEXT_TIMER_WHEEL_SLOTS - 1 ) );
+
+        int timer = wheel->heads[bucket];
+        while ( timer >= 0 )
+        {
+            const int next = wheel->next[timer];
+            next_timer_wheel_unlink( wheel, timer );
+            next_timer_wheel_link( wheel, timer, NEXT_TIMER_WHEEL_EXPIRED );
+            timer = next;
+        }
+
+        wheel->current_tick++;
+    }
 }
 
-next_proxy_session_entry_t * next_proxy_session_manager_add( next_proxy_session_manager_t * session_manager, const next_address_t * address, uint64_t session_id )
+int next_timer_wheel_pop( next_timer_wheel_t * wheel )
 {
-    next_proxy_session_manager_verify_sentinels( session_manager );
+    // returns the next expired timer, or -1 when there are none left
 
-    next_assert( session_id != 0 );
-    next_assert( address );
-    next_assert( address->type != NEXT_ADDRESS_NONE );
+    next_assert( wheel );
 
-    // first scan existing entries and see if we can insert there
+    const int timer = wheel->heads[NEXT_TIMER_WHEEL_EXPIRED];
 
-    const int size = session_manager->size;
+    if ( timer < 0 )
+        return -1;
 
-    for ( int i = 0; i < size; ++i )
-    {
-        if ( session_manager->addresses[i].type == NEXT_ADDRESS_NONE )
-        {
-            session_manager->addresses[i] = *address;
-            next_proxy_session_entry_t * entry = &session_manager->entries[i];
-            entry->address = *address;
-            entry->session_id = session_id;
-            next_bandwidth_limiter_reset( &entry->send_bandwidth );
-            if ( i > session_manager->max_entry_index )
-            {
-                session_manager->max_entry_index = i;
-            }
-            return entry;
-        }
-    }
+    next_timer_wheel_unlink( wheel, timer );
 
-    // ok, we need to grow, expand and add at the end (expand compacts existing entries)
+    wheel->num_timers--;
 
-    if ( !next_proxy_session_manager_expand( session_manager ) )
-        return NULL;
+    return timer;
+}
 
-    const int i = ++session_manager->max_entry_index;
-    session_manager->addresses[i] = *address;
-    next_proxy_session_entry_t * entry = &session_manager->entries[i];
-    entry->address = *address;
-    entry->session_id = session_id;
-    next_bandwidth_limiter_reset( &entry->send_bandwidth );
+// ---------------------------------------------------------------
 
-    next_proxy_session_manager_verify_sentinels( session_manager );
+struct next_session_send_route_t
+{
+    bool multipath;
+    bool committed;
+    bool send_over_network_next;
+    int envelope_kbps_up;
+    int envelope_kbps_down;
+    uint8_t open_session_sequence;
+    uint64_t session_id;
+    uint8_t session_version;
+    next_address_t send_address;
+    uint8_t private_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+    double last_upgraded_packet_receive_time;
+};
 
-    return entry;
+struct next_session_send_state_t
+{
+    // Everything next_server_send_packet needs for a session, shared between the internal server thread and the application
+    // thread(s) without taking the session mutex. The internal thread is the only writer of the route, which is published
+    // under a seqlock: the version is odd while a write is in progress, and readers retry until they see the same even
+    // version before and after their copy. Payload sequence and bandwidth flag are updated by senders with atomics.
+    // The state is reference counted: the internal session entry holds one reference and the proxy session entry another.
+
+    void * context;
+    uint32_t ref_count;
+    uint32_t version;
+    next_session_send_route_t route;
+    uint64_t payload_send_sequence;
+    uint32_t server_bandwidth_over_limit;
+};
+
+next_session_send_state_t * next_session_send_state_create( void * context )
+{
+    next_session_send_state_t * state = (next_session_send_state_t*) next_malloc( context, sizeof(next_session_send_state_t) );
+    if ( !state )
+        return NULL;
+    memset( state, 0, sizeof(next_session_send_state_t) );
+    state->context = context;
+    state->ref_count = 1;
+    return state;
 }
 
-void next_proxy_session_manager_remove_at_index( next_proxy_session_manager_t * session_manager, int index )
+void next_session_send_state_retain( next_session_send_state_t * state )
 {
-    next_proxy_session_manager_verify_sentinels( session_manager );
+    next_assert( state );
+    next_atomic_add_32( &state->ref_count, 1 );
+}
 
-    next_assert( index >= 0 );
-    next_assert( index <= session_manager->max_entry_index );
-    const int max_index = session_manager->max_entry_index;
-    session_manager->addresses[index].type = NEXT_ADDRESS_NONE;
-    if ( index == max_index )
+void next_session_send_state_release( next_session_send_state_t * state )
+{
+    next_assert( state );
+    if ( next_atomic_add_32( &state->ref_count, -1 ) == 0 )
     {
-        while ( index > 0 && session_manager->addresses[index].type == NEXT_ADDRESS_NONE )
-        {
-            index--;
-        }
-        session_manager->max_entry_index = index;
+        clear_and_free( state->context, state, sizeof(next_session_send_state_t) );
     }
-
-    next_proxy_session_manager_verify_sentinels( session_manager );
 }
 
-void next_proxy_session_manager_remove_by_address( next_proxy_session_manager_t * session_manager, const next_address_t * address )
+void next_session_send_state_begin_write( next_session_send_state_t * state )
 {
-    next_proxy_session_manager_verify_sentinels( session_manager );
+    next_assert( ( state->version & 1 ) == 0 );
+    next_atomic_store_32( &state->version, state->version + 1 );
+    next_atomic_fence();
+}
 
-    next_assert( address );
+void next_session_send_state_end_write( next_session_send_state_t * state )
+{
+    next_assert( ( state->version & 1 ) == 1 );
+    next_atomic_store_32( &state->version, state->version + 1 );
+}
 
-    const int max_index = session_manager->max_entry_index;
-    for ( int i = 0; i <= max_index; ++i )
+void next_session_send_state_read( next_session_send_state_t * state, next_session_send_route_t * route )
+{
+    next_assert( state );
+    next_assert( route );
+    while ( true )
     {
-        if ( next_address_equal( address, &session_manager->addresses[i] ) == 1 )
-        {
-            next_proxy_session_manager_remove_at_index( session_manager, i );
-            next_proxy_session_manager_verify_sentinels( session_manager );
+        const uint32_t version = next_atomic_load_32( &state->version );
+        if ( version & 1 )
+            continue;
+        memcpy( route, &state->route, sizeof(next_session_send_route_t) );
+        next_atomic_fence();
+        if ( next_atomic_load_32( &state->version ) == version )
             return;
-        }
     }
 }
 
-next_proxy_session_entry_t * next_proxy_session_manager_find( next_proxy_session_manager_t * session_manager, const next_address_t * address )
+// ---------------------------------------------------------------
+
+struct next_pending_session_entry_t
 {
-    next_proxy_session_manager_verify_sentinels( session_manager );
+    NEXT_DECLARE_SENTINEL(0)
 
-    next_assert( address );
+    next_address_t address;
+    uint64_t session_id;
+    uint64_t user_hash;
+    uint64_t tags[NEXT_MAX_TAGS];
+    int num_tags;
+    double upgrade_time;
+    double last_packet_send_time;
+    uint8_t private_key[NEXT_CRYPTO_SECRETBOX_KEYBYTES];
+    uint8_t upgrade_token[NEXT_UPGRADE_TOKEN_BYTES];
 
-    const int max_index = session_manager->max_entry_index;
-    for ( int i = 0; i <= max_index; ++i )
-    {
-        if ( next_address_equal( address, &session_manager->addresses[i] ) == 1 )
-        {
-            return &session_manager->entries[i];
-        }
-    }
+    NEXT_DECLARE_SENTINEL(1)
+};
 
-    return NULL;
+void next_pending_session_entry_initialize_sentinels( next_pending_session_entry_t * entry )
+{
+    (void) entry;
+    next_assert( entry );
+    NEXT_INITIALIZE_SENTINEL( entry, 0 )
+    NEXT_INITIALIZE_SENTINEL( entry, 1 )
 }
 
-int next_proxy_session_manager_num_entries( next_proxy_session_manager_t * session_manager )
+void next_pending_session_entry_verify_sentinels( next_pending_session_entry_t * entry )
 {
-    next_proxy_session_manager_verify_sentinels( session_manager );
+    (void) entry;
+    next_assert( entry );
+    NEXT_VERIFY_SENTINEL( entry, 0 )
+    NEXT_VERIFY_SENTINEL( entry, 1 )
+}
 
-    int num_entries = 0;
+struct next_pending_session_manager_t
+{
+    NEXT_DECLARE_SENTINEL(0)
 
-    const int max_index = session_manager->max_entry_index;
-    for ( int i = 0; i <= max_index; ++i )
+    void * context;
+    int size;
+    int max_entry_index;
+    next_address_t * addresses;
+    next_pending_session_entry_t * entries;
+    next_hash_index_t address_index;
+
+    NEXT_DECLARE_SENTINEL(1)
+};
+
+void next_pending_session_manager_initialize_sentinels( next_pending_session_manager_t * session_manager )
+{
+    (void) session_manager;
+    next_assert( session_manager );
+    NEXT_INITIALIZE_SENTINEL( session_manager, 0 )
+    NEXT_INITIALIZE_SENTINEL( session_manager, 1 )
+}
+
+void next_pending_session_manager_verify_sentinels( next_pending_session_manager_t * session_manager )
+{
+    (void) session_manager;
+#if NEXT_ENABLE_MEMORY_CHECKS
+    next_assert( session_manager );
+    NEXT_VERIFY_SENTINEL( session_manager, 0 )
+    NEXT_VERIFY_SENTINEL( session_manager, 1 )
+    const int size = session_manager->size;
+    for ( int i = 0; i < size; ++i )
     {
         if ( session_manager->addresses[i].type != 0 )
         {
-            num_entries++;
+            next_pending_session_entry_verify_sentinels( &session_manager->entries[i] );
         }
     }
-
-    return num_entries;
+#endif // #if NEXT_ENABLE_MEMORY_CHECKS
 }
 
-// ---------------------------------------------------------------
+void next_pending_session_manager_destroy( next_pending_session_manager_t * pending_session_manager );
 
-struct NextBackendServerInitRequestPacket
+next_pending_session_manager_t * next_pending_session_manager_create( void * context, int initial_size )
 {
-    int version_major;
-    int version_minor;
-    int version_patch;
-    uint64_t request_id;
-    uint64_t customer_id;
-    uint64_t datacenter_id;
-    char datacenter_name[NEXT_MAX_DATACENTER_NAME_LENGTH];
+    next_pending_session_manager_t * pending_session_manager = (next_pending_session_manager_t*) next_malloc( context, sizeof(next_pending_session_manager_t) );
 
-    NextBackendServerInitRequestPacket()
-    {
-        version_major = NEXT_VERSION_MAJOR_INT;
-        version_minor = NEXT_VERSION_MINOR_INT;
-        version_patch = NEXT_VERSION_PATCH_INT;
-        request_id = 0;
-        customer_id = 0;
-        datacenter_id = 0;
-        datacenter_name[0] = '\0';
-    }
+    next_assert( pending_session_manager );
+    if ( !pending_session_manager )
+        return NULL;
 
-    template <typename Stream> bool Serialize( Stream & stream )
+    memset( pending_session_manager, 0, sizeof(next_pending_session_manager_t) );
+
+    next_pending_session_manager_initialize_sentinels( pending_session_manager );
+
+    pending_session_manager->context = context;
+    pending_session_manager->size = initial_size;
+    pending_session_manager->addresses = (next_address_t*) next_malloc( context, initial_size * sizeof(next_address_t) );
+    pending_session_manager->entries = (next_pending_session_entry_t*) next_malloc( context, initial_size * sizeof(next_pending_session_entry_t) );
+
+    next_assert( pending_session_manager->addresses );
+    next_assert( pending_session_manager->entries );
+
+    if ( pending_session_manager->addresses == NULL || pending_session_manager->entries == NULL )
     {
-        serialize_bits( stream, version_major, 8 );
-        serialize_bits( stream, version_minor, 8 );
-        serialize_bits( stream, version_patch, 8 );
-        serialize_uint64( stream, request_id );
-        serialize_uint64( stream, customer_id );
-        serialize_uint64( stream, datacenter_id );
-        serialize_string( stream, datacenter_name, NEXT_MAX_DATACENTER_NAME_LENGTH );
-        return true;
+        next_pending_session_manager_destroy( pending_session_manager );
+        return NULL;
     }
-};
 
-// ---------------------------------------------------------------
-
-struct NextBackendServerInitResponsePacket
-{
-    uint64_t request_id;
-    uint32_t response;
-    uint8_t upcoming_magic[8];
-    uint8_t current_magic[8];
-    uint8_t previous_magic[8];
-
-    NextBackendServerInitResponsePacket()
-    {
-        memset( this, 0, sizeof(NextBackendServerInitResponsePacket) );
-    }
+    memset( pending_session_manager->addresses, 0, initial_size * sizeof(next_address_t) );
+    memset( pending_session_manager->entries, 0, initial_size * sizeof(next_pending_session_entry_t) );
 
-    template <typename Stream> bool Serialize( Stream & stream )
+    if ( !next_hash_index_create( context, &pending_session_manager->address_index, initial_size ) )
     {
-        serialize_uint64( stream, request_id );
-        serialize_bits( stream, response, 8 );
-        serialize_bytes( stream, upcoming_magic, 8 );
-        serialize_bytes( stream, current_magic, 8 );
-        serialize_bytes( stream, previous_magic, 8 );
-        return true;
+        next_pending_session_manager_destroy( pending_session_manager );
+        return NULL;
     }
-};
-
-// ---------------------------------------------------------------
-
-struct NextBackendServerUpdateRequestPacket
-{
-    int version_major;
-    int version_minor;
-    int version_patch;
-    uint64_t request_id;
-    uint64_t customer_id;
-    uint64_t datacenter_id;
-    uint32_t num_sessions;
-    next_address_t server_address;
 
-    NextBackendServerUpdateRequestPacket()
-    {
-        version_major = NEXT_VERSION_MAJOR_INT;
-        version_minor = NEXT_VERSION_MINOR_INT;
-        version_patch = NEXT_VERSION_PATCH_INT;
-        request_id = 0;
-        customer_id = 0;
-        datacenter_id = 0;
-        num_sessions = 0;
-        memset( &server_address, 0, sizeof(next_address_t) );
-    }
+    for ( int i = 0; i < initial_size; i++ )
+        next_pending_session_entry_initialize_sentinels( &pending_session_manager->entries[i] );
 
-    template <typename Stream> bool Serialize( Stream & stream )
-    {
-        serialize_bits( stream, version_major, 8 );
-        serialize_bits( stream, version_minor, 8 );
-        serialize_bits( stream, version_patch, 8 );
-        serialize_uint64( stream, request_id );
-        serialize_uint64( stream, customer_id );
-        serialize_uint64( stream, datacenter_id );
-        serialize_uint32( stream, num_sessions );
-        serialize_address( stream, server_address );
-        return true;
-    }
-};
+    next_pending_session_manager_verify_sentinels( pending_session_manager );
 
-// ---------------------------------------------------------------
+    return pending_session_manager;
+}
 
-struct NextBackendServerUpdateResponsePacket
+void next_pending_session_manager_destroy( next_pending_session_manager_t * pending_session_manager )
 {
-    uint64_t request_id;
-    uint8_t upcoming_magic[8];
-    uint8_t current_magic[8];
-    uint8_t previous_magic[8];
+    next_pending_session_manager_verify_sentinels( pending_session_manager );
 
-    NextBackendServerUpdateResponsePacket()
-    {
-        memset( this, 0, sizeof(NextBackendServerUpdateResponsePacket) );
-    }
+    next_free( pending_session_manager->context, pending_session_manager->addresses );
+    next_free( pending_session_manager->context, pending_session_manager->entries );
 
-    template <typename Stream> bool Serialize( Stream & stream )
-    {
-        serialize_uint64( stream, request_id );
-        serialize_bytes( stream, upcoming_magic, 8 );
-        serialize_bytes( stream, current_magic, 8 );
-        serialize_bytes( stream, previous_magic, 8 );
-        return true;
-    }
-};
+    next_hash_index_destroy( &pending_session_manager->address_index );
 
-// ---------------------------------------------------------------
+    clear_and_free( pending_session_manager->context, pending_session_manager, sizeof(next_pending_session_manager_t) );
+}
 
-struct NextBackendSessionUpdateRequestPacket
+bool next_pending_session_manager_expand( next_pending_session_manager_t * pending_session_manager )
 {
-    int version_major;
-    int version_minor;
-    int version_patch;
-    uint64_t customer_id;
-    uint64_t datacenter_id;
-    uint64_t session_id;
-    uint32_t slice_number;
-    uint32_t retry_number;
-    int session_data_bytes;
-    uint8_t session_data[NEXT_MAX_SESSION_DATA_BYTES];
-    next_address_t client_address;
-    next_address_t server_address;
-    uint8_t client_route_public_key[NEXT_CRYPTO_BOX_PUBLICKEYBYTES];
-    uint8_t server_route_public_key[NEXT_CRYPTO_BOX_PUBLICKEYBYTES];
-    uint64_t user_hash;
-    int platform_id;
-    int connection_type;
-    bool next;
-    bool committed;
-    bool reported;
-    bool fallback_to_direct;
-    bool client_bandwidth_over_limit;
-    bool server_bandwidth_over_limit;
-    bool client_ping_timed_out;
-    bool has_near_relay_pings;
-    int num_tags;
-    uint64_t tags[NEXT_MAX_TAGS];
-    uint64_t server_events;
-    float direct_min_rtt;
-    float direct_max_rtt;
-    float direct_prime_rtt;
-    float direct_jitter;
-    float direct_packet_loss;
-    float next_rtt;
-    float next_jitter;
-    float next_packet_loss;
-    int num_near_relays;
-    uint64_t near_relay_ids[NEXT_MAX_NEAR_RELAYS];
-    uint8_t near_relay_rtt[NEXT_MAX_NEAR_RELAYS];
-    uint8_t near_relay_jitter[NEXT_MAX_NEAR_RELAYS];
-    uint8_t near_relay_packet_loss[NEXT_MAX_NEAR_RELAYS];
-    uint32_t next_kbps_up;
-    uint32_t next_kbps_down;
-    uint64_t packets_sent_client_to_server;
-    uint64_t packets_sent_server_to_client;
-    uint64_t packets_lost_client_to_server;
-    uint64_t packets_lost_server_to_client;
-    uint64_t packets_out_of_order_client_to_server;
-    uint64_t packets_out_of_order_server_to_client;
-    float jitter_client_to_server;
-    float jitter_server_to_client;
+    next_pending_session_manager_verify_sentinels( pending_session_manager );
 
-    void Reset()
-    {
-        memset( this, 0, sizeof(NextBackendSessionUpdateRequestPacket) );
-        version_major = NEXT_VERSION_MAJOR_INT;
-        version_minor = NEXT_VERSION_MINOR_INT;
-        version_patch = NEXT_VERSION_PATCH_INT;
-    }
+    int new_size = pending_session_manager->size * 2;
 
-    template <typename Stream> bool Serialize( Stream & stream )
-    {
-        serialize_bits( stream, version_major, 8 );
-        serialize_bits( stream, version_minor, 8 );
-        serialize_bits( stream, version_patch, 8 );
+    next_address_t * new_addresses = (next_address_t*) next_malloc( pending_session_manager->context, new_size * sizeof(next_address_t) );
 
-        serialize_uint64( stream, customer_id );
+    next_pending_session_entry_t * new_entries = (next_pending_session_entry_t*) next_malloc( pending_session_manager->context, new_size * sizeof(next_pending_session_entry_t) );
 
-        serialize_uint64( stream, datacenter_id );
+    next_hash_index_t new_address_index;
+    memset( &new_address_index, 0, sizeof(next_hash_index_t) );
 
-        serialize_uint64( stream, session_id );
+    next_assert( new_addresses );
+    next_assert( new_entries );
 
-        serialize_uint32( stream, slice_number );
+    if ( new_addresses == NULL || new_entries == NULL || !next_hash_index_create( pending_session_manager->context, &new_address_index, new_size ) )
+    {
+        next_free( pending_session_manager->context, new_addresses );
+        next_free( pending_session_manager->context, new_entries );
+        next_hash_index_destroy( &new_address_index );
+        return false;
+    }
 
-        serialize_int( stream, retry_number, 0, NEXT_MAX_SESSION_UPDATE_RETRIES );
+    memset( new_addresses, 0, new_size * sizeof(next_address_t) );
+    memset( new_entries, 0, new_size * sizeof(next_pending_session_entry_t) );
 
-        serialize_int( stream, session_data_bytes, 0, NEXT_MAX_SESSION_DATA_BYTES );
-        if ( session_data_bytes > 0 )
-        {
-            serialize_bytes( stream, session_data, session_data_bytes );
-        }
+    for ( int i = 0; i < new_size; ++i )
+        next_pending_session_entry_initialize_sentinels( &new_entries[i] );
 
-        // IMPORTANT: Anonymize the client address before sending it up to our backend
-        // This ensures that we are fully compliant with the GDPR and there is zero risk
-        // the address will be accidentally stored or intecepted in transit
-        if ( Stream::IsWriting )
+    int index = 0;
+    const int current_size = pending_session_manager->size;
+    for ( int i = 0; i < current_size; ++i )
+    {
+        if ( pending_session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
         {
-            next_address_anonymize( &client_address );
+            memcpy( &new_addresses[index], &pending_session_manager->addresses[i], sizeof(next_address_t) );
+            memcpy( &new_entries[index], &pending_session_manager->entries[i], sizeof(next_pending_session_entry_t) );
+            next_hash_index_insert( &new_address_index, next_address_hash( &new_addresses[index] ), index );
+            index++;
         }
+    }
 
-        serialize_address( stream, client_address );
+    next_free( pending_session_manager->context, pending_session_manager->addresses );
+    next_free( pending_session_manager->context, pending_session_manager->entries );
 
-        serialize_address( stream, server_address );
+    next_hash_index_destroy( &pending_session_manager->address_index );
 
-        serialize_bytes( stream, client_route_public_key, NEXT_CRYPTO_BOX_PUBLICKEYBYTES );
-        serialize_bytes( stream, server_route_public_key, NEXT_CRYPTO_BOX_PUBLICKEYBYTES );
+    pending_session_manager->addresses = new_addresses;
+    pending_session_manager->entries = new_entries;
+    pending_session_manager->address_index = new_address_index;
+    pending_session_manager->size = new_size;
+    pending_session_manager->max_entry_index = index - 1;
 
-        serialize_uint64( stream, user_hash );
+    next_pending_session_manager_verify_sentinels( pending_session_manager );
 
-        serialize_int( stream, platform_id, NEXT_PLATFORM_UNKNOWN, NEXT_PLATFORM_MAX );
+    return true;
+}
 
-        serialize_int( stream, connection_type, NEXT_CONNECTION_TYPE_UNKNOWN, NEXT_CONNECTION_TYPE_MAX );
+next_pending_session_entry_t * next_pending_session_manager_add( next_pending_session_manager_t * pending_session_manager, const next_address_t * address, uint64_t session_id, const uint8_t * private_key, const uint8_t * upgrade_token, double current_time )
+{
+    next_pending_session_manager_verify_sentinels( pending_session_manager );
 
-        serialize_bool( stream, next );
-        serialize_bool( stream, committed );
-        serialize_bool( stream, reported );
-        serialize_bool( stream, fallback_to_direct );
-        serialize_bool( stream, client_bandwidth_over_limit );
-        serialize_bool( stream, server_bandwidth_over_limit );
-        serialize_bool( stream, client_ping_timed_out );
-        serialize_bool( stream, has_near_relay_pings );
+    next_assert( session_id != 0 );
+    next_assert( address );
+    next_assert( address->type != NEXT_ADDRESS_NONE );
 
-        bool has_tags = Stream::IsWriting && slice_number == 0 && num_tags > 0;
-        bool has_server_events = Stream::IsWriting && server_events != 0;
-        bool has_lost_packets = Stream::IsWriting && ( packets_lost_client_to_server + packets_lost_server_to_client ) > 0;
-        bool has_out_of_order_packets = Stream::IsWriting && ( packets_out_of_order_client_to_server + packets_out_of_order_server_to_client ) > 0;
+    // first scan existing entries and see if we can insert there
 
-        serialize_bool( stream, has_tags );
-        serialize_bool( stream, has_server_events );
-        serialize_bool( stream, has_lost_packets );
-        serialize_bool( stream, has_out_of_order_packets );
+    const int size = pending_session_manager->size;
 
-        if ( has_tags )
+    for ( int i = 0; i < size; ++i )
+    {
+        if ( pending_session_manager->addresses[i].type == NEXT_ADDRESS_NONE )
         {
-            serialize_int( stream, num_tags, 0, NEXT_MAX_TAGS );
-            for ( int i = 0; i < num_tags; ++i )
+            pending_session_manager->addresses[i] = *address;
+            next_hash_index_insert( &pending_session_manager->address_index, next_address_hash( address ), i );
+            next_pending_session_entry_t * entry = &pending_session_manager->entries[i];
+            entry->address = *address;
+            entry->session_id = session_id;
+            entry->upgrade_time = current_time;
+            entry->last_packet_send_time = -1000.0;
+            memcpy( entry->private_key, private_key, NEXT_CRYPTO_SECRETBOX_KEYBYTES );
+            memcpy( entry->upgrade_token, upgrade_token, NEXT_UPGRADE_TOKEN_BYTES );
+            if ( i > pending_session_manager->max_entry_index )
             {
-                serialize_uint64( stream, tags[i] );
+                pending_session_manager->max_entry_index = i;
             }
+            return entry;
         }
+    }
 
-        if ( has_server_events )
-        {
-            serialize_uint64( stream, server_events );
-        }
+    // ok, we need to grow, expand and add at the end (expand compacts existing entries)
 
-        serialize_float( stream, direct_min_rtt );
-        serialize_float( stream, direct_max_rtt );
-        serialize_float( stream, direct_prime_rtt );
-        serialize_float( stream, direct_jitter );
-        serialize_float( stream, direct_packet_loss );
+    if ( !next_pending_session_manager_expand( pending_session_manager ) )
+        return NULL;
 
-        if ( next )
-        {
-            serialize_float( stream, next_rtt );
-            serialize_float( stream, next_jitter );
-            serialize_float( stream, next_packet_loss );
-        }
+    const int i = ++pending_session_manager->max_entry_index;
+    pending_session_manager->addresses[i] = *address;
+    next_hash_index_insert( &pending_session_manager->address_index, next_address_hash( address ), i );
+    next_pending_session_entry_t * entry = &pending_session_manager->entries[i];
+    entry->address = *address;
+    entry->session_id = session_id;
+    entry->upgrade_time = current_time;
+    entry->last_packet_send_time = -1000.0;
+    memcpy( entry->private_key, private_key, NEXT_CRYPTO_SECRETBOX_KEYBYTES );
+    memcpy( entry->upgrade_token, upgrade_token, NEXT_UPGRADE_TOKEN_BYTES );
 
-        serialize_int( stream, num_near_relays, 0, NEXT_MAX_NEAR_RELAYS );
+    next_pending_session_manager_verify_sentinels( pending_session_manager );
 
-        for ( int i = 0; i < num_near_relays; ++i )
-        {
-            serialize_uint64( stream, near_relay_ids[i] );
-            if ( has_near_relay_pings )
-            {
-                serialize_int( stream, near_relay_rtt[i], 0, 255 );
-                serialize_int( stream, near_relay_jitter[i], 0, 255 );
-                serialize_int( stream, near_relay_packet_loss[i], 0, 100 );
-            }
-        }
+    return entry;
+}
 
-        if ( next )
-        {
-            serialize_uint32( stream, next_kbps_up );
-            serialize_uint32( stream, next_kbps_down );
-        }
+void next_pending_session_manager_remove_at_index( next_pending_session_manager_t * pending_session_manager, int index )
+{
+    next_pending_session_manager_verify_sentinels( pending_session_manager );
 
-        serialize_uint64( stream, packets_sent_client_to_server );
-        serialize_uint64( stream, packets_sent_server_to_client );
+    next_assert( index >= 0 );
+    next_assert( index <= pending_session_manager->max_entry_index );
 
-        if ( has_lost_packets )
+    const int max_index = pending_session_manager->max_entry_index;
+
+    if ( pending_session_manager->addresses[index].type != NEXT_ADDRESS_NONE )
+    {
+        next_hash_index_remove( &pending_session_manager->address_index, next_address_hash( &pending_session_manager->addresses[index] ), index );
+    }
+
+    pending_session_manager->addresses[index].type = NEXT_ADDRESS_NONE;
+
+    if ( index == max_index )
+    {
+        while ( index > 0 && pending_session_manager->addresses[index].type == NEXT_ADDRESS_NONE )
         {
-            serialize_uint64( stream, packets_lost_client_to_server );
-            serialize_uint64( stream, packets_lost_server_to_client );
+            index--;
         }
+        pending_session_manager->max_entry_index = index;
+    }
+}
 
-        if ( has_out_of_order_packets )
+int next_pending_session_manager_find_index( next_pending_session_manager_t * pending_session_manager, const next_address_t * address )
+{
+    const uint32_t hash = next_address_hash( address );
+    int probe = -1;
+    int index;
+    while ( ( index = next_hash_index_probe( &pending_session_manager->address_index, hash, &probe ) ) != -1 )
+    {
+        if ( next_address_equal( address, &pending_session_manager->addresses[index] ) == 1 )
         {
-            serialize_uint64( stream, packets_out_of_order_client_to_server );
-            serialize_uint64( stream, packets_out_of_order_server_to_client );
+            return index;
         }
-
-        serialize_float( stream, jitter_client_to_server );
-        serialize_float( stream, jitter_server_to_client );
-
-        return true;
     }
-};
-
-// ---------------------------------------------------------------
+    return -1;
+}
 
-struct NextBackendMatchDataRequestPacket
+void next_pending_session_manager_remove_by_address( next_pending_session_manager_t * pending_session_manager, const next_address_t * address )
 {
-    int version_major;
-    int version_minor;
-    int version_patch;
-    uint64_t customer_id;
-    next_address_t server_address;
-    uint64_t datacenter_id;
-    uint64_t user_hash;
-    uint64_t session_id;
-    uint32_t retry_number;
-    uint64_t match_id;
-    int num_match_values;
-    double match_values[NEXT_MAX_MATCH_VALUES];
+    next_pending_session_manager_verify_sentinels( pending_session_manager );
 
-    void Reset()
+    next_assert( address );
+
+    const int index = next_pending_session_manager_find_index( pending_session_manager, address );
+    if ( index != -1 )
     {
-        memset( this, 0, sizeof(NextBackendMatchDataRequestPacket) );
-        version_major = NEXT_VERSION_MAJOR_INT;
-        version_minor = NEXT_VERSION_MINOR_INT;
-        version_patch = NEXT_VERSION_PATCH_INT;
+        next_pending_session_manager_remove_at_index( pending_session_manager, index );
     }
+}
 
-    template <typename Stream> bool Serialize( Stream & stream )
-    {
-        serialize_bits( stream, version_major, 8 );
-        serialize_bits( stream, version_minor, 8 );
-        serialize_bits( stream, version_patch, 8 );
-        serialize_uint64( stream, customer_id );
-        serialize_address( stream, server_address );
-        serialize_uint64( stream, datacenter_id );
-        serialize_uint64( stream, user_hash );
-        serialize_uint64( stream, session_id );
-        serialize_uint32( stream, retry_number );
-        serialize_uint64( stream, match_id );
+next_pending_session_entry_t * next_pending_session_manager_find( next_pending_session_manager_t * pending_session_manager, const next_address_t * address )
+{
+    next_pending_session_manager_verify_sentinels( pending_session_manager );
 
-        bool has_match_values = Stream::IsWriting && num_match_values > 0;
+    next_assert( address );
 
-        serialize_bool( stream, has_match_values );
+    const int index = next_pending_session_manager_find_index( pending_session_manager, address );
 
-        if ( has_match_values )
-        {
-            serialize_int( stream, num_match_values, 0, NEXT_MAX_MATCH_VALUES );
-            for ( int i = 0; i < num_match_values; ++i )
-            {
-                serialize_double( stream, match_values[i] );
-            }
-        }
+    return ( index != -1 ) ? &pending_session_manager->entries[index] : NULL;
+}
 
-        return true;
-    }
-};
+int next_pending_session_manager_num_entries( next_pending_session_manager_t * pending_session_manager )
+{
+    next_pending_session_manager_verify_sentinels( pending_session_manager );
 
-// ---------------------------------------------------------------
+    int num_entries = 0;
 
-struct NextBackendMatchDataResponsePacket
-{
-    uint64_t session_id;
-    uint32_t response;
+    const int max_index = pending_session_manager->max_entry_index;
 
-    template <typename Stream> bool Serialize( Stream & stream )
+    for ( int i = 0; i <= max_index; ++i )
     {
-        serialize_uint64( stream, session_id );
-        serialize_bits( stream, response, 8 );
-        return true;
+        if ( pending_session_manager->addresses[i].type != 0 )
+        {
+            num_entries++;
+        }
     }
-};
+
+    return num_entries;
+}
 
 // ---------------------------------------------------------------
 
-struct next_session_entry_t
+struct next_proxy_session_entry_t
 {
     NEXT_DECLARE_SENTINEL(0)
 
     next_address_t address;
     uint64_t session_id;
-    uint8_t most_recent_session_version;
-    uint64_t special_send_sequence;
-    uint64_t internal_send_sequence;
-    uint64_t stats_sequence;
-    uint64_t user_hash;
-    uint64_t tags[NEXT_MAX_TAGS];
-    int num_tags;
-	uint64_t previous_server_events;
-	uint64_t current_server_events;
-    uint8_t client_open_session_sequence;
 
     NEXT_DECLARE_SENTINEL(1)
 
-    bool stats_reported;
-    bool stats_multipath;
-    bool stats_committed;
-    bool stats_fallback_to_direct;
-    bool stats_client_bandwidth_over_limit;
-    bool stats_server_bandwidth_over_limit;
-    bool stats_has_near_relay_pings;
-    int stats_platform_id;
-    int stats_connection_type;
-    float stats_next_kbps_up;
-    float stats_next_kbps_down;
-    float stats_direct_min_rtt;
-    float stats_direct_max_rtt;
-    float stats_direct_prime_rtt;
-    float stats_direct_jitter;
-    float stats_direct_packet_loss;
-    bool stats_next;
-    float stats_next_rtt;
-    float stats_next_jitter;
-    float stats_next_packet_loss;
-    int stats_num_near_relays;
+    next_bandwidth_limiter_t send_bandwidth;
+
+    next_session_send_state_t * send_state;
 
     NEXT_DECLARE_SENTINEL(2)
+};
 
-    uint64_t stats_near_relay_ids[NEXT_MAX_NEAR_RELAYS];
+void next_proxy_session_entry_initialize_sentinels( next_proxy_session_entry_t * entry )
+{
+    (void) entry;
+    next_assert( entry );
+    NEXT_INITIALIZE_SENTINEL( entry, 0 )
+    NEXT_INITIALIZE_SENTINEL( entry, 1 )
+    NEXT_INITIALIZE_SENTINEL( entry, 2 )
+}
 
-    NEXT_DECLARE_SENTINEL(3)
+void next_proxy_session_entry_verify_sentinels( next_proxy_session_entry_t * entry )
+{
+    (void) entry;
+    next_assert( entry );
+    NEXT_VERIFY_SENTINEL( entry, 0 )
+    NEXT_VERIFY_SENTINEL( entry, 1 )
+    NEXT_VERIFY_SENTINEL( entry, 2 )
+}
 
-    uint8_t stats_near_relay_rtt[NEXT_MAX_NEAR_RELAYS];
+struct next_proxy_session_manager_t
+{
+    NEXT_DECLARE_SENTINEL(0)
 
-    NEXT_DECLARE_SENTINEL(4)
+    void * context;
+    int size;
+    int max_entry_index;
+    next_address_t * addresses;
+    next_proxy_session_entry_t * entries;
+    next_hash_index_t address_index;
 
-    uint8_t stats_near_relay_jitter[NEXT_MAX_NEAR_RELAYS];
+    NEXT_DECLARE_SENTINEL(1)
+};
 
-    NEXT_DECLARE_SENTINEL(5)
+void next_proxy_session_manager_initialize_sentinels( next_proxy_session_manager_t * session_manager )
+{
+    (void) session_manager;
+    next_assert( session_manager );
+    NEXT_INITIALIZE_SENTINEL( session_manager, 0 )
+    NEXT_INITIALIZE_SENTINEL( session_manager, 1 )
+}
 
-    uint8_t stats_near_relay_packet_loss[NEXT_MAX_NEAR_RELAYS];
+void next_proxy_session_manager_verify_sentinels( next_proxy_session_manager_t * session_manager )
+{
+    (void) session_manager;
+#if NEXT_ENABLE_MEMORY_CHECKS
+    next_assert( session_manager );
+    NEXT_VERIFY_SENTINEL( session_manager, 0 )
+    NEXT_VERIFY_SENTINEL( session_manager, 1 )
+    const int size = session_manager->size;
+    for ( int i = 0; i < size; ++i )
+    {
+        if ( session_manager->addresses[i].type != 0 )
+        {
+            next_proxy_session_entry_verify_sentinels( &session_manager->entries[i] );
+        }
+    }
+#endif // #if NEXT_ENABLE_MEMORY_CHECKS
+}
 
-    NEXT_DECLARE_SENTINEL(6)
+void next_proxy_session_manager_destroy( next_proxy_session_manager_t * session_manager );
 
-    uint64_t stats_packets_sent_client_to_server;
-    uint64_t stats_packets_sent_server_to_client;
-    uint64_t stats_packets_lost_client_to_server;
-    uint64_t stats_packets_lost_server_to_client;
-    uint64_t stats_packets_out_of_order_client_to_server;
-    uint64_t stats_packets_out_of_order_server_to_client;
+next_proxy_session_manager_t * next_proxy_session_manager_create( void * context, int initial_size )
+{
+    next_proxy_session_manager_t * session_manager = (next_proxy_session_manager_t*) next_malloc( context, sizeof(next_proxy_session_manager_t) );
 
-    float stats_jitter_client_to_server;
-    float stats_jitter_server_to_client;
+    next_assert( session_manager );
 
-    double next_tracker_update_time;
-    double next_session_update_time;
-    double next_session_resend_time;
-    double last_client_stats_update;
-    double last_upgraded_packet_receive_time;
+    if ( !session_manager )
+        return NULL;
 
-    uint64_t update_sequence;
-    bool update_dirty;
-    bool waiting_for_update_response;
-    bool multipath;
-    bool committed;
-    double update_last_send_time;
-    uint8_t update_type;
-    int update_num_tokens;
+    memset( session_manager, 0, sizeof(next_proxy_session_manager_t) );
 
-    NEXT_DECLARE_SENTINEL(7)
+    next_proxy_session_manager_initialize_sentinels( session_manager );
 
-    uint8_t update_tokens[NEXT_MAX_TOKENS*NEXT_ENCRYPTED_ROUTE_TOKEN_BYTES];
+    session_manager->context = context;
+    session_manager->size = initial_size;
+    session_manager->addresses = (next_address_t*) next_malloc( context, initial_size * sizeof(next_address_t) );
+    session_manager->entries = (next_proxy_session_entry_t*) next_malloc( context, initial_size * sizeof(next_proxy_session_entry_t) );
 
-    NEXT_DECLARE_SENTINEL(8)
+    next_assert( session_manager->addresses );
+    next_assert( session_manager->entries );
 
-    bool update_dont_ping_near_relays;
-    bool update_near_relays_changed;
-    int update_num_near_relays;
+    if ( session_manager->addresses == NULL || session_manager->entries == NULL )
+    {
+        next_proxy_session_manager_destroy( session_manager );
+        return NULL;
+    }
 
-    NEXT_DECLARE_SENTINEL(9)
+    memset( session_manager->addresses, 0, initial_size * sizeof(next_address_t) );
+    memset( session_manager->entries, 0, initial_size * sizeof(next_proxy_session_entry_t) );
 
-    uint64_t update_near_relay_ids[NEXT_MAX_NEAR_RELAYS];
+    if ( !next_hash_index_create( context, &session_manager->address_index, initial_size ) )
+    {
+        next_proxy_session_manager_destroy( session_manager );
+        return NULL;
+    }
 
-    NEXT_DECLARE_SENTINEL(10)
+    for ( int i = 0; i < initial_size; ++i )
+        next_proxy_session_entry_initialize_sentinels( &session_manager->entries[i] );
 
-    next_address_t update_near_relay_addresses[NEXT_MAX_NEAR_RELAYS];
+    next_proxy_session_manager_verify_sentinels( session_manager );
 
-    NEXT_DECLARE_SENTINEL(11)
+    return session_manager;
+}
 
-    NextBackendSessionUpdateRequestPacket session_update_request_packet;
+void next_proxy_session_manager_destroy( next_proxy_session_manager_t * session_manager )
+{
+    next_proxy_session_manager_verify_sentinels( session_manager );
 
-    NEXT_DECLARE_SENTINEL(12)
+    if ( session_manager->addresses && session_manager->entries )
+    {
+        for ( int i = 0; i <= session_manager->max_entry_index; ++i )
+        {
+            if ( session_manager->addresses[i].type != NEXT_ADDRESS_NONE && session_manager->entries[i].send_state )
+            {
+                next_session_send_state_release( session_manager->entries[i].send_state );
+            }
+        }
+    }
 
-    bool has_pending_route;
-    bool pending_route_committed;
-    uint8_t pending_route_session_version;
-    uint64_t pending_route_expire_timestamp;
-    double pending_route_expire_time;
-    int pending_route_kbps_up;
-    int pending_route_kbps_down;
-    next_address_t pending_route_send_address;
+    next_free( session_manager->context, session_manager->addresses );
+    next_free( session_manager->context, session_manager->entries );
 
-    NEXT_DECLARE_SENTINEL(13)
+    next_hash_index_destroy( &session_manager->address_index );
 
-    uint8_t pending_route_private_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+    clear_and_free( session_manager->context, session_manager, sizeof(next_proxy_session_manager_t) );
+}
 
-    NEXT_DECLARE_SENTINEL(14)
+bool next_proxy_session_manager_expand( next_proxy_session_manager_t * session_manager )
+{
+    next_proxy_session_manager_verify_sentinels( session_manager );
 
-    bool has_current_route;
-    bool current_route_committed;
-    uint8_t current_route_session_version;
-    uint64_t current_route_expire_timestamp;
-    double current_route_expire_time;
-    int current_route_kbps_up;
-    int current_route_kbps_down;
-    next_address_t current_route_send_address;
+    int new_size = session_manager->size * 2;
+    next_address_t * new_addresses = (next_address_t*) next_malloc( session_manager->context, new_size * sizeof(next_address_t) );
+    next_proxy_session_entry_t * new_entries = (next_proxy_session_entry_t*) next_malloc( session_manager->context, new_size * sizeof(next_proxy_session_entry_t) );
 
-    NEXT_DECLARE_SENTINEL(15)
+    next_hash_index_t new_address_index;
+    memset( &new_address_index, 0, sizeof(next_hash_index_t) );
 
-    uint8_t current_route_private_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+    next_assert( new_addresses );
+    next_assert( new_entries );
 
-    NEXT_DECLARE_SENTINEL(16)
+    if ( new_addresses == NULL || new_entries == NULL || !next_hash_index_create( session_manager->context, &new_address_index, new_size ) )
+    {
+        next_free( session_manager->context, new_addresses );
+        next_free( session_manager->context, new_entries );
+        next_hash_index_destroy( &new_address_index );
+        return false;
+    }
 
-    bool has_previous_route;
-    next_address_t previous_route_send_address;
+    memset( new_addresses, 0, new_size * sizeof(next_address_t) );
+    memset( new_entries, 0, new_size * sizeof(next_proxy_session_entry_t) );
 
-    NEXT_DECLARE_SENTINEL(17)
+    for ( int i = 0; i < new_size; ++i )
+        next_proxy_session_entry_initialize_sentinels( &new_entries[i] );
 
-    uint8_t previous_route_private_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+    int index = 0;
+    const int current_size = session_manager->size;
+    for ( int i = 0; i < current_size; ++i )
+    {
+        if ( session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
+        {
+            memcpy( &new_addresses[index], &session_manager->addresses[i], sizeof(next_address_t) );
+            memcpy( &new_entries[index], &session_manager->entries[i], sizeof(next_proxy_session_entry_t) );
+            next_hash_index_insert( &new_address_index, next_address_hash( &new_addresses[index] ), index );
+            index++;
+        }
+    }
 
-    NEXT_DECLARE_SENTINEL(18)
+    next_free( session_manager->context, session_manager->addresses );
+    next_free( session_manager->context, session_manager->entries );
 
-    uint8_t ephemeral_private_key[NEXT_CRYPTO_SECRETBOX_KEYBYTES];
-    uint8_t send_key[NEXT_CRYPTO_KX_SESSIONKEYBYTES];
-    uint8_t receive_key[NEXT_CRYPTO_KX_SESSIONKEYBYTES];
-    uint8_t client_route_public_key[NEXT_CRYPTO_BOX_PUBLICKEYBYTES];
+    next_hash_index_destroy( &session_manager->address_index );
 
-    NEXT_DECLARE_SENTINEL(19)
+    session_manager->addresses = new_addresses;
+    session_manager->entries = new_entries;
+    session_manager->address_index = new_address_index;
+    session_manager->size = new_size;
+    session_manager->max_entry_index = index - 1;
 
-    uint8_t upgrade_token[NEXT_UPGRADE_TOKEN_BYTES];
+    next_proxy_session_manager_verify_sentinels( session_manager );
 
-    NEXT_DECLARE_SENTINEL(20)
+    return true;
+}
 
-    next_replay_protection_t payload_replay_protection;
-    next_replay_protection_t special_replay_protection;
-    next_replay_protection_t internal_replay_protection;
+next_proxy_session_entry_t * next_proxy_session_manager_add( next_proxy_session_manager_t * session_manager, const next_address_t * address, uint64_t session_id )
+{
+    next_proxy_session_manager_verify_sentinels( session_manager );
 
-    NEXT_DECLARE_SENTINEL(21)
+    next_assert( session_id != 0 );
+    next_assert( address );
+    next_assert( address->type != NEXT_ADDRESS_NONE );
 
-    next_packet_loss_tracker_t packet_loss_tracker;
-    next_out_of_order_tracker_t out_of_order_tracker;
-    next_jitter_tracker_t jitter_tracker;
+    // first scan existing entries and see if we can insert there
 
-    NEXT_DECLARE_SENTINEL(22)
+    const int size = session_manager->size;
 
-    bool mutex_multipath;
-    bool mutex_committed;
-    int mutex_envelope_kbps_up;
-    int mutex_envelope_kbps_down;
-    uint64_t mutex_payload_send_sequence;
-    uint64_t mutex_session_id;
-    uint8_t mutex_session_version;
-    bool mutex_send_over_network_next;
-    next_address_t mutex_send_address;
+    for ( int i = 0; i < size; ++i )
+    {
+        if ( session_manager->addresses[i].type == NEXT_ADDRESS_NONE )
+        {
+            session_manager->addresses[i] = *address;
+            next_hash_index_insert( &session_manager->address_index, next_address_hash( address ), i );
+            next_proxy_session_entry_t * entry = &session_manager->entries[i];
+            entry->address = *address;
+            entry->session_id = session_id;
+            next_bandwidth_limiter_reset( &entry->send_bandwidth );
+            entry->send_state = NULL;
+            if ( i > session_manager->max_entry_index )
+            {
+                session_manager->max_entry_index = i;
+            }
+            return entry;
+        }
+    }
 
-    NEXT_DECLARE_SENTINEL(23)
+    // ok, we need to grow, expand and add at the end (expand compacts existing entries)
 
-    uint8_t mutex_private_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+    if ( !next_proxy_session_manager_expand( session_manager ) )
+        return NULL;
 
-    NEXT_DECLARE_SENTINEL(24)
+    const int i = ++session_manager->max_entry_index;
+    session_manager->addresses[i] = *address;
+    next_hash_index_insert( &session_manager->address_index, next_address_hash( address ), i );
+    next_proxy_session_entry_t * entry = &session_manager->entries[i];
+    entry->address = *address;
+    entry->session_id = session_id;
+    next_bandwidth_limiter_reset( &entry->send_bandwidth );
+    entry->send_state = NULL;
 
-    int session_data_bytes;
-    uint8_t session_data[NEXT_MAX_SESSION_DATA_BYTES];
+    next_proxy_session_manager_verify_sentinels( session_manager );
 
-    NEXT_DECLARE_SENTINEL(25)
+    return entry;
+}
 
-    bool client_ping_timed_out;
-    double last_client_direct_ping;
-    double last_client_next_ping;
+void next_proxy_session_manager_remove_at_index( next_proxy_session_manager_t * session_manager, int index )
+{
+    next_proxy_session_manager_verify_sentinels( session_manager );
 
-    NEXT_DECLARE_SENTINEL(26)
+    next_assert( index >= 0 );
+    next_assert( index <= session_manager->max_entry_index );
+    const int max_index = session_manager->max_entry_index;
+    if ( session_manager->addresses[index].type != NEXT_ADDRESS_NONE )
+    {
+        next_hash_index_remove( &session_manager->address_index, next_address_hash( &session_manager->addresses[index] ), index );
+        if ( session_manager->entries[index].send_state )
+        {
+            next_session_send_state_release( session_manager->entries[index].send_state );
+            session_manager->entries[index].send_state = NULL;
+        }
+    }
+    session_manager->addresses[index].type = NEXT_ADDRESS_NONE;
+    if ( index == max_index )
+    {
+        while ( index > 0 && session_manager->addresses[index].type == NEXT_ADDRESS_NONE )
+        {
+            index--;
+        }
+        session_manager->max_entry_index = index;
+    }
 
-    bool has_debug;
-    char debug[NEXT_MAX_SESSION_DEBUG];
+    next_proxy_session_manager_verify_sentinels( session_manager );
+}
 
-    NEXT_DECLARE_SENTINEL(27)
+int next_proxy_session_manager_find_index( next_proxy_session_manager_t * session_manager, const next_address_t * address )
+{
+    const uint32_t hash = next_address_hash( address );
+    int probe = -1;
+    int index;
+    while ( ( index = next_hash_index_probe( &session_manager->address_index, hash, &probe ) ) != -1 )
+    {
+        if ( next_address_equal( address, &session_manager->addresses[index] ) == 1 )
+        {
+            return index;
+        }
+    }
+    return -1;
+}
 
-    bool exclude_near_relays;
-    bool near_relay_excluded[NEXT_MAX_NEAR_RELAYS];
-    bool high_frequency_pings;
+void next_proxy_session_manager_remove_by_address( next_proxy_session_manager_t * session_manager, const next_address_t * address )
+{
+    next_proxy_session_manager_verify_sentinels( session_manager );
 
-    NEXT_DECLARE_SENTINEL(28)
+    next_assert( address );
 
-    uint64_t match_id;
-    double match_values[NEXT_MAX_MATCH_VALUES];
-    int num_match_values;
+    const int index = next_proxy_session_manager_find_index( session_manager, address );
+    if ( index != -1 )
+    {
+        next_proxy_session_manager_remove_at_index( session_manager, index );
+        next_proxy_session_manager_verify_sentinels( session_manager );
+    }
+}
 
-    NextBackendMatchDataRequestPacket match_data_request_packet;
+next_proxy_session_entry_t * next_proxy_session_manager_find( next_proxy_session_manager_t * session_manager, const next_address_t * address )
+{
+    next_proxy_session_manager_verify_sentinels( session_manager );
 
-    bool has_match_data;
-    double next_match_data_resend_time;
-    bool waiting_for_match_data_response;
-    bool match_data_response_received;
+    next_assert( address );
 
-    NEXT_DECLARE_SENTINEL(29)
+    const int index = next_proxy_session_manager_find_index( session_manager, address );
 
-	uint32_t session_flush_update_sequence;
-    bool session_update_flush;
-    bool session_update_flush_finished;
-    bool match_data_flush;
-    bool match_data_flush_finished;
+    return ( index != -1 ) ? &session_manager->entries[index] : NULL;
+}
 
-    NEXT_DECLARE_SENTINEL(30)
-};
+int next_proxy_session_manager_num_entries( next_proxy_session_manager_t * session_manager )
+{
+    next_proxy_session_manager_verify_sentinels( session_manager );
+
+    int num_entries = 0;
+
+    const int max_index = session_manager->max_entry_index;
+    for ( int i = 0; i <= max_index; ++i )
+    {
+        if ( session_manager->addresses[i].type != 0 )
+        {
+            num_entries++;
+        }
+    }
+
+    return num_entries;
+}
+
+// ---------------------------------------------------------------
+
+struct NextBackendServerInitRequestPacket
+{
+    int version_major;
+    int version_minor;
+    int version_patch;
+    uint64_t request_id;
+    uint64_t customer_id;
+    uint64_t datacenter_id;
+    char datacenter_name[NEXT_MAX_DATACENTER_NAME_LENGTH];
+
+    NextBackendServerInitRequestPacket()
+    {
+        version_major = NEXT_VERSION_MAJOR_INT;
+        version_minor = NEXT_VERSION_MINOR_INT;
+        version_patch = NEXT_VERSION_PATCH_INT;
+        request_id = 0;
+        customer_id = 0;
+        datacenter_id = 0;
+        datacenter_name[0] = '\0';
+    }
+
+    template <typename Stream> bool Serialize( Stream & stream )
+    {
+        serialize_bits( stream, version_major, 8 );
+        serialize_bits( stream, version_minor, 8 );
+        serialize_bits( stream, version_patch, 8 );
+        serialize_uint64( stream, request_id );
+        serialize_uint64( stream, customer_id );
+        serialize_uint64( stream, datacenter_id );
+        serialize_string( stream, datacenter_name, NEXT_MAX_DATACENTER_NAME_LENGTH );
+        return true;
+    }
+};
+
+// ---------------------------------------------------------------
+
+struct NextBackendServerInitResponsePacket
+{
+    uint64_t request_id;
+    uint32_t response;
+    uint8_t upcoming_magic[8];
+    uint8_t current_magic[8];
+    uint8_t previous_magic[8];
+
+    NextBackendServerInitResponsePacket()
+    {
+        memset( this, 0, sizeof(NextBackendServerInitResponsePacket) );
+    }
+
+    template <typename Stream> bool Serialize( Stream & stream )
+    {
+        serialize_uint64( stream, request_id );
+        serialize_bits( stream, response, 8 );
+        serialize_bytes( stream, upcoming_magic, 8 );
+        serialize_bytes( stream, current_magic, 8 );
+        serialize_bytes( stream, previous_magic, 8 );
+        return true;
+    }
+};
+
+// ---------------------------------------------------------------
+
+struct NextBackendServerUpdateRequestPacket
+{
+    int version_major;
+    int version_minor;
+    int version_patch;
+    uint64_t request_id;
+    uint64_t customer_id;
+    uint64_t datacenter_id;
+    uint32_t num_sessions;
+    next_address_t server_address;
+
+    NextBackendServerUpdateRequestPacket()
+    {
+        version_major = NEXT_VERSION_MAJOR_INT;
+        version_minor = NEXT_VERSION_MINOR_INT;
+        version_patch = NEXT_VERSION_PATCH_INT;
+        request_id = 0;
+        customer_id = 0;
+        datacenter_id = 0;
+        num_sessions = 0;
+        memset( &server_address, 0, sizeof(next_address_t) );
+    }
+
+    template <typename Stream> bool Serialize( Stream & stream )
+    {
+        serialize_bits( stream, version_major, 8 );
+        serialize_bits( stream, version_minor, 8 );
+        serialize_bits( stream, version_patch, 8 );
+        serialize_uint64( stream, request_id );
+        serialize_uint64( stream, customer_id );
+        serialize_uint64( stream, datacenter_id );
+        serialize_uint32( stream, num_sessions );
+        serialize_address( stream, server_address );
+        return true;
+    }
+};
+
+// ---------------------------------------------------------------
+
+struct NextBackendServerUpdateResponsePacket
+{
+    uint64_t request_id;
+    uint8_t upcoming_magic[8];
+    uint8_t current_magic[8];
+    uint8_t previous_magic[8];
+
+    NextBackendServerUpdateResponsePacket()
+    {
+        memset( this, 0, sizeof(NextBackendServerUpdateResponsePacket) );
+    }
+
+    template <typename Stream> bool Serialize( Stream & stream )
+    {
+        serialize_uint64( stream, request_id );
+        serialize_bytes( stream, upcoming_magic, 8 );
+        serialize_bytes( stream, current_magic, 8 );
+        serialize_bytes( stream, previous_magic, 8 );
+        return true;
+    }
+};
+
+// ---------------------------------------------------------------
+
+struct NextBackendSessionUpdateRequestPacket
+{
+    int version_major;
+    int version_minor;
+    int version_patch;
+    uint64_t customer_id;
+    uint64_t datacenter_id;
+    uint64_t session_id;
+    uint32_t slice_number;
+    uint32_t retry_number;
+    int session_data_bytes;
+    uint8_t session_data[NEXT_MAX_SESSION_DATA_BYTES];
+    next_address_t client_address;
+    next_address_t server_address;
+    uint8_t client_route_public_key[NEXT_CRYPTO_BOX_PUBLICKEYBYTES];
+    uint8_t server_route_public_key[NEXT_CRYPTO_BOX_PUBLICKEYBYTES];
+    uint64_t user_hash;
+    int platform_id;
+    int connection_type;
+    bool next;
+    bool committed;
+    bool reported;
+    bool fallback_to_direct;
+    bool client_bandwidth_over_limit;
+    bool server_bandwidth_over_limit;
+    bool client_ping_timed_out;
+    bool has_near_relay_pings;
+    int num_tags;
+    uint64_t tags[NEXT_MAX_TAGS];
+    uint64_t server_events;
+    float direct_min_rtt;
+    float direct_max_rtt;
+    float direct_prime_rtt;
+    float direct_jitter;
+    float direct_packet_loss;
+    float next_rtt;
+    float next_jitter;
+    float next_packet_loss;
+    int num_near_relays;
+    uint64_t near_relay_ids[NEXT_MAX_NEAR_RELAYS];
+    uint8_t near_relay_rtt[NEXT_MAX_NEAR_RELAYS];
+    uint8_t near_relay_jitter[NEXT_MAX_NEAR_RELAYS];
+    uint8_t near_relay_packet_loss[NEXT_MAX_NEAR_RELAYS];
+    uint32_t next_kbps_up;
+    uint32_t next_kbps_down;
+    uint64_t packets_sent_client_to_server;
+    uint64_t packets_sent_server_to_client;
+    uint64_t packets_lost_client_to_server;
+    uint64_t packets_lost_server_to_client;
+    uint64_t packets_out_of_order_client_to_server;
+    uint64_t packets_out_of_order_server_to_client;
+    float jitter_client_to_server;
+    float jitter_server_to_client;
+
+    void Reset()
+    {
+        memset( this, 0, sizeof(NextBackendSessionUpdateRequestPacket) );
+        version_major = NEXT_VERSION_MAJOR_INT;
+        version_minor = NEXT_VERSION_MINOR_INT;
+        version_patch = NEXT_VERSION_PATCH_INT;
+    }
+
+    template <typename Stream> bool Serialize( Stream & stream )
+    {
+        serialize_bits( stream, version_major, 8 );
+        serialize_bits( stream, version_minor, 8 );
+        serialize_bits( stream, version_patch, 8 );
+
+        serialize_uint64( stream, customer_id );
+
+        serialize_uint64( stream, datacenter_id );
+
+        serialize_uint64( stream, session_id );
+
+        serialize_uint32( stream, slice_number );
+
+        serialize_int( stream, retry_number, 0, NEXT_MAX_SESSION_UPDATE_RETRIES );
+
+        serialize_int( stream, session_data_bytes, 0, NEXT_MAX_SESSION_DATA_BYTES );
+        if ( session_data_bytes > 0 )
+        {
+            serialize_bytes( stream, session_data, session_data_bytes );
+        }
+
+        // IMPORTANT: Anonymize the client address before sending it up to our backend
+        // This ensures that we are fully compliant with the GDPR and there is zero risk
+        // the address will be accidentally stored or intecepted in transit
+        if ( Stream::IsWriting )
+        {
+            next_address_anonymize( &client_address );
+        }
+
+        serialize_address( stream, client_address );
+
+        serialize_address( stream, server_address );
+
+        serialize_bytes( stream, client_route_public_key, NEXT_CRYPTO_BOX_PUBLICKEYBYTES );
+        serialize_bytes( stream, server_route_public_key, NEXT_CRYPTO_BOX_PUBLICKEYBYTES );
+
+        serialize_uint64( stream, user_hash );
+
+        serialize_int( stream, platform_id, NEXT_PLATFORM_UNKNOWN, NEXT_PLATFORM_MAX );
+
+        serialize_int( stream, connection_type, NEXT_CONNECTION_TYPE_UNKNOWN, NEXT_CONNECTION_TYPE_MAX );
+
+        serialize_bool( stream, next );
+        serialize_bool( stream, committed );
+        serialize_bool( stream, reported );
+        serialize_bool( stream, fallback_to_direct );
+        serialize_bool( stream, client_bandwidth_over_limit );
+        serialize_bool( stream, server_bandwidth_over_limit );
+        serialize_bool( stream, client_ping_timed_out );
+        serialize_bool( stream, has_near_relay_pings );
+
+        bool has_tags = Stream::IsWriting && slice_number == 0 && num_tags > 0;
+        bool has_server_events = Stream::IsWriting && server_events != 0;
+        bool has_lost_packets = Stream::IsWriting && ( packets_lost_client_to_server + packets_lost_server_to_client ) > 0;
+        bool has_out_of_order_packets = Stream::IsWriting && ( packets_out_of_order_client_to_server + packets_out_of_order_server_to_client ) > 0;
+
+        serialize_bool( stream, has_tags );
+        serialize_bool( stream, has_server_events );
+        serialize_bool( stream, has_lost_packets );
+        serialize_bool( stream, has_out_of_order_packets );
+
+        if ( has_tags )
+        {
+            serialize_int( stream, num_tags, 0, NEXT_MAX_TAGS );
+            for ( int i = 0; i < num_tags; ++i )
+            {
+                serialize_uint64( stream, tags[i] );
+            }
+        }
+
+        if ( has_server_events )
+        {
+            serialize_uint64( stream, server_events );
+        }
+
+        serialize_float( stream, direct_min_rtt );
+        serialize_float( stream, direct_max_rtt );
+        serialize_float( stream, direct_prime_rtt );
+        serialize_float( stream, direct_jitter );
+        serialize_float( stream, direct_packet_loss );
+
+        if ( next )
+        {
+            serialize_float( stream, next_rtt );
+            serialize_float( stream, next_jitter );
+            serialize_float( stream, next_packet_loss );
+        }
+
+        serialize_int( stream, num_near_relays, 0, NEXT_MAX_NEAR_RELAYS );
+
+        for ( int i = 0; i < num_near_relays; ++i )
+        {
+            serialize_uint64( stream, near_relay_ids[i] );
+            if ( has_near_relay_pings )
+            {
+                serialize_int( stream, near_relay_rtt[i], 0, 255 );
+                serialize_int( stream, near_relay_jitter[i], 0, 255 );
+                serialize_int( stream, near_relay_packet_loss[i], 0, 100 );
+            }
+        }
+
+        if ( next )
+        {
+            serialize_uint32( stream, next_kbps_up );
+            serialize_uint32( stream, next_kbps_down );
+        }
+
+        serialize_uint64( stream, packets_sent_client_to_server );
+        serialize_uint64( stream, packets_sent_server_to_client );
+
+        if ( has_lost_packets )
+        {
+            serialize_uint64( stream, packets_lost_client_to_server );
+            serialize_uint64( stream, packets_lost_server_to_client );
+        }
+
+        if ( has_out_of_order_packets )
+        {
+            serialize_uint64( stream, packets_out_of_order_client_to_server );
+            serialize_uint64( stream, packets_out_of_order_server_to_client );
+        }
+
+        serialize_float( stream, jitter_client_to_server );
+        serialize_float( stream, jitter_server_to_client );
+
+        return true;
+    }
+};
+
+// ---------------------------------------------------------------
+
+struct NextBackendMatchDataRequestPacket
+{
+    int version_major;
+    int version_minor;
+    int version_patch;
+    uint64_t customer_id;
+    next_address_t server_address;
+    uint64_t datacenter_id;
+    uint64_t user_hash;
+    uint64_t session_id;
+    uint32_t retry_number;
+    uint64_t match_id;
+    int num_match_values;
+    double match_values[NEXT_MAX_MATCH_VALUES];
+
+    void Reset()
+    {
+        memset( this, 0, sizeof(NextBackendMatchDataRequestPacket) );
+        version_major = NEXT_VERSION_MAJOR_INT;
+        version_minor = NEXT_VERSION_MINOR_INT;
+        version_patch = NEXT_VERSION_PATCH_INT;
+    }
+
+    template <typename Stream> bool Serialize( Stream & stream )
+    {
+        serialize_bits( stream, version_major, 8 );
+        serialize_bits( stream, version_minor, 8 );
+        serialize_bits( stream, version_patch, 8 );
+        serialize_uint64( stream, customer_id );
+        serialize_address( stream, server_address );
+        serialize_uint64( stream, datacenter_id );
+        serialize_uint64( stream, user_hash );
+        serialize_uint64( stream, session_id );
+        serialize_uint32( stream, retry_number );
+        serialize_uint64( stream, match_id );
+
+        bool has_match_values = Stream::IsWriting && num_match_values > 0;
+
+        serialize_bool( stream, has_match_values );
+
+        if ( has_match_values )
+        {
+            serialize_int( stream, num_match_values, 0, NEXT_MAX_MATCH_VALUES );
+            for ( int i = 0; i < num_match_values; ++i )
+            {
+                serialize_double( stream, match_values[i] );
+            }
+        }
+
+        return true;
+    }
+};
+
+// ---------------------------------------------------------------
+
+struct NextBackendMatchDataResponsePacket
+{
+    uint64_t session_id;
+    uint32_t response;
+
+    template <typename Stream> bool Serialize( Stream & stream )
+    {
+        serialize_uint64( stream, session_id );
+        serialize_bits( stream, response, 8 );
+        return true;
+    }
+};
+
+// ---------------------------------------------------------------
+
+struct next_session_entry_t
+{
+    NEXT_DECLARE_SENTINEL(0)
+
+    next_address_t address;
+    uint64_t session_id;
+    uint8_t most_recent_session_version;
+    uint64_t special_send_sequence;
+    uint64_t internal_send_sequence;
+    uint64_t stats_sequence;
+    uint64_t user_hash;
+    uint64_t tags[NEXT_MAX_TAGS];
+    int num_tags;
+	uint64_t previous_server_events;
+	uint64_t current_server_events;
+    uint8_t client_open_session_sequence;
+
+    NEXT_DECLARE_SENTINEL(1)
+
+    bool stats_reported;
+    bool stats_multipath;
+    bool stats_committed;
+    bool stats_fallback_to_direct;
+    bool stats_client_bandwidth_over_limit;
+    bool stats_has_near_relay_pings;
+    int stats_platform_id;
+    int stats_connection_type;
+    float stats_next_kbps_up;
+    float stats_next_kbps_down;
+    float stats_direct_min_rtt;
+    float stats_direct_max_rtt;
+    float stats_direct_prime_rtt;
+    float stats_direct_jitter;
+    float stats_direct_packet_loss;
+    bool stats_next;
+    float stats_next_rtt;
+    float stats_next_jitter;
+    float stats_next_packet_loss;
+    int stats_num_near_relays;
+
+    NEXT_DECLARE_SENTINEL(2)
+
+    uint64_t stats_near_relay_ids[NEXT_MAX_NEAR_RELAYS];
+
+    NEXT_DECLARE_SENTINEL(3)
+
+    uint8_t stats_near_relay_rtt[NEXT_MAX_NEAR_RELAYS];
+
+    NEXT_DECLARE_SENTINEL(4)
+
+    uint8_t stats_near_relay_jitter[NEXT_MAX_NEAR_RELAYS];
+
+    NEXT_DECLARE_SENTINEL(5)
+
+    uint8_t stats_near_relay_packet_loss[NEXT_MAX_NEAR_RELAYS];
+
+    NEXT_DECLARE_SENTINEL(6)
+
+    uint64_t stats_packets_sent_client_to_server;
+    uint64_t stats_packets_lost_client_to_server;
+    uint64_t stats_packets_lost_server_to_client;
+    uint64_t stats_packets_out_of_order_client_to_server;
+    uint64_t stats_packets_out_of_order_server_to_client;
+
+    float stats_jitter_client_to_server;
+    float stats_jitter_server_to_client;
+
+    double next_tracker_update_time;
+    double next_session_update_time;
+    double next_session_resend_time;
+    double last_client_stats_update;
+
+    uint64_t update_sequence;
+    bool update_dirty;
+    bool waiting_for_update_response;
+    bool multipath;
+    bool committed;
+    double update_last_send_time;
+    uint8_t update_type;
+    int update_num_tokens;
+
+    NEXT_DECLARE_SENTINEL(7)
+
+    uint8_t update_tokens[NEXT_MAX_TOKENS*NEXT_ENCRYPTED_ROUTE_TOKEN_BYTES];
+
+    NEXT_DECLARE_SENTINEL(8)
+
+    bool update_dont_ping_near_relays;
+    bool update_near_relays_changed;
+    int update_num_near_relays;
+
+    NEXT_DECLARE_SENTINEL(9)
+
+    uint64_t update_near_relay_ids[NEXT_MAX_NEAR_RELAYS];
+
+    NEXT_DECLARE_SENTINEL(10)
+
+    next_address_t update_near_relay_addresses[NEXT_MAX_NEAR_RELAYS];
+
+    NEXT_DECLARE_SENTINEL(11)
+
+    NextBackendSessionUpdateRequestPacket session_update_request_packet;
+
+    NEXT_DECLARE_SENTINEL(12)
+
+    bool has_pending_route;
+    bool pending_route_committed;
+    uint8_t pending_route_session_version;
+    uint64_t pending_route_expire_timestamp;
+    double pending_route_expire_time;
+    int pending_route_kbps_up;
+    int pending_route_kbps_down;
+    next_address_t pending_route_send_address;
+
+    NEXT_DECLARE_SENTINEL(13)
+
+    uint8_t pending_route_private_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+
+    NEXT_DECLARE_SENTINEL(14)
+
+    bool has_current_route;
+    bool current_route_committed;
+    uint8_t current_route_session_version;
+    uint64_t current_route_expire_timestamp;
+    double current_route_expire_time;
+    int current_route_kbps_up;
+    int current_route_kbps_down;
+    next_address_t current_route_send_address;
+
+    NEXT_DECLARE_SENTINEL(15)
+
+    uint8_t current_route_private_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+
+    NEXT_DECLARE_SENTINEL(16)
+
+    bool has_previous_route;
+    next_address_t previous_route_send_address;
+
+    NEXT_DECLARE_SENTINEL(17)
+
+    uint8_t previous_route_private_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+
+    NEXT_DECLARE_SENTINEL(18)
+
+    uint8_t ephemeral_private_key[NEXT_CRYPTO_SECRETBOX_KEYBYTES];
+    uint8_t send_key[NEXT_CRYPTO_KX_SESSIONKEYBYTES];
+    uint8_t receive_key[NEXT_CRYPTO_KX_SESSIONKEYBYTES];
+    uint8_t client_route_public_key[NEXT_CRYPTO_BOX_PUBLICKEYBYTES];
+
+    NEXT_DECLARE_SENTINEL(19)
+
+    uint8_t upgrade_token[NEXT_UPGRADE_TOKEN_BYTES];
+
+    NEXT_DECLARE_SENTINEL(20)
+
+    next_replay_protection_t payload_replay_protection;
+    next_replay_protection_t special_replay_protection;
+    next_replay_protection_t internal_replay_protection;
+
+    NEXT_DECLARE_SENTINEL(21)
+
+    next_packet_loss_tracker_t packet_loss_tracker;
+    next_out_of_order_tracker_t out_of_order_tracker;
+    next_jitter_tracker_t jitter_tracker;
+
+    NEXT_DECLARE_SENTINEL(22)
+
+    next_session_send_state_t * send_state;
+
+    NEXT_DECLARE_SENTINEL(23)
+
+    int session_data_bytes;
+    uint8_t session_data[NEXT_MAX_SESSION_DATA_BYTES];
+
+    NEXT_DECLARE_SENTINEL(24)
+
+    bool client_ping_timed_out;
+    double last_client_direct_ping;
+    double last_client_next_ping;
+
+    NEXT_DECLARE_SENTINEL(25)
+
+    bool has_debug;
+    char debug[NEXT_MAX_SESSION_DEBUG];
+
+    NEXT_DECLARE_SENTINEL(26)
+
+    bool exclude_near_relays;
+    bool near_relay_excluded[NEXT_MAX_NEAR_RELAYS];
+    bool high_frequency_pings;
+
+    NEXT_DECLARE_SENTINEL(27)
+
+    uint64_t match_id;
+    double match_values[NEXT_MAX_MATCH_VALUES];
+    int num_match_values;
+
+    NextBackendMatchDataRequestPacket match_data_request_packet;
+
+    bool has_match_data;
+    double next_match_data_resend_time;
+    bool waiting_for_match_data_response;
+    bool match_data_response_received;
+
+    NEXT_DECLARE_SENTINEL(28)
+
+	uint32_t session_flush_update_sequence;
+    bool session_update_flush;
+    bool session_update_flush_finished;
+    bool match_data_flush;
+    bool match_data_flush_finished;
+
+    NEXT_DECLARE_SENTINEL(29)
+};
+
+void next_session_entry_initialize_sentinels( next_session_entry_t * entry )
+{
+    (void) entry;
+    next_assert( entry );
+    NEXT_INITIALIZE_SENTINEL( entry, 0 )
+    NEXT_INITIALIZE_SENTINEL( entry, 1 )
+    NEXT_INITIALIZE_SENTINEL( entry, 2 )
+    NEXT_INITIALIZE_SENTINEL( entry, 3 )
+    NEXT_INITIALIZE_SENTINEL( entry, 4 )
+    NEXT_INITIALIZE_SENTINEL( entry, 5 )
+    NEXT_INITIALIZE_SENTINEL( entry, 6 )
+    NEXT_INITIALIZE_SENTINEL( entry, 7 )
+    NEXT_INITIALIZE_SENTINEL( entry, 8 )
+    NEXT_INITIALIZE_SENTINEL( entry, 9 )
+    NEXT_INITIALIZE_SENTINEL( entry, 10 )
+    NEXT_INITIALIZE_SENTINEL( entry, 11 )
+    NEXT_INITIALIZE_SENTINEL( entry, 12 )
+    NEXT_INITIALIZE_SENTINEL( entry, 13 )
+    NEXT_INITIALIZE_SENTINEL( entry, 14 )
+    NEXT_INITIALIZE_SENTINEL( entry, 15 )
+    NEXT_INITIALIZE_SENTINEL( entry, 16 )
+    NEXT_INITIALIZE_SENTINEL( entry, 17 )
+    NEXT_INITIALIZE_SENTINEL( entry, 18 )
+    NEXT_INITIALIZE_SENTINEL( entry, 19 )
+    NEXT_INITIALIZE_SENTINEL( entry, 20 )
+    NEXT_INITIALIZE_SENTINEL( entry, 21 )
+    NEXT_INITIALIZE_SENTINEL( entry, 22 )
+    NEXT_INITIALIZE_SENTINEL( entry, 23 )
+    NEXT_INITIALIZE_SENTINEL( entry, 24 )
+    NEXT_INITIALIZE_SENTINEL( entry, 25 )
+    NEXT_INITIALIZE_SENTINEL( entry, 26 )
+    NEXT_INITIALIZE_SENTINEL( entry, 27 )
+    NEXT_INITIALIZE_SENTINEL( entry, 28 )
+    NEXT_INITIALIZE_SENTINEL( entry, 29 )
+}
+
+void next_session_entry_verify_sentinels( next_session_entry_t * entry )
+{
+    (void) entry;
+    next_assert( entry );
+    NEXT_VERIFY_SENTINEL( entry, 0 )
+    NEXT_VERIFY_SENTINEL( entry, 1 )
+    NEXT_VERIFY_SENTINEL( entry, 2 )
+    NEXT_VERIFY_SENTINEL( entry, 3 )
+    NEXT_VERIFY_SENTINEL( entry, 4 )
+    NEXT_VERIFY_SENTINEL( entry, 5 )
+    NEXT_VERIFY_SENTINEL( entry, 6 )
+    NEXT_VERIFY_SENTINEL( entry, 7 )
+    NEXT_VERIFY_SENTINEL( entry, 8 )
+    NEXT_VERIFY_SENTINEL( entry, 9 )
+    NEXT_VERIFY_SENTINEL( entry, 10 )
+    NEXT_VERIFY_SENTINEL( entry, 11 )
+    NEXT_VERIFY_SENTINEL( entry, 12 )
+    NEXT_VERIFY_SENTINEL( entry, 13 )
+    NEXT_VERIFY_SENTINEL( entry, 14 )
+    NEXT_VERIFY_SENTINEL( entry, 15 )
+    NEXT_VERIFY_SENTINEL( entry, 16 )
+    NEXT_VERIFY_SENTINEL( entry, 17 )
+    NEXT_VERIFY_SENTINEL( entry, 18 )
+    NEXT_VERIFY_SENTINEL( entry, 19 )
+    NEXT_VERIFY_SENTINEL( entry, 20 )
+    NEXT_VERIFY_SENTINEL( entry, 21 )
+    NEXT_VERIFY_SENTINEL( entry, 22 )
+    NEXT_VERIFY_SENTINEL( entry, 23 )
+    NEXT_VERIFY_SENTINEL( entry, 24 )
+    NEXT_VERIFY_SENTINEL( entry, 25 )
+    NEXT_VERIFY_SENTINEL( entry, 26 )
+    NEXT_VERIFY_SENTINEL( entry, 27 )
+    NEXT_VERIFY_SENTINEL( entry, 28 )
+    NEXT_VERIFY_SENTINEL( entry, 29 )
+    next_replay_protection_verify_sentinels( &entry->payload_replay_protection );
+    next_replay_protection_verify_sentinels( &entry->special_replay_protection );
+    next_replay_protection_verify_sentinels( &entry->internal_replay_protection );
+    next_packet_loss_tracker_verify_sentinels( &entry->packet_loss_tracker );
+    next_out_of_order_tracker_verify_sentinels( &entry->out_of_order_tracker );
+    next_jitter_tracker_verify_sentinels( &entry->jitter_tracker );
+}
+
+struct next_session_manager_t
+{
+    NEXT_DECLARE_SENTINEL(0)
+
+    void * context;
+    int size;
+    int max_entry_index;
+    uint64_t num_expands;
+    uint64_t * session_ids;
+    next_address_t * addresses;
+    next_session_entry_t * entries;
+    next_hash_index_t address_index;
+    next_hash_index_t session_id_index;
+
+    NEXT_DECLARE_SENTINEL(1)
+};
+
+void next_session_manager_initialize_sentinels( next_session_manager_t * session_manager )
+{
+    (void) session_manager;
+    next_assert( session_manager );
+    NEXT_INITIALIZE_SENTINEL( session_manager, 0 )
+    NEXT_INITIALIZE_SENTINEL( session_manager, 1 )
+}
+
+void next_session_manager_verify_sentinels( next_session_manager_t * session_manager )
+{
+    (void) session_manager;
+#if NEXT_ENABLE_MEMORY_CHECKS
+    next_assert( session_manager );
+    NEXT_VERIFY_SENTINEL( session_manager, 0 )
+    NEXT_VERIFY_SENTINEL( session_manager, 1 )
+    const int size = session_manager->size;
+    for ( int i = 0; i < size; ++i )
+    {
+        if ( session_manager->session_ids[i] != 0 )
+        {
+            next_session_entry_verify_sentinels( &session_manager->entries[i] );
+        }
+    }
+#endif // #if NEXT_ENABLE_MEMORY_CHECKS
+}
+
+void next_session_manager_destroy( next_session_manager_t * session_manager );
+
+next_session_manager_t * next_session_manager_create( void * context, int initial_size )
+{
+    next_session_manager_t * session_manager = (next_session_manager_t*) next_malloc( context, sizeof(next_session_manager_t) );
+
+    next_assert( session_manager );
+    if ( !session_manager )
+        return NULL;
+
+    memset( session_manager, 0, sizeof(next_session_manager_t) );
+
+    next_session_manager_initialize_sentinels( session_manager );
+
+    session_manager->context = context;
+    session_manager->size = initial_size;
+    session_manager->session_ids = (uint64_t*) next_malloc( context, size_t(initial_size) * 8 );
+    session_manager->addresses = (next_address_t*) next_malloc( context, size_t(initial_size) * sizeof(next_address_t) );
+    session_manager->entries = (next_session_entry_t*) next_malloc( context, size_t(initial_size) * sizeof(next_session_entry_t) );
+
+    next_assert( session_manager->session_ids );
+    next_assert( session_manager->addresses );
+    next_assert( session_manager->entries );
+
+    if ( session_manager->session_ids == NULL || session_manager->addresses == NULL || session_manager->entries == NULL )
+    {
+        next_session_manager_destroy( session_manager );
+        return NULL;
+    }
+
+    memset( session_manager->session_ids, 0, size_t(initial_size) * 8 );
+    memset( session_manager->addresses, 0, size_t(initial_size) * sizeof(next_address_t) );
+    memset( session_manager->entries, 0, size_t(initial_size) * sizeof(next_session_entry_t) );
+
+    if ( !next_hash_index_create( context, &session_manager->address_index, initial_size ) || !next_hash_index_create( context, &session_manager->session_id_index, initial_size ) )
+    {
+        next_session_manager_destroy( session_manager );
+        return NULL;
+    }
+
+    next_session_manager_verify_sentinels( session_manager );
+
+    return session_manager;
+}
+
+void next_session_manager_release_send_state( next_session_entry_t * entry )
+{
+    next_session_send_state_t * send_state = entry->send_state;
+    if ( !send_state )
+        return;
+
+    // the application thread may still hold a reference. make sure it falls back to passthrough from now on
+
+    next_session_send_state_begin_write( send_state );
+    send_state->route.send_over_network_next = false;
+    send_state->route.last_upgraded_packet_receive_time = -1000.0;
+    next_session_send_state_end_write( send_state );
+
+    next_session_send_state_release( send_state );
+
+    entry->send_state = NULL;
+}
+
+void next_session_manager_destroy( next_session_manager_t * session_manager )
+{
+    next_session_manager_verify_sentinels( session_manager );
+
+    if ( session_manager->session_ids && session_manager->addresses && session_manager->entries )
+    {
+        for ( int i = 0; i <= session_manager->max_entry_index; ++i )
+        {
+            if ( session_manager->session_ids[i] != 0 )
+            {
+                next_session_manager_release_send_state( &session_manager->entries[i] );
+            }
+        }
+    }
+
+    next_free( session_manager->context, session_manager->session_ids );
+    next_free( session_manager->context, session_manager->addresses );
+    next_free( session_manager->context, session_manager->entries );
+
+    next_hash_index_destroy( &session_manager->address_index );
+    next_hash_index_destroy( &session_manager->session_id_index );
+
+    clear_and_free( session_manager->context, session_manager, sizeof(next_session_manager_t) );
+}
+
+bool next_session_manager_expand( next_session_manager_t * session_manager )
+{
+    next_session_manager_verify_sentinels( session_manager );
+
+    int new_size = session_manager->size * 2;
+
+    uint64_t * new_session_ids = (uint64_t*) next_malloc( session_manager->context, size_t(new_size) * 8 );
+    next_address_t * new_addresses = (next_address_t*) next_malloc( session_manager->context, size_t(new_size) * sizeof(next_address_t) );
+    next_session_entry_t * new_entries = (next_session_entry_t*) next_malloc( session_manager->context, size_t(new_size) * sizeof(next_session_entry_t) );
+
+    next_hash_index_t new_address_index;
+    next_hash_index_t new_session_id_index;
+    memset( &new_address_index, 0, sizeof(next_hash_index_t) );
+    memset( &new_session_id_index, 0, sizeof(next_hash_index_t) );
+
+    next_assert( new_session_ids );
+    next_assert( new_addresses );
+    next_assert( new_entries );
+
+    if ( new_session_ids == NULL || new_addresses == NULL || new_entries == NULL || 
+         !next_hash_index_create( session_manager->context, &new_address_index, new_size ) || 
+         !next_hash_index_create( session_manager->context, &new_session_id_index, new_size ) )
+    {
+        next_free( session_manager->context, new_session_ids );
+        next_free( session_manager->context, new_addresses );
+        next_free( session_manager->context, new_entries );
+        next_hash_index_destroy( &new_address_index );
+        next_hash_index_destroy( &new_session_id_index );
+        return false;
+    }
+
+    memset( new_session_ids, 0, size_t(new_size) * 8 );
+    memset( new_addresses, 0, size_t(new_size) * sizeof(next_address_t) );
+    memset( new_entries, 0, size_t(new_size) * sizeof(next_session_entry_t) );
+
+    int index = 0;
+    const int current_size = session_manager->size;
+    for ( int i = 0; i < current_size; ++i )
+    {
+        if ( session_manager->session_ids[i] != 0 )
+        {
+            memcpy( &new_session_ids[index], &session_manager->session_ids[i], 8 );
+            memcpy( &new_addresses[index], &session_manager->addresses[i], sizeof(next_address_t) );
+            memcpy( &new_entries[index], &session_manager->entries[i], sizeof(next_session_entry_t) );
+            next_hash_index_insert( &new_address_index, next_address_hash( &new_addresses[index] ), index );
+            next_hash_index_insert( &new_session_id_index, next_session_id_hash( new_session_ids[index] ), index );
+            index++;
+        }
+    }
+
+    next_free( session_manager->context, session_manager->session_ids );
+    next_free( session_manager->context, session_manager->addresses );
+    next_free( session_manager->context, session_manager->entries );
+
+    next_hash_index_destroy( &session_manager->address_index );
+    next_hash_index_destroy( &session_manager->session_id_index );
+
+    session_manager->session_ids = new_session_ids;
+    session_manager->addresses = new_addresses;
+    session_manager->entries = new_entries;
+    session_manager->address_index = new_address_index;
+    session_manager->session_id_index = new_session_id_index;
+    session_manager->size = new_size;
+    session_manager->max_entry_index = index - 1;
+
+    // entries moved to new indices, so anything keyed by entry index must be rebuilt
+
+    session_manager->num_expands++;
+
+    return true;
+}
+
+void next_clear_session_entry( next_session_entry_t * entry, const next_address_t * address, uint64_t session_id )
+{
+    memset( entry, 0, sizeof(next_session_entry_t) );
+
+    next_session_entry_initialize_sentinels( entry );
+
+    entry->address = *address;
+    entry->session_id = session_id;
+
+    next_replay_protection_reset( &entry->payload_replay_protection );
+    next_replay_protection_reset( &entry->special_replay_protection );
+    next_replay_protection_reset( &entry->internal_replay_protection );
+
+    next_packet_loss_tracker_reset( &entry->packet_loss_tracker );
+    next_out_of_order_tracker_reset( &entry->out_of_order_tracker );
+    next_jitter_tracker_reset( &entry->jitter_tracker );
+
+    next_session_entry_verify_sentinels( entry );
+
+    entry->special_send_sequence = 1;
+    entry->internal_send_sequence = 1;
+
+    const double current_time = next_time();
+
+    entry->last_client_direct_ping = current_time;
+    entry->last_client_next_ping = current_time;
+}
+
+next_session_entry_t * next_session_manager_add( next_session_manager_t * session_manager, const next_address_t * address, uint64_t session_id, const uint8_t * ephemeral_private_key, const uint8_t * upgrade_token, const uint64_t * tags, int num_tags )
+{
+    next_session_manager_verify_sentinels( session_manager );
+
+    next_assert( session_id != 0 );
+    next_assert( address );
+    next_assert( address->type != NEXT_ADDRESS_NONE );
+    next_assert( num_tags == 0 || tags );
+
+    next_session_send_state_t * send_state = next_session_send_state_create( session_manager->context );
+    if ( !send_state )
+        return NULL;
+
+    // first scan existing entries and see if we can insert there
+
+    const int size = session_manager->size;
+
+    for ( int i = 0; i < size; ++i )
+    {
+        if ( session_manager->session_ids[i] == 0 )
+        {
+            session_manager->session_ids[i] = session_id;
+            session_manager->addresses[i] = *address;
+            next_hash_index_insert( &session_manager->address_index, next_address_hash( address ), i );
+            next_hash_index_insert( &session_manager->session_id_index, next_session_id_hash( session_id ), i );
+            next_session_entry_t * entry = &session_manager->entries[i];
+            next_clear_session_entry( entry, address, session_id );
+            entry->send_state = send_state;
+            memcpy( entry->ephemeral_private_key, ephemeral_private_key, NEXT_CRYPTO_SECRETBOX_KEYBYTES );
+            memcpy( entry->upgrade_token, upgrade_token, NEXT_UPGRADE_TOKEN_BYTES );
+            entry->num_tags = num_tags;
+            for ( int j = 0; j < num_tags; ++j )
+            {
+                entry->tags[j] = tags[j];
+            }
+            if ( i > session_manager->max_entry_index )
+            {
+                session_manager->max_entry_index = i;
+            }
+            return entry;
+        }
+    }
+
+    // ok, we need to grow, expand and add at the end (expand compacts existing entries)
+
+    if ( !next_session_manager_expand( session_manager ) )
+    {
+        next_session_send_state_release( send_state );
+        return NULL;
+    }
+
+    const int i = ++session_manager->max_entry_index;
+
+    session_manager->session_ids[i] = session_id;
+    session_manager->addresses[i] = *address;
+    next_hash_index_insert( &session_manager->address_index, next_address_hash( address ), i );
+    next_hash_index_insert( &session_manager->session_id_index, next_session_id_hash( session_id ), i );
+    next_session_entry_t * entry = &session_manager->entries[i];
+    next_clear_session_entry( entry, address, session_id );
+    entry->send_state = send_state;
+    memcpy( entry->ephemeral_private_key, ephemeral_private_key, NEXT_CRYPTO_SECRETBOX_KEYBYTES );
+    memcpy( entry->upgrade_token, upgrade_token, NEXT_UPGRADE_TOKEN_BYTES );
+    entry->num_tags = num_tags;
+    for ( int j = 0; j < num_tags; ++j )
+    {
+        entry->tags[j] = tags[j];
+    }
+
+    next_session_manager_verify_sentinels( session_manager );
+
+    return entry;
+}
+
+void next_session_manager_remove_at_index( next_session_manager_t * session_manager, int index )
+{
+    next_session_manager_verify_sentinels( session_manager );
+
+    next_assert( index >= 0 );
+    next_assert( index <= session_manager->max_entry_index );
+
+    const int max_index = session_manager->max_entry_index;
+    if ( session_manager->session_ids[index] != 0 )
+    {
+        next_hash_index_remove( &session_manager->address_index, next_address_hash( &session_manager->addresses[index] ), index );
+        next_hash_index_remove( &session_manager->session_id_index, next_session_id_hash( session_manager->session_ids[index] ), index );
+        next_session_manager_release_send_state( &session_manager->entries[index] );
+    }
+    session_manager->session_ids[index] = 0;
+    session_manager->addresses[index].type = NEXT_ADDRESS_NONE;
+    if ( index == max_index )
+    {
+        while ( index > 0 && session_manager->session_ids[index] == 0 )
+        {
+            index--;
+        }
+        session_manager->max_entry_index = index;
+    }
+
+    next_session_manager_verify_sentinels( session_manager );
+}
+
+int next_session_manager_find_index_by_address( next_session_manager_t * session_manager, const next_address_t * address )
+{
+    next_assert( address );
+    const uint32_t hash = next_address_hash( address );
+    int probe = -1;
+    int index;
+    while ( ( index = next_hash_index_probe( &session_manager->address_index, hash, &probe ) ) != -1 )
+    {
+        if ( next_address_equal( address, &session_manager->addresses[index] ) == 1 )
+        {
+            return index;
+        }
+    }
+    return -1;
+}
+
+void next_session_manager_remove_by_address( next_session_manager_t * session_manager, const next_address_t * address )
+{
+    next_session_manager_verify_sentinels( session_manager );
+
+    next_assert( address );
+
+    const int index = next_session_manager_find_index_by_address( session_manager, address );
+    if ( index != -1 )
+    {
+        next_session_manager_remove_at_index( session_manager, index );
+        return;
+    }
+
+    next_session_manager_verify_sentinels( session_manager );
+}
+
+next_session_entry_t * next_session_manager_find_by_address( next_session_manager_t * session_manager, const next_address_t * address )
+{
+    next_session_manager_verify_sentinels( session_manager );
+    next_assert( address );
+    const int index = next_session_manager_find_index_by_address( session_manager, address );
+    return ( index != -1 ) ? &session_manager->entries[index] : NULL;
+}
+
+next_session_entry_t * next_session_manager_find_by_session_id( next_session_manager_t * session_manager, uint64_t session_id )
+{
+    next_session_manager_verify_sentinels( session_manager );
+    next_assert( session_id );
+    if ( session_id == 0 )
+    {
+        return NULL;
+    }
+    const uint32_t hash = next_session_id_hash( session_id );
+    int probe = -1;
+    int index;
+    while ( ( index = next_hash_index_probe( &session_manager->session_id_index, hash, &probe ) ) != -1 )
+    {
+        if ( session_id == session_manager->session_ids[index] )
+        {
+            return &session_manager->entries[index];
+        }
+    }
+    return NULL;
+}
+
+int next_session_manager_num_entries( next_session_manager_t * session_manager )
+{
+    next_session_manager_verify_sentinels( session_manager );
+    int num_entries = 0;
+    const int max_index = session_manager->max_entry_index;
+    for ( int i = 0; i <= max_index; ++i )
+    {
+        if ( session_manager->session_ids[i] != 0 )
+        {
+            num_entries++;
+        }
+    }
+    return num_entries;
+}
+
+// ---------------------------------------------------------------
+
+struct NextBackendSessionUpdateResponsePacket
+{
+    uint64_t session_id;
+    uint32_t slice_number;
+    int session_data_bytes;
+    uint8_t session_data[NEXT_MAX_SESSION_DATA_BYTES];
+    uint8_t response_type;
+    bool near_relays_changed;
+    int num_near_relays;
+    uint64_t near_relay_ids[NEXT_MAX_NEAR_RELAYS];
+    next_address_t near_relay_addresses[NEXT_MAX_NEAR_RELAYS];
+    int num_tokens;
+    uint8_t tokens[NEXT_MAX_TOKENS*NEXT_ENCRYPTED_ROUTE_TOKEN_BYTES];
+    bool multipath;
+    bool committed;
+    bool has_debug;
+    char debug[NEXT_MAX_SESSION_DEBUG];
+    bool dont_ping_near_relays;
+    bool exclude_near_relays;
+    bool near_relay_excluded[NEXT_MAX_NEAR_RELAYS];
+    bool high_frequency_pings;
+
+    NextBackendSessionUpdateResponsePacket()
+    {
+        memset( this, 0, sizeof(NextBackendSessionUpdateResponsePacket) );
+    }
+
+    template <typename Stream> bool Serialize( Stream & stream )
+    {
+        serialize_uint64( stream, session_id );
+
+        serialize_uint32( stream, slice_number );
+
+        serialize_int( stream, session_data_bytes, 0, NEXT_MAX_SESSION_DATA_BYTES );
+        if ( session_data_bytes > 0 )
+        {
+            serialize_bytes( stream, session_data, session_data_bytes );
+        }
+
+        serialize_int( stream, response_type, 0, NEXT_UPDATE_TYPE_CONTINUE );
+
+        serialize_bool( stream, near_relays_changed );
+
+        if ( near_relays_changed )
+        {
+            serialize_int( stream, num_near_relays, 0, NEXT_MAX_NEAR_RELAYS );
+            for ( int i = 0; i < num_near_relays; ++i )
+            {
+                serialize_uint64( stream, near_relay_ids[i] );
+                serialize_address( stream, near_relay_addresses[i] );
+            }
+        }
+
+        if ( response_type != NEXT_UPDATE_TYPE_DIRECT )
+        {
+            serialize_bool( stream, multipath );
+            serialize_bool( stream, committed );
+            serialize_int( stream, num_tokens, 0, NEXT_MAX_TOKENS );
+        }
+
+        if ( response_type == NEXT_UPDATE_TYPE_ROUTE )
+        {
+            serialize_bytes( stream, tokens, num_tokens * NEXT_ENCRYPTED_ROUTE_TOKEN_BYTES );
+        }
+
+        if ( response_type == NEXT_UPDATE_TYPE_CONTINUE )
+        {
+            serialize_bytes( stream, tokens, num_tokens * NEXT_ENCRYPTED_CONTINUE_TOKEN_BYTES );
+        }
+
+        serialize_bool( stream, has_debug );
+        if ( has_debug )
+        {
+            serialize_string( stream, debug, NEXT_MAX_SESSION_DEBUG );
+        }
+
+        serialize_bool( stream, dont_ping_near_relays );
+        if ( !dont_ping_near_relays )
+        {
+            serialize_bool( stream, exclude_near_relays );
+            if ( exclude_near_relays )
+            {
+                for ( int i = 0; i < NEXT_MAX_NEAR_RELAYS; ++i )
+                {
+                    serialize_bool( stream, near_relay_excluded[i] );
+                }
+            }
+
+            serialize_bool( stream, high_frequency_pings );
+        }
+
+        return true;
+    }
+};
+
+// ---------------------------------------------------------------
+
+int next_write_backend_packet( uint8_t packet_id, void * packet_object, uint8_t * packet_data, int * packet_bytes, const int * signed_packet, const uint8_t * sign_private_key, const uint8_t * magic, const uint8_t * from_address, int from_address_bytes, uint16_t from_port, const uint8_t * to_address, int to_address_bytes, uint16_t to_port )
+{
+    next_assert( packet_object );
+    next_assert( packet_data );
+    next_assert( packet_bytes );
+
+    next::WriteStream stream( packet_data, NEXT_MAX_PACKET_BYTES );
+
+    typedef next::WriteStream Stream;
+
+    serialize_bits( stream, packet_id, 8 );
+
+    uint8_t dummy = 0;
+    for ( int i = 0; i < 15; ++i )
+    {
+        serialize_bits( stream, dummy, 8 );
+    }
+
+    switch ( packet_id )
+    {
+        case NEXT_BACKEND_SERVER_INIT_REQUEST_PACKET:
+        {
+            NextBackendServerInitRequestPacket * packet = (NextBackendServerInitRequestPacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
+
+        case NEXT_BACKEND_SERVER_INIT_RESPONSE_PACKET:
+        {
+            NextBackendServerInitResponsePacket * packet = (NextBackendServerInitResponsePacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
+
+        case NEXT_BACKEND_SERVER_UPDATE_REQUEST_PACKET:
+        {
+            NextBackendServerUpdateRequestPacket * packet = (NextBackendServerUpdateRequestPacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
+
+        case NEXT_BACKEND_SERVER_UPDATE_RESPONSE_PACKET:
+        {
+            NextBackendServerUpdateResponsePacket * packet = (NextBackendServerUpdateResponsePacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
+
+        case NEXT_BACKEND_SESSION_UPDATE_REQUEST_PACKET:
+        {
+            NextBackendSessionUpdateRequestPacket * packet = (NextBackendSessionUpdateRequestPacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
+
+        case NEXT_BACKEND_SESSION_UPDATE_RESPONSE_PACKET:
+        {
+            NextBackendSessionUpdateResponsePacket * packet = (NextBackendSessionUpdateResponsePacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
+
+        case NEXT_BACKEND_MATCH_DATA_REQUEST_PACKET:
+        {
+            NextBackendMatchDataRequestPacket * packet = (NextBackendMatchDataRequestPacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
+
+        case NEXT_BACKEND_MATCH_DATA_RESPONSE_PACKET:
+        {
+            NextBackendMatchDataResponsePacket * packet = (NextBackendMatchDataResponsePacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
+
+        default:
+            return NEXT_ERROR;
+    }
+
+    stream.Flush();
+
+    *packet_bytes = stream.GetBytesProcessed();
+
+    next_assert( *packet_bytes >= 0 );
+    next_assert( *packet_bytes < NEXT_MAX_PACKET_BYTES );
+
+    if ( signed_packet && signed_packet[packet_id] )
+    {
+        next_assert( sign_private_key );
+        next_crypto_sign_state_t state;
+        next_crypto_sign_init( &state );
+        next_crypto_sign_update( &state, packet_data, 1 );
+        next_crypto_sign_update( &state, packet_data + 16, size_t(*packet_bytes) - 16 );
+        next_crypto_sign_final_create( &state, packet_data + *packet_bytes, NULL, sign_private_key );
+        *packet_bytes += NEXT_CRYPTO_SIGN_BYTES;
+    }
+
+    *packet_bytes += 2;
+
+    next_generate_chonkle( packet_data + 1, magic, from_address, from_address_bytes, from_port, to_address, to_address_bytes, to_port, *packet_bytes );
+    next_generate_pittle( packet_data + *packet_bytes - 2, from_address, from_address_bytes, from_port, to_address, to_address_bytes, to_port, *packet_bytes );
+
+    return NEXT_OK;
+}
+
+int next_read_backend_packet( uint8_t packet_id, uint8_t * packet_data, int begin, int end, void * packet_object, const int * signed_packet, const uint8_t * sign_public_key )
+{
+    next_assert( packet_data );
+    next_assert( packet_object );
+
+    next::ReadStream stream( packet_data, end );
+
+    uint8_t dummy[begin];
+    serialize_bytes( stream, dummy, begin );
+
+    if ( signed_packet && signed_packet[packet_id] )
+    {
+        next_assert( sign_public_key );
+
+	    const int packet_bytes = end - begin;
+
+        if ( packet_bytes < int( NEXT_CRYPTO_SIGN_BYTES ) )
+        {
+            next_printf( NEXT_LOG_LEVEL_DEBUG, "signed backend packet is too small to be valid" );
+            return NEXT_ERROR;
+        }
+
+        next_crypto_sign_state_t state;
+        next_crypto_sign_init( &state );
+        next_crypto_sign_update( &state, &packet_id, 1 );
+        next_crypto_sign_update( &state, packet_data + begin, packet_bytes - NEXT_CRYPTO_SIGN_BYTES );
+        if ( next_crypto_sign_final_verify( &state, packet_data + end - NEXT_CRYPTO_SIGN_BYTES, sign_public_key ) != 0 )
+        {
+            next_printf( NEXT_LOG_LEVEL_DEBUG, "signed backend packet did not verify" );
+            return NEXT_ERROR;
+        }
+	}
+
+    switch ( packet_id )
+    {
+        case NEXT_BACKEND_SERVER_INIT_REQUEST_PACKET:
+        {
+            NextBackendServerInitRequestPacket * packet = (NextBackendServerInitRequestPacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
+
+        case NEXT_BACKEND_SERVER_INIT_RESPONSE_PACKET:
+        {
+            NextBackendServerInitResponsePacket * packet = (NextBackendServerInitResponsePacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
+
+        case NEXT_BACKEND_SERVER_UPDATE_REQUEST_PACKET:
+        {
+            NextBackendServerUpdateRequestPacket * packet = (NextBackendServerUpdateRequestPacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
+
+        case NEXT_BACKEND_SERVER_UPDATE_RESPONSE_PACKET:
+        {
+            NextBackendServerUpdateResponsePacket * packet = (NextBackendServerUpdateResponsePacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
 
-void next_session_entry_initialize_sentinels( next_session_entry_t * entry )
-{
-    (void) entry;
-    next_assert( entry );
-    NEXT_INITIALIZE_SENTINEL( entry, 0 )
-    NEXT_INITIALIZE_SENTINEL( entry, 1 )
-    NEXT_INITIALIZE_SENTINEL( entry, 2 )
-    NEXT_INITIALIZE_SENTINEL( entry, 3 )
-    NEXT_INITIALIZE_SENTINEL( entry, 4 )
-    NEXT_INITIALIZE_SENTINEL( entry, 5 )
-    NEXT_INITIALIZE_SENTINEL( entry, 6 )
-    NEXT_INITIALIZE_SENTINEL( entry, 7 )
-    NEXT_INITIALIZE_SENTINEL( entry, 8 )
-    NEXT_INITIALIZE_SENTINEL( entry, 9 )
-    NEXT_INITIALIZE_SENTINEL( entry, 10 )
-    NEXT_INITIALIZE_SENTINEL( entry, 11 )
-    NEXT_INITIALIZE_SENTINEL( entry, 12 )
-    NEXT_INITIALIZE_SENTINEL( entry, 13 )
-    NEXT_INITIALIZE_SENTINEL( entry, 14 )
-    NEXT_INITIALIZE_SENTINEL( entry, 15 )
-    NEXT_INITIALIZE_SENTINEL( entry, 16 )
-    NEXT_INITIALIZE_SENTINEL( entry, 17 )
-    NEXT_INITIALIZE_SENTINEL( entry, 18 )
-    NEXT_INITIALIZE_SENTINEL( entry, 19 )
-    NEXT_INITIALIZE_SENTINEL( entry, 20 )
-    NEXT_INITIALIZE_SENTINEL( entry, 21 )
-    NEXT_INITIALIZE_SENTINEL( entry, 22 )
-    NEXT_INITIALIZE_SENTINEL( entry, 23 )
-    NEXT_INITIALIZE_SENTINEL( entry, 24 )
-    NEXT_INITIALIZE_SENTINEL( entry, 25 )
-    NEXT_INITIALIZE_SENTINEL( entry, 26 )
-    NEXT_INITIALIZE_SENTINEL( entry, 27 )
-    NEXT_INITIALIZE_SENTINEL( entry, 28 )
-    NEXT_INITIALIZE_SENTINEL( entry, 29 )
-    NEXT_INITIALIZE_SENTINEL( entry, 30 )
+        case NEXT_BACKEND_SESSION_UPDATE_REQUEST_PACKET:
+        {
+            NextBackendSessionUpdateRequestPacket * packet = (NextBackendSessionUpdateRequestPacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
+
+        case NEXT_BACKEND_SESSION_UPDATE_RESPONSE_PACKET:
+        {
+            NextBackendSessionUpdateResponsePacket * packet = (NextBackendSessionUpdateResponsePacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
+
+        case NEXT_BACKEND_MATCH_DATA_REQUEST_PACKET:
+        {
+            NextBackendMatchDataRequestPacket * packet = (NextBackendMatchDataRequestPacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
+
+        case NEXT_BACKEND_MATCH_DATA_RESPONSE_PACKET:
+        {
+            NextBackendMatchDataResponsePacket * packet = (NextBackendMatchDataResponsePacket*) packet_object;
+            if ( !packet->Serialize( stream ) )
+                return NEXT_ERROR;
+        }
+        break;
+
+        default:
+            return NEXT_ERROR;
+    }
+
+    return (int) packet_id;
 }
 
-void next_session_entry_verify_sentinels( next_session_entry_t * entry )
-{
-    (void) entry;
-    next_assert( entry );
-    NEXT_VERIFY_SENTINEL( entry, 0 )
-    NEXT_VERIFY_SENTINEL( entry, 1 )
-    NEXT_VERIFY_SENTINEL( entry, 2 )
-    NEXT_VERIFY_SENTINEL( entry, 3 )
-    NEXT_VERIFY_SENTINEL( entry, 4 )
-    NEXT_VERIFY_SENTINEL( entry, 5 )
-    NEXT_VERIFY_SENTINEL( entry, 6 )
-    NEXT_VERIFY_SENTINEL( entry, 7 )
-    NEXT_VERIFY_SENTINEL( entry, 8 )
-    NEXT_VERIFY_SENTINEL( entry, 9 )
-    NEXT_VERIFY_SENTINEL( entry, 10 )
-    NEXT_VERIFY_SENTINEL( entry, 11 )
-    NEXT_VERIFY_SENTINEL( entry, 12 )
-    NEXT_VERIFY_SENTINEL( entry, 13 )
-    NEXT_VERIFY_SENTINEL( entry, 14 )
-    NEXT_VERIFY_SENTINEL( entry, 15 )
-    NEXT_VERIFY_SENTINEL( entry, 16 )
-    NEXT_VERIFY_SENTINEL( entry, 17 )
-    NEXT_VERIFY_SENTINEL( entry, 18 )
-    NEXT_VERIFY_SENTINEL( entry, 19 )
-    NEXT_VERIFY_SENTINEL( entry, 20 )
-    NEXT_VERIFY_SENTINEL( entry, 21 )
-    NEXT_VERIFY_SENTINEL( entry, 22 )
-    NEXT_VERIFY_SENTINEL( entry, 23 )
-    NEXT_VERIFY_SENTINEL( entry, 24 )
-    NEXT_VERIFY_SENTINEL( entry, 25 )
-    NEXT_VERIFY_SENTINEL( entry, 26 )
-    NEXT_VERIFY_SENTINEL( entry, 27 )
-    NEXT_VERIFY_SENTINEL( entry, 28 )
-    NEXT_VERIFY_SENTINEL( entry, 29 )
-    NEXT_VERIFY_SENTINEL( entry, 30 )
-    next_replay_protection_verify_sentinels( &entry->payload_replay_protection );
-    next_replay_protection_verify_sentinels( &entry->special_replay_protection );
-    next_replay_protection_verify_sentinels( &entry->internal_replay_protection );
-    next_packet_loss_tracker_verify_sentinels( &entry->packet_loss_tracker );
-    next_out_of_order_tracker_verify_sentinels( &entry->out_of_order_tracker );
-    next_jitter_tracker_verify_sentinels( &entry->jitter_tracker );
-}
+// ---------------------------------------------------------------
+
+#define NEXT_SERVER_COMMAND_UPGRADE_SESSION             			0
+#define NEXT_SERVER_COMMAND_TAG_SESSION                 			1
+#define NEXT_SERVER_COMMAND_SERVER_EVENT                			2
+#define NEXT_SERVER_COMMAND_MATCH_DATA                  			3
+#define NEXT_SERVER_COMMAND_FLUSH                       			4
+
+struct next_server_command_t
+{
+    int type;
+};
+
+struct next_server_command_upgrade_session_t : public next_server_command_t
+{
+    next_address_t address;
+    uint64_t session_id;
+    uint64_t user_hash;
+};
+
+struct next_server_command_tag_session_t : public next_server_command_t
+{
+    next_address_t address;
+    uint64_t tags[NEXT_MAX_TAGS];
+    int num_tags;
+};
+
+struct next_server_command_server_event_t : public next_server_command_t
+{
+    next_address_t address;
+    uint64_t server_events;
+};
+
+struct next_server_command_match_data_t : public next_server_command_t
+{
+    next_address_t address;
+    uint64_t match_id;
+    double match_values[NEXT_MAX_MATCH_VALUES];
+    int num_match_values;
+};
+
+struct next_server_command_flush_t : public next_server_command_t
+{
+    // ...
+};
+
+// ---------------------------------------------------------------
+
+#define NEXT_SERVER_NOTIFY_PACKET_RECEIVED                      0
+#define NEXT_SERVER_NOTIFY_PENDING_SESSION_TIMED_OUT            1
+#define NEXT_SERVER_NOTIFY_SESSION_UPGRADED                     2
+#define NEXT_SERVER_NOTIFY_SESSION_TIMED_OUT                    3
+#define NEXT_SERVER_NOTIFY_INIT_TIMED_OUT                       4
+#define NEXT_SERVER_NOTIFY_READY                        		5
+#define NEXT_SERVER_NOTIFY_FLUSH_FINISHED                  		6
+#define NEXT_SERVER_NOTIFY_MAGIC_UPDATED                        7
+
+struct next_server_notify_t
+{
+    int type;
+};
+
+struct next_server_notify_packet_received_t : public next_server_notify_t
+{
+    next_address_t from;
+    int packet_bytes;
+    uint8_t packet_data[NEXT_MTU];
+};
+
+struct next_server_notify_pending_session_cancelled_t : public next_server_notify_t
+{
+    next_address_t address;
+    uint64_t session_id;
+};
+
+struct next_server_notify_pending_session_timed_out_t : public next_server_notify_t
+{
+    next_address_t address;
+    uint64_t session_id;
+};
+
+struct next_server_notify_session_upgraded_t : public next_server_notify_t
+{
+    next_address_t address;
+    uint64_t session_id;
+    next_session_send_state_t * send_state;
+};
+
+struct next_server_notify_session_timed_out_t : public next_server_notify_t
+{
+    next_address_t address;
+    uint64_t session_id;
+};
+
+struct next_server_notify_init_timed_out_t : public next_server_notify_t
+{
+    // ...
+};
+
+struct next_server_notify_ready_t : public next_server_notify_t
+{
+    char datacenter_name[NEXT_MAX_DATACENTER_NAME_LENGTH];
+};
+
+struct next_server_notify_flush_finished_t : public next_server_notify_t
+{
+    // ...
+};
+
+struct next_server_notify_magic_updated_t : public next_server_notify_t
+{
+    uint8_t current_magic[8];
+};
+
+// ---------------------------------------------------------------
+
+struct next_server_receive_worker_t;
+
+struct next_server_internal_t
+{
+    NEXT_DECLARE_SENTINEL(0)
+
+    next_server_callbacks_t callbacks;
+    void * context;
+    int state;
+    uint64_t customer_id;
+    uint64_t datacenter_id;
+    char datacenter_name[NEXT_MAX_DATACENTER_NAME_LENGTH];
+    char autodetect_input[NEXT_MAX_DATACENTER_NAME_LENGTH];
+    char autodetect_datacenter[NEXT_MAX_DATACENTER_NAME_LENGTH];
+    bool autodetected_datacenter;
+
+    NEXT_DECLARE_SENTINEL(1)
+
+    uint8_t customer_private_key[NEXT_CRYPTO_SIGN_SECRETKEYBYTES];
+
+    NEXT_DECLARE_SENTINEL(2)
+
+    bool valid_customer_private_key;
+    bool no_datacenter_specified;
+    uint64_t upgrade_sequence;
+    double next_resolve_hostname_time;
+    next_address_t backend_address;
+    next_address_t server_address;
+    next_address_t bind_address;
+    next_queue_t * command_queue;
+    next_queue_t * notify_queue;
+    next_platform_mutex_t session_mutex;
+    next_platform_mutex_t command_mutex;
+    next_platform_mutex_t notify_mutex;
+    next_platform_socket_t * socket;
+    next_pending_session_manager_t * pending_session_manager;
+    next_session_manager_t * session_manager;
+
+    NEXT_DECLARE_SENTINEL(3)
+
+    bool resolving_hostname;
+    bool resolve_hostname_finished;
+    double resolve_hostname_start_time;
+    next_address_t resolve_hostname_result;
+    next_platform_mutex_t resolve_hostname_mutex;
+    next_platform_thread_t * resolve_hostname_thread;
+
+    NEXT_DECLARE_SENTINEL(4)
+
+    bool autodetecting;
+    bool autodetect_finished;
+    bool autodetect_actually_did_something;
+    bool autodetect_succeeded;
+    double autodetect_start_time;
+    char autodetect_result[NEXT_MAX_DATACENTER_NAME_LENGTH];
+    next_platform_mutex_t autodetect_mutex;
+    next_platform_thread_t * autodetect_thread;
+
+    NEXT_DECLARE_SENTINEL(5)
+
+    uint8_t server_kx_public_key[NEXT_CRYPTO_KX_PUBLICKEYBYTES];
+    uint8_t server_kx_private_key[NEXT_CRYPTO_KX_SECRETKEYBYTES];
+    uint8_t server_route_public_key[NEXT_CRYPTO_BOX_PUBLICKEYBYTES];
+    uint8_t server_route_private_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+
+    NEXT_DECLARE_SENTINEL(6)
+
+    uint8_t upcoming_magic[8];
+    uint8_t current_magic[8];
+    uint8_t previous_magic[8];
 
-struct next_session_manager_t
-{
-    NEXT_DECLARE_SENTINEL(0)
+    NEXT_DECLARE_SENTINEL(7)
 
-    void * context;
-    int size;
-    int max_entry_index;
-    uint64_t * session_ids;
-    next_address_t * addresses;
-    next_session_entry_t * entries;
+    uint64_t server_init_request_id;
+    double server_init_resend_time;
+    double server_init_timeout_time;
+    bool received_init_response;
 
-    NEXT_DECLARE_SENTINEL(1)
+    NEXT_DECLARE_SENTINEL(8)
+
+    uint64_t server_update_request_id;
+    double server_update_last_time;
+    double server_update_resend_time;
+    int server_update_num_sessions;
+    bool server_update_first;
+
+    NEXT_DECLARE_SENTINEL(9)
+
+    next_platform_mutex_t quit_mutex;
+    bool quit;
+
+    NEXT_DECLARE_SENTINEL(10)
+
+    bool flushing;
+    bool flushed;
+    uint64_t num_session_updates_to_flush;
+    uint64_t num_match_data_to_flush;
+    uint64_t num_flushed_session_updates;
+    uint64_t num_flushed_match_data;
+
+    NEXT_DECLARE_SENTINEL(11)
+
+    int num_receive_workers;
+    next_server_receive_worker_t * receive_workers[NEXT_MAX_SERVER_RECEIVE_THREADS];
+    next_platform_mutex_t receive_event_mutex;
+    next_queue_t * receive_event_queue;
+
+    NEXT_DECLARE_SENTINEL(12)
+
+    double maintenance_last_time;
+    bool maintenance_update_route;
+    bool maintenance_update_sessions;
+    bool maintenance_update_trackers;
+    bool maintenance_update_backend;
+    next_timer_wheel_t * session_timers;
+    uint64_t session_timers_num_expands;
+
+    NEXT_DECLARE_SENTINEL(13)
 };
 
-void next_session_manager_initialize_sentinels( next_session_manager_t * session_manager )
+void next_server_internal_initialize_sentinels( next_server_internal_t * server )
 {
-    (void) session_manager;
-    next_assert( session_manager );
-    NEXT_INITIALIZE_SENTINEL( session_manager, 0 )
-    NEXT_INITIALIZE_SENTINEL( session_manager, 1 )
+    (void) server;
+    next_assert( server );
+    NEXT_INITIALIZE_SENTINEL( server, 0 )
+    NEXT_INITIALIZE_SENTINEL( server, 1 )
+    NEXT_INITIALIZE_SENTINEL( server, 2 )
+    NEXT_INITIALIZE_SENTINEL( server, 3 )
+    NEXT_INITIALIZE_SENTINEL( server, 4 )
+    NEXT_INITIALIZE_SENTINEL( server, 5 )
+    NEXT_INITIALIZE_SENTINEL( server, 6 )
+    NEXT_INITIALIZE_SENTINEL( server, 7 )
+    NEXT_INITIALIZE_SENTINEL( server, 8 )
+    NEXT_INITIALIZE_SENTINEL( server, 9 )
+    NEXT_INITIALIZE_SENTINEL( server, 10 )
+    NEXT_INITIALIZE_SENTINEL( server, 11 )
+    NEXT_INITIALIZE_SENTINEL( server, 12 )
+    NEXT_INITIALIZE_SENTINEL( server, 13 )
 }
 
-void next_session_manager_verify_sentinels( next_session_manager_t * session_manager )
+void next_server_internal_verify_sentinels( next_server_internal_t * server )
 {
-    (void) session_manager;
-#if NEXT_ENABLE_MEMORY_CHECKS
-    next_assert( session_manager );
-    NEXT_VERIFY_SENTINEL( session_manager, 0 )
-    NEXT_VERIFY_SENTINEL( session_manager, 1 )
-    const int size = session_manager->size;
-    for ( int i = 0; i < size; ++i )
-    {
-        if ( session_manager->session_ids[i] != 0 )
-        {
-            next_session_entry_verify_sentinels( &session_manager->entries[i] );
-        }
-    }
-#endif // #if NEXT_ENABLE_MEMORY_CHECKS
+    (void) server;
+    next_assert( server );
+    NEXT_VERIFY_SENTINEL( server, 0 )
+    NEXT_VERIFY_SENTINEL( server, 1 )
+    NEXT_VERIFY_SENTINEL( server, 2 )
+    NEXT_VERIFY_SENTINEL( server, 3 )
+    NEXT_VERIFY_SENTINEL( server, 4 )
+    NEXT_VERIFY_SENTINEL( server, 5 )
+    NEXT_VERIFY_SENTINEL( server, 6 )
+    NEXT_VERIFY_SENTINEL( server, 7 )
+    NEXT_VERIFY_SENTINEL( server, 8 )
+    NEXT_VERIFY_SENTINEL( server, 9 )
+    NEXT_VERIFY_SENTINEL( server, 10 )
+    NEXT_VERIFY_SENTINEL( server, 11 )
+    NEXT_VERIFY_SENTINEL( server, 12 )
+    NEXT_VERIFY_SENTINEL( server, 13 )
+    if ( server->session_manager )
+        next_session_manager_verify_sentinels( server->session_manager );
+    if ( server->pending_session_manager )
+        next_pending_session_manager_verify_sentinels( server->pending_session_manager );
 }
 
-void next_session_manager_destroy( next_session_manager_t * session_manager );
+// ---------------------------------------------------------------
 
-next_session_manager_t * next_session_manager_create( void * context, int initial_size )
+void next_server_internal_deliver_payload( next_server_internal_t * server, const next_address_t * from, const uint8_t * payload_data, int payload_bytes )
 {
-    next_session_manager_t * session_manager = (next_session_manager_t*) next_malloc( context, sizeof(next_session_manager_t) );
+    next_assert( server );
+    next_assert( from );
+    next_assert( payload_data );
+    next_assert( payload_bytes > 0 );
+    next_assert( payload_bytes <= NEXT_MTU );
 
-    next_assert( session_manager );
-    if ( !session_manager )
-        return NULL;
+    if ( server->callbacks.payload_receive_callback )
+    {
+        void * callback_data = server->callbacks.payload_receive_callback_data;
+        if ( server->callbacks.payload_receive_callback( callback_data, from, payload_data, payload_bytes ) )
+            return;
+    }
 
-    memset( session_manager, 0, sizeof(next_session_manager_t) );
+    next_server_notify_packet_received_t * notify = (next_server_notify_packet_received_t*) next_malloc( server->context, sizeof( next_server_notify_packet_received_t ) );
+    notify->type = NEXT_SERVER_NOTIFY_PACKET_RECEIVED;
+    notify->from = *from;
+    notify->packet_bytes = payload_bytes;
+    memcpy( notify->packet_data, payload_data, size_t(payload_bytes) );
+    {
+        next_platform_mutex_guard( &server->notify_mutex );
+        next_queue_push( server->notify_queue, notify );
+    }
+}
 
-    next_session_manager_initialize_sentinels( session_manager );
+void next_server_internal_wake_session( next_server_internal_t * server, next_session_entry_t * entry, double time )
+{
+    // brings the session's maintenance timer forward to time, for state changes that give it work to do sooner
 
-    session_manager->context = context;
-    session_manager->size = initial_size;
-    session_manager->session_ids = (uint64_t*) next_malloc( context, size_t(initial_size) * 8 );
-    session_manager->addresses = (next_address_t*) next_malloc( context, size_t(initial_size) * sizeof(next_address_t) );
-    session_manager->entries = (next_session_entry_t*) next_malloc( context, size_t(initial_size) * sizeof(next_session_entry_t) );
+    next_assert( server );
+    next_assert( entry );
+    next_assert( server->session_timers );
 
-    next_assert( session_manager->session_ids );
-    next_assert( session_manager->addresses );
-    next_assert( session_manager->entries );
+    const int index = int( entry - server->session_manager->entries );
 
-    if ( session_manager->session_ids == NULL || session_manager->addresses == NULL || session_manager->entries == NULL )
+    next_assert( index >= 0 );
+    next_assert( index < server->session_manager->size );
+
+    if ( !next_timer_wheel_expand( server->session_timers, server->session_manager->size ) )
     {
-        next_session_manager_destroy( session_manager );
-        return NULL;
+        next_printf( NEXT_LOG_LEVEL_ERROR, "server could not expand session timers" );
+        return;
     }
 
-    memset( session_manager->session_ids, 0, size_t(initial_size) * 8 );
-    memset( session_manager->addresses, 0, size_t(initial_size) * sizeof(next_address_t) );
-    memset( session_manager->entries, 0, size_t(initial_size) * sizeof(next_session_entry_t) );
+    next_timer_wheel_schedule_earliest( server->session_timers, index, time );
+}
 
-    next_session_manager_verify_sentinels( session_manager );
+// ---------------------------------------------------------------
 
-    return session_manager;
-}
+/*
+    Optional receive workers for the server (next_config_t::server_receive_threads).
 
-void next_session_manager_destroy( next_session_manager_t * session_manager )
+    The internal server thread stays the single owner of the socket, the backend and all session control state. It runs
+    the packet filters, then hands client payload packets (client to server, direct and passthrough) to the worker that owns
+    the session, worker[ hash(session id) % N ]. Each worker owns a disjoint partition of sessions: it verifies headers, applies
+    payload replay protection, runs the loss/out of order/jitter trackers and delivers payloads, so both paths of a multipath
+    session always land on the same worker.
+
+    The internal thread publishes the route keys a worker needs through the worker command queue whenever they change.
+    Workers report pending route promotions and tracker stats back through the receive event queue, and the internal thread
+    applies them to the session entry, so there is still only one writer for all session state.
+
+    IMPORTANT: With receive workers enabled, payload_receive_callback is called from the worker threads, concurrently.
+*/
+
+struct next_server_receive_route_t
 {
-    next_session_manager_verify_sentinels( session_manager );
+    bool has_pending_route;
+    bool has_current_route;
+    bool has_previous_route;
+    uint8_t pending_route_session_version;
+    uint8_t pending_route_private_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+    uint8_t current_route_private_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+    uint8_t previous_route_private_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+};
 
-    next_free( session_manager->context, session_manager->session_ids );
-    next_free( session_manager->context, session_manager->addresses );
-    next_free( session_manager->context, session_manager->entries );
+struct next_server_receive_session_t
+{
+    uint64_t session_id;
+    next_address_t address;
+    uint8_t open_session_sequence;
+    bool promote_requested;
+    next_server_receive_route_t route;
+    next_replay_protection_t payload_replay_protection;
+    next_packet_loss_tracker_t packet_loss_tracker;
+    next_out_of_order_tracker_t out_of_order_tracker;
+    next_jitter_tracker_t jitter_tracker;
+};
 
-    clear_and_free( session_manager->context, session_manager, sizeof(next_session_manager_t) );
-}
+struct next_server_receive_packet_t
+{
+    uint8_t packet_type;
+    uint64_t session_id;
+    next_address_t from;
+    int packet_bytes;
+    uint8_t packet_data[NEXT_MAX_PACKET_BYTES];
+};
 
-bool next_session_manager_expand( next_session_manager_t * session_manager )
+#define NEXT_SERVER_RECEIVE_COMMAND_UPDATE_SESSION                      0
+#define NEXT_SERVER_RECEIVE_COMMAND_REMOVE_SESSION                      1
+
+struct next_server_receive_command_t
 {
-    next_session_manager_verify_sentinels( session_manager );
+    int type;
+};
 
-    int new_size = session_manager->size * 2;
+struct next_server_receive_command_update_session_t : public next_server_receive_command_t
+{
+    uint64_t session_id;
+    next_address_t address;
+    uint8_t open_session_sequence;
+    next_server_receive_route_t route;
+};
 
-    uint64_t * new_session_ids = (uint64_t*) next_malloc( session_manager->context, size_t(new_size) * 8 );
-    next_address_t * new_addresses = (next_address_t*) next_malloc( session_manager->context, size_t(new_size) * sizeof(next_address_t) );
-    next_session_entry_t * new_entries = (next_session_entry_t*) next_malloc( session_manager->context, size_t(new_size) * sizeof(next_session_entry_t) );
+struct next_server_receive_command_remove_session_t : public next_server_receive_command_t
+{
+    uint64_t session_id;
+};
 
-    next_assert( session_manager->session_ids );
-    next_assert( session_manager->addresses );
-    next_assert( session_manager->entries );
+#define NEXT_SERVER_RECEIVE_EVENT_PROMOTE_ROUTE                         0
+#define NEXT_SERVER_RECEIVE_EVENT_TRACKER_STATS                         1
 
-    if ( session_manager->session_ids == NULL || session_manager->addresses == NULL || session_manager->entries == NULL )
-    {
-        next_free( session_manager->context, new_session_ids );
-        next_free( session_manager->context, new_addresses );
-        next_free( session_manager->context, new_entries );
-        return false;
-    }
+#define NEXT_SERVER_RECEIVE_TRACKER_STATS_BATCH                        64
+
+struct next_server_receive_event_t
+{
+    int type;
+};
+
+struct next_server_receive_event_promote_route_t : public next_server_receive_event_t
+{
+    uint64_t session_id;
+    uint8_t session_version;
+};
 
-    memset( new_session_ids, 0, size_t(new_size) * 8 );
-    memset( new_addresses, 0, size_t(new_size) * sizeof(next_address_t) );
-    memset( new_entries, 0, size_t(new_size) * sizeof(next_session_entry_t) );
+struct next_server_receive_event_tracker_stats_t : public next_server_receive_event_t
+{
+    int num_sessions;
+    uint64_t session_ids[NEXT_SERVER_RECEIVE_TRACKER_STATS_BATCH];
+    int packets_lost[NEXT_SERVER_RECEIVE_TRACKER_STATS_BATCH];
+    uint64_t packets_out_of_order[NEXT_SERVER_RECEIVE_TRACKER_STATS_BATCH];
+    float jitter[NEXT_SERVER_RECEIVE_TRACKER_STATS_BATCH];
+};
 
-    int index = 0;
-    const int current_size = session_manager->size;
-    for ( int i = 0; i < current_size; ++i )
-    {
-        if ( session_manager->session_ids[i] != 0 )
-        {
-            memcpy( &new_session_ids[index], &session_manager->session_ids[i], 8 );
-            memcpy( &new_addresses[index], &session_manager->addresses[i], sizeof(next_address_t) );
-            memcpy( &new_entries[index], &session_manager->entries[i], sizeof(next_session_entry_t) );
-            index++;
-        }
-    }
+struct next_server_receive_worker_t
+{
+    NEXT_DECLARE_SENTINEL(0)
 
-    next_free( session_manager->context, session_manager->session_ids );
-    next_free( session_manager->context, session_manager->addresses );
-    next_free( session_manager->context, session_manager->entries );
+    void * context;
+    next_server_internal_t * server;
+    int index;
+    next_platform_thread_t * thread;
+    next_platform_semaphore_t semaphore;
+    uint32_t waiting;
+    uint32_t commands_pending;
+    uint32_t quit;
 
-    session_manager->session_ids = new_session_ids;
-    session_manager->addresses = new_addresses;
-    session_manager->entries = new_entries;
-    session_manager->size = new_size;
-    session_manager->max_entry_index = index - 1;
+    NEXT_DECLARE_SENTINEL(1)
 
-    return true;
-}
+    // single producer (internal server thread), single consumer (worker) ring of packets
 
-void next_clear_session_entry( next_session_entry_t * entry, const next_address_t * address, uint64_t session_id )
-{
-    memset( entry, 0, sizeof(next_session_entry_t) );
+    uint32_t ring_write_index;
+    uint32_t ring_read_index;
+    next_server_receive_packet_t * ring;
+    uint64_t packets_dropped;
 
-    next_session_entry_initialize_sentinels( entry );
+    NEXT_DECLARE_SENTINEL(2)
 
-    entry->address = *address;
-    entry->session_id = session_id;
+    next_platform_mutex_t command_mutex;
+    next_queue_t * command_queue;
 
-    next_replay_protection_reset( &entry->payload_replay_protection );
-    next_replay_protection_reset( &entry->special_replay_protection );
-    next_replay_protection_reset( &entry->internal_replay_protection );
+    NEXT_DECLARE_SENTINEL(3)
 
-    next_packet_loss_tracker_reset( &entry->packet_loss_tracker );
-    next_out_of_order_tracker_reset( &entry->out_of_order_tracker );
-    next_jitter_tracker_reset( &entry->jitter_tracker );
+    // sessions owned by this worker. removal swaps the last session into the hole, so the array stays dense
 
-    next_session_entry_verify_sentinels( entry );
+    int size;
+    int num_sessions;
+    next_server_receive_session_t * sessions;
+    next_hash_index_t session_id_index;
+    double next_tracker_update_time;
 
-    entry->special_send_sequence = 1;
-    entry->internal_send_sequence = 1;
+    NEXT_DECLARE_SENTINEL(4)
+};
 
-    const double current_time = next_time();
+void next_server_receive_worker_initialize_sentinels( next_server_receive_worker_t * worker )
+{
+    (void) worker;
+    next_assert( worker );
+    NEXT_INITIALIZE_SENTINEL( worker, 0 )
+    NEXT_INITIALIZE_SENTINEL( worker, 1 )
+    NEXT_INITIALIZE_SENTINEL( worker, 2 )
+    NEXT_INITIALIZE_SENTINEL( worker, 3 )
+    NEXT_INITIALIZE_SENTINEL( worker, 4 )
+}
 
-    entry->last_client_direct_ping = current_time;
-    entry->last_client_next_ping = current_time;
+void next_server_receive_worker_verify_sentinels( next_server_receive_worker_t * worker )
+{
+    (void) worker;
+    next_assert( worker );
+    NEXT_VERIFY_SENTINEL( worker, 0 )
+    NEXT_VERIFY_SENTINEL( worker, 1 )
+    NEXT_VERIFY_SENTINEL( worker, 2 )
+    NEXT_VERIFY_SENTINEL( worker, 3 )
+    NEXT_VERIFY_SENTINEL( worker, 4 )
 }
 
-next_session_entry_t * next_session_manager_add( next_session_manager_t * session_manager, const next_address_t * address, uint64_t session_id, const uint8_t * ephemeral_private_key, const uint8_t * upgrade_token, const uint64_t * tags, int num_tags )
+void next_server_receive_worker_destroy( next_server_receive_worker_t * worker );
+
+next_server_receive_worker_t * next_server_receive_worker_create( void * context, next_server_internal_t * server, int index )
 {
-    next_session_manager_verify_sentinels( session_manager );
+    next_server_receive_worker_t * worker = (next_server_receive_worker_t*) next_malloc( context, sizeof(next_server_receive_worker_t) );
+    if ( !worker )
+        return NULL;
 
-    next_assert( session_id != 0 );
-    next_assert( address );
-    next_assert( address->type != NEXT_ADDRESS_NONE );
-    next_assert( num_tags == 0 || tags );
+    memset( worker, 0, sizeof(next_server_receive_worker_t) );
 
-    // first scan existing entries and see if we can insert there
+    next_server_receive_worker_initialize_sentinels( worker );
 
-    const int size = session_manager->size;
+    worker->context = context;
+    worker->server = server;
+    worker->index = index;
+    worker->size = NEXT_INITIAL_SESSION_SIZE;
 
-    for ( int i = 0; i < size; ++i )
+    worker->ring = (next_server_receive_packet_t*) next_malloc( context, NEXT_SERVER_RECEIVE_RING_SIZE * sizeof(next_server_receive_packet_t) );
+    worker->sessions = (next_server_receive_session_t*) next_malloc( context, size_t(worker->size) * sizeof(next_server_receive_session_t) );
+    worker->command_queue = next_queue_create( context, NEXT_SERVER_RECEIVE_COMMAND_QUEUE_LENGTH );
+
+    if ( !worker->ring || !worker->sessions || !worker->command_queue )
     {
-        if ( session_manager->session_ids[i] == 0 )
-        {
-            session_manager->session_ids[i] = session_id;
-            session_manager->addresses[i] = *address;
-            next_session_entry_t * entry = &session_manager->entries[i];
-            next_clear_session_entry( entry, address, session_id );
-            memcpy( entry->ephemeral_private_key, ephemeral_private_key, NEXT_CRYPTO_SECRETBOX_KEYBYTES );
-            memcpy( entry->upgrade_token, upgrade_token, NEXT_UPGRADE_TOKEN_BYTES );
-            entry->num_tags = num_tags;
-            for ( int j = 0; j < num_tags; ++j )
-            {
-                entry->tags[j] = tags[j];
-            }
-            if ( i > session_manager->max_entry_index )
-            {
-                session_manager->max_entry_index = i;
-            }
-            return entry;
-        }
+        next_server_receive_worker_destroy( worker );
+        return NULL;
     }
 
-    // ok, we need to grow, expand and add at the end (expand compacts existing entries)
-
-    if ( !next_session_manager_expand( session_manager ) )
+    if ( !next_hash_index_create( context, &worker->session_id_index, worker->size ) )
+    {
+        next_server_receive_worker_destroy( worker );
         return NULL;
+    }
 
-    const int i = ++session_manager->max_entry_index;
+    if ( next_platform_mutex_create( &worker->command_mutex ) != NEXT_OK )
+    {
+        next_server_receive_worker_destroy( worker );
+        return NULL;
+    }
 
-    session_manager->session_ids[i] = session_id;
-    session_manager->addresses[i] = *address;
-    next_session_entry_t * entry = &session_manager->entries[i];
-    next_clear_session_entry( entry, address, session_id );
-    memcpy( entry->ephemeral_private_key, ephemeral_private_key, NEXT_CRYPTO_SECRETBOX_KEYBYTES );
-    memcpy( entry->upgrade_token, upgrade_token, NEXT_UPGRADE_TOKEN_BYTES );
-    entry->num_tags = num_tags;
-    for ( int j = 0; j < num_tags; ++j )
+    if ( next_platform_semaphore_create( &worker->semaphore ) != NEXT_OK )
     {
-        entry->tags[j] = tags[j];
+        next_server_receive_worker_destroy( worker );
+        return NULL;
     }
 
-    next_session_manager_verify_sentinels( session_manager );
+    next_server_receive_worker_verify_sentinels( worker );
 
-    return entry;
+    return worker;
 }
 
-void next_session_manager_remove_at_index( next_session_manager_t * session_manager, int index )
+void next_server_receive_worker_destroy( next_server_receive_worker_t * worker )
 {
-    next_session_manager_verify_sentinels( session_manager );
+    next_server_receive_worker_verify_sentinels( worker );
 
-    next_assert( index >= 0 );
-    next_assert( index <= session_manager->max_entry_index );
+    next_assert( worker->thread == NULL );
 
-    const int max_index = session_manager->max_entry_index;
-    session_manager->session_ids[index] = 0;
-    session_manager->addresses[index].type = NEXT_ADDRESS_NONE;
-    if ( index == max_index )
+    next_free( worker->context, worker->ring );
+    next_free( worker->context, worker->sessions );
+
+    if ( worker->command_queue )
     {
-        while ( index > 0 && session_manager->session_ids[index] == 0 )
-        {
-            index--;
-        }
-        session_manager->max_entry_index = index;
+        next_queue_destroy( worker->command_queue );
     }
 
-    next_session_manager_verify_sentinels( session_manager );
+    next_hash_index_destroy( &worker->session_id_index );
+
+    next_platform_mutex_destroy( &worker->command_mutex );
+    next_platform_semaphore_destroy( &worker->semaphore );
+
+    clear_and_free( worker->context, worker, sizeof(next_server_receive_worker_t) );
 }
 
-void next_session_manager_remove_by_address( next_session_manager_t * session_manager, const next_address_t * address )
+void next_server_receive_worker_wake( next_server_receive_worker_t * worker )
 {
-    next_session_manager_verify_sentinels( session_manager );
+    // pairs with the fence in the worker between setting waiting and checking for work, so a worker never sleeps on work
 
-    next_assert( address );
+    next_atomic_fence();
 
-    const int max_index = session_manager->max_entry_index;
-    for ( int i = 0; i <= max_index; ++i )
+    if ( next_atomic_load_32( &worker->waiting ) && next_atomic_exchange_32( &worker->waiting, 0 ) )
     {
-        if ( next_address_equal( address, &session_manager->addresses[i] ) == 1 )
-        {
-            next_session_manager_remove_at_index( session_manager, i );
-            return;
-        }
+        next_platform_semaphore_signal( &worker->semaphore );
     }
-
-    next_session_manager_verify_sentinels( session_manager );
 }
 
-next_session_entry_t * next_session_manager_find_by_address( next_session_manager_t * session_manager, const next_address_t * address )
+next_server_receive_packet_t * next_server_receive_worker_begin_packet( next_server_receive_worker_t * worker )
 {
-    next_session_manager_verify_sentinels( session_manager );
-    next_assert( address );
-    const int max_index = session_manager->max_entry_index;
-    for ( int i = 0; i <= max_index; ++i )
+    // called only by the internal server thread. returns NULL when the ring is full
+
+    const uint32_t write_index = worker->ring_write_index;
+
+    if ( write_index - next_atomic_load_32( &worker->ring_read_index ) >= NEXT_SERVER_RECEIVE_RING_SIZE )
     {
-        if ( next_address_equal( address, &session_manager->addresses[i] ) == 1 )
-        {
-            return &session_manager->entries[i];
-        }
+        worker->packets_dropped++;
+        return NULL;
     }
-    return NULL;
+
+    return &worker->ring[write_index % NEXT_SERVER_RECEIVE_RING_SIZE];
 }
 
-next_session_entry_t * next_session_manager_find_by_session_id( next_session_manager_t * session_manager, uint64_t session_id )
+void next_server_receive_worker_end_packet( next_server_receive_worker_t * worker )
 {
-    next_session_manager_verify_sentinels( session_manager );
-    next_assert( session_id );
-    if ( session_id == 0 )
-    {
-        return NULL;
-    }
-    const int max_index = session_manager->max_entry_index;
-    for ( int i = 0; i <= max_index; ++i )
-    {
-        if ( session_id == session_manager->session_ids[i] )
-        {
-            return &session_manager->entries[i];
-        }
-    }
-    return NULL;
+    next_atomic_store_32( &worker->ring_write_index, worker->ring_write_index + 1 );
+
+    next_server_receive_worker_wake( worker );
 }
 
-int next_session_manager_num_entries( next_session_manager_t * session_manager )
+void next_server_receive_worker_push_command( next_server_receive_worker_t * worker, next_server_receive_command_t * command )
 {
-    next_session_manager_verify_sentinels( session_manager );
-    int num_entries = 0;
-    const int max_index = session_manager->max_entry_index;
-    for ( int i = 0; i <= max_index; ++i )
+    next_assert( worker );
+    next_assert( command );
+
+    int result;
     {
-        if ( session_manager->session_ids[i] != 0 )
-        {
-            num_entries++;
-        }
+        next_platform_mutex_guard( &worker->command_mutex );
+        result = next_queue_push( worker->command_queue, command );
     }
-    return num_entries;
+
+    if ( result != NEXT_OK )
+    {
+        next_printf( NEXT_LOG_LEVEL_ERROR, "server receive worker %d command queue is full", worker->index );
+        return;
+    }
+
+    next_atomic_store_32( &worker->commands_pending, 1 );
+
+    next_server_receive_worker_wake( worker );
 }
 
-// ---------------------------------------------------------------
+bool next_server_receive_worker_push_event( next_server_receive_worker_t * worker, next_server_receive_event_t * event );
 
-struct NextBackendSessionUpdateResponsePacket
+next_server_receive_session_t * next_server_receive_worker_find_session( next_server_receive_worker_t * worker, uint64_t session_id )
 {
-    uint64_t session_id;
-    uint32_t slice_number;
-    int session_data_bytes;
-    uint8_t session_data[NEXT_MAX_SESSION_DATA_BYTES];
-    uint8_t response_type;
-    bool near_relays_changed;
-    int num_near_relays;
-    uint64_t near_relay_ids[NEXT_MAX_NEAR_RELAYS];
-    next_address_t near_relay_addresses[NEXT_MAX_NEAR_RELAYS];
-    int num_tokens;
-    uint8_t tokens[NEXT_MAX_TOKENS*NEXT_ENCRYPTED_ROUTE_TOKEN_BYTES];
-    bool multipath;
-    bool committed;
-    bool has_debug;
-    char debug[NEXT_MAX_SESSION_DEBUG];
-    bool dont_ping_near_relays;
-    bool exclude_near_relays;
-    bool near_relay_excluded[NEXT_MAX_NEAR_RELAYS];
-    bool high_frequency_pings;
+    next_assert( worker );
 
-    NextBackendSessionUpdateResponsePacket()
+    const uint32_t hash = next_session_id_hash( session_id );
+
+    int probe = -1;
+    int index;
+    while ( ( index = next_hash_index_probe( &worker->session_id_index, hash, &probe ) ) != -1 )
     {
-        memset( this, 0, sizeof(NextBackendSessionUpdateResponsePacket) );
+        if ( worker->sessions[index].session_id == session_id )
+            return &worker->sessions[index];
     }
 
-    template <typename Stream> bool Serialize( Stream & stream )
-    {
-        serialize_uint64( stream, session_id );
+    return NULL;
+}
 
-        serialize_uint32( stream, slice_number );
+bool next_server_receive_worker_expand( next_server_receive_worker_t * worker )
+{
+    const int new_size = worker->size * 2;
 
-        serialize_int( stream, session_data_bytes, 0, NEXT_MAX_SESSION_DATA_BYTES );
-        if ( session_data_bytes > 0 )
-        {
-            serialize_bytes( stream, session_data, session_data_bytes );
-        }
+    next_server_receive_session_t * new_sessions = (next_server_receive_session_t*) next_malloc( worker->context, size_t(new_size) * sizeof(next_server_receive_session_t) );
 
-        serialize_int( stream, response_type, 0, NEXT_UPDATE_TYPE_CONTINUE );
+    next_hash_index_t new_session_id_index;
+    memset( &new_session_id_index, 0, sizeof(next_hash_index_t) );
 
-        serialize_bool( stream, near_relays_changed );
+    if ( new_sessions == NULL || !next_hash_index_create( worker->context, &new_session_id_index, new_size ) )
+    {
+        next_free( worker->context, new_sessions );
+        next_hash_index_destroy( &new_session_id_index );
+        return false;
+    }
 
-        if ( near_relays_changed )
-        {
-            serialize_int( stream, num_near_relays, 0, NEXT_MAX_NEAR_RELAYS );
-            for ( int i = 0; i < num_near_relays; ++i )
-            {
-                serialize_uint64( stream, near_relay_ids[i] );
-                serialize_address( stream, near_relay_addresses[i] );
-            }
-        }
+    memcpy( new_sessions, worker->sessions, size_t(worker->num_sessions) * sizeof(next_server_receive_session_t) );
 
-        if ( response_type != NEXT_UPDATE_TYPE_DIRECT )
-        {
-            serialize_bool( stream, multipath );
-            serialize_bool( stream, committed );
-            serialize_int( stream, num_tokens, 0, NEXT_MAX_TOKENS );
-        }
+    for ( int i = 0; i < worker->num_sessions; ++i )
+    {
+        next_hash_index_insert( &new_session_id_index, next_session_id_hash( new_sessions[i].session_id ), i );
+    }
 
-        if ( response_type == NEXT_UPDATE_TYPE_ROUTE )
-        {
-            serialize_bytes( stream, tokens, num_tokens * NEXT_ENCRYPTED_ROUTE_TOKEN_BYTES );
-        }
+    next_free( worker->context, worker->sessions );
+    next_hash_index_destroy( &worker->session_id_index );
 
-        if ( response_type == NEXT_UPDATE_TYPE_CONTINUE )
-        {
-            serialize_bytes( stream, tokens, num_tokens * NEXT_ENCRYPTED_CONTINUE_TOKEN_BYTES );
-        }
+    worker->sessions = new_sessions;
+    worker->session_id_index = new_session_id_index;
+    worker->size = new_size;
+
+    return true;
+}
+
+void next_server_receive_worker_update_session( next_server_receive_worker_t * worker, const next_server_receive_command_update_session_t * command )
+{
+    next_server_receive_session_t * session = next_server_receive_worker_find_session( worker, command->session_id );
 
-        serialize_bool( stream, has_debug );
-        if ( has_debug )
+    if ( !session )
+    {
+        if ( worker->num_sessions == worker->size && !next_server_receive_worker_expand( worker ) )
         {
-            serialize_string( stream, debug, NEXT_MAX_SESSION_DEBUG );
+            next_printf( NEXT_LOG_LEVEL_ERROR, "server receive worker %d could not add session %016" PRIx64, worker->index, command->session_id );
+            return;
         }
 
-        serialize_bool( stream, dont_ping_near_relays );
-        if ( !dont_ping_near_relays )
-        {
-            serialize_bool( stream, exclude_near_relays );
-            if ( exclude_near_relays )
-            {
-                for ( int i = 0; i < NEXT_MAX_NEAR_RELAYS; ++i )
-                {
-                    serialize_bool( stream, near_relay_excluded[i] );
-                }
-            }
+        const int index = worker->num_sessions++;
 
-            serialize_bool( stream, high_frequency_pings );
-        }
+        session = &worker->sessions[index];
+        memset( session, 0, sizeof(next_server_receive_session_t) );
+        session->session_id = command->session_id;
+        next_replay_protection_reset( &session->payload_replay_protection );
+        next_packet_loss_tracker_reset( &session->packet_loss_tracker );
+        next_out_of_order_tracker_reset( &session->out_of_order_tracker );
+        next_jitter_tracker_reset( &session->jitter_tracker );
 
-        return true;
+        next_hash_index_insert( &worker->session_id_index, next_session_id_hash( session->session_id ), index );
     }
-};
 
-// ---------------------------------------------------------------
+    session->address = command->address;
+    session->open_session_sequence = command->open_session_sequence;
+    session->route = command->route;
+    session->promote_requested = false;
+}
 
-int next_write_backend_packet( uint8_t packet_id, void * packet_object, uint8_t * packet_data, int * packet_bytes, const int * signed_packet, const uint8_t * sign_private_key, const uint8_t * magic, const uint8_t * from_address, int from_address_bytes, uint16_t from_port, const uint8_t * to_address, int to_address_bytes, uint16_t to_port )
+void next_server_receive_worker_remove_session( next_server_receive_worker_t * worker, uint64_t session_id )
 {
-    next_assert( packet_object );
-    next_assert( packet_data );
-    next_assert( packet_bytes );
-
-    next::WriteStream stream( packet_data, NEXT_MAX_PACKET_BYTES );
+    next_server_receive_session_t * session = next_server_receive_worker_find_session( worker, session_id );
+    if ( !session )
+        return;
 
-    typedef next::WriteStream Stream;
+    const int index = int( session - worker->sessions );
+    const int last_index = worker->num_sessions - 1;
 
-    serialize_bits( stream, packet_id, 8 );
+    next_hash_index_remove( &worker->session_id_index, next_session_id_hash( session_id ), index );
 
-    uint8_t dummy = 0;
-    for ( int i = 0; i < 15; ++i )
+    if ( index != last_index )
     {
-        serialize_bits( stream, dummy, 8 );
+        next_hash_index_remove( &worker->session_id_index, next_session_id_hash( worker->sessions[last_index].session_id ), last_index );
+        memcpy( &worker->sessions[index], &worker->sessions[last_index], sizeof(next_server_receive_session_t) );
+        next_hash_index_insert( &worker->session_id_index, next_session_id_hash( worker->sessions[index].session_id ), index );
     }
 
-    switch ( packet_id )
+    worker->num_sessions--;
+}
+
+void next_server_receive_worker_pump_commands( next_server_receive_worker_t * worker )
+{
+    if ( !next_atomic_exchange_32( &worker->commands_pending, 0 ) )
+        return;
+
+    while ( true )
     {
-        case NEXT_BACKEND_SERVER_INIT_REQUEST_PACKET:
+        next_server_receive_command_t * command = NULL;
         {
-            NextBackendServerInitRequestPacket * packet = (NextBackendServerInitRequestPacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
+            next_platform_mutex_guard( &worker->command_mutex );
+            command = (next_server_receive_command_t*) next_queue_pop( worker->command_queue );
         }
-        break;
 
-        case NEXT_BACKEND_SERVER_INIT_RESPONSE_PACKET:
-        {
-            NextBackendServerInitResponsePacket * packet = (NextBackendServerInitResponsePacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
-        }
-        break;
+        if ( command == NULL )
+            break;
 
-        case NEXT_BACKEND_SERVER_UPDATE_REQUEST_PACKET:
+        switch ( command->type )
         {
-            NextBackendServerUpdateRequestPacket * packet = (NextBackendServerUpdateRequestPacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
-        }
-        break;
+            case NEXT_SERVER_RECEIVE_COMMAND_UPDATE_SESSION:
+                next_server_receive_worker_update_session( worker, (next_server_receive_command_update_session_t*) command );
+                break;
 
-        case NEXT_BACKEND_SERVER_UPDATE_RESPONSE_PACKET:
-        {
-            NextBackendServerUpdateResponsePacket * packet = (NextBackendServerUpdateResponsePacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
-        }
-        break;
+            case NEXT_SERVER_RECEIVE_COMMAND_REMOVE_SESSION:
+                next_server_receive_worker_remove_session( worker, ( (next_server_receive_command_remove_session_t*) command )->session_id );
+                break;
 
-        case NEXT_BACKEND_SESSION_UPDATE_REQUEST_PACKET:
-        {
-            NextBackendSessionUpdateRequestPacket * packet = (NextBackendSessionUpdateRequestPacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
+            default: break;
         }
-        break;
 
-        case NEXT_BACKEND_SESSION_UPDATE_RESPONSE_PACKET:
-        {
-            NextBackendSessionUpdateResponsePacket * packet = (NextBackendSessionUpdateResponsePacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
-        }
-        break;
+        next_free( worker->context, command );
+    }
+}
 
-        case NEXT_BACKEND_MATCH_DATA_REQUEST_PACKET:
-        {
-            NextBackendMatchDataRequestPacket * packet = (NextBackendMatchDataRequestPacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
-        }
-        break;
+void next_server_receive_worker_process_direct_packet( next_server_receive_worker_t * worker, next_server_receive_packet_t * packet )
+{
+    const int packet_bytes = packet->packet_bytes;
 
-        case NEXT_BACKEND_MATCH_DATA_RESPONSE_PACKET:
-        {
-            NextBackendMatchDataResponsePacket * packet = (NextBackendMatchDataResponsePacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
-        }
-        break;
+    if ( packet_bytes <= 9 )
+    {
+        char address_buffer[NEXT_MAX_ADDRESS_STRING_LENGTH];
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server ignored direct packet from %s. packet is too small to be valid", next_address_to_string( &packet->from, address_buffer ) );
+        return;
+    }
 
-        default:
-            return NEXT_ERROR;
+    if ( packet_bytes > NEXT_MTU + 9 )
+    {
+        char address_buffer[NEXT_MAX_ADDRESS_STRING_LENGTH];
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server ignored direct packet from %s. packet is too large to be valid", next_address_to_string( &packet->from, address_buffer ) );
+        return;
     }
 
-    stream.Flush();
+    next_server_receive_session_t * session = next_server_receive_worker_find_session( worker, packet->session_id );
+    if ( !session )
+    {
+        char address_buffer[NEXT_MAX_ADDRESS_STRING_LENGTH];
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server ignored direct packet from %s. could not find session for address", next_address_to_string( &packet->from, address_buffer ) );
+        return;
+    }
 
-    *packet_bytes = stream.GetBytesProcessed();
+    const uint8_t * p = packet->packet_data;
 
-    next_assert( *packet_bytes >= 0 );
-    next_assert( *packet_bytes < NEXT_MAX_PACKET_BYTES );
+    uint8_t packet_session_sequence = next_read_uint8( &p );
 
-    if ( signed_packet && signed_packet[packet_id] )
+    uint64_t packet_sequence = next_read_uint64( &p );
+
+    if ( packet_session_sequence != session->open_session_sequence )
     {
-        next_assert( sign_private_key );
-        next_crypto_sign_state_t state;
-        next_crypto_sign_init( &state );
-        next_crypto_sign_update( &state, packet_data, 1 );
-        next_crypto_sign_update( &state, packet_data + 16, size_t(*packet_bytes) - 16 );
-        next_crypto_sign_final_create( &state, packet_data + *packet_bytes, NULL, sign_private_key );
-        *packet_bytes += NEXT_CRYPTO_SIGN_BYTES;
+        char address_buffer[NEXT_MAX_ADDRESS_STRING_LENGTH];
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server ignored direct packet from %s. session mismatch", next_address_to_string( &packet->from, address_buffer ) );
+        return;
     }
 
-    *packet_bytes += 2;
+    uint64_t clean_sequence = next_clean_sequence( packet_sequence );
 
-    next_generate_chonkle( packet_data + 1, magic, from_address, from_address_bytes, from_port, to_address, to_address_bytes, to_port, *packet_bytes );
-    next_generate_pittle( packet_data + *packet_bytes - 2, from_address, from_address_bytes, from_port, to_address, to_address_bytes, to_port, *packet_bytes );
+    if ( next_replay_protection_already_received( &session->payload_replay_protection, clean_sequence ) )
+    {
+        char address_buffer[NEXT_MAX_ADDRESS_STRING_LENGTH];
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server ignored direct packet from %s. already received (%" PRIx64 " vs. %" PRIx64 ")", next_address_to_string( &packet->from, address_buffer ), clean_sequence, session->payload_replay_protection.most_recent_sequence );
+        return;
+    }
 
-    return NEXT_OK;
+    next_replay_protection_advance_sequence( &session->payload_replay_protection, clean_sequence );
+
+    next_packet_loss_tracker_packet_received( &session->packet_loss_tracker, clean_sequence );
+
+    next_out_of_order_tracker_packet_received( &session->out_of_order_tracker, clean_sequence );
+
+    next_jitter_tracker_packet_received( &session->jitter_tracker, clean_sequence, next_time() );
+
+    next_server_internal_deliver_payload( worker->server, &packet->from, packet->packet_data + 9, packet_bytes - 9 );
 }
 
-int next_read_backend_packet( uint8_t packet_id, uint8_t * packet_data, int begin, int end, void * packet_object, const int * signed_packet, const uint8_t * sign_public_key )
+void next_server_receive_worker_process_client_to_server_packet( next_server_receive_worker_t * worker, next_server_receive_packet_t * packet )
 {
-    next_assert( packet_data );
-    next_assert( packet_object );
+    uint8_t * packet_data = packet->packet_data;
+    const int packet_bytes = packet->packet_bytes;
 
-    next::ReadStream stream( packet_data, end );
+    if ( packet_bytes <= NEXT_HEADER_BYTES )
+    {
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server ignored client to server packet. packet is too small to be valid" );
+        return;
+    }
 
-    uint8_t dummy[begin];
-    serialize_bytes( stream, dummy, begin );
+    uint64_t packet_sequence = 0;
+    uint64_t packet_session_id = 0;
+    uint8_t packet_session_version = 0;
 
-    if ( signed_packet && signed_packet[packet_id] )
+    if ( next_peek_header( NEXT_DIRECTION_CLIENT_TO_SERVER, NEXT_CLIENT_TO_SERVER_PACKET, &packet_sequence, &packet_session_id, &packet_session_version, packet_data, packet_bytes ) != NEXT_OK )
     {
-        next_assert( sign_public_key );
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server ignored client to server packet. could not peek header" );
+        return;
+    }
 
-	    const int packet_bytes = end - begin;
+    next_server_receive_session_t * session = next_server_receive_worker_find_session( worker, packet_session_id );
+    if ( !session )
+    {
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server ignored client to server packet. could not find session" );
+        return;
+    }
 
-        if ( packet_bytes < int( NEXT_CRYPTO_SIGN_BYTES ) )
-        {
-            next_printf( NEXT_LOG_LEVEL_DEBUG, "signed backend packet is too small to be valid" );
-            return NEXT_ERROR;
-        }
+    next_server_receive_route_t * route = &session->route;
 
-        next_crypto_sign_state_t state;
-        next_crypto_sign_init( &state );
-        next_crypto_sign_update( &state, &packet_id, 1 );
-        next_crypto_sign_update( &state, packet_data + begin, packet_bytes - NEXT_CRYPTO_SIGN_BYTES );
-        if ( next_crypto_sign_final_verify( &state, packet_data + end - NEXT_CRYPTO_SIGN_BYTES, sign_public_key ) != 0 )
-        {
-            next_printf( NEXT_LOG_LEVEL_DEBUG, "signed backend packet did not verify" );
-            return NEXT_ERROR;
-        }
-	}
+    if ( !route->has_pending_route && !route->has_current_route && !route->has_previous_route )
+    {
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server ignored client to server packet. session has no route" );
+        return;
+    }
 
-    switch ( packet_id )
+    uint64_t clean_sequence = next_clean_sequence( packet_sequence );
+
+    if ( next_replay_protection_already_received( &session->payload_replay_protection, clean_sequence ) )
+        return;
+
+    if ( route->has_pending_route && next_read_header( NEXT_DIRECTION_CLIENT_TO_SERVER, NEXT_CLIENT_TO_SERVER_PACKET, &packet_sequence, &packet_session_id, &packet_session_version, route->pending_route_private_key, packet_data, packet_bytes ) == NEXT_OK )
     {
-        case NEXT_BACKEND_SERVER_INIT_REQUEST_PACKET:
-        {
-            NextBackendServerInitRequestPacket * packet = (NextBackendServerInitRequestPacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
-        }
-        break;
+        // promote locally so the next packets verify against the current route key, then let the internal thread promote the session
 
-        case NEXT_BACKEND_SERVER_INIT_RESPONSE_PACKET:
+        if ( !session->promote_requested )
         {
-            NextBackendServerInitResponsePacket * packet = (NextBackendServerInitResponsePacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
+            next_server_receive_event_promote_route_t * event = (next_server_receive_event_promote_route_t*) next_malloc( worker->context, sizeof(next_server_receive_event_promote_route_t) );
+            event->type = NEXT_SERVER_RECEIVE_EVENT_PROMOTE_ROUTE;
+            event->session_id = session->session_id;
+            event->session_version = route->pending_route_session_version;
+            session->promote_requested = next_server_receive_worker_push_event( worker, event );
         }
-        break;
 
-        case NEXT_BACKEND_SERVER_UPDATE_REQUEST_PACKET:
+        if ( route->has_current_route )
         {
-            NextBackendServerUpdateRequestPacket * packet = (NextBackendServerUpdateRequestPacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
+            route->has_previous_route = true;
+            memcpy( route->previous_route_private_key, route->current_route_private_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
         }
-        break;
 
-        case NEXT_BACKEND_SERVER_UPDATE_RESPONSE_PACKET:
-        {
-            NextBackendServerUpdateResponsePacket * packet = (NextBackendServerUpdateResponsePacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
-        }
-        break;
+        route->has_pending_route = false;
+        route->has_current_route = true;
+        memcpy( route->current_route_private_key, route->pending_route_private_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
+    }
+    else
+    {
+        bool current_route_ok = false;
+        bool previous_route_ok = false;
 
-        case NEXT_BACKEND_SESSION_UPDATE_REQUEST_PACKET:
-        {
-            NextBackendSessionUpdateRequestPacket * packet = (NextBackendSessionUpdateRequestPacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
-        }
-        break;
+        if ( route->has_current_route )
+            current_route_ok = next_read_header( NEXT_DIRECTION_CLIENT_TO_SERVER, NEXT_CLIENT_TO_SERVER_PACKET, &packet_sequence, &packet_session_id, &packet_session_version, route->current_route_private_key, packet_data, packet_bytes ) == NEXT_OK;
 
-        case NEXT_BACKEND_SESSION_UPDATE_RESPONSE_PACKET:
+        if ( !current_route_ok && route->has_previous_route )
+            previous_route_ok = next_read_header( NEXT_DIRECTION_CLIENT_TO_SERVER, NEXT_CLIENT_TO_SERVER_PACKET, &packet_sequence, &packet_session_id, &packet_session_version, route->previous_route_private_key, packet_data, packet_bytes ) == NEXT_OK;
+
+        if ( !current_route_ok && !previous_route_ok )
         {
-            NextBackendSessionUpdateResponsePacket * packet = (NextBackendSessionUpdateResponsePacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
+            next_printf( NEXT_LOG_LEVEL_DEBUG, "server ignored client to server packet. did not verify" );
+            return;
         }
-        break;
+    }
+
+    next_replay_protection_advance_sequence( &session->payload_replay_protection, clean_sequence );
+
+    next_packet_loss_tracker_packet_received( &session->packet_loss_tracker, clean_sequence );
+    next_out_of_order_tracker_packet_received( &session->out_of_order_tracker, clean_sequence );
+    next_jitter_tracker_packet_received( &session->jitter_tracker, clean_sequence, next_time() );
+
+    next_server_internal_deliver_payload( worker->server, &session->address, packet_data + NEXT_HEADER_BYTES, packet_bytes - NEXT_HEADER_BYTES );
+}
+
+void next_server_receive_worker_process_packet( next_server_receive_worker_t * worker, next_server_receive_packet_t * packet )
+{
+    switch ( packet->packet_type )
+    {
+        case NEXT_PASSTHROUGH_PACKET:
+            next_server_internal_deliver_payload( worker->server, &packet->from, packet->packet_data, packet->packet_bytes );
+            break;
+
+        case NEXT_DIRECT_PACKET:
+            next_server_receive_worker_process_direct_packet( worker, packet );
+            break;
+
+        case NEXT_CLIENT_TO_SERVER_PACKET:
+            next_server_receive_worker_process_client_to_server_packet( worker, packet );
+            break;
+
+        default: break;
+    }
+}
+
+void next_server_receive_worker_update_trackers( next_server_receive_worker_t * worker, double current_time )
+{
+    if ( worker->next_tracker_update_time > current_time )
+        return;
 
-        case NEXT_BACKEND_MATCH_DATA_REQUEST_PACKET:
+    worker->next_tracker_update_time = current_time + NEXT_SECONDS_BETWEEN_PACKET_LOSS_UPDATES;
+
+    next_server_receive_event_tracker_stats_t * event = NULL;
+
+    for ( int i = 0; i < worker->num_sessions; ++i )
+    {
+        next_server_receive_session_t * session = &worker->sessions[i];
+
+        if ( !event )
         {
-            NextBackendMatchDataRequestPacket * packet = (NextBackendMatchDataRequestPacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
+            event = (next_server_receive_event_tracker_stats_t*) next_malloc( worker->context, sizeof(next_server_receive_event_tracker_stats_t) );
+            event->type = NEXT_SERVER_RECEIVE_EVENT_TRACKER_STATS;
+            event->num_sessions = 0;
         }
-        break;
 
-        case NEXT_BACKEND_MATCH_DATA_RESPONSE_PACKET:
+        const int index = event->num_sessions++;
+        event->session_ids[index] = session->session_id;
+        event->packets_lost[index] = next_packet_loss_tracker_update( &session->packet_loss_tracker );
+        event->packets_out_of_order[index] = session->out_of_order_tracker.num_out_of_order_packets;
+        event->jitter[index] = float( session->jitter_tracker.jitter );
+
+        if ( event->num_sessions == NEXT_SERVER_RECEIVE_TRACKER_STATS_BATCH )
         {
-            NextBackendMatchDataResponsePacket * packet = (NextBackendMatchDataResponsePacket*) packet_object;
-            if ( !packet->Serialize( stream ) )
-                return NEXT_ERROR;
+            next_server_receive_worker_push_event( worker, event );
+            event = NULL;
         }
-        break;
-
-        default:
-            return NEXT_ERROR;
     }
 
-    return (int) packet_id;
+    if ( event )
+    {
+        next_server_receive_worker_push_event( worker, event );
+    }
 }
 
-// ---------------------------------------------------------------
-
-#define NEXT_SERVER_COMMAND_UPGRADE_SESSION             			0
-#define NEXT_SERVER_COMMAND_TAG_SESSION                 			1
-#define NEXT_SERVER_COMMAND_SERVER_EVENT                			2
-#define NEXT_SERVER_COMMAND_MATCH_DATA                  			3
-#define NEXT_SERVER_COMMAND_FLUSH                       			4
-
-struct next_server_command_t
+bool next_server_receive_worker_update( next_server_receive_worker_t * worker )
 {
-    int type;
-};
+    // process everything queued for this worker. returns true if there was any work
 
-struct next_server_command_upgrade_session_t : public next_server_command_t
-{
-    next_address_t address;
-    uint64_t session_id;
-    uint64_t user_hash;
-};
+    next_server_receive_worker_verify_sentinels( worker );
 
-struct next_server_command_tag_session_t : public next_server_command_t
-{
-    next_address_t address;
-    uint64_t tags[NEXT_MAX_TAGS];
-    int num_tags;
-};
+    next_server_receive_worker_pump_commands( worker );
 
-struct next_server_command_server_event_t : public next_server_command_t
-{
-    next_address_t address;
-    uint64_t server_events;
-};
+    bool did_work = false;
 
-struct next_server_command_match_data_t : public next_server_command_t
-{
-    next_address_t address;
-    uint64_t match_id;
-    double match_values[NEXT_MAX_MATCH_VALUES];
-    int num_match_values;
-};
+    uint32_t read_index = worker->ring_read_index;
 
-struct next_server_command_flush_t : public next_server_command_t
-{
-    // ...
-};
+    while ( read_index != next_atomic_load_32( &worker->ring_write_index ) )
+    {
+        next_server_receive_worker_process_packet( worker, &worker->ring[read_index % NEXT_SERVER_RECEIVE_RING_SIZE] );
+        read_index++;
+        next_atomic_store_32( &worker->ring_read_index, read_index );
+        did_work = true;
+    }
 
-// ---------------------------------------------------------------
+    next_server_receive_worker_update_trackers( worker, next_time() );
 
-#define NEXT_SERVER_NOTIFY_PACKET_RECEIVED                      0
-#define NEXT_SERVER_NOTIFY_PENDING_SESSION_TIMED_OUT            1
-#define NEXT_SERVER_NOTIFY_SESSION_UPGRADED                     2
-#define NEXT_SERVER_NOTIFY_SESSION_TIMED_OUT                    3
-#define NEXT_SERVER_NOTIFY_INIT_TIMED_OUT                       4
-#define NEXT_SERVER_NOTIFY_READY                        		5
-#define NEXT_SERVER_NOTIFY_FLUSH_FINISHED                  		6
-#define NEXT_SERVER_NOTIFY_MAGIC_UPDATED                        7
+    return did_work;
+}
 
-struct next_server_notify_t
+static next_platform_thread_return_t NEXT_PLATFORM_THREAD_FUNC next_server_receive_worker_thread_function( void * context )
 {
-    int type;
-};
+    next_assert( context );
 
-struct next_server_notify_packet_received_t : public next_server_notify_t
-{
-    next_address_t from;
-    int packet_bytes;
-    uint8_t packet_data[NEXT_MTU];
-};
+    next_server_receive_worker_t * worker = (next_server_receive_worker_t*) context;
 
-struct next_server_notify_pending_session_cancelled_t : public next_server_notify_t
-{
-    next_address_t address;
-    uint64_t session_id;
-};
+    while ( !next_atomic_load_32( &worker->quit ) )
+    {
+        if ( next_server_receive_worker_update( worker ) )
+            continue;
 
-struct next_server_notify_pending_session_timed_out_t : public next_server_notify_t
-{
-    next_address_t address;
-    uint64_t session_id;
-};
+        // park until the internal thread hands over more work. the timeout keeps trackers and quit responsive
 
-struct next_server_notify_session_upgraded_t : public next_server_notify_t
-{
-    next_address_t address;
-    uint64_t session_id;
-};
+        next_atomic_store_32( &worker->waiting, 1 );
+        next_atomic_fence();
 
-struct next_server_notify_session_timed_out_t : public next_server_notify_t
-{
-    next_address_t address;
-    uint64_t session_id;
-};
+        const bool has_work = worker->ring_read_index != next_atomic_load_32( &worker->ring_write_index ) || next_atomic_load_32( &worker->commands_pending ) || next_atomic_load_32( &worker->quit );
 
-struct next_server_notify_init_timed_out_t : public next_server_notify_t
-{
-    // ...
-};
+        if ( !has_work )
+        {
+            next_platform_semaphore_wait( &worker->semaphore, NEXT_SECONDS_BETWEEN_PACKET_LOSS_UPDATES );
+        }
 
-struct next_server_notify_ready_t : public next_server_notify_t
-{
-    char datacenter_name[NEXT_MAX_DATACENTER_NAME_LENGTH];
-};
+        next_atomic_store_32( &worker->waiting, 0 );
+    }
 
-struct next_server_notify_flush_finished_t : public next_server_notify_t
-{
-    // ...
-};
+    NEXT_PLATFORM_THREAD_RETURN();
+}
 
-struct next_server_notify_magic_updated_t : public next_server_notify_t
+bool next_server_receive_worker_start( next_server_receive_worker_t * worker )
 {
-    uint8_t current_magic[8];
-};
+    next_assert( worker );
+    next_assert( worker->thread == NULL );
 
-// ---------------------------------------------------------------
+    worker->thread = next_platform_thread_create( worker->context, next_server_receive_worker_thread_function, worker );
 
-struct next_server_internal_t
+    return worker->thread != NULL;
+}
+
+void next_server_receive_worker_stop( next_server_receive_worker_t * worker )
 {
-    NEXT_DECLARE_SENTINEL(0)
+    next_assert( worker );
 
-    next_server_callbacks_t callbacks;
-    void * context;
-    int state;
-    uint64_t customer_id;
-    uint64_t datacenter_id;
-    char datacenter_name[NEXT_MAX_DATACENTER_NAME_LENGTH];
-    char autodetect_input[NEXT_MAX_DATACENTER_NAME_LENGTH];
-    char autodetect_datacenter[NEXT_MAX_DATACENTER_NAME_LENGTH];
-    bool autodetected_datacenter;
+    if ( !worker->thread )
+        return;
 
-    NEXT_DECLARE_SENTINEL(1)
+    next_atomic_store_32( &worker->quit, 1 );
+    next_platform_semaphore_signal( &worker->semaphore );
 
-    uint8_t customer_private_key[NEXT_CRYPTO_SIGN_SECRETKEYBYTES];
+    next_platform_thread_join( worker->thread );
+    next_platform_thread_destroy( worker->thread );
+    worker->thread = NULL;
+}
 
-    NEXT_DECLARE_SENTINEL(2)
+bool next_server_receive_worker_push_event( next_server_receive_worker_t * worker, next_server_receive_event_t * event )
+{
+    next_assert( worker );
+    next_assert( event );
 
-    bool valid_customer_private_key;
-    bool no_datacenter_specified;
-    uint64_t upgrade_sequence;
-    double next_resolve_hostname_time;
-    next_address_t backend_address;
-    next_address_t server_address;
-    next_address_t bind_address;
-    next_queue_t * command_queue;
-    next_queue_t * notify_queue;
-    next_platform_mutex_t session_mutex;
-    next_platform_mutex_t command_mutex;
-    next_platform_mutex_t notify_mutex;
-    next_platform_socket_t * socket;
-    next_pending_session_manager_t * pending_session_manager;
-    next_session_manager_t * session_manager;
+    next_server_internal_t * server = worker->server;
 
-    NEXT_DECLARE_SENTINEL(3)
+    next_platform_mutex_guard( &server->receive_event_mutex );
+    return next_queue_push( server->receive_event_queue, event ) == NEXT_OK;
+}
 
-    bool resolving_hostname;
-    bool resolve_hostname_finished;
-    double resolve_hostname_start_time;
-    next_address_t resolve_hostname_result;
-    next_platform_mutex_t resolve_hostname_mutex;
-    next_platform_thread_t * resolve_hostname_thread;
+// ---------------------------------------------------------------
 
-    NEXT_DECLARE_SENTINEL(4)
+next_server_receive_worker_t * next_server_internal_receive_worker( next_server_internal_t * server, uint32_t hash )
+{
+    next_assert( server->num_receive_workers > 0 );
+    return server->receive_workers[hash % uint32_t( server->num_receive_workers )];
+}
 
-    bool autodetecting;
-    bool autodetect_finished;
-    bool autodetect_actually_did_something;
-    bool autodetect_succeeded;
-    double autodetect_start_time;
-    char autodetect_result[NEXT_MAX_DATACENTER_NAME_LENGTH];
-    next_platform_mutex_t autodetect_mutex;
-    next_platform_thread_t * autodetect_thread;
+void next_server_internal_publish_receive_session( next_server_internal_t * server, next_session_entry_t * entry )
+{
+    // hand the worker that owns this session a copy of the state it needs to verify and deliver packets
 
-    NEXT_DECLARE_SENTINEL(5)
+    next_assert( server );
+    next_assert( entry );
 
-    uint8_t server_kx_public_key[NEXT_CRYPTO_KX_PUBLICKEYBYTES];
-    uint8_t server_kx_private_key[NEXT_CRYPTO_KX_SECRETKEYBYTES];
-    uint8_t server_route_public_key[NEXT_CRYPTO_BOX_PUBLICKEYBYTES];
-    uint8_t server_route_private_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+    if ( server->num_receive_workers == 0 )
+        return;
 
-    NEXT_DECLARE_SENTINEL(6)
+    next_server_receive_command_update_session_t * command = (next_server_receive_command_update_session_t*) next_malloc( server->context, sizeof(next_server_receive_command_update_session_t) );
+    memset( command, 0, sizeof(next_server_receive_command_update_session_t) );
+    command->type = NEXT_SERVER_RECEIVE_COMMAND_UPDATE_SESSION;
+    command->session_id = entry->session_id;
+    command->address = entry->address;
+    command->open_session_sequence = entry->client_open_session_sequence;
+    command->route.has_pending_route = entry->has_pending_route;
+    command->route.has_current_route = entry->has_current_route;
+    command->route.has_previous_route = entry->has_previous_route;
+    command->route.pending_route_session_version = entry->pending_route_session_version;
+    memcpy( command->route.pending_route_private_key, entry->pending_route_private_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
+    memcpy( command->route.current_route_private_key, entry->current_route_private_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
+    memcpy( command->route.previous_route_private_key, entry->previous_route_private_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
 
-    uint8_t upcoming_magic[8];
-    uint8_t current_magic[8];
-    uint8_t previous_magic[8];
+    next_server_receive_worker_push_command( next_server_internal_receive_worker( server, next_session_id_hash( entry->session_id ) ), command );
+}
 
-    NEXT_DECLARE_SENTINEL(7)
+void next_server_internal_retire_receive_session( next_server_internal_t * server, uint64_t session_id )
+{
+    next_assert( server );
 
-    uint64_t server_init_request_id;
-    double server_init_resend_time;
-    double server_init_timeout_time;
-    bool received_init_response;
+    if ( server->num_receive_workers == 0 )
+        return;
 
-    NEXT_DECLARE_SENTINEL(8)
+    next_server_receive_command_remove_session_t * command = (next_server_receive_command_remove_session_t*) next_malloc( server->context, sizeof(next_server_receive_command_remove_session_t) );
+    command->type = NEXT_SERVER_RECEIVE_COMMAND_REMOVE_SESSION;
+    command->session_id = session_id;
 
-    uint64_t server_update_request_id;
-    double server_update_last_time;
-    double server_update_resend_time;
-    int server_update_num_sessions;
-    bool server_update_first;
+    next_server_receive_worker_push_command( next_server_internal_receive_worker( server, next_session_id_hash( session_id ) ), command );
+}
 
-    NEXT_DECLARE_SENTINEL(9)
+void next_server_internal_dispatch_receive_packet( next_server_internal_t * server, uint32_t hash, uint8_t packet_type, uint64_t session_id, const next_address_t * from, const uint8_t * packet_data, int packet_bytes )
+{
+    next_assert( server );
+    next_assert( from );
+    next_assert( packet_data );
+    next_assert( packet_bytes >= 0 );
+    next_assert( packet_bytes <= NEXT_MAX_PACKET_BYTES );
 
-    next_platform_mutex_t quit_mutex;
-    bool quit;
+    next_server_receive_worker_t * worker = next_server_internal_receive_worker( server, hash );
 
-    NEXT_DECLARE_SENTINEL(10)
+    next_server_receive_packet_t * packet = next_server_receive_worker_begin_packet( worker );
+    if ( !packet )
+    {
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server receive worker %d is full. dropped packet", worker->index );
+        return;
+    }
 
-    bool flushing;
-    bool flushed;
-    uint64_t num_session_updates_to_flush;
-    uint64_t num_match_data_to_flush;
-    uint64_t num_flushed_session_updates;
-    uint64_t num_flushed_match_data;
+    packet->packet_type = packet_type;
+    packet->session_id = session_id;
+    packet->from = *from;
+    packet->packet_bytes = packet_bytes;
+    memcpy( packet->packet_data, packet_data, size_t(packet_bytes) );
 
-    NEXT_DECLARE_SENTINEL(11)
-};
+    next_server_receive_worker_end_packet( worker );
+}
 
-void next_server_internal_initialize_sentinels( next_server_internal_t * server )
+void next_server_internal_promote_pending_route( next_server_internal_t * server, next_session_entry_t * entry );
+
+void next_server_internal_pump_receive_events( next_server_internal_t * server )
 {
-    (void) server;
     next_assert( server );
-    NEXT_INITIALIZE_SENTINEL( server, 0 )
-    NEXT_INITIALIZE_SENTINEL( server, 1 )
-    NEXT_INITIALIZE_SENTINEL( server, 2 )
-    NEXT_INITIALIZE_SENTINEL( server, 3 )
-    NEXT_INITIALIZE_SENTINEL( server, 4 )
-    NEXT_INITIALIZE_SENTINEL( server, 5 )
-    NEXT_INITIALIZE_SENTINEL( server, 6 )
-    NEXT_INITIALIZE_SENTINEL( server, 7 )
-    NEXT_INITIALIZE_SENTINEL( server, 8 )
-    NEXT_INITIALIZE_SENTINEL( server, 9 )
-    NEXT_INITIALIZE_SENTINEL( server, 10 )
-    NEXT_INITIALIZE_SENTINEL( server, 11 )
-}
 
-void next_server_internal_verify_sentinels( next_server_internal_t * server )
-{
-    (void) server;
-    next_assert( server );
-    NEXT_VERIFY_SENTINEL( server, 0 )
-    NEXT_VERIFY_SENTINEL( server, 1 )
-    NEXT_VERIFY_SENTINEL( server, 2 )
-    NEXT_VERIFY_SENTINEL( server, 3 )
-    NEXT_VERIFY_SENTINEL( server, 4 )
-    NEXT_VERIFY_SENTINEL( server, 5 )
-    NEXT_VERIFY_SENTINEL( server, 6 )
-    NEXT_VERIFY_SENTINEL( server, 7 )
-    NEXT_VERIFY_SENTINEL( server, 8 )
-    NEXT_VERIFY_SENTINEL( server, 9 )
-    NEXT_VERIFY_SENTINEL( server, 10 )
-    NEXT_VERIFY_SENTINEL( server, 11 )
-    if ( server->session_manager )
-        next_session_manager_verify_sentinels( server->session_manager );
-    if ( server->pending_session_manager )
-        next_pending_session_manager_verify_sentinels( server->pending_session_manager );
+    if ( server->num_receive_workers == 0 )
+        return;
+
+    while ( true )
+    {
+        next_server_receive_event_t * event = NULL;
+        {
+            next_platform_mutex_guard( &server->receive_event_mutex );
+            event = (next_server_receive_event_t*) next_queue_pop( server->receive_event_queue );
+        }
+
+        if ( event == NULL )
+            break;
+
+        switch ( event->type )
+        {
+            case NEXT_SERVER_RECEIVE_EVENT_PROMOTE_ROUTE:
+            {
+                next_server_receive_event_promote_route_t * promote_route = (next_server_receive_event_promote_route_t*) event;
+                next_session_entry_t * entry = next_session_manager_find_by_session_id( server->session_manager, promote_route->session_id );
+                if ( entry && entry->has_pending_route && entry->pending_route_session_version == promote_route->session_version )
+                {
+                    next_server_internal_promote_pending_route( server, entry );
+                }
+            }
+            break;
+
+            case NEXT_SERVER_RECEIVE_EVENT_TRACKER_STATS:
+            {
+                next_server_receive_event_tracker_stats_t * tracker_stats = (next_server_receive_event_tracker_stats_t*) event;
+                for ( int i = 0; i < tracker_stats->num_sessions; ++i )
+                {
+                    next_session_entry_t * entry = next_session_manager_find_by_session_id( server->session_manager, tracker_stats->session_ids[i] );
+                    if ( entry && !entry->stats_fallback_to_direct )
+                    {
+                        entry->stats_packets_lost_client_to_server += tracker_stats->packets_lost[i];
+                        entry->stats_packets_out_of_order_client_to_server = tracker_stats->packets_out_of_order[i];
+                        entry->stats_jitter_client_to_server = tracker_stats->jitter[i] * 1000.0f;
+                    }
+                }
+            }
+            break;
+
+            default: break;
+        }
+
+        next_free( server->context, event );
+    }
 }
 
 static next_platform_thread_return_t NEXT_PLATFORM_THREAD_FUNC next_server_internal_resolve_hostname_thread_function( void * context );
@@ -12177,6 +14182,11 @@ next_server_internal_t * next_server_internal_create( void * context, const char
         return NULL;
     }
 
+    if ( next_global_config.udp_segmentation && !next_platform_socket_enable_segmentation( server->socket ) )
+    {
+        next_printf( NEXT_LOG_LEVEL_INFO, "server socket does not support udp segmentation" );
+    }
+
     if ( server_address.port == 0 )
     {
         server_address.port = bind_address.port;
@@ -12257,6 +14267,56 @@ next_server_internal_t * next_server_internal_create( void * context, const char
         return NULL;
     }
 
+    server->session_timers = next_timer_wheel_create( context, NEXT_INITIAL_SESSION_SIZE, NEXT_SERVER_SESSION_TIMER_RESOLUTION, next_time() );
+    if ( server->session_timers == NULL )
+    {
+        next_printf( NEXT_LOG_LEVEL_ERROR, "server could not create session timers" );
+        next_server_internal_destroy( server );
+        return NULL;
+    }
+
+    if ( next_global_config.server_receive_threads > 0 )
+    {
+        result = next_platform_mutex_create( &server->receive_event_mutex );
+
+        if ( result != NEXT_OK )
+        {
+            next_printf( NEXT_LOG_LEVEL_ERROR, "server could not create receive event mutex" );
+            next_server_internal_destroy( server );
+            return NULL;
+        }
+
+        server->receive_event_queue = next_queue_create( context, NEXT_SERVER_RECEIVE_EVENT_QUEUE_LENGTH );
+        if ( !server->receive_event_queue )
+        {
+            next_printf( NEXT_LOG_LEVEL_ERROR, "server could not create receive event queue" );
+            next_server_internal_destroy( server );
+            return NULL;
+        }
+
+        for ( int i = 0; i < next_global_config.server_receive_threads; ++i )
+        {
+            next_server_receive_worker_t * worker = next_server_receive_worker_create( context, server, i );
+            if ( !worker )
+            {
+                next_printf( NEXT_LOG_LEVEL_ERROR, "server could not create receive worker" );
+                next_server_internal_destroy( server );
+                return NULL;
+            }
+
+            server->receive_workers[server->num_receive_workers++] = worker;
+
+            if ( !next_server_receive_worker_start( worker ) )
+            {
+                next_printf( NEXT_LOG_LEVEL_ERROR, "server could not start receive worker thread" );
+                next_server_internal_destroy( server );
+                return NULL;
+            }
+        }
+
+        next_printf( NEXT_LOG_LEVEL_INFO, "server started %d receive threads", server->num_receive_workers );
+    }
+
     if ( !next_global_config.disable_network_next && server->valid_customer_private_key )
     {
         next_server_internal_initialize( server );
@@ -12284,6 +14344,21 @@ void next_server_internal_destroy( next_server_internal_t * server )
     // IMPORTANT: Please call next_server_flush before destroying the server!
     next_assert( server->state != NEXT_SERVER_STATE_INITIALIZING );
 
+    // receive workers deliver into the notify queue, so they must stop first
+
+    for ( int i = 0; i < server->num_receive_workers; ++i )
+    {
+        next_server_receive_worker_stop( server->receive_workers[i] );
+        next_server_receive_worker_destroy( server->receive_workers[i] );
+        server->receive_workers[i] = NULL;
+    }
+    server->num_receive_workers = 0;
+
+    if ( server->receive_event_queue )
+    {
+        next_queue_destroy( server->receive_event_queue );
+    }
+
     if ( server->socket )
     {
         next_platform_socket_destroy( server->socket );
@@ -12298,6 +14373,19 @@ void next_server_internal_destroy( next_server_internal_t * server )
     }
     if ( server->notify_queue )
     {
+        // release send state references held by notifies the application never processed
+        while ( true )
+        {
+            next_server_notify_t * notify = (next_server_notify_t*) next_queue_pop( server->notify_queue );
+            if ( !notify )
+                break;
+            if ( notify->type == NEXT_SERVER_NOTIFY_SESSION_UPGRADED )
+            {
+                next_server_notify_session_upgraded_t * session_upgraded = (next_server_notify_session_upgraded_t*) notify;
+                next_session_send_state_release( session_upgraded->send_state );
+            }
+            next_free( server->context, notify );
+        }
         next_queue_destroy( server->notify_queue );
     }
     if ( server->session_manager )
@@ -12305,6 +14393,11 @@ void next_server_internal_destroy( next_server_internal_t * server )
         next_session_manager_destroy( server->session_manager );
         server->session_manager = NULL;
     }
+    if ( server->session_timers )
+    {
+        next_timer_wheel_destroy( server->session_timers );
+        server->session_timers = NULL;
+    }
     if ( server->pending_session_manager )
     {
         next_pending_session_manager_destroy( server->pending_session_manager );
@@ -12317,6 +14410,7 @@ void next_server_internal_destroy( next_server_internal_t * server )
     next_platform_mutex_destroy( &server->resolve_hostname_mutex );
     next_platform_mutex_destroy( &server->autodetect_mutex );
     next_platform_mutex_destroy( &server->quit_mutex );
+    next_platform_mutex_destroy( &server->receive_event_mutex );
 
     next_server_internal_verify_sentinels( server );
 
@@ -12436,6 +14530,47 @@ inline int next_sequence_greater_than( uint8_t s1, uint8_t s2 )
            ( ( s1 < s2 ) && ( s2 - s1  > 128 ) );
 }
 
+void next_server_internal_promote_pending_route( next_server_internal_t * server, next_session_entry_t * entry )
+{
+    next_assert( server );
+    next_assert( entry );
+    next_assert( entry->has_pending_route );
+
+    next_printf( NEXT_LOG_LEVEL_DEBUG, "server promoted pending route for session %016" PRIx64, entry->session_id );
+
+    if ( entry->has_current_route )
+    {
+        entry->has_previous_route = true;
+        entry->previous_route_send_address = entry->current_route_send_address;
+        memcpy( entry->previous_route_private_key, entry->current_route_private_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
+    }
+
+    entry->has_pending_route = false;
+    entry->has_current_route = true;
+    entry->current_route_session_version = entry->pending_route_session_version;
+    entry->current_route_expire_timestamp = entry->pending_route_expire_timestamp;
+    entry->current_route_expire_time = entry->pending_route_expire_time;
+    entry->current_route_kbps_up = entry->pending_route_kbps_up;
+    entry->current_route_kbps_down = entry->pending_route_kbps_down;
+    entry->current_route_send_address = entry->pending_route_send_address;
+    memcpy( entry->current_route_private_key, entry->pending_route_private_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
+
+    next_session_send_state_t * send_state = entry->send_state;
+    next_session_send_state_begin_write( send_state );
+    send_state->route.envelope_kbps_up = entry->current_route_kbps_up;
+    send_state->route.envelope_kbps_down = entry->current_route_kbps_down;
+    send_state->route.send_over_network_next = true;
+    send_state->route.session_id = entry->session_id;
+    send_state->route.session_version = entry->current_route_session_version;
+    send_state->route.send_address = entry->current_route_send_address;
+    memcpy( send_state->route.private_key, entry->current_route_private_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
+    next_session_send_state_end_write( send_state );
+
+    next_server_internal_publish_receive_session( server, entry );
+
+    next_server_internal_wake_session( server, entry, entry->current_route_expire_time );
+}
+
 next_session_entry_t * next_server_internal_process_client_to_server_packet( next_server_internal_t * server, uint8_t packet_type, uint8_t * packet_data, int packet_bytes )
 {
     next_assert( server );
@@ -12489,34 +14624,7 @@ next_session_entry_t * next_server_internal_process_client_to_server_packet( nex
 
     if ( entry->has_pending_route && next_read_header( NEXT_DIRECTION_CLIENT_TO_SERVER, packet_type, &packet_sequence, &packet_session_id, &packet_session_version, entry->pending_route_private_key, packet_data, packet_bytes ) == NEXT_OK )
     {
-        next_printf( NEXT_LOG_LEVEL_DEBUG, "server promoted pending route for session %016" PRIx64, entry->session_id );
-
-        if ( entry->has_current_route )
-        {
-            entry->has_previous_route = true;
-            entry->previous_route_send_address = entry->current_route_send_address;
-            memcpy( entry->previous_route_private_key, entry->current_route_private_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
-        }
-
-        entry->has_pending_route = false;
-        entry->has_current_route = true;
-        entry->current_route_session_version = entry->pending_route_session_version;
-        entry->current_route_expire_timestamp = entry->pending_route_expire_timestamp;
-        entry->current_route_expire_time = entry->pending_route_expire_time;
-        entry->current_route_kbps_up = entry->pending_route_kbps_up;
-        entry->current_route_kbps_down = entry->pending_route_kbps_down;
-        entry->current_route_send_address = entry->pending_route_send_address;
-        memcpy( entry->current_route_private_key, entry->pending_route_private_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
-
-        next_platform_mutex_acquire( &server->session_mutex );
-        entry->mutex_envelope_kbps_up = entry->current_route_kbps_up;
-        entry->mutex_envelope_kbps_down = entry->current_route_kbps_down;
-        entry->mutex_send_over_network_next = true;
-        entry->mutex_session_id = entry->session_id;
-        entry->mutex_session_version = entry->current_route_session_version;
-        entry->mutex_send_address = entry->current_route_send_address;
-        memcpy( entry->mutex_private_key, entry->current_route_private_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
-        next_platform_mutex_release( &server->session_mutex );
+        next_server_internal_promote_pending_route( server, entry );
     }
     else
     {
@@ -12548,77 +14656,56 @@ next_session_entry_t * next_server_internal_process_client_to_server_packet( nex
     return entry;
 }
 
-void next_server_internal_update_route( next_server_internal_t * server )
+void next_server_internal_update_session_route( next_server_internal_t * server, next_session_entry_t * entry, double current_time )
 {
     next_assert( server );
+    next_assert( entry );
 
-    next_server_internal_verify_sentinels( server );
-
-    if ( server->flushing )
-    	return;
-
-    if ( next_global_config.disable_network_next )
-        return;
-
-    const double current_time = next_time();
-
-    const int max_index = server->session_manager->max_entry_index;
-
-    for ( int i = 0; i <= max_index; ++i )
+    if ( entry->update_dirty && !entry->client_ping_timed_out && !entry->stats_fallback_to_direct && entry->update_last_send_time + NEXT_UPDATE_SEND_TIME <= current_time )
     {
-        if ( server->session_manager->session_ids[i] == 0 )
-            continue;
-
-        next_session_entry_t * entry = &server->session_manager->entries[i];
-
-        if ( entry->update_dirty && !entry->client_ping_timed_out && !entry->stats_fallback_to_direct && entry->update_last_send_time + NEXT_UPDATE_SEND_TIME <= current_time )
+        NextRouteUpdatePacket packet;
+        memcpy( packet.upcoming_magic, server->upcoming_magic, 8 );
+        memcpy( packet.current_magic, server->current_magic, 8 );
+        memcpy( packet.previous_magic, server->previous_magic, 8 );
+        packet.sequence = entry->update_sequence;
+        packet.dont_ping_near_relays = entry->update_dont_ping_near_relays;
+        packet.near_relays_changed = entry->update_near_relays_changed;
+        if ( packet.near_relays_changed )
         {
-            NextRouteUpdatePacket packet;
-            memcpy( packet.upcoming_magic, server->upcoming_magic, 8 );
-            memcpy( packet.current_magic, server->current_magic, 8 );
-            memcpy( packet.previous_magic, server->previous_magic, 8 );
-            packet.sequence = entry->update_sequence;
-            packet.dont_ping_near_relays = entry->update_dont_ping_near_relays;
-            packet.near_relays_changed = entry->update_near_relays_changed;
-            if ( packet.near_relays_changed )
-            {
-                packet.num_near_relays = entry->update_num_near_relays;
-                memcpy( packet.near_relay_ids, entry->update_near_relay_ids, size_t(8) * entry->update_num_near_relays );
-                memcpy( packet.near_relay_addresses, entry->update_near_relay_addresses, sizeof(next_address_t) * entry->update_num_near_relays );
-            }
-            packet.update_type = entry->update_type;
-            packet.multipath = entry->multipath;
-            packet.committed = entry->committed;
-            packet.num_tokens = entry->update_num_tokens;
-            if ( entry->update_type == NEXT_UPDATE_TYPE_ROUTE )
-            {
-                memcpy( packet.tokens, entry->update_tokens, NEXT_ENCRYPTED_ROUTE_TOKEN_BYTES * size_t(entry->update_num_tokens) );
-            }
-            else if ( entry->update_type == NEXT_UPDATE_TYPE_CONTINUE )
-            {
-                memcpy( packet.tokens, entry->update_tokens, NEXT_ENCRYPTED_CONTINUE_TOKEN_BYTES * size_t(entry->update_num_tokens) );
-            }
-            packet.packets_lost_client_to_server = entry->stats_packets_lost_client_to_server;
-            packet.packets_out_of_order_client_to_server = entry->stats_packets_out_of_order_client_to_server;
-            packet.jitter_client_to_server = float( entry->stats_jitter_client_to_server );
+            packet.num_near_relays = entry->update_num_near_relays;
+            memcpy( packet.near_relay_ids, entry->update_near_relay_ids, size_t(8) * entry->update_num_near_relays );
+            memcpy( packet.near_relay_addresses, entry->update_near_relay_addresses, sizeof(next_address_t) * entry->update_num_near_relays );
+        }
+        packet.update_type = entry->update_type;
+        packet.multipath = entry->multipath;
+        packet.committed = entry->committed;
+        packet.num_tokens = entry->update_num_tokens;
+        if ( entry->update_type == NEXT_UPDATE_TYPE_ROUTE )
+        {
+            memcpy( packet.tokens, entry->update_tokens, NEXT_ENCRYPTED_ROUTE_TOKEN_BYTES * size_t(entry->update_num_tokens) );
+        }
+        else if ( entry->update_type == NEXT_UPDATE_TYPE_CONTINUE )
+        {
+            memcpy( packet.tokens, entry->update_tokens, NEXT_ENCRYPTED_CONTINUE_TOKEN_BYTES * size_t(entry->update_num_tokens) );
+        }
+        packet.packets_lost_client_to_server = entry->stats_packets_lost_client_to_server;
+        packet.packets_out_of_order_client_to_server = entry->stats_packets_out_of_order_client_to_server;
+        packet.jitter_client_to_server = float( entry->stats_jitter_client_to_server );
 
-            next_platform_mutex_acquire( &server->session_mutex );
-            packet.packets_sent_server_to_client = entry->stats_packets_sent_server_to_client;
-            next_platform_mutex_release( &server->session_mutex );
+        packet.packets_sent_server_to_client = next_atomic_load_64( &entry->send_state->payload_send_sequence );
 
-            packet.has_debug = entry->has_debug;
-            memcpy( packet.debug, entry->debug, NEXT_MAX_SESSION_DEBUG );
+        packet.has_debug = entry->has_debug;
+        memcpy( packet.debug, entry->debug, NEXT_MAX_SESSION_DEBUG );
 
-            packet.exclude_near_relays = entry->exclude_near_relays;
-            memcpy( packet.near_relay_excluded, entry->near_relay_excluded, sizeof( packet.near_relay_excluded ) );
-            packet.high_frequency_pings = entry->high_frequency_pings;
+        packet.exclude_near_relays = entry->exclude_near_relays;
+        memcpy( packet.near_relay_excluded, entry->near_relay_excluded, sizeof( packet.near_relay_excluded ) );
+        packet.high_frequency_pings = entry->high_frequency_pings;
 
-            next_server_internal_send_packet( server, &entry->address, NEXT_ROUTE_UPDATE_PACKET, &packet );
+        next_server_internal_send_packet( server, &entry->address, NEXT_ROUTE_UPDATE_PACKET, &packet );
 
-            entry->update_last_send_time = current_time;
+        entry->update_last_send_time = current_time;
 
-            next_printf( NEXT_LOG_LEVEL_DEBUG, "server sent route update packet to session %016" PRIx64, entry->session_id );
-        }
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server sent route update packet to session %016" PRIx64, entry->session_id );
     }
 }
 
@@ -12689,81 +14776,69 @@ void next_server_internal_update_pending_upgrades( next_server_internal_t * serv
     }
 }
 
-void next_server_internal_update_sessions( next_server_internal_t * server )
+bool next_server_internal_update_session_timeouts( next_server_internal_t * server, int index, double current_time )
 {
     next_assert( server );
+    next_assert( index >= 0 );
+    next_assert( index <= server->session_manager->max_entry_index );
+    next_assert( server->session_manager->session_ids[index] != 0 );
 
-    next_server_internal_verify_sentinels( server );
-
-    if ( next_global_config.disable_network_next )
-        return;
-
-    if ( server->state == NEXT_SERVER_STATE_DIRECT_ONLY )
-        return;
-
-    const double current_time = next_time();
+    next_session_entry_t * entry = &server->session_manager->entries[index];
 
-    int index = 0;
+    if ( !entry->client_ping_timed_out &&
+         entry->last_client_direct_ping + NEXT_SERVER_PING_TIMEOUT <= current_time &&
+         entry->last_client_next_ping + NEXT_SERVER_PING_TIMEOUT <= current_time )
+    {
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server client ping timed out for session %016" PRIx64, entry->session_id );
+        entry->client_ping_timed_out = true;
+    }
 
-    while ( index <= server->session_manager->max_entry_index )
+    // IMPORTANT: Don't time out sessions during server flush. Otherwise the server flush might wait longer than necessary.
+    if ( !server->flushing && entry->last_client_stats_update + NEXT_SERVER_SESSION_TIMEOUT <= current_time )
     {
-        if ( server->session_manager->session_ids[index] == 0 )
+        next_server_notify_session_timed_out_t * notify = (next_server_notify_session_timed_out_t*) next_malloc( server->context, sizeof( next_server_notify_session_timed_out_t ) );
+        notify->type = NEXT_SERVER_NOTIFY_SESSION_TIMED_OUT;
+        notify->address = entry->address;
+        notify->session_id = entry->session_id;
         {
-            ++index;
-            continue;
+            next_platform_mutex_guard( &server->notify_mutex );
+            next_queue_push( server->notify_queue, notify );
         }
 
-        next_session_entry_t * entry = &server->session_manager->entries[index];
-
-        if ( !entry->client_ping_timed_out &&
-             entry->last_client_direct_ping + NEXT_SERVER_PING_TIMEOUT <= current_time &&
-             entry->last_client_next_ping + NEXT_SERVER_PING_TIMEOUT <= current_time )
-        {
-            next_printf( NEXT_LOG_LEVEL_DEBUG, "server client ping timed out for session %016" PRIx64, entry->session_id );
-            entry->client_ping_timed_out = true;
-        }
+        next_server_internal_retire_receive_session( server, entry->session_id );
 
-        // IMPORTANT: Don't time out sessions during server flush. Otherwise the server flush might wait longer than necessary.
-        if ( !server->flushing && entry->last_client_stats_update + NEXT_SERVER_SESSION_TIMEOUT <= current_time )
-        {
-            next_server_notify_session_timed_out_t * notify = (next_server_notify_session_timed_out_t*) next_malloc( server->context, sizeof( next_server_notify_session_timed_out_t ) );
-            notify->type = NEXT_SERVER_NOTIFY_SESSION_TIMED_OUT;
-            notify->address = entry->address;
-            notify->session_id = entry->session_id;
-            {
-                next_platform_mutex_guard( &server->notify_mutex );
-                next_queue_push( server->notify_queue, notify );
-            }
+        next_platform_mutex_acquire( &server->session_mutex );
+        next_session_manager_remove_at_index( server->session_manager, index );
+        next_platform_mutex_release( &server->session_mutex );
 
-            next_platform_mutex_acquire( &server->session_mutex );
-            next_session_manager_remove_at_index( server->session_manager, index );
-            next_platform_mutex_release( &server->session_mutex );
+        next_timer_wheel_cancel( server->session_timers, index );
 
-            continue;
-        }
+        return true;
+    }
 
-        if ( entry->has_current_route && entry->current_route_expire_time <= current_time )
+    if ( entry->has_current_route && entry->current_route_expire_time <= current_time )
+    {
+        // IMPORTANT: Only print this out as an error if it occurs *before* the client ping times out
+        // otherwise we get red herring errors on regular client disconnect from server that make it
+        // look like something is wrong when everything is fine...
+        if ( !entry->client_ping_timed_out )
         {
-            // IMPORTANT: Only print this out as an error if it occurs *before* the client ping times out
-            // otherwise we get red herring errors on regular client disconnect from server that make it
-            // look like something is wrong when everything is fine...
-            if ( !entry->client_ping_timed_out )
-            {
-                next_printf( NEXT_LOG_LEVEL_ERROR, "server network next route expired for session %016" PRIx64, entry->session_id );
-            }
+            next_printf( NEXT_LOG_LEVEL_ERROR, "server network next route expired for session %016" PRIx64, entry->session_id );
+        }
 
-            entry->has_current_route = false;
-            entry->has_previous_route = false;
-            entry->update_dirty = false;
-            entry->waiting_for_update_response = false;
+        entry->has_current_route = false;
+        entry->has_previous_route = false;
+        entry->update_dirty = false;
+        entry->waiting_for_update_response = false;
 
-            next_platform_mutex_acquire( &server->session_mutex );
-            entry->mutex_send_over_network_next = false;
-            next_platform_mutex_release( &server->session_mutex );
-        }
+        next_session_send_state_begin_write( entry->send_state );
+        entry->send_state->route.send_over_network_next = false;
+        next_session_send_state_end_write( entry->send_state );
 
-        index++;
+        next_server_internal_publish_receive_session( server, entry );
     }
+
+    return false;
 }
 
 void next_server_internal_update_flush( next_server_internal_t * server )
@@ -12976,6 +15051,20 @@ void next_server_internal_process_network_next_packet( next_server_internal_t *
     {
     	const int packet_bytes = end - begin;
 
+        if ( server->num_receive_workers > 0 )
+        {
+            next_session_entry_t * entry = next_session_manager_find_by_address( server->session_manager, from );
+            if ( !entry )
+            {
+                char address_buffer[NEXT_MAX_ADDRESS_STRING_LENGTH];
+                next_printf( NEXT_LOG_LEVEL_DEBUG, "server ignored direct packet from %s. could not find session for address", next_address_to_string( from, address_buffer ) );
+                return;
+            }
+
+            next_server_internal_dispatch_receive_packet( server, next_session_id_hash( entry->session_id ), NEXT_DIRECT_PACKET, entry->session_id, from, packet_data + begin, packet_bytes );
+            return;
+        }
+
         if ( packet_bytes <= 9 )
         {
             char address_buffer[NEXT_MAX_ADDRESS_STRING_LENGTH];
@@ -13030,27 +15119,7 @@ void next_server_internal_process_network_next_packet( next_server_internal_t *
 
     	begin += 9;
 
-    	const int payload_bytes = end - begin;
-    	const uint8_t * payload_data = packet_data + begin;
-
-    	if ( server->callbacks.payload_receive_callback )
-    	{
-    		void * callback_data = server->callbacks.payload_receive_callback_data;
-    		if ( server->callbacks.payload_receive_callback( callback_data, from, payload_data, payload_bytes ) )
-	    		return;
-    	}
-
-        next_server_notify_packet_received_t * notify = (next_server_notify_packet_received_t*) next_malloc( server->context, sizeof( next_server_notify_packet_received_t ) );
-        notify->type = NEXT_SERVER_NOTIFY_PACKET_RECEIVED;
-        notify->from = *from;
-        notify->packet_bytes = payload_bytes;
-        next_assert( notify->packet_bytes > 0 );
-        next_assert( notify->packet_bytes <= NEXT_MTU );
-        memcpy( notify->packet_data, payload_data, size_t(notify->packet_bytes) );
-        {
-            next_platform_mutex_guard( &server->notify_mutex );
-            next_queue_push( server->notify_queue, notify );
-        }
+        next_server_internal_deliver_payload( server, from, packet_data + begin, end - begin );
 
         return;
     }
@@ -13168,18 +15237,20 @@ void next_server_internal_process_network_next_packet( next_server_internal_t *
         {
             next_printf( NEXT_LOG_LEVEL_DEBUG, "server multipath enabled for session %016" PRIx64, entry->session_id );
             entry->multipath = true;
-            next_platform_mutex_acquire( &server->session_mutex );
-            entry->mutex_multipath = true;
-            next_platform_mutex_release( &server->session_mutex );
+            next_session_send_state_begin_write( entry->send_state );
+            entry->send_state->route.multipath = true;
+            next_session_send_state_end_write( entry->send_state );
         }
 
         entry->committed = packet.committed;
-        next_platform_mutex_acquire( &server->session_mutex );
-        entry->mutex_committed = packet.committed;
-        next_platform_mutex_release( &server->session_mutex );
+        next_session_send_state_begin_write( entry->send_state );
+        entry->send_state->route.committed = packet.committed;
+        next_session_send_state_end_write( entry->send_state );
 
         entry->update_dirty = true;
 
+        next_server_internal_wake_session( server, entry, entry->update_last_send_time + NEXT_UPDATE_SEND_TIME );
+
         entry->update_type = (uint8_t) packet.response_type;
 
         entry->update_num_tokens = packet.num_tokens;
@@ -13213,13 +15284,14 @@ void next_server_internal_process_network_next_packet( next_server_internal_t *
         {
             bool session_transitions_to_direct = false;
 
-            next_platform_mutex_acquire( &server->session_mutex );
-            if ( entry->mutex_send_over_network_next )
+            // IMPORTANT: the internal thread is the only writer of the send route, so it can read it without the seqlock
+            if ( entry->send_state->route.send_over_network_next )
             {
-                entry->mutex_send_over_network_next = false;
+                next_session_send_state_begin_write( entry->send_state );
+                entry->send_state->route.send_over_network_next = false;
+                next_session_send_state_end_write( entry->send_state );
                 session_transitions_to_direct = true;
             }
-            next_platform_mutex_release( &server->session_mutex );
 
             if ( session_transitions_to_direct )
             {
@@ -13227,6 +15299,8 @@ void next_server_internal_process_network_next_packet( next_server_internal_t *
                 entry->has_current_route = false;
                 entry->previous_route_send_address = entry->current_route_send_address;
                 memcpy( entry->previous_route_private_key, entry->current_route_private_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
+
+                next_server_internal_publish_receive_session( server, entry );
             }
         }
 
@@ -13433,7 +15507,15 @@ void next_server_internal_process_network_next_packet( next_server_internal_t *
             entry->client_open_session_sequence = packet.client_open_session_sequence;
             entry->stats_platform_id = packet.platform_id;
             entry->stats_connection_type = packet.connection_type;
-            entry->last_upgraded_packet_receive_time = next_time();
+
+            next_session_send_state_begin_write( entry->send_state );
+            entry->send_state->route.open_session_sequence = packet.client_open_session_sequence;
+            entry->send_state->route.last_upgraded_packet_receive_time = next_time();
+            next_session_send_state_end_write( entry->send_state );
+
+            next_server_internal_publish_receive_session( server, entry );
+
+            next_server_internal_wake_session( server, entry, next_time() );
 
             // notify session upgraded
 
@@ -13441,9 +15523,14 @@ void next_server_internal_process_network_next_packet( next_server_internal_t *
             notify->type = NEXT_SERVER_NOTIFY_SESSION_UPGRADED;
             notify->address = entry->address;
             notify->session_id = entry->session_id;
+            notify->send_state = entry->send_state;
+            next_session_send_state_retain( entry->send_state );
             {
                 next_platform_mutex_guard( &server->notify_mutex );
-                next_queue_push( server->notify_queue, notify );
+                if ( next_queue_push( server->notify_queue, notify ) != NEXT_OK )
+                {
+                    next_session_send_state_release( entry->send_state );
+                }
             }
 
             char address_buffer[NEXT_MAX_ADDRESS_STRING_LENGTH];
@@ -13560,6 +15647,8 @@ void next_server_internal_process_network_next_packet( next_server_internal_t *
             entry->pending_route_send_address = *from;
             memcpy( entry->pending_route_private_key, route_token.private_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
             entry->most_recent_session_version = route_token.session_version;
+
+            next_server_internal_publish_receive_session( server, entry );
         }
 
         uint64_t session_send_sequence = entry->special_send_sequence++;
@@ -13639,7 +15728,12 @@ void next_server_internal_process_network_next_packet( next_server_internal_t *
 
         entry->current_route_expire_timestamp = continue_token.expire_timestamp;
         entry->current_route_expire_time += NEXT_SLICE_SECONDS;
-        entry->has_previous_route = false;
+
+        if ( entry->has_previous_route )
+        {
+            entry->has_previous_route = false;
+            next_server_internal_publish_receive_session( server, entry );
+        }
 
         uint64_t session_send_sequence = entry->special_send_sequence++;
 
@@ -13681,6 +15775,22 @@ void next_server_internal_process_network_next_packet( next_server_internal_t *
             return;
         }
 
+        if ( server->num_receive_workers > 0 )
+        {
+            uint64_t packet_sequence = 0;
+            uint64_t packet_session_id = 0;
+            uint8_t packet_session_version = 0;
+
+            if ( next_peek_header( NEXT_DIRECTION_CLIENT_TO_SERVER, packet_id, &packet_sequence, &packet_session_id, &packet_session_version, packet_data + begin, packet_bytes ) != NEXT_OK )
+            {
+                next_printf( NEXT_LOG_LEVEL_DEBUG, "server ignored client to server packet. could not peek header" );
+                return;
+            }
+
+            next_server_internal_dispatch_receive_packet( server, next_session_id_hash( packet_session_id ), NEXT_CLIENT_TO_SERVER_PACKET, packet_session_id, from, packet_data + begin, packet_bytes );
+            return;
+        }
+
         next_session_entry_t * entry = next_server_internal_process_client_to_server_packet( server, packet_id, packet_data + begin, packet_bytes );
         if ( !entry )
         {
@@ -13692,27 +15802,7 @@ void next_server_internal_process_network_next_packet( next_server_internal_t *
 
         begin += NEXT_HEADER_BYTES;
 
-        const int payload_bytes = end - begin;
-        const uint8_t * payload_data = packet_data + begin;
-
-    	if ( server->callbacks.payload_receive_callback )
-    	{
-    		void * callback_data = server->callbacks.payload_receive_callback_data;
-    		if ( server->callbacks.payload_receive_callback( callback_data, &entry->address, payload_data, payload_bytes ) )
-	    		return;
-    	}
-
-        next_server_notify_packet_received_t * notify = (next_server_notify_packet_received_t*) next_malloc( server->context, sizeof( next_server_notify_packet_received_t ) );
-        notify->type = NEXT_SERVER_NOTIFY_PACKET_RECEIVED;
-        notify->from = entry->address;
-        notify->packet_bytes = payload_bytes;
-        next_assert( notify->packet_bytes > 0 );
-        next_assert( notify->packet_bytes <= NEXT_MTU );
-        memcpy( notify->packet_data, payload_data, size_t(notify->packet_bytes) );
-        {
-            next_platform_mutex_guard( &server->notify_mutex );
-            next_queue_push( server->notify_queue, notify );
-        }
+        next_server_internal_deliver_payload( server, &entry->address, packet_data + begin, end - begin );
 
         return;
     }
@@ -13782,7 +15872,9 @@ void next_server_internal_process_network_next_packet( next_server_internal_t *
         if ( !session )
             return;
 
-        session->last_upgraded_packet_receive_time = next_time();
+        next_session_send_state_begin_write( session->send_state );
+        session->send_state->route.last_upgraded_packet_receive_time = next_time();
+        next_session_send_state_end_write( session->send_state );
     }
 
     // direct ping packet
@@ -13943,44 +16035,31 @@ void next_server_internal_process_passthrough_packet( next_server_internal_t * s
 
     next_server_internal_verify_sentinels( server );
 
-    if ( packet_bytes <= NEXT_MTU )
-    {
-    	if ( server->callbacks.payload_receive_callback )
-    	{
-    		void * callback_data = server->callbacks.payload_receive_callback_data;
-    		if ( server->callbacks.payload_receive_callback( callback_data, from, packet_data, packet_bytes ) )
-	    		return;
-    	}
-
-        next_server_notify_packet_received_t * notify = (next_server_notify_packet_received_t*) next_malloc( server->context, sizeof( next_server_notify_packet_received_t ) );
-        notify->type = NEXT_SERVER_NOTIFY_PACKET_RECEIVED;
-        notify->from = *from;
-        notify->packet_bytes = packet_bytes;
-        next_assert( packet_bytes > 0 );
-        next_assert( packet_bytes <= NEXT_MTU );
-        memcpy( notify->packet_data, packet_data, size_t(packet_bytes) );
-        {
-            next_platform_mutex_guard( &server->notify_mutex );
-            next_queue_push( server->notify_queue, notify );
-        }
-    }
-}
+    if ( packet_bytes > NEXT_MTU )
+        return;
 
-void next_server_internal_block_and_receive_packet( next_server_internal_t * server )
-{
-    next_server_internal_verify_sentinels( server );
+    if ( server->num_receive_workers > 0 )
+    {
+        // key passthrough packets by session when there is one, so they are delivered in order with the session's other packets
 
-    uint8_t packet_data[NEXT_MAX_PACKET_BYTES];
+        next_session_entry_t * entry = next_session_manager_find_by_address( server->session_manager, from );
 
-    next_assert( ( size_t(packet_data) % 4 ) == 0 );
+        const uint32_t hash = entry ? next_session_id_hash( entry->session_id ) : next_address_hash( from );
 
-    next_address_t from;
+        next_server_internal_dispatch_receive_packet( server, hash, NEXT_PASSTHROUGH_PACKET, 0, from, packet_data, packet_bytes );
 
-    const int packet_bytes = next_platform_socket_receive_packet( server->socket, &from, packet_data, NEXT_MAX_PACKET_BYTES );
+        return;
+    }
 
-    if ( packet_bytes == 0 )
-    	return;
+    next_server_internal_deliver_payload( server, from, packet_data, packet_bytes );
+}
+
+void next_server_internal_process_packet( next_server_internal_t * server, next_address_t * from, uint8_t * packet_data, int packet_bytes )
+{
+    next_server_internal_verify_sentinels( server );
 
+    next_assert( from );
+    next_assert( packet_data );
     next_assert( packet_bytes > 0 );
 
     int begin = 0;
@@ -13990,7 +16069,7 @@ void next_server_internal_block_and_receive_packet( next_server_internal_t * ser
     {
     	void * callback_data = server->callbacks.packet_receive_callback_data;
 
-	    server->callbacks.packet_receive_callback( callback_data, &from, packet_data, &begin, &end );
+	    server->callbacks.packet_receive_callback( callback_data, from, packet_data, &begin, &end );
 
 	    next_assert( begin >= 0 );
 	    next_assert( end <= NEXT_MAX_PACKET_BYTES );
@@ -14008,13 +16087,63 @@ void next_server_internal_block_and_receive_packet( next_server_internal_t * ser
 
     if ( packet_type != NEXT_PASSTHROUGH_PACKET )
     {
-    	next_server_internal_process_network_next_packet( server, &from, packet_data, begin, end );
+    	next_server_internal_process_network_next_packet( server, from, packet_data, begin, end );
     }
     else
     {
     	begin += 1;
-        next_server_internal_process_passthrough_packet( server, &from, packet_data + begin, end - begin );
+        next_server_internal_process_passthrough_packet( server, from, packet_data + begin, end - begin );
+    }
+}
+
+bool next_server_internal_block_and_receive_packet( next_server_internal_t * server )
+{
+    next_server_internal_verify_sentinels( server );
+
+    // packets land after send headroom and have send tailroom after them, so the packet receive callback can send whatever
+    // part of a packet it forwards with next_server_send_packet_in_place
+
+    uint8_t packet_buffer[NEXT_SEND_PACKET_HEADROOM + NEXT_MAX_PACKET_BYTES + NEXT_SEND_PACKET_TAILROOM];
+
+    uint8_t * packet_data = packet_buffer + NEXT_SEND_PACKET_HEADROOM;
+
+    next_assert( ( size_t(packet_data) % 4 ) == 0 );
+
+    next_address_t from;
+
+    bool received_packet = false;
+
+    // process packets handed to the server in-process first. the packet source returns zero once it has nothing left for this pass
+
+    if ( server->callbacks.packet_source_callback )
+    {
+    	void * callback_data = server->callbacks.packet_source_callback_data;
+
+    	while ( true )
+    	{
+    		const int packet_bytes = server->callbacks.packet_source_callback( callback_data, &from, packet_data, NEXT_MAX_PACKET_BYTES );
+
+    		if ( packet_bytes <= 0 )
+    			break;
+
+    		next_assert( packet_bytes <= NEXT_MAX_PACKET_BYTES );
+
+    		next_server_internal_process_packet( server, &from, packet_data, packet_bytes );
+
+    		received_packet = true;
+    	}
     }
+
+    const int packet_bytes = next_platform_socket_receive_packet( server->socket, &from, packet_data, NEXT_MAX_PACKET_BYTES );
+
+    if ( packet_bytes == 0 )
+    	return received_packet;
+
+    next_assert( packet_bytes > 0 );
+
+    next_server_internal_process_packet( server, &from, packet_data, packet_bytes );
+
+    return true;
 }
 
 void next_server_internal_upgrade_session( next_server_internal_t * server, const next_address_t * address, uint64_t session_id, uint64_t user_hash )
@@ -14058,7 +16187,15 @@ void next_server_internal_upgrade_session( next_server_internal_t * server, cons
 
     next_pending_session_manager_remove_by_address( server->pending_session_manager, address );
 
+    next_session_entry_t * existing_entry = next_session_manager_find_by_address( server->session_manager, address );
+    if ( existing_entry )
+    {
+        next_server_internal_retire_receive_session( server, existing_entry->session_id );
+    }
+
+    next_platform_mutex_acquire( &server->session_mutex );
     next_session_manager_remove_by_address( server->session_manager, address );
+    next_platform_mutex_release( &server->session_mutex );
 
     next_pending_session_entry_t * entry = next_pending_session_manager_add( server->pending_session_manager, address, upgrade_token.session_id, session_private_key, upgrade_token_data, next_time() );
 
@@ -14173,6 +16310,8 @@ void next_server_internal_match_data( next_server_internal_t * server, const nex
     }
     entry->has_match_data = true;
 
+    next_server_internal_wake_session( server, entry, next_time() );
+
     char buffer[NEXT_MAX_ADDRESS_STRING_LENGTH];
     next_printf( NEXT_LOG_LEVEL_DEBUG, "server adds match data for session %016" PRIx64 " at address %s", entry->session_id, next_address_to_string( address, buffer ) );
 }
@@ -14200,6 +16339,8 @@ void next_server_internal_flush_session_update( next_server_internal_t * server
         session->session_flush_update_sequence = session->update_sequence + 1;
         session->session_update_flush = true;
         server->num_session_updates_to_flush++;
+
+        next_server_internal_wake_session( server, session, next_time() );
     }
 }
 
@@ -14222,6 +16363,8 @@ void next_server_internal_flush_match_data( next_server_internal_t * server )
 
         session->match_data_flush = true;
         server->num_match_data_to_flush++;
+
+        next_server_internal_wake_session( server, session, next_time() );
     }
 }
 
@@ -14707,7 +16850,7 @@ void next_server_internal_update_init( next_server_internal_t * server )
     next_printf( NEXT_LOG_LEVEL_DEBUG, "server sent init request to backend" );
 }
 
-void next_server_internal_backend_update( next_server_internal_t * server )
+bool next_server_internal_backend_update( next_server_internal_t * server )
 {
     next_server_internal_verify_sentinels( server );
 
@@ -14718,34 +16861,10 @@ void next_server_internal_backend_update( next_server_internal_t * server )
     // don't do anything until we resolve the backend hostname
 
     if ( server->resolving_hostname )
-        return;
-
-    // tracker updates
-
-    const int max_entry_index = server->session_manager->max_entry_index;
-
-    for ( int i = 0; i <= max_entry_index; ++i )
-    {
-        if ( server->session_manager->session_ids[i] == 0 )
-            continue;
-
-        next_session_entry_t * session = &server->session_manager->entries[i];
-
-        if ( session->stats_fallback_to_direct )
-            continue;
-
-        if ( session->next_tracker_update_time <= current_time )
-        {
-            const int packets_lost = next_packet_loss_tracker_update( &session->packet_loss_tracker );
-            session->stats_packets_lost_client_to_server += packets_lost;
-            session->stats_packets_out_of_order_client_to_server = session->out_of_order_tracker.num_out_of_order_packets;
-            session->stats_jitter_client_to_server = session->jitter_tracker.jitter * 1000.0;
-            session->next_tracker_update_time = current_time + NEXT_SECONDS_BETWEEN_PACKET_LOSS_UPDATES;
-        }
-    }
+        return false;
 
     if ( server->state != NEXT_SERVER_STATE_INITIALIZED )
-        return;
+        return false;
 
     // server update
 
@@ -14757,7 +16876,7 @@ void next_server_internal_backend_update( next_server_internal_t * server )
         {
             next_printf( NEXT_LOG_LEVEL_INFO, "server update response timed out. falling back to direct mode only :(" );
             server->state = NEXT_SERVER_STATE_DIRECT_ONLY;
-            return;
+            return false;
         }
 
         while ( server->server_update_request_id == 0 )
@@ -14797,7 +16916,7 @@ void next_server_internal_backend_update( next_server_internal_t * server )
         if ( next_write_backend_packet( NEXT_BACKEND_SERVER_UPDATE_REQUEST_PACKET, &packet, packet_data, &packet_bytes, next_signed_packets, server->customer_private_key, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port ) != NEXT_OK )
         {
             next_printf( NEXT_LOG_LEVEL_ERROR, "server failed to write server update request packet for backend" );
-            return;
+            return false;
         }
 
         next_assert( next_basic_packet_filter( packet_data, packet_bytes ) );
@@ -14813,7 +16932,7 @@ void next_server_internal_backend_update( next_server_internal_t * server )
     }
 
     if ( first_server_update )
-        return;
+        return false;
 
     // server update resend
 
@@ -14848,7 +16967,7 @@ void next_server_internal_backend_update( next_server_internal_t * server )
         if ( next_write_backend_packet( NEXT_BACKEND_SERVER_UPDATE_REQUEST_PACKET, &packet, packet_data, &packet_bytes, next_signed_packets, server->customer_private_key, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port ) != NEXT_OK )
         {
             next_printf( NEXT_LOG_LEVEL_ERROR, "server failed to write server update packet for backend" );
-            return;
+            return false;
         }
 
         next_assert( next_basic_packet_filter( packet_data, packet_bytes ) );
@@ -14861,330 +16980,547 @@ void next_server_internal_backend_update( next_server_internal_t * server )
         server->server_update_resend_time = current_time + 1.0;
     }
 
-    // session updates
+    return true;
+}
 
-    for ( int i = 0; i <= max_entry_index; ++i )
+void next_server_internal_update_session_trackers( next_server_internal_t * server, next_session_entry_t * session, double current_time )
+{
+    next_assert( server );
+    next_assert( session );
+
+    if ( session->stats_fallback_to_direct )
+        return;
+
+    // receive workers run the trackers for their own sessions and report through the receive event queue
+
+    if ( server->num_receive_workers == 0 && session->next_tracker_update_time <= current_time )
     {
-        if ( server->session_manager->session_ids[i] == 0 )
-            continue;
+        const int packets_lost = next_packet_loss_tracker_update( &session->packet_loss_tracker );
+        session->stats_packets_lost_client_to_server += packets_lost;
+        session->stats_packets_out_of_order_client_to_server = session->out_of_order_tracker.num_out_of_order_packets;
+        session->stats_jitter_client_to_server = session->jitter_tracker.jitter * 1000.0;
+        session->next_tracker_update_time = current_time + NEXT_SECONDS_BETWEEN_PACKET_LOSS_UPDATES;
+    }
+}
 
-        next_session_entry_t * session = &server->session_manager->entries[i];
+void next_server_internal_backend_update_session( next_server_internal_t * server, next_session_entry_t * session, double current_time )
+{
+    next_assert( server );
+    next_assert( session );
+
+    // session update
+
+    if ( ( session->next_session_update_time >= 0.0 && session->next_session_update_time <= current_time ) || ( session->session_update_flush && !session->session_update_flush_finished && !session->waiting_for_update_response ) )
+    {
+        NextBackendSessionUpdateRequestPacket packet;
+
+        packet.Reset();
+
+        packet.customer_id = server->customer_id;
+        packet.datacenter_id = server->datacenter_id;
+        packet.session_id = session->session_id;
+        packet.slice_number = session->update_sequence++;
+        packet.platform_id = session->stats_platform_id;
+        packet.user_hash = session->user_hash;
+        packet.num_tags = session->num_tags;
+        for ( int j = 0; j < session->num_tags; ++j )
+        {
+            packet.tags[j] = session->tags[j];
+        }
+        session->previous_server_events = session->current_server_events;
+        session->current_server_events = 0;
+        packet.server_events = session->previous_server_events;
+        packet.reported = session->stats_reported;
+        packet.fallback_to_direct = session->stats_fallback_to_direct;
+        packet.client_bandwidth_over_limit = session->stats_client_bandwidth_over_limit;
+        packet.server_bandwidth_over_limit = next_atomic_exchange_32( &session->send_state->server_bandwidth_over_limit, 0 ) != 0;
+        packet.client_ping_timed_out = session->client_ping_timed_out;
+        packet.connection_type = session->stats_connection_type;
+        packet.next_kbps_up = session->stats_next_kbps_up;
+        packet.next_kbps_down = session->stats_next_kbps_down;
+        packet.packets_sent_client_to_server = session->stats_packets_sent_client_to_server;
+        packet.packets_sent_server_to_client = next_atomic_load_64( &session->send_state->payload_send_sequence );
+
+        packet.packets_lost_client_to_server = session->stats_packets_lost_client_to_server;
+        packet.packets_lost_server_to_client = session->stats_packets_lost_server_to_client;
+        packet.packets_out_of_order_client_to_server = session->stats_packets_out_of_order_client_to_server;
+        packet.packets_out_of_order_server_to_client = session->stats_packets_out_of_order_server_to_client;
+        packet.jitter_client_to_server = session->stats_jitter_client_to_server;
+        packet.jitter_server_to_client = session->stats_jitter_server_to_client;
+        packet.next = session->stats_next;
+        packet.committed = session->stats_committed;
+        packet.next_rtt = session->stats_next_rtt;
+        packet.next_jitter = session->stats_next_jitter;
+        packet.next_packet_loss = session->stats_next_packet_loss;
+        packet.direct_min_rtt = session->stats_direct_min_rtt;
+        packet.direct_max_rtt = session->stats_direct_max_rtt;
+        packet.direct_prime_rtt = session->stats_direct_prime_rtt;
+        packet.direct_jitter = session->stats_direct_jitter;
+        packet.direct_packet_loss = session->stats_direct_packet_loss;
+        packet.has_near_relay_pings = session->stats_has_near_relay_pings;
+        packet.num_near_relays = session->stats_num_near_relays;
+        for ( int j = 0; j < packet.num_near_relays; ++j )
+        {
+            packet.near_relay_ids[j] = session->stats_near_relay_ids[j];
+            packet.near_relay_rtt[j] = session->stats_near_relay_rtt[j];
+            packet.near_relay_jitter[j] = session->stats_near_relay_jitter[j];
+            packet.near_relay_packet_loss[j] = session->stats_near_relay_packet_loss[j];
+        }
+        packet.client_address = session->address;
+        packet.server_address = server->server_address;
+        memcpy( packet.client_route_public_key, session->client_route_public_key, NEXT_CRYPTO_BOX_PUBLICKEYBYTES );
+        memcpy( packet.server_route_public_key, server->server_route_public_key, NEXT_CRYPTO_BOX_PUBLICKEYBYTES );
+
+        next_assert( session->session_data_bytes >= 0 );
+        next_assert( session->session_data_bytes <= NEXT_MAX_SESSION_DATA_BYTES );
+        packet.session_data_bytes = session->session_data_bytes;
+        memcpy( packet.session_data, session->session_data, session->session_data_bytes );
+
+        session->session_update_request_packet = packet;
+
+        uint8_t magic[8];
+        memset( magic, 0, sizeof(magic) );
+
+        uint8_t from_address_data[32];
+        uint8_t to_address_data[32];
+        uint16_t from_address_port;
+        uint16_t to_address_port;
+        int from_address_bytes;
+        int to_address_bytes;
+
+        next_address_data( &server->server_address, from_address_data, &from_address_bytes, &from_address_port );
+        next_address_data( &server->backend_address, to_address_data, &to_address_bytes, &to_address_port );
+
+        uint8_t packet_data[NEXT_MAX_PACKET_BYTES];
+
+        next_assert( ( size_t(packet_data) % 4 ) == 0 );
+
+        int packet_bytes = 0;
+        if ( next_write_backend_packet( NEXT_BACKEND_SESSION_UPDATE_REQUEST_PACKET, &packet, packet_data, &packet_bytes, next_signed_packets, server->customer_private_key, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port ) != NEXT_OK )
+        {
+            next_printf( NEXT_LOG_LEVEL_ERROR, "server failed to write server init request packet for backend" );
+            return;
+        }
+
+        next_assert( next_basic_packet_filter( packet_data, packet_bytes ) );
+        next_assert( next_advanced_packet_filter( packet_data, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port, packet_bytes ) );
+
+        next_server_internal_send_packet_to_backend( server, packet_data, packet_bytes );
+
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server sent session update packet to backend for session %016" PRIx64, session->session_id );
 
-        if ( ( session->next_session_update_time >= 0.0 && session->next_session_update_time <= current_time ) || ( session->session_update_flush && !session->session_update_flush_finished && !session->waiting_for_update_response ) )
+        if ( session->next_session_update_time == 0.0 )
+        {
+            session->next_session_update_time = current_time + NEXT_SECONDS_BETWEEN_SESSION_UPDATES;
+        }
+        else
         {
-            NextBackendSessionUpdateRequestPacket packet;
+            session->next_session_update_time += NEXT_SECONDS_BETWEEN_SESSION_UPDATES;
+        }
 
-            packet.Reset();
+        session->stats_client_bandwidth_over_limit = false;
 
-            packet.customer_id = server->customer_id;
-            packet.datacenter_id = server->datacenter_id;
-            packet.session_id = session->session_id;
-            packet.slice_number = session->update_sequence++;
-            packet.platform_id = session->stats_platform_id;
-            packet.user_hash = session->user_hash;
-            packet.num_tags = session->num_tags;
-            for ( int j = 0; j < session->num_tags; ++j )
-            {
-                packet.tags[j] = session->tags[j];
-            }
-            session->previous_server_events = session->current_server_events;
-            session->current_server_events = 0;
-            packet.server_events = session->previous_server_events;
-            packet.reported = session->stats_reported;
-            packet.fallback_to_direct = session->stats_fallback_to_direct;
-            packet.client_bandwidth_over_limit = session->stats_client_bandwidth_over_limit;
-            packet.server_bandwidth_over_limit = session->stats_server_bandwidth_over_limit;
-            packet.client_ping_timed_out = session->client_ping_timed_out;
-            packet.connection_type = session->stats_connection_type;
-            packet.next_kbps_up = session->stats_next_kbps_up;
-            packet.next_kbps_down = session->stats_next_kbps_down;
-            packet.packets_sent_client_to_server = session->stats_packets_sent_client_to_server;
-            next_platform_mutex_acquire( &server->session_mutex );
-            packet.packets_sent_server_to_client = session->stats_packets_sent_server_to_client;
-            next_platform_mutex_release( &server->session_mutex );
+        session->next_session_resend_time = current_time + NEXT_SESSION_UPDATE_RESEND_TIME;
 
-            packet.packets_lost_client_to_server = session->stats_packets_lost_client_to_server;
-            packet.packets_lost_server_to_client = session->stats_packets_lost_server_to_client;
-            packet.packets_out_of_order_client_to_server = session->stats_packets_out_of_order_client_to_server;
-            packet.packets_out_of_order_server_to_client = session->stats_packets_out_of_order_server_to_client;
-            packet.jitter_client_to_server = session->stats_jitter_client_to_server;
-            packet.jitter_server_to_client = session->stats_jitter_server_to_client;
-            packet.next = session->stats_next;
-            packet.committed = session->stats_committed;
-            packet.next_rtt = session->stats_next_rtt;
-            packet.next_jitter = session->stats_next_jitter;
-            packet.next_packet_loss = session->stats_next_packet_loss;
-            packet.direct_min_rtt = session->stats_direct_min_rtt;
-            packet.direct_max_rtt = session->stats_direct_max_rtt;
-            packet.direct_prime_rtt = session->stats_direct_prime_rtt;
-            packet.direct_jitter = session->stats_direct_jitter;
-            packet.direct_packet_loss = session->stats_direct_packet_loss;
-            packet.has_near_relay_pings = session->stats_has_near_relay_pings;
-            packet.num_near_relays = session->stats_num_near_relays;
-            for ( int j = 0; j < packet.num_near_relays; ++j )
-            {
-                packet.near_relay_ids[j] = session->stats_near_relay_ids[j];
-                packet.near_relay_rtt[j] = session->stats_near_relay_rtt[j];
-                packet.near_relay_jitter[j] = session->stats_near_relay_jitter[j];
-                packet.near_relay_packet_loss[j] = session->stats_near_relay_packet_loss[j];
-            }
-            packet.client_address = session->address;
-            packet.server_address = server->server_address;
-            memcpy( packet.client_route_public_key, session->client_route_public_key, NEXT_CRYPTO_BOX_PUBLICKEYBYTES );
-            memcpy( packet.server_route_public_key, server->server_route_public_key, NEXT_CRYPTO_BOX_PUBLICKEYBYTES );
+        session->waiting_for_update_response = true;
+    }
+
+    if ( session->waiting_for_update_response && session->next_session_resend_time <= current_time )
+    {
+        session->session_update_request_packet.retry_number++;
+
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server resent session update packet to backend for session %016" PRIx64 " (%d)", session->session_id, session->session_update_request_packet.retry_number );
+
+        uint8_t magic[8];
+        memset( magic, 0, sizeof(magic) );
+
+        uint8_t from_address_data[32];
+        uint8_t to_address_data[32];
+        uint16_t from_address_port;
+        uint16_t to_address_port;
+        int from_address_bytes;
+        int to_address_bytes;
+
+        next_address_data( &server->server_address, from_address_data, &from_address_bytes, &from_address_port );
+        next_address_data( &server->backend_address, to_address_data, &to_address_bytes, &to_address_port );
+
+        uint8_t packet_data[NEXT_MAX_PACKET_BYTES];
+
+        next_assert( ( size_t(packet_data) % 4 ) == 0 );
+
+        int packet_bytes = 0;
+        if ( next_write_backend_packet( NEXT_BACKEND_SESSION_UPDATE_REQUEST_PACKET, &session->session_update_request_packet, packet_data, &packet_bytes, next_signed_packets, server->customer_private_key, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port ) != NEXT_OK )
+        {
+            next_printf( NEXT_LOG_LEVEL_ERROR, "server failed to write server init request packet for backend" );
+            return;
+        }
+
+        next_assert( next_basic_packet_filter( packet_data, packet_bytes ) );
+        next_assert( next_advanced_packet_filter( packet_data, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port, packet_bytes ) );
+
+        next_server_internal_send_packet_to_backend( server, packet_data, packet_bytes );
+
+        session->next_session_resend_time += NEXT_SESSION_UPDATE_RESEND_TIME;
+    }
+
+    if ( session->waiting_for_update_response && session->next_session_update_time - NEXT_SECONDS_BETWEEN_SESSION_UPDATES + NEXT_SESSION_UPDATE_TIMEOUT <= current_time )
+    {
+        next_printf( NEXT_LOG_LEVEL_ERROR, "server timed out waiting for backend response for session %016" PRIx64, session->session_id );
+        session->waiting_for_update_response = false;
+        session->next_session_update_time = -1.0;
+
+        // IMPORTANT: Send packets direct from now on for this session
+        session->committed = false;
+        next_session_send_state_begin_write( session->send_state );
+        session->send_state->route.committed = false;
+        next_session_send_state_end_write( session->send_state );
+    }
+
+    // match data
+
+    if ( !session->has_match_data || session->match_data_response_received )
+        return;
+
+    if ( ( session->next_match_data_resend_time == 0.0 && !session->waiting_for_match_data_response) || ( session->match_data_flush && !session->waiting_for_match_data_response ) )
+    {
+        NextBackendMatchDataRequestPacket packet;
+        
+        packet.Reset();
+        
+        packet.customer_id = server->customer_id;
+        packet.datacenter_id = server->datacenter_id;
+        packet.server_address = server->server_address;
+        packet.user_hash = session->user_hash;
+        packet.session_id = session->session_id;
+        packet.match_id = session->match_id;
+        packet.num_match_values = session->num_match_values;
+        next_assert( packet.num_match_values <= NEXT_MAX_MATCH_VALUES );
+        for ( int j = 0; j < session->num_match_values; ++j )
+        {
+            packet.match_values[j] = session->match_values[j];
+        }
+
+        session->match_data_request_packet = packet;
+
+        uint8_t magic[8];
+        memset( magic, 0, sizeof(magic) );
+
+        uint8_t from_address_data[32];
+        uint8_t to_address_data[32];
+        uint16_t from_address_port;
+        uint16_t to_address_port;
+        int from_address_bytes;
+        int to_address_bytes;
+
+        next_address_data( &server->server_address, from_address_data, &from_address_bytes, &from_address_port );
+        next_address_data( &server->backend_address, to_address_data, &to_address_bytes, &to_address_port );
+
+        uint8_t packet_data[NEXT_MAX_PACKET_BYTES];
+
+        next_assert( ( size_t(packet_data) % 4 ) == 0 );
+
+        int packet_bytes = 0;
+        if ( next_write_backend_packet( NEXT_BACKEND_MATCH_DATA_REQUEST_PACKET, &session->match_data_request_packet, packet_data, &packet_bytes, next_signed_packets, server->customer_private_key, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port ) != NEXT_OK )
+        {
+            next_printf( NEXT_LOG_LEVEL_ERROR, "server failed to write match data request packet for backend" );
+            return;
+			}
+
+        next_assert( next_basic_packet_filter( packet_data, packet_bytes ) );
+        next_assert( next_advanced_packet_filter( packet_data, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port, packet_bytes ) );
+
+        next_server_internal_send_packet_to_backend( server, packet_data, packet_bytes );
+        
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server sent match data packet to backend for session %016" PRIx64, session->session_id );
+
+        session->next_match_data_resend_time = ( session->match_data_flush ) ? current_time + NEXT_MATCH_DATA_FLUSH_RESEND_TIME : current_time + NEXT_MATCH_DATA_RESEND_TIME;
+
+        session->waiting_for_match_data_response = true;
+    }
+
+    if ( session->waiting_for_match_data_response && session->next_match_data_resend_time <= current_time )
+    {
+        session->match_data_request_packet.retry_number++;
+
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "server resent match data packet to backend for session %016" PRIx64 " (%d)", session->session_id, session->match_data_request_packet.retry_number );
+
+        uint8_t magic[8];
+        memset( magic, 0, sizeof(magic) );
+
+        uint8_t from_address_data[32];
+        uint8_t to_address_data[32];
+        uint16_t from_address_port;
+        uint16_t to_address_port;
+        int from_address_bytes;
+        int to_address_bytes;
+
+        next_address_data( &server->server_address, from_address_data, &from_address_bytes, &from_address_port );
+        next_address_data( &server->backend_address, to_address_data, &to_address_bytes, &to_address_port );
+
+        uint8_t packet_data[NEXT_MAX_PACKET_BYTES];
+
+        next_assert( ( size_t(packet_data) % 4 ) == 0 );
+
+        int packet_bytes = 0;
+        if ( next_write_backend_packet( NEXT_BACKEND_MATCH_DATA_REQUEST_PACKET, &session->match_data_request_packet, packet_data, &packet_bytes, next_signed_packets, server->customer_private_key, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port ) != NEXT_OK )
+        {
+            next_printf( NEXT_LOG_LEVEL_ERROR, "server failed to write match data request packet for backend" );
+            return;
+			}
 
-            next_assert( session->session_data_bytes >= 0 );
-            next_assert( session->session_data_bytes <= NEXT_MAX_SESSION_DATA_BYTES );
-            packet.session_data_bytes = session->session_data_bytes;
-            memcpy( packet.session_data, session->session_data, session->session_data_bytes );
+        next_assert( next_basic_packet_filter( packet_data, packet_bytes ) );
+        next_assert( next_advanced_packet_filter( packet_data, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port, packet_bytes ) );
 
-            session->session_update_request_packet = packet;
+        next_server_internal_send_packet_to_backend( server, packet_data, packet_bytes );
 
-            uint8_t magic[8];
-            memset( magic, 0, sizeof(magic) );
+        session->next_match_data_resend_time += ( session->match_data_flush && !session->match_data_flush_finished ) ? NEXT_MATCH_DATA_FLUSH_RESEND_TIME : NEXT_MATCH_DATA_RESEND_TIME;
+    }
+}
 
-            uint8_t from_address_data[32];
-            uint8_t to_address_data[32];
-            uint16_t from_address_port;
-            uint16_t to_address_port;
-            int from_address_bytes;
-            int to_address_bytes;
+/*
+    Server maintenance runs on the internal thread, between packets.
+
+    The server wide work (flush, init, backend server update, pending upgrades and commands) runs every
+    NEXT_SERVER_MAINTENANCE_INTERVAL. The per-session work (route updates, timeouts, trackers, session updates and match data)
+    is driven by a timer per session in a timer wheel, set to the earliest time any of it could have something to do, so each
+    step only visits the sessions that are due. While packets are flowing, each step stops at NEXT_SERVER_MAINTENANCE_BUDGET and
+    leaves the rest of the due sessions for the next step, so the data path never waits behind them. When the socket is idle
+    the step runs until no sessions are due.
+*/
 
-            next_address_data( &server->server_address, from_address_data, &from_address_bytes, &from_address_port );
-            next_address_data( &server->backend_address, to_address_data, &to_address_bytes, &to_address_port );
+static double next_earliest_time( double a, double b )
+{
+    return ( a < b ) ? a : b;
+}
 
-            uint8_t packet_data[NEXT_MAX_PACKET_BYTES];
+double next_server_internal_session_update_time( next_server_internal_t * server, next_session_entry_t * entry, double current_time )
+{
+    // state changed outside of maintenance that gives the session work sooner than this wakes it with next_server_internal_wake_session
 
-            next_assert( ( size_t(packet_data) % 4 ) == 0 );
+    next_assert( server );
+    next_assert( entry );
 
-            int packet_bytes = 0;
-            if ( next_write_backend_packet( NEXT_BACKEND_SESSION_UPDATE_REQUEST_PACKET, &packet, packet_data, &packet_bytes, next_signed_packets, server->customer_private_key, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port ) != NEXT_OK )
-            {
-                next_printf( NEXT_LOG_LEVEL_ERROR, "server failed to write server init request packet for backend" );
-                return;
-            }
+    double update_time = entry->last_client_stats_update + NEXT_SERVER_SESSION_TIMEOUT;
 
-            next_assert( next_basic_packet_filter( packet_data, packet_bytes ) );
-            next_assert( next_advanced_packet_filter( packet_data, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port, packet_bytes ) );
+    if ( !entry->client_ping_timed_out )
+    {
+        const double last_client_ping = ( entry->last_client_direct_ping > entry->last_client_next_ping ) ? entry->last_client_direct_ping : entry->last_client_next_ping;
+        update_time = next_earliest_time( update_time, last_client_ping + NEXT_SERVER_PING_TIMEOUT );
+    }
 
-            next_server_internal_send_packet_to_backend( server, packet_data, packet_bytes );
+    if ( entry->has_current_route )
+    {
+        update_time = next_earliest_time( update_time, entry->current_route_expire_time );
+    }
 
-            next_printf( NEXT_LOG_LEVEL_DEBUG, "server sent session update packet to backend for session %016" PRIx64, session->session_id );
+    if ( entry->update_dirty && !entry->client_ping_timed_out && !entry->stats_fallback_to_direct )
+    {
+        update_time = next_earliest_time( update_time, entry->update_last_send_time + NEXT_UPDATE_SEND_TIME );
+    }
 
-            if ( session->next_session_update_time == 0.0 )
-            {
-                session->next_session_update_time = current_time + NEXT_SECONDS_BETWEEN_SESSION_UPDATES;
-            }
-            else
-            {
-                session->next_session_update_time += NEXT_SECONDS_BETWEEN_SESSION_UPDATES;
-            }
+    if ( !entry->stats_fallback_to_direct && server->num_receive_workers == 0 )
+    {
+        update_time = next_earliest_time( update_time, entry->next_tracker_update_time );
+    }
 
-            session->stats_client_bandwidth_over_limit = false;
-            session->stats_server_bandwidth_over_limit = false;
+    if ( entry->next_session_update_time >= 0.0 )
+    {
+        update_time = next_earliest_time( update_time, entry->next_session_update_time );
+    }
 
-            session->next_session_resend_time = current_time + NEXT_SESSION_UPDATE_RESEND_TIME;
+    if ( entry->waiting_for_update_response )
+    {
+        update_time = next_earliest_time( update_time, entry->next_session_resend_time );
+        update_time = next_earliest_time( update_time, entry->next_session_update_time - NEXT_SECONDS_BETWEEN_SESSION_UPDATES + NEXT_SESSION_UPDATE_TIMEOUT );
+    }
+    else if ( entry->session_update_flush && !entry->session_update_flush_finished )
+    {
+        update_time = current_time;
+    }
 
-            session->waiting_for_update_response = true;
+    if ( entry->has_match_data && !entry->match_data_response_received )
+    {
+        if ( entry->waiting_for_match_data_response )
+        {
+            update_time = next_earliest_time( update_time, entry->next_match_data_resend_time );
         }
-
-        if ( session->waiting_for_update_response && session->next_session_resend_time <= current_time )
+        else if ( entry->next_match_data_resend_time == 0.0 || entry->match_data_flush )
         {
-            session->session_update_request_packet.retry_number++;
+            update_time = current_time;
+        }
+    }
 
-            next_printf( NEXT_LOG_LEVEL_DEBUG, "server resent session update packet to backend for session %016" PRIx64 " (%d)", session->session_id, session->session_update_request_packet.retry_number );
+    // while some of the maintenance is switched off server wide (not initialized yet, flushing, direct only), check back every interval
 
-            uint8_t magic[8];
-            memset( magic, 0, sizeof(magic) );
+    if ( !server->maintenance_update_route || !server->maintenance_update_sessions || !server->maintenance_update_trackers || !server->maintenance_update_backend )
+    {
+        update_time = next_earliest_time( update_time, current_time + NEXT_SERVER_MAINTENANCE_INTERVAL );
+    }
 
-            uint8_t from_address_data[32];
-            uint8_t to_address_data[32];
-            uint16_t from_address_port;
-            uint16_t to_address_port;
-            int from_address_bytes;
-            int to_address_bytes;
+    // never spin on a deadline that has already passed
 
-            next_address_data( &server->server_address, from_address_data, &from_address_bytes, &from_address_port );
-            next_address_data( &server->backend_address, to_address_data, &to_address_bytes, &to_address_port );
+    if ( update_time <= current_time )
+    {
+        update_time = current_time + NEXT_SERVER_MAINTENANCE_INTERVAL;
+    }
 
-            uint8_t packet_data[NEXT_MAX_PACKET_BYTES];
+    return update_time;
+}
 
-            next_assert( ( size_t(packet_data) % 4 ) == 0 );
+bool next_server_internal_restart_session_timers( next_server_internal_t * server, double current_time )
+{
+    // session timers are keyed by entry index, and expanding the session manager compacts the entries. the timers no
+    // longer belong to the sessions now at their indices, so drop them all and make every session due right away
 
-            int packet_bytes = 0;
-            if ( next_write_backend_packet( NEXT_BACKEND_SESSION_UPDATE_REQUEST_PACKET, &session->session_update_request_packet, packet_data, &packet_bytes, next_signed_packets, server->customer_private_key, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port ) != NEXT_OK )
-            {
-                next_printf( NEXT_LOG_LEVEL_ERROR, "server failed to write server init request packet for backend" );
-                return;
-            }
+    next_assert( server );
+    next_assert( server->session_timers );
 
-            next_assert( next_basic_packet_filter( packet_data, packet_bytes ) );
-            next_assert( next_advanced_packet_filter( packet_data, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port, packet_bytes ) );
+    next_session_manager_t * session_manager = server->session_manager;
 
-            next_server_internal_send_packet_to_backend( server, packet_data, packet_bytes );
+    if ( session_manager->size > server->session_timers->max_timers && !next_timer_wheel_expand( server->session_timers, session_manager->size ) )
+    {
+        next_printf( NEXT_LOG_LEVEL_ERROR, "server could not expand session timers" );
+        return false;
+    }
 
-            session->next_session_resend_time += NEXT_SESSION_UPDATE_RESEND_TIME;
-        }
+    for ( int i = 0; i < server->session_timers->max_timers; ++i )
+    {
+        next_timer_wheel_cancel( server->session_timers, i );
+    }
 
-        if ( session->waiting_for_update_response && session->next_session_update_time - NEXT_SECONDS_BETWEEN_SESSION_UPDATES + NEXT_SESSION_UPDATE_TIMEOUT <= current_time )
+    for ( int i = 0; i <= session_manager->max_entry_index; ++i )
+    {
+        if ( session_manager->session_ids[i] != 0 )
         {
-            next_printf( NEXT_LOG_LEVEL_ERROR, "server timed out waiting for backend response for session %016" PRIx64, session->session_id );
-            session->waiting_for_update_response = false;
-            session->next_session_update_time = -1.0;
-
-            // IMPORTANT: Send packets direct from now on for this session
-            session->committed = false;
-            next_platform_mutex_acquire( &server->session_mutex );
-            session->mutex_committed = false;
-            next_platform_mutex_release( &server->session_mutex );
+            next_timer_wheel_schedule( server->session_timers, i, current_time - NEXT_SERVER_SESSION_TIMER_RESOLUTION );
         }
     }
 
-    // match data
-
-    for ( int i = 0; i <= max_entry_index; ++i )
-    {
-        if ( server->session_manager->session_ids[i] == 0 )
-            continue;
-
-        next_session_entry_t * session = &server->session_manager->entries[i];
+    server->session_timers_num_expands = session_manager->num_expands;
 
-        if ( !session->has_match_data || session->match_data_response_received )
-            continue;
+    return true;
+}
 
-        if ( ( session->next_match_data_resend_time == 0.0 && !session->waiting_for_match_data_response) || ( session->match_data_flush && !session->waiting_for_match_data_response ) )
-        {
-            NextBackendMatchDataRequestPacket packet;
-            
-            packet.Reset();
-            
-            packet.customer_id = server->customer_id;
-            packet.datacenter_id = server->datacenter_id;
-            packet.server_address = server->server_address;
-            packet.user_hash = session->user_hash;
-            packet.session_id = session->session_id;
-            packet.match_id = session->match_id;
-            packet.num_match_values = session->num_match_values;
-            next_assert( packet.num_match_values <= NEXT_MAX_MATCH_VALUES );
-            for ( int j = 0; j < session->num_match_values; ++j )
-            {
-                packet.match_values[j] = session->match_values[j];
-            }
+bool next_server_internal_update_session_timers( next_server_internal_t * server, double time_budget )
+{
+    next_assert( server );
+    next_assert( server->session_timers );
 
-            session->match_data_request_packet = packet;
+    const double current_time = next_time();
 
-            uint8_t magic[8];
-            memset( magic, 0, sizeof(magic) );
+    next_timer_wheel_advance( server->session_timers, current_time );
 
-            uint8_t from_address_data[32];
-            uint8_t to_address_data[32];
-            uint16_t from_address_port;
-            uint16_t to_address_port;
-            int from_address_bytes;
-            int to_address_bytes;
+    next_session_manager_t * session_manager = server->session_manager;
 
-            next_address_data( &server->server_address, from_address_data, &from_address_bytes, &from_address_port );
-            next_address_data( &server->backend_address, to_address_data, &to_address_bytes, &to_address_port );
+    // until the restart goes through, the timers can't be trusted. try again on the next call, and don't report the pass as done
 
-            uint8_t packet_data[NEXT_MAX_PACKET_BYTES];
+    if ( server->session_timers_num_expands != session_manager->num_expands )
+    {
+        if ( !next_server_internal_restart_session_timers( server, current_time ) )
+            return false;
+    }
 
-            next_assert( ( size_t(packet_data) % 4 ) == 0 );
+    int num_sessions = 0;
 
-            int packet_bytes = 0;
-            if ( next_write_backend_packet( NEXT_BACKEND_MATCH_DATA_REQUEST_PACKET, &session->match_data_request_packet, packet_data, &packet_bytes, next_signed_packets, server->customer_private_key, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port ) != NEXT_OK )
-            {
-                next_printf( NEXT_LOG_LEVEL_ERROR, "server failed to write match data request packet for backend" );
-                return;
-			}
+    while ( true )
+    {
+        const int index = next_timer_wheel_pop( server->session_timers );
 
-            next_assert( next_basic_packet_filter( packet_data, packet_bytes ) );
-            next_assert( next_advanced_packet_filter( packet_data, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port, packet_bytes ) );
+        if ( index < 0 )
+            break;
 
-            next_server_internal_send_packet_to_backend( server, packet_data, packet_bytes );
-            
-            next_printf( NEXT_LOG_LEVEL_DEBUG, "server sent match data packet to backend for session %016" PRIx64, session->session_id );
+        // a session removed outside of maintenance may leave its timer behind
 
-            session->next_match_data_resend_time = ( session->match_data_flush ) ? current_time + NEXT_MATCH_DATA_FLUSH_RESEND_TIME : current_time + NEXT_MATCH_DATA_RESEND_TIME;
+        if ( index > session_manager->max_entry_index || session_manager->session_ids[index] == 0 )
+            continue;
 
-            session->waiting_for_match_data_response = true;
-        }
+        next_session_entry_t * entry = &session_manager->entries[index];
 
-        if ( session->waiting_for_match_data_response && session->next_match_data_resend_time <= current_time )
+        if ( server->maintenance_update_route )
         {
-            session->match_data_request_packet.retry_number++;
-
-            next_printf( NEXT_LOG_LEVEL_DEBUG, "server resent match data packet to backend for session %016" PRIx64 " (%d)", session->session_id, session->match_data_request_packet.retry_number );
-
-            uint8_t magic[8];
-            memset( magic, 0, sizeof(magic) );
-
-            uint8_t from_address_data[32];
-            uint8_t to_address_data[32];
-            uint16_t from_address_port;
-            uint16_t to_address_port;
-            int from_address_bytes;
-            int to_address_bytes;
+            next_server_internal_update_session_route( server, entry, current_time );
+        }
 
-            next_address_data( &server->server_address, from_address_data, &from_address_bytes, &from_address_port );
-            next_address_data( &server->backend_address, to_address_data, &to_address_bytes, &to_address_port );
+        bool timed_out = false;
 
-            uint8_t packet_data[NEXT_MAX_PACKET_BYTES];
+        if ( server->maintenance_update_sessions )
+        {
+            timed_out = next_server_internal_update_session_timeouts( server, index, current_time );
+        }
 
-            next_assert( ( size_t(packet_data) % 4 ) == 0 );
+        if ( !timed_out )
+        {
+            if ( server->maintenance_update_trackers )
+            {
+                next_server_internal_update_session_trackers( server, entry, current_time );
+            }
 
-            int packet_bytes = 0;
-            if ( next_write_backend_packet( NEXT_BACKEND_MATCH_DATA_REQUEST_PACKET, &session->match_data_request_packet, packet_data, &packet_bytes, next_signed_packets, server->customer_private_key, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port ) != NEXT_OK )
+            if ( server->maintenance_update_backend )
             {
-                next_printf( NEXT_LOG_LEVEL_ERROR, "server failed to write match data request packet for backend" );
-                return;
-			}
+                next_server_internal_backend_update_session( server, entry, current_time );
+            }
 
-            next_assert( next_basic_packet_filter( packet_data, packet_bytes ) );
-            next_assert( next_advanced_packet_filter( packet_data, magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port, packet_bytes ) );
+            next_timer_wheel_schedule( server->session_timers, index, next_server_internal_session_update_time( server, entry, current_time ) );
+        }
 
-            next_server_internal_send_packet_to_backend( server, packet_data, packet_bytes );
+        num_sessions++;
 
-            session->next_match_data_resend_time += ( session->match_data_flush && !session->match_data_flush_finished ) ? NEXT_MATCH_DATA_FLUSH_RESEND_TIME : NEXT_MATCH_DATA_RESEND_TIME;
-        }
+        if ( time_budget > 0.0 && ( num_sessions % NEXT_SERVER_MAINTENANCE_BATCH ) == 0 && next_time() >= current_time + time_budget )
+            return false;
     }
+
+    return true;
 }
 
-static next_platform_thread_return_t NEXT_PLATFORM_THREAD_FUNC next_server_internal_thread_function( void * context )
+void next_server_internal_update_maintenance( next_server_internal_t * server, double time_budget )
 {
-    next_assert( context );
+    next_assert( server );
 
-    next_server_internal_t * server = (next_server_internal_t*) context;
+    next_server_internal_verify_sentinels( server );
 
-    double last_update_time = next_time();
+    const double current_time = next_time();
 
-    while ( !server->quit )
+    if ( current_time >= server->maintenance_last_time + NEXT_SERVER_MAINTENANCE_INTERVAL )
     {
-        next_server_internal_block_and_receive_packet( server );
+        server->maintenance_last_time = current_time;
 
-        double current_time = next_time();
+        next_server_internal_update_flush( server );
 
-        if ( current_time >= last_update_time + 0.1 )
-        {
-            next_server_internal_update_flush( server );
+        next_server_internal_update_resolve_hostname( server );
+
+        next_server_internal_update_autodetect( server );
+
+        next_server_internal_update_init( server );
+
+        next_server_internal_update_pending_upgrades( server );
 
-            next_server_internal_update_resolve_hostname( server );
+        server->maintenance_update_backend = next_server_internal_backend_update( server );
 
-            next_server_internal_update_autodetect( server );
+        next_server_internal_pump_commands( server );
 
-			next_server_internal_update_init( server );
+        server->maintenance_update_route = !server->flushing && !next_global_config.disable_network_next;
+        server->maintenance_update_sessions = !next_global_config.disable_network_next && server->state != NEXT_SERVER_STATE_DIRECT_ONLY;
+        server->maintenance_update_trackers = !server->resolving_hostname;
+    }
+
+    next_server_internal_update_session_timers( server, time_budget );
+}
 
-            next_server_internal_update_pending_upgrades( server );
+static next_platform_thread_return_t NEXT_PLATFORM_THREAD_FUNC next_server_internal_thread_function( void * context )
+{
+    next_assert( context );
 
-            next_server_internal_update_route( server );
+    next_server_internal_t * server = (next_server_internal_t*) context;
 
-            next_server_internal_update_sessions( server );
+    server->maintenance_last_time = next_time();
 
-            next_server_internal_backend_update( server );
+    while ( !server->quit )
+    {
+        const bool received_packet = next_server_internal_block_and_receive_packet( server );
 
-            next_server_internal_pump_commands( server );
+        next_server_internal_pump_receive_events( server );
 
-            last_update_time = current_time;
-        }
+        next_server_internal_update_maintenance( server, received_packet ? NEXT_SERVER_MAINTENANCE_BUDGET : 0.0 );
     }
 
     NEXT_PLATFORM_THREAD_RETURN();
@@ -15397,6 +17733,16 @@ void next_server_update( next_server_t * server )
                     next_proxy_session_manager_remove_by_address( server->session_manager, &session_upgraded->address );
                     next_proxy_session_manager_remove_by_address( server->pending_session_manager, &session_upgraded->address );
                     proxy_entry = next_proxy_session_manager_add( server->session_manager, &session_upgraded->address, session_upgraded->session_id );
+                    if ( proxy_entry )
+                    {
+                        // the proxy session entry takes over the reference carried by the notify
+                        proxy_entry->send_state = session_upgraded->send_state;
+                        session_upgraded->send_state = NULL;
+                    }
+                }
+                if ( session_upgraded->send_state )
+                {
+                    next_session_send_state_release( session_upgraded->send_state );
                 }
             }
             break;
@@ -15617,7 +17963,7 @@ void next_server_send_packet_to_address( next_server_t * server, const next_addr
     next_platform_socket_send_packet( server->internal->socket, address, packet_data, packet_bytes );
 }
 
-void next_server_send_packet( next_server_t * server, const next_address_t * to_address, const uint8_t * packet_data, int packet_bytes )
+static void next_server_send_packet_internal( next_server_t * server, const next_address_t * to_address, const uint8_t * packet_data, int packet_bytes, bool in_place )
 {
     next_server_verify_sentinels( server );
 
@@ -15649,50 +17995,35 @@ void next_server_send_packet( next_server_t * server, const next_address_t * to_
     bool send_over_network_next = false;
     bool send_direct = false;
 
-    if ( entry )
+    if ( entry && entry->send_state )
     {
-        bool multipath = false;
-        bool committed = false;
-        int envelope_kbps_down = 0;
-        uint8_t open_session_sequence = 0;
-        uint64_t send_sequence = 0;
-        uint64_t session_id = 0;
-        uint8_t session_version = 0;
-        next_address_t session_address;
-        double last_upgraded_packet_receive_time = 0.0;
-        uint8_t session_private_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+        next_session_send_state_t * send_state = entry->send_state;
 
-        next_platform_mutex_acquire( &server->internal->session_mutex );
-        next_session_entry_t * internal_entry = next_session_manager_find_by_address( server->internal->session_manager, to_address );
-        if ( internal_entry )
-        {
-            last_upgraded_packet_receive_time = internal_entry->last_upgraded_packet_receive_time;
-        }
-        next_platform_mutex_release( &server->internal->session_mutex );
+        next_session_send_route_t route;
+        next_session_send_state_read( send_state, &route );
 
         // IMPORTANT: If we haven't received any upgraded packets in the last second send passthrough packets.
         // This makes reconnect robust when a client reconnects using the same port number.
-        if ( !internal_entry || last_upgraded_packet_receive_time + 1.0 < next_time() )
+        if ( route.last_upgraded_packet_receive_time + 1.0 < next_time() )
         {
             next_server_send_packet_direct( server, to_address, packet_data, packet_bytes );
             return;
         }
 
-        next_platform_mutex_acquire( &server->internal->session_mutex );
-        multipath = internal_entry->mutex_multipath;
-        committed = internal_entry->mutex_committed;
-        envelope_kbps_down = internal_entry->mutex_envelope_kbps_down;
-        send_over_network_next = internal_entry->mutex_send_over_network_next && committed;
+        const bool multipath = route.multipath;
+        const bool committed = route.committed;
+        const int envelope_kbps_down = route.envelope_kbps_down;
+        const uint8_t open_session_sequence = route.open_session_sequence;
+        const uint64_t session_id = route.session_id;
+        const uint8_t session_version = route.session_version;
+        const next_address_t session_address = route.send_address;
+        const uint8_t * session_private_key = route.private_key;
+
+        send_over_network_next = route.send_over_network_next && committed;
         send_direct = !send_over_network_next;
-        send_sequence = internal_entry->mutex_payload_send_sequence++;
+
+        uint64_t send_sequence = next_atomic_fetch_add_64( &send_state->payload_send_sequence, 1 );
         send_sequence |= uint64_t(1) << 63;
-        open_session_sequence = internal_entry->client_open_session_sequence;
-        session_id = internal_entry->mutex_session_id;
-        session_version = internal_entry->mutex_session_version;
-        session_address = internal_entry->mutex_send_address;
-        memcpy( session_private_key, internal_entry->mutex_private_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
-        internal_entry->stats_packets_sent_server_to_client++;
-        next_platform_mutex_release( &server->internal->session_mutex );
 
         if ( multipath )
         {
@@ -15708,9 +18039,7 @@ void next_server_send_packet( next_server_t * server, const next_address_t * to_
             if ( over_budget )
             {
                 next_printf( NEXT_LOG_LEVEL_WARN, "server exceeded bandwidth budget for session %016" PRIx64 " (%d kbps)", session_id, envelope_kbps_down );
-                next_platform_mutex_acquire( &server->internal->session_mutex );
-                internal_entry->stats_server_bandwidth_over_limit = true;
-                next_platform_mutex_release( &server->internal->session_mutex );
+                next_atomic_store_32( &send_state->server_bandwidth_over_limit, 1 );
                 send_over_network_next = false;
                 if ( !multipath )
                 {
@@ -15733,9 +18062,21 @@ void next_server_send_packet( next_server_t * server, const next_address_t * to_
             next_address_data( &server->address, from_address_data, &from_address_bytes, &from_address_port );
             next_address_data( &session_address, to_address_data, &to_address_bytes, &to_address_port );
 
-            uint8_t next_packet_data[NEXT_MAX_PACKET_BYTES];
+            uint8_t next_packet_buffer[NEXT_MAX_PACKET_BYTES];
+
+            uint8_t * next_packet_data = next_packet_buffer;
+
+            int next_packet_bytes = 0;
 
-            int next_packet_bytes = next_write_server_to_client_packet( next_packet_data, send_sequence, session_id, session_version, session_private_key, packet_data, packet_bytes, server->current_magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port );
+            if ( in_place )
+            {
+                next_packet_data = (uint8_t*) packet_data - NEXT_SERVER_TO_CLIENT_PACKET_HEADER_BYTES;
+                next_packet_bytes = next_write_server_to_client_packet_in_place( next_packet_data, send_sequence, session_id, session_version, session_private_key, packet_bytes, server->current_magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port );
+            }
+            else
+            {
+                next_packet_bytes = next_write_server_to_client_packet( next_packet_data, send_sequence, session_id, session_version, session_private_key, packet_data, packet_bytes, server->current_magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port );
+            }
 
             next_assert( next_packet_bytes > 0 );
 
@@ -15761,9 +18102,23 @@ void next_server_send_packet( next_server_t * server, const next_address_t * to_
 	            next_address_data( &server->address, from_address_data, &from_address_bytes, &from_address_port );
 	            next_address_data( to_address, to_address_data, &to_address_bytes, &to_address_port );
 
-	            uint8_t direct_packet_data[NEXT_MAX_PACKET_BYTES];
+	            uint8_t direct_packet_buffer[NEXT_MAX_PACKET_BYTES];
+
+	            uint8_t * direct_packet_data = direct_packet_buffer;
 
-	            int direct_packet_bytes = next_write_direct_packet( direct_packet_data, open_session_sequence, send_sequence, packet_data, packet_bytes, server->current_magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port );
+	            int direct_packet_bytes = 0;
+
+	            if ( in_place )
+	            {
+	            	// with multipath, this overwrites the headroom of the next packet above. that packet has already been sent
+
+	            	direct_packet_data = (uint8_t*) packet_data - NEXT_DIRECT_PACKET_HEADER_BYTES;
+	            	direct_packet_bytes = next_write_direct_packet_in_place( direct_packet_data, open_session_sequence, send_sequence, packet_bytes, server->current_magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port );
+	            }
+	            else
+	            {
+	            	direct_packet_bytes = next_write_direct_packet( direct_packet_data, open_session_sequence, send_sequence, packet_data, packet_bytes, server->current_magic, from_address_data, from_address_bytes, from_address_port, to_address_data, to_address_bytes, to_address_port );
+	            }
 
 	            next_assert( direct_packet_bytes >= 27 );
 	            next_assert( direct_packet_bytes <= NEXT_MTU + 27 );
@@ -15790,6 +18145,23 @@ void next_server_send_packet( next_server_t * server, const next_address_t * to_
     }
 }
 
+void next_server_send_packet( next_server_t * server, const next_address_t * to_address, const uint8_t * packet_data, int packet_bytes )
+{
+    next_server_send_packet_internal( server, to_address, packet_data, packet_bytes, false );
+}
+
+void next_server_send_packet_in_place( next_server_t * server, const next_address_t * to_address, uint8_t * packet_data, int packet_bytes )
+{
+    // the network next header goes in the NEXT_SEND_PACKET_HEADROOM bytes in front of the packet and the trailer after it,
+    // so the payload is never copied. passthrough packets are sent as they are
+
+    next_assert( NEXT_SEND_PACKET_HEADROOM >= NEXT_SERVER_TO_CLIENT_PACKET_HEADER_BYTES );
+    next_assert( NEXT_SEND_PACKET_HEADROOM >= NEXT_DIRECT_PACKET_HEADER_BYTES );
+    next_assert( NEXT_SEND_PACKET_TAILROOM >= NEXT_PACKET_TRAILER_BYTES );
+
+    next_server_send_packet_internal( server, to_address, packet_data, packet_bytes, true );
+}
+
 void next_server_send_packet_direct( next_server_t * server, const next_address_t * to_address, const uint8_t * packet_data, int packet_bytes )
 {
     next_server_verify_sentinels( server );
@@ -15851,7 +18223,7 @@ NEXT_BOOL next_server_stats( next_server_t * server, const next_address_t * addr
     stats->next_kbps_up = entry->stats_next_kbps_up;
     stats->next_kbps_down = entry->stats_next_kbps_down;
     stats->packets_sent_client_to_server = entry->stats_packets_sent_client_to_server;
-    stats->packets_sent_server_to_client = entry->stats_packets_sent_server_to_client;
+    stats->packets_sent_server_to_client = next_atomic_load_64( &entry->send_state->payload_send_sequence );
     stats->packets_lost_client_to_server = entry->stats_packets_lost_client_to_server;
     stats->packets_lost_server_to_client = entry->stats_packets_lost_server_to_client;
     stats->packets_out_of_order_client_to_server = entry->stats_packets_out_of_order_client_to_server;
@@ -16125,10 +18497,130 @@ void test_base64()
     next_check( next_base64_decode_string( encoded, decoded, 10 ) == 0 );
 }
 
-void test_fnv1a()
-{
-    uint64_t hash = next_datacenter_id( "local" );
-    next_check( hash == 0x249f1fb6f3a680e8ULL );
+void test_fnv1a()
+{
+    uint64_t hash = next_datacenter_id( "local" );
+    next_check( hash == 0x249f1fb6f3a680e8ULL );
+}
+
+void test_siphash()
+{
+    // reference vectors for siphash-1-3 with key 00 01 .. 0f, and messages 00 01 .. of 0, 16 and 24 bytes
+
+    uint64_t key[2];
+    uint64_t words[3];
+    uint8_t bytes[24];
+    for ( int i = 0; i < 24; ++i )
+    {
+        bytes[i] = uint8_t(i);
+    }
+    memcpy( key, bytes, 16 );
+    memcpy( words, bytes, 24 );
+
+#if NEXT_LITTLE_ENDIAN
+    next_check( next_siphash13( key, words, 0 ) == 0xABAC0158050FC4DCULL );
+    next_check( next_siphash13( key, words, 2 ) == 0xCC4FDD1A7D908B66ULL );
+    next_check( next_siphash13( key, words, 3 ) == 0xF464AEB267349C8CULL );
+#endif // #if NEXT_LITTLE_ENDIAN
+
+    // the process key is random, and hashes change with it
+
+    next_address_t address;
+    next_address_parse( &address, "127.0.0.1:50000" );
+
+    const uint64_t saved_key[2] = { next_hash_key[0], next_hash_key[1] };
+
+    next_check( next_hash_key_initialized );
+    next_check( saved_key[0] != 0 || saved_key[1] != 0 );
+
+    const uint32_t hash = next_address_hash( &address );
+
+    const uint64_t other_key[2] = { saved_key[0] ^ 1, saved_key[1] };
+    next_hash_set_key( other_key );
+    next_check( next_address_hash( &address ) != hash );
+
+    next_hash_set_key( saved_key );
+    next_check( next_address_hash( &address ) == hash );
+}
+
+void test_hash_collision_attack()
+{
+    // an attacker who knows the hash key can pick addresses that all land on one slot of an index, so every lookup walks
+    // one long cluster. the same addresses hashed with a key the attacker does not know spread out like any others
+
+    const int NumAddresses = 64;
+
+    const uint64_t saved_key[2] = { next_hash_key[0], next_hash_key[1] };
+
+    const uint64_t attack_key[2] = { 0x0123456789ABCDEFULL, 0xFEDCBA9876543210ULL };
+
+    next_hash_set_key( attack_key );
+
+    next_hash_index_t index;
+    next_check( next_hash_index_create( NULL, &index, 512 ) );
+
+    const uint32_t mask = uint32_t( index.capacity - 1 );
+
+    next_address_t addresses[NumAddresses];
+
+    int num_addresses = 0;
+
+    for ( int i = 0; num_addresses < NumAddresses; ++i )
+    {
+        next_address_t address;
+        memset( &address, 0, sizeof(address) );
+        address.type = NEXT_ADDRESS_IPV4;
+        address.data.ipv4[0] = 10;
+        address.data.ipv4[1] = uint8_t( i >> 16 );
+        address.data.ipv4[2] = uint8_t( i >> 8 );
+        address.data.ipv4[3] = uint8_t( i );
+        address.port = 40000;
+        if ( ( next_address_hash( &address ) & mask ) == 0 )
+        {
+            addresses[num_addresses++] = address;
+        }
+    }
+
+    int probe_distance[2] = { 0, 0 };
+
+    const uint64_t process_key[2] = { next_random_uint64(), next_random_uint64() };
+
+    for ( int k = 0; k < 2; ++k )
+    {
+        next_hash_set_key( k == 0 ? attack_key : process_key );
+
+        for ( int i = 0; i < NumAddresses; ++i )
+        {
+            next_hash_index_insert( &index, next_address_hash( &addresses[i] ), i );
+        }
+
+        for ( int i = 0; i < NumAddresses; ++i )
+        {
+            const uint32_t hash = next_address_hash( &addresses[i] );
+            int probe = -1;
+            int entry_index;
+            while ( ( entry_index = next_hash_index_probe( &index, hash, &probe ) ) != -1 && entry_index != i );
+            next_check( entry_index == i );
+            probe_distance[k] += int( ( uint32_t( probe ) - hash ) & mask );
+        }
+
+        for ( int i = 0; i < NumAddresses; ++i )
+        {
+            next_hash_index_remove( &index, next_address_hash( &addresses[i] ), i );
+        }
+
+        for ( int i = 0; i < index.capacity; ++i )
+        {
+            next_check( index.entries[i] == -1 );
+        }
+    }
+
+    next_check( probe_distance[0] == NumAddresses * ( NumAddresses - 1 ) / 2 );
+    next_check( probe_distance[1] < NumAddresses * 2 );
+
+    next_hash_index_destroy( &index );
+
+    next_hash_set_key( saved_key );
 }
 
 void test_queue()
@@ -16223,6 +18715,84 @@ void test_queue()
     next_queue_destroy( queue );
 }
 
+void test_timer_wheel()
+{
+    const int MaxTimers = 256;
+    const double Resolution = 0.01;
+
+    double time = 1000.0;
+
+    next_timer_wheel_t * wheel = next_timer_wheel_create( NULL, MaxTimers / 2, Resolution, time );
+    next_check( wheel );
+    next_check( next_timer_wheel_pop( wheel ) == -1 );
+
+    // timers already due go straight to the expired list
+
+    next_timer_wheel_schedule( wheel, 0, time - 1.0 );
+    next_check( next_timer_wheel_scheduled( wheel, 0 ) );
+    next_check( next_timer_wheel_pop( wheel ) == 0 );
+    next_check( !next_timer_wheel_scheduled( wheel, 0 ) );
+    next_check( next_timer_wheel_pop( wheel ) == -1 );
+
+    // the wheel grows, and timers keep their buckets when it does
+
+    next_timer_wheel_schedule( wheel, 1, time + 0.5 );
+    next_check( next_timer_wheel_expand( wheel, MaxTimers ) );
+    next_check( next_timer_wheel_scheduled( wheel, 1 ) );
+    next_timer_wheel_cancel( wheel, 1 );
+    next_check( !next_timer_wheel_scheduled( wheel, 1 ) );
+    next_check( wheel->num_timers == 0 );
+
+    // deadlines spread across every level, and past the range of the top level, fire in order and never early
+
+    double deadlines[MaxTimers];
+    bool fired[MaxTimers];
+    for ( int i = 0; i < MaxTimers; ++i )
+    {
+        const double range = ( i % 4 == 0 ) ? 0.5 : ( i % 4 == 1 ) ? 60.0 : ( i % 4 == 2 ) ? 3600.0 : 400000.0;
+        deadlines[i] = time + range * next_random_float();
+        fired[i] = false;
+        next_timer_wheel_schedule( wheel, i, deadlines[i] );
+    }
+
+    // cancelled timers never fire, and rescheduling earlier wins over a later reschedule
+
+    for ( int i = 0; i < MaxTimers; i += 8 )
+    {
+        next_timer_wheel_cancel( wheel, i );
+    }
+
+    next_timer_wheel_schedule_earliest( wheel, 3, time + 1.0 );
+    next_timer_wheel_schedule_earliest( wheel, 3, time + 2.0 );
+    if ( deadlines[3] > time + 1.0 )
+    {
+        deadlines[3] = time + 1.0;
+    }
+
+    int num_fired = 0;
+
+    while ( num_fired < MaxTimers - MaxTimers / 8 )
+    {
+        const double step = ( time < 1100.0 ) ? 0.037 : 97.0;
+        time += step;
+        next_timer_wheel_advance( wheel, time );
+        int timer;
+        while ( ( timer = next_timer_wheel_pop( wheel ) ) >= 0 )
+        {
+            next_check( timer % 8 != 0 );
+            next_check( !fired[timer] );
+            next_check( deadlines[timer] <= time );
+            next_check( deadlines[timer] > time - step - Resolution );
+            fired[timer] = true;
+            num_fired++;
+        }
+    }
+
+    next_check( wheel->num_timers == 0 );
+
+    next_timer_wheel_destroy( wheel );
+}
+
 using namespace next;
 
 void test_bitpacker()
@@ -17286,6 +19856,45 @@ void test_platform_socket()
         next_platform_socket_destroy( socket );
     }
 #endif
+
+    // segmented socket (ipv4). coalesced sends and receives come back one packet per receive, in order
+#if NEXT_PLATFORM == NEXT_PLATFORM_LINUX
+    {
+        next_address_t bind_address;
+        next_address_t local_address;
+        next_address_parse( &bind_address, "0.0.0.0" );
+        next_address_parse( &local_address, "127.0.0.1" );
+        next_platform_socket_t * socket = next_platform_socket_create( NULL, &bind_address, NEXT_PLATFORM_SOCKET_BLOCKING, 0.01f, 256*1024, 256*1024, true );
+        local_address.port = bind_address.port;
+        next_check( socket );
+        next_platform_socket_enable_segmentation( socket );
+        const int NumPackets = 20;
+        uint8_t packets[NumPackets][256];
+        void * packet_data[NumPackets];
+        int packet_bytes[NumPackets];
+        next_address_t to[NumPackets];
+        for ( int i = 0; i < NumPackets; ++i )
+        {
+            memset( packets[i], i, sizeof(packets[i]) );
+            packet_data[i] = packets[i];
+            packet_bytes[i] = ( i < 8 || i >= 12 ) ? 200 : 100;
+            to[i] = local_address;
+        }
+        next_platform_socket_send_packets( socket, to, packet_data, packet_bytes, NumPackets );
+        uint8_t packet[256];
+        next_address_t from;
+        for ( int i = 0; i < NumPackets; ++i )
+        {
+            const int bytes = next_platform_socket_receive_packet( socket, &from, packet, sizeof(packet) );
+            next_check( bytes == packet_bytes[i] );
+            next_check( packet[0] == i );
+            next_check( packet[bytes-1] == i );
+            next_check( next_address_equal( &from, &local_address ) );
+        }
+        next_check( next_platform_socket_receive_packet( socket, &from, packet, sizeof(packet) ) == 0 );
+        next_platform_socket_destroy( socket );
+    }
+#endif // #if NEXT_PLATFORM == NEXT_PLATFORM_LINUX
 }
 
 static bool threads_work = false;
@@ -17319,6 +19928,20 @@ void test_platform_mutex()
     next_platform_mutex_destroy( &mutex );
 }
 
+void test_platform_semaphore()
+{
+    next_platform_semaphore_t semaphore;
+    int result = next_platform_semaphore_create( &semaphore );
+    next_check( result == NEXT_OK );
+    next_check( !next_platform_semaphore_wait( &semaphore, 0.001 ) );
+    next_platform_semaphore_signal( &semaphore );
+    next_platform_semaphore_signal( &semaphore );
+    next_check( next_platform_semaphore_wait( &semaphore, 0.001 ) );
+    next_check( next_platform_semaphore_wait( &semaphore, 0.001 ) );
+    next_check( !next_platform_semaphore_wait( &semaphore, 0.001 ) );
+    next_platform_semaphore_destroy( &semaphore );
+}
+
 static int num_client_packets_received = 0;
 
 static void test_client_packet_received_callback( next_client_t * client, void * context, const next_address_t * from, const uint8_t * packet_data, int packet_bytes )
@@ -18317,6 +20940,65 @@ void test_server_to_client_packet()
     }
 }
 
+void test_in_place_packets()
+{
+    // writing around a payload that is already in place gives the same packet, byte for byte, as copying the payload in
+
+    uint8_t packet_data[NEXT_MAX_PACKET_BYTES];
+    uint8_t in_place_buffer[NEXT_SEND_PACKET_HEADROOM + NEXT_MTU + NEXT_SEND_PACKET_TAILROOM + 1];
+    uint64_t iterations = 100;
+    for ( uint64_t i = 0; i < iterations; ++i )
+    {
+        uint8_t magic[8];
+        uint8_t from_address[4];
+        uint8_t to_address[4];
+        next_random_bytes( magic, 8 );
+        next_random_bytes( from_address, 4 );
+        next_random_bytes( to_address, 4 );
+        uint16_t from_port = uint16_t( i + 1000000 );
+        uint16_t to_port = uint16_t( i + 5000 );
+
+        uint64_t send_sequence = i + 1000;
+        uint64_t session_id = 0x12314141LL;
+        uint8_t session_version = uint8_t(i%256);
+        uint8_t open_session_sequence = uint8_t( i + 10 );
+        uint8_t private_key[NEXT_CRYPTO_AEAD_CHACHA20POLY1305_KEYBYTES];
+        next_random_bytes( private_key, sizeof(private_key) );
+
+        uint8_t game_packet_data[NEXT_MTU];
+        int game_packet_bytes = rand() % NEXT_MTU;
+        for ( int j = 0; j < game_packet_bytes; j++ ) { game_packet_data[j] = uint8_t( rand() % 256 ); }
+
+        uint8_t * payload = in_place_buffer + NEXT_SEND_PACKET_HEADROOM;
+        const int guard = NEXT_SEND_PACKET_HEADROOM + game_packet_bytes + NEXT_SEND_PACKET_TAILROOM;
+
+        // server to client
+
+        int packet_bytes = next_write_server_to_client_packet( packet_data, send_sequence, session_id, session_version, private_key, game_packet_data, game_packet_bytes, magic, from_address, 4, from_port, to_address, 4, to_port );
+        next_check( packet_bytes > 0 );
+
+        memcpy( payload, game_packet_data, game_packet_bytes );
+        in_place_buffer[guard] = 0xAB;
+        uint8_t * in_place_packet = payload - NEXT_SERVER_TO_CLIENT_PACKET_HEADER_BYTES;
+        int in_place_bytes = next_write_server_to_client_packet_in_place( in_place_packet, send_sequence, session_id, session_version, private_key, game_packet_bytes, magic, from_address, 4, from_port, to_address, 4, to_port );
+        next_check( in_place_bytes == packet_bytes );
+        next_check( memcmp( in_place_packet, packet_data, packet_bytes ) == 0 );
+        next_check( in_place_buffer[guard] == 0xAB );
+
+        // direct
+
+        packet_bytes = next_write_direct_packet( packet_data, open_session_sequence, send_sequence, game_packet_data, game_packet_bytes, magic, from_address, 4, from_port, to_address, 4, to_port );
+        next_check( packet_bytes > 0 );
+
+        memcpy( payload, game_packet_data, game_packet_bytes );
+        in_place_packet = payload - NEXT_DIRECT_PACKET_HEADER_BYTES;
+        in_place_bytes = next_write_direct_packet_in_place( in_place_packet, open_session_sequence, send_sequence, game_packet_bytes, magic, from_address, 4, from_port, to_address, 4, to_port );
+        next_check( in_place_bytes == packet_bytes );
+        next_check( memcmp( in_place_packet, packet_data, packet_bytes ) == 0 );
+        next_check( in_place_buffer[guard] == 0xAB );
+    }
+}
+
 void test_ping_packet()
 {
     uint8_t packet_data[NEXT_MAX_PACKET_BYTES];
@@ -20122,19 +22804,233 @@ void test_match_data_response_packet()
 	}
 }
 
-void test_pending_session_manager()
+void next_test_session_index_addresses( next_address_t * addresses, int count )
+{
+    // a mix of ipv6 and ipv4 addresses, where many of the ipv4 addresses share a port, for the session manager index tests
+
+    for ( int i = 0; i < count; ++i )
+    {
+        char address_string[256];
+        if ( i % 3 == 0 )
+        {
+            sprintf( address_string, "[::1]:%d", 20000 + i );
+        }
+        else
+        {
+            sprintf( address_string, "10.0.%d.%d:%d", i / 256, i % 256, 30000 + ( i % 7 ) );
+        }
+        next_check( next_address_parse( &addresses[i], address_string ) == NEXT_OK );
+    }
+}
+
+void test_pending_session_manager()
+{
+    const int InitialSize = 32;
+
+    next_pending_session_manager_t * pending_session_manager = next_pending_session_manager_create( NULL, InitialSize );
+
+    next_check( pending_session_manager );
+
+    next_address_t address;
+    next_address_parse( &address, "127.0.0.1:12345" );
+
+    double time = 10.0;
+
+    // test private keys
+
+    uint8_t private_keys[InitialSize*3*NEXT_CRYPTO_SECRETBOX_KEYBYTES];
+    next_random_bytes( private_keys, sizeof(private_keys) );
+
+    // test upgrade tokens
+
+    uint8_t upgrade_tokens[InitialSize*3*NEXT_UPGRADE_TOKEN_BYTES];
+    next_random_bytes( upgrade_tokens, sizeof(upgrade_tokens) );
+
+    // add enough entries to make sure we have to expand
+
+    for ( int i = 0; i < InitialSize*3; ++i )
+    {
+        next_pending_session_entry_t * entry = next_pending_session_manager_add( pending_session_manager, &address, uint64_t(i)+1000, &private_keys[i*NEXT_CRYPTO_SECRETBOX_KEYBYTES], &upgrade_tokens[i*NEXT_UPGRADE_TOKEN_BYTES], time );
+        next_check( entry );
+        next_check( entry->session_id == uint64_t(i) + 1000 );
+        next_check( entry->upgrade_time == time );
+        next_check( entry->last_packet_send_time < 0.0 );
+        next_check( next_address_equal( &address, &entry->address ) == 1 );
+        next_check( memcmp( entry->private_key, &private_keys[i*NEXT_CRYPTO_SECRETBOX_KEYBYTES], NEXT_CRYPTO_SECRETBOX_KEYBYTES ) == 0 );
+        next_check( memcmp( entry->upgrade_token, &upgrade_tokens[i*NEXT_UPGRADE_TOKEN_BYTES], NEXT_UPGRADE_TOKEN_BYTES ) == 0 );
+        address.port++;
+    }
+
+    // verify that all entries are there
+
+    address.port = 12345;
+    for ( int i = 0; i < InitialSize*3; ++i )
+    {
+        next_pending_session_entry_t * entry = next_pending_session_manager_find( pending_session_manager, &address );
+        next_check( entry );
+        next_check( entry->session_id == uint64_t(i) + 1000 );
+        next_check( entry->upgrade_time == time );
+        next_check( entry->last_packet_send_time < 0.0 );
+        next_check( next_address_equal( &address, &entry->address ) == 1 );
+        address.port++;
+    }
+
+    next_check( next_pending_session_manager_num_entries( pending_session_manager ) == InitialSize*3 );
+
+    // remove every second entry
+
+    for ( int i = 0; i < InitialSize*3; ++i )
+    {
+        if ( (i%2) == 0 )
+        {
+            next_pending_session_manager_remove_by_address( pending_session_manager, &pending_session_manager->addresses[i] );
+        }
+    }
+
+    // verify only the entries that remain can be found
+
+    address.port = 12345;
+    for ( int i = 0; i < InitialSize*3; ++i )
+    {
+        next_pending_session_entry_t * entry = next_pending_session_manager_find( pending_session_manager, &address );
+        if ( (i%2) != 0 )
+        {
+            next_check( entry );
+            next_check( entry->session_id == uint64_t(i) + 1000 );
+            next_check( entry->upgrade_time == time );
+            next_check( entry->last_packet_send_time < 0.0 );
+            next_check( next_address_equal( &address, &entry->address ) == 1 );
+        }
+        else
+        {
+            next_check( entry == NULL );
+        }
+        address.port++;
+    }
+
+    // expand, and verify that all entries get collapsed
+
+    next_pending_session_manager_expand( pending_session_manager );
+
+    address.port = 12346;
+    for ( int i = 0; i < pending_session_manager->size; ++i )
+    {
+        if ( pending_session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
+        {
+            next_check( next_address_equal( &address, &pending_session_manager->addresses[i] ) == 1 );
+            next_pending_session_entry_t * entry = &pending_session_manager->entries[i];
+            next_check( entry->session_id == uint64_t(i)*2+1001 );
+            next_check( entry->upgrade_time == time );
+            next_check( entry->last_packet_send_time < 0.0 );
+            next_check( next_address_equal( &address, &entry->address ) == 1 );
+        }
+        address.port += 2;
+    }
+
+    // remove all remaining entries manually
+
+    for ( int i = 0; i < pending_session_manager->size; ++i )
+    {
+        if ( pending_session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
+        {
+            next_pending_session_manager_remove_by_address( pending_session_manager, &pending_session_manager->addresses[i] );
+        }
+    }
+
+    next_check( pending_session_manager->max_entry_index == 0 );
+
+    next_check( next_pending_session_manager_num_entries( pending_session_manager ) == 0 );
+
+    next_pending_session_manager_destroy( pending_session_manager );
+}
+
+void test_pending_session_manager_index()
+{
+    // randomly add and remove sessions across several expands and check that lookups by address always agree with a shadow copy
+
+    const int MaxSessions = 200;
+
+    next_pending_session_manager_t * manager = next_pending_session_manager_create( NULL, 4 );
+
+    next_check( manager );
+
+    uint8_t private_key[NEXT_CRYPTO_SECRETBOX_KEYBYTES];
+    uint8_t upgrade_token[NEXT_UPGRADE_TOKEN_BYTES];
+    memset( private_key, 0, sizeof(private_key) );
+    memset( upgrade_token, 0, sizeof(upgrade_token) );
+
+    next_address_t addresses[MaxSessions];
+    bool active[MaxSessions];
+    memset( active, 0, sizeof(active) );
+
+    next_test_session_index_addresses( addresses, MaxSessions );
+
+    for ( int iteration = 0; iteration < 10000; ++iteration )
+    {
+        const int i = int( next_random_uint64() % MaxSessions );
+
+        if ( active[i] )
+        {
+            next_pending_session_manager_remove_by_address( manager, &addresses[i] );
+            active[i] = false;
+        }
+        else
+        {
+            next_pending_session_entry_t * entry = next_pending_session_manager_add( manager, &addresses[i], uint64_t(i) + 1000, private_key, upgrade_token, 0.0 );
+            next_check( entry );
+            active[i] = true;
+        }
+
+        if ( ( iteration % 2500 ) == 1250 )
+        {
+            next_pending_session_manager_expand( manager );
+        }
+
+        int num_active = 0;
+        for ( int j = 0; j < MaxSessions; ++j )
+        {
+            next_pending_session_entry_t * entry = next_pending_session_manager_find( manager, &addresses[j] );
+            if ( active[j] )
+            {
+                next_check( entry );
+                next_check( entry->session_id == uint64_t(j) + 1000 );
+                next_check( next_address_equal( &entry->address, &addresses[j] ) == 1 );
+                num_active++;
+            }
+            else
+            {
+                next_check( entry == NULL );
+            }
+        }
+
+        next_check( next_pending_session_manager_num_entries( manager ) == num_active );
+    }
+
+    for ( int i = 0; i < MaxSessions; ++i )
+    {
+        if ( active[i] )
+        {
+            next_pending_session_manager_remove_by_address( manager, &addresses[i] );
+        }
+    }
+
+    next_check( manager->max_entry_index == 0 );
+    next_check( next_pending_session_manager_num_entries( manager ) == 0 );
+
+    next_pending_session_manager_destroy( manager );
+}
+
+void test_proxy_session_manager()
 {
     const int InitialSize = 32;
 
-    next_pending_session_manager_t * pending_session_manager = next_pending_session_manager_create( NULL, InitialSize );
+    next_proxy_session_manager_t * proxy_session_manager = next_proxy_session_manager_create( NULL, InitialSize );
 
-    next_check( pending_session_manager );
+    next_check( proxy_session_manager );
 
     next_address_t address;
     next_address_parse( &address, "127.0.0.1:12345" );
 
-    double time = 10.0;
-
     // test private keys
 
     uint8_t private_keys[InitialSize*3*NEXT_CRYPTO_SECRETBOX_KEYBYTES];
@@ -20149,14 +23045,10 @@ void test_pending_session_manager()
 
     for ( int i = 0; i < InitialSize*3; ++i )
     {
-        next_pending_session_entry_t * entry = next_pending_session_manager_add( pending_session_manager, &address, uint64_t(i)+1000, &private_keys[i*NEXT_CRYPTO_SECRETBOX_KEYBYTES], &upgrade_tokens[i*NEXT_UPGRADE_TOKEN_BYTES], time );
+        next_proxy_session_entry_t * entry = next_proxy_session_manager_add( proxy_session_manager, &address, uint64_t(i)+1000 );
         next_check( entry );
         next_check( entry->session_id == uint64_t(i) + 1000 );
-        next_check( entry->upgrade_time == time );
-        next_check( entry->last_packet_send_time < 0.0 );
         next_check( next_address_equal( &address, &entry->address ) == 1 );
-        next_check( memcmp( entry->private_key, &private_keys[i*NEXT_CRYPTO_SECRETBOX_KEYBYTES], NEXT_CRYPTO_SECRETBOX_KEYBYTES ) == 0 );
-        next_check( memcmp( entry->upgrade_token, &upgrade_tokens[i*NEXT_UPGRADE_TOKEN_BYTES], NEXT_UPGRADE_TOKEN_BYTES ) == 0 );
         address.port++;
     }
 
@@ -20165,16 +23057,14 @@ void test_pending_session_manager()
     address.port = 12345;
     for ( int i = 0; i < InitialSize*3; ++i )
     {
-        next_pending_session_entry_t * entry = next_pending_session_manager_find( pending_session_manager, &address );
+        next_proxy_session_entry_t * entry = next_proxy_session_manager_find( proxy_session_manager, &address );
         next_check( entry );
         next_check( entry->session_id == uint64_t(i) + 1000 );
-        next_check( entry->upgrade_time == time );
-        next_check( entry->last_packet_send_time < 0.0 );
         next_check( next_address_equal( &address, &entry->address ) == 1 );
         address.port++;
     }
 
-    next_check( next_pending_session_manager_num_entries( pending_session_manager ) == InitialSize*3 );
+    next_check( next_proxy_session_manager_num_entries( proxy_session_manager ) == InitialSize*3 );
 
     // remove every second entry
 
@@ -20182,7 +23072,7 @@ void test_pending_session_manager()
     {
         if ( (i%2) == 0 )
         {
-            next_pending_session_manager_remove_by_address( pending_session_manager, &pending_session_manager->addresses[i] );
+            next_proxy_session_manager_remove_by_address( proxy_session_manager, &proxy_session_manager->addresses[i] );
         }
     }
 
@@ -20191,13 +23081,11 @@ void test_pending_session_manager()
     address.port = 12345;
     for ( int i = 0; i < InitialSize*3; ++i )
     {
-        next_pending_session_entry_t * entry = next_pending_session_manager_find( pending_session_manager, &address );
+        next_proxy_session_entry_t * entry = next_proxy_session_manager_find( proxy_session_manager, &address );
         if ( (i%2) != 0 )
         {
             next_check( entry );
             next_check( entry->session_id == uint64_t(i) + 1000 );
-            next_check( entry->upgrade_time == time );
-            next_check( entry->last_packet_send_time < 0.0 );
             next_check( next_address_equal( &address, &entry->address ) == 1 );
         }
         else
@@ -20209,18 +23097,16 @@ void test_pending_session_manager()
 
     // expand, and verify that all entries get collapsed
 
-    next_pending_session_manager_expand( pending_session_manager );
+    next_proxy_session_manager_expand( proxy_session_manager );
 
     address.port = 12346;
-    for ( int i = 0; i < pending_session_manager->size; ++i )
+    for ( int i = 0; i < proxy_session_manager->size; ++i )
     {
-        if ( pending_session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
+        if ( proxy_session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
         {
-            next_check( next_address_equal( &address, &pending_session_manager->addresses[i] ) == 1 );
-            next_pending_session_entry_t * entry = &pending_session_manager->entries[i];
+            next_check( next_address_equal( &address, &proxy_session_manager->addresses[i] ) == 1 );
+            next_proxy_session_entry_t * entry = &proxy_session_manager->entries[i];
             next_check( entry->session_id == uint64_t(i)*2+1001 );
-            next_check( entry->upgrade_time == time );
-            next_check( entry->last_packet_send_time < 0.0 );
             next_check( next_address_equal( &address, &entry->address ) == 1 );
         }
         address.port += 2;
@@ -20228,28 +23114,99 @@ void test_pending_session_manager()
 
     // remove all remaining entries manually
 
-    for ( int i = 0; i < pending_session_manager->size; ++i )
+    for ( int i = 0; i < proxy_session_manager->size; ++i )
     {
-        if ( pending_session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
+        if ( proxy_session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
         {
-            next_pending_session_manager_remove_by_address( pending_session_manager, &pending_session_manager->addresses[i] );
+            next_proxy_session_manager_remove_by_address( proxy_session_manager, &proxy_session_manager->addresses[i] );
         }
     }
 
-    next_check( pending_session_manager->max_entry_index == 0 );
+    next_check( proxy_session_manager->max_entry_index == 0 );
 
-    next_check( next_pending_session_manager_num_entries( pending_session_manager ) == 0 );
+    next_check( next_proxy_session_manager_num_entries( proxy_session_manager ) == 0 );
 
-    next_pending_session_manager_destroy( pending_session_manager );
+    next_proxy_session_manager_destroy( proxy_session_manager );
 }
 
-void test_proxy_session_manager()
+void test_proxy_session_manager_index()
+{
+    // randomly add and remove sessions across several expands and check that lookups by address always agree with a shadow copy
+
+    const int MaxSessions = 200;
+
+    next_proxy_session_manager_t * manager = next_proxy_session_manager_create( NULL, 4 );
+
+    next_check( manager );
+
+    next_address_t addresses[MaxSessions];
+    bool active[MaxSessions];
+    memset( active, 0, sizeof(active) );
+
+    next_test_session_index_addresses( addresses, MaxSessions );
+
+    for ( int iteration = 0; iteration < 10000; ++iteration )
+    {
+        const int i = int( next_random_uint64() % MaxSessions );
+
+        if ( active[i] )
+        {
+            next_proxy_session_manager_remove_by_address( manager, &addresses[i] );
+            active[i] = false;
+        }
+        else
+        {
+            next_proxy_session_entry_t * entry = next_proxy_session_manager_add( manager, &addresses[i], uint64_t(i) + 1000 );
+            next_check( entry );
+            active[i] = true;
+        }
+
+        if ( ( iteration % 2500 ) == 1250 )
+        {
+            next_proxy_session_manager_expand( manager );
+        }
+
+        int num_active = 0;
+        for ( int j = 0; j < MaxSessions; ++j )
+        {
+            next_proxy_session_entry_t * entry = next_proxy_session_manager_find( manager, &addresses[j] );
+            if ( active[j] )
+            {
+                next_check( entry );
+                next_check( entry->session_id == uint64_t(j) + 1000 );
+                next_check( next_address_equal( &entry->address, &addresses[j] ) == 1 );
+                num_active++;
+            }
+            else
+            {
+                next_check( entry == NULL );
+            }
+        }
+
+        next_check( next_proxy_session_manager_num_entries( manager ) == num_active );
+    }
+
+    for ( int i = 0; i < MaxSessions; ++i )
+    {
+        if ( active[i] )
+        {
+            next_proxy_session_manager_remove_by_address( manager, &addresses[i] );
+        }
+    }
+
+    next_check( manager->max_entry_index == 0 );
+    next_check( next_proxy_session_manager_num_entries( manager ) == 0 );
+
+    next_proxy_session_manager_destroy( manager );
+}
+
+void test_session_manager()
 {
     const int InitialSize = 32;
 
-    next_proxy_session_manager_t * proxy_session_manager = next_proxy_session_manager_create( NULL, InitialSize );
+    next_session_manager_t * session_manager = next_session_manager_create( NULL, InitialSize );
 
-    next_check( proxy_session_manager );
+    next_check( session_manager );
 
     next_address_t address;
     next_address_parse( &address, "127.0.0.1:12345" );
@@ -20268,10 +23225,12 @@ void test_proxy_session_manager()
 
     for ( int i = 0; i < InitialSize*3; ++i )
     {
-        next_proxy_session_entry_t * entry = next_proxy_session_manager_add( proxy_session_manager, &address, uint64_t(i)+1000 );
+        next_session_entry_t * entry = next_session_manager_add( session_manager, &address, uint64_t(i)+1000, &private_keys[i*NEXT_CRYPTO_SECRETBOX_KEYBYTES], &upgrade_tokens[i*NEXT_UPGRADE_TOKEN_BYTES], NULL, 0 );
         next_check( entry );
         next_check( entry->session_id == uint64_t(i) + 1000 );
         next_check( next_address_equal( &address, &entry->address ) == 1 );
+        next_check( memcmp( entry->ephemeral_private_key, &private_keys[i*NEXT_CRYPTO_SECRETBOX_KEYBYTES], NEXT_CRYPTO_SECRETBOX_KEYBYTES ) == 0 );
+        next_check( memcmp( entry->upgrade_token, &upgrade_tokens[i*NEXT_UPGRADE_TOKEN_BYTES], NEXT_UPGRADE_TOKEN_BYTES ) == 0 );
         address.port++;
     }
 
@@ -20280,14 +23239,14 @@ void test_proxy_session_manager()
     address.port = 12345;
     for ( int i = 0; i < InitialSize*3; ++i )
     {
-        next_proxy_session_entry_t * entry = next_proxy_session_manager_find( proxy_session_manager, &address );
+        next_session_entry_t * entry = next_session_manager_find_by_address( session_manager, &address );
         next_check( entry );
-        next_check( entry->session_id == uint64_t(i) + 1000 );
+        next_check( entry->session_id == uint64_t(i)+1000 );
         next_check( next_address_equal( &address, &entry->address ) == 1 );
         address.port++;
     }
 
-    next_check( next_proxy_session_manager_num_entries( proxy_session_manager ) == InitialSize*3 );
+    next_check( next_session_manager_num_entries( session_manager ) == InitialSize*3 );
 
     // remove every second entry
 
@@ -20295,7 +23254,7 @@ void test_proxy_session_manager()
     {
         if ( (i%2) == 0 )
         {
-            next_proxy_session_manager_remove_by_address( proxy_session_manager, &proxy_session_manager->addresses[i] );
+            next_session_manager_remove_by_address( session_manager, &session_manager->addresses[i] );
         }
     }
 
@@ -20304,11 +23263,11 @@ void test_proxy_session_manager()
     address.port = 12345;
     for ( int i = 0; i < InitialSize*3; ++i )
     {
-        next_proxy_session_entry_t * entry = next_proxy_session_manager_find( proxy_session_manager, &address );
+        next_session_entry_t * entry = next_session_manager_find_by_address( session_manager, &address );
         if ( (i%2) != 0 )
         {
             next_check( entry );
-            next_check( entry->session_id == uint64_t(i) + 1000 );
+            next_check( entry->session_id == uint64_t(i)+1000 );
             next_check( next_address_equal( &address, &entry->address ) == 1 );
         }
         else
@@ -20320,147 +23279,489 @@ void test_proxy_session_manager()
 
     // expand, and verify that all entries get collapsed
 
-    next_proxy_session_manager_expand( proxy_session_manager );
+    next_session_manager_expand( session_manager );
 
     address.port = 12346;
-    for ( int i = 0; i < proxy_session_manager->size; ++i )
+    for ( int i = 0; i < session_manager->size; ++i )
+    {
+        if ( session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
+        {
+            next_check( next_address_equal( &address, &session_manager->addresses[i] ) == 1 );
+            next_session_entry_t * entry = &session_manager->entries[i];
+            next_check( entry->session_id == uint64_t(i)*2+1001 );
+            next_check( next_address_equal( &address, &entry->address ) == 1 );
+        }
+        address.port += 2;
+    }
+
+    // remove all remaining entries manually
+
+    for ( int i = 0; i < session_manager->size; ++i )
+    {
+        if ( session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
+        {
+            next_session_manager_remove_by_address( session_manager, &session_manager->addresses[i] );
+        }
+    }
+
+    next_check( session_manager->max_entry_index == 0 );
+
+    next_check( next_session_manager_num_entries( session_manager ) == 0 );
+
+    next_session_manager_destroy( session_manager );
+}
+
+void test_session_manager_index()
+{
+    // randomly add and remove sessions across several expands and check that lookups by address and session id always agree with a shadow copy
+
+    const int MaxSessions = 200;
+
+    next_session_manager_t * session_manager = next_session_manager_create( NULL, 4 );
+
+    next_check( session_manager );
+
+    uint8_t private_key[NEXT_CRYPTO_SECRETBOX_KEYBYTES];
+    uint8_t upgrade_token[NEXT_UPGRADE_TOKEN_BYTES];
+    memset( private_key, 0, sizeof(private_key) );
+    memset( upgrade_token, 0, sizeof(upgrade_token) );
+
+    next_address_t addresses[MaxSessions];
+    bool active[MaxSessions];
+    memset( active, 0, sizeof(active) );
+
+    next_test_session_index_addresses( addresses, MaxSessions );
+
+    for ( int iteration = 0; iteration < 10000; ++iteration )
+    {
+        const int i = int( next_random_uint64() % MaxSessions );
+
+        if ( active[i] )
+        {
+            next_session_manager_remove_by_address( session_manager, &addresses[i] );
+            active[i] = false;
+        }
+        else
+        {
+            next_session_entry_t * entry = next_session_manager_add( session_manager, &addresses[i], uint64_t(i) + 1000, private_key, upgrade_token, NULL, 0 );
+            next_check( entry );
+            active[i] = true;
+        }
+
+        if ( ( iteration % 2500 ) == 1250 )
+        {
+            // force an expand while there are holes, so entries get compacted and the indexes rebuilt
+
+            next_session_manager_expand( session_manager );
+        }
+
+        int num_active = 0;
+        for ( int j = 0; j < MaxSessions; ++j )
+        {
+            next_session_entry_t * by_address = next_session_manager_find_by_address( session_manager, &addresses[j] );
+            next_session_entry_t * by_session_id = next_session_manager_find_by_session_id( session_manager, uint64_t(j) + 1000 );
+            next_check( by_address == by_session_id );
+            if ( active[j] )
+            {
+                next_check( by_address );
+                next_check( by_address->session_id == uint64_t(j) + 1000 );
+                next_check( next_address_equal( &by_address->address, &addresses[j] ) == 1 );
+                num_active++;
+            }
+            else
+            {
+                next_check( by_address == NULL );
+            }
+        }
+
+        next_check( next_session_manager_num_entries( session_manager ) == num_active );
+    }
+
+    for ( int i = 0; i < MaxSessions; ++i )
+    {
+        if ( active[i] )
+        {
+            next_session_manager_remove_by_address( session_manager, &addresses[i] );
+        }
+    }
+
+    next_check( session_manager->max_entry_index == 0 );
+    next_check( next_session_manager_num_entries( session_manager ) == 0 );
+
+    next_session_manager_destroy( session_manager );
+}
+
+void test_session_send_state()
+{
+    next_session_manager_t * session_manager = next_session_manager_create( NULL, 4 );
+
+    next_check( session_manager );
+
+    uint8_t private_key[NEXT_CRYPTO_SECRETBOX_KEYBYTES];
+    uint8_t upgrade_token[NEXT_UPGRADE_TOKEN_BYTES];
+    memset( private_key, 0, sizeof(private_key) );
+    memset( upgrade_token, 0, sizeof(upgrade_token) );
+
+    next_address_t address;
+    next_address_parse( &address, "127.0.0.1:12345" );
+
+    next_session_entry_t * entry = next_session_manager_add( session_manager, &address, 1000, private_key, upgrade_token, NULL, 0 );
+    next_check( entry );
+    next_check( entry->send_state );
+
+    // take a reference like the application thread does when it receives the session upgraded notify
+
+    next_session_send_state_t * send_state = entry->send_state;
+    next_session_send_state_retain( send_state );
+
+    // publish a route and check that readers see all of it
+
+    next_address_t send_address;
+    next_address_parse( &send_address, "10.0.0.1:40000" );
+
+    next_session_send_state_begin_write( send_state );
+    send_state->route.committed = true;
+    send_state->route.send_over_network_next = true;
+    send_state->route.envelope_kbps_down = 256;
+    send_state->route.session_id = 1000;
+    send_state->route.session_version = 5;
+    send_state->route.send_address = send_address;
+    send_state->route.last_upgraded_packet_receive_time = 100.0;
+    memset( send_state->route.private_key, 0xFF, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
+    next_session_send_state_end_write( send_state );
+
+    next_check( ( send_state->version & 1 ) == 0 );
+
+    next_session_send_route_t route;
+    next_session_send_state_read( send_state, &route );
+    next_check( route.committed );
+    next_check( route.send_over_network_next );
+    next_check( route.envelope_kbps_down == 256 );
+    next_check( route.session_id == 1000 );
+    next_check( route.session_version == 5 );
+    next_check( next_address_equal( &route.send_address, &send_address ) == 1 );
+    next_check( route.last_upgraded_packet_receive_time == 100.0 );
+    next_check( route.private_key[0] == 0xFF && route.private_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES-1] == 0xFF );
+
+    // payload sequence is shared by all senders
+
+    next_check( next_atomic_fetch_add_64( &send_state->payload_send_sequence, 1 ) == 0 );
+    next_check( next_atomic_fetch_add_64( &send_state->payload_send_sequence, 1 ) == 1 );
+    next_check( next_atomic_load_64( &send_state->payload_send_sequence ) == 2 );
+
+    // when the internal session goes away, the application's reference stays valid but falls back to passthrough
+
+    next_session_manager_remove_by_address( session_manager, &address );
+    next_check( next_session_manager_find_by_address( session_manager, &address ) == NULL );
+
+    next_session_send_state_read( send_state, &route );
+    next_check( !route.send_over_network_next );
+    next_check( route.last_upgraded_packet_receive_time < 0.0 );
+    next_check( send_state->ref_count == 1 );
+
+    next_session_send_state_release( send_state );
+
+    next_session_manager_destroy( session_manager );
+}
+
+void test_server_receive_worker()
+{
+    // drive a receive worker directly on this thread, through the same ring and command queue the internal server thread uses
+
+    next_server_internal_t * server = (next_server_internal_t*) next_malloc( NULL, sizeof(next_server_internal_t) );
+    next_check( server );
+    memset( server, 0, sizeof(next_server_internal_t) );
+    next_server_internal_initialize_sentinels( server );
+    next_check( next_platform_mutex_create( &server->notify_mutex ) == NEXT_OK );
+    next_check( next_platform_mutex_create( &server->receive_event_mutex ) == NEXT_OK );
+    server->notify_queue = next_queue_create( NULL, NEXT_NOTIFY_QUEUE_LENGTH );
+    server->receive_event_queue = next_queue_create( NULL, NEXT_SERVER_RECEIVE_EVENT_QUEUE_LENGTH );
+    next_check( server->notify_queue );
+    next_check( server->receive_event_queue );
+
+    next_server_receive_worker_t * worker = next_server_receive_worker_create( NULL, server, 0 );
+    next_check( worker );
+    server->receive_workers[0] = worker;
+    server->num_receive_workers = 1;
+
+    const uint64_t session_id = 0x12345;
+    const uint8_t open_session_sequence = 7;
+
+    next_address_t client_address;
+    next_address_parse( &client_address, "127.0.0.1:30000" );
+    next_address_t relay_address;
+    next_address_parse( &relay_address, "10.0.0.1:40000" );
+
+    uint8_t current_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+    uint8_t pending_key[NEXT_CRYPTO_BOX_SECRETKEYBYTES];
+    next_random_bytes( current_key, sizeof(current_key) );
+    next_random_bytes( pending_key, sizeof(pending_key) );
+
+    next_server_receive_command_update_session_t * command = (next_server_receive_command_update_session_t*) next_malloc( NULL, sizeof(next_server_receive_command_update_session_t) );
+    memset( command, 0, sizeof(next_server_receive_command_update_session_t) );
+    command->type = NEXT_SERVER_RECEIVE_COMMAND_UPDATE_SESSION;
+    command->session_id = session_id;
+    command->address = client_address;
+    command->open_session_sequence = open_session_sequence;
+    command->route.has_current_route = true;
+    memcpy( command->route.current_route_private_key, current_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
+    next_server_receive_worker_push_command( worker, command );
+
+    next_check( next_server_receive_worker_update( worker ) == false );
+    next_check( worker->num_sessions == 1 );
+    next_check( next_server_receive_worker_find_session( worker, session_id ) != NULL );
+
+    uint8_t magic[8];
+    memset( magic, 0, sizeof(magic) );
+    uint8_t from_address_data[4] = { 0 };
+    uint8_t to_address_data[4] = { 0 };
+
+    uint8_t payload[32];
+    for ( int i = 0; i < int( sizeof(payload) ); ++i )
+    {
+        payload[i] = uint8_t( i );
+    }
+
+    uint8_t packet_data[NEXT_MAX_PACKET_BYTES];
+
+    // client to server packet on the current route is delivered once, with the session address
+
+    int packet_bytes = next_write_client_to_server_packet( packet_data, 1, session_id, 0, current_key, payload, sizeof(payload), magic, from_address_data, 4, 0, to_address_data, 4, 0 );
+    next_check( packet_bytes > 0 );
+
+    for ( int i = 0; i < 2; ++i )
+    {
+        next_server_receive_packet_t * packet = next_server_receive_worker_begin_packet( worker );
+        next_check( packet );
+        packet->packet_type = NEXT_CLIENT_TO_SERVER_PACKET;
+        packet->session_id = session_id;
+        packet->from = relay_address;
+        packet->packet_bytes = packet_bytes - 18;
+        memcpy( packet->packet_data, packet_data + 16, size_t(packet->packet_bytes) );
+        next_server_receive_worker_end_packet( worker );
+    }
+
+    next_check( next_server_receive_worker_update( worker ) == true );
+    next_check( server->notify_queue->num_entries == 1 );
+
+    next_server_notify_packet_received_t * notify = (next_server_notify_packet_received_t*) next_queue_pop( server->notify_queue );
+    next_check( notify );
+    next_check( notify->type == NEXT_SERVER_NOTIFY_PACKET_RECEIVED );
+    next_check( next_address_equal( &notify->from, &client_address ) == 1 );
+    next_check( notify->packet_bytes == int( sizeof(payload) ) );
+    next_check( memcmp( notify->packet_data, payload, sizeof(payload) ) == 0 );
+    next_free( NULL, notify );
+
+    // direct packets share the payload replay protection with the next route
+
+    packet_bytes = next_write_direct_packet( packet_data, open_session_sequence, 2, payload, sizeof(payload), magic, from_address_data, 4, 0, to_address_data, 4, 0 );
+    next_check( packet_bytes > 0 );
+
+    for ( int i = 0; i < 2; ++i )
+    {
+        next_server_receive_packet_t * packet = next_server_receive_worker_begin_packet( worker );
+        next_check( packet );
+        packet->packet_type = NEXT_DIRECT_PACKET;
+        packet->session_id = session_id;
+        packet->from = client_address;
+        packet->packet_bytes = packet_bytes - 18;
+        memcpy( packet->packet_data, packet_data + 16, size_t(packet->packet_bytes) );
+        next_server_receive_worker_end_packet( worker );
+    }
+
+    next_check( next_server_receive_worker_update( worker ) == true );
+    next_check( server->notify_queue->num_entries == 1 );
+    next_queue_clear( server->notify_queue );
+
+    // a packet on the pending route is delivered and asks the internal thread to promote the route
+
+    next_server_receive_command_update_session_t * pending_command = (next_server_receive_command_update_session_t*) next_malloc( NULL, sizeof(next_server_receive_command_update_session_t) );
+    memset( pending_command, 0, sizeof(next_server_receive_command_update_session_t) );
+    pending_command->type = NEXT_SERVER_RECEIVE_COMMAND_UPDATE_SESSION;
+    pending_command->session_id = session_id;
+    pending_command->address = client_address;
+    pending_command->open_session_sequence = open_session_sequence;
+    pending_command->route.has_current_route = true;
+    pending_command->route.has_pending_route = true;
+    pending_command->route.pending_route_session_version = 1;
+    memcpy( pending_command->route.current_route_private_key, current_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
+    memcpy( pending_command->route.pending_route_private_key, pending_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES );
+    next_server_receive_worker_push_command( worker, pending_command );
+
+    packet_bytes = next_write_client_to_server_packet( packet_data, 3, session_id, 1, pending_key, payload, sizeof(payload), magic, from_address_data, 4, 0, to_address_data, 4, 0 );
+    next_check( packet_bytes > 0 );
     {
-        if ( proxy_session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
-        {
-            next_check( next_address_equal( &address, &proxy_session_manager->addresses[i] ) == 1 );
-            next_proxy_session_entry_t * entry = &proxy_session_manager->entries[i];
-            next_check( entry->session_id == uint64_t(i)*2+1001 );
-            next_check( next_address_equal( &address, &entry->address ) == 1 );
-        }
-        address.port += 2;
+        next_server_receive_packet_t * packet = next_server_receive_worker_begin_packet( worker );
+        next_check( packet );
+        packet->packet_type = NEXT_CLIENT_TO_SERVER_PACKET;
+        packet->session_id = session_id;
+        packet->from = relay_address;
+        packet->packet_bytes = packet_bytes - 18;
+        memcpy( packet->packet_data, packet_data + 16, size_t(packet->packet_bytes) );
+        next_server_receive_worker_end_packet( worker );
     }
 
-    // remove all remaining entries manually
+    next_check( next_server_receive_worker_update( worker ) == true );
+    next_check( server->notify_queue->num_entries == 1 );
+    next_queue_clear( server->notify_queue );
 
-    for ( int i = 0; i < proxy_session_manager->size; ++i )
+    bool promote_requested = false;
+    while ( true )
     {
-        if ( proxy_session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
+        next_server_receive_event_t * event = (next_server_receive_event_t*) next_queue_pop( server->receive_event_queue );
+        if ( !event )
+            break;
+        if ( event->type == NEXT_SERVER_RECEIVE_EVENT_PROMOTE_ROUTE )
         {
-            next_proxy_session_manager_remove_by_address( proxy_session_manager, &proxy_session_manager->addresses[i] );
+            next_server_receive_event_promote_route_t * promote_route = (next_server_receive_event_promote_route_t*) event;
+            next_check( promote_route->session_id == session_id );
+            next_check( promote_route->session_version == 1 );
+            promote_requested = true;
         }
+        next_free( NULL, event );
     }
+    next_check( promote_requested );
 
-    next_check( proxy_session_manager->max_entry_index == 0 );
+    next_server_receive_session_t * session = next_server_receive_worker_find_session( worker, session_id );
+    next_check( session );
+    next_check( !session->route.has_pending_route );
+    next_check( session->route.has_previous_route );
+    next_check( memcmp( session->route.current_route_private_key, pending_key, NEXT_CRYPTO_BOX_SECRETKEYBYTES ) == 0 );
 
-    next_check( next_proxy_session_manager_num_entries( proxy_session_manager ) == 0 );
+    // once the session is removed its packets are dropped
 
-    next_proxy_session_manager_destroy( proxy_session_manager );
-}
+    next_server_internal_retire_receive_session( server, session_id );
 
-void test_session_manager()
-{
-    const int InitialSize = 32;
+    packet_bytes = next_write_direct_packet( packet_data, open_session_sequence, 4, payload, sizeof(payload), magic, from_address_data, 4, 0, to_address_data, 4, 0 );
+    {
+        next_server_receive_packet_t * packet = next_server_receive_worker_begin_packet( worker );
+        next_check( packet );
+        packet->packet_type = NEXT_DIRECT_PACKET;
+        packet->session_id = session_id;
+        packet->from = client_address;
+        packet->packet_bytes = packet_bytes - 18;
+        memcpy( packet->packet_data, packet_data + 16, size_t(packet->packet_bytes) );
+        next_server_receive_worker_end_packet( worker );
+    }
 
-    next_session_manager_t * session_manager = next_session_manager_create( NULL, InitialSize );
+    next_server_receive_worker_update( worker );
+    next_check( worker->num_sessions == 0 );
+    next_check( server->notify_queue->num_entries == 0 );
 
-    next_check( session_manager );
+    // the ring drops packets instead of blocking the internal thread when a worker falls behind
 
-    next_address_t address;
-    next_address_parse( &address, "127.0.0.1:12345" );
+    for ( int i = 0; i < NEXT_SERVER_RECEIVE_RING_SIZE; ++i )
+    {
+        next_check( next_server_receive_worker_begin_packet( worker ) );
+        next_server_receive_worker_end_packet( worker );
+    }
+    next_check( next_server_receive_worker_begin_packet( worker ) == NULL );
+    next_check( worker->packets_dropped == 1 );
 
-    // test private keys
+    next_server_receive_worker_destroy( worker );
+    next_queue_destroy( server->notify_queue );
+    next_queue_destroy( server->receive_event_queue );
+    next_platform_mutex_destroy( &server->notify_mutex );
+    next_platform_mutex_destroy( &server->receive_event_mutex );
+    next_free( NULL, server );
+}
 
-    uint8_t private_keys[InitialSize*3*NEXT_CRYPTO_SECRETBOX_KEYBYTES];
-    next_random_bytes( private_keys, sizeof(private_keys) );
+void test_server_maintenance()
+{
+    // per-session maintenance only visits the sessions whose timers are due, and stops at its time budget
 
-    // test upgrade tokens
+    next_server_internal_t * server = (next_server_internal_t*) next_malloc( NULL, sizeof(next_server_internal_t) );
+    next_check( server );
+    memset( server, 0, sizeof(next_server_internal_t) );
+    next_server_internal_initialize_sentinels( server );
+    next_check( next_platform_mutex_create( &server->notify_mutex ) == NEXT_OK );
+    next_check( next_platform_mutex_create( &server->session_mutex ) == NEXT_OK );
+    server->notify_queue = next_queue_create( NULL, NEXT_NOTIFY_QUEUE_LENGTH );
+    next_check( server->notify_queue );
+    server->session_manager = next_session_manager_create( NULL, 64 );
+    next_check( server->session_manager );
+    server->session_timers = next_timer_wheel_create( NULL, 64, NEXT_SERVER_SESSION_TIMER_RESOLUTION, next_time() );
+    next_check( server->session_timers );
 
-    uint8_t upgrade_tokens[InitialSize*3*NEXT_UPGRADE_TOKEN_BYTES];
-    next_random_bytes( upgrade_tokens, sizeof(upgrade_tokens) );
+    const int NumSessions = 256;
 
-    // add enough entries to make sure we have to expand
+    next_address_t address;
+    next_address_parse( &address, "127.0.0.1:20000" );
 
-    for ( int i = 0; i < InitialSize*3; ++i )
-    {
-        next_session_entry_t * entry = next_session_manager_add( session_manager, &address, uint64_t(i)+1000, &private_keys[i*NEXT_CRYPTO_SECRETBOX_KEYBYTES], &upgrade_tokens[i*NEXT_UPGRADE_TOKEN_BYTES], NULL, 0 );
-        next_check( entry );
-        next_check( entry->session_id == uint64_t(i) + 1000 );
-        next_check( next_address_equal( &address, &entry->address ) == 1 );
-        next_check( memcmp( entry->ephemeral_private_key, &private_keys[i*NEXT_CRYPTO_SECRETBOX_KEYBYTES], NEXT_CRYPTO_SECRETBOX_KEYBYTES ) == 0 );
-        next_check( memcmp( entry->upgrade_token, &upgrade_tokens[i*NEXT_UPGRADE_TOKEN_BYTES], NEXT_UPGRADE_TOKEN_BYTES ) == 0 );
-        address.port++;
-    }
+    uint8_t private_key[NEXT_CRYPTO_SECRETBOX_KEYBYTES];
+    uint8_t upgrade_token[NEXT_UPGRADE_TOKEN_BYTES];
+    memset( private_key, 0, sizeof(private_key) );
+    memset( upgrade_token, 0, sizeof(upgrade_token) );
 
-    // verify that all entries are there
+    const double current_time = next_time();
 
-    address.port = 12345;
-    for ( int i = 0; i < InitialSize*3; ++i )
+    for ( int i = 0; i < NumSessions; ++i )
     {
-        next_session_entry_t * entry = next_session_manager_find_by_address( session_manager, &address );
+        next_session_entry_t * entry = next_session_manager_add( server->session_manager, &address, uint64_t(i) + 1000, private_key, upgrade_token, NULL, 0 );
         next_check( entry );
-        next_check( entry->session_id == uint64_t(i)+1000 );
-        next_check( next_address_equal( &address, &entry->address ) == 1 );
+        const bool stale = ( i % 2 ) == 0;
+        entry->last_client_stats_update = stale ? current_time - 2.0 * NEXT_SERVER_SESSION_TIMEOUT : current_time;
+        entry->last_client_direct_ping = current_time;
+        entry->last_client_next_ping = current_time;
+        entry->next_session_update_time = -1.0;
+        entry->stats_fallback_to_direct = true;
+        next_server_internal_wake_session( server, entry, current_time - 1.0 );
         address.port++;
     }
 
-    next_check( next_session_manager_num_entries( session_manager ) == InitialSize*3 );
+    server->maintenance_update_route = true;
+    server->maintenance_update_sessions = true;
+    server->maintenance_update_trackers = true;
+    server->maintenance_update_backend = true;
 
-    // remove every second entry
+    next_check( next_server_internal_update_session_timers( server, 1.0e-9 ) == false );
+    next_check( server->notify_queue->num_entries > 0 );
+    next_check( server->notify_queue->num_entries < NumSessions / 2 );
 
-    for ( int i = 0; i < InitialSize*3; ++i )
-    {
-        if ( (i%2) == 0 )
-        {
-            next_session_manager_remove_by_address( session_manager, &session_manager->addresses[i] );
-        }
-    }
+    // the sessions timed out so far leave holes, so an expand between steps moves the rest to new indices.
+    // the pass starts over, and every stale session still times out exactly once
 
-    // verify only the entries that remain can be found
+    const int num_timed_out = server->notify_queue->num_entries;
+    next_check( next_session_manager_expand( server->session_manager ) );
+    next_check( server->session_manager->max_entry_index == NumSessions - num_timed_out - 1 );
 
-    address.port = 12345;
-    for ( int i = 0; i < InitialSize*3; ++i )
+    int num_steps = 1;
+    while ( !next_server_internal_update_session_timers( server, 1.0e-9 ) )
     {
-        next_session_entry_t * entry = next_session_manager_find_by_address( session_manager, &address );
-        if ( (i%2) != 0 )
-        {
-            next_check( entry );
-            next_check( entry->session_id == uint64_t(i)+1000 );
-            next_check( next_address_equal( &address, &entry->address ) == 1 );
-        }
-        else
-        {
-            next_check( entry == NULL );
-        }
-        address.port++;
+        num_steps++;
+        next_check( num_steps <= NumSessions );
     }
 
-    // expand, and verify that all entries get collapsed
+    next_check( num_steps > 1 );
+    next_check( server->notify_queue->num_entries == NumSessions / 2 );
+    next_check( next_session_manager_num_entries( server->session_manager ) == NumSessions / 2 );
 
-    next_session_manager_expand( session_manager );
+    // the live sessions are rescheduled for their ping timeout, so nothing is due until then
 
-    address.port = 12346;
-    for ( int i = 0; i < session_manager->size; ++i )
+    for ( int i = 0; i < server->session_manager->size; ++i )
     {
-        if ( session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
-        {
-            next_check( next_address_equal( &address, &session_manager->addresses[i] ) == 1 );
-            next_session_entry_t * entry = &session_manager->entries[i];
-            next_check( entry->session_id == uint64_t(i)*2+1001 );
-            next_check( next_address_equal( &address, &entry->address ) == 1 );
-        }
-        address.port += 2;
+        next_check( next_timer_wheel_scheduled( server->session_timers, i ) == ( server->session_manager->session_ids[i] != 0 ) );
     }
 
-    // remove all remaining entries manually
-
-    for ( int i = 0; i < session_manager->size; ++i )
-    {
-        if ( session_manager->addresses[i].type != NEXT_ADDRESS_NONE )
-        {
-            next_session_manager_remove_by_address( session_manager, &session_manager->addresses[i] );
-        }
-    }
+    next_queue_clear( server->notify_queue );
+    next_check( next_server_internal_update_session_timers( server, 0.0 ) == true );
+    next_check( server->session_timers->heads[NEXT_TIMER_WHEEL_EXPIRED] == -1 );
+    next_check( server->notify_queue->num_entries == 0 );
 
-    next_check( session_manager->max_entry_index == 0 );
+    // waking a session makes it due straight away
 
-    next_check( next_session_manager_num_entries( session_manager ) == 0 );
+    next_check( server->session_manager->session_ids[1] != 0 );
+    next_server_internal_wake_session( server, &server->session_manager->entries[1], next_time() );
+    next_timer_wheel_advance( server->session_timers, next_time() + NEXT_SERVER_SESSION_TIMER_RESOLUTION );
+    next_check( next_timer_wheel_pop( server->session_timers ) == 1 );
+    next_check( next_timer_wheel_pop( server->session_timers ) == -1 );
 
-    next_session_manager_destroy( session_manager );
+    next_timer_wheel_destroy( server->session_timers );
+    next_session_manager_destroy( server->session_manager );
+    next_queue_destroy( server->notify_queue );
+    next_platform_mutex_destroy( &server->session_mutex );
+    next_platform_mutex_destroy( &server->notify_mutex );
+    next_free( NULL, server );
 }
 
 void test_relay_manager()
@@ -21003,6 +24304,20 @@ void test_passthrough_packets()
     next_server_destroy( server );
 }
 
+void test_passthrough_packets_receive_threads()
+{
+    const int server_receive_threads = next_global_config.server_receive_threads;
+
+    next_global_config.server_receive_threads = 2;
+
+    test_passthrough_packets_client_packets_received = 0;
+    test_passthrough_packets_server_packets_received = 0;
+
+    test_passthrough_packets();
+
+    next_global_config.server_receive_threads = server_receive_threads;
+}
+
 #endif // #if defined(NEXT_PLATFORM_CAN_RUN_SERVER)
 
 #define RUN_TEST( test_function )                                           \
@@ -21022,7 +24337,10 @@ void next_test()
         RUN_TEST( test_endian );
         RUN_TEST( test_base64 );
         RUN_TEST( test_fnv1a );
+        RUN_TEST( test_siphash );
+        RUN_TEST( test_hash_collision_attack );
         RUN_TEST( test_queue );
+        RUN_TEST( test_timer_wheel );
         RUN_TEST( test_bitpacker );
         RUN_TEST( test_bits_required );
         RUN_TEST( test_stream );
@@ -21042,6 +24360,7 @@ void next_test()
         RUN_TEST( test_platform_socket );
         RUN_TEST( test_platform_thread );
         RUN_TEST( test_platform_mutex );
+        RUN_TEST( test_platform_semaphore );
         RUN_TEST( test_client_ipv4 );
         RUN_TEST( test_server_ipv4 );
 #if defined(NEXT_PLATFORM_HAS_IPV6)
@@ -21075,6 +24394,7 @@ void next_test()
         RUN_TEST( test_route_response_packet );
         RUN_TEST( test_client_to_server_packet );
         RUN_TEST( test_server_to_client_packet );
+        RUN_TEST( test_in_place_packets );
         RUN_TEST( test_ping_packet );
         RUN_TEST( test_pong_packet );
         RUN_TEST( test_continue_request_packet );
@@ -21104,8 +24424,14 @@ void next_test()
         RUN_TEST( test_match_data_request_packet );
         RUN_TEST( test_match_data_response_packet );
         RUN_TEST( test_pending_session_manager );
+        RUN_TEST( test_pending_session_manager_index );
         RUN_TEST( test_proxy_session_manager );
+        RUN_TEST( test_proxy_session_manager_index );
         RUN_TEST( test_session_manager );
+        RUN_TEST( test_session_manager_index );
+        RUN_TEST( test_session_send_state );
+        RUN_TEST( test_server_receive_worker );
+        RUN_TEST( test_server_maintenance );
         RUN_TEST( test_relay_manager );
         RUN_TEST( test_tags );
         RUN_TEST( test_bandwidth_limiter );
@@ -21119,10 +24445,300 @@ void next_test()
 #endif // #if defined(NEXT_PLATFORM_HAS_IPV6)
 #if defined(NEXT_PLATFORM_CAN_RUN_SERVER)
         RUN_TEST( test_passthrough_packets );
+        RUN_TEST( test_passthrough_packets_receive_threads );
 #endif // #if defined(NEXT_PLATFORM_CAN_RUN_SERVER)
     }
 }
 
+void bench_session_manager()
+{
+    // lookup cost by address and by session id should stay flat as the number of sessions grows
+
+    const int NumLookups = 1000000;
+
+    const int session_counts[] = { 64, 256, 1024, 4096, 16384, 65536, 100000 };
+
+    uint8_t private_key[NEXT_CRYPTO_SECRETBOX_KEYBYTES];
+    uint8_t upgrade_token[NEXT_UPGRADE_TOKEN_BYTES];
+    memset( private_key, 0, sizeof(private_key) );
+    memset( upgrade_token, 0, sizeof(upgrade_token) );
+
+    for ( int k = 0; k < int( sizeof(session_counts) / sizeof(int) ); ++k )
+    {
+        const int num_sessions = session_counts[k];
+
+        // size the manager up front. entries are large, so growing through expand would need two copies in memory at once
+
+        next_session_manager_t * session_manager = next_session_manager_create( NULL, num_sessions + 1 );
+        if ( !session_manager )
+        {
+            next_printf( "    session_manager: could not create manager for %d sessions", num_sessions );
+            return;
+        }
+
+        next_address_t * addresses = (next_address_t*) next_malloc( NULL, size_t(num_sessions) * sizeof(next_address_t) );
+        uint64_t * session_ids = (uint64_t*) next_malloc( NULL, size_t(num_sessions) * 8 );
+        int * lookups = (int*) next_malloc( NULL, size_t(NumLookups) * sizeof(int) );
+
+        for ( int i = 0; i < num_sessions; ++i )
+        {
+            memset( &addresses[i], 0, sizeof(next_address_t) );
+            addresses[i].type = NEXT_ADDRESS_IPV4;
+            addresses[i].data.ipv4[0] = 10;
+            addresses[i].data.ipv4[1] = uint8_t( i >> 16 );
+            addresses[i].data.ipv4[2] = uint8_t( i >> 8 );
+            addresses[i].data.ipv4[3] = uint8_t( i );
+            addresses[i].port = uint16_t( 10000 + ( i % 50000 ) );
+            session_ids[i] = next_random_uint64() | 1;
+            next_session_manager_add( session_manager, &addresses[i], session_ids[i], private_key, upgrade_token, NULL, 0 );
+        }
+
+        for ( int i = 0; i < NumLookups; ++i )
+        {
+            lookups[i] = int( next_random_uint64() % uint64_t(num_sessions) );
+        }
+
+        int found = 0;
+
+        double start_time = next_time();
+        for ( int i = 0; i < NumLookups; ++i )
+        {
+            found += next_session_manager_find_by_address( session_manager, &addresses[lookups[i]] ) != NULL;
+        }
+        const double address_time = next_time() - start_time;
+
+        start_time = next_time();
+        for ( int i = 0; i < NumLookups; ++i )
+        {
+            found += next_session_manager_find_by_session_id( session_manager, session_ids[lookups[i]] ) != NULL;
+        }
+        const double session_id_time = next_time() - start_time;
+
+        next_check( found == NumLookups * 2 );
+
+        next_printf( "    session_manager: %6d sessions -> find_by_address %.1fns, find_by_session_id %.1fns", num_sessions, address_time * 1000000000.0 / NumLookups, session_id_time * 1000000000.0 / NumLookups );
+
+        next_free( NULL, lookups );
+        next_free( NULL, session_ids );
+        next_free( NULL, addresses );
+
+        next_session_manager_destroy( session_manager );
+    }
+}
+
+void bench_proxy_session_manager()
+{
+    // next_server_send_packet looks up the proxy session on every payload, so this cost must not grow with session count
+
+    const int NumLookups = 1000000;
+
+    const int session_counts[] = { 64, 256, 1024, 4096, 16384, 65536, 100000 };
+
+    for ( int k = 0; k < int( sizeof(session_counts) / sizeof(int) ); ++k )
+    {
+        const int num_sessions = session_counts[k];
+
+        next_proxy_session_manager_t * session_manager = next_proxy_session_manager_create( NULL, 64 );
+        if ( !session_manager )
+        {
+            next_printf( "    proxy_session_manager: could not create manager for %d sessions", num_sessions );
+            return;
+        }
+
+        next_address_t * addresses = (next_address_t*) next_malloc( NULL, size_t(num_sessions) * sizeof(next_address_t) );
+        int * lookups = (int*) next_malloc( NULL, size_t(NumLookups) * sizeof(int) );
+
+        for ( int i = 0; i < num_sessions; ++i )
+        {
+            memset( &addresses[i], 0, sizeof(next_address_t) );
+            addresses[i].type = NEXT_ADDRESS_IPV4;
+            addresses[i].data.ipv4[0] = 10;
+            addresses[i].data.ipv4[1] = uint8_t( i >> 16 );
+            addresses[i].data.ipv4[2] = uint8_t( i >> 8 );
+            addresses[i].data.ipv4[3] = uint8_t( i );
+            addresses[i].port = uint16_t( 10000 + ( i % 50000 ) );
+            next_proxy_session_manager_add( session_manager, &addresses[i], uint64_t(i) + 1 );
+        }
+
+        for ( int i = 0; i < NumLookups; ++i )
+        {
+            lookups[i] = int( next_random_uint64() % uint64_t(num_sessions) );
+        }
+
+        int found = 0;
+
+        const double start_time = next_time();
+        for ( int i = 0; i < NumLookups; ++i )
+        {
+            found += next_proxy_session_manager_find( session_manager, &addresses[lookups[i]] ) != NULL;
+        }
+        const double find_time = next_time() - start_time;
+
+        next_check( found == NumLookups );
+
+        next_printf( "    proxy_session_manager: %6d sessions -> find %.1fns", num_sessions, find_time * 1000000000.0 / NumLookups );
+
+        next_free( NULL, lookups );
+        next_free( NULL, addresses );
+
+        next_proxy_session_manager_destroy( session_manager );
+    }
+}
+
+void bench_hash()
+{
+    // cost of the keyed address and session id hashes, against the unkeyed byte at a time fnv-1a they replace
+
+    const int NumAddresses = 4096;
+    const int NumIterations = 1000;
+
+    next_address_t * addresses = (next_address_t*) next_malloc( NULL, size_t(NumAddresses) * sizeof(next_address_t) );
+    uint64_t * session_ids = (uint64_t*) next_malloc( NULL, size_t(NumAddresses) * 8 );
+
+    for ( int k = 0; k < 2; ++k )
+    {
+        for ( int i = 0; i < NumAddresses; ++i )
+        {
+            memset( &addresses[i], 0, sizeof(next_address_t) );
+            if ( k == 0 )
+            {
+                addresses[i].type = NEXT_ADDRESS_IPV4;
+                next_random_bytes( addresses[i].data.ipv4, 4 );
+            }
+            else
+            {
+                addresses[i].type = NEXT_ADDRESS_IPV6;
+                next_random_bytes( (uint8_t*) addresses[i].data.ipv6, 16 );
+            }
+            addresses[i].port = uint16_t( next_random_uint64() );
+            session_ids[i] = next_random_uint64();
+        }
+
+        const int address_bytes = ( k == 0 ) ? 4 : 16;
+
+        uint64_t sum = 0;
+
+        double start_time = next_time();
+        for ( int j = 0; j < NumIterations; ++j )
+        {
+            for ( int i = 0; i < NumAddresses; ++i )
+            {
+                next_fnv_t fnv;
+                next_fnv_init( &fnv );
+                next_fnv_write( &fnv, (const uint8_t*) &addresses[i].port, 2 );
+                next_fnv_write( &fnv, (const uint8_t*) &addresses[i].data, address_bytes );
+                sum += next_fnv_finalize( &fnv );
+            }
+        }
+        const double fnv_time = next_time() - start_time;
+
+        start_time = next_time();
+        for ( int j = 0; j < NumIterations; ++j )
+        {
+            for ( int i = 0; i < NumAddresses; ++i )
+            {
+                sum += next_address_hash( &addresses[i] );
+            }
+        }
+        const double address_time = next_time() - start_time;
+
+        start_time = next_time();
+        for ( int j = 0; j < NumIterations; ++j )
+        {
+            for ( int i = 0; i < NumAddresses; ++i )
+            {
+                sum += next_session_id_hash( session_ids[i] );
+            }
+        }
+        const double session_id_time = next_time() - start_time;
+
+        const double scale = 1000000000.0 / ( double(NumAddresses) * NumIterations );
+
+        next_check( sum != 0 );
+
+        next_printf( "    hash: %s -> fnv1a %.1fns, address_hash %.1fns, session_id_hash %.1fns", ( k == 0 ) ? "ipv4" : "ipv6", fnv_time * scale, address_time * scale, session_id_time * scale );
+    }
+
+    next_free( NULL, session_ids );
+    next_free( NULL, addresses );
+}
+
+void bench_write_packets()
+{
+    // cost of writing server to client and direct packets by copying the payload in, against writing around a payload that is already in place
+
+    const int NumPackets = 1000000;
+
+    const int payload_sizes[] = { 100, 600, 1200 };
+
+    uint8_t magic[8];
+    uint8_t from_address[4];
+    uint8_t to_address[4];
+    uint8_t private_key[NEXT_CRYPTO_AEAD_CHACHA20POLY1305_KEYBYTES];
+    next_random_bytes( magic, 8 );
+    next_random_bytes( from_address, 4 );
+    next_random_bytes( to_address, 4 );
+    next_random_bytes( private_key, sizeof(private_key) );
+
+    uint8_t game_packet_data[NEXT_MTU];
+    next_random_bytes( game_packet_data, sizeof(game_packet_data) );
+
+    uint8_t packet_data[NEXT_MAX_PACKET_BYTES];
+    uint8_t in_place_buffer[NEXT_SEND_PACKET_HEADROOM + NEXT_MTU + NEXT_SEND_PACKET_TAILROOM];
+    uint8_t * payload = in_place_buffer + NEXT_SEND_PACKET_HEADROOM;
+
+    for ( int k = 0; k < int( sizeof(payload_sizes) / sizeof(int) ); ++k )
+    {
+        const int game_packet_bytes = payload_sizes[k];
+
+        memcpy( payload, game_packet_data, game_packet_bytes );
+
+        uint64_t sum = 0;
+
+        double start_time = next_time();
+        for ( int i = 0; i < NumPackets; ++i )
+        {
+            sum += next_write_server_to_client_packet( packet_data, uint64_t(i), 0x12314141LL, 0, private_key, game_packet_data, game_packet_bytes, magic, from_address, 4, 1000, to_address, 4, 2000 );
+        }
+        const double copy_time = next_time() - start_time;
+
+        start_time = next_time();
+        for ( int i = 0; i < NumPackets; ++i )
+        {
+            sum += next_write_server_to_client_packet_in_place( payload - NEXT_SERVER_TO_CLIENT_PACKET_HEADER_BYTES, uint64_t(i), 0x12314141LL, 0, private_key, game_packet_bytes, magic, from_address, 4, 1000, to_address, 4, 2000 );
+        }
+        const double in_place_time = next_time() - start_time;
+
+        start_time = next_time();
+        for ( int i = 0; i < NumPackets; ++i )
+        {
+            sum += next_write_direct_packet( packet_data, 0, uint64_t(i), game_packet_data, game_packet_bytes, magic, from_address, 4, 1000, to_address, 4, 2000 );
+        }
+        const double direct_copy_time = next_time() - start_time;
+
+        start_time = next_time();
+        for ( int i = 0; i < NumPackets; ++i )
+        {
+            sum += next_write_direct_packet_in_place( payload - NEXT_DIRECT_PACKET_HEADER_BYTES, 0, uint64_t(i), game_packet_bytes, magic, from_address, 4, 1000, to_address, 4, 2000 );
+        }
+        const double direct_in_place_time = next_time() - start_time;
+
+        next_check( sum != 0 );
+
+        const double scale = 1000000000.0 / NumPackets;
+
+        next_printf( "    write_packets: %4d byte payload -> server_to_client %.1fns (%d bytes copied), in place %.1fns (0 bytes copied). direct %.1fns (%d bytes copied), in place %.1fns (0 bytes copied)", game_packet_bytes, copy_time * scale, game_packet_bytes, in_place_time * scale, direct_copy_time * scale, game_packet_bytes, direct_in_place_time * scale );
+    }
+}
+
+void next_bench()
+{
+    bench_hash();
+    bench_session_manager();
+    bench_proxy_session_manager();
+    bench_write_packets();
+}
+
 #endif // #if NEXT_COMPILE_WITH_TESTS
 
 #ifdef _MSC_VER
@@ -59,6 +59,11 @@
 
 #define NEXT_MTU                                               1300
 
+// next_server_send_packet_in_place needs this much writable room in front of the packet and after it
+
+#define NEXT_SEND_PACKET_HEADROOM                                64
+#define NEXT_SEND_PACKET_TAILROOM                                 2
+
 #define NEXT_LOG_LEVEL_NONE                                       0
 #define NEXT_LOG_LEVEL_ERROR                                      1
 #define NEXT_LOG_LEVEL_INFO                                       2
@@ -176,6 +181,8 @@ struct next_config_t
     NEXT_BOOL disable_autodetect;
     NEXT_BOOL force_passthrough_direct;
     NEXT_BOOL high_priority_threads;
+    int server_receive_threads;
+    NEXT_BOOL udp_segmentation;
 };
 
 NEXT_EXPORT_FUNC void next_default_config( struct next_config_t * config );
@@ -325,6 +332,9 @@ struct next_server_callbacks_t
 
 	void (*route_update_callback)( void * data, const next_address_t * client_address, NEXT_BOOL next );
 	void * route_update_callback_data;
+
+	int (*packet_source_callback)( void * data, next_address_t * from, uint8_t * packet_data, int max_packet_bytes );
+	void * packet_source_callback_data;
 };
 
 struct next_server_stats_t
@@ -389,6 +399,8 @@ NEXT_EXPORT_FUNC NEXT_BOOL next_server_session_upgraded( struct next_server_t *
 
 NEXT_EXPORT_FUNC void next_server_send_packet( struct next_server_t * server, const struct next_address_t * to_address, const uint8_t * packet_data, int packet_bytes );
 
+NEXT_EXPORT_FUNC void next_server_send_packet_in_place( struct next_server_t * server, const struct next_address_t * to_address, uint8_t * packet_data, int packet_bytes );
+
 NEXT_EXPORT_FUNC void next_server_send_packet_direct( struct next_server_t * server, const struct next_address_t * to_address, const uint8_t * packet_data, int packet_bytes );
 
 NEXT_EXPORT_FUNC NEXT_BOOL next_server_stats( struct next_server_t * server, const struct next_address_t * address, struct next_server_stats_t * stats );
@@ -434,6 +446,8 @@ struct next_mutex_helper_t
 
 NEXT_EXPORT_FUNC void next_test();
 
+NEXT_EXPORT_FUNC void next_bench();
+
 // -----------------------------------------
 
 #endif // #ifndef NEXT_H
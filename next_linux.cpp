@@ -43,6 +43,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <alloca.h>
+#include <netinet/udp.h>
 
 extern void * next_global_context;
 
@@ -181,6 +182,18 @@ void next_platform_sleep( double time )
 
 // ---------------------------------------------------
 
+/*
+    With segmentation enabled, a batch send coalesces packets of the same size to the same address into one message
+    that the kernel splits back into datagrams, and a receive may get several datagrams from one sender as one message.
+    The socket keeps that message and hands it out a datagram per receive call, ahead of anything new from the kernel.
+*/
+
+#define NEXT_PLATFORM_GSO_MAX_SEGMENTS                             64
+#define NEXT_PLATFORM_GSO_MAX_SEGMENT_BYTES                      1452
+#define NEXT_PLATFORM_GSO_MAX_BYTES                             65000
+
+#define NEXT_PLATFORM_GRO_MESSAGE_BYTES                         65536
+
 void next_platform_socket_destroy( next_platform_socket_t * socket );
 
 next_platform_socket_t * next_platform_socket_create( void * context, next_address_t * address, int socket_type, float timeout_seconds, int send_buffer_size, int receive_buffer_size, bool enable_packet_tagging )
@@ -198,6 +211,12 @@ next_platform_socket_t * next_platform_socket_create( void * context, next_addre
 
     socket->type = socket_type;
 
+    socket->gso = false;
+    socket->gro_buffer = NULL;
+    socket->gro_bytes = 0;
+    socket->gro_offset = 0;
+    socket->gro_segment_bytes = 0;
+
     socket->handle = ::socket( ( address->type == NEXT_ADDRESS_IPV6 ) ? AF_INET6 : AF_INET, SOCK_DGRAM, IPPROTO_UDP );
 
     if ( socket->handle < 0 )
@@ -370,6 +389,31 @@ next_platform_socket_t * next_platform_socket_create( void * context, next_addre
     return socket;
 }
 
+bool next_platform_socket_enable_segmentation( next_platform_socket_t * socket )
+{
+    // udp gso for batch sends and gro for receives. call before the socket is in use. false if the kernel supports neither
+
+    next_assert( socket );
+
+    const int segment_size = 0;
+    socket->gso = setsockopt( socket->handle, IPPROTO_UDP, UDP_SEGMENT, &segment_size, sizeof(int) ) == 0;
+
+    int enable = 1;
+    if ( setsockopt( socket->handle, IPPROTO_UDP, UDP_GRO, &enable, sizeof(int) ) == 0 )
+    {
+        socket->gro_buffer = (uint8_t*) next_malloc( socket->context, NEXT_PLATFORM_GRO_MESSAGE_BYTES );
+        if ( !socket->gro_buffer )
+        {
+            enable = 0;
+            setsockopt( socket->handle, IPPROTO_UDP, UDP_GRO, &enable, sizeof(int) );
+        }
+    }
+
+    next_printf( NEXT_LOG_LEVEL_DEBUG, "udp gso %s, gro %s", socket->gso ? "on" : "off", socket->gro_buffer ? "on" : "off" );
+
+    return socket->gso || socket->gro_buffer;
+}
+
 void next_platform_socket_destroy( next_platform_socket_t * socket )
 {
     next_assert( socket );
@@ -377,6 +421,10 @@ void next_platform_socket_destroy( next_platform_socket_t * socket )
     {
         close( socket->handle );
     }
+    if ( socket->gro_buffer )
+    {
+        next_free( socket->context, socket->gro_buffer );
+    }
     next_free( socket->context, socket );
 }
 
@@ -441,14 +489,6 @@ void next_platform_socket_send_packets( next_platform_socket_t * socket, const n
     if ( num_packets == 0 )
         return;
 
-    iovec * msg = (iovec*) alloca( sizeof(iovec) * num_packets );
-
-    for ( int i = 0; i < num_packets; ++i )
-    {
-        msg[i].iov_base = packet_data[i];
-        msg[i].iov_len = packet_bytes[i];
-    }
-
     sockaddr_in * socket_address = (sockaddr_in*) alloca( sizeof(sockaddr_in) * num_packets );
 
     for ( int i = 0; i < num_packets; ++i )
@@ -460,20 +500,119 @@ void next_platform_socket_send_packets( next_platform_socket_t * socket, const n
                                             ( ( (uint32_t) to[i].data.ipv4[1] ) << 8 )   | 
                                             ( ( (uint32_t) to[i].data.ipv4[2] ) << 16 )  | 
                                             ( ( (uint32_t) to[i].data.ipv4[3] ) << 24 );
-        socket_address[i].sin_port = next_platform_htons( to->port );
+        socket_address[i].sin_port = next_platform_htons( to[i].port );
+    }
+
+    // with gso, each message is a run of packets of the same size to the same address. a packet only joins the
+    // last message to its address, so packets to one address keep their order
+
+    int * message_first = (int*) alloca( sizeof(int) * num_packets );
+    int * message_last = (int*) alloca( sizeof(int) * num_packets );
+    int * message_count = (int*) alloca( sizeof(int) * num_packets );
+    int * message_bytes = (int*) alloca( sizeof(int) * num_packets );
+    int * packet_next = (int*) alloca( sizeof(int) * num_packets );
+
+    int table_size = 1;
+    while ( table_size < num_packets * 2 )
+    {
+        table_size *= 2;
+    }
+
+    int * table = (int*) alloca( sizeof(int) * table_size );
+    for ( int i = 0; i < table_size; ++i )
+    {
+        table[i] = -1;
     }
 
-    mmsghdr * packet_array = (mmsghdr*) alloca( sizeof(mmsghdr) * num_packets );
+    int num_messages = 0;
 
     for ( int i = 0; i < num_packets; ++i )
     {
-        packet_array[i].msg_hdr.msg_name = &socket_address[i];
+        packet_next[i] = -1;
+
+        if ( socket->gso )
+        {
+            const uint32_t hash = ( socket_address[i].sin_addr.s_addr ^ ( uint32_t( socket_address[i].sin_port ) << 16 ) ) * 0x9E3779B1U;
+
+            int index = int( hash >> 16 ) & ( table_size - 1 );
+
+            while ( table[index] != -1 )
+            {
+                const sockaddr_in * first = &socket_address[message_first[table[index]]];
+                if ( first->sin_addr.s_addr == socket_address[i].sin_addr.s_addr && first->sin_port == socket_address[i].sin_port )
+                    break;
+                index = ( index + 1 ) & ( table_size - 1 );
+            }
+
+            const int message = table[index];
+
+            if ( message != -1 &&
+                 packet_bytes[message_first[message]] == packet_bytes[i] &&
+                 packet_bytes[i] <= NEXT_PLATFORM_GSO_MAX_SEGMENT_BYTES &&
+                 message_count[message] < NEXT_PLATFORM_GSO_MAX_SEGMENTS &&
+                 message_bytes[message] + packet_bytes[i] <= NEXT_PLATFORM_GSO_MAX_BYTES )
+            {
+                packet_next[message_last[message]] = i;
+                message_last[message] = i;
+                message_count[message]++;
+                message_bytes[message] += packet_bytes[i];
+                continue;
+            }
+
+            table[index] = num_messages;
+        }
+
+        message_first[num_messages] = i;
+        message_last[num_messages] = i;
+        message_count[num_messages] = 1;
+        message_bytes[num_messages] = packet_bytes[i];
+        num_messages++;
+    }
+
+    iovec * msg = (iovec*) alloca( sizeof(iovec) * num_packets );
+
+    mmsghdr * packet_array = (mmsghdr*) alloca( sizeof(mmsghdr) * num_messages );
+
+    memset( packet_array, 0, sizeof(mmsghdr) * num_messages );
+
+    const size_t control_size = CMSG_SPACE( sizeof(uint16_t) );
+
+    uint8_t * control = (uint8_t*) alloca( control_size * num_messages );
+
+    int num_iov = 0;
+
+    for ( int i = 0; i < num_messages; ++i )
+    {
+        const int first = message_first[i];
+
+        packet_array[i].msg_hdr.msg_name = &socket_address[first];
         packet_array[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
-        packet_array[i].msg_hdr.msg_iov = &msg[i];
-        packet_array[i].msg_hdr.msg_iovlen = 1;
+        packet_array[i].msg_hdr.msg_iov = &msg[num_iov];
+        packet_array[i].msg_hdr.msg_iovlen = message_count[i];
+
+        for ( int packet = first; packet != -1; packet = packet_next[packet] )
+        {
+            msg[num_iov].iov_base = packet_data[packet];
+            msg[num_iov].iov_len = packet_bytes[packet];
+            num_iov++;
+        }
+
+        if ( message_count[i] > 1 )
+        {
+            uint8_t * message_control = control + control_size * i;
+            memset( message_control, 0, control_size );
+            packet_array[i].msg_hdr.msg_control = message_control;
+            packet_array[i].msg_hdr.msg_controllen = control_size;
+            cmsghdr * cmsg = CMSG_FIRSTHDR( &packet_array[i].msg_hdr );
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN( sizeof(uint16_t) );
+            const uint16_t segment_size = uint16_t( packet_bytes[first] );
+            memcpy( CMSG_DATA( cmsg ), &segment_size, sizeof(uint16_t) );
+        }
     }
 
-    int result = sendmmsg( socket->handle, packet_array, num_packets, 0 );
+    int result = sendmmsg( socket->handle, packet_array, num_messages, 0 );
     
     if ( result == -1 )
     {
@@ -481,6 +620,111 @@ void next_platform_socket_send_packets( next_platform_socket_t * socket, const n
     }
 }
 
+static bool next_platform_socket_address_from_sockaddr( const sockaddr_storage * sockaddr_from, next_address_t * from )
+{
+    if ( sockaddr_from->ss_family == AF_INET6 )
+    {
+        const sockaddr_in6 * addr_ipv6 = (const sockaddr_in6*) sockaddr_from;
+        from->type = NEXT_ADDRESS_IPV6;
+        for ( int i = 0; i < 8; ++i )
+        {
+            from->data.ipv6[i] = next_platform_ntohs( ( (const uint16_t*) &addr_ipv6->sin6_addr ) [i] );
+        }
+        from->port = next_platform_ntohs( addr_ipv6->sin6_port );
+        return true;
+    }
+    else if ( sockaddr_from->ss_family == AF_INET )
+    {
+        const sockaddr_in * addr_ipv4 = (const sockaddr_in*) sockaddr_from;
+        from->type = NEXT_ADDRESS_IPV4;
+        from->data.ipv4[0] = (uint8_t) ( ( addr_ipv4->sin_addr.s_addr & 0x000000FF ) );
+        from->data.ipv4[1] = (uint8_t) ( ( addr_ipv4->sin_addr.s_addr & 0x0000FF00 ) >> 8 );
+        from->data.ipv4[2] = (uint8_t) ( ( addr_ipv4->sin_addr.s_addr & 0x00FF0000 ) >> 16 );
+        from->data.ipv4[3] = (uint8_t) ( ( addr_ipv4->sin_addr.s_addr & 0xFF000000 ) >> 24 );
+        from->port = next_platform_ntohs( addr_ipv4->sin_port );
+        return true;
+    }
+    return false;
+}
+
+static int next_platform_socket_next_segment( next_platform_socket_t * socket, next_address_t * from, void * packet_data, int max_packet_size )
+{
+    // the next datagram of the last coalesced message. truncated like recvfrom if it doesn't fit
+
+    const int remaining = socket->gro_bytes - socket->gro_offset;
+    const int segment_bytes = ( remaining < socket->gro_segment_bytes ) ? remaining : socket->gro_segment_bytes;
+    const int bytes = ( segment_bytes < max_packet_size ) ? segment_bytes : max_packet_size;
+
+    memcpy( packet_data, socket->gro_buffer + socket->gro_offset, bytes );
+
+    *from = socket->gro_from;
+
+    socket->gro_offset += segment_bytes;
+
+    return bytes;
+}
+
+static int next_platform_socket_receive_segmented_packet( next_platform_socket_t * socket, next_address_t * from, void * packet_data, int max_packet_size )
+{
+    if ( socket->gro_offset < socket->gro_bytes )
+        return next_platform_socket_next_segment( socket, from, packet_data, max_packet_size );
+
+    sockaddr_storage sockaddr_from;
+    uint8_t control[CMSG_SPACE( sizeof(int) )];
+
+    iovec msg;
+    msg.iov_base = socket->gro_buffer;
+    msg.iov_len = NEXT_PLATFORM_GRO_MESSAGE_BYTES;
+
+    msghdr header;
+    memset( &header, 0, sizeof(header) );
+    header.msg_name = &sockaddr_from;
+    header.msg_namelen = sizeof( sockaddr_from );
+    header.msg_iov = &msg;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof( control );
+
+    int result = int( recvmsg( socket->handle, &header, socket->type == NEXT_PLATFORM_SOCKET_NON_BLOCKING ? MSG_DONTWAIT : 0 ) );
+
+    if ( result <= 0 )
+    {
+        if ( errno == EAGAIN || errno == EINTR )
+        {
+            return 0;
+        }
+
+        next_printf( NEXT_LOG_LEVEL_DEBUG, "recvmsg failed with error %d", errno );
+
+        return 0;
+    }
+
+    if ( !next_platform_socket_address_from_sockaddr( &sockaddr_from, &socket->gro_from ) )
+    {
+        next_assert( 0 );
+        return 0;
+    }
+
+    socket->gro_bytes = result;
+    socket->gro_offset = 0;
+    socket->gro_segment_bytes = result;
+
+    for ( cmsghdr * cmsg = CMSG_FIRSTHDR( &header ); cmsg; cmsg = CMSG_NXTHDR( &header, cmsg ) )
+    {
+        if ( cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO )
+        {
+            int gso_size;
+            memcpy( &gso_size, CMSG_DATA( cmsg ), sizeof(int) );
+            if ( gso_size > 0 )
+            {
+                socket->gro_segment_bytes = gso_size;
+            }
+        }
+    }
+
+    return next_platform_socket_next_segment( socket, from, packet_data, max_packet_size );
+}
+
 int next_platform_socket_receive_packet( next_platform_socket_t * socket, next_address_t * from, void * packet_data, int max_packet_size )
 {
     next_assert( socket );
@@ -488,6 +732,9 @@ int next_platform_socket_receive_packet( next_platform_socket_t * socket, next_a
     next_assert( packet_data );
     next_assert( max_packet_size > 0 );
 
+    if ( socket->gro_buffer )
+        return next_platform_socket_receive_segmented_packet( socket, from, packet_data, max_packet_size );
+
     sockaddr_storage sockaddr_from;
     socklen_t from_length = sizeof( sockaddr_from );
 
@@ -505,27 +752,7 @@ int next_platform_socket_receive_packet( next_platform_socket_t * socket, next_a
         return 0;
     }
 
-    if ( sockaddr_from.ss_family == AF_INET6 )
-    {
-        sockaddr_in6 * addr_ipv6 = (sockaddr_in6*) &sockaddr_from;
-        from->type = NEXT_ADDRESS_IPV6;
-        for ( int i = 0; i < 8; ++i )
-        {
-            from->data.ipv6[i] = next_platform_ntohs( ( (uint16_t*) &addr_ipv6->sin6_addr ) [i] );
-        }
-        from->port = next_platform_ntohs( addr_ipv6->sin6_port );
-    }
-    else if ( sockaddr_from.ss_family == AF_INET )
-    {
-        sockaddr_in * addr_ipv4 = (sockaddr_in*) &sockaddr_from;
-        from->type = NEXT_ADDRESS_IPV4;
-        from->data.ipv4[0] = (uint8_t) ( ( addr_ipv4->sin_addr.s_addr & 0x000000FF ) );
-        from->data.ipv4[1] = (uint8_t) ( ( addr_ipv4->sin_addr.s_addr & 0x0000FF00 ) >> 8 );
-        from->data.ipv4[2] = (uint8_t) ( ( addr_ipv4->sin_addr.s_addr & 0x00FF0000 ) >> 16 );
-        from->data.ipv4[3] = (uint8_t) ( ( addr_ipv4->sin_addr.s_addr & 0xFF000000 ) >> 24 );
-        from->port = next_platform_ntohs( addr_ipv4->sin_port );
-    }
-    else
+    if ( !next_platform_socket_address_from_sockaddr( &sockaddr_from, from ) )
     {
         next_assert( 0 );
         return 0;
@@ -536,6 +763,7 @@ int next_platform_socket_receive_packet( next_platform_socket_t * socket, next_a
     return result;
 }
 
+
 // ---------------------------------------------------
 
 next_platform_thread_t * next_platform_thread_create( void * context, next_platform_thread_func_t * thread_function, void * arg )
@@ -622,6 +850,66 @@ void next_platform_mutex_destroy( next_platform_mutex_t * mutex )
 
 // ---------------------------------------------------
 
+int next_platform_semaphore_create( next_platform_semaphore_t * semaphore )
+{
+    next_assert( semaphore );
+
+    memset( semaphore, 0, sizeof(next_platform_semaphore_t) );
+
+    if ( sem_init( &semaphore->handle, 0, 0 ) != 0 )
+        return NEXT_ERROR;
+
+    semaphore->ok = true;
+
+    return NEXT_OK;
+}
+
+void next_platform_semaphore_signal( next_platform_semaphore_t * semaphore )
+{
+    next_assert( semaphore );
+    next_assert( semaphore->ok );
+    sem_post( &semaphore->handle );
+}
+
+bool next_platform_semaphore_wait( next_platform_semaphore_t * semaphore, double timeout_seconds )
+{
+    next_assert( semaphore );
+    next_assert( semaphore->ok );
+
+    struct timespec deadline;
+    clock_gettime( CLOCK_REALTIME, &deadline );
+
+    const long long timeout_nanoseconds = (long long) ( timeout_seconds * 1000000000.0 );
+
+    deadline.tv_sec += time_t( timeout_nanoseconds / 1000000000 );
+    deadline.tv_nsec += long( timeout_nanoseconds % 1000000000 );
+    if ( deadline.tv_nsec >= 1000000000 )
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    while ( sem_timedwait( &semaphore->handle, &deadline ) != 0 )
+    {
+        if ( errno != EINTR )
+            return false;
+    }
+
+    return true;
+}
+
+void next_platform_semaphore_destroy( next_platform_semaphore_t * semaphore )
+{
+    next_assert( semaphore );
+    if ( semaphore->ok )
+    {
+        sem_destroy( &semaphore->handle );
+        memset( semaphore, 0, sizeof(next_platform_semaphore_t) );
+    }
+}
+
+// ---------------------------------------------------
+
 template <typename T> struct next_vector_t
 {
     T * data;
@@ -28,6 +28,7 @@
 #if NEXT_PLATFORM == NEXT_PLATFORM_LINUX
 
 #include <pthread.h>
+#include <semaphore.h>
 #include <unistd.h>
 #include <sched.h>
 
@@ -43,6 +44,12 @@ struct next_platform_socket_t
     void * context;
     int type;
     next_platform_socket_handle_t handle;
+    bool gso;
+    uint8_t * gro_buffer;
+    int gro_bytes;
+    int gro_offset;
+    int gro_segment_bytes;
+    next_address_t gro_from;
 };
 
 // -------------------------------------
@@ -71,6 +78,14 @@ struct next_platform_mutex_t
 
 // -------------------------------------
 
+struct next_platform_semaphore_t
+{
+    bool ok;
+    sem_t handle;
+};
+
+// -------------------------------------
+
 #endif // #if NEXT_PLATFORM == NEXT_PLATFORM_LINUX
 
 #endif // #ifndef NEXT_LINUX_H
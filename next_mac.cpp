@@ -394,6 +394,15 @@ next_platform_socket_t * next_platform_socket_create( void * context, next_addre
     return socket;
 }
 
+bool next_platform_socket_enable_segmentation( next_platform_socket_t * socket )
+{
+    // udp gso/gro is linux only
+
+    next_assert( socket );
+    (void) socket;
+    return false;
+}
+
 void next_platform_socket_destroy( next_platform_socket_t * socket )
 {
     next_assert( socket );
@@ -599,6 +608,47 @@ void next_platform_mutex_destroy( next_platform_mutex_t * mutex )
 
 // ---------------------------------------------------
 
+int next_platform_semaphore_create( next_platform_semaphore_t * semaphore )
+{
+    next_assert( semaphore );
+
+    memset( semaphore, 0, sizeof(next_platform_semaphore_t) );
+
+    semaphore->handle = dispatch_semaphore_create( 0 );
+    if ( !semaphore->handle )
+        return NEXT_ERROR;
+
+    semaphore->ok = true;
+
+    return NEXT_OK;
+}
+
+void next_platform_semaphore_signal( next_platform_semaphore_t * semaphore )
+{
+    next_assert( semaphore );
+    next_assert( semaphore->ok );
+    dispatch_semaphore_signal( semaphore->handle );
+}
+
+bool next_platform_semaphore_wait( next_platform_semaphore_t * semaphore, double timeout_seconds )
+{
+    next_assert( semaphore );
+    next_assert( semaphore->ok );
+    return dispatch_semaphore_wait( semaphore->handle, dispatch_time( DISPATCH_TIME_NOW, int64_t( timeout_seconds * 1000000000.0 ) ) ) == 0;
+}
+
+void next_platform_semaphore_destroy( next_platform_semaphore_t * semaphore )
+{
+    next_assert( semaphore );
+    if ( semaphore->ok )
+    {
+        dispatch_release( semaphore->handle );
+        memset( semaphore, 0, sizeof(next_platform_semaphore_t) );
+    }
+}
+
+// ---------------------------------------------------
+
 #else // #if NEXT_PLATFORM == NEXT_PLATFORM_MAC
 
 int next_mac_dummy_symbol = 0;
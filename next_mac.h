@@ -29,6 +29,7 @@
 
 #include <pthread.h>
 #include <unistd.h>
+#include <dispatch/dispatch.h>
 
 #define NEXT_PLATFORM_SOCKET_NON_BLOCKING       0
 #define NEXT_PLATFORM_SOCKET_BLOCKING           1
@@ -69,6 +70,14 @@ struct next_platform_mutex_t
 
 // -------------------------------------
 
+struct next_platform_semaphore_t
+{
+    bool ok;
+    dispatch_semaphore_t handle;
+};
+
+// -------------------------------------
+
 #endif // #if NEXT_PLATFORM == NEXT_PLATFORM_MAC
 
 #endif // #ifndef NEXT_MAC_H
\ No newline at end of file
@@ -184,6 +184,47 @@ void next_platform_mutex_destroy( next_platform_mutex_t * mutex )
 	}
 }
 
+// semaphore
+
+int next_platform_semaphore_create( next_platform_semaphore_t * semaphore )
+{
+    next_assert( semaphore );
+
+    memset( semaphore, 0, sizeof(next_platform_semaphore_t) );
+
+    semaphore->handle = CreateSemaphore( NULL, 0, 0x7FFFFFFF, NULL );
+    if ( semaphore->handle == NULL )
+        return NEXT_ERROR;
+
+    semaphore->ok = true;
+
+    return NEXT_OK;
+}
+
+void next_platform_semaphore_signal( next_platform_semaphore_t * semaphore )
+{
+    next_assert( semaphore );
+    next_assert( semaphore->ok );
+    ReleaseSemaphore( semaphore->handle, 1, NULL );
+}
+
+bool next_platform_semaphore_wait( next_platform_semaphore_t * semaphore, double timeout_seconds )
+{
+    next_assert( semaphore );
+    next_assert( semaphore->ok );
+    return WaitForSingleObject( semaphore->handle, DWORD( timeout_seconds * 1000.0 ) ) == WAIT_OBJECT_0;
+}
+
+void next_platform_semaphore_destroy( next_platform_semaphore_t * semaphore )
+{
+    next_assert( semaphore );
+    if ( semaphore->ok )
+    {
+        CloseHandle( semaphore->handle );
+        memset( semaphore, 0, sizeof(next_platform_semaphore_t) );
+    }
+}
+
 // time
 
 void next_platform_sleep( double time )
@@ -496,6 +537,15 @@ next_platform_socket_t * next_platform_socket_create( void * context, next_addre
     return s;
 }
 
+bool next_platform_socket_enable_segmentation( next_platform_socket_t * socket )
+{
+    // udp gso/gro is linux only
+
+    next_assert( socket );
+    (void) socket;
+    return false;
+}
+
 void next_platform_socket_destroy( next_platform_socket_t * socket )
 {
     next_assert( socket );
@@ -28,6 +28,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <time.h>
 #include "next.h"
 
 const char * next_bind_address = "0.0.0.0:60000";
@@ -60,6 +61,7 @@ const char * next_customer_private_key = "87imaWGyq+JSNpzHRsFS1mX4Y5xlHi8IduJDfJ
 #define NEXT_ROUTE_UPDATE_ACK_PACKET                                   19
 #define NEXT_RELAY_PING_PACKET                                         20
 #define NEXT_RELAY_PONG_PACKET                                         21
+#define NEXT_DOORBELL_PACKET                                          253
 #define NEXT_FORWARD_PACKET_TO_CLIENT                                 254
 
 //#define debug_printf printf
@@ -95,6 +97,19 @@ void proxy_read_int_env( const char * env, int * value )
 	}
 }
 
+void proxy_read_string_env( const char * env, char * value, int value_size )
+{
+	assert( env );
+	assert( value );
+	assert( value_size > 0 );
+	const char * env_string = proxy_platform_getenv( env );
+	if ( env_string )
+	{
+		strncpy( value, env_string, size_t( value_size - 1 ) );
+		value[value_size-1] = '\0';
+	}
+}
+
 void proxy_read_address_env( const char * env, proxy_address_t * address )
 {
 	assert( env );
@@ -118,9 +133,18 @@ struct proxy_config_t
 	int next_base_port;
 	int max_packet_size;
 	int proxy_thread_data_bytes;
-	int slot_thread_data_bytes;
 	int next_thread_data_bytes;	
     int slot_timeout_seconds;
+    int slot_evict_lru;
+    int rebalance_interval_seconds;
+    int rebalance_threshold_percent;
+    int cpu_placement;
+    int io_uring;
+    int udp_segmentation;
+    int slot_connect;
+    int tunnel;
+    char xdp_interface[64];
+    int xdp_driver_mode;
     int socket_send_buffer_size;
     int socket_receive_buffer_size;
     proxy_address_t slot_bind_address;
@@ -151,11 +175,28 @@ bool proxy_init()
 	config.max_packet_size = 1500;
 
 	config.proxy_thread_data_bytes = 1 * 1024 * 1024;
-	config.slot_thread_data_bytes = 1 * 1024 * 1024;
 	config.next_thread_data_bytes = 1 * 1024 * 1024;
 
 	config.slot_timeout_seconds = 60;
 
+	config.slot_evict_lru = 0;
+
+	config.rebalance_interval_seconds = 10;
+	config.rebalance_threshold_percent = 25;
+
+	config.cpu_placement = 0;
+
+	config.io_uring = 0;
+
+	config.udp_segmentation = 0;
+
+	config.slot_connect = 1;
+
+	config.tunnel = 0;
+
+	config.xdp_interface[0] = '\0';
+	config.xdp_driver_mode = 0;
+
 	config.slot_base_port = 10000;
 
 	memset( &config.slot_bind_address, 0, sizeof(proxy_address_t) );
@@ -187,6 +228,16 @@ bool proxy_init()
 
 	proxy_read_int_env( "NUM_THREADS", &config.num_threads );
 	proxy_read_int_env( "NUM_SLOTS_PER_THREAD", &config.num_slots_per_thread );
+	proxy_read_int_env( "SLOT_EVICT_LRU", &config.slot_evict_lru );
+	proxy_read_int_env( "REBALANCE_INTERVAL_SECONDS", &config.rebalance_interval_seconds );
+	proxy_read_int_env( "REBALANCE_THRESHOLD_PERCENT", &config.rebalance_threshold_percent );
+	proxy_read_int_env( "CPU_PLACEMENT", &config.cpu_placement );
+	proxy_read_int_env( "IO_URING", &config.io_uring );
+	proxy_read_int_env( "UDP_SEGMENTATION", &config.udp_segmentation );
+	proxy_read_int_env( "SLOT_CONNECT", &config.slot_connect );
+	proxy_read_int_env( "TUNNEL", &config.tunnel );
+	proxy_read_string_env( "XDP_INTERFACE", config.xdp_interface, sizeof(config.xdp_interface) );
+	proxy_read_int_env( "XDP_DRIVER_MODE", &config.xdp_driver_mode );
 
 	proxy_read_address_env( "PROXY_ADDRESS", &config.proxy_address );
 	proxy_read_address_env( "SERVER_ADDRESS", &config.server_address );
@@ -307,10 +358,20 @@ extern void proxy_platform_socket_destroy( proxy_platform_socket_t * socket );
 
 extern void proxy_platform_socket_close( proxy_platform_socket_t * socket );
 
+extern bool proxy_platform_socket_connect( proxy_platform_socket_t * socket, const proxy_address_t * address );
+
+extern void proxy_platform_socket_disconnect( proxy_platform_socket_t * socket );
+
 extern void proxy_platform_socket_send_packet( proxy_platform_socket_t * socket, const proxy_address_t * to, const void * packet_data, int packet_bytes );
 
+extern void proxy_platform_socket_send_packets( proxy_platform_socket_t * socket, const proxy_address_t * to, void ** packet_data, int * packet_bytes, int num_packets );
+
 extern int proxy_platform_socket_receive_packet( proxy_platform_socket_t * socket, proxy_address_t * from, void * packet_data, int max_packet_size );
 
+extern int proxy_platform_socket_receive_packets( proxy_platform_socket_t * socket, proxy_address_t * from, uint8_t ** packet_data, int * packet_bytes, int max_packet_size, int max_packets );
+
+extern bool proxy_platform_socket_steer( proxy_platform_socket_t * socket, const int * bucket_threads, int num_buckets, int cpu_sockets );
+
 extern int proxy_platform_id();
 
 extern int proxy_platform_connection_type();
@@ -327,6 +388,60 @@ extern bool proxy_platform_thread_high_priority( proxy_platform_thread_t * threa
 
 extern bool proxy_platform_thread_affinity( proxy_platform_thread_t * thread, int core );
 
+extern bool proxy_platform_memory_bind_local( void * data, size_t bytes );
+
+extern void * proxy_platform_memory_alloc_pages( size_t bytes );
+
+extern void proxy_platform_memory_free_pages( void * data, size_t bytes );
+
+extern proxy_platform_poll_t * proxy_platform_poll_create( int max_sockets );
+
+extern void proxy_platform_poll_destroy( proxy_platform_poll_t * poll );
+
+extern bool proxy_platform_poll_add( proxy_platform_poll_t * poll, proxy_platform_socket_t * socket, uint64_t id );
+
+extern bool proxy_platform_poll_add_event( proxy_platform_poll_t * poll, proxy_platform_event_t * event, uint64_t id );
+
+extern int proxy_platform_poll_wait( proxy_platform_poll_t * poll, uint64_t * ready_ids, int max_ready, float timeout_seconds );
+
+extern proxy_platform_uring_t * proxy_platform_uring_create( int max_sockets, int num_buffers, int max_packet_size, int num_send_buffers );
+
+extern void proxy_platform_uring_destroy( proxy_platform_uring_t * uring );
+
+extern bool proxy_platform_uring_add( proxy_platform_uring_t * uring, proxy_platform_socket_t * socket, uint64_t id );
+
+extern bool proxy_platform_uring_add_event( proxy_platform_uring_t * uring, proxy_platform_event_t * event, uint64_t id );
+
+extern int proxy_platform_uring_wait( proxy_platform_uring_t * uring, uint64_t * ids, proxy_address_t * from, uint8_t ** packet_data, int * packet_bytes, int max_packets, float timeout_seconds );
+
+extern void proxy_platform_uring_recycle( proxy_platform_uring_t * uring );
+
+extern void proxy_platform_uring_send_packets( proxy_platform_uring_t * uring, proxy_platform_socket_t * socket, const proxy_address_t * to, void ** packet_data, int * packet_bytes, int num_packets );
+
+extern void proxy_platform_uring_submit( proxy_platform_uring_t * uring );
+
+extern proxy_platform_xdp_t * proxy_platform_xdp_create( const char * interface_name, bool driver_mode, uint16_t proxy_port, const proxy_address_t * server_address, int slot_base_port, int num_slots );
+
+extern void proxy_platform_xdp_destroy( proxy_platform_xdp_t * xdp );
+
+extern bool proxy_platform_xdp_slot_set( proxy_platform_xdp_t * xdp, int slot, const proxy_address_t * client_address );
+
+extern bool proxy_platform_xdp_client_set( proxy_platform_xdp_t * xdp, const proxy_address_t * client_address, int slot );
+
+extern double proxy_platform_xdp_slot_idle_seconds( proxy_platform_xdp_t * xdp, int slot );
+
+extern void proxy_platform_xdp_counters( proxy_platform_xdp_t * xdp, uint64_t * packets_to_server, uint64_t * packets_to_client );
+
+extern bool proxy_platform_network_namespace_create();
+
+extern proxy_platform_event_t * proxy_platform_event_create();
+
+extern void proxy_platform_event_destroy( proxy_platform_event_t * event );
+
+extern void proxy_platform_event_signal( proxy_platform_event_t * event );
+
+extern void proxy_platform_event_clear( proxy_platform_event_t * event );
+
 extern bool proxy_platform_mutex_create( proxy_platform_mutex_t * mutex );
 
 extern void proxy_platform_mutex_acquire( proxy_platform_mutex_t * mutex );
@@ -589,14 +704,61 @@ uint64_t proxy_fnv_finalize( proxy_fnv_t * fnv )
     return *fnv;
 }
 
+// keyed hash from the next sdk. the key is random per process, so clients cannot pick addresses that collide
+
+extern bool next_hash_key_init();
+
+extern uint64_t next_hash_words( const uint64_t * words, int num_words );
+
 uint64_t hash_address( const proxy_address_t * key )
 {
 	assert( key );
-    proxy_fnv_t fnv;
-    proxy_fnv_init( &fnv );
-    proxy_fnv_write( &fnv, (const uint8_t*) &key->port, 2 );
-    proxy_fnv_write( &fnv, (const uint8_t*) &key->data.ipv4, 4 );
-    return proxy_fnv_finalize( &fnv );
+
+	uint64_t words[3];
+
+	words[0] = ( uint64_t( key->type ) << 48 ) | ( uint64_t( key->port ) << 32 );
+
+    if ( key->type == PROXY_ADDRESS_IPV6 )
+    {
+    	words[1] = ( uint64_t( key->data.ipv6[0] ) << 48 ) | ( uint64_t( key->data.ipv6[1] ) << 32 ) | ( uint64_t( key->data.ipv6[2] ) << 16 ) | uint64_t( key->data.ipv6[3] );
+    	words[2] = ( uint64_t( key->data.ipv6[4] ) << 48 ) | ( uint64_t( key->data.ipv6[5] ) << 32 ) | ( uint64_t( key->data.ipv6[6] ) << 16 ) | uint64_t( key->data.ipv6[7] );
+    	return next_hash_words( words, 3 );
+    }
+
+	words[0] |= ( uint64_t( key->data.ipv4[0] ) << 24 ) | ( uint64_t( key->data.ipv4[1] ) << 16 ) | ( uint64_t( key->data.ipv4[2] ) << 8 ) | uint64_t( key->data.ipv4[3] );
+
+	return next_hash_words( words, 1 );
+}
+
+int proxy_thread_for_address( const proxy_address_t * address )
+{
+	// picks the thread socket that replies to this client. multiply shift instead of a 64 bit divide per packet
+
+	return int( ( ( hash_address( address ) >> 32 ) * uint64_t( config.num_threads ) ) >> 32 );
+}
+
+/*
+	Client addresses fold into steering buckets. Each bucket is either left to the kernel's reuseport hash, or owned by
+	one proxy thread, and the reuseport steering program sends the bucket's packets to that thread's socket. The fold
+	must match the program in proxy_platform_socket_steer, which only sees ipv4, so ipv6 clients are never steered.
+*/
+
+#define PROXY_STEERING_BUCKETS                                        256
+
+int proxy_steering_bucket( const proxy_address_t * address )
+{
+	assert( address );
+
+	if ( address->type != PROXY_ADDRESS_IPV4 )
+		return -1;
+
+	uint32_t x = ( uint32_t( address->data.ipv4[0] ) << 24 ) | ( uint32_t( address->data.ipv4[1] ) << 16 ) | ( uint32_t( address->data.ipv4[2] ) << 8 ) | uint32_t( address->data.ipv4[3] );
+
+	x ^= address->port;
+	x ^= x >> 16;
+	x ^= x >> 8;
+
+	return int( x & ( PROXY_STEERING_BUCKETS - 1 ) );
 }
 
 // ---------------------------------------------------------------------
@@ -786,247 +948,291 @@ bool proxy_advanced_packet_filter( const uint8_t * data, const uint8_t * magic,
 
 // ---------------------------------------------------------------------
 
-#define SESSION_TABLE_CAPACITY 4096	// must be power of 2
+#define PROXY_RING_SIZE                                              1024
 
-struct session_table_entry_t 
+struct proxy_ring_entry_t
 {
-    proxy_address_t key;
-    uint64_t sequence;
-    int value;
+	int packet_bytes;
+	int slot;
+	uint32_t session_handle;
+	proxy_address_t address;
 };
 
-struct session_table_t 
+struct proxy_ring_t
 {
-    session_table_entry_t * entries[2];
-    session_table_entry_t * current_entries;
-    session_table_entry_t * previous_entries;
-    int entries_index;
-    uint64_t current_sequence;
-    uint64_t previous_sequence;
+	uint64_t write_index;
+	uint8_t write_padding[64 - sizeof(uint64_t)];
+	uint64_t read_index;
+	uint8_t read_padding[64 - sizeof(uint64_t)];
+	int entry_bytes;
+	int max_packet_bytes;
+	uint8_t * entries;
 };
 
-session_table_t * session_table_create() 
+proxy_ring_t * proxy_ring_create( int max_packet_bytes )
 {
-    session_table_t * table = (session_table_t*) calloc( 1, sizeof(session_table_t) );
-    if ( table == NULL) 
-        return NULL;
-    table->entries[0] = (session_table_entry_t*) calloc( SESSION_TABLE_CAPACITY, sizeof( session_table_entry_t ) );
-    table->entries[1] = (session_table_entry_t*) calloc( SESSION_TABLE_CAPACITY, sizeof( session_table_entry_t ) );
-    if ( table->entries[0] == NULL || table->entries[1] == NULL ) 
-    {
-	    free( table->entries[0] );
-	    free( table->entries[1] );
-        free( table );
-        return NULL;
-    }
-    table->current_entries = table->entries[0];
-    table->previous_entries = table->entries[1];
-    return table;
-}
+	proxy_ring_t * ring = (proxy_ring_t*) calloc( 1, sizeof(proxy_ring_t) );
+	if ( !ring )
+		return NULL;
+
+	ring->max_packet_bytes = max_packet_bytes;
+	ring->entry_bytes = ( int( sizeof(proxy_ring_entry_t) ) + max_packet_bytes + 63 ) & ~63;
+	ring->entries = (uint8_t*) malloc( size_t(ring->entry_bytes) * PROXY_RING_SIZE );
+	if ( !ring->entries )
+	{
+		free( ring );
+		return NULL;
+	}
 
-void session_table_destroy( session_table_t * table )
-{
-	assert( table );
-    free( table->entries[0] );
-    free( table->entries[1] );
-    free( table );
+	return ring;
 }
 
-void session_table_swap( session_table_t * table )
+void proxy_ring_destroy( proxy_ring_t * ring )
 {
-	assert( table );
-	table->entries_index = ( table->entries_index + 1 ) % 2;
-	table->previous_entries = table->current_entries;
-	table->current_entries = table->entries[table->entries_index];
-	table->previous_sequence = table->current_sequence;
-	table->current_sequence++;
+	assert( ring );
+	free( ring->entries );
+	free( ring );
 }
 
-void session_table_insert( session_table_t * table, const proxy_address_t * key, int value )
-{
-	// IMPORTANT: key must not already exist in table
+// producer side. returns false if the ring is full and the packet was dropped
 
-	assert( table );
+bool proxy_ring_push( proxy_ring_t * ring, const proxy_ring_entry_t * header, const uint8_t * packet_data, int packet_bytes )
+{
+	assert( ring );
+	assert( header );
+	assert( packet_data );
+	assert( packet_bytes > 0 );
+	assert( packet_bytes <= ring->max_packet_bytes );
 
-    uint64_t hash = hash_address( key );
+	const uint64_t write_index = ring->write_index;
+	const uint64_t read_index = __atomic_load_n( &ring->read_index, __ATOMIC_ACQUIRE );
 
-    const uint64_t mask = (uint64_t)( SESSION_TABLE_CAPACITY - 1 );
+	if ( write_index - read_index >= PROXY_RING_SIZE )
+		return false;
 
-    size_t index = (size_t) ( hash & mask );
+	uint8_t * entry_data = ring->entries + size_t( write_index % PROXY_RING_SIZE ) * ring->entry_bytes;
+	proxy_ring_entry_t * entry = (proxy_ring_entry_t*) entry_data;
+	*entry = *header;
+	entry->packet_bytes = packet_bytes;
+	memcpy( entry_data + sizeof(proxy_ring_entry_t), packet_data, packet_bytes );
 
-    while ( table->current_entries[index].key.type == PROXY_ADDRESS_IPV4 && table->current_entries[index].sequence == table->current_sequence ) 
-    {
-        index ++;
-        index &= mask;
-	}
+	__atomic_store_n( &ring->write_index, write_index + 1, __ATOMIC_RELEASE );
 
-    table->current_entries[index].key = *key;
-    table->current_entries[index].value = value;
-    table->current_entries[index].sequence = table->current_sequence;
+	return true;
 }
 
-int session_table_get( session_table_t * table, const proxy_address_t * key ) 
+bool proxy_ring_full( proxy_ring_t * ring )
 {
-	assert( table );
+	assert( ring );
+	return ring->write_index - __atomic_load_n( &ring->read_index, __ATOMIC_ACQUIRE ) >= PROXY_RING_SIZE;
+}
 
-    uint64_t hash = hash_address( key );
+// consumer side. entries stay valid until popped, packet data follows the entry header
+
+int proxy_ring_count( proxy_ring_t * ring )
+{
+	assert( ring );
+	return int( __atomic_load_n( &ring->write_index, __ATOMIC_ACQUIRE ) - ring->read_index );
+}
 
-    const uint64_t mask = (uint64_t)( SESSION_TABLE_CAPACITY - 1 );
+proxy_ring_entry_t * proxy_ring_peek( proxy_ring_t * ring )
+{
+	assert( ring );
+	if ( ring->read_index == __atomic_load_n( &ring->write_index, __ATOMIC_ACQUIRE ) )
+		return NULL;
+	return (proxy_ring_entry_t*) ( ring->entries + size_t( ring->read_index % PROXY_RING_SIZE ) * ring->entry_bytes );
+}
 
-    size_t index = (size_t) ( hash & mask );
+void proxy_ring_pop( proxy_ring_t * ring )
+{
+	assert( ring );
+	assert( ring->read_index != ring->write_index );
+	__atomic_store_n( &ring->read_index, ring->read_index + 1, __ATOMIC_RELEASE );
+}
 
-    // first search current table
+// waiting flags let a consumer park on its wakeup primitive. producers only pay for a wakeup when the consumer is parked
 
-    while ( table->current_entries[index].sequence == table->current_sequence && table->current_entries[index].key.type == PROXY_ADDRESS_IPV4 ) 
-    {
-        if ( proxy_address_equal( key, &table->current_entries[index].key ) )
-        {
-        	return table->current_entries[index].value;
-        }
+bool proxy_consumer_park( uint32_t * waiting, proxy_ring_t ** rings, int num_rings )
+{
+	__atomic_store_n( waiting, 1, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_SEQ_CST );
+	for ( int i = 0; i < num_rings; ++i )
+	{
+		if ( proxy_ring_count( rings[i] ) != 0 )
+		{
+			__atomic_store_n( waiting, 0, __ATOMIC_RELAXED );
+			return false;
+		}
+	}
+	return true;
+}
 
-        index ++;
-        index &= mask;
-    }
+bool proxy_producer_should_wake( uint32_t * waiting )
+{
+	__atomic_thread_fence( __ATOMIC_SEQ_CST );
+	return __atomic_load_n( waiting, __ATOMIC_RELAXED ) != 0 && __atomic_exchange_n( waiting, 0, __ATOMIC_ACQ_REL ) != 0;
+}
 
-    // fall back to previous table (these are entries about to time out on next swap if they aren't in current)
+// ---------------------------------------------------------------------
 
-    index = (size_t) ( hash & mask );
+// timer wheel from the next sdk. timers are slot indices, and fire on the first advance at or after their deadline
 
-    while ( table->previous_entries[index].sequence == table->previous_sequence && table->previous_entries[index].key.type == PROXY_ADDRESS_IPV4 ) 
-    {
-        if ( proxy_address_equal( key, &table->previous_entries[index].key ) )
-        {
-        	int value = table->previous_entries[index].value;
-        	session_table_insert( table, key, value );
-        	return value;
-        }
+struct next_timer_wheel_t;
 
-        index ++;
-        index &= mask;
-    }
+extern next_timer_wheel_t * next_timer_wheel_create( void * context, int max_timers, double resolution, double current_time );
+extern void next_timer_wheel_destroy( next_timer_wheel_t * wheel );
+extern void next_timer_wheel_schedule( next_timer_wheel_t * wheel, int timer, double time );
+extern void next_timer_wheel_advance( next_timer_wheel_t * wheel, double current_time );
+extern int next_timer_wheel_pop( next_timer_wheel_t * wheel );
 
-    return -1;
-}
+#define PROXY_SLOT_TIMER_RESOLUTION 0.1
 
-bool session_table_update( session_table_t * table, const proxy_address_t * key, int value )
+static void proxy_check_handler( const char * condition, const char * function, const char * file, int line )
 {
-	int existing_value = session_table_get( table, key );
-	if ( existing_value >= 0 )
-		return false;
-	session_table_insert( table, key, value );
-	return true;
+    printf( "check failed: ( %s ), function %s, file %s, line %d\n", condition, function, file, line );
+    fflush( stdout );
+#ifndef NDEBUG
+    __builtin_trap();
+#endif
+    exit( 1 );
 }
 
-void test_session_table()
+#define proxy_check( condition )                                                                            \
+do                                                                                                          \
+{                                                                                                           \
+    if ( !(condition) )                                                                                     \
+    {                                                                                                       \
+        proxy_check_handler( #condition, (const char*) __FUNCTION__, (const char*) __FILE__, __LINE__ );    \
+    }                                                                                                       \
+} while(0)
+
+extern void next_hash_get_key( uint64_t key[2] );
+
+extern void next_hash_set_key( const uint64_t key[2] );
+
+void test_ring()
 {
-	printf( "    test_session_table\n" );
+	printf( "    test_ring\n" );
 
-	session_table_t * session_table = session_table_create();
+	const int MaxPacketBytes = 100;
 
-	const int NumAddresses = 100;
+	proxy_ring_t * ring = proxy_ring_create( MaxPacketBytes );
 
-	// add some addresses
+	proxy_check( ring );
+	proxy_check( proxy_ring_count( ring ) == 0 );
+	proxy_check( proxy_ring_peek( ring ) == NULL );
 
-	proxy_address_t address_a[NumAddresses];
+	uint8_t packet_data[MaxPacketBytes];
 
-	for ( int i = 0; i < NumAddresses; ++i ) 
-	{
-		char buffer[1024];
-		sprintf( buffer, "127.0.0.1:%d", 50000 + i );
-		proxy_address_parse( &address_a[i], buffer );
-	}
+	// fill the ring, then verify the next push is dropped
 
-	for ( int i = 0; i < NumAddresses; ++i ) 
+	for ( int i = 0; i < PROXY_RING_SIZE; ++i )
 	{
-		session_table_insert( session_table, &address_a[i], i );
+		proxy_ring_entry_t header;
+		memset( &header, 0, sizeof(header) );
+		header.slot = i;
+		memset( packet_data, uint8_t(i), sizeof(packet_data) );
+		proxy_check( proxy_ring_push( ring, &header, packet_data, 1 + ( i % MaxPacketBytes ) ) );
 	}
 
-	// verify these addresses are in the table
+	proxy_check( proxy_ring_count( ring ) == PROXY_RING_SIZE );
 
-	for ( int i = 0; i < NumAddresses; ++i )
 	{
-		assert( session_table_get( session_table, &address_a[i] ) == i );
+		proxy_ring_entry_t header;
+		memset( &header, 0, sizeof(header) );
+		proxy_check( !proxy_ring_push( ring, &header, packet_data, 1 ) );
 	}
 
-	// swap the table and verify the addesses are still there
+	// drain half, push more so the indices wrap around, then drain everything in order
 
-	session_table_swap( session_table );
+	int next_read = 0;
+	int next_write = PROXY_RING_SIZE;
 
-	for ( int i = 0; i < NumAddresses; ++i )
+	for ( int i = 0; i < PROXY_RING_SIZE / 2; ++i )
 	{
-		assert( session_table_get( session_table, &address_a[i] ) == i );
+		proxy_ring_entry_t * entry = proxy_ring_peek( ring );
+		proxy_check( entry );
+		proxy_check( entry->slot == next_read );
+		proxy_check( entry->packet_bytes == 1 + ( next_read % MaxPacketBytes ) );
+		const uint8_t * entry_data = (const uint8_t*) ( entry + 1 );
+		proxy_check( entry_data[0] == uint8_t(next_read) );
+		proxy_check( entry_data[entry->packet_bytes-1] == uint8_t(next_read) );
+		proxy_ring_pop( ring );
+		next_read++;
 	}
 
-	// add a second set of addresses and verify that both sets of addresses are there
-
-	proxy_address_t address_b[NumAddresses];
-
-	for ( int i = 0; i < NumAddresses; ++i ) 
+	for ( int i = 0; i < PROXY_RING_SIZE / 2; ++i )
 	{
-		char buffer[1024];
-		sprintf( buffer, "127.0.0.1:%d", 60000 + i );
-		proxy_address_parse( &address_b[i], buffer );
-		session_table_insert( session_table, &address_b[i], i );
+		proxy_ring_entry_t header;
+		memset( &header, 0, sizeof(header) );
+		header.slot = next_write;
+		memset( packet_data, uint8_t(next_write), sizeof(packet_data) );
+		proxy_check( proxy_ring_push( ring, &header, packet_data, 1 + ( next_write % MaxPacketBytes ) ) );
+		next_write++;
 	}
 
-	for ( int i = 0; i < NumAddresses; ++i )
+	proxy_check( proxy_ring_count( ring ) == PROXY_RING_SIZE );
+
+	while ( proxy_ring_peek( ring ) )
 	{
-		assert( session_table_get( session_table, &address_a[i] ) == i );
-		assert( session_table_get( session_table, &address_b[i] ) == i );
+		proxy_ring_entry_t * entry = proxy_ring_peek( ring );
+		proxy_check( entry->slot == next_read );
+		proxy_check( entry->packet_bytes == 1 + ( next_read % MaxPacketBytes ) );
+		const uint8_t * entry_data = (const uint8_t*) ( entry + 1 );
+		proxy_check( entry_data[entry->packet_bytes-1] == uint8_t(next_read) );
+		proxy_ring_pop( ring );
+		next_read++;
 	}
 
-	// swap again and both address sets should be there still
+	proxy_check( next_read == next_write );
+	proxy_check( proxy_ring_count( ring ) == 0 );
+
+	// consumer parks only when every ring is empty, and producers wake it exactly once
 
-	session_table_swap( session_table );
+	uint32_t waiting = 0;
+
+	proxy_check( proxy_consumer_park( &waiting, &ring, 1 ) );
+	proxy_check( waiting == 1 );
+	proxy_check( proxy_producer_should_wake( &waiting ) );
+	proxy_check( !proxy_producer_should_wake( &waiting ) );
 
-	for ( int i = 0; i < NumAddresses; ++i )
 	{
-		assert( session_table_get( session_table, &address_a[i] ) == i );
-		assert( session_table_get( session_table, &address_b[i] ) == i );
+		proxy_ring_entry_t header;
+		memset( &header, 0, sizeof(header) );
+		proxy_check( proxy_ring_push( ring, &header, packet_data, 1 ) );
 	}
 
-	// swap twice and verify that both sets of addresses are gone
+	proxy_check( !proxy_consumer_park( &waiting, &ring, 1 ) );
+	proxy_check( waiting == 0 );
 
-	session_table_swap( session_table );
-	session_table_swap( session_table );
+	proxy_ring_destroy( ring );
+}
 
-	for ( int i = 0; i < NumAddresses; ++i )
-	{
-		assert( session_table_get( session_table, &address_a[i] ) == -1 );
-		assert( session_table_get( session_table, &address_b[i] ) == -1 );
-	}
+extern void next_tests();
 
-	// add addresses again and verify they are there
+void test_slot_allocator();
 
-	for ( int i = 0; i < NumAddresses; ++i ) 
-	{
-		session_table_insert( session_table, &address_a[i], i );
-		session_table_insert( session_table, &address_b[i], i );
-	}
+void test_slot_pool();
 
-	for ( int i = 0; i < NumAddresses; ++i )
-	{
-		assert( session_table_get( session_table, &address_a[i] ) == i );
-		assert( session_table_get( session_table, &address_b[i] ) == i );
-	}
+void test_steering();
 
-	// swap twice again and verify they are removed
+void test_uring();
 
-	session_table_swap( session_table );
-	session_table_swap( session_table );
+void test_xdp();
 
-	for ( int i = 0; i < NumAddresses; ++i )
-	{
-		assert( session_table_get( session_table, &address_a[i] ) == -1 );
-		assert( session_table_get( session_table, &address_b[i] ) == -1 );
-	}
+void test_udp_segmentation();
 
-	// clean up
+void test_slot_connect();
 
-	session_table_destroy( session_table );
-}
+void test_tunnel();
 
-extern void next_tests();
+void test_session_handle();
+
+void test_session_directory();
+
+void test_packet_pool();
+
+void test_memory_pages();
 
 void run_tests()
 {
@@ -1046,404 +1252,4570 @@ void run_tests()
 
     next_test();
 
-    test_session_table();
-
-    next_term();
-}
-
-// ---------------------------------------------------------------------
+    test_ring();
 
-struct next_platform_socket_t;
+    test_slot_allocator();
 
-extern void next_platform_socket_send_packet( next_platform_socket_t * socket, const next_address_t * to, const void * packet_data, int packet_bytes );
+    test_slot_pool();
 
-struct slot_thread_data_t
-{
-	int thread_number;
-	int slot_number;
-	proxy_platform_thread_t * thread;
-	proxy_platform_socket_t * socket;
-	proxy_platform_socket_t ** thread_sockets;
-	next_platform_socket_t * next_socket;
+    test_steering();
 
-	// protected by mutex
-	proxy_platform_mutex_t mutex;
-	bool allocated;
-	bool next;
-	proxy_address_t client_address;
-};
+    test_uring();
 
-static proxy_platform_thread_return_t PROXY_PLATFORM_THREAD_FUNC slot_thread_function( void * data )
-{
-	slot_thread_data_t * thread_data = (slot_thread_data_t*) data;
+    test_xdp();
 
-	debug_printf( "proxy thread %d slot thread %d started\n", thread_data->thread_number, thread_data->slot_number );
+    test_udp_segmentation();
 
-	assert( thread_data->socket );
+    test_slot_connect();
 
-	for ( int i = 0; i < config.num_threads; ++i )
-	{
-		assert( thread_data->thread_sockets[i] != NULL );
-	}
+    test_tunnel();
 
-    char string_buffer[1024];
-    
-    (void) string_buffer;
+    test_session_handle();
 
-	while ( true )
-	{
-		const int prefix = 11;
+    test_session_directory();
 
-		uint8_t buffer[prefix + config.max_packet_size];
+    test_packet_pool();
 
-		proxy_address_t from;
+    test_memory_pages();
 
-		int packet_bytes = proxy_platform_socket_receive_packet( thread_data->socket, &from, buffer + prefix, config.max_packet_size );
+    next_term();
+}
 
-		if ( packet_bytes < 0 )
-			break;
-		
-		if ( packet_bytes == 0 )
-			continue;
+void bench_session_directory();
 
-		uint8_t * packet_data = buffer + prefix;
+void bench_socket_backend();
 
-		proxy_platform_mutex_acquire( &thread_data->mutex );
-		bool allocated = thread_data->allocated;
-		bool next = thread_data->next;
-		proxy_address_t client_address = thread_data->client_address;
-		proxy_platform_mutex_release( &thread_data->mutex );
+void bench_udp_segmentation();
 
-		if ( allocated )
-		{
-			if ( !next )
-			{
-				// forward packet to client as passthrough packet
+void run_benchmarks()
+{
+	next_quiet( true );
 
-				debug_printf( "proxy thread %d forwarded %d byte packet to client for slot %d (%s)\n", thread_data->thread_number, packet_bytes + 1, thread_data->slot_number, proxy_address_to_string( &client_address, string_buffer ) );
+    next_config_t next_config;
+    next_default_config( &next_config );
+    strncpy( next_config.server_backend_hostname, next_backend_hostname, sizeof(next_config.server_backend_hostname) - 1 );
+    strncpy( next_config.customer_private_key, next_customer_private_key, sizeof(next_config.customer_private_key) - 1 );
+    next_config.high_priority_threads = false;
 
-				packet_data -= 1;
-				packet_bytes += 1;
+    if ( next_init( NULL, &next_config ) != NEXT_OK )
+    {
+        printf( "error: could not initialize network next\n" );
+        exit(1);
+    }
 
-	            packet_data[0] = NEXT_PASSTHROUGH_PACKET;
-				uint64_t hash = hash_address( &client_address );
-				int index = hash % config.num_threads;
-				proxy_platform_socket_send_packet( thread_data->thread_sockets[index], &client_address, packet_data, packet_bytes );
-			}
-			else
-			{
-				// forward packet to client through next server
-
-	            buffer[0] = NEXT_FORWARD_PACKET_TO_CLIENT;
-	            buffer[1] = client_address.data.ipv4[0];
-	            buffer[2] = client_address.data.ipv4[1];
-	            buffer[3] = client_address.data.ipv4[2];
-	            buffer[4] = client_address.data.ipv4[3];
-	            buffer[5] = uint8_t( client_address.port >> 8 );
-	            buffer[6] = uint8_t( client_address.port );
-	            buffer[7] = uint8_t( thread_data->thread_number >> 8 );
-	            buffer[8] = uint8_t( thread_data->thread_number );
-	            buffer[9] = uint8_t( thread_data->slot_number >> 8 );
-	            buffer[10] = uint8_t( thread_data->slot_number );
-
-	            packet_data = buffer;
-	            packet_bytes += prefix;
-
-				next_platform_socket_send_packet( thread_data->next_socket, (next_address_t*) &config.next_local_address, packet_data, packet_bytes );
-			}
-		}
-        else
-        {
-            debug_printf( "proxy thread %d slot %d received packet from %s, but slot is not allocated\n", thread_data->thread_number, thread_data->slot_number, proxy_address_to_string( &from, string_buffer ) );
-        }
-	}
+    next_bench();
 
-	debug_printf( "proxy thread %d slot thread %d stopped\n", thread_data->thread_number, thread_data->slot_number );
+    bench_session_directory();
 
-	proxy_platform_socket_destroy( thread_data->socket );
+    bench_socket_backend();
 
-	fflush( stdout );
+    bench_udp_segmentation();
 
-    PROXY_PLATFORM_THREAD_RETURN();
+    next_term();
 }
 
 // ---------------------------------------------------------------------
 
-struct proxy_slot_data_t
+/*
+	Packet buffers. Each proxy thread receives into buffers from its own pool, so a packet that only needs a prefix,
+	a passthrough byte or a tunnel header put in front of it can be sent from the buffer it was received into. Each
+	buffer starts on a cache line and has headroom in front of the packet for those, and tailroom behind it, so a
+	packet grown at either end never runs into the next buffer. The pool is only touched by the thread that owns it.
+	With IO_URING=1 there is no pool: the ring owns the receive and send buffers, so packets are copied as before.
+*/
+
+#define PROXY_PACKET_HEADROOM                                          16
+#define PROXY_PACKET_TAILROOM                                          16
+#define PROXY_PACKET_ALIGNMENT                                         64
+
+struct proxy_packet_pool_t
 {
-	double last_packet_receive_time;
+	int max_packet_bytes;
+	int buffer_size;
+	int num_buffers;
+	int num_free;
+	int * free_buffers;
+	uint8_t * allocation;
+	uint8_t * buffers;
 };
 
-struct proxy_thread_data_t
+proxy_packet_pool_t * proxy_packet_pool_create( int num_buffers, int max_packet_bytes )
 {
-	int thread_number;
-	session_table_t * session_table;
-	proxy_slot_data_t * slot_data;
-	proxy_platform_thread_t * thread;
-	proxy_platform_socket_t * socket;
-	slot_thread_data_t ** slot_thread_data;
-	proxy_platform_socket_t ** thread_sockets;
-	proxy_platform_socket_t ** slot_sockets;
-	next_platform_socket_t * next_socket;
-};
+	assert( num_buffers > 0 );
+	assert( max_packet_bytes > 0 );
 
-extern next_platform_socket_t * next_server_socket( next_server_t * server );
+	proxy_packet_pool_t * pool = (proxy_packet_pool_t*) calloc( 1, sizeof(proxy_packet_pool_t) );
+	if ( !pool )
+		return NULL;
 
-static proxy_platform_thread_return_t PROXY_PLATFORM_THREAD_FUNC proxy_thread_function( void * data )
-{
-	proxy_thread_data_t * thread_data = (proxy_thread_data_t*) data;
+	pool->max_packet_bytes = max_packet_bytes;
+	pool->buffer_size = ( PROXY_PACKET_HEADROOM + max_packet_bytes + PROXY_PACKET_TAILROOM + PROXY_PACKET_ALIGNMENT - 1 ) & ~( PROXY_PACKET_ALIGNMENT - 1 );
+	pool->num_buffers = num_buffers;
+	pool->num_free = num_buffers;
 
-	printf( "proxy thread %d started\n", thread_data->thread_number );
+	pool->free_buffers = (int*) malloc( sizeof(int) * num_buffers );
+	pool->allocation = (uint8_t*) malloc( size_t(pool->buffer_size) * num_buffers + PROXY_PACKET_ALIGNMENT - 1 );
 
-	for ( int i = 0; i < config.num_threads; ++i )
+	if ( !pool->free_buffers || !pool->allocation )
 	{
-		assert( thread_data->thread_sockets[i] != NULL );
+		free( pool->free_buffers );
+		free( pool->allocation );
+		free( pool );
+		return NULL;
 	}
 
-	// create slot threads
+	pool->buffers = (uint8_t*) ( ( uintptr_t( pool->allocation ) + PROXY_PACKET_ALIGNMENT - 1 ) & ~uintptr_t( PROXY_PACKET_ALIGNMENT - 1 ) );
+
+	// hand out the lowest buffers first
 
-	thread_data->slot_thread_data = (slot_thread_data_t**) malloc( sizeof(slot_thread_data_t*) * config.num_slots_per_thread );
-	
-	for ( int i = 0; i < config.num_slots_per_thread; ++i )
+	for ( int i = 0; i < num_buffers; ++i )
 	{
-		thread_data->slot_thread_data[i] = (slot_thread_data_t*) calloc( 1, config.slot_thread_data_bytes );
-		
-		if ( !thread_data->slot_thread_data[i] )
-		{
-	        printf( "error: could not allocate slot thread data\n" );
-			exit(1);
-		}
+		pool->free_buffers[i] = num_buffers - 1 - i;
+	}
 
-		thread_data->slot_thread_data[i]->thread_number = thread_data->thread_number;
-		thread_data->slot_thread_data[i]->thread_sockets = thread_data->thread_sockets;
-		thread_data->slot_thread_data[i]->slot_number = i;
-		thread_data->slot_thread_data[i]->next_socket = thread_data->next_socket;
+	return pool;
+}
 
-		const int global_slot_index = thread_data->thread_number * config.num_slots_per_thread + i;
+void proxy_packet_pool_destroy( proxy_packet_pool_t * pool )
+{
+	assert( pool );
+	free( pool->free_buffers );
+	free( pool->allocation );
+	free( pool );
+}
 
-		thread_data->slot_thread_data[i]->socket = thread_data->slot_sockets[global_slot_index];
+int proxy_packet_pool_alloc( proxy_packet_pool_t * pool )
+{
+	// returns -1 if every buffer is in use
 
-		proxy_platform_mutex_create( &thread_data->slot_thread_data[i]->mutex );
+	assert( pool );
 
-	    thread_data->slot_thread_data[i]->thread = proxy_platform_thread_create( slot_thread_function, thread_data->slot_thread_data[i] );
+	if ( pool->num_free == 0 )
+		return -1;
 
-	    if ( !thread_data->slot_thread_data[i]->thread )
-	    {
-	        printf( "error: failed to create slot thread\n" );
-	        exit(1);
-	    }
-	}
+	return pool->free_buffers[--pool->num_free];
+}
 
-    // process received packets
+void proxy_packet_pool_free( proxy_packet_pool_t * pool, int buffer )
+{
+	assert( pool );
+	assert( buffer >= 0 );
+	assert( buffer < pool->num_buffers );
+	assert( pool->num_free < pool->num_buffers );
 
-    char string_buffer[1024];
+	pool->free_buffers[pool->num_free++] = buffer;
+}
 
-    (void) string_buffer;
+static inline uint8_t * proxy_packet_pool_data( proxy_packet_pool_t * pool, int buffer )
+{
+	// where the packet goes, after the headroom
 
-    double last_swap_time = proxy_time();
+	assert( pool );
+	assert( buffer >= 0 );
+	assert( buffer < pool->num_buffers );
 
-	while ( true )
-	{
-		const int prefix = 11;
+	return pool->buffers + size_t(buffer) * pool->buffer_size + PROXY_PACKET_HEADROOM;
+}
 
-		uint8_t buffer[prefix + config.max_packet_size];
+static inline bool proxy_packet_pool_buffer_holds( proxy_packet_pool_t * pool, int buffer, const uint8_t * packet_data, int packet_bytes )
+{
+	// true if these bytes are all inside the buffer, headroom and tailroom included
 
-		uint8_t * packet_data = buffer + prefix;
+	const uint8_t * start = pool->buffers + size_t(buffer) * pool->buffer_size;
 
-		proxy_address_t from;
+	return packet_data >= start && packet_data + packet_bytes <= start + pool->buffer_size;
+}
 
-		int packet_bytes = proxy_platform_socket_receive_packet( thread_data->socket, &from, packet_data, config.max_packet_size );
+// ---------------------------------------------------------------------
 
-		if ( packet_bytes < 0 )
-			break;
+#define PROXY_SEND_QUEUE_SIZE                                         256
+#define PROXY_SEND_QUEUE_FLOW_TABLE_SIZE                              512
 
-		if ( packet_bytes == 0 )
-			continue;
+struct proxy_send_queue_t
+{
+	int max_packet_size;
+	int num_packets;
+	int num_flows;
+	uint8_t * packet_buffer;
+	uint8_t * packet_data[PROXY_SEND_QUEUE_SIZE];
+	int packet_pool_buffer[PROXY_SEND_QUEUE_SIZE];
+	proxy_address_t packet_to[PROXY_SEND_QUEUE_SIZE];
+	int packet_bytes[PROXY_SEND_QUEUE_SIZE];
+	int packet_next[PROXY_SEND_QUEUE_SIZE];
+	proxy_platform_socket_t * flow_socket[PROXY_SEND_QUEUE_SIZE];
+	int flow_first[PROXY_SEND_QUEUE_SIZE];
+	int flow_last[PROXY_SEND_QUEUE_SIZE];
+	int flow_table_index[PROXY_SEND_QUEUE_SIZE];
+	int flow_table[PROXY_SEND_QUEUE_FLOW_TABLE_SIZE];
+	proxy_platform_uring_t * uring;
+	proxy_packet_pool_t * pool;
+};
 
-		double current_time = proxy_time();
+proxy_send_queue_t * proxy_send_queue_create( int max_packet_size )
+{
+	proxy_send_queue_t * queue = (proxy_send_queue_t*) calloc( 1, sizeof(proxy_send_queue_t) );
+	if ( !queue )
+		return NULL;
 
-		if ( current_time - last_swap_time > config.slot_timeout_seconds / 2 )
+	queue->packet_buffer = (uint8_t*) malloc( size_t(max_packet_size) * PROXY_SEND_QUEUE_SIZE );
+	if ( !queue->packet_buffer )
+	{
+		free( queue );
+		return NULL;
+	}
+
+	queue->max_packet_size = max_packet_size;
+
+	for ( int i = 0; i < PROXY_SEND_QUEUE_FLOW_TABLE_SIZE; ++i )
+	{
+		queue->flow_table[i] = -1;
+	}
+
+	return queue;
+}
+
+void proxy_send_queue_destroy( proxy_send_queue_t * queue )
+{
+	assert( queue );
+	free( queue->packet_buffer );
+	free( queue );
+}
+
+void proxy_send_queue_flush( proxy_send_queue_t * queue )
+{
+	assert( queue );
+
+	// one batched send per destination socket, packets in the order they were queued
+
+	void * packet_data[PROXY_SEND_QUEUE_SIZE];
+	int packet_bytes[PROXY_SEND_QUEUE_SIZE];
+	proxy_address_t packet_to[PROXY_SEND_QUEUE_SIZE];
+
+	for ( int i = 0; i < queue->num_flows; ++i )
+	{
+		int num_packets = 0;
+
+		for ( int index = queue->flow_first[i]; index != -1; index = queue->packet_next[index] )
+		{
+			packet_data[num_packets] = queue->packet_data[index];
+			packet_bytes[num_packets] = queue->packet_bytes[index];
+			packet_to[num_packets] = queue->packet_to[index];
+			num_packets++;
+		}
+
+		if ( queue->uring )
+		{
+			proxy_platform_uring_send_packets( queue->uring, queue->flow_socket[i], packet_to, packet_data, packet_bytes, num_packets );
+		}
+		else
+		{
+			proxy_platform_socket_send_packets( queue->flow_socket[i], packet_to, packet_data, packet_bytes, num_packets );
+		}
+
+		queue->flow_table[queue->flow_table_index[i]] = -1;
+	}
+
+	// with io_uring, every flow goes to the kernel in one submission
+
+	if ( queue->uring && queue->num_flows > 0 )
+	{
+		proxy_platform_uring_submit( queue->uring );
+	}
+
+	// packets sent by reference are done with once sent. io_uring copies them into its own send buffers
+
+	for ( int i = 0; i < queue->num_packets; ++i )
+	{
+		if ( queue->packet_pool_buffer[i] >= 0 )
+		{
+			assert( queue->pool );
+			proxy_packet_pool_free( queue->pool, queue->packet_pool_buffer[i] );
+		}
+	}
+
+	queue->num_packets = 0;
+	queue->num_flows = 0;
+}
+
+static int proxy_send_queue_add( proxy_send_queue_t * queue, proxy_platform_socket_t * socket, const proxy_address_t * to, int packet_bytes )
+{
+	assert( queue );
+	assert( socket );
+	assert( to );
+	assert( packet_bytes > 0 );
+
+	if ( queue->num_packets == PROXY_SEND_QUEUE_SIZE )
+	{
+		proxy_send_queue_flush( queue );
+	}
+
+	// find the flow for this socket, or start a new one
+
+	uint64_t hash = uint64_t( uintptr_t( socket ) >> 4 ) * 0x9E3779B97F4A7C15ULL;
+	int table_index = int( hash >> 32 ) & ( PROXY_SEND_QUEUE_FLOW_TABLE_SIZE - 1 );
+
+	int flow = -1;
+
+	while ( true )
+	{
+		const int entry = queue->flow_table[table_index];
+		if ( entry == -1 )
+			break;
+		if ( queue->flow_socket[entry] == socket )
+		{
+			flow = entry;
+			break;
+		}
+		table_index = ( table_index + 1 ) & ( PROXY_SEND_QUEUE_FLOW_TABLE_SIZE - 1 );
+	}
+
+	const int index = queue->num_packets++;
+
+	if ( flow == -1 )
+	{
+		flow = queue->num_flows++;
+		queue->flow_socket[flow] = socket;
+		queue->flow_first[flow] = index;
+		queue->flow_table_index[flow] = table_index;
+		queue->flow_table[table_index] = flow;
+	}
+	else
+	{
+		queue->packet_next[queue->flow_last[flow]] = index;
+	}
+
+	queue->flow_last[flow] = index;
+	queue->packet_next[index] = -1;
+	queue->packet_to[index] = *to;
+	queue->packet_bytes[index] = packet_bytes;
+
+	return index;
+}
+
+uint8_t * proxy_send_queue_reserve( proxy_send_queue_t * queue, proxy_platform_socket_t * socket, const proxy_address_t * to, int packet_bytes )
+{
+	// queues a packet and returns where its bytes go. the caller fills them in before the next flush
+
+	assert( queue );
+	assert( packet_bytes <= queue->max_packet_size );
+
+	const int index = proxy_send_queue_add( queue, socket, to, packet_bytes );
+
+	queue->packet_data[index] = queue->packet_buffer + size_t(index) * queue->max_packet_size;
+	queue->packet_pool_buffer[index] = -1;
+
+	return queue->packet_data[index];
+}
+
+void proxy_send_queue_packet_by_reference( proxy_send_queue_t * queue, proxy_platform_socket_t * socket, const proxy_address_t * to, uint8_t * packet_data, int packet_bytes, int pool_buffer )
+{
+	// queues a packet without copying it. the queue owns the pool buffer holding it from here, and frees it once the packet is sent
+
+	assert( queue );
+	assert( queue->pool );
+	assert( packet_data );
+	assert( proxy_packet_pool_buffer_holds( queue->pool, pool_buffer, packet_data, packet_bytes ) );
+
+	const int index = proxy_send_queue_add( queue, socket, to, packet_bytes );
+
+	queue->packet_data[index] = packet_data;
+	queue->packet_pool_buffer[index] = pool_buffer;
+}
+
+void proxy_send_queue_packet( proxy_send_queue_t * queue, proxy_platform_socket_t * socket, const proxy_address_t * to, const uint8_t * packet_data, int packet_bytes )
+{
+	assert( packet_data );
+
+	memcpy( proxy_send_queue_reserve( queue, socket, to, packet_bytes ), packet_data, packet_bytes );
+}
+
+void test_packet_pool()
+{
+	printf( "    test_packet_pool\n" );
+
+	const int NumBuffers = 8;
+	const int MaxPacketBytes = 100;
+
+	proxy_packet_pool_t * pool = proxy_packet_pool_create( NumBuffers, MaxPacketBytes );
+	proxy_check( pool );
+	proxy_check( pool->buffer_size % PROXY_PACKET_ALIGNMENT == 0 );
+	proxy_check( pool->buffer_size >= PROXY_PACKET_HEADROOM + MaxPacketBytes + PROXY_PACKET_TAILROOM );
+
+	// every buffer is handed out once, on its own cache line, until the pool is empty
+
+	int buffers[NumBuffers];
+
+	for ( int i = 0; i < NumBuffers; ++i )
+	{
+		buffers[i] = proxy_packet_pool_alloc( pool );
+		proxy_check( buffers[i] >= 0 );
+		proxy_check( ( uintptr_t( proxy_packet_pool_data( pool, buffers[i] ) - PROXY_PACKET_HEADROOM ) % PROXY_PACKET_ALIGNMENT ) == 0 );
+		for ( int j = 0; j < i; ++j )
+		{
+			proxy_check( buffers[j] != buffers[i] );
+		}
+	}
+
+	proxy_check( proxy_packet_pool_alloc( pool ) == -1 );
+
+	for ( int i = 0; i < NumBuffers; ++i )
+	{
+		proxy_packet_pool_free( pool, buffers[i] );
+	}
+
+	proxy_check( pool->num_free == NumBuffers );
+
+	// headroom and tailroom belong to the buffer, but not a byte more
+
+	uint8_t * data = proxy_packet_pool_data( pool, 0 );
+	proxy_check( proxy_packet_pool_buffer_holds( pool, 0, data - PROXY_PACKET_HEADROOM, pool->buffer_size ) );
+	proxy_check( proxy_packet_pool_buffer_holds( pool, 0, data, MaxPacketBytes + PROXY_PACKET_TAILROOM ) );
+	proxy_check( !proxy_packet_pool_buffer_holds( pool, 0, data - PROXY_PACKET_HEADROOM - 1, 1 ) );
+	proxy_check( !proxy_packet_pool_buffer_holds( pool, 0, data - PROXY_PACKET_HEADROOM, pool->buffer_size + 1 ) );
+	proxy_check( !proxy_packet_pool_buffer_holds( pool, 1, data, 1 ) );
+
+	// packets queued by reference go out in order with copied packets, and their buffers go back to the pool once sent
+
+	proxy_address_t bind_address;
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+	proxy_platform_socket_t * sender = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 1000000, 1000000 );
+	proxy_check( sender );
+
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+	proxy_platform_socket_t * receiver = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 1000000, 1000000 );
+	proxy_check( receiver );
+	const proxy_address_t receiver_address = bind_address;
+
+	proxy_send_queue_t * queue = proxy_send_queue_create( MaxPacketBytes );
+	proxy_check( queue );
+	queue->pool = pool;
+
+	const int first = proxy_packet_pool_alloc( pool );
+	proxy_check( first >= 0 );
+	memset( proxy_packet_pool_data( pool, first ), 'A', 50 );
+	proxy_send_queue_packet_by_reference( queue, sender, &receiver_address, proxy_packet_pool_data( pool, first ), 50, first );
+
+	uint8_t copied[60];
+	memset( copied, 'B', sizeof(copied) );
+	proxy_send_queue_packet( queue, sender, &receiver_address, copied, sizeof(copied) );
+
+	// a header written into the headroom goes out with the packet behind it
+
+	const int second = proxy_packet_pool_alloc( pool );
+	proxy_check( second >= 0 );
+	uint8_t * header = proxy_packet_pool_data( pool, second ) - 4;
+	memset( header, 'H', 4 );
+	memset( header + 4, 'C', MaxPacketBytes );
+	proxy_send_queue_packet_by_reference( queue, sender, &receiver_address, header, 4 + MaxPacketBytes, second );
+
+	proxy_check( pool->num_free == NumBuffers - 2 );
+
+	proxy_send_queue_flush( queue );
+
+	proxy_check( pool->num_free == NumBuffers );
+	proxy_check( queue->num_packets == 0 );
+
+	const int expected_bytes[] = { 50, 60, 4 + MaxPacketBytes };
+	const uint8_t expected_byte[] = { 'A', 'B', 'C' };
+
+	uint8_t receive_buffer[256];
+	uint8_t * packet_data[1] = { receive_buffer };
+	int packet_bytes[1] = { 0 };
+	proxy_address_t from[1];
+
+	int num_received = 0;
+
+	for ( int iteration = 0; iteration < 1000 && num_received < 3; ++iteration )
+	{
+		const int num_packets = proxy_platform_socket_receive_packets( receiver, from, packet_data, packet_bytes, sizeof(receive_buffer), 1 );
+		proxy_check( num_packets >= 0 );
+
+		if ( num_packets == 0 )
+		{
+			proxy_sleep( 0.001 );
+			continue;
+		}
+
+		proxy_check( packet_bytes[0] == expected_bytes[num_received] );
+		proxy_check( receive_buffer[packet_bytes[0] - 1] == expected_byte[num_received] );
+		if ( num_received == 2 )
+		{
+			proxy_check( memcmp( receive_buffer, "HHHH", 4 ) == 0 );
+		}
+
+		num_received++;
+	}
+
+	proxy_check( num_received == 3 );
+
+	proxy_send_queue_destroy( queue );
+
+	proxy_platform_socket_destroy( receiver );
+	proxy_platform_socket_destroy( sender );
+
+	proxy_packet_pool_destroy( pool );
+}
+
+void test_memory_pages()
+{
+	printf( "    test_memory_pages\n" );
+
+	// thread data and slots come zeroed and page aligned, so binding them to a numa node covers the whole range
+
+	const size_t Bytes = 64 * 1024;
+
+	uint8_t * data = (uint8_t*) proxy_platform_memory_alloc_pages( Bytes );
+	proxy_check( data );
+	proxy_check( ( uintptr_t( data ) & 4095 ) == 0 );
+
+	for ( size_t i = 0; i < Bytes; ++i )
+	{
+		proxy_check( data[i] == 0 );
+	}
+
+	// a range inside a single page can't be bound at all, which must not pass for success
+
+	proxy_check( !proxy_platform_memory_bind_local( data + 16, 64 ) );
+
+	proxy_platform_memory_free_pages( data, Bytes );
+}
+
+// ---------------------------------------------------------------------
+
+/*
+	Tunnel mode (TUNNEL=1). Without it, every slot has its own socket and port, so the server can tell clients apart
+	by source address, at the cost of a socket, an fd and a kernel hash entry per slot. In tunnel mode each proxy
+	thread has a single tunnel socket to the server instead, and every packet between them carries a 4 byte header:
+	PROXY_TUNNEL_PACKET, then the slot in 24 bits, big endian. The proxy's socket count and per-packet demux cost no
+	longer depend on the number of clients, and with gso, packets of the same size for different clients share a send.
+
+	The server side (MODE=server with TUNNEL=1) decapsulates each packet into the client it came from, a tunnel peer
+	and slot, and the payload, and encapsulates replies to that client the same way.
+*/
+
+#define PROXY_TUNNEL_PACKET                                          0x7E
+#define PROXY_TUNNEL_HEADER_BYTES                                       4
+#define PROXY_TUNNEL_MAX_SLOTS                                    (1<<24)
+
+struct proxy_tunnel_client_t
+{
+	proxy_address_t tunnel_address;
+	int slot;
+};
+
+void proxy_tunnel_write_header( uint8_t * header, int slot )
+{
+	assert( header );
+	assert( slot >= 0 );
+	assert( slot < PROXY_TUNNEL_MAX_SLOTS );
+
+	header[0] = PROXY_TUNNEL_PACKET;
+	header[1] = uint8_t( slot >> 16 );
+	header[2] = uint8_t( slot >> 8 );
+	header[3] = uint8_t( slot );
+}
+
+int proxy_tunnel_read_header( const uint8_t * packet_data, int packet_bytes )
+{
+	// returns the slot, or -1 if this isn't a tunnel packet with a payload
+
+	assert( packet_data );
+
+	if ( packet_bytes <= PROXY_TUNNEL_HEADER_BYTES || packet_data[0] != PROXY_TUNNEL_PACKET )
+		return -1;
+
+	return ( int( packet_data[1] ) << 16 ) | ( int( packet_data[2] ) << 8 ) | int( packet_data[3] );
+}
+
+int proxy_tunnel_decapsulate( const proxy_address_t * from, uint8_t * packet_data, int packet_bytes, proxy_tunnel_client_t * client, uint8_t ** payload )
+{
+	// returns the payload bytes, or -1 if the packet isn't from a tunnel
+
+	assert( from );
+	assert( client );
+	assert( payload );
+
+	const int slot = proxy_tunnel_read_header( packet_data, packet_bytes );
+	if ( slot < 0 )
+		return -1;
+
+	client->tunnel_address = *from;
+	client->slot = slot;
+
+	*payload = packet_data + PROXY_TUNNEL_HEADER_BYTES;
+
+	return packet_bytes - PROXY_TUNNEL_HEADER_BYTES;
+}
+
+int proxy_tunnel_encapsulate( const proxy_tunnel_client_t * client, uint8_t * payload, int payload_bytes, proxy_address_t * to, uint8_t ** packet_data )
+{
+	// writes the header in place, so the payload needs PROXY_TUNNEL_HEADER_BYTES of headroom. returns the packet bytes
+
+	assert( client );
+	assert( payload );
+	assert( to );
+	assert( packet_data );
+
+	*packet_data = payload - PROXY_TUNNEL_HEADER_BYTES;
+	proxy_tunnel_write_header( *packet_data, client->slot );
+
+	*to = client->tunnel_address;
+
+	return payload_bytes + PROXY_TUNNEL_HEADER_BYTES;
+}
+
+void test_tunnel()
+{
+	printf( "    test_tunnel\n" );
+
+	// the header round trips every slot the tunnel can address
+
+	const int slots[] = { 0, 1, 255, 256, 65535, 65536, PROXY_TUNNEL_MAX_SLOTS - 1 };
+
+	for ( int i = 0; i < int( sizeof(slots) / sizeof(slots[0]) ); ++i )
+	{
+		uint8_t packet[PROXY_TUNNEL_HEADER_BYTES + 1];
+		proxy_tunnel_write_header( packet, slots[i] );
+		packet[PROXY_TUNNEL_HEADER_BYTES] = 0;
+		proxy_check( proxy_tunnel_read_header( packet, sizeof(packet) ) == slots[i] );
+	}
+
+	// anything without the tunnel marker or a payload is dropped
+
+	uint8_t packet[64];
+	proxy_tunnel_write_header( packet, 10 );
+	proxy_check( proxy_tunnel_read_header( packet, PROXY_TUNNEL_HEADER_BYTES ) == -1 );
+	packet[0] = NEXT_PASSTHROUGH_PACKET;
+	proxy_check( proxy_tunnel_read_header( packet, sizeof(packet) ) == -1 );
+
+	// the server decapsulates a packet from a proxy thread, and a reply encapsulated in place goes back through the same tunnel to the same slot
+
+	proxy_address_t tunnel_address;
+	proxy_check( proxy_address_parse( &tunnel_address, "10.0.0.1:10005" ) );
+
+	proxy_tunnel_write_header( packet, 12345 );
+	for ( int i = PROXY_TUNNEL_HEADER_BYTES; i < int( sizeof(packet) ); ++i )
+	{
+		packet[i] = uint8_t( i );
+	}
+
+	proxy_tunnel_client_t client;
+	uint8_t * payload = NULL;
+	const int payload_bytes = proxy_tunnel_decapsulate( &tunnel_address, packet, sizeof(packet), &client, &payload );
+	proxy_check( payload_bytes == int( sizeof(packet) ) - PROXY_TUNNEL_HEADER_BYTES );
+	proxy_check( payload == packet + PROXY_TUNNEL_HEADER_BYTES );
+	proxy_check( payload[0] == PROXY_TUNNEL_HEADER_BYTES );
+	proxy_check( client.slot == 12345 );
+	proxy_check( proxy_address_equal( &client.tunnel_address, &tunnel_address ) );
+
+	memset( packet, 0, PROXY_TUNNEL_HEADER_BYTES );
+
+	proxy_address_t to;
+	uint8_t * reply = NULL;
+	const int reply_bytes = proxy_tunnel_encapsulate( &client, payload, payload_bytes, &to, &reply );
+	proxy_check( reply == packet );
+	proxy_check( reply_bytes == int( sizeof(packet) ) );
+	proxy_check( proxy_address_equal( &to, &tunnel_address ) );
+	proxy_check( proxy_tunnel_read_header( reply, reply_bytes ) == 12345 );
+}
+
+// ---------------------------------------------------------------------
+
+struct next_platform_socket_t;
+
+extern void next_platform_socket_send_packet( next_platform_socket_t * socket, const next_address_t * to, const void * packet_data, int packet_bytes );
+
+/*
+	Slots are global. Slot g is bound to port slot_base_port + g and its socket is polled by its home thread,
+	g / num_slots_per_thread, but any proxy thread can lease it for a client that thread sees on its own socket.
+
+	Slot state is one word, so reading it on the per packet path never waits. The leasing thread is the only writer
+	of the allocated bit, the client address and the lru links. The next thread only sets and clears the next bit
+	with atomic or/and.
+
+	The upper bits of the state are a generation that bumps whenever the slot loses its client, so the home thread
+	can copy the client address seqlock style: state, address, state again, and drop the packet if it changed.
+
+	A client keeps its slot when it migrates to another proxy thread. While the adopt message is in flight the lessee
+	is the new thread with the moving bit set, so payloads already go to the new thread but neither thread touches it.
+*/
+
+#define PROXY_SLOT_STATE_ALLOCATED                                  (1<<0)
+#define PROXY_SLOT_STATE_NEXT                                       (1<<1)
+#define PROXY_SLOT_STATE_FLAGS                                       0xFF
+#define PROXY_SLOT_STATE_GENERATION                                 (1<<8)
+
+#define PROXY_SLOT_LESSEE_MOVING                                   (1U<<31)
+
+struct proxy_slot_data_t
+{
+	proxy_platform_socket_t * socket;
+	double last_packet_receive_time;
+	uint32_t state;
+	uint32_t lessee;
+	proxy_address_t client_address;
+
+	// leasing thread only. links the slot into that thread's lru list
+	int list_prev;
+	int list_next;
+};
+
+static inline uint32_t proxy_slot_state( const proxy_slot_data_t * slot_data )
+{
+	return __atomic_load_n( &slot_data->state, __ATOMIC_ACQUIRE );
+}
+
+static inline bool proxy_slot_read_client( const proxy_slot_data_t * slot_data, uint32_t * state, proxy_address_t * client_address )
+{
+	// false if the slot has no client, or it changed hands while the address was being copied
+
+	const uint32_t before = proxy_slot_state( slot_data );
+
+	if ( !( before & PROXY_SLOT_STATE_ALLOCATED ) )
+		return false;
+
+	*client_address = slot_data->client_address;
+
+	__atomic_thread_fence( __ATOMIC_ACQUIRE );
+
+	const uint32_t after = __atomic_load_n( &slot_data->state, __ATOMIC_RELAXED );
+
+	if ( ( before & ~PROXY_SLOT_STATE_NEXT ) != ( after & ~PROXY_SLOT_STATE_NEXT ) )
+		return false;
+
+	*state = after;
+
+	return true;
+}
+
+/*
+	Packets handed to the next thread carry a 5 byte prefix in the headroom in front of the client packet: the packet
+	type, then a session handle. The handle is the global slot in the low 24 bits and the low 8 bits of the slot's
+	generation above it, big endian. The next thread indexes its per slot session arrays with it directly instead of
+	hashing the client address, and a generation it hasn't seen for that slot means a new client. The client address
+	itself is read from the slot, so it doesn't have to fit in the prefix and IPv6 clients work the same as IPv4.
+*/
+
+#define PROXY_NEXT_PREFIX_BYTES                                         5
+#define PROXY_SESSION_HANDLE_MAX_SLOTS                            (1<<24)
+
+static inline uint32_t proxy_session_handle( int slot, uint32_t state )
+{
+	assert( slot >= 0 );
+	assert( slot < PROXY_SESSION_HANDLE_MAX_SLOTS );
+
+	return uint32_t( slot ) | ( ( state / PROXY_SLOT_STATE_GENERATION ) << 24 );
+}
+
+static inline int proxy_session_handle_slot( uint32_t handle )
+{
+	return int( handle & ( PROXY_SESSION_HANDLE_MAX_SLOTS - 1 ) );
+}
+
+static inline bool proxy_session_handle_matches( uint32_t handle, uint32_t state )
+{
+	return ( handle >> 24 ) == ( ( state / PROXY_SLOT_STATE_GENERATION ) & 0xFF );
+}
+
+static inline void proxy_write_next_prefix( uint8_t * buffer, uint8_t packet_type, uint32_t handle )
+{
+	buffer[0] = packet_type;
+	buffer[1] = uint8_t( handle >> 24 );
+	buffer[2] = uint8_t( handle >> 16 );
+	buffer[3] = uint8_t( handle >> 8 );
+	buffer[4] = uint8_t( handle );
+}
+
+static inline uint32_t proxy_read_session_handle( const uint8_t * buffer )
+{
+	return ( uint32_t( buffer[1] ) << 24 ) | ( uint32_t( buffer[2] ) << 16 ) | ( uint32_t( buffer[3] ) << 8 ) | uint32_t( buffer[4] );
+}
+
+/*
+	The session directory maps client addresses to slots for every thread at once: each proxy thread and the next thread
+	look clients up in the same directory, without taking a lock. The thread leasing a slot adds its client when it gets
+	the slot and removes it when the slot loses the client. A client migrating between proxy threads keeps its entry.
+
+	Each entry is one 64 bit word, the upper half of the address hash above the slot + 1. The address itself lives in
+	the slot, so a lookup confirms a candidate by copying it seqlock style, and an entry for a slot that has moved on
+	to another client just doesn't match. Linear probing over a table at least twice the number of slots, so it is
+	never more than half full of live entries. Writers take a mutex. Removed entries become tombstones that probes pass
+	over, and once they build up, the writer builds a clean copy of the table and swaps it in.
+
+	Old tables are freed with epoch based reclamation. A reader publishes the global epoch before it loads the table
+	pointer and clears it when done. A retired table is stamped with the epoch it was retired in, and freed once every
+	reader is either outside the directory or published a later epoch, since those readers loaded the new table.
+*/
+
+#define PROXY_SESSION_DIRECTORY_EMPTY                                  0ULL
+#define PROXY_SESSION_DIRECTORY_TOMBSTONE                             ~0ULL
+
+struct proxy_session_directory_table_t
+{
+	int capacity;
+	int num_entries;
+	int num_tombstones;
+	uint64_t retire_epoch;
+	proxy_session_directory_table_t * next_retired;
+	uint64_t * entries;
+};
+
+struct proxy_session_directory_reader_t
+{
+	uint64_t epoch;
+	uint8_t padding[56];
+};
+
+struct proxy_session_directory_t
+{
+	proxy_session_directory_table_t * table;
+	uint64_t epoch;
+	const proxy_slot_data_t * slots;
+	int num_slots;
+	int num_readers;
+	proxy_session_directory_reader_t * readers;
+	proxy_session_directory_table_t * retired;
+	proxy_platform_mutex_t mutex;
+};
+
+static inline uint64_t proxy_session_directory_entry( uint64_t hash, int slot )
+{
+	return ( hash & 0xFFFFFFFF00000000ULL ) | uint64_t( slot + 1 );
+}
+
+static inline int proxy_session_directory_entry_slot( uint64_t entry )
+{
+	return int( entry & 0xFFFFFFFFULL ) - 1;
+}
+
+static inline int proxy_session_directory_home( const proxy_session_directory_table_t * table, uint64_t entry )
+{
+	// only the upper half of the hash is kept, so a rebuild can place entries without the address
+
+	return int( ( entry >> 32 ) & uint64_t( table->capacity - 1 ) );
+}
+
+static proxy_session_directory_table_t * proxy_session_directory_table_create( int capacity )
+{
+	proxy_session_directory_table_t * table = (proxy_session_directory_table_t*) calloc( 1, sizeof(proxy_session_directory_table_t) );
+	uint64_t * entries = (uint64_t*) calloc( size_t(capacity), sizeof(uint64_t) );
+	if ( !table || !entries )
+	{
+		free( table );
+		free( entries );
+		return NULL;
+	}
+
+	table->capacity = capacity;
+	table->entries = entries;
+
+	return table;
+}
+
+static void proxy_session_directory_table_destroy( proxy_session_directory_table_t * table )
+{
+	free( table->entries );
+	free( table );
+}
+
+proxy_session_directory_t * proxy_session_directory_create( const proxy_slot_data_t * slots, int num_slots, int num_readers )
+{
+	assert( slots );
+	assert( num_slots > 0 );
+	assert( num_slots <= PROXY_SESSION_HANDLE_MAX_SLOTS );
+	assert( num_readers > 0 );
+
+	int capacity = 16;
+	while ( capacity < num_slots * 2 )
+		capacity *= 2;
+
+	proxy_session_directory_t * directory = (proxy_session_directory_t*) calloc( 1, sizeof(proxy_session_directory_t) );
+	if ( !directory )
+		return NULL;
+
+	directory->table = proxy_session_directory_table_create( capacity );
+	directory->readers = (proxy_session_directory_reader_t*) calloc( size_t(num_readers), sizeof(proxy_session_directory_reader_t) );
+
+	if ( !directory->table || !directory->readers || !proxy_platform_mutex_create( &directory->mutex ) )
+	{
+		if ( directory->table )
+			proxy_session_directory_table_destroy( directory->table );
+		free( directory->readers );
+		free( directory );
+		return NULL;
+	}
+
+	directory->epoch = 1;
+	directory->slots = slots;
+	directory->num_slots = num_slots;
+	directory->num_readers = num_readers;
+
+	return directory;
+}
+
+void proxy_session_directory_destroy( proxy_session_directory_t * directory )
+{
+	assert( directory );
+
+	proxy_session_directory_table_t * table = directory->retired;
+	while ( table )
+	{
+		proxy_session_directory_table_t * next_retired = table->next_retired;
+		proxy_session_directory_table_destroy( table );
+		table = next_retired;
+	}
+
+	proxy_session_directory_table_destroy( directory->table );
+	proxy_platform_mutex_destroy( &directory->mutex );
+	free( directory->readers );
+	free( directory );
+}
+
+int proxy_session_directory_get( proxy_session_directory_t * directory, int reader, const proxy_address_t * address )
+{
+	// returns the slot with this client, or -1. each thread passes its own reader index
+
+	assert( directory );
+	assert( reader >= 0 );
+	assert( reader < directory->num_readers );
+
+	const uint64_t hash = hash_address( address );
+
+	uint64_t * reader_epoch = &directory->readers[reader].epoch;
+
+	__atomic_store_n( reader_epoch, __atomic_load_n( &directory->epoch, __ATOMIC_SEQ_CST ), __ATOMIC_SEQ_CST );
+
+	const proxy_session_directory_table_t * table = __atomic_load_n( &directory->table, __ATOMIC_SEQ_CST );
+
+	const int mask = table->capacity - 1;
+
+	int index = proxy_session_directory_home( table, hash );
+
+	int result = -1;
+
+	for ( int i = 0; i < table->capacity; ++i )
+	{
+		const uint64_t entry = __atomic_load_n( &table->entries[index], __ATOMIC_ACQUIRE );
+
+		if ( entry == PROXY_SESSION_DIRECTORY_EMPTY )
+			break;
+
+		if ( entry != PROXY_SESSION_DIRECTORY_TOMBSTONE && ( ( entry ^ hash ) >> 32 ) == 0 )
+		{
+			const int slot = proxy_session_directory_entry_slot( entry );
+
+			uint32_t state;
+			proxy_address_t client_address;
+
+			if ( proxy_slot_read_client( &directory->slots[slot], &state, &client_address ) && proxy_address_equal( &client_address, address ) )
+			{
+				result = slot;
+				break;
+			}
+		}
+
+		index = ( index + 1 ) & mask;
+	}
+
+	__atomic_store_n( reader_epoch, 0, __ATOMIC_RELEASE );
+
+	return result;
+}
+
+static void proxy_session_directory_reclaim( proxy_session_directory_t * directory )
+{
+	// frees the retired tables no reader can still be probing. writer only
+
+	uint64_t oldest_epoch = ~0ULL;
+
+	for ( int i = 0; i < directory->num_readers; ++i )
+	{
+		const uint64_t epoch = __atomic_load_n( &directory->readers[i].epoch, __ATOMIC_SEQ_CST );
+		if ( epoch != 0 && epoch < oldest_epoch )
+			oldest_epoch = epoch;
+	}
+
+	proxy_session_directory_table_t ** link = &directory->retired;
+
+	while ( *link )
+	{
+		proxy_session_directory_table_t * table = *link;
+
+		if ( table->retire_epoch < oldest_epoch )
+		{
+			*link = table->next_retired;
+			proxy_session_directory_table_destroy( table );
+		}
+		else
+		{
+			link = &table->next_retired;
+		}
+	}
+}
+
+static bool proxy_session_directory_rebuild( proxy_session_directory_t * directory )
+{
+	// swaps in a copy of the table without tombstones. readers still in the old table finish there. writer only
+
+	proxy_session_directory_table_t * old_table = directory->table;
+
+	proxy_session_directory_table_t * table = proxy_session_directory_table_create( old_table->capacity );
+	if ( !table )
+		return false;
+
+	const int mask = table->capacity - 1;
+
+	for ( int i = 0; i < old_table->capacity; ++i )
+	{
+		const uint64_t entry = old_table->entries[i];
+
+		if ( entry == PROXY_SESSION_DIRECTORY_EMPTY || entry == PROXY_SESSION_DIRECTORY_TOMBSTONE )
+			continue;
+
+		int index = proxy_session_directory_home( table, entry );
+		while ( table->entries[index] != PROXY_SESSION_DIRECTORY_EMPTY )
+			index = ( index + 1 ) & mask;
+
+		table->entries[index] = entry;
+		table->num_entries++;
+	}
+
+	__atomic_store_n( &directory->table, table, __ATOMIC_SEQ_CST );
+
+	old_table->retire_epoch = __atomic_fetch_add( &directory->epoch, 1, __ATOMIC_SEQ_CST );
+	old_table->next_retired = directory->retired;
+	directory->retired = old_table;
+
+	return true;
+}
+
+bool proxy_session_directory_insert( proxy_session_directory_t * directory, const proxy_address_t * address, int slot )
+{
+	// the slot must already hold the client. replaces any entry the client has for another slot. false only if a rebuild could not allocate
+
+	assert( directory );
+	assert( slot >= 0 );
+	assert( slot < directory->num_slots );
+
+	proxy_platform_mutex_guard( &directory->mutex );
+
+	proxy_session_directory_table_t * table = directory->table;
+
+	if ( ( table->num_entries + table->num_tombstones + 1 ) * 4 > table->capacity * 3 )
+	{
+		if ( !proxy_session_directory_rebuild( directory ) )
+			return false;
+
+		table = directory->table;
+	}
+
+	const uint64_t hash = hash_address( address );
+
+	const uint64_t new_entry = proxy_session_directory_entry( hash, slot );
+
+	const int mask = table->capacity - 1;
+
+	int index = proxy_session_directory_home( table, hash );
+
+	int free_index = -1;
+
+	while ( true )
+	{
+		const uint64_t entry = table->entries[index];
+
+		if ( entry == PROXY_SESSION_DIRECTORY_EMPTY )
+			break;
+
+		if ( entry == PROXY_SESSION_DIRECTORY_TOMBSTONE )
+		{
+			if ( free_index < 0 )
+				free_index = index;
+		}
+		else if ( ( ( entry ^ hash ) >> 32 ) == 0 )
+		{
+			const int other_slot = proxy_session_directory_entry_slot( entry );
+
+			uint32_t state;
+			proxy_address_t client_address;
+
+			if ( other_slot == slot || ( proxy_slot_read_client( &directory->slots[other_slot], &state, &client_address ) && proxy_address_equal( &client_address, address ) ) )
+			{
+				__atomic_store_n( &table->entries[index], new_entry, __ATOMIC_RELEASE );
+				proxy_session_directory_reclaim( directory );
+				return true;
+			}
+		}
+
+		index = ( index + 1 ) & mask;
+	}
+
+	if ( free_index >= 0 )
+	{
+		index = free_index;
+		table->num_tombstones--;
+	}
+
+	__atomic_store_n( &table->entries[index], new_entry, __ATOMIC_RELEASE );
+
+	table->num_entries++;
+
+	proxy_session_directory_reclaim( directory );
+
+	return true;
+}
+
+bool proxy_session_directory_remove( proxy_session_directory_t * directory, const proxy_address_t * address, int slot )
+{
+	// removes the client's entry only if it is still for this slot, since a newer slot for the client may have replaced it
+
+	assert( directory );
+	assert( slot >= 0 );
+	assert( slot < directory->num_slots );
+
+	proxy_platform_mutex_guard( &directory->mutex );
+
+	proxy_session_directory_table_t * table = directory->table;
+
+	const uint64_t hash = hash_address( address );
+
+	const uint64_t old_entry = proxy_session_directory_entry( hash, slot );
+
+	const int mask = table->capacity - 1;
+
+	int index = proxy_session_directory_home( table, hash );
+
+	bool removed = false;
+
+	for ( int i = 0; i < table->capacity; ++i )
+	{
+		const uint64_t entry = table->entries[index];
+
+		if ( entry == PROXY_SESSION_DIRECTORY_EMPTY )
+			break;
+
+		if ( entry == old_entry )
+		{
+			// nothing was placed past an empty entry, so the end of a probe run can go straight back to empty
+
+			if ( table->entries[( index + 1 ) & mask] == PROXY_SESSION_DIRECTORY_EMPTY )
+			{
+				__atomic_store_n( &table->entries[index], PROXY_SESSION_DIRECTORY_EMPTY, __ATOMIC_RELEASE );
+			}
+			else
+			{
+				__atomic_store_n( &table->entries[index], PROXY_SESSION_DIRECTORY_TOMBSTONE, __ATOMIC_RELEASE );
+				table->num_tombstones++;
+			}
+
+			table->num_entries--;
+			removed = true;
+			break;
+		}
+
+		index = ( index + 1 ) & mask;
+	}
+
+	proxy_session_directory_reclaim( directory );
+
+	return removed;
+}
+
+int proxy_session_directory_num_entries( proxy_session_directory_t * directory )
+{
+	assert( directory );
+
+	proxy_platform_mutex_guard( &directory->mutex );
+
+	return directory->table->num_entries;
+}
+
+static void test_session_directory_set_client( proxy_slot_data_t * slot_data, const proxy_address_t * client_address )
+{
+	// what the leasing thread does to a slot, without the rest of the proxy
+
+	const uint32_t state = __atomic_load_n( &slot_data->state, __ATOMIC_RELAXED );
+	__atomic_store_n( &slot_data->state, ( state & ~uint32_t( PROXY_SLOT_STATE_FLAGS ) ) + PROXY_SLOT_STATE_GENERATION, __ATOMIC_RELEASE );
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+	slot_data->client_address = *client_address;
+	__atomic_store_n( &slot_data->state, ( state & ~uint32_t( PROXY_SLOT_STATE_FLAGS ) ) + PROXY_SLOT_STATE_GENERATION + PROXY_SLOT_STATE_ALLOCATED, __ATOMIC_RELEASE );
+}
+
+static void test_session_directory_address( proxy_address_t * address, int i )
+{
+	if ( i % 3 == 0 )
+	{
+		char buffer[256];
+		sprintf( buffer, "[2001:db8::%x:%x]:%d", i >> 16, i & 0xFFFF, 40000 + i % 1000 );
+		proxy_check( proxy_address_parse( address, buffer ) );
+	}
+	else
+	{
+		memset( address, 0, sizeof(proxy_address_t) );
+		address->type = PROXY_ADDRESS_IPV4;
+		address->data.ipv4[0] = 10;
+		address->data.ipv4[1] = uint8_t( i >> 16 );
+		address->data.ipv4[2] = uint8_t( i >> 8 );
+		address->data.ipv4[3] = uint8_t( i );
+		address->port = uint16_t( 40000 + i % 1000 );
+	}
+}
+
+struct test_session_directory_thread_data_t
+{
+	proxy_session_directory_t * directory;
+	const proxy_address_t * addresses;
+	int num_stable;
+	uint32_t done;
+	bool failed;
+	uint64_t num_lookups;
+};
+
+static proxy_platform_thread_return_t PROXY_PLATFORM_THREAD_FUNC test_session_directory_thread_function( void * data )
+{
+	test_session_directory_thread_data_t * thread_data = (test_session_directory_thread_data_t*) data;
+
+	while ( !__atomic_load_n( &thread_data->done, __ATOMIC_ACQUIRE ) )
+	{
+		for ( int i = 0; i < thread_data->num_stable; ++i )
+		{
+			if ( proxy_session_directory_get( thread_data->directory, 1, &thread_data->addresses[i] ) != i )
+				thread_data->failed = true;
+
+			thread_data->num_lookups++;
+		}
+	}
+
+	PROXY_PLATFORM_THREAD_RETURN();
+}
+
+void test_session_directory()
+{
+	printf( "    test_session_directory\n" );
+
+	const int NumSlots = 256;
+
+	proxy_slot_data_t * slots = (proxy_slot_data_t*) calloc( NumSlots, sizeof(proxy_slot_data_t) );
+	proxy_check( slots );
+
+	proxy_session_directory_t * directory = proxy_session_directory_create( slots, NumSlots, 2 );
+	proxy_check( directory );
+
+	proxy_address_t addresses[NumSlots];
+
+	for ( int i = 0; i < NumSlots; ++i )
+	{
+		test_session_directory_address( &addresses[i], i );
+		test_session_directory_set_client( &slots[i], &addresses[i] );
+		proxy_check( proxy_session_directory_insert( directory, &addresses[i], i ) );
+	}
+
+	proxy_check( proxy_session_directory_num_entries( directory ) == NumSlots );
+
+	for ( int i = 0; i < NumSlots; ++i )
+	{
+		proxy_check( proxy_session_directory_get( directory, i % 2, &addresses[i] ) == i );
+	}
+
+	proxy_address_t unknown;
+	test_session_directory_address( &unknown, NumSlots );
+	proxy_check( proxy_session_directory_get( directory, 0, &unknown ) == -1 );
+
+	// remove half. an entry is only removed for the slot it is for
+
+	for ( int i = 0; i < NumSlots; i += 2 )
+	{
+		proxy_check( !proxy_session_directory_remove( directory, &addresses[i], i + 1 ) );
+		proxy_check( proxy_session_directory_remove( directory, &addresses[i], i ) );
+		proxy_check( !proxy_session_directory_remove( directory, &addresses[i], i ) );
+	}
+
+	proxy_check( proxy_session_directory_num_entries( directory ) == NumSlots / 2 );
+
+	for ( int i = 0; i < NumSlots; ++i )
+	{
+		proxy_check( proxy_session_directory_get( directory, 0, &addresses[i] ) == ( ( i % 2 ) ? i : -1 ) );
+	}
+
+	// a slot that moves on to another client stops matching, even before its entry is removed
+
+	test_session_directory_set_client( &slots[1], &unknown );
+	proxy_check( proxy_session_directory_get( directory, 0, &addresses[1] ) == -1 );
+	proxy_check( proxy_session_directory_get( directory, 0, &unknown ) == -1 );
+	proxy_check( proxy_session_directory_remove( directory, &addresses[1], 1 ) );
+	proxy_check( proxy_session_directory_insert( directory, &unknown, 1 ) );
+	proxy_check( proxy_session_directory_get( directory, 0, &unknown ) == 1 );
+
+	// a client given a new slot replaces its old entry, which the old slot can no longer remove
+
+	test_session_directory_set_client( &slots[0], &addresses[3] );
+	proxy_check( proxy_session_directory_insert( directory, &addresses[3], 0 ) );
+	proxy_check( proxy_session_directory_get( directory, 0, &addresses[3] ) == 0 );
+	proxy_check( !proxy_session_directory_remove( directory, &addresses[3], 3 ) );
+	proxy_check( proxy_session_directory_get( directory, 0, &addresses[3] ) == 0 );
+	proxy_check( proxy_session_directory_num_entries( directory ) == NumSlots / 2 );
+
+	// churn leaves tombstones behind, and rebuilds clear them without losing anyone. a reader inside the directory
+	// keeps the tables it could be probing alive until it leaves
+
+	const uint64_t parked_epoch = __atomic_load_n( &directory->epoch, __ATOMIC_SEQ_CST );
+	__atomic_store_n( &directory->readers[1].epoch, parked_epoch, __ATOMIC_SEQ_CST );
+
+	for ( int round = 0; round < 8; ++round )
+	{
+		for ( int slot = 2; slot < NumSlots; slot += 2 )
+		{
+			proxy_address_t address;
+			test_session_directory_address( &address, NumSlots * ( round + 2 ) + slot );
+			test_session_directory_set_client( &slots[slot], &address );
+			proxy_check( proxy_session_directory_insert( directory, &address, slot ) );
+			proxy_check( proxy_session_directory_get( directory, 0, &address ) == slot );
+		}
+
+		for ( int slot = 2; slot < NumSlots; slot += 2 )
+		{
+			proxy_check( proxy_session_directory_remove( directory, &slots[slot].client_address, slot ) );
+		}
+	}
+
+	proxy_check( __atomic_load_n( &directory->epoch, __ATOMIC_SEQ_CST ) > parked_epoch );
+	proxy_check( directory->retired );
+	proxy_check( directory->table->num_tombstones * 4 <= directory->table->capacity * 3 );
+
+	__atomic_store_n( &directory->readers[1].epoch, 0, __ATOMIC_SEQ_CST );
+
+	proxy_check( proxy_session_directory_remove( directory, &unknown, 1 ) );
+	proxy_check( directory->retired == NULL );
+
+	for ( int i = 5; i < NumSlots; i += 2 )
+	{
+		proxy_check( proxy_session_directory_get( directory, 0, &addresses[i] ) == i );
+	}
+
+	proxy_session_directory_destroy( directory );
+
+	// addresses picked to share one home entry still work, they just cost a longer probe. with any other key (every
+	// other process) the same addresses spread over the table, so an attacker needs the key to do this
+
+	directory = proxy_session_directory_create( slots, NumSlots, 2 );
+	proxy_check( directory );
+
+	const int NumCollidingAddresses = 100;
+
+	proxy_address_t colliding_addresses[NumCollidingAddresses];
+
+	int num_colliding_addresses = 0;
+
+	for ( int i = 0; num_colliding_addresses < NumCollidingAddresses; ++i )
+	{
+		proxy_address_t address;
+		memset( &address, 0, sizeof(address) );
+		address.type = PROXY_ADDRESS_IPV4;
+		address.data.ipv4[0] = 172;
+		address.data.ipv4[1] = uint8_t( i >> 16 );
+		address.data.ipv4[2] = uint8_t( i >> 8 );
+		address.data.ipv4[3] = uint8_t( i );
+		address.port = 20000;
+		if ( proxy_session_directory_home( directory->table, hash_address( &address ) ) == 0 )
+		{
+			colliding_addresses[num_colliding_addresses++] = address;
+		}
+	}
+
+	for ( int i = 0; i < NumCollidingAddresses; ++i )
+	{
+		test_session_directory_set_client( &slots[i], &colliding_addresses[i] );
+		proxy_check( proxy_session_directory_insert( directory, &colliding_addresses[i], i ) );
+	}
+
+	for ( int i = 0; i < NumCollidingAddresses; ++i )
+	{
+		proxy_check( proxy_session_directory_get( directory, 0, &colliding_addresses[i] ) == i );
+	}
+
+	for ( int i = 0; i < NumCollidingAddresses; ++i )
+	{
+		proxy_check( proxy_session_directory_remove( directory, &colliding_addresses[i], i ) );
+		proxy_check( proxy_session_directory_get( directory, 0, &colliding_addresses[i] ) == -1 );
+	}
+
+	proxy_check( proxy_session_directory_num_entries( directory ) == 0 );
+
+	uint64_t process_key[2];
+	next_hash_get_key( process_key );
+
+	const uint64_t other_key[2] = { 0x0123456789ABCDEFULL, 0xFEDCBA9876543210ULL };
+
+	next_hash_set_key( other_key );
+
+	bool * home_entries = (bool*) calloc( size_t( directory->table->capacity ), sizeof(bool) );
+	proxy_check( home_entries );
+
+	for ( int i = 0; i < NumCollidingAddresses; ++i )
+	{
+		home_entries[proxy_session_directory_home( directory->table, hash_address( &colliding_addresses[i] ) )] = true;
+	}
+
+	int num_home_entries = 0;
+	for ( int i = 0; i < directory->table->capacity; ++i )
+	{
+		num_home_entries += home_entries[i] ? 1 : 0;
+	}
+
+	proxy_check( num_home_entries >= NumCollidingAddresses / 2 );
+
+	free( home_entries );
+
+	next_hash_set_key( process_key );
+
+	proxy_session_directory_destroy( directory );
+
+	// a reader looks up clients that stay put the whole time, while the writer churns the rest of the slots and
+	// rebuilds the table under it again and again
+
+	directory = proxy_session_directory_create( slots, NumSlots, 2 );
+	proxy_check( directory );
+
+	const int NumStable = NumSlots / 4;
+
+	memset( slots, 0, sizeof(proxy_slot_data_t) * NumSlots );
+
+	for ( int i = 0; i < NumStable; ++i )
+	{
+		test_session_directory_set_client( &slots[i], &addresses[i] );
+		proxy_check( proxy_session_directory_insert( directory, &addresses[i], i ) );
+	}
+
+	test_session_directory_thread_data_t thread_data;
+	memset( &thread_data, 0, sizeof(thread_data) );
+	thread_data.directory = directory;
+	thread_data.addresses = addresses;
+	thread_data.num_stable = NumStable;
+
+	proxy_platform_thread_t * thread = proxy_platform_thread_create( test_session_directory_thread_function, &thread_data );
+	proxy_check( thread );
+
+	const uint64_t start_epoch = __atomic_load_n( &directory->epoch, __ATOMIC_SEQ_CST );
+
+	for ( int round = 0; round < 1000; ++round )
+	{
+		for ( int slot = NumStable; slot < NumSlots; ++slot )
+		{
+			proxy_address_t address;
+			test_session_directory_address( &address, NumSlots * ( round + 1 ) + slot );
+			test_session_directory_set_client( &slots[slot], &address );
+			proxy_check( proxy_session_directory_insert( directory, &address, slot ) );
+		}
+
+		for ( int slot = NumStable; slot < NumSlots; ++slot )
+		{
+			proxy_check( proxy_session_directory_remove( directory, &slots[slot].client_address, slot ) );
+		}
+	}
+
+	__atomic_store_n( &thread_data.done, 1, __ATOMIC_RELEASE );
+
+	proxy_platform_thread_join( thread );
+	proxy_platform_thread_destroy( thread );
+
+	proxy_check( !thread_data.failed );
+	proxy_check( thread_data.num_lookups > 0 );
+	proxy_check( __atomic_load_n( &directory->epoch, __ATOMIC_SEQ_CST ) > start_epoch );
+	proxy_check( proxy_session_directory_num_entries( directory ) == NumStable );
+
+	proxy_session_directory_destroy( directory );
+
+	free( slots );
+}
+
+void bench_session_directory()
+{
+	// per packet cost of a session directory lookup, with the keyed address hash and the check against the slot, as it grows
+
+	const int NumLookups = 1000000;
+
+	const int session_counts[] = { 64, 1024, 16384, 100000 };
+
+	int * lookups = (int*) malloc( sizeof(int) * NumLookups );
+
+	for ( int k = 0; k < int( sizeof(session_counts) / sizeof(int) ); ++k )
+	{
+		const int num_sessions = session_counts[k];
+
+		proxy_slot_data_t * slots = (proxy_slot_data_t*) calloc( num_sessions, sizeof(proxy_slot_data_t) );
+		proxy_check( slots );
+
+		proxy_session_directory_t * directory = proxy_session_directory_create( slots, num_sessions, 1 );
+		proxy_check( directory );
+
+		proxy_address_t * addresses = (proxy_address_t*) calloc( num_sessions, sizeof(proxy_address_t) );
+
+		for ( int i = 0; i < num_sessions; ++i )
+		{
+			addresses[i].type = PROXY_ADDRESS_IPV4;
+			addresses[i].data.ipv4[0] = 10;
+			addresses[i].data.ipv4[1] = uint8_t( i >> 16 );
+			addresses[i].data.ipv4[2] = uint8_t( i >> 8 );
+			addresses[i].data.ipv4[3] = uint8_t( i );
+			addresses[i].port = uint16_t( 10000 + ( i % 50000 ) );
+			test_session_directory_set_client( &slots[i], &addresses[i] );
+			proxy_check( proxy_session_directory_insert( directory, &addresses[i], i ) );
+		}
+
+		for ( int i = 0; i < NumLookups; ++i )
+		{
+			lookups[i] = rand() % num_sessions;
+		}
+
+		int found = 0;
+
+		const double start_time = proxy_time();
+		for ( int i = 0; i < NumLookups; ++i )
+		{
+			found += proxy_session_directory_get( directory, 0, &addresses[lookups[i]] ) == lookups[i];
+		}
+		const double find_time = proxy_time() - start_time;
+
+		proxy_check( found == NumLookups );
+
+		printf( "    session_directory: %6d sessions -> get %.1fns\n", num_sessions, find_time * 1000000000.0 / NumLookups );
+
+		free( addresses );
+
+		proxy_session_directory_destroy( directory );
+
+		free( slots );
+	}
+
+	free( lookups );
+}
+
+/*
+	Free slots are kept in one lock free stack per home thread. A thread leases from its own stack first, so slot packets
+	are usually processed by the thread that owns the client, and only takes from other threads' stacks when its own
+	runs dry. Total capacity is num_threads * num_slots_per_thread however unevenly SO_REUSEPORT spreads clients.
+
+	Each head packs a 32 bit tag above the slot index + 1, so a slot popped and pushed back between another thread's
+	load and compare exchange can't be mistaken for the head it saw.
+*/
+
+#define PROXY_SLOT_POOL_HEAD_STRIDE                                     8	// one head per cache line
+
+struct proxy_slot_pool_t
+{
+	int num_threads;
+	int num_slots_per_thread;
+	uint64_t * heads;
+	int * next;
+};
+
+proxy_slot_pool_t * proxy_slot_pool_create( int num_threads, int num_slots_per_thread )
+{
+	proxy_slot_pool_t * pool = (proxy_slot_pool_t*) calloc( 1, sizeof(proxy_slot_pool_t) );
+	if ( !pool )
+		return NULL;
+
+	const int num_slots = num_threads * num_slots_per_thread;
+
+	pool->num_threads = num_threads;
+	pool->num_slots_per_thread = num_slots_per_thread;
+	pool->heads = (uint64_t*) calloc( size_t(num_threads) * PROXY_SLOT_POOL_HEAD_STRIDE, sizeof(uint64_t) );
+	pool->next = (int*) calloc( size_t(num_slots) + 1, sizeof(int) );
+
+	if ( !pool->heads || !pool->next )
+	{
+		free( pool->heads );
+		free( pool->next );
+		free( pool );
+		return NULL;
+	}
+
+	// every slot starts free, lowest slot of each home thread on top
+
+	for ( int i = 0; i < num_threads; ++i )
+	{
+		const int first_slot = i * num_slots_per_thread;
+
+		for ( int j = 0; j < num_slots_per_thread; ++j )
+		{
+			pool->next[first_slot + j] = ( j + 1 < num_slots_per_thread ) ? first_slot + j + 1 : -1;
+		}
+
+		pool->heads[i * PROXY_SLOT_POOL_HEAD_STRIDE] = ( num_slots_per_thread > 0 ) ? uint64_t( first_slot + 1 ) : 0;
+	}
+
+	return pool;
+}
+
+void proxy_slot_pool_destroy( proxy_slot_pool_t * pool )
+{
+	assert( pool );
+	free( pool->heads );
+	free( pool->next );
+	free( pool );
+}
+
+static int proxy_slot_pool_pop_home( proxy_slot_pool_t * pool, int home )
+{
+	uint64_t * head = &pool->heads[home * PROXY_SLOT_POOL_HEAD_STRIDE];
+
+	uint64_t current = __atomic_load_n( head, __ATOMIC_ACQUIRE );
+
+	while ( true )
+	{
+		const int slot = int( current & 0xFFFFFFFFULL ) - 1;
+
+		if ( slot < 0 )
+			return -1;
+
+		const int next = __atomic_load_n( &pool->next[slot], __ATOMIC_RELAXED );
+
+		const uint64_t replacement = ( ( ( current >> 32 ) + 1 ) << 32 ) | uint64_t( uint32_t( next + 1 ) );
+
+		if ( __atomic_compare_exchange_n( head, &current, replacement, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+			return slot;
+	}
+}
+
+int proxy_slot_pool_pop( proxy_slot_pool_t * pool, int thread_number )
+{
+	// own slots first, then the other threads in turn
+
+	assert( pool );
+	assert( thread_number >= 0 );
+	assert( thread_number < pool->num_threads );
+
+	for ( int i = 0; i < pool->num_threads; ++i )
+	{
+		int home = thread_number + i;
+		if ( home >= pool->num_threads )
+			home -= pool->num_threads;
+
+		const int slot = proxy_slot_pool_pop_home( pool, home );
+		if ( slot >= 0 )
+			return slot;
+	}
+
+	return -1;
+}
+
+void proxy_slot_pool_push( proxy_slot_pool_t * pool, int slot )
+{
+	assert( pool );
+	assert( slot >= 0 );
+	assert( slot < pool->num_threads * pool->num_slots_per_thread );
+
+	uint64_t * head = &pool->heads[( slot / pool->num_slots_per_thread ) * PROXY_SLOT_POOL_HEAD_STRIDE];
+
+	uint64_t current = __atomic_load_n( head, __ATOMIC_RELAXED );
+
+	while ( true )
+	{
+		__atomic_store_n( &pool->next[slot], int( current & 0xFFFFFFFFULL ) - 1, __ATOMIC_RELAXED );
+
+		const uint64_t replacement = ( ( ( current >> 32 ) + 1 ) << 32 ) | uint64_t( uint32_t( slot + 1 ) );
+
+		if ( __atomic_compare_exchange_n( head, &current, replacement, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+			return;
+	}
+}
+
+/*
+	The main thread moves steering buckets between proxy threads. It sets the bucket's new owner and bumps the epoch.
+	Each proxy thread that sees a new epoch hands its clients in buckets owned by other threads to their owners, then
+	acks the epoch. Only once every thread has acked does the main thread point the reuseport steering program at
+	the new owner, so packets still arriving on the old thread's socket find their session gone and are forwarded.
+*/
+
+struct proxy_steering_t
+{
+	int owners[PROXY_STEERING_BUCKETS];
+	uint32_t epoch;
+};
+
+void proxy_steering_init( proxy_steering_t * steering )
+{
+	assert( steering );
+	for ( int i = 0; i < PROXY_STEERING_BUCKETS; ++i )
+	{
+		steering->owners[i] = -1;
+	}
+	steering->epoch = 0;
+}
+
+int proxy_steering_cpu_sockets()
+{
+	// with cpu placement, buckets without an owner go to the thread pinned to the core whose nic queue received the packet
+
+	return config.cpu_placement ? config.num_threads : 0;
+}
+
+struct proxy_thread_data_t
+{
+	int thread_number;
+	proxy_session_directory_t * session_directory;
+	next_timer_wheel_t * slot_timers;
+	proxy_slot_data_t * slots;
+	proxy_slot_pool_t * slot_pool;
+	int lru_slot_head;
+	int lru_slot_tail;
+	proxy_steering_t * steering;
+	uint32_t steering_epoch;
+	proxy_thread_data_t ** peers;
+	proxy_ring_t * handoff_ring;
+	proxy_platform_mutex_t handoff_mutex;
+	bool draining_handoff;
+	uint64_t busy_nanoseconds;
+	uint64_t packets_received;
+	uint64_t bucket_packets[PROXY_STEERING_BUCKETS];
+	uint32_t placed;
+	proxy_platform_thread_t * thread;
+	proxy_platform_socket_t * socket;
+	proxy_platform_socket_t ** thread_sockets;
+	proxy_platform_socket_t ** slot_sockets;
+	proxy_platform_socket_t * tunnel_socket;
+	next_platform_socket_t * next_socket;
+	proxy_send_queue_t * send_queue;
+	proxy_packet_pool_t * packet_pool;
+	int * receive_buffers;
+	uint8_t ** receive_packet_data;
+	int receive_index;
+	proxy_ring_t * next_ring;
+	proxy_ring_t * return_ring;
+	proxy_platform_event_t * return_event;
+	uint32_t return_waiting;
+	uint32_t * next_waiting;
+	proxy_platform_xdp_t * xdp;
+};
+
+extern next_platform_socket_t * next_server_socket( next_server_t * server );
+
+#define PROXY_MAX_POLL_EVENTS                                        1024
+#define PROXY_MAX_PACKETS_PER_RECEIVE                                  64
+#define PROXY_POLL_ID_THREAD_SOCKET                        0xFFFFFFFFULL
+#define PROXY_POLL_ID_RETURN_EVENT                         0xFFFFFFFEULL
+#define PROXY_POLL_ID_TUNNEL_SOCKET                        0xFFFFFFFDULL
+
+/*
+	Slot allocation is O(1). Free slots come from the slot pool. Slots leased by a thread sit on that thread's doubly
+	linked list in order of last activity, least recent at the head, so when the pool is empty the only candidate for
+	reuse is the head.
+*/
+
+static void proxy_thread_init_slots( proxy_thread_data_t * thread_data )
+{
+	thread_data->lru_slot_head = -1;
+	thread_data->lru_slot_tail = -1;
+}
+
+static inline bool proxy_thread_leases_slot( const proxy_thread_data_t * thread_data, int slot )
+{
+	const proxy_slot_data_t * slot_data = &thread_data->slots[slot];
+	return ( proxy_slot_state( slot_data ) & PROXY_SLOT_STATE_ALLOCATED ) && __atomic_load_n( &slot_data->lessee, __ATOMIC_RELAXED ) == uint32_t( thread_data->thread_number );
+}
+
+static void proxy_thread_lru_unlink( proxy_thread_data_t * thread_data, int slot )
+{
+	proxy_slot_data_t * slot_data = &thread_data->slots[slot];
+
+	if ( slot_data->list_prev >= 0 )
+		thread_data->slots[slot_data->list_prev].list_next = slot_data->list_next;
+	else
+		thread_data->lru_slot_head = slot_data->list_next;
+
+	if ( slot_data->list_next >= 0 )
+		thread_data->slots[slot_data->list_next].list_prev = slot_data->list_prev;
+	else
+		thread_data->lru_slot_tail = slot_data->list_prev;
+
+	slot_data->list_prev = -1;
+	slot_data->list_next = -1;
+}
+
+static void proxy_thread_lru_append( proxy_thread_data_t * thread_data, int slot )
+{
+	proxy_slot_data_t * slot_data = &thread_data->slots[slot];
+
+	slot_data->list_prev = thread_data->lru_slot_tail;
+	slot_data->list_next = -1;
+
+	if ( thread_data->lru_slot_tail >= 0 )
+		thread_data->slots[thread_data->lru_slot_tail].list_next = slot;
+	else
+		thread_data->lru_slot_head = slot;
+
+	thread_data->lru_slot_tail = slot;
+}
+
+static void proxy_thread_touch_slot( proxy_thread_data_t * thread_data, int slot, double current_time )
+{
+	assert( slot >= 0 );
+	assert( slot < config.num_threads * config.num_slots_per_thread );
+
+	// a payload can race the slot changing hands. only the leasing thread keeps a slot alive
+
+	if ( !proxy_thread_leases_slot( thread_data, slot ) )
+		return;
+
+	thread_data->slots[slot].last_packet_receive_time = current_time;
+
+	if ( thread_data->lru_slot_tail != slot )
+	{
+		proxy_thread_lru_unlink( thread_data, slot );
+		proxy_thread_lru_append( thread_data, slot );
+	}
+}
+
+static void proxy_thread_release_client( proxy_thread_data_t * thread_data, int slot )
+{
+	// the client loses the slot. bumping the generation tells readers on the home thread their copy of the address is stale
+
+	proxy_slot_data_t * slot_data = &thread_data->slots[slot];
+
+	proxy_session_directory_remove( thread_data->session_directory, &slot_data->client_address, slot );
+
+	const uint32_t state = __atomic_load_n( &slot_data->state, __ATOMIC_RELAXED );
+
+	__atomic_store_n( &slot_data->state, ( state & ~uint32_t( PROXY_SLOT_STATE_FLAGS ) ) + PROXY_SLOT_STATE_GENERATION, __ATOMIC_RELEASE );
+
+	// and the kernel stops forwarding for it. the main thread removes the client's own entry when it sees the new generation
+
+	if ( thread_data->xdp )
+	{
+		proxy_platform_xdp_slot_set( thread_data->xdp, slot, NULL );
+	}
+
+	proxy_thread_lru_unlink( thread_data, slot );
+}
+
+static void proxy_thread_free_slot( proxy_thread_data_t * thread_data, int slot )
+{
+	assert( proxy_thread_leases_slot( thread_data, slot ) );
+
+	proxy_thread_release_client( thread_data, slot );
+
+	proxy_slot_pool_push( thread_data->slot_pool, slot );
+}
+
+static int proxy_thread_allocate_slot( proxy_thread_data_t * thread_data, const proxy_address_t * from, double current_time )
+{
+	// returns the slot now leased to the client, or -1 if every slot is busy (and eviction is off) or the session directory could not rebuild
+
+	int slot = proxy_slot_pool_pop( thread_data->slot_pool, thread_data->thread_number );
+
+	if ( slot < 0 )
+	{
+		slot = thread_data->lru_slot_head;
+
+		if ( slot < 0 )
+			return -1;
+
+		// the slot can time out here before its timer fires. otherwise only evict when configured to
+
+		const bool timed_out = current_time - thread_data->slots[slot].last_packet_receive_time >= config.slot_timeout_seconds;
+
+		if ( !timed_out && !config.slot_evict_lru )
+			return -1;
+
+		debug_printf( "proxy thread %d slot %d evicted its client\n", thread_data->thread_number, slot );
+
+		proxy_thread_release_client( thread_data, slot );
+	}
+
+	proxy_slot_data_t * slot_data = &thread_data->slots[slot];
+
+	assert( !( proxy_slot_state( slot_data ) & PROXY_SLOT_STATE_ALLOCATED ) );
+
+	// the release fence keeps the address writes after the generation bump, for readers copying it on the home thread
+
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+
+	__atomic_store_n( &slot_data->lessee, uint32_t( thread_data->thread_number ), __ATOMIC_RELAXED );
+
+	slot_data->client_address = *from;
+
+	slot_data->last_packet_receive_time = current_time;
+
+	const uint32_t state = __atomic_load_n( &slot_data->state, __ATOMIC_RELAXED );
+
+	__atomic_store_n( &slot_data->state, ( state & ~uint32_t( PROXY_SLOT_STATE_FLAGS ) ) | PROXY_SLOT_STATE_ALLOCATED, __ATOMIC_RELEASE );
+
+	proxy_thread_lru_append( thread_data, slot );
+
+	if ( !proxy_session_directory_insert( thread_data->session_directory, from, slot ) )
+	{
+		proxy_thread_free_slot( thread_data, slot );
+		return -1;
+	}
+
+	next_timer_wheel_schedule( thread_data->slot_timers, slot, current_time + config.slot_timeout_seconds );
+
+	return slot;
+}
+
+static void proxy_thread_send_to_next( proxy_thread_data_t * thread_data, const uint8_t * packet_data, int packet_bytes )
+{
+	// hand the packet to the next server thread in-process. ring the doorbell only if the next server thread is parked on its socket
+
+	proxy_ring_entry_t header;
+	memset( &header, 0, sizeof(header) );
+
+	if ( !proxy_ring_push( thread_data->next_ring, &header, packet_data, packet_bytes ) )
+	{
+		debug_printf( "proxy thread %d dropped packet. next ring is full\n", thread_data->thread_number );
+		return;
+	}
+
+	if ( proxy_producer_should_wake( thread_data->next_waiting ) )
+	{
+		const uint8_t doorbell = NEXT_DOORBELL_PACKET;
+		next_platform_socket_send_packet( thread_data->next_socket, (next_address_t*) &config.next_local_address, &doorbell, 1 );
+	}
+}
+
+static bool proxy_thread_holds_received_packet( const proxy_thread_data_t * thread_data, const uint8_t * packet_data, int packet_bytes )
+{
+	// true if these bytes are in the receive buffer of the packet being processed, so they can be sent from there
+
+	const int index = thread_data->receive_index;
+
+	return thread_data->packet_pool && index >= 0 && proxy_packet_pool_buffer_holds( thread_data->packet_pool, thread_data->receive_buffers[index], packet_data, packet_bytes );
+}
+
+static void proxy_thread_send_packet( proxy_thread_data_t * thread_data, proxy_platform_socket_t * socket, const proxy_address_t * to, const uint8_t * packet_data, int packet_bytes )
+{
+	// a received packet goes out from its receive buffer, and the receive slot gets a fresh buffer from the pool in its place.
+	// anything else, or if the pool has run dry, is copied into the send queue
+
+	if ( proxy_thread_holds_received_packet( thread_data, packet_data, packet_bytes ) )
+	{
+		const int buffer = proxy_packet_pool_alloc( thread_data->packet_pool );
+
+		if ( buffer >= 0 )
+		{
+			const int index = thread_data->receive_index;
+
+			proxy_send_queue_packet_by_reference( thread_data->send_queue, socket, to, (uint8_t*) packet_data, packet_bytes, thread_data->receive_buffers[index] );
+
+			thread_data->receive_buffers[index] = buffer;
+			thread_data->receive_packet_data[index] = proxy_packet_pool_data( thread_data->packet_pool, buffer );
+			thread_data->receive_index = -1;
+
+			return;
+		}
+	}
+
+	proxy_send_queue_packet( thread_data->send_queue, socket, to, packet_data, packet_bytes );
+}
+
+static void proxy_thread_send_to_server( proxy_thread_data_t * thread_data, int slot, const proxy_address_t * to, const uint8_t * packet_data, int packet_bytes )
+{
+	// through the slot's own socket, or in tunnel mode, the tunnel socket of the thread that owns the slot, with the slot in front
+
+	assert( slot >= 0 );
+	assert( slot < config.num_threads * config.num_slots_per_thread );
+
+	proxy_platform_socket_t * socket = thread_data->slots[slot].socket;
+
+	if ( !config.tunnel )
+	{
+		proxy_thread_send_packet( thread_data, socket, to, packet_data, packet_bytes );
+		return;
+	}
+
+	// a received packet has headroom for the tunnel header
+
+	uint8_t * in_place = (uint8_t*) packet_data - PROXY_TUNNEL_HEADER_BYTES;
+
+	if ( proxy_thread_holds_received_packet( thread_data, in_place, PROXY_TUNNEL_HEADER_BYTES + packet_bytes ) )
+	{
+		proxy_tunnel_write_header( in_place, slot );
+		proxy_thread_send_packet( thread_data, socket, to, in_place, PROXY_TUNNEL_HEADER_BYTES + packet_bytes );
+		return;
+	}
+
+	uint8_t * tunnel_packet = proxy_send_queue_reserve( thread_data->send_queue, socket, to, PROXY_TUNNEL_HEADER_BYTES + packet_bytes );
+
+	proxy_tunnel_write_header( tunnel_packet, slot );
+
+	memcpy( tunnel_packet + PROXY_TUNNEL_HEADER_BYTES, packet_data, packet_bytes );
+}
+
+static void proxy_thread_process_return_ring( proxy_thread_data_t * thread_data )
+{
+	// packets the next server thread wants sent. only take what is there now, so a busy next server can't starve the sockets
+
+	const int num_entries = proxy_ring_count( thread_data->return_ring );
+
+	const double current_time = proxy_time();
+
+	for ( int i = 0; i < num_entries; ++i )
+	{
+		proxy_ring_entry_t * entry = proxy_ring_peek( thread_data->return_ring );
+
+		assert( entry );
+
+		const uint8_t * packet_data = (const uint8_t*) ( entry + 1 );
+
+		if ( entry->slot < 0 )
+		{
+			proxy_send_queue_packet( thread_data->send_queue, thread_data->socket, &entry->address, packet_data, entry->packet_bytes );
+		}
+		else
+		{
+			// payload from a client on network next. this keeps its slot alive, just like its passthrough packets do.
+			// the slot may have changed hands since the payload was queued. it belongs to the old client, so drop it
+
+			assert( entry->slot < config.num_threads * config.num_slots_per_thread );
+			assert( proxy_session_handle_slot( entry->session_handle ) == entry->slot );
+
+			if ( proxy_thread_leases_slot( thread_data, entry->slot ) && proxy_session_handle_matches( entry->session_handle, proxy_slot_state( &thread_data->slots[entry->slot] ) ) )
+			{
+				proxy_thread_send_to_server( thread_data, entry->slot, &entry->address, packet_data, entry->packet_bytes );
+				proxy_thread_touch_slot( thread_data, entry->slot, current_time );
+			}
+			else
+			{
+				debug_printf( "proxy thread %d dropped payload for slot %d. the slot changed hands\n", thread_data->thread_number, entry->slot );
+			}
+		}
+
+		proxy_ring_pop( thread_data->return_ring );
+	}
+}
+
+/*
+	Client migration. A thread hands a client to the thread that owns its steering bucket by pushing an adopt message
+	onto the owner's handoff ring. Packets a thread receives for clients it no longer has, in buckets owned by another
+	thread, follow on the same ring, so they can't overtake the adopt and nothing is dropped while the kernel catches up.
+*/
+
+static inline void proxy_counter_add( uint64_t * counter, uint64_t value )
+{
+	// one writer per counter, so no locked add. other threads read it with an atomic load
+
+	__atomic_store_n( counter, __atomic_load_n( counter, __ATOMIC_RELAXED ) + value, __ATOMIC_RELAXED );
+}
+
+static inline int proxy_thread_bucket_owner( const proxy_thread_data_t * thread_data, const proxy_address_t * address )
+{
+	if ( !thread_data->steering )
+		return -1;
+
+	const int bucket = proxy_steering_bucket( address );
+	if ( bucket < 0 )
+		return -1;
+
+	return __atomic_load_n( &thread_data->steering->owners[bucket], __ATOMIC_RELAXED );
+}
+
+static void proxy_thread_wake( proxy_thread_data_t * thread_data )
+{
+	if ( proxy_producer_should_wake( &thread_data->return_waiting ) )
+	{
+		proxy_platform_event_signal( thread_data->return_event );
+	}
+}
+
+static bool proxy_thread_hand_off_client( proxy_thread_data_t * thread_data, int slot, int owner )
+{
+	// the client keeps its slot. returns false, with nothing changed, if the adopt message doesn't fit on the owner's handoff ring
+
+	assert( proxy_thread_leases_slot( thread_data, slot ) );
+	assert( owner >= 0 );
+	assert( owner < config.num_threads );
+	assert( owner != thread_data->thread_number );
+
+	proxy_thread_data_t * peer = thread_data->peers[owner];
+
+	proxy_slot_data_t * slot_data = &thread_data->slots[slot];
+
+	proxy_platform_mutex_guard( &peer->handoff_mutex );
+
+	if ( proxy_ring_full( peer->handoff_ring ) )
+		return false;
+
+	proxy_thread_lru_unlink( thread_data, slot );
+
+	// release, so a thread that sees the client moving to it also sees the slot as it was handed off. the owner parks
+	// packets it receives for the client behind the adopt message, and it takes the handoff mutex to do it, so the
+	// adopt message is always on the ring first
+
+	__atomic_store_n( &slot_data->lessee, uint32_t( owner ) | PROXY_SLOT_LESSEE_MOVING, __ATOMIC_RELEASE );
+
+	proxy_ring_entry_t header;
+	memset( &header, 0, sizeof(header) );
+	header.slot = slot;
+	header.address = slot_data->client_address;
+
+	const double last_packet_receive_time = slot_data->last_packet_receive_time;
+
+	if ( !proxy_ring_push( peer->handoff_ring, &header, (const uint8_t*) &last_packet_receive_time, int( sizeof(double) ) ) )
+	{
+		__atomic_store_n( &slot_data->lessee, uint32_t( thread_data->thread_number ), __ATOMIC_RELEASE );
+		proxy_thread_lru_append( thread_data, slot );
+		return false;
+	}
+
+	proxy_thread_wake( peer );
+
+	return true;
+}
+
+static void proxy_thread_adopt_client( proxy_thread_data_t * thread_data, int slot, double last_packet_receive_time )
+{
+	assert( slot >= 0 );
+	assert( slot < config.num_threads * config.num_slots_per_thread );
+
+	proxy_slot_data_t * slot_data = &thread_data->slots[slot];
+
+	assert( __atomic_load_n( &slot_data->lessee, __ATOMIC_RELAXED ) == ( uint32_t( thread_data->thread_number ) | PROXY_SLOT_LESSEE_MOVING ) );
+
+	// the client's directory entry stays as it is. only the lessee changes
+
+	__atomic_store_n( &slot_data->lessee, uint32_t( thread_data->thread_number ), __ATOMIC_RELAXED );
+
+	slot_data->last_packet_receive_time = last_packet_receive_time;
+
+	proxy_thread_lru_append( thread_data, slot );
+
+	next_timer_wheel_schedule( thread_data->slot_timers, slot, last_packet_receive_time + config.slot_timeout_seconds );
+}
+
+static void proxy_thread_update_steering( proxy_thread_data_t * thread_data )
+{
+	// on a new steering epoch, hand off every client in a bucket owned by another thread. the epoch is only acked once all of them are gone
+
+	if ( !thread_data->steering )
+		return;
+
+	const uint32_t epoch = __atomic_load_n( &thread_data->steering->epoch, __ATOMIC_ACQUIRE );
+
+	if ( epoch == thread_data->steering_epoch )
+		return;
+
+	bool handed_off_all = true;
+
+	int slot = thread_data->lru_slot_head;
+
+	while ( slot >= 0 )
+	{
+		const int next_slot = thread_data->slots[slot].list_next;
+
+		const int owner = proxy_thread_bucket_owner( thread_data, &thread_data->slots[slot].client_address );
+
+		if ( owner >= 0 && owner != thread_data->thread_number && !proxy_thread_hand_off_client( thread_data, slot, owner ) )
+		{
+			handed_off_all = false;
+		}
+
+		slot = next_slot;
+	}
+
+	if ( handed_off_all )
+	{
+		__atomic_store_n( &thread_data->steering_epoch, epoch, __ATOMIC_RELEASE );
+	}
+}
+
+static void proxy_thread_push_client_packet( proxy_thread_data_t * thread_data, int peer_number, const proxy_address_t * from, uint8_t * buffer, int packet_bytes )
+{
+	// hands a client packet to a proxy thread, which processes it as if it had received it. a thread can push onto its own ring, to park a packet until it has caught up
+
+	assert( peer_number >= 0 );
+	assert( peer_number < config.num_threads );
+
+	const int prefix = PROXY_NEXT_PREFIX_BYTES;
+
+	proxy_thread_data_t * peer = thread_data->peers[peer_number];
+
+	proxy_ring_entry_t header;
+	memset( &header, 0, sizeof(header) );
+	header.slot = -1;
+	header.address = *from;
+
+	proxy_platform_mutex_acquire( &peer->handoff_mutex );
+
+	const bool pushed = proxy_ring_push( peer->handoff_ring, &header, buffer, prefix + packet_bytes );
+
+	proxy_platform_mutex_release( &peer->handoff_mutex );
+
+	if ( pushed )
+	{
+		proxy_thread_wake( peer );
+	}
+	else
+	{
+		debug_printf( "proxy thread %d dropped packet. handoff ring for thread %d is full\n", thread_data->thread_number, peer_number );
+	}
+}
+
+static bool proxy_thread_forward_client_packet( proxy_thread_data_t * thread_data, const proxy_address_t * from, uint8_t * buffer, int packet_bytes )
+{
+	// returns true if the client's bucket belongs to another thread, which now has the packet (or it was dropped because that thread's ring is full)
+
+	const int owner = proxy_thread_bucket_owner( thread_data, from );
+
+	if ( owner < 0 || owner == thread_data->thread_number )
+		return false;
+
+	proxy_thread_push_client_packet( thread_data, owner, from, buffer, packet_bytes );
+
+	return true;
+}
+
+static void proxy_thread_forward_to_lessee( proxy_thread_data_t * thread_data, int lessee, const proxy_address_t * from, uint8_t * buffer, int packet_bytes )
+{
+	// the client already has a slot on another thread. that thread gets the packet, so the client never ends up with two slots
+
+	// when the client is moving here, its adopt message wasn't on the handoff ring yet. the packet goes on the ring behind
+	// it and is processed once the client is adopted. if the hand off failed instead, it is forwarded back to the lessee
+
+	proxy_thread_push_client_packet( thread_data, lessee, from, buffer, packet_bytes );
+}
+
+static void proxy_thread_process_client_packet( proxy_thread_data_t * thread_data, const proxy_address_t * from, uint8_t * buffer, int packet_bytes );
+
+static void proxy_thread_process_handoff_ring( proxy_thread_data_t * thread_data )
+{
+	// adopted clients and packets forwarded by other proxy threads. a forwarded packet never drains the ring again
+
+	if ( !thread_data->handoff_ring || thread_data->draining_handoff )
+		return;
+
+	thread_data->draining_handoff = true;
+
+	const int prefix = PROXY_NEXT_PREFIX_BYTES;
+
+	const int num_entries = proxy_ring_count( thread_data->handoff_ring );
+
+	for ( int i = 0; i < num_entries; ++i )
+	{
+		proxy_ring_entry_t * entry = proxy_ring_peek( thread_data->handoff_ring );
+
+		assert( entry );
+
+		uint8_t * entry_data = (uint8_t*) ( entry + 1 );
+
+		if ( entry->slot >= 0 )
+		{
+			double last_packet_receive_time;
+			memcpy( &last_packet_receive_time, entry_data, sizeof(double) );
+			proxy_thread_adopt_client( thread_data, entry->slot, last_packet_receive_time );
+		}
+		else
+		{
+			proxy_thread_process_client_packet( thread_data, &entry->address, entry_data, entry->packet_bytes - prefix );
+		}
+
+		proxy_ring_pop( thread_data->handoff_ring );
+	}
+
+	thread_data->draining_handoff = false;
+}
+
+static int proxy_thread_find_client( proxy_thread_data_t * thread_data, const proxy_address_t * from, int * lessee )
+{
+	// returns the client's slot only if this thread leases it. otherwise lessee is the thread the client's slot is leased to, or -1 if it has none
+
+	assert( lessee );
+
+	*lessee = -1;
+
+	const int slot = proxy_session_directory_get( thread_data->session_directory, thread_data->thread_number, from );
+
+	if ( slot < 0 )
+		return -1;
+
+	// a client that just migrated here can send before its adopt message is processed. take it before treating the client as new
+
+	if ( !proxy_thread_leases_slot( thread_data, slot ) && thread_data->handoff_ring && !thread_data->draining_handoff && proxy_ring_count( thread_data->handoff_ring ) != 0 )
+	{
+		proxy_thread_process_handoff_ring( thread_data );
+	}
+
+	if ( proxy_thread_leases_slot( thread_data, slot ) )
+		return slot;
+
+	if ( proxy_slot_state( &thread_data->slots[slot] ) & PROXY_SLOT_STATE_ALLOCATED )
+	{
+		*lessee = int( __atomic_load_n( &thread_data->slots[slot].lessee, __ATOMIC_ACQUIRE ) & ~PROXY_SLOT_LESSEE_MOVING );
+	}
+
+	return -1;
+}
+
+static void proxy_thread_process_slot_packet( proxy_thread_data_t * thread_data, int slot, uint8_t * buffer, int packet_bytes )
+{
+	const int prefix = PROXY_NEXT_PREFIX_BYTES;
+
+	uint8_t * packet_data = buffer + prefix;
+
+	// slot is the index among this thread's own slot sockets. the client may be leased to any proxy thread
+
+	proxy_slot_data_t * slot_data = &thread_data->slots[thread_data->thread_number * config.num_slots_per_thread + slot];
+
+    char string_buffer[1024];
+    
+    (void) string_buffer;
+
+	uint32_t state;
+
+	proxy_address_t client_address;
+
+	if ( !proxy_slot_read_client( slot_data, &state, &client_address ) )
+	{
+        debug_printf( "proxy thread %d slot %d received packet, but slot is not allocated\n", thread_data->thread_number, slot );
+        return;
+	}
+
+	if ( !( state & PROXY_SLOT_STATE_NEXT ) )
+	{
+		// forward packet to client as passthrough packet
+
+		debug_printf( "proxy thread %d forwarded %d byte packet to client for slot %d (%s)\n", thread_data->thread_number, packet_bytes + 1, slot, proxy_address_to_string( &client_address, string_buffer ) );
+
+		packet_data -= 1;
+		packet_bytes += 1;
+
+        packet_data[0] = NEXT_PASSTHROUGH_PACKET;
+		const int index = proxy_thread_for_address( &client_address );
+		proxy_thread_send_packet( thread_data, thread_data->thread_sockets[index], &client_address, packet_data, packet_bytes );
+	}
+	else
+	{
+		// forward packet to client through next server
+
+        proxy_write_next_prefix( buffer, NEXT_FORWARD_PACKET_TO_CLIENT, proxy_session_handle( thread_data->thread_number * config.num_slots_per_thread + slot, state ) );
+
+        packet_data = buffer;
+        packet_bytes += prefix;
+
+		proxy_thread_send_to_next( thread_data, packet_data, packet_bytes );
+	}
+}
+
+static void proxy_thread_process_tunnel_packet( proxy_thread_data_t * thread_data, const proxy_address_t * from, uint8_t * buffer, int packet_bytes )
+{
+	// the same as a packet on one of this thread's slot sockets, once the tunnel header is off
+
+	const int prefix = PROXY_NEXT_PREFIX_BYTES;
+
+	// a connected tunnel socket only ever receives from the server. without slot connect, anyone could write a tunnel
+	// header for any slot, so check the source here
+
+	if ( !proxy_address_equal( from, &config.server_address ) )
+	{
+		debug_printf( "proxy thread %d dropped tunnel packet. it did not come from the server\n", thread_data->thread_number );
+		return;
+	}
+
+	const int slot = proxy_tunnel_read_header( buffer + prefix, packet_bytes );
+
+	const int first_slot = thread_data->thread_number * config.num_slots_per_thread;
+
+	if ( slot < first_slot || slot >= first_slot + config.num_slots_per_thread )
+	{
+		debug_printf( "proxy thread %d dropped tunnel packet for slot %d\n", thread_data->thread_number, slot );
+		return;
+	}
+
+	proxy_thread_process_slot_packet( thread_data, slot - first_slot, buffer + PROXY_TUNNEL_HEADER_BYTES, packet_bytes - PROXY_TUNNEL_HEADER_BYTES );
+}
+
+static void proxy_thread_process_client_packet( proxy_thread_data_t * thread_data, const proxy_address_t * from, uint8_t * buffer, int packet_bytes )
+{
+	const int prefix = PROXY_NEXT_PREFIX_BYTES;
+
+	uint8_t * packet_data = buffer + prefix;
+
+    char string_buffer[1024];
+
+    (void) string_buffer;
+
+	if ( packet_data[0] == 0 )
+	{
+		// passthrough packet
+
+		int lessee;
+
+		int slot = proxy_thread_find_client( thread_data, from, &lessee );
+
+		if ( slot != -1 )
+  		{
+  			// found existing slot for client
+  			
+  			assert( slot >= 0 );
+  			assert( slot < config.num_threads * config.num_slots_per_thread );
+
+			if ( proxy_thread_leases_slot( thread_data, slot ) )
+			{
+				// forward packet to server
+
+				debug_printf( "proxy thread %d forwarded packet to server for slot %d\n", thread_data->thread_number, slot );
+				
+				proxy_thread_send_to_server( thread_data, slot, &config.server_address, packet_data + 1, packet_bytes - 1 );
+                
+                proxy_thread_touch_slot( thread_data, slot, proxy_time() );
+			}
+			else
+			{
+  				debug_printf( "proxy thread %d dropped packet because slot %d is not allocated?\n", thread_data->thread_number, slot );
+			}
+  		}
+  		else if ( lessee >= 0 )
+  		{
+  			proxy_thread_forward_to_lessee( thread_data, lessee, from, buffer, packet_bytes );
+  		}
+  		else if ( !proxy_thread_forward_client_packet( thread_data, from, buffer, packet_bytes ) )
+  		{
+  			// new client. add to slot if possible
+
+  			const int slot = proxy_thread_allocate_slot( thread_data, from, proxy_time() );
+
+  			if ( slot < 0 )
+  			{
+  				debug_printf( "proxy thread %d dropped packet. no client slot found for address %s\n", thread_data->thread_number, proxy_address_to_string( from, string_buffer ) );
+  				return;
+  			}
+
+			printf( "proxy thread %d slot %d has new client %s\n", thread_data->thread_number, slot, proxy_address_to_string( from, string_buffer ) );
+			fflush( stdout );
+
+			// forward packet to server
+
+            assert( slot >= 0 );
+            assert( slot < config.num_threads * config.num_slots_per_thread );
+
+			proxy_thread_send_to_server( thread_data, slot, &config.server_address, packet_data + 1, packet_bytes - 1 );
+
+			// send dummy passthrough packet to the next thread so it sees the new client and upgrades it. built on the side, since the packet may still be queued from its receive buffer
+
+			uint8_t dummy_packet[PROXY_NEXT_PREFIX_BYTES + 1];
+
+            proxy_write_next_prefix( dummy_packet, NEXT_PASSTHROUGH_PACKET, proxy_session_handle( slot, proxy_slot_state( &thread_data->slots[slot] ) ) );
+
+            dummy_packet[prefix] = 0;
+
+			proxy_thread_send_to_next( thread_data, dummy_packet, prefix + 1 );
+  		}
+	}
+	else
+	{
+		// other packet types
+
+		if ( !proxy_basic_packet_filter( packet_data, packet_bytes ) )
+		{
+			debug_printf( "basic packet filter dropped packet\n" );
+			return;
+		}
+
+        const uint8_t packet_type = packet_data[0];
+
+        switch ( packet_type )
+        {
+        	case NEXT_PASSTHROUGH_PACKET:
+        	case NEXT_DIRECT_PACKET:
+        	case NEXT_DIRECT_PING_PACKET:
+			case NEXT_UPGRADE_RESPONSE_PACKET:
+			case NEXT_CLIENT_STATS_PACKET:
+			case NEXT_ROUTE_UPDATE_ACK_PACKET:
+			default:
+				break;
+        }
+        
+		int lessee;
+
+		int slot = proxy_thread_find_client( thread_data, from, &lessee );
+		if ( slot == -1 )
+		{
+			if ( lessee >= 0 )
+			{
+				proxy_thread_forward_to_lessee( thread_data, lessee, from, buffer, packet_bytes );
+			}
+			else
+			{
+				proxy_thread_forward_client_packet( thread_data, from, buffer, packet_bytes );
+			}
+			return;
+		}
+
+		proxy_thread_touch_slot( thread_data, slot, proxy_time() );
+
+        packet_data = buffer;
+        packet_bytes += prefix;
+
+        proxy_write_next_prefix( packet_data, packet_type, proxy_session_handle( slot, proxy_slot_state( &thread_data->slots[slot] ) ) );
+
+        // forward packet to next server
+
+		proxy_thread_send_to_next( thread_data, packet_data, packet_bytes );
+	}
+}
+
+void test_slot_allocator()
+{
+	printf( "    test_slot_allocator\n" );
+
+	const proxy_config_t saved_config = config;
+
+	config.num_threads = 2;
+	config.num_slots_per_thread = 2;
+	config.slot_timeout_seconds = 60;
+	config.slot_evict_lru = 0;
+
+	const int NumSlots = 4;
+
+	proxy_slot_data_t * slots = (proxy_slot_data_t*) calloc( NumSlots, sizeof(proxy_slot_data_t) );
+	proxy_slot_pool_t * slot_pool = proxy_slot_pool_create( config.num_threads, config.num_slots_per_thread );
+	proxy_session_directory_t * session_directory = proxy_session_directory_create( slots, NumSlots, 2 );
+	proxy_check( slots );
+	proxy_check( slot_pool );
+	proxy_check( session_directory );
+
+	proxy_thread_data_t * thread_data[2];
+
+	for ( int i = 0; i < 2; ++i )
+	{
+		thread_data[i] = (proxy_thread_data_t*) calloc( 1, sizeof(proxy_thread_data_t) );
+		proxy_check( thread_data[i] );
+		thread_data[i]->thread_number = i;
+		thread_data[i]->session_directory = session_directory;
+		thread_data[i]->slot_timers = next_timer_wheel_create( NULL, NumSlots, PROXY_SLOT_TIMER_RESOLUTION, 0.0 );
+		thread_data[i]->slots = slots;
+		thread_data[i]->slot_pool = slot_pool;
+		proxy_check( thread_data[i]->slot_timers );
+		proxy_thread_init_slots( thread_data[i] );
+	}
+
+	const int NumClients = 8;
+
+	proxy_address_t clients[NumClients];
+
+	for ( int i = 0; i < NumClients; ++i )
+	{
+		char buffer[1024];
+		sprintf( buffer, "127.0.0.1:%d", 50000 + i );
+		proxy_address_parse( &clients[i], buffer );
+	}
+
+	// a thread leases its own slots first, then the other thread's
+
+	for ( int i = 0; i < NumSlots; ++i )
+	{
+		proxy_check( proxy_thread_allocate_slot( thread_data[0], &clients[i], double(i) ) == i );
+		proxy_check( proxy_session_directory_get( session_directory, 0, &clients[i] ) == i );
+		proxy_check( slots[i].lessee == 0 );
+	}
+
+	// the pool is empty, and thread 1 has nothing of its own to evict
+
+	proxy_check( proxy_thread_allocate_slot( thread_data[1], &clients[4], 10.0 ) == -1 );
+
+	// full, and nobody has timed out. without eviction the new client is dropped
+
+	proxy_check( proxy_thread_allocate_slot( thread_data[0], &clients[4], 10.0 ) == -1 );
+	proxy_check( proxy_session_directory_get( session_directory, 0, &clients[4] ) == -1 );
+
+	// activity moves a slot to the back of the lru list. only the leasing thread can do that
+
+	proxy_thread_touch_slot( thread_data[0], 0, 20.0 );
+	proxy_thread_touch_slot( thread_data[1], 1, 20.0 );
+	proxy_check( slots[1].last_packet_receive_time == 1.0 );
+
+	const int expected_order[] = { 1, 2, 3, 0 };
+	int slot = thread_data[0]->lru_slot_head;
+	for ( int i = 0; i < NumSlots; ++i )
+	{
+		proxy_check( slot == expected_order[i] );
+		slot = slots[slot].list_next;
+	}
+	proxy_check( slot == -1 );
+	proxy_check( thread_data[0]->lru_slot_tail == 0 );
+
+	// with eviction on, the least recently active client loses its slot, and a reader on the home thread sees it change hands
+
+	uint32_t state_before;
+	proxy_address_t address;
+	proxy_check( proxy_slot_read_client( &slots[1], &state_before, &address ) );
+	proxy_check( proxy_address_equal( &address, &clients[1] ) );
+
+	config.slot_evict_lru = 1;
+
+	proxy_check( proxy_thread_allocate_slot( thread_data[0], &clients[4], 21.0 ) == 1 );
+	proxy_check( proxy_session_directory_get( session_directory, 0, &clients[1] ) == -1 );
+	proxy_check( proxy_session_directory_get( session_directory, 0, &clients[4] ) == 1 );
+	proxy_check( thread_data[0]->lru_slot_head == 2 );
+	proxy_check( thread_data[0]->lru_slot_tail == 1 );
+
+	uint32_t state_after;
+	proxy_check( proxy_slot_read_client( &slots[1], &state_after, &address ) );
+	proxy_check( proxy_address_equal( &address, &clients[4] ) );
+	proxy_check( ( state_after & ~uint32_t( PROXY_SLOT_STATE_FLAGS ) ) != ( state_before & ~uint32_t( PROXY_SLOT_STATE_FLAGS ) ) );
+
+	// a payload the next thread queued for the evicted client is dropped. one queued for the new client goes out the slot socket
+
+	proxy_address_t bind_address;
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+	slots[1].socket = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+	proxy_check( slots[1].socket );
+
+	thread_data[0]->return_ring = proxy_ring_create( 100 );
+	thread_data[0]->send_queue = proxy_send_queue_create( 100 );
+	proxy_check( thread_data[0]->return_ring );
+	proxy_check( thread_data[0]->send_queue );
+
+	const uint8_t payload[10] = { 0 };
+
+	for ( int i = 0; i < 2; ++i )
+	{
+		proxy_ring_entry_t header;
+		memset( &header, 0, sizeof(header) );
+		header.slot = 1;
+		header.session_handle = proxy_session_handle( 1, i == 0 ? state_before : state_after );
+		header.address = clients[7];
+		proxy_check( proxy_ring_push( thread_data[0]->return_ring, &header, payload, sizeof(payload) ) );
+	}
+
+	proxy_thread_process_return_ring( thread_data[0] );
+
+	proxy_check( proxy_ring_count( thread_data[0]->return_ring ) == 0 );
+	proxy_check( thread_data[0]->send_queue->num_packets == 1 );
+
+	proxy_send_queue_destroy( thread_data[0]->send_queue );
+	proxy_ring_destroy( thread_data[0]->return_ring );
+	thread_data[0]->send_queue = NULL;
+	thread_data[0]->return_ring = NULL;
+	proxy_platform_socket_destroy( slots[1].socket );
+	slots[1].socket = NULL;
+
+	// without eviction, a client that timed out before its timer fired still gives up its slot
+
+	config.slot_evict_lru = 0;
+
+	proxy_check( proxy_thread_allocate_slot( thread_data[0], &clients[5], 62.0 ) == 2 );
+	proxy_check( proxy_session_directory_get( session_directory, 0, &clients[2] ) == -1 );
+	proxy_check( proxy_session_directory_get( session_directory, 0, &clients[5] ) == 2 );
+
+	// freed slots go back to their home thread's pool, where either thread can lease them
+
+	proxy_thread_free_slot( thread_data[0], 3 );
+	proxy_check( proxy_session_directory_get( session_directory, 0, &clients[3] ) == -1 );
+	proxy_check( !proxy_slot_read_client( &slots[3], &state_after, &address ) );
+
+	proxy_check( proxy_thread_allocate_slot( thread_data[1], &clients[6], 63.0 ) == 3 );
+	proxy_check( slots[3].lessee == 1 );
+	proxy_check( proxy_session_directory_get( session_directory, 1, &clients[6] ) == 3 );
+	proxy_check( proxy_thread_allocate_slot( thread_data[0], &clients[7], 64.0 ) == -1 );
+
+	// every allocated slot is on its lessee's lru list exactly once
+
+	int num_allocated = 0;
+	for ( int i = 0; i < 2; ++i )
+	{
+		for ( slot = thread_data[i]->lru_slot_head; slot >= 0; slot = slots[slot].list_next )
+		{
+			proxy_check( proxy_thread_leases_slot( thread_data[i], slot ) );
+			num_allocated++;
+		}
+	}
+	proxy_check( num_allocated == NumSlots );
+	proxy_check( proxy_session_directory_num_entries( session_directory ) == NumSlots );
+
+	for ( int i = 0; i < 2; ++i )
+	{
+		next_timer_wheel_destroy( thread_data[i]->slot_timers );
+		free( thread_data[i] );
+	}
+
+	proxy_session_directory_destroy( session_directory );
+	proxy_slot_pool_destroy( slot_pool );
+	free( slots );
+
+	config = saved_config;
+}
+
+struct test_slot_pool_thread_data_t
+{
+	proxy_slot_pool_t * pool;
+	uint32_t * owners;
+	int thread_number;
+	bool failed;
+};
+
+static proxy_platform_thread_return_t PROXY_PLATFORM_THREAD_FUNC test_slot_pool_thread_function( void * data )
+{
+	test_slot_pool_thread_data_t * thread_data = (test_slot_pool_thread_data_t*) data;
+
+	const int MaxHeld = 16;
+
+	int held[MaxHeld];
+	int num_held = 0;
+
+	uint32_t seed = uint32_t( thread_data->thread_number ) * 2654435761U + 1;
+
+	for ( int i = 0; i < 200000; ++i )
+	{
+		seed = seed * 1664525U + 1013904223U;
+
+		if ( num_held < MaxHeld && ( num_held == 0 || ( seed >> 16 ) & 1 ) )
+		{
+			const int slot = proxy_slot_pool_pop( thread_data->pool, thread_data->thread_number );
+			if ( slot < 0 )
+				continue;
+
+			// nobody else may hold this slot
+
+			if ( __atomic_exchange_n( &thread_data->owners[slot], uint32_t( thread_data->thread_number + 1 ), __ATOMIC_ACQ_REL ) != 0 )
+				thread_data->failed = true;
+
+			held[num_held++] = slot;
+		}
+		else
+		{
+			const int index = int( ( seed >> 8 ) % uint32_t( num_held ) );
+			const int slot = held[index];
+			held[index] = held[--num_held];
+
+			if ( __atomic_exchange_n( &thread_data->owners[slot], 0, __ATOMIC_ACQ_REL ) != uint32_t( thread_data->thread_number + 1 ) )
+				thread_data->failed = true;
+
+			proxy_slot_pool_push( thread_data->pool, slot );
+		}
+	}
+
+	for ( int i = 0; i < num_held; ++i )
+	{
+		__atomic_store_n( &thread_data->owners[held[i]], 0, __ATOMIC_RELEASE );
+		proxy_slot_pool_push( thread_data->pool, held[i] );
+	}
+
+	PROXY_PLATFORM_THREAD_RETURN();
+}
+
+void test_slot_pool()
+{
+	printf( "    test_slot_pool\n" );
+
+	// few slots and many threads, so pops and pushes race on every head and threads keep leasing each other's slots
+
+	const int NumThreads = 4;
+	const int NumSlotsPerThread = 8;
+	const int NumSlots = NumThreads * NumSlotsPerThread;
+
+	proxy_slot_pool_t * pool = proxy_slot_pool_create( NumThreads, NumSlotsPerThread );
+	proxy_check( pool );
+
+	uint32_t owners[NumSlots];
+	memset( owners, 0, sizeof(owners) );
+
+	test_slot_pool_thread_data_t thread_data[NumThreads];
+	proxy_platform_thread_t * threads[NumThreads];
+
+	for ( int i = 0; i < NumThreads; ++i )
+	{
+		thread_data[i].pool = pool;
+		thread_data[i].owners = owners;
+		thread_data[i].thread_number = i;
+		thread_data[i].failed = false;
+		threads[i] = proxy_platform_thread_create( test_slot_pool_thread_function, &thread_data[i] );
+		proxy_check( threads[i] );
+	}
+
+	for ( int i = 0; i < NumThreads; ++i )
+	{
+		proxy_platform_thread_join( threads[i] );
+		proxy_platform_thread_destroy( threads[i] );
+		proxy_check( !thread_data[i].failed );
+	}
+
+	// every slot is back, exactly once, on its home thread's stack
+
+	bool seen[NumSlots];
+	memset( seen, 0, sizeof(seen) );
+
+	for ( int i = 0; i < NumThreads; ++i )
+	{
+		int slot;
+		while ( ( slot = proxy_slot_pool_pop_home( pool, i ) ) >= 0 )
+		{
+			proxy_check( slot / NumSlotsPerThread == i );
+			proxy_check( !seen[slot] );
+			seen[slot] = true;
+		}
+	}
+
+	for ( int i = 0; i < NumSlots; ++i )
+	{
+		proxy_check( seen[i] );
+	}
+
+	proxy_slot_pool_destroy( pool );
+}
+
+static void proxy_thread_update_slot_timers( proxy_thread_data_t * thread_data, double current_time )
+{
+	// only the slots whose deadline has come up are visited. a slot that saw packets since it was scheduled just moves its deadline
+
+	next_timer_wheel_advance( thread_data->slot_timers, current_time );
+
+	int slot;
+
+	while ( ( slot = next_timer_wheel_pop( thread_data->slot_timers ) ) >= 0 )
+	{
+		assert( slot < config.num_threads * config.num_slots_per_thread );
+
+		if ( !proxy_thread_leases_slot( thread_data, slot ) )
+			continue;
+
+		const double timeout_time = thread_data->slots[slot].last_packet_receive_time + config.slot_timeout_seconds;
+
+		if ( timeout_time > current_time )
+		{
+			next_timer_wheel_schedule( thread_data->slot_timers, slot, timeout_time );
+			continue;
+		}
+
+		// packets forwarded by xdp never reach this thread. the kernel keeps its own time of the client's last packet
+
+		if ( thread_data->xdp )
+		{
+			const double idle_seconds = proxy_platform_xdp_slot_idle_seconds( thread_data->xdp, slot );
+
+			if ( idle_seconds >= 0.0 && idle_seconds < config.slot_timeout_seconds )
+			{
+				proxy_thread_touch_slot( thread_data, slot, current_time - idle_seconds );
+				next_timer_wheel_schedule( thread_data->slot_timers, slot, current_time - idle_seconds + config.slot_timeout_seconds );
+				continue;
+			}
+		}
+
+		debug_printf( "proxy thread %d slot %d timed out\n", thread_data->thread_number, slot );
+
+		proxy_thread_free_slot( thread_data, slot );
+	}
+}
+
+/*
+	Every rebalance interval the main thread samples each proxy thread's busy time and packet counts, and prints them.
+	If the busiest thread is more than the threshold busier than the idlest, it moves one steering bucket between them:
+	the busiest thread's hottest bucket that still leaves the idlest thread less loaded than the busiest afterwards.
+*/
+
+struct proxy_load_t
+{
+	uint64_t busy_nanoseconds;
+	uint64_t packets;
+	uint64_t bucket_packets[PROXY_STEERING_BUCKETS];
+};
+
+void proxy_thread_sample_load( const proxy_thread_data_t * thread_data, proxy_load_t * load )
+{
+	load->busy_nanoseconds = __atomic_load_n( &thread_data->busy_nanoseconds, __ATOMIC_RELAXED );
+	load->packets = __atomic_load_n( &thread_data->packets_received, __ATOMIC_RELAXED );
+	for ( int i = 0; i < PROXY_STEERING_BUCKETS; ++i )
+	{
+		load->bucket_packets[i] = __atomic_load_n( &thread_data->bucket_packets[i], __ATOMIC_RELAXED );
+	}
+}
+
+bool proxy_rebalance_pick( const proxy_load_t * loads, const int * owners, int num_threads, double interval_seconds, int threshold_percent, int * bucket, int * from_thread, int * to_thread )
+{
+	// loads are what each thread did over the interval. packets counted just before a bucket moved can make it look like the busiest thread still has it
+
+	assert( loads );
+	assert( num_threads > 0 );
+	assert( interval_seconds > 0.0 );
+
+	int busiest = 0;
+	int idlest = 0;
+
+	for ( int i = 1; i < num_threads; ++i )
+	{
+		if ( loads[i].busy_nanoseconds > loads[busiest].busy_nanoseconds )
+			busiest = i;
+		if ( loads[i].busy_nanoseconds < loads[idlest].busy_nanoseconds )
+			idlest = i;
+	}
+
+	const double interval_nanoseconds = interval_seconds * 1000000000.0;
+
+	const double busiest_load = loads[busiest].busy_nanoseconds / interval_nanoseconds;
+	const double idlest_load = loads[idlest].busy_nanoseconds / interval_nanoseconds;
+
+	if ( busiest == idlest || loads[busiest].packets == 0 || ( busiest_load - idlest_load ) * 100.0 < threshold_percent )
+		return false;
+
+	// a bucket's cost is estimated from the busiest thread's cost per packet. every thread's share of the bucket moves with it
+
+	const double cost_per_packet = busiest_load / loads[busiest].packets;
+
+	int best_bucket = -1;
+	uint64_t best_packets = 0;
+
+	for ( int i = 0; i < PROXY_STEERING_BUCKETS; ++i )
+	{
+		const uint64_t packets = loads[busiest].bucket_packets[i];
+
+		if ( packets <= best_packets || owners[i] == idlest )
+			continue;
+
+		uint64_t total_packets = 0;
+		for ( int j = 0; j < num_threads; ++j )
+		{
+			if ( j != idlest )
+				total_packets += loads[j].bucket_packets[i];
+		}
+
+		if ( idlest_load + total_packets * cost_per_packet >= busiest_load - packets * cost_per_packet )
+			continue;
+
+		best_bucket = i;
+		best_packets = packets;
+	}
+
+	if ( best_bucket < 0 )
+		return false;
+
+	*bucket = best_bucket;
+	*from_thread = busiest;
+	*to_thread = idlest;
+
+	return true;
+}
+
+bool proxy_steering_move_bucket( proxy_steering_t * steering, proxy_thread_data_t ** thread_data, int num_threads, int bucket, int thread_number )
+{
+	// returns once every proxy thread has handed off its clients in the bucket, or false if the proxy is quitting first
+
+	__atomic_store_n( &steering->owners[bucket], thread_number, __ATOMIC_RELAXED );
+
+	const uint32_t epoch = __atomic_add_fetch( &steering->epoch, 1, __ATOMIC_RELEASE );
+
+	for ( int i = 0; i < num_threads; ++i )
+	{
+		while ( __atomic_load_n( &thread_data[i]->steering_epoch, __ATOMIC_ACQUIRE ) != epoch )
+		{
+			if ( quit )
+				return false;
+			proxy_sleep( 0.001 );
+		}
+	}
+
+	return true;
+}
+
+static void proxy_rebalance( proxy_thread_data_t ** thread_data, proxy_platform_socket_t ** thread_sockets, proxy_steering_t * steering, bool steering_enabled, proxy_load_t * previous_loads, proxy_load_t * loads, double interval_seconds )
+{
+	for ( int i = 0; i < config.num_threads; ++i )
+	{
+		proxy_load_t sample;
+		proxy_thread_sample_load( thread_data[i], &sample );
+
+		loads[i].busy_nanoseconds = sample.busy_nanoseconds - previous_loads[i].busy_nanoseconds;
+		loads[i].packets = sample.packets - previous_loads[i].packets;
+		for ( int j = 0; j < PROXY_STEERING_BUCKETS; ++j )
+		{
+			loads[i].bucket_packets[j] = sample.bucket_packets[j] - previous_loads[i].bucket_packets[j];
+		}
+
+		previous_loads[i] = sample;
+	}
+
+	// export per thread load: busy percent and packets per second received on the thread socket
+
+	char buffer[4096];
+	int length = snprintf( buffer, sizeof(buffer), "proxy load:" );
+	for ( int i = 0; i < config.num_threads && length < int( sizeof(buffer) ); ++i )
+	{
+		length += snprintf( buffer + length, sizeof(buffer) - length, " %d:%.0f%%/%.0fpps", i, loads[i].busy_nanoseconds / ( interval_seconds * 10000000.0 ), loads[i].packets / interval_seconds );
+	}
+	printf( "%s\n", buffer );
+	fflush( stdout );
+
+	if ( !steering_enabled )
+		return;
+
+	int bucket, from_thread, to_thread;
+
+	if ( !proxy_rebalance_pick( loads, steering->owners, config.num_threads, interval_seconds, config.rebalance_threshold_percent, &bucket, &from_thread, &to_thread ) )
+		return;
+
+	printf( "moving steering bucket %d from proxy thread %d to proxy thread %d\n", bucket, from_thread, to_thread );
+	fflush( stdout );
+
+	if ( !proxy_steering_move_bucket( steering, thread_data, config.num_threads, bucket, to_thread ) )
+		return;
+
+	if ( !proxy_platform_socket_steer( thread_sockets[0], steering->owners, PROXY_STEERING_BUCKETS, proxy_steering_cpu_sockets() ) )
+	{
+		printf( "warning: could not update reuseport steering program\n" );
+		fflush( stdout );
+	}
+}
+
+void test_steering()
+{
+	printf( "    test_steering\n" );
+
+	const proxy_config_t saved_config = config;
+
+	config.num_threads = 2;
+	config.num_slots_per_thread = 2;
+	config.slot_timeout_seconds = 60;
+	config.slot_evict_lru = 0;
+
+	// buckets fold the ipv4 address and port the same way the reuseport program does. ipv6 is never steered
+
+	proxy_address_t address;
+	proxy_check( proxy_address_parse( &address, "10.1.2.3:40000" ) );
+	uint32_t x = ( ( 10U << 24 ) | ( 1U << 16 ) | ( 2U << 8 ) | 3U ) ^ 40000U;
+	x ^= x >> 16;
+	x ^= x >> 8;
+	proxy_check( proxy_steering_bucket( &address ) == int( x & 0xFF ) );
+	proxy_check( proxy_address_parse( &address, "[::1]:40000" ) );
+	proxy_check( proxy_steering_bucket( &address ) == -1 );
+
+	// the busiest thread gives up its hottest bucket that doesn't just move the overload to the idlest thread
+
+	proxy_load_t * loads = (proxy_load_t*) calloc( 2, sizeof(proxy_load_t) );
+	proxy_check( loads );
+
+	loads[0].busy_nanoseconds = 900000000;
+	loads[0].packets = 900;
+	loads[0].bucket_packets[5] = 800;
+	loads[0].bucket_packets[7] = 100;
+	loads[1].busy_nanoseconds = 100000000;
+	loads[1].packets = 100;
+	loads[1].bucket_packets[9] = 100;
+
+	int owners[PROXY_STEERING_BUCKETS];
+	for ( int i = 0; i < PROXY_STEERING_BUCKETS; ++i )
+	{
+		owners[i] = -1;
+	}
+
+	int bucket = -1, from_thread = -1, to_thread = -1;
+	proxy_check( proxy_rebalance_pick( loads, owners, 2, 1.0, 25, &bucket, &from_thread, &to_thread ) );
+	proxy_check( bucket == 7 );
+	proxy_check( from_thread == 0 );
+	proxy_check( to_thread == 1 );
+
+	proxy_check( !proxy_rebalance_pick( loads, owners, 2, 4.0, 25, &bucket, &from_thread, &to_thread ) );
+
+	owners[7] = 1;
+	proxy_check( !proxy_rebalance_pick( loads, owners, 2, 1.0, 25, &bucket, &from_thread, &to_thread ) );
+	owners[7] = -1;
+
+	loads[0].bucket_packets[7] = 0;
+	proxy_check( !proxy_rebalance_pick( loads, owners, 2, 1.0, 25, &bucket, &from_thread, &to_thread ) );
+
+	free( loads );
+
+	// two proxy threads sharing the slots, with thread 0 leasing a slot to a client
+
+	const int NumSlots = 4;
+
+	proxy_slot_data_t * slots = (proxy_slot_data_t*) calloc( NumSlots, sizeof(proxy_slot_data_t) );
+	proxy_slot_pool_t * slot_pool = proxy_slot_pool_create( config.num_threads, config.num_slots_per_thread );
+	proxy_session_directory_t * session_directory = proxy_session_directory_create( slots, NumSlots, 2 );
+	proxy_check( slots );
+	proxy_check( slot_pool );
+	proxy_check( session_directory );
+
+	proxy_address_t bind_address;
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+	proxy_platform_socket_t * slot_socket = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+	proxy_check( slot_socket );
+
+	for ( int i = 0; i < NumSlots; ++i )
+	{
+		slots[i].socket = slot_socket;
+	}
+
+	proxy_steering_t steering;
+	proxy_steering_init( &steering );
+
+	proxy_thread_data_t * thread_data[2];
+
+	for ( int i = 0; i < 2; ++i )
+	{
+		thread_data[i] = (proxy_thread_data_t*) calloc( 1, sizeof(proxy_thread_data_t) );
+		proxy_check( thread_data[i] );
+		thread_data[i]->thread_number = i;
+		thread_data[i]->session_directory = session_directory;
+		thread_data[i]->slot_timers = next_timer_wheel_create( NULL, NumSlots, PROXY_SLOT_TIMER_RESOLUTION, 0.0 );
+		thread_data[i]->slots = slots;
+		thread_data[i]->slot_pool = slot_pool;
+		thread_data[i]->steering = &steering;
+		thread_data[i]->peers = thread_data;
+		thread_data[i]->handoff_ring = proxy_ring_create( PROXY_NEXT_PREFIX_BYTES + 100 );
+		thread_data[i]->send_queue = proxy_send_queue_create( PROXY_NEXT_PREFIX_BYTES + 100 );
+		proxy_check( thread_data[i]->slot_timers );
+		proxy_check( thread_data[i]->handoff_ring );
+		proxy_check( thread_data[i]->send_queue );
+		proxy_check( proxy_platform_mutex_create( &thread_data[i]->handoff_mutex ) );
+		proxy_thread_init_slots( thread_data[i] );
+	}
+
+	proxy_address_t client;
+	proxy_check( proxy_address_parse( &client, "127.0.0.1:50000" ) );
+
+	const int slot = proxy_thread_allocate_slot( thread_data[0], &client, 10.0 );
+	proxy_check( slot == 0 );
+
+	uint32_t state_before;
+	proxy_check( proxy_slot_read_client( &slots[slot], &state_before, &address ) );
+
+	// moving the client's bucket to thread 1. thread 0 hands the client over with its slot, and acks the epoch
+
+	const int client_bucket = proxy_steering_bucket( &client );
+	steering.owners[client_bucket] = 1;
+	steering.epoch++;
+
+	proxy_thread_update_steering( thread_data[1] );
+	proxy_check( thread_data[1]->steering_epoch == steering.epoch );
+
+	proxy_thread_update_steering( thread_data[0] );
+	proxy_check( thread_data[0]->steering_epoch == steering.epoch );
+	int lessee = -1;
+	proxy_check( proxy_thread_find_client( thread_data[0], &client, &lessee ) == -1 );
+	proxy_check( lessee == 1 );
+	proxy_check( proxy_session_directory_get( session_directory, 0, &client ) == slot );
+	proxy_check( thread_data[0]->lru_slot_head == -1 );
+
+	// in flight, neither thread leases the slot, but payloads already go to thread 1 and the slot socket still reaches the client
+
+	proxy_check( !proxy_thread_leases_slot( thread_data[0], slot ) );
+	proxy_check( !proxy_thread_leases_slot( thread_data[1], slot ) );
+	proxy_check( int( slots[slot].lessee & ~PROXY_SLOT_LESSEE_MOVING ) == 1 );
+
+	uint32_t state_moving;
+	proxy_check( proxy_slot_read_client( &slots[slot], &state_moving, &address ) );
+	proxy_check( state_moving == state_before );
+	proxy_check( proxy_address_equal( &address, &client ) );
+
+	// thread 0 still receives the client's packets until the kernel steers them. they follow the adopt message
+
+	uint8_t buffer[PROXY_NEXT_PREFIX_BYTES + 100];
+	memset( buffer, 0, sizeof(buffer) );
+	buffer[PROXY_NEXT_PREFIX_BYTES] = NEXT_PASSTHROUGH_PACKET;
+	buffer[PROXY_NEXT_PREFIX_BYTES + 1] = 42;
+
+	proxy_check( proxy_thread_forward_client_packet( thread_data[0], &client, buffer, 2 ) );
+	proxy_check( !proxy_thread_forward_client_packet( thread_data[1], &client, buffer, 2 ) );
+	proxy_check( proxy_ring_count( thread_data[1]->handoff_ring ) == 2 );
+
+	// a packet arriving straight on thread 1 finds the client, adopting it first, and keeps the slot alive there
+
+	proxy_check( proxy_thread_find_client( thread_data[1], &client, &lessee ) == slot );
+	proxy_check( proxy_ring_count( thread_data[1]->handoff_ring ) == 0 );
+	proxy_check( proxy_thread_leases_slot( thread_data[1], slot ) );
+	proxy_check( thread_data[1]->lru_slot_head == slot );
+	proxy_check( thread_data[1]->send_queue->num_packets == 1 );
+
+	proxy_thread_touch_slot( thread_data[1], slot, 20.0 );
+	proxy_check( slots[slot].last_packet_receive_time == 20.0 );
+
+	uint32_t state_after;
+	proxy_check( proxy_slot_read_client( &slots[slot], &state_after, &address ) );
+	proxy_check( state_after == state_before );
+
+	// moving it back again
+
+	steering.owners[client_bucket] = 0;
+	steering.epoch++;
+
+	proxy_thread_update_steering( thread_data[1] );
+	proxy_thread_process_handoff_ring( thread_data[0] );
+	proxy_check( proxy_thread_find_client( thread_data[0], &client, &lessee ) == slot );
+	proxy_check( proxy_thread_find_client( thread_data[1], &client, &lessee ) == -1 );
+	proxy_check( lessee == 0 );
+	proxy_check( proxy_thread_leases_slot( thread_data[0], slot ) );
+
+	// with nobody owning the bucket, a packet from the client on thread 1 still goes to thread 0, which leases its slot.
+	// thread 1 must not give the client a second slot
+
+	steering.owners[client_bucket] = -1;
+	steering.epoch++;
+
+	proxy_thread_update_steering( thread_data[0] );
+	proxy_thread_update_steering( thread_data[1] );
+
+	const int packets_queued = thread_data[0]->send_queue->num_packets;
+
+	proxy_thread_process_client_packet( thread_data[1], &client, buffer, 2 );
+
+	proxy_check( thread_data[1]->lru_slot_head == -1 );
+	proxy_check( proxy_session_directory_get( session_directory, 1, &client ) == slot );
+	proxy_check( proxy_session_directory_num_entries( session_directory ) == 1 );
+	proxy_check( proxy_ring_count( thread_data[0]->handoff_ring ) == 1 );
+
+	proxy_thread_process_handoff_ring( thread_data[0] );
+
+	proxy_check( proxy_ring_count( thread_data[0]->handoff_ring ) == 0 );
+	proxy_check( thread_data[0]->send_queue->num_packets == packets_queued + 1 );
+
+	// a packet can reach thread 1 after thread 0 marks the client as moving there, but before the adopt message is on
+	// the ring. thread 1 parks it on its own ring instead of dropping it. here the hand off fails and is undone, so the
+	// parked packet goes back to thread 0
+
+	proxy_thread_lru_unlink( thread_data[0], slot );
+	slots[slot].lessee = 1 | PROXY_SLOT_LESSEE_MOVING;
+
+	proxy_thread_process_client_packet( thread_data[1], &client, buffer, 2 );
+
+	proxy_check( proxy_ring_count( thread_data[1]->handoff_ring ) == 1 );
+	proxy_check( thread_data[1]->lru_slot_head == -1 );
+	proxy_check( thread_data[1]->send_queue->num_packets == 1 );
+
+	slots[slot].lessee = 0;
+	proxy_thread_lru_append( thread_data[0], slot );
+
+	proxy_thread_process_handoff_ring( thread_data[1] );
+
+	proxy_check( proxy_ring_count( thread_data[1]->handoff_ring ) == 0 );
+	proxy_check( proxy_ring_count( thread_data[0]->handoff_ring ) == 1 );
+
+	proxy_thread_process_handoff_ring( thread_data[0] );
+
+	proxy_check( thread_data[0]->send_queue->num_packets == packets_queued + 2 );
+
+	// a tunnel packet for the client's slot only reaches the client when it comes from the server
+
+	proxy_platform_socket_t * thread_sockets[2] = { slot_socket, slot_socket };
+	thread_data[0]->thread_sockets = thread_sockets;
+
+	uint8_t tunnel_buffer[PROXY_NEXT_PREFIX_BYTES + PROXY_TUNNEL_HEADER_BYTES + 10];
+	memset( tunnel_buffer, 0, sizeof(tunnel_buffer) );
+
+	proxy_address_t stranger;
+	proxy_check( proxy_address_parse( &stranger, "127.0.0.1:50001" ) );
+
+	proxy_tunnel_write_header( tunnel_buffer + PROXY_NEXT_PREFIX_BYTES, slot );
+	proxy_thread_process_tunnel_packet( thread_data[0], &stranger, tunnel_buffer, PROXY_TUNNEL_HEADER_BYTES + 10 );
+	proxy_check( thread_data[0]->send_queue->num_packets == packets_queued + 2 );
+
+	proxy_tunnel_write_header( tunnel_buffer + PROXY_NEXT_PREFIX_BYTES, slot );
+	proxy_thread_process_tunnel_packet( thread_data[0], &config.server_address, tunnel_buffer, PROXY_TUNNEL_HEADER_BYTES + 10 );
+	proxy_check( thread_data[0]->send_queue->num_packets == packets_queued + 3 );
+
+	for ( int i = 0; i < 2; ++i )
+	{
+		proxy_send_queue_destroy( thread_data[i]->send_queue );
+		proxy_ring_destroy( thread_data[i]->handoff_ring );
+		proxy_platform_mutex_destroy( &thread_data[i]->handoff_mutex );
+		next_timer_wheel_destroy( thread_data[i]->slot_timers );
+		free( thread_data[i] );
+	}
+
+	proxy_session_directory_destroy( session_directory );
+
+	proxy_slot_pool_destroy( slot_pool );
+	free( slots );
+
+	// the kernel delivers a steered client's packets to the socket of the thread that owns its bucket
+
+	bind_address.port = 0;
+
+	proxy_platform_socket_t * sockets[2];
+	sockets[0] = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_REUSE_PORT | PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+	proxy_check( sockets[0] );
+	sockets[1] = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_REUSE_PORT | PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+	proxy_check( sockets[1] );
+
+	proxy_address_t sender_address;
+	proxy_check( proxy_address_parse( &sender_address, "127.0.0.1:0" ) );
+	proxy_platform_socket_t * sender = proxy_platform_socket_create( &sender_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+	proxy_check( sender );
+
+	for ( int i = 0; i < PROXY_STEERING_BUCKETS; ++i )
+	{
+		owners[i] = -1;
+	}
+
+	if ( proxy_platform_socket_steer( sockets[0], owners, PROXY_STEERING_BUCKETS, 0 ) )
+	{
+		for ( int i = 0; i < 4; ++i )
+		{
+			const int owner = i & 1;
+
+			owners[proxy_steering_bucket( &sender_address )] = owner;
+			proxy_check( proxy_platform_socket_steer( sockets[0], owners, PROXY_STEERING_BUCKETS, 0 ) );
+
+			const uint8_t packet = uint8_t( i );
+			proxy_platform_socket_send_packet( sender, &bind_address, &packet, 1 );
+
+			int received_on = -1;
+			for ( int j = 0; j < 100 && received_on < 0; ++j )
+			{
+				proxy_sleep( 0.001 );
+				for ( int k = 0; k < 2; ++k )
+				{
+					proxy_address_t from;
+					uint8_t data[16];
+					if ( proxy_platform_socket_receive_packet( sockets[k], &from, data, sizeof(data) ) == 1 )
+					{
+						proxy_check( data[0] == packet );
+						proxy_check( proxy_address_equal( &from, &sender_address ) );
+						received_on = k;
+					}
+				}
+			}
+
+			proxy_check( received_on == owner );
+		}
+
+		// unowned buckets can follow the cpu that received the packet instead of the kernel's hash. with one cpu socket, every sender lands on it
+
+		owners[proxy_steering_bucket( &sender_address )] = -1;
+		proxy_check( proxy_platform_socket_steer( sockets[0], owners, PROXY_STEERING_BUCKETS, 1 ) );
+
+		for ( int i = 0; i < 8; ++i )
+		{
+			proxy_address_t cpu_sender_address;
+			proxy_check( proxy_address_parse( &cpu_sender_address, "127.0.0.1:0" ) );
+			proxy_platform_socket_t * cpu_sender = proxy_platform_socket_create( &cpu_sender_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+			proxy_check( cpu_sender );
+
+			const uint8_t packet = uint8_t( i );
+			proxy_platform_socket_send_packet( cpu_sender, &bind_address, &packet, 1 );
+
+			bool received = false;
+			for ( int j = 0; j < 100 && !received; ++j )
+			{
+				proxy_sleep( 0.001 );
+				proxy_address_t from;
+				uint8_t data[16];
+				proxy_check( proxy_platform_socket_receive_packet( sockets[1], &from, data, sizeof(data) ) <= 0 );
+				received = proxy_platform_socket_receive_packet( sockets[0], &from, data, sizeof(data) ) == 1;
+			}
+
+			proxy_check( received );
+
+			proxy_platform_socket_destroy( cpu_sender );
+		}
+	}
+
+	proxy_platform_socket_destroy( sender );
+	proxy_platform_socket_destroy( sockets[0] );
+	proxy_platform_socket_destroy( sockets[1] );
+	proxy_platform_socket_destroy( slot_socket );
+
+	config = saved_config;
+}
+
+/*
+	With cpu placement, proxy thread i is pinned to core i and the next thread to the core after the last proxy thread,
+	wrapping around. Once pinned, a proxy thread moves its own memory to its numa node: its thread data and the slot
+	data for the slot sockets it polls are bound to the node, and its slot timers are created again from the thread so
+	their pages are first touched there. Buffers the thread allocates later land there anyway.
+*/
+
+int proxy_thread_core( int thread_number )
+{
+	return thread_number % proxy_platform_num_cores();
+}
+
+static void proxy_thread_place( proxy_thread_data_t * thread_data )
+{
+	// the main thread pins us right after creating us. nothing is worth moving until then
+
+	while ( !__atomic_load_n( &thread_data->placed, __ATOMIC_ACQUIRE ) )
+	{
+		if ( quit )
+			return;
+
+		proxy_sleep( 0.001 );
+	}
+
+	const int first_slot = thread_data->thread_number * config.num_slots_per_thread;
+
+	if ( !proxy_platform_memory_bind_local( thread_data, config.proxy_thread_data_bytes ) || !proxy_platform_memory_bind_local( &thread_data->slots[first_slot], sizeof(proxy_slot_data_t) * config.num_slots_per_thread ) )
+	{
+		printf( "warning: could not move proxy thread %d memory to its numa node\n", thread_data->thread_number );
+	}
+
+	next_timer_wheel_t * slot_timers = next_timer_wheel_create( NULL, config.num_threads * config.num_slots_per_thread, PROXY_SLOT_TIMER_RESOLUTION, proxy_time() );
+
+	if ( !slot_timers )
+	{
+		// keep the one the main thread made
+
+		return;
+	}
+
+	next_timer_wheel_destroy( thread_data->slot_timers );
+
+	thread_data->slot_timers = slot_timers;
+}
+
+static void proxy_thread_process_received_packet( proxy_thread_data_t * thread_data, uint64_t id, const proxy_address_t * from, uint8_t * buffer, int packet_bytes )
+{
+	if ( id == PROXY_POLL_ID_THREAD_SOCKET )
+	{
+		const int bucket = proxy_steering_bucket( from );
+
+		if ( bucket >= 0 )
+		{
+			proxy_counter_add( &thread_data->bucket_packets[bucket], 1 );
+		}
+
+		proxy_counter_add( &thread_data->packets_received, 1 );
+
+		proxy_thread_process_client_packet( thread_data, from, buffer, packet_bytes );
+	}
+	else if ( id == PROXY_POLL_ID_TUNNEL_SOCKET )
+	{
+		proxy_thread_process_tunnel_packet( thread_data, from, buffer, packet_bytes );
+	}
+	else
+	{
+		assert( id < uint64_t( config.num_slots_per_thread ) );
+
+		proxy_thread_process_slot_packet( thread_data, int( id ), buffer, packet_bytes );
+	}
+}
+
+/*
+	With IO_URING=1 a proxy thread receives through io_uring instead of epoll and recvmmsg. Every socket the thread
+	polls keeps a multishot recvmsg armed that completes into buffers the kernel picks from a registered buffer ring,
+	and the thread's send queue hands each flush to the kernel as one batch of sendmsg submissions. If io_uring is
+	not available, the thread logs it and falls back to epoll.
+*/
+
+#define PROXY_URING_BUFFERS                                          1024
+#define PROXY_URING_SEND_BUFFERS                                      512
+#define PROXY_URING_MAX_PACKETS_PER_WAIT                              256
+
+void test_uring()
+{
+	printf( "    test_uring\n" );
+
+	proxy_platform_uring_t * uring = proxy_platform_uring_create( 4, 4, 100, 4 );
+	if ( !uring )
+	{
+		printf( "    io_uring not available. skipping\n" );
+		return;
+	}
+
+	proxy_address_t bind_address;
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+	proxy_platform_socket_t * receiver = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+	proxy_check( receiver );
+	proxy_address_t receiver_address = bind_address;
+
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+	proxy_platform_socket_t * sender = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+	proxy_check( sender );
+	proxy_address_t sender_address = bind_address;
+
+	proxy_platform_event_t * event = proxy_platform_event_create();
+	proxy_check( event );
+
+	proxy_check( proxy_platform_uring_add( uring, receiver, 7 ) );
+	proxy_check( proxy_platform_uring_add_event( uring, event, 9 ) );
+
+	// more packets than receive buffers. the multishot receive stops when the buffers run out and is armed again after recycle
+
+	const int NumPackets = 10;
+
+	for ( int i = 0; i < NumPackets; ++i )
+	{
+		uint8_t packet[50];
+		memset( packet, i, sizeof(packet) );
+		proxy_platform_socket_send_packet( sender, &receiver_address, packet, 1 + i );
+	}
+
+	uint64_t ids[8];
+	proxy_address_t from[8];
+	uint8_t * packet_data[8];
+	int packet_bytes[8];
+
+	int num_received = 0;
+
+	for ( int i = 0; i < 100 && num_received < NumPackets; ++i )
+	{
+		const int num_packets = proxy_platform_uring_wait( uring, ids, from, packet_data, packet_bytes, 8, 0.01f );
+		proxy_check( num_packets >= 0 );
+		proxy_check( num_packets <= 4 );
+
+		for ( int j = 0; j < num_packets; ++j )
+		{
+			proxy_check( ids[j] == 7 );
+			proxy_check( proxy_address_equal( &from[j], &sender_address ) );
+			proxy_check( packet_bytes[j] == 1 + num_received );
+			proxy_check( packet_data[j][0] == num_received );
+			proxy_check( packet_data[j][packet_bytes[j] - 1] == num_received );
+
+			// the caller owns the bytes in front of the packet until recycle
+
+			memset( packet_data[j] - 11, 0xFF, 11 );
+
+			num_received++;
+		}
+
+		proxy_platform_uring_recycle( uring );
+	}
+
+	proxy_check( num_received == NumPackets );
+
+	// events show up as zero byte entries, every time they are signalled
+
+	for ( int k = 0; k < 2; ++k )
+	{
+		proxy_platform_event_signal( event );
+
+		bool signalled = false;
+		for ( int i = 0; i < 100 && !signalled; ++i )
+		{
+			const int num_packets = proxy_platform_uring_wait( uring, ids, from, packet_data, packet_bytes, 8, 0.01f );
+			proxy_check( num_packets >= 0 );
+			for ( int j = 0; j < num_packets; ++j )
+			{
+				proxy_check( ids[j] == 9 );
+				proxy_check( packet_bytes[j] == 0 );
+				signalled = true;
+			}
+			proxy_platform_uring_recycle( uring );
+		}
+
+		proxy_check( signalled );
+
+		proxy_platform_event_clear( event );
+	}
+
+	// sends are copied, so the caller's buffers can change right away. more sends than send buffers reuse completed ones
+
+	proxy_address_t to[NumPackets];
+	void * send_data[NumPackets];
+	int send_bytes[NumPackets];
+	uint8_t send_buffer[NumPackets][50];
+
+	for ( int i = 0; i < NumPackets; ++i )
+	{
+		memset( send_buffer[i], 100 + i, sizeof(send_buffer[i]) );
+		to[i] = sender_address;
+		send_data[i] = send_buffer[i];
+		send_bytes[i] = 1 + i;
+	}
+
+	proxy_platform_uring_send_packets( uring, receiver, to, send_data, send_bytes, NumPackets );
+	proxy_platform_uring_submit( uring );
+
+	memset( send_buffer, 0, sizeof(send_buffer) );
+
+	num_received = 0;
+
+	for ( int i = 0; i < 100 && num_received < NumPackets; ++i )
+	{
+		proxy_address_t address;
+		uint8_t data[100];
+		const int bytes = proxy_platform_socket_receive_packet( sender, &address, data, sizeof(data) );
+		if ( bytes <= 0 )
+		{
+			proxy_sleep( 0.001 );
+			continue;
+		}
+		proxy_check( bytes == 1 + num_received );
+		proxy_check( data[0] == 100 + num_received );
+		proxy_check( proxy_address_equal( &address, &receiver_address ) );
+		num_received++;
+	}
+
+	proxy_check( num_received == NumPackets );
+
+	proxy_platform_uring_destroy( uring );
+	proxy_platform_event_destroy( event );
+	proxy_platform_socket_destroy( sender );
+	proxy_platform_socket_destroy( receiver );
+}
+
+void test_udp_segmentation()
+{
+	printf( "    test_udp_segmentation\n" );
+
+	// batches mix sizes and destinations. whether or not the kernel supports gso and gro, each receiver must get every
+	// packet it was sent, in order, in its own buffer, with the prefix headroom in front of it untouched
+
+	const int Prefix = PROXY_NEXT_PREFIX_BYTES;
+	const int MaxPacketBytes = 200;
+	const int NumPackets = 40;
+
+	proxy_address_t bind_address;
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+	proxy_platform_socket_t * sender = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING | PROXY_PLATFORM_SOCKET_GSO, 0.0f, 1000000, 1000000 );
+	proxy_check( sender );
+	const proxy_address_t sender_address = bind_address;
+
+	proxy_platform_socket_t * receivers[2];
+	proxy_address_t receiver_address[2];
+
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+	receivers[0] = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING | PROXY_PLATFORM_SOCKET_GRO, 0.0f, 1000000, 1000000 );
+	proxy_check( receivers[0] );
+	receiver_address[0] = bind_address;
+
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+	receivers[1] = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 1000000, 1000000 );
+	proxy_check( receivers[1] );
+	receiver_address[1] = bind_address;
+
+	uint8_t packets[NumPackets][MaxPacketBytes];
+	void * send_data[NumPackets];
+	int send_bytes[NumPackets];
+	proxy_address_t send_to[NumPackets];
+	int destination[NumPackets];
+
+	for ( int i = 0; i < NumPackets; ++i )
+	{
+		destination[i] = ( i % 7 == 3 ) ? 1 : 0;
+		send_bytes[i] = ( i >= 10 && i < 15 ) ? 60 : ( i == 30 ) ? MaxPacketBytes : 100;
+		memset( packets[i], i, send_bytes[i] );
+		send_data[i] = packets[i];
+		send_to[i] = receiver_address[destination[i]];
+	}
+
+	proxy_platform_socket_send_packets( sender, send_to, send_data, send_bytes, NumPackets );
+
+	uint8_t * buffer = (uint8_t*) malloc( size_t( Prefix + MaxPacketBytes ) * PROXY_MAX_PACKETS_PER_RECEIVE );
+	proxy_check( buffer );
+
+	uint8_t * packet_data[PROXY_MAX_PACKETS_PER_RECEIVE];
+	int packet_bytes[PROXY_MAX_PACKETS_PER_RECEIVE];
+	proxy_address_t from[PROXY_MAX_PACKETS_PER_RECEIVE];
+
+	for ( int r = 0; r < 2; ++r )
+	{
+		int expected = 0;
+		while ( expected < NumPackets && destination[expected] != r )
+			expected++;
+
+		for ( int iteration = 0; iteration < 1000 && expected < NumPackets; ++iteration )
+		{
+			memset( buffer, 0xAB, size_t( Prefix + MaxPacketBytes ) * PROXY_MAX_PACKETS_PER_RECEIVE );
+
+			for ( int i = 0; i < PROXY_MAX_PACKETS_PER_RECEIVE; ++i )
+			{
+				packet_data[i] = buffer + i * ( Prefix + MaxPacketBytes ) + Prefix;
+			}
+
+			const int num_packets = proxy_platform_socket_receive_packets( receivers[r], from, packet_data, packet_bytes, MaxPacketBytes, PROXY_MAX_PACKETS_PER_RECEIVE );
+			proxy_check( num_packets >= 0 );
+
+			if ( num_packets == 0 )
+			{
+				proxy_sleep( 0.001 );
+				continue;
+			}
+
+			for ( int i = 0; i < num_packets; ++i )
+			{
+				proxy_check( expected < NumPackets );
+				proxy_check( proxy_address_equal( &from[i], &sender_address ) );
+				proxy_check( packet_bytes[i] == send_bytes[expected] );
+				proxy_check( packet_data[i][0] == expected );
+				proxy_check( packet_data[i][packet_bytes[i] - 1] == expected );
+
+				for ( int j = 0; j < Prefix; ++j )
+				{
+					proxy_check( packet_data[i][j - Prefix] == 0xAB );
+				}
+
+				expected++;
+				while ( expected < NumPackets && destination[expected] != r )
+					expected++;
+			}
+		}
+
+		proxy_check( expected == NumPackets );
+	}
+
+	free( buffer );
+
+	proxy_platform_socket_destroy( receivers[1] );
+	proxy_platform_socket_destroy( receivers[0] );
+	proxy_platform_socket_destroy( sender );
+}
+
+static int test_slot_connect_receive( proxy_platform_socket_t * socket, proxy_address_t * from, uint8_t * data )
+{
+	// packets on loopback arrive right away, but give them a moment anyway
+
+	uint8_t * packet_data[1] = { data };
+	int packet_bytes[1] = { 0 };
+
+	for ( int i = 0; i < 20; ++i )
+	{
+		const int num_packets = proxy_platform_socket_receive_packets( socket, from, packet_data, packet_bytes, 256, 1 );
+		proxy_check( num_packets >= 0 );
+		if ( num_packets == 1 )
+			return packet_bytes[0];
+		proxy_sleep( 0.001 );
+	}
+
+	return 0;
+}
+
+void test_slot_connect()
+{
+	printf( "    test_slot_connect\n" );
+
+	proxy_address_t bind_address;
+
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+	proxy_platform_socket_t * slot = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+	proxy_check( slot );
+	const proxy_address_t slot_address = bind_address;
+
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+	proxy_platform_socket_t * server = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+	proxy_check( server );
+	const proxy_address_t server_address = bind_address;
+
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+	proxy_platform_socket_t * other = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+	proxy_check( other );
+	const proxy_address_t other_address = bind_address;
+
+	uint8_t packet[256];
+	proxy_address_t from;
+
+	if ( !proxy_platform_socket_connect( slot, &server_address ) )
+	{
+		printf( "    connected sockets not supported. skipping\n" );
+	}
+	else
+	{
+		// batched and single sends to the peer go out without an address, and the server sees them from the slot
+
+		void * send_data[3] = { packet, packet, packet };
+		int send_bytes[3] = { 10, 20, 30 };
+		proxy_address_t send_to[3] = { server_address, server_address, server_address };
+		memset( packet, 1, sizeof(packet) );
+		proxy_platform_socket_send_packets( slot, send_to, send_data, send_bytes, 3 );
+		proxy_platform_socket_send_packet( slot, &server_address, packet, 40 );
+
+		for ( int i = 0; i < 4; ++i )
+		{
+			proxy_check( test_slot_connect_receive( server, &from, packet ) == 10 * ( i + 1 ) );
+			proxy_check( proxy_address_equal( &from, &slot_address ) );
+		}
+
+		// only the server gets through to the slot
+
+		memset( packet, 2, sizeof(packet) );
+		proxy_platform_socket_send_packet( other, &slot_address, packet, 50 );
+		proxy_platform_socket_send_packet( server, &slot_address, packet, 60 );
+
+		proxy_check( test_slot_connect_receive( slot, &from, packet ) == 60 );
+		proxy_check( proxy_address_equal( &from, &server_address ) );
+		proxy_check( test_slot_connect_receive( slot, &from, packet ) == 0 );
+	}
+
+	// the server moves. the first send to the new address disconnects the slot, and after that it hears from anyone
+
+	proxy_platform_socket_send_packet( slot, &other_address, packet, 70 );
+
+	proxy_check( test_slot_connect_receive( other, &from, packet ) == 70 );
+	proxy_check( proxy_address_equal( &from, &slot_address ) );
+
+	proxy_platform_socket_send_packet( other, &slot_address, packet, 80 );
+	proxy_platform_socket_send_packet( server, &slot_address, packet, 90 );
+
+	proxy_check( test_slot_connect_receive( slot, &from, packet ) == 80 );
+	proxy_check( proxy_address_equal( &from, &other_address ) );
+	proxy_check( test_slot_connect_receive( slot, &from, packet ) == 90 );
+	proxy_check( proxy_address_equal( &from, &server_address ) );
+
+	// a peer that isn't listening refuses what a connected slot sends it. the next receive sees that, with or without gro, and it isn't a socket error
+
+	for ( int i = 0; i < 2; ++i )
+	{
+		proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+		proxy_platform_socket_t * closed = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+		proxy_check( closed );
+		const proxy_address_t closed_address = bind_address;
+		proxy_platform_socket_destroy( closed );
+
+		proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+		proxy_platform_socket_t * refused = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING | ( i ? PROXY_PLATFORM_SOCKET_GRO : 0 ), 0.0f, 100000, 100000 );
+		proxy_check( refused );
+
+		if ( proxy_platform_socket_connect( refused, &closed_address ) )
+		{
+			proxy_platform_socket_send_packet( refused, &closed_address, packet, 10 );
+
+			proxy_sleep( 0.01 );
+
+			uint8_t * packet_data[1] = { packet };
+			int packet_bytes[1] = { 0 };
+
+			proxy_check( proxy_platform_socket_receive_packets( refused, &from, packet_data, packet_bytes, sizeof(packet), 1 ) == 0 );
+		}
+
+		proxy_platform_socket_destroy( refused );
+	}
+
+	proxy_platform_socket_destroy( other );
+	proxy_platform_socket_destroy( server );
+	proxy_platform_socket_destroy( slot );
+}
+
+static double bench_socket_backend_run( proxy_platform_uring_t * uring, int num_packets, int socket_flags = 0, double * cpu_seconds = NULL )
+{
+	// packets go client -> proxy -> sink in bursts, like a proxy thread forwarding to the server. only the proxy side uses the backend
+
+	const int Burst = 32;
+	const int PacketBytes = 100;
+
+	proxy_address_t bind_address;
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+	proxy_platform_socket_t * client = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING | ( socket_flags & PROXY_PLATFORM_SOCKET_GSO ), 0.0f, 1000000, 1000000 );
+	proxy_check( client );
+
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+	proxy_platform_socket_t * proxy = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING | socket_flags, 0.0f, 1000000, 1000000 );
+	proxy_check( proxy );
+	const proxy_address_t proxy_address = bind_address;
+
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:0" ) );
+	proxy_platform_socket_t * sink = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 1000000, 1000000 );
+	proxy_check( sink );
+	const proxy_address_t sink_address = bind_address;
+
+	proxy_platform_poll_t * poll = NULL;
+	if ( uring )
+	{
+		proxy_check( proxy_platform_uring_add( uring, proxy, 0 ) );
+	}
+	else
+	{
+		poll = proxy_platform_poll_create( 1 );
+		proxy_check( poll );
+		proxy_check( proxy_platform_poll_add( poll, proxy, 0 ) );
+	}
+
+	uint8_t * buffer = (uint8_t*) calloc( PROXY_MAX_PACKETS_PER_RECEIVE, PacketBytes );
+
+	uint8_t * packet_data[PROXY_MAX_PACKETS_PER_RECEIVE];
+	void * send_data[PROXY_MAX_PACKETS_PER_RECEIVE];
+	int packet_bytes[PROXY_MAX_PACKETS_PER_RECEIVE];
+	proxy_address_t to[PROXY_MAX_PACKETS_PER_RECEIVE];
+	proxy_address_t from[PROXY_MAX_PACKETS_PER_RECEIVE];
+	uint64_t ids[PROXY_MAX_PACKETS_PER_RECEIVE];
+
+	int sent = 0;
+	int forwarded = 0;
+
+	const double start_time = proxy_time();
+
+	const clock_t start_clock = clock();
+
+	while ( sent < num_packets )
+	{
+		for ( int i = 0; i < Burst; ++i )
+		{
+			packet_data[i] = buffer + i * PacketBytes;
+			send_data[i] = packet_data[i];
+			packet_bytes[i] = PacketBytes;
+			to[i] = proxy_address;
+		}
+
+		proxy_platform_socket_send_packets( client, to, send_data, packet_bytes, Burst );
+
+		sent += Burst;
+
+		// the proxy side receives and forwards until the burst is through
+
+		double last_progress_time = proxy_time();
+
+		while ( forwarded < sent && proxy_time() - last_progress_time < 1.0 )
+		{
+			int num_packets_received = 0;
+
+			if ( uring )
+			{
+				num_packets_received = proxy_platform_uring_wait( uring, ids, from, packet_data, packet_bytes, PROXY_MAX_PACKETS_PER_RECEIVE, 0.001f );
+			}
+			else if ( proxy_platform_poll_wait( poll, ids, 1, 0.001f ) > 0 )
+			{
+				for ( int i = 0; i < PROXY_MAX_PACKETS_PER_RECEIVE; ++i )
+				{
+					packet_data[i] = buffer + i * PacketBytes;
+				}
+
+				num_packets_received = proxy_platform_socket_receive_packets( proxy, from, packet_data, packet_bytes, PacketBytes, PROXY_MAX_PACKETS_PER_RECEIVE );
+			}
+
+			if ( num_packets_received <= 0 )
+				continue;
+
+			for ( int i = 0; i < num_packets_received; ++i )
+			{
+				send_data[i] = packet_data[i];
+				to[i] = sink_address;
+			}
+
+			if ( uring )
+			{
+				proxy_platform_uring_send_packets( uring, proxy, to, send_data, packet_bytes, num_packets_received );
+				proxy_platform_uring_submit( uring );
+				proxy_platform_uring_recycle( uring );
+			}
+			else
+			{
+				proxy_platform_socket_send_packets( proxy, to, send_data, packet_bytes, num_packets_received );
+			}
+
+			forwarded += num_packets_received;
+
+			last_progress_time = proxy_time();
+		}
+
+		// drain the sink so its receive buffer never fills
+
+		for ( int i = 0; i < PROXY_MAX_PACKETS_PER_RECEIVE; ++i )
+		{
+			packet_data[i] = buffer + i * PacketBytes;
+		}
+
+		while ( proxy_platform_socket_receive_packets( sink, from, packet_data, packet_bytes, PacketBytes, PROXY_MAX_PACKETS_PER_RECEIVE ) > 0 ) {}
+	}
+
+	const double time = proxy_time() - start_time;
+
+	if ( cpu_seconds )
+	{
+		*cpu_seconds = double( clock() - start_clock ) / CLOCKS_PER_SEC;
+	}
+
+	if ( poll )
+	{
+		proxy_platform_poll_destroy( poll );
+	}
+
+	free( buffer );
+
+	proxy_platform_socket_destroy( sink );
+	proxy_platform_socket_destroy( proxy );
+	proxy_platform_socket_destroy( client );
+
+	return forwarded / time;
+}
+
+void bench_socket_backend()
+{
+	// forwarding rate of one thread through epoll + recvmmsg/sendmmsg against io_uring
+
+	const int NumPackets = 1000000;
+
+	printf( "    socket_backend: epoll -> %.0f packets/sec\n", bench_socket_backend_run( NULL, NumPackets ) );
+
+	proxy_platform_uring_t * uring = proxy_platform_uring_create( 1, PROXY_URING_BUFFERS, 100, PROXY_URING_SEND_BUFFERS );
+
+	if ( uring )
+	{
+		printf( "    socket_backend: io_uring -> %.0f packets/sec\n", bench_socket_backend_run( uring, NumPackets ) );
+
+		proxy_platform_uring_destroy( uring );
+	}
+	else
+	{
+		printf( "    socket_backend: io_uring not available\n" );
+	}
+}
+
+void bench_udp_segmentation()
+{
+	// the same forwarding loop with plain sockets, then with gso on the sends and gro on the proxy receive. cpu is
+	// the whole process (user and system), so it includes the kernel work on both ends of each hop
+
+	const int NumPackets = 1000000;
+
+	const char * names[] = { "off", "gso+gro" };
+	const int flags[] = { 0, PROXY_PLATFORM_SOCKET_GSO | PROXY_PLATFORM_SOCKET_GRO };
+
+	for ( int i = 0; i < 2; ++i )
+	{
+		double cpu_seconds = 0.0;
+		const double packets_per_second = bench_socket_backend_run( NULL, NumPackets, flags[i], &cpu_seconds );
+		printf( "    udp_segmentation: %s -> %.0f packets/sec, %.0f cpu ns/packet\n", names[i], packets_per_second, cpu_seconds * 1000000000.0 / NumPackets );
+	}
+}
+
+/*
+	With XDP_INTERFACE set, passthrough flows skip the proxy threads. An xdp program on that interface rewrites and
+	forwards packets between a client and the server for every slot in its maps, and passes everything else up to the
+	proxy threads as before: new clients, next packets, and non-ipv4 traffic.
+
+	The main thread manages the maps. Every tenth of a second it installs each allocated passthrough slot with an ipv4
+	client, and removes slots whose state changed since, so a slot that loses its client or upgrades to next falls
+	back to the proxy threads. The threads also clear the slot's map entry themselves the moment that happens, and the
+	slot entry is what the program checks last, so the main thread being behind only ever punts packets.
+*/
+
+#define PROXY_XDP_SYNC_INTERVAL                                       0.1
+
+struct proxy_xdp_flows_t
+{
+	proxy_platform_xdp_t * xdp;
+	int num_slots;
+	uint32_t * installed_state;					// slot state when installed. 0 if not installed
+	proxy_address_t * installed_client;
+};
+
+proxy_xdp_flows_t * proxy_xdp_flows_create( proxy_platform_xdp_t * xdp, int num_slots )
+{
+	assert( xdp );
+	assert( num_slots > 0 );
+
+	proxy_xdp_flows_t * flows = (proxy_xdp_flows_t*) calloc( 1, sizeof(proxy_xdp_flows_t) );
+	if ( !flows )
+		return NULL;
+
+	flows->xdp = xdp;
+	flows->num_slots = num_slots;
+	flows->installed_state = (uint32_t*) calloc( num_slots, sizeof(uint32_t) );
+	flows->installed_client = (proxy_address_t*) calloc( num_slots, sizeof(proxy_address_t) );
+
+	if ( !flows->installed_state || !flows->installed_client )
+	{
+		free( flows->installed_state );
+		free( flows->installed_client );
+		free( flows );
+		return NULL;
+	}
+
+	return flows;
+}
+
+void proxy_xdp_flows_destroy( proxy_xdp_flows_t * flows )
+{
+	assert( flows );
+	free( flows->installed_state );
+	free( flows->installed_client );
+	free( flows );
+}
+
+static void proxy_xdp_flows_remove( proxy_xdp_flows_t * flows, int slot )
+{
+	proxy_platform_xdp_slot_set( flows->xdp, slot, NULL );
+	proxy_platform_xdp_client_set( flows->xdp, &flows->installed_client[slot], -1 );
+	flows->installed_state[slot] = 0;
+}
+
+void proxy_xdp_flows_sync( proxy_xdp_flows_t * flows, const proxy_slot_data_t * slots )
+{
+	// removals first, so a client that moved to another slot is installed for its new slot, not removed from it
+
+	assert( flows );
+	assert( slots );
+
+	for ( int i = 0; i < flows->num_slots; ++i )
+	{
+		if ( !flows->installed_state[i] )
+			continue;
+
+		uint32_t state;
+		proxy_address_t client_address;
+
+		if ( !proxy_slot_read_client( &slots[i], &state, &client_address ) || state != flows->installed_state[i] )
+		{
+			proxy_xdp_flows_remove( flows, i );
+		}
+	}
+
+	for ( int i = 0; i < flows->num_slots; ++i )
+	{
+		if ( flows->installed_state[i] )
+			continue;
+
+		uint32_t state;
+		proxy_address_t client_address;
+
+		if ( !proxy_slot_read_client( &slots[i], &state, &client_address ) )
+			continue;
+
+		if ( ( state & PROXY_SLOT_STATE_NEXT ) || client_address.type != PROXY_ADDRESS_IPV4 )
+			continue;
+
+		flows->installed_client[i] = client_address;
+		flows->installed_state[i] = state;
+
+		if ( !proxy_platform_xdp_slot_set( flows->xdp, i, &client_address ) || !proxy_platform_xdp_client_set( flows->xdp, &client_address, i ) )
+		{
+			proxy_xdp_flows_remove( flows, i );
+			continue;
+		}
+
+		// the slot may have changed hands, or gone next, while it was installed. the thread that changed it may have cleared the slot entry before it was set
+
+		if ( proxy_slot_state( &slots[i] ) != state )
+		{
+			proxy_xdp_flows_remove( flows, i );
+		}
+	}
+}
+
+struct test_xdp_data_t
+{
+	bool available;
+	bool done;
+};
+
+static void test_xdp_receive( proxy_platform_socket_t * socket, proxy_address_t * from, uint8_t * data, int * bytes )
+{
+	*bytes = 0;
+	for ( int i = 0; i < 1000; ++i )
+	{
+		*bytes = proxy_platform_socket_receive_packet( socket, from, data, 100 );
+		if ( *bytes > 0 )
+			return;
+		proxy_sleep( 0.001 );
+	}
+}
+
+static proxy_platform_thread_return_t PROXY_PLATFORM_THREAD_FUNC test_xdp_thread_function( void * arg )
+{
+	// runs in its own network namespace, with generic xdp on loopback and forwarding on, so it can't disturb anything on the host
+
+	test_xdp_data_t * test_data = (test_xdp_data_t*) arg;
+
+	const int NumSlots = 4;
+	const int SlotBasePort = 41000;
+
+	proxy_address_t proxy_address, server_address, client_address, bind_address, from;
+	proxy_check( proxy_address_parse( &proxy_address, "127.0.0.1:40000" ) );
+	proxy_check( proxy_address_parse( &server_address, "127.0.0.1:40001" ) );
+	proxy_check( proxy_address_parse( &client_address, "127.0.0.1:40002" ) );
+
+	proxy_platform_xdp_t * xdp = NULL;
+
+	if ( proxy_platform_network_namespace_create() )
+	{
+		xdp = proxy_platform_xdp_create( "lo", false, proxy_address.port, &server_address, SlotBasePort, NumSlots );
+	}
+
+	if ( !xdp )
+	{
+		test_data->done = true;
+		PROXY_PLATFORM_THREAD_RETURN();
+	}
+
+	test_data->available = true;
+
+	proxy_platform_socket_t * proxy_socket = proxy_platform_socket_create( &proxy_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+	proxy_platform_socket_t * server_socket = proxy_platform_socket_create( &server_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+	proxy_platform_socket_t * client_socket = proxy_platform_socket_create( &client_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+	proxy_check( proxy_socket );
+	proxy_check( server_socket );
+	proxy_check( client_socket );
+
+	proxy_check( proxy_address_parse( &bind_address, "127.0.0.1:41002" ) );
+	proxy_platform_socket_t * slot_socket = proxy_platform_socket_create( &bind_address, PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, 100000, 100000 );
+	proxy_check( slot_socket );
+
+	proxy_slot_data_t slots[NumSlots];
+	memset( slots, 0, sizeof(slots) );
+
+	proxy_xdp_flows_t * flows = proxy_xdp_flows_create( xdp, NumSlots );
+	proxy_check( flows );
+
+	uint8_t data[100];
+	int bytes;
+
+	// no flows yet. passthrough packets from the client reach the proxy untouched
+
+	const uint8_t client_packet[] = { 0, 1, 2, 3 };
+	proxy_platform_socket_send_packet( client_socket, &proxy_address, client_packet, sizeof(client_packet) );
+	test_xdp_receive( proxy_socket, &from, data, &bytes );
+	proxy_check( bytes == 4 );
+	proxy_check( memcmp( data, client_packet, 4 ) == 0 );
+	proxy_check( proxy_address_equal( &from, &client_address ) );
+
+	// once slot 2 is installed for the client, the kernel forwards between the client and the server itself
+
+	slots[2].client_address = client_address;
+	__atomic_store_n( &slots[2].state, uint32_t( PROXY_SLOT_STATE_ALLOCATED ), __ATOMIC_RELEASE );
+	proxy_xdp_flows_sync( flows, slots );
+	proxy_check( proxy_platform_xdp_slot_idle_seconds( xdp, 2 ) < 0.0 );
+
+	proxy_platform_socket_send_packet( client_socket, &proxy_address, client_packet, sizeof(client_packet) );
+	test_xdp_receive( server_socket, &from, data, &bytes );
+	proxy_check( bytes == 3 );
+	proxy_check( data[0] == 1 && data[1] == 2 && data[2] == 3 );
+	proxy_check( proxy_address_equal( &from, &bind_address ) );
+	proxy_check( proxy_platform_socket_receive_packet( proxy_socket, &from, data, sizeof(data) ) <= 0 );
+
+	const double idle_seconds = proxy_platform_xdp_slot_idle_seconds( xdp, 2 );
+	proxy_check( idle_seconds >= 0.0 && idle_seconds < 10.0 );
+
+	const uint8_t server_packet[] = { 4, 5 };
+	proxy_platform_socket_send_packet( server_socket, &bind_address, server_packet, sizeof(server_packet) );
+	test_xdp_receive( client_socket, &from, data, &bytes );
+	proxy_check( bytes == 3 );
+	proxy_check( data[0] == 0 && data[1] == 4 && data[2] == 5 );
+	proxy_check( proxy_address_equal( &from, &proxy_address ) );
+	proxy_check( proxy_platform_socket_receive_packet( slot_socket, &from, data, sizeof(data) ) <= 0 );
+
+	// next packets are always for the proxy threads
+
+	const uint8_t next_packet[] = { 1, 2, 3, 4 };
+	proxy_platform_socket_send_packet( client_socket, &proxy_address, next_packet, sizeof(next_packet) );
+	test_xdp_receive( proxy_socket, &from, data, &bytes );
+	proxy_check( bytes == 4 );
+	proxy_check( data[0] == 1 );
+
+	uint64_t packets_to_server = 0, packets_to_client = 0;
+	proxy_platform_xdp_counters( xdp, &packets_to_server, &packets_to_client );
+	proxy_check( packets_to_server == 1 );
+	proxy_check( packets_to_client == 1 );
+
+	// a slot that upgrades to next goes back to the proxy threads, then comes back when it drops to passthrough again
+
+	__atomic_fetch_or( &slots[2].state, PROXY_SLOT_STATE_NEXT, __ATOMIC_RELEASE );
+	proxy_xdp_flows_sync( flows, slots );
+	proxy_check( flows->installed_state[2] == 0 );
+
+	proxy_platform_socket_send_packet( server_socket, &bind_address, server_packet, sizeof(server_packet) );
+	test_xdp_receive( slot_socket, &from, data, &bytes );
+	proxy_check( bytes == 2 );
+	proxy_check( proxy_address_equal( &from, &server_address ) );
+
+	__atomic_fetch_and( &slots[2].state, ~uint32_t( PROXY_SLOT_STATE_NEXT ), __ATOMIC_RELEASE );
+	proxy_xdp_flows_sync( flows, slots );
+	proxy_check( flows->installed_state[2] != 0 );
+
+	// a slot that loses its client stops forwarding for it at once
+
+	__atomic_store_n( &slots[2].state, uint32_t( PROXY_SLOT_STATE_GENERATION ), __ATOMIC_RELEASE );
+	proxy_platform_xdp_slot_set( xdp, 2, NULL );
+
+	proxy_platform_socket_send_packet( client_socket, &proxy_address, client_packet, sizeof(client_packet) );
+	test_xdp_receive( proxy_socket, &from, data, &bytes );
+	proxy_check( bytes == 4 );
+	proxy_check( data[0] == 0 );
+
+	proxy_xdp_flows_sync( flows, slots );
+	proxy_check( flows->installed_state[2] == 0 );
+
+	proxy_xdp_flows_destroy( flows );
+	proxy_platform_socket_destroy( slot_socket );
+	proxy_platform_socket_destroy( client_socket );
+	proxy_platform_socket_destroy( server_socket );
+	proxy_platform_socket_destroy( proxy_socket );
+	proxy_platform_xdp_destroy( xdp );
+
+	test_data->done = true;
+
+	PROXY_PLATFORM_THREAD_RETURN();
+}
+
+void test_xdp()
+{
+	printf( "    test_xdp\n" );
+
+	test_xdp_data_t test_data;
+	memset( &test_data, 0, sizeof(test_data) );
+
+	proxy_platform_thread_t * thread = proxy_platform_thread_create( test_xdp_thread_function, &test_data );
+	proxy_check( thread );
+	proxy_platform_thread_join( thread );
+	proxy_platform_thread_destroy( thread );
+
+	proxy_check( test_data.done );
+
+	if ( !test_data.available )
+	{
+		printf( "    xdp not available. skipping\n" );
+	}
+}
+
+static proxy_platform_uring_t * proxy_thread_create_uring( proxy_thread_data_t * thread_data, int buffer_size )
+{
+	proxy_platform_uring_t * uring = proxy_platform_uring_create( config.num_slots_per_thread + 2, PROXY_URING_BUFFERS, buffer_size, PROXY_URING_SEND_BUFFERS );
+	if ( !uring )
+		return NULL;
+
+	bool ok = proxy_platform_uring_add( uring, thread_data->socket, PROXY_POLL_ID_THREAD_SOCKET );
+
+	ok = ok && proxy_platform_uring_add_event( uring, thread_data->return_event, PROXY_POLL_ID_RETURN_EVENT );
+
+	if ( thread_data->tunnel_socket )
+	{
+		ok = ok && proxy_platform_uring_add( uring, thread_data->tunnel_socket, PROXY_POLL_ID_TUNNEL_SOCKET );
+	}
+
+	for ( int i = 0; ok && !thread_data->tunnel_socket && i < config.num_slots_per_thread; ++i )
+	{
+		ok = proxy_platform_uring_add( uring, thread_data->slots[thread_data->thread_number * config.num_slots_per_thread + i].socket, uint64_t(i) );
+	}
+
+	if ( !ok )
+	{
+		proxy_platform_uring_destroy( uring );
+		return NULL;
+	}
+
+	return uring;
+}
+
+static proxy_platform_thread_return_t PROXY_PLATFORM_THREAD_FUNC proxy_thread_function( void * data )
+{
+	proxy_thread_data_t * thread_data = (proxy_thread_data_t*) data;
+
+	if ( config.cpu_placement )
+	{
+		proxy_thread_place( thread_data );
+	}
+
+	printf( "proxy thread %d started\n", thread_data->thread_number );
+
+	fflush( stdout );
+
+	for ( int i = 0; i < config.num_threads; ++i )
+	{
+		assert( thread_data->thread_sockets[i] != NULL );
+	}
+
+    // process received packets in batches. packets to send are queued per destination socket and flushed at the end of each batch
+
+    const int prefix = PROXY_NEXT_PREFIX_BYTES;
+
+    // room for a tunnel header on top of a full size packet, either way
+
+    const int receive_packet_size = config.max_packet_size + ( config.tunnel ? PROXY_TUNNEL_HEADER_BYTES : 0 );
+
+    const int buffer_size = prefix + receive_packet_size;
+
+    thread_data->send_queue = proxy_send_queue_create( buffer_size );
+
+    if ( !thread_data->send_queue )
+    {
+        printf( "error: could not allocate packet buffers for proxy thread %d\n", thread_data->thread_number );
+		exit(1);
+    }
+
+    proxy_platform_uring_t * uring = NULL;
+
+    if ( config.io_uring )
+    {
+    	uring = proxy_thread_create_uring( thread_data, buffer_size );
+
+    	if ( !uring )
+    	{
+    		printf( "proxy thread %d could not set up io_uring. falling back to epoll\n", thread_data->thread_number );
+    	}
+    }
+
+    thread_data->send_queue->uring = uring;
+
+	// otherwise one event loop per proxy thread watches the thread socket and all of its slot sockets
+
+	proxy_platform_poll_t * poll = NULL;
+
+	// one gro receive can carry up to 64 packets, so give recvmmsg room for a few of them
+
+	const int max_received = ( uring || config.udp_segmentation ) ? PROXY_URING_MAX_PACKETS_PER_WAIT : PROXY_MAX_PACKETS_PER_RECEIVE;
+
+	if ( !uring )
+	{
+		poll = proxy_platform_poll_create( config.num_slots_per_thread + 2 );
+		if ( !poll )
 		{
-			debug_printf( "proxy thread %d swap\n", thread_data->thread_number );
-			session_table_swap( thread_data->session_table );
-			last_swap_time = current_time;
+	        printf( "error: could not create poll set for proxy thread %d\n", thread_data->thread_number );
+			exit(1);
 		}
 
-		if ( packet_data[0] == 0 )
+		if ( !proxy_platform_poll_add( poll, thread_data->socket, PROXY_POLL_ID_THREAD_SOCKET ) )
 		{
-			// passthrough packet
+	        printf( "error: could not add thread socket to poll set\n" );
+			exit(1);
+		}
 
-			int slot = session_table_get( thread_data->session_table, &from );
+		if ( !proxy_platform_poll_add_event( poll, thread_data->return_event, PROXY_POLL_ID_RETURN_EVENT ) )
+		{
+	        printf( "error: could not add return event to poll set\n" );
+			exit(1);
+		}
 
-			if ( slot != -1 )
-	  		{
-	  			// found existing slot for client
-	  			
-	  			assert( slot >= 0 );
-	  			assert( slot < config.num_slots_per_thread );
+		if ( thread_data->tunnel_socket && !proxy_platform_poll_add( poll, thread_data->tunnel_socket, PROXY_POLL_ID_TUNNEL_SOCKET ) )
+		{
+	        printf( "error: could not add tunnel socket to poll set\n" );
+			exit(1);
+		}
 
-				proxy_platform_mutex_acquire( &thread_data->slot_thread_data[slot]->mutex );
-				bool allocated = thread_data->slot_thread_data[slot]->allocated;
-				proxy_platform_mutex_release( &thread_data->slot_thread_data[slot]->mutex );
+		for ( int i = 0; !thread_data->tunnel_socket && i < config.num_slots_per_thread; ++i )
+		{
+			if ( !proxy_platform_poll_add( poll, thread_data->slots[thread_data->thread_number * config.num_slots_per_thread + i].socket, uint64_t(i) ) )
+			{
+		        printf( "error: could not add slot socket %d to poll set\n", i );
+				exit(1);
+			}
+		}
 
-				if ( allocated )
-				{
-					// forward packet to server
+	    // enough buffers to fill every receive slot, plus every packet the send queue can hold by reference before it flushes.
+	    // only epoll gets a pool. io_uring receives into its own provided buffer ring and copies every send into a send
+	    // buffer the kernel owns until the send completes, so there it keeps the copying path
 
-					debug_printf( "proxy thread %d forwarded packet to server for slot %d\n", thread_data->thread_number, slot );
-					
-					proxy_platform_socket_send_packet( thread_data->slot_thread_data[slot]->socket, &config.server_address, packet_data + 1, packet_bytes - 1 );
-	                
-	                thread_data->slot_data[slot].last_packet_receive_time = proxy_time();
-				}
-				else
-				{
-	  				debug_printf( "proxy thread %d dropped packet because slot %d is not allocated?\n", thread_data->thread_number, slot );
-				}
-	  		}
-	  		else
-	  		{
-	  			// new client. add to slot if possible
+	    thread_data->packet_pool = proxy_packet_pool_create( max_received + PROXY_SEND_QUEUE_SIZE, receive_packet_size );
 
-	  			int slot = -1;
+	    if ( !thread_data->packet_pool )
+	    {
+	        printf( "error: could not allocate packet buffers for proxy thread %d\n", thread_data->thread_number );
+			exit(1);
+	    }
+	}
 
-	  			for ( int i = 0; i < config.num_slots_per_thread; ++i )
-	  			{
-	                double current_time = proxy_time();
+    thread_data->send_queue->pool = thread_data->packet_pool;
 
-	  				double last_packet_receive_time = thread_data->slot_data[i].last_packet_receive_time;
+    uint8_t * receive_packet_data[PROXY_URING_MAX_PACKETS_PER_WAIT];
+    int receive_packet_bytes[PROXY_URING_MAX_PACKETS_PER_WAIT];
+    proxy_address_t receive_from[PROXY_URING_MAX_PACKETS_PER_WAIT];
+    uint64_t receive_ids[PROXY_URING_MAX_PACKETS_PER_WAIT];
+    int receive_buffers[PROXY_URING_MAX_PACKETS_PER_WAIT];
+
+    // packets are received at the end of the headroom, which leaves at least the next prefix in front of them
+
+    assert( PROXY_PACKET_HEADROOM >= prefix + PROXY_TUNNEL_HEADER_BYTES );
+
+    for ( int i = 0; thread_data->packet_pool && i < max_received; ++i )
+    {
+    	receive_buffers[i] = proxy_packet_pool_alloc( thread_data->packet_pool );
+    	assert( receive_buffers[i] >= 0 );
+    	receive_packet_data[i] = proxy_packet_pool_data( thread_data->packet_pool, receive_buffers[i] );
+    }
 
-	  				double time_since_last_packet_receive = current_time - last_packet_receive_time;
+    thread_data->receive_buffers = receive_buffers;
+    thread_data->receive_packet_data = receive_packet_data;
+    thread_data->receive_index = -1;
 
-	  				if ( time_since_last_packet_receive >= config.slot_timeout_seconds )
-	  				{
-		  				printf( "proxy thread %d slot %d has new client %s\n", thread_data->thread_number, i, proxy_address_to_string( &from, string_buffer ) );
-		  				fflush( stdout );
-	  					
-	  					slot = i;
+    uint64_t ready[PROXY_MAX_POLL_EVENTS];
 
-						proxy_platform_mutex_acquire( &thread_data->slot_thread_data[slot]->mutex );
-						thread_data->slot_thread_data[slot]->allocated = true;
-						thread_data->slot_thread_data[slot]->next = false;
-						thread_data->slot_thread_data[slot]->client_address = from;
+    proxy_ring_t * rings[] = { thread_data->return_ring, thread_data->handoff_ring };
 
-						proxy_platform_mutex_release( &thread_data->slot_thread_data[slot]->mutex );
+	while ( !quit )
+	{
+		// only block if the next server thread and the other proxy threads have nothing queued for us. they signal the return event if they queue packets while we wait
 
-						session_table_insert( thread_data->session_table, &from, slot );
+		const bool parked = proxy_consumer_park( &thread_data->return_waiting, rings, 2 );
 
-						thread_data->slot_data[slot].last_packet_receive_time = current_time;
+		const float timeout_seconds = parked ? 0.1f : 0.0f;
 
-						break;
-	  				}
-	  			}
+		int num_ready = uring ? proxy_platform_uring_wait( uring, receive_ids, receive_from, receive_packet_data, receive_packet_bytes, max_received, timeout_seconds )
+		                      : proxy_platform_poll_wait( poll, ready, PROXY_MAX_POLL_EVENTS, timeout_seconds );
 
-	  			if ( slot < 0 )
-	  			{
-	  				debug_printf( "proxy thread %d dropped packet. no client slot found for address %s\n", thread_data->thread_number, proxy_address_to_string( &from, string_buffer ) );
-	  				continue;
-	  			}
+		__atomic_store_n( &thread_data->return_waiting, 0, __ATOMIC_RELAXED );
 
-				// forward packet to server
+		if ( num_ready < 0 )
+			break;
 
-	            assert( slot >= 0 );
-	            assert( slot < config.num_slots_per_thread );
+		// load is the fraction of time spent outside of poll
 
-				proxy_platform_socket_send_packet( thread_data->slot_thread_data[slot]->socket, &config.server_address, packet_data + 1, packet_bytes - 1 );
+		const double busy_start_time = proxy_time();
 
-				// send dummy passthrough packet to the next thread so it sees the new client and upgrades it
+		proxy_thread_update_slot_timers( thread_data, busy_start_time );
 
-	            packet_data[0] = NEXT_PASSTHROUGH_PACKET;
-	            packet_data[1] = from.data.ipv4[0];
-	            packet_data[2] = from.data.ipv4[1];
-	            packet_data[3] = from.data.ipv4[2];
-	            packet_data[4] = from.data.ipv4[3];
-	            packet_data[5] = uint8_t( from.port >> 8 );
-	            packet_data[6] = uint8_t( from.port );
-	            packet_data[7] = uint8_t( thread_data->thread_number >> 8 );
-	            packet_data[8] = uint8_t( thread_data->thread_number );
-	            packet_data[9] = uint8_t( slot >> 8 );
-	            packet_data[10] = uint8_t( slot );
+		proxy_thread_update_steering( thread_data );
 
-				next_platform_socket_send_packet( thread_data->next_socket, (next_address_t*) &config.next_local_address, packet_data, prefix + 1 );
-	  		}
-		}
-		else
+		if ( uring )
 		{
-			// other packet types
+			// each completion is already a packet, or the return event firing
 
-			if ( !proxy_basic_packet_filter( packet_data, packet_bytes ) )
+			for ( int i = 0; i < num_ready; ++i )
 			{
-				debug_printf( "basic packet filter dropped packet\n" );
-				continue;
+				if ( receive_ids[i] == PROXY_POLL_ID_RETURN_EVENT )
+				{
+					proxy_platform_event_clear( thread_data->return_event );
+					continue;
+				}
+
+				if ( receive_packet_bytes[i] <= 0 )
+					continue;
+
+				proxy_thread_process_received_packet( thread_data, receive_ids[i], &receive_from[i], receive_packet_data[i] - prefix, receive_packet_bytes[i] );
 			}
 
-            const uint8_t packet_type = packet_data[0];
+			proxy_platform_uring_recycle( uring );
+		}
+		else
+		{
+			for ( int i = 0; i < num_ready; ++i )
+			{
+				if ( ready[i] == PROXY_POLL_ID_RETURN_EVENT )
+				{
+					proxy_platform_event_clear( thread_data->return_event );
+					continue;
+				}
+
+				proxy_platform_socket_t * socket = NULL;
 
-            switch ( packet_type )
-            {
-            	case NEXT_PASSTHROUGH_PACKET:
-            	case NEXT_DIRECT_PACKET:
-            	case NEXT_DIRECT_PING_PACKET:
-				case NEXT_UPGRADE_RESPONSE_PACKET:
-				case NEXT_CLIENT_STATS_PACKET:
-				case NEXT_ROUTE_UPDATE_ACK_PACKET:
-				default:
-					break;
-            }
-            
-			int slot = session_table_get( thread_data->session_table, &from );
-			if ( slot == -1 )
-				continue;
+				if ( ready[i] == PROXY_POLL_ID_THREAD_SOCKET )
+				{
+					socket = thread_data->socket;
+				}
+				else if ( ready[i] == PROXY_POLL_ID_TUNNEL_SOCKET )
+				{
+					socket = thread_data->tunnel_socket;
+				}
+				else
+				{
+					assert( ready[i] < uint64_t( config.num_slots_per_thread ) );
+					socket = thread_data->slots[thread_data->thread_number * config.num_slots_per_thread + int( ready[i] )].socket;
+				}
+
+				int num_packets = proxy_platform_socket_receive_packets( socket, receive_from, receive_packet_data, receive_packet_bytes, receive_packet_size, max_received );
 
-            packet_data = buffer;
-            packet_bytes += prefix;
+				for ( int j = 0; j < num_packets; ++j )
+				{
+					if ( receive_packet_bytes[j] <= 0 )
+						continue;
 
-            packet_data[0] = packet_type;
-            packet_data[1] = from.data.ipv4[0];
-            packet_data[2] = from.data.ipv4[1];
-            packet_data[3] = from.data.ipv4[2];
-            packet_data[4] = from.data.ipv4[3];
-            packet_data[5] = uint8_t( from.port >> 8 );
-            packet_data[6] = uint8_t( from.port );
-            packet_data[7] = uint8_t( thread_data->thread_number >> 8 );
-            packet_data[8] = uint8_t( thread_data->thread_number );
-            packet_data[9] = uint8_t( slot >> 8 );
-            packet_data[10] = uint8_t( slot );
+					thread_data->receive_index = j;
 
-            // forward packet to next server
+					proxy_thread_process_received_packet( thread_data, ready[i], &receive_from[j], receive_packet_data[j] - prefix, receive_packet_bytes[j] );
+				}
 
-			next_platform_socket_send_packet( thread_data->next_socket, (next_address_t*) &config.next_local_address, packet_data, packet_bytes );
+				thread_data->receive_index = -1;
+			}
 		}
-	}
 
-	// shutdown
+		// adopt messages first. the next server thread may already be sending this thread payloads for adopted slots
 
-	debug_printf( "proxy thread %d stopping...\n", thread_data->thread_number );	
+		proxy_thread_process_handoff_ring( thread_data );
 
-	proxy_platform_socket_destroy( thread_data->socket );
+		proxy_thread_process_return_ring( thread_data );
 
-	for ( int i = 0; i < config.num_slots_per_thread; ++i )
-	{
-		proxy_platform_socket_close( thread_data->slot_thread_data[i]->socket );
+		proxy_send_queue_flush( thread_data->send_queue );
+
+		proxy_counter_add( &thread_data->busy_nanoseconds, uint64_t( ( proxy_time() - busy_start_time ) * 1000000000.0 ) );
 	}
 
-	debug_printf( "proxy thread %d joining slot threads\n", thread_data->thread_number );
+	// shutdown
 
-	for ( int i = 0; i < config.num_slots_per_thread; ++i )
+	if ( uring )
 	{
-		proxy_platform_thread_join( thread_data->slot_thread_data[i]->thread );
+		proxy_platform_uring_destroy( uring );
 	}
-    
-	debug_printf( "proxy thread %d destroying slot threads\n", thread_data->thread_number );
 
-	for ( int i = 0; i < config.num_slots_per_thread; ++i )
+	if ( poll )
+	{
+		proxy_platform_poll_destroy( poll );
+	}
+
+	proxy_send_queue_destroy( thread_data->send_queue );
+
+	thread_data->send_queue = NULL;
+
+	if ( thread_data->packet_pool )
 	{
-		proxy_platform_thread_destroy( thread_data->slot_thread_data[i]->thread );
-		proxy_platform_mutex_destroy( &thread_data->slot_thread_data[i]->mutex );
-		free( thread_data->slot_thread_data[i] );
-		thread_data->slot_thread_data[i] = NULL;
+		proxy_packet_pool_destroy( thread_data->packet_pool );
+		thread_data->packet_pool = NULL;
 	}
 
+	thread_data->receive_buffers = NULL;
+	thread_data->receive_packet_data = NULL;
+
 	printf( "proxy thread %d stopped\n", thread_data->thread_number );	
 
 	fflush( stdout );
@@ -1463,26 +5835,75 @@ static proxy_platform_thread_return_t PROXY_PLATFORM_THREAD_FUNC server_thread_f
 
     (void) string_buffer;
 
-	while ( true )
+	const int packet_size = config.max_packet_size + ( config.tunnel ? PROXY_TUNNEL_HEADER_BYTES : 0 );
+
+	uint8_t * buffer = (uint8_t*) malloc( size_t(packet_size) * PROXY_MAX_PACKETS_PER_RECEIVE );
+	if ( !buffer )
 	{
-		uint8_t buffer[config.max_packet_size];
+		printf( "error: could not allocate packet buffers for server thread %d\n", thread_data->thread_number );
+		exit(1);
+	}
 
-		proxy_address_t from;
+	uint8_t * packet_data[PROXY_MAX_PACKETS_PER_RECEIVE];
+	int packet_bytes[PROXY_MAX_PACKETS_PER_RECEIVE];
+	proxy_address_t from[PROXY_MAX_PACKETS_PER_RECEIVE];
 
-		int packet_bytes = proxy_platform_socket_receive_packet( thread_data->socket, &from, buffer, config.max_packet_size );
+	for ( int i = 0; i < PROXY_MAX_PACKETS_PER_RECEIVE; ++i )
+	{
+		packet_data[i] = buffer + i * packet_size;
+	}
+
+	while ( !quit )
+	{
+		int num_packets = proxy_platform_socket_receive_packets( thread_data->socket, from, packet_data, packet_bytes, packet_size, PROXY_MAX_PACKETS_PER_RECEIVE );
 
-		if ( packet_bytes < 0 )
+		if ( num_packets < 0 )
 			break;
 
-		if ( packet_bytes == 0 )
-			continue;
+		// reflect the whole batch back to where each packet came from
+
+		int num_send_packets = 0;
+
+		void * send_packet_data[PROXY_MAX_PACKETS_PER_RECEIVE];
+		int send_packet_bytes[PROXY_MAX_PACKETS_PER_RECEIVE];
+		proxy_address_t send_to[PROXY_MAX_PACKETS_PER_RECEIVE];
 
-		// debug_printf( "server thread %d reflected %d byte packet back to %s\n", thread_data->thread_number, packet_bytes, proxy_address_to_string( &from, string_buffer ) );
+		for ( int i = 0; i < num_packets; ++i )
+		{
+			if ( packet_bytes[i] <= 0 )
+				continue;
+
+			// debug_printf( "server thread %d reflected %d byte packet back to %s\n", thread_data->thread_number, packet_bytes[i], proxy_address_to_string( &from[i], string_buffer ) );
+
+			if ( config.tunnel )
+			{
+				// the game sees each client's payload and replies to that client. the reply goes back through the tunnel it came in on
+
+				proxy_tunnel_client_t client;
+				uint8_t * payload = NULL;
+
+				const int payload_bytes = proxy_tunnel_decapsulate( &from[i], packet_data[i], packet_bytes[i], &client, &payload );
+
+				if ( payload_bytes < 0 )
+					continue;
 
-		proxy_platform_socket_send_packet( thread_data->socket, &from, buffer, packet_bytes );
+				uint8_t * tunnel_packet = NULL;
+				send_packet_bytes[num_send_packets] = proxy_tunnel_encapsulate( &client, payload, payload_bytes, &send_to[num_send_packets], &tunnel_packet );
+				send_packet_data[num_send_packets] = tunnel_packet;
+				num_send_packets++;
+				continue;
+			}
+
+			send_packet_data[num_send_packets] = packet_data[i];
+			send_packet_bytes[num_send_packets] = packet_bytes[i];
+			send_to[num_send_packets] = from[i];
+			num_send_packets++;
+		}
+
+		proxy_platform_socket_send_packets( thread_data->socket, send_to, send_packet_data, send_packet_bytes, num_send_packets );
 	}
 
-	proxy_platform_socket_destroy( thread_data->socket );
+	free( buffer );
 
 	printf( "server thread %d stopped\n", thread_data->thread_number );	
 
@@ -1496,12 +5917,16 @@ static proxy_platform_thread_return_t PROXY_PLATFORM_THREAD_FUNC server_thread_f
 struct next_thread_data_t
 {
 	next_server_t * next_server;
-	proxy_platform_socket_t ** thread_sockets;
-	proxy_platform_socket_t ** slot_sockets;
-	session_table_t * session_table;
-	double last_session_table_swap_time;
+	proxy_session_directory_t * session_directory;
+	proxy_address_t * socket_client_addresses;
+	uint32_t * socket_handles;
 	proxy_thread_data_t ** proxy_thread_data;
-	next_platform_socket_t * next_socket;
+	proxy_slot_data_t * slots;
+	proxy_ring_t ** next_rings;
+	int * source_budget;
+	int source_ring_index;
+	bool source_pass_active;
+	uint32_t next_waiting;
 };
 
 void next_packet_received( next_server_t * server, void * context, const next_address_t * from, const uint8_t * packet_data, int packet_bytes )
@@ -1516,42 +5941,139 @@ void next_packet_received( next_server_t * server, void * context, const next_ad
     assert( false );
 }
 
-void next_packet_receive_callback( void * data, next_address_t * from, uint8_t * packet_data, int * begin, int * end )
+static bool next_thread_session_client( next_thread_data_t * thread_data, uint32_t handle, proxy_address_t * client_address, bool * new_session )
 {
-	next_thread_data_t * thread_data = ( next_thread_data_t*) data;
+	// false if the slot has moved on to a newer client since the packet was sent
 
-	assert( thread_data );
+	const int socket_index = proxy_session_handle_slot( handle );
 
-	// ignore any packet that's too short to be valid
+	if ( thread_data->socket_handles[socket_index] == handle && thread_data->socket_client_addresses[socket_index].type != PROXY_ADDRESS_NONE )
+	{
+		*client_address = thread_data->socket_client_addresses[socket_index];
+		*new_session = false;
+		return true;
+	}
 
-	const int packet_bytes = *end - *begin;
+	// a generation this thread hasn't seen for the slot. the client is read from the slot itself
+
+	uint32_t state;
+
+	if ( !proxy_slot_read_client( &thread_data->slots[socket_index], &state, client_address ) || !proxy_session_handle_matches( handle, state ) )
+		return false;
+
+	*new_session = true;
+	return true;
+}
+
+void test_session_handle()
+{
+	printf( "    test_session_handle\n" );
+
+	// the prefix round trips the packet type and the handle for every slot a handle can address
 
-	if ( packet_bytes <= 11 )
+	const int slots[] = { 0, 1, 255, 256, 65535, 65536, PROXY_SESSION_HANDLE_MAX_SLOTS - 1 };
+
+	for ( int i = 0; i < int( sizeof(slots) / sizeof(slots[0]) ); ++i )
 	{
-		debug_printf( "packet too small (%d bytes)\n", packet_bytes );
-		*begin = 0;
-		*end = 0;
-		return;
+		const uint32_t state = PROXY_SLOT_STATE_ALLOCATED | ( uint32_t( i * 37 ) * PROXY_SLOT_STATE_GENERATION );
+		const uint32_t handle = proxy_session_handle( slots[i], state );
+
+		uint8_t prefix[PROXY_NEXT_PREFIX_BYTES];
+		proxy_write_next_prefix( prefix, NEXT_DIRECT_PACKET, handle );
+		proxy_check( prefix[0] == NEXT_DIRECT_PACKET );
+		proxy_check( proxy_read_session_handle( prefix ) == handle );
+		proxy_check( proxy_session_handle_slot( handle ) == slots[i] );
+		proxy_check( proxy_session_handle_matches( handle, state ) );
+		proxy_check( proxy_session_handle_matches( handle, state | PROXY_SLOT_STATE_NEXT ) );
+		proxy_check( !proxy_session_handle_matches( handle, state + PROXY_SLOT_STATE_GENERATION ) );
 	}
 
-	// special case: forward packet from server to client
+	// the next thread takes a known session from its own arrays, and a new generation on the slot from the slot itself
+
+	const proxy_config_t saved_config = config;
+
+	config.num_threads = 1;
+	config.num_slots_per_thread = 4;
+
+	proxy_slot_data_t slot_data[4];
+	memset( slot_data, 0, sizeof(slot_data) );
+
+	proxy_address_t addresses[4];
+	uint32_t handles[4];
+	memset( addresses, 0, sizeof(addresses) );
+	memset( handles, 0, sizeof(handles) );
+
+	next_thread_data_t thread_data;
+	memset( &thread_data, 0, sizeof(thread_data) );
+	thread_data.slots = slot_data;
+	thread_data.socket_client_addresses = addresses;
+	thread_data.socket_handles = handles;
+
+	proxy_address_t client_a, client_b;
+	proxy_check( proxy_address_parse( &client_a, "[2001:db8::1]:50000" ) );
+	proxy_check( proxy_address_parse( &client_b, "10.0.0.2:50000" ) );
+
+	slot_data[2].client_address = client_a;
+	slot_data[2].state = PROXY_SLOT_STATE_ALLOCATED | PROXY_SLOT_STATE_GENERATION * 255;
+
+	const uint32_t handle_a = proxy_session_handle( 2, slot_data[2].state );
+
+	proxy_address_t client_address;
+	bool new_session = false;
+
+	proxy_check( next_thread_session_client( &thread_data, handle_a, &client_address, &new_session ) );
+	proxy_check( new_session );
+	proxy_check( proxy_address_equal( &client_address, &client_a ) );
+
+	addresses[2] = client_a;
+	handles[2] = handle_a;
+
+	memset( &client_address, 0, sizeof(client_address) );
+	proxy_check( next_thread_session_client( &thread_data, handle_a, &client_address, &new_session ) );
+	proxy_check( !new_session );
+	proxy_check( proxy_address_equal( &client_address, &client_a ) );
+
+	// the slot passes to another client. its handle is a new session, and packets still in flight for the old one are stale
+
+	slot_data[2].client_address = client_b;
+	slot_data[2].state = PROXY_SLOT_STATE_ALLOCATED | PROXY_SLOT_STATE_GENERATION * 256;
+
+	const uint32_t handle_b = proxy_session_handle( 2, slot_data[2].state );
+
+	proxy_check( handle_b != handle_a );
+	proxy_check( next_thread_session_client( &thread_data, handle_b, &client_address, &new_session ) );
+	proxy_check( new_session );
+	proxy_check( proxy_address_equal( &client_address, &client_b ) );
+
+	addresses[2] = client_b;
+	handles[2] = handle_b;
+
+	proxy_check( !next_thread_session_client( &thread_data, handle_a, &client_address, &new_session ) );
+
+	// and a slot with no client has no sessions
+
+	proxy_check( !next_thread_session_client( &thread_data, proxy_session_handle( 3, 0 ), &client_address, &new_session ) );
+
+	config = saved_config;
+}
+
+void next_packet_receive_callback( void * data, next_address_t * from, uint8_t * packet_data, int * begin, int * end )
+{
+	next_thread_data_t * thread_data = ( next_thread_data_t*) data;
 
-	const int prefix = 11;
+	assert( thread_data );
 
-	if ( packet_data[0] == NEXT_FORWARD_PACKET_TO_CLIENT )
-	{
-		next_assert( packet_bytes > prefix );
+	// ignore any packet that's too short to be valid
 
-		next_address_t client_address;
-		client_address.type = NEXT_ADDRESS_IPV4;
-		client_address.data.ipv4[0] = packet_data[1];
-		client_address.data.ipv4[1] = packet_data[2];
-		client_address.data.ipv4[2] = packet_data[3];
-		client_address.data.ipv4[3] = packet_data[4];
-		client_address.port = ( uint16_t(packet_data[5]) << 8 ) | ( uint16_t(packet_data[6]) );
+	const int packet_bytes = *end - *begin;
 
-		next_server_send_packet( thread_data->next_server, &client_address, packet_data + prefix, packet_bytes - prefix );
+	const int prefix = PROXY_NEXT_PREFIX_BYTES;
 
+	if ( packet_bytes <= prefix )
+	{
+		debug_printf( "packet too small (%d bytes)\n", packet_bytes );
+		*begin = 0;
+		*end = 0;
 		return;
 	}
 
@@ -1561,6 +6083,7 @@ void next_packet_receive_callback( void * data, next_address_t * from, uint8_t *
 
 	switch ( packet_type )
 	{
+		case NEXT_FORWARD_PACKET_TO_CLIENT:
     	case NEXT_PASSTHROUGH_PACKET:
     	case NEXT_DIRECT_PACKET:
     	case NEXT_DIRECT_PING_PACKET:
@@ -1573,26 +6096,49 @@ void next_packet_receive_callback( void * data, next_address_t * from, uint8_t *
 			return;
 	}
 
-	// set the from address to the address that sent the packet to the proxy
+	// the session handle says which slot the client is on
+
+	const uint32_t handle = proxy_read_session_handle( packet_data );
+
+	const int socket_index = proxy_session_handle_slot( handle );
+
+	proxy_address_t client_address;
+
+	bool new_session = false;
+
+	if ( socket_index >= config.num_threads * config.num_slots_per_thread || !next_thread_session_client( thread_data, handle, &client_address, &new_session ) )
+	{
+		debug_printf( "next thread dropped packet for stale session handle %08x\n", handle );
+		*begin = 0;
+		*end = 0;
+		return;
+	}
+
+	// special case: forward packet from server to client
+
+	if ( packet_type == NEXT_FORWARD_PACKET_TO_CLIENT )
+	{
+		// the next server receives with send headroom in front of every packet, so the header is written over the prefix
+		// and whatever comes before it. the packet is unreadable after that, so the server must not process it further
+
+		next_server_send_packet_in_place( thread_data->next_server, (const next_address_t*) &client_address, packet_data + prefix, packet_bytes - prefix );
+
+		*begin = 0;
+		*end = 0;
 
-	from->type = NEXT_ADDRESS_IPV4;
-	from->data.ipv4[0] = packet_data[1];
-	from->data.ipv4[1] = packet_data[2];
-	from->data.ipv4[2] = packet_data[3];
-	from->data.ipv4[3] = packet_data[4];
-	from->port = ( uint16_t(packet_data[5]) << 8 ) | ( uint16_t(packet_data[6]) );
+		return;
+	}
 
-	// detect new client sessions and upgrade them
+	// set the from address to the address that sent the packet to the proxy
 
-	const int thread_id = ( int(packet_data[7]) << 8 ) | ( int(packet_data[8]) );
-	const int slot_id = ( int(packet_data[9]) << 8 ) | ( int(packet_data[10]) );
-	const int socket_index = thread_id * config.num_slots_per_thread + slot_id;
+	*from = *( (const next_address_t*) &client_address );
 
-	assert( thread_data->session_table );
+	// upgrade new client sessions. a slot only changes hands after its old client timed out or was evicted in the proxy
 
-	if ( session_table_update( thread_data->session_table, (proxy_address_t*) from, socket_index ) )
+	if ( new_session )
 	{
-		// new session
+		thread_data->socket_client_addresses[socket_index] = client_address;
+		thread_data->socket_handles[socket_index] = handle;
 
 		if ( next_server_ready( thread_data->next_server ) )
 		{
@@ -1604,19 +6150,6 @@ void next_packet_receive_callback( void * data, next_address_t * from, uint8_t *
 		}
 	}
 
-	// swap the session table double buffer every n seconds
-
-	const double current_time = next_time();
-
-	const double time_since_last_swap = current_time - thread_data->last_session_table_swap_time;
-
-	if ( time_since_last_swap >= config.slot_timeout_seconds )
-	{
-		debug_printf( "next thread swap\n" );
-		session_table_swap( thread_data->session_table );
-		thread_data->last_session_table_swap_time = current_time;
-	}
-
 	// if it is a passthrough packet, stop here. these are just sent to the next server to upgrade sessions
 
 	if ( packet_type == NEXT_PASSTHROUGH_PACKET )
@@ -1628,7 +6161,7 @@ void next_packet_receive_callback( void * data, next_address_t * from, uint8_t *
 
 	// adjust begin index forward. the next server will process this packet
 
-	*begin += 11;
+	*begin += prefix;
 }
 
 extern const uint8_t * next_server_magic( next_server_t * server );
@@ -1643,9 +6176,7 @@ int next_send_packet_to_address_callback( void * data, const next_address_t * ad
 
 	next_assert( thread_data );
 
-	uint64_t hash = hash_address( (proxy_address_t*) address );
-
-	const int index = hash % config.num_threads;
+	const int index = proxy_thread_for_address( (proxy_address_t*) address );
 
 	if ( packet_data[0] != NEXT_PASSTHROUGH_PACKET )
 	{
@@ -1674,9 +6205,19 @@ int next_send_packet_to_address_callback( void * data, const next_address_t * ad
 		next_assert( next_basic_packet_filter( packet_data, packet_bytes ) );
 	}
 
-    // send to the client via the slot packet
+    // hand the packet to the proxy thread that owns the socket for this client
+
+	proxy_thread_data_t * proxy_thread_data = thread_data->proxy_thread_data[index];
 
-	proxy_platform_socket_send_packet( thread_data->thread_sockets[index], (const proxy_address_t*) address, packet_data, packet_bytes );
+	proxy_ring_entry_t header;
+	memset( &header, 0, sizeof(header) );
+	header.slot = -1;
+	header.address = *( (const proxy_address_t*) address );
+
+	if ( proxy_ring_push( proxy_thread_data->return_ring, &header, packet_data, packet_bytes ) && proxy_producer_should_wake( &proxy_thread_data->return_waiting ) )
+	{
+		proxy_platform_event_signal( proxy_thread_data->return_event );
+	}
 
 	return 1;
 }
@@ -1687,7 +6228,7 @@ int next_payload_receive_callback( void * data, const next_address_t * client_ad
 
 	next_assert( thread_data );
 
-	int socket_index = session_table_get( thread_data->session_table, (proxy_address_t*) client_address );
+	int socket_index = proxy_session_directory_get( thread_data->session_directory, config.num_threads, (const proxy_address_t*) client_address );
 	if ( socket_index < 0 )
 	{
 		/*
@@ -1697,44 +6238,134 @@ int next_payload_receive_callback( void * data, const next_address_t * client_ad
 		return 1;
 	}
 
-	proxy_platform_socket_t * socket = thread_data->slot_sockets[socket_index];
-
 	/*
 	char buffer[1024];
 	printf( "next thread forwarded %d byte packet to server for client %s\n", payload_bytes, next_address_to_string( from, buffer ) );
 	*/
 
-	proxy_platform_socket_send_packet( socket, &config.server_address, payload_data, payload_bytes );
+	// the session handle ties the payload to this client, so the lessee can drop it if the slot changes hands before it is sent
+
+	uint32_t state;
+	proxy_address_t slot_client_address;
+
+	if ( !proxy_slot_read_client( &thread_data->slots[socket_index], &state, &slot_client_address ) || !proxy_address_equal( &slot_client_address, (const proxy_address_t*) client_address ) )
+		return 1;
+
+	// hand the payload to the proxy thread that leases the slot, which sends it out the slot socket
+
+	const int lessee = int( __atomic_load_n( &thread_data->slots[socket_index].lessee, __ATOMIC_ACQUIRE ) & ~PROXY_SLOT_LESSEE_MOVING );
+
+	next_assert( lessee >= 0 );
+	next_assert( lessee < config.num_threads );
+
+	proxy_thread_data_t * proxy_thread_data = thread_data->proxy_thread_data[lessee];
+
+	proxy_ring_entry_t header;
+	memset( &header, 0, sizeof(header) );
+	header.slot = socket_index;
+	header.session_handle = proxy_session_handle( socket_index, state );
+	header.address = config.server_address;
+
+	if ( proxy_ring_push( proxy_thread_data->return_ring, &header, payload_data, payload_bytes ) && proxy_producer_should_wake( &proxy_thread_data->return_waiting ) )
+	{
+		proxy_platform_event_signal( proxy_thread_data->return_event );
+	}
 
 	return 1;
 }
 
+int next_packet_source_callback( void * data, next_address_t * from, uint8_t * packet_data, int max_packet_bytes )
+{
+	next_thread_data_t * thread_data = (next_thread_data_t*) data;
+
+	next_assert( thread_data );
+
+	// each pass only takes the packets queued when it started, so the next server socket is still read between passes
+
+	if ( !thread_data->source_pass_active )
+	{
+		__atomic_store_n( &thread_data->next_waiting, 0, __ATOMIC_RELAXED );
+		for ( int i = 0; i < config.num_threads; ++i )
+		{
+			thread_data->source_budget[i] = proxy_ring_count( thread_data->next_rings[i] );
+		}
+		thread_data->source_pass_active = true;
+	}
+
+	for ( int i = 0; i < config.num_threads; ++i )
+	{
+		const int ring_index = thread_data->source_ring_index;
+
+		thread_data->source_ring_index = ( ring_index + 1 ) % config.num_threads;
+
+		if ( thread_data->source_budget[ring_index] == 0 )
+			continue;
+
+		proxy_ring_t * ring = thread_data->next_rings[ring_index];
+
+		proxy_ring_entry_t * entry = proxy_ring_peek( ring );
+
+		next_assert( entry );
+		next_assert( entry->packet_bytes <= max_packet_bytes );
+
+		(void) max_packet_bytes;
+
+		const int packet_bytes = entry->packet_bytes;
+
+		memcpy( packet_data, entry + 1, packet_bytes );
+
+		proxy_ring_pop( ring );
+
+		thread_data->source_budget[ring_index]--;
+
+		*from = *( (const next_address_t*) &config.next_local_address );
+
+		return packet_bytes;
+	}
+
+	// pass is done. park so proxy threads ring the doorbell, unless more packets arrived during the pass
+
+	thread_data->source_pass_active = false;
+
+	if ( !proxy_consumer_park( &thread_data->next_waiting, thread_data->next_rings, config.num_threads ) )
+	{
+		const uint8_t doorbell = NEXT_DOORBELL_PACKET;
+		next_platform_socket_send_packet( next_server_socket( thread_data->next_server ), (next_address_t*) &config.next_local_address, &doorbell, 1 );
+	}
+
+	return 0;
+}
+
 void next_route_update_callback( void * data, const next_address_t * client_address, NEXT_BOOL next )
 {
 	next_thread_data_t * thread_data = (next_thread_data_t*) data;
 
-	int index = session_table_get( thread_data->session_table, (proxy_address_t*) client_address );
+	int index = proxy_session_directory_get( thread_data->session_directory, config.num_threads, (const proxy_address_t*) client_address );
 	if ( index < 0 )
 		return;
 
-	const int slot_number = index % config.num_slots_per_thread;
-	const int thread_number = index / config.num_slots_per_thread;
+	next_assert( index >= 0 );
+	next_assert( index < config.num_threads * config.num_slots_per_thread );
 
-	next_assert( slot_number >= 0 );
-	next_assert( slot_number < config.num_slots_per_thread );
+	next_assert( thread_data->slots );
 
-	next_assert( thread_number >= 0 );
-	next_assert( thread_number < config.num_threads );
+	proxy_slot_data_t * slot_data = &thread_data->slots[index];
 
-	next_assert( thread_data->proxy_thread_data );
-
-	proxy_thread_data_t * proxy_thread_data = thread_data->proxy_thread_data[thread_number];
+	if ( next )
+	{
+		__atomic_fetch_or( &slot_data->state, PROXY_SLOT_STATE_NEXT, __ATOMIC_RELEASE );
 
-	slot_thread_data_t * slot_thread_data = proxy_thread_data->slot_thread_data[slot_number];
+		// server packets for the client must go through next from now on, not out the xdp fast path
 
-	proxy_platform_mutex_acquire( &slot_thread_data->mutex );
-	slot_thread_data->next = next ? true : false;
-	proxy_platform_mutex_release( &slot_thread_data->mutex );
+		if ( thread_data->proxy_thread_data[0]->xdp )
+		{
+			proxy_platform_xdp_slot_set( thread_data->proxy_thread_data[0]->xdp, index, NULL );
+		}
+	}
+	else
+	{
+		__atomic_fetch_and( &slot_data->state, ~uint32_t( PROXY_SLOT_STATE_NEXT ), __ATOMIC_RELEASE );
+	}
 }
 
 static proxy_platform_thread_return_t PROXY_PLATFORM_THREAD_FUNC next_thread_function( void * data )
@@ -1772,6 +6403,8 @@ int main( int argc, char * argv[] )
     
     bool test_mode = (argc == 2 ) && strcmp( argv[1], "test" ) == 0;
 
+    bool bench_mode = (argc == 2 ) && strcmp( argv[1], "bench" ) == 0;
+
     const char * mode_env = proxy_platform_getenv( "MODE" );
     if ( mode_env && strcmp( mode_env, "server" ) == 0 )
     {
@@ -1790,6 +6423,14 @@ int main( int argc, char * argv[] )
     	fflush( stdout );
     	return 0;
     }
+    else if ( bench_mode )
+    {
+		printf( "\nrunning benchmarks:\n\n" );
+    	run_benchmarks();
+    	printf( "\n" );
+    	fflush( stdout );
+    	return 0;
+    }
     else
     {
 		printf( "network next proxy\n" );    	
@@ -1803,15 +6444,76 @@ int main( int argc, char * argv[] )
         exit(1);
     }
 
+    // session tables are hashed with the process key, so pick it before creating any
+
+    if ( !next_hash_key_init() )
+    {
+        printf( "error: could not initialize hash key\n" );
+        exit(1);
+    }
+
     // create slot sockets in a flat array
 
     const int num_slot_sockets = config.num_threads * config.num_slots_per_thread;
 
     proxy_platform_socket_t * slot_sockets[num_slot_sockets];
 
-    memset( slot_sockets, 0, sizeof(proxy_platform_socket_t*) );
+    memset( slot_sockets, 0, sizeof(proxy_platform_socket_t*) * num_slot_sockets );
 
-    if ( !server_mode )
+    // with udp segmentation, every socket coalesces batch sends. only the thread sockets coalesce receives, since the
+    // kernel holds a 64k receive buffer per socket for it and io_uring buffer rings are sized for one packet
+
+    const int slot_socket_flags = PROXY_PLATFORM_SOCKET_NON_BLOCKING | ( config.udp_segmentation ? PROXY_PLATFORM_SOCKET_GSO : 0 );
+
+    int thread_socket_flags = PROXY_PLATFORM_SOCKET_REUSE_PORT | PROXY_PLATFORM_SOCKET_NON_BLOCKING;
+    if ( config.udp_segmentation )
+    {
+    	thread_socket_flags |= PROXY_PLATFORM_SOCKET_GSO;
+    	if ( !config.io_uring )
+    	{
+    		thread_socket_flags |= PROXY_PLATFORM_SOCKET_GRO;
+    	}
+    }
+
+    // in tunnel mode, each proxy thread has one socket to the server for all of its slots instead
+
+    proxy_platform_socket_t * tunnel_sockets[config.num_threads];
+
+    memset( tunnel_sockets, 0, sizeof(proxy_platform_socket_t*) * config.num_threads );
+
+    if ( !server_mode && config.tunnel )
+    {
+    	if ( num_slot_sockets > PROXY_TUNNEL_MAX_SLOTS )
+    	{
+    		printf( "error: tunnel mode supports at most %d slots\n", PROXY_TUNNEL_MAX_SLOTS );
+    		exit(1);
+    	}
+
+    	printf( "creating %d tunnel sockets on ports [%d,%d]\n", config.num_threads, config.slot_base_port, config.slot_base_port + config.num_threads - 1 );
+
+    	const int tunnel_socket_flags = slot_socket_flags | ( ( config.udp_segmentation && !config.io_uring ) ? PROXY_PLATFORM_SOCKET_GRO : 0 );
+
+    	for ( int i = 0; i < config.num_threads; ++i )
+    	{
+			proxy_address_t bind_address = config.slot_bind_address;
+
+			bind_address.port = config.slot_base_port + i;
+
+		    tunnel_sockets[i] = proxy_platform_socket_create( &bind_address, tunnel_socket_flags, 0.0f, config.socket_send_buffer_size, config.socket_receive_buffer_size );
+
+		    if ( !tunnel_sockets[i] )
+		    {
+		    	printf( "error: could not create tunnel socket %d\n", i );
+		    	exit(1);
+		    }
+
+		    if ( config.slot_connect && !proxy_platform_socket_connect( tunnel_sockets[i], &config.server_address ) )
+		    {
+		    	printf( "tunnel socket %d could not connect to the server address. it stays unconnected\n", i );
+		    }
+    	}
+    }
+    else if ( !server_mode )
     {
     	printf( "creating %d slot sockets on ports [%d,%d]\n", num_slot_sockets, config.slot_base_port, config.slot_base_port + num_slot_sockets - 1 );
 
@@ -1821,7 +6523,7 @@ int main( int argc, char * argv[] )
 
 			bind_address.port = config.slot_base_port + i;
 
-		    slot_sockets[i] = proxy_platform_socket_create( &bind_address, 0, 0.1f, config.socket_send_buffer_size, config.socket_receive_buffer_size );
+		    slot_sockets[i] = proxy_platform_socket_create( &bind_address, slot_socket_flags, 0.0f, config.socket_send_buffer_size, config.socket_receive_buffer_size );
 
 		    if ( !slot_sockets[i] )
 		    {
@@ -1829,6 +6531,26 @@ int main( int argc, char * argv[] )
 		    	exit(1);
 		    }
 		}
+
+		// slot sockets only talk to the server, so connect them to it. any send elsewhere disconnects the socket again
+
+		if ( config.slot_connect )
+		{
+			int num_connected = 0;
+
+			for ( int i = 0; i < num_slot_sockets; ++i )
+			{
+				if ( proxy_platform_socket_connect( slot_sockets[i], &config.server_address ) )
+				{
+					num_connected++;
+				}
+			}
+
+			if ( num_connected < num_slot_sockets )
+			{
+				printf( "%d of %d slot sockets could not connect to the server address. they stay unconnected\n", num_slot_sockets - num_connected, num_slot_sockets );
+			}
+		}
 	}
 
     // create thread sockets prior to actually creating threads, to avoid race conditions
@@ -1846,9 +6568,42 @@ int main( int argc, char * argv[] )
 
     proxy_platform_socket_t * thread_sockets[config.num_threads];
 
+    // slots are shared by all proxy threads. each thread polls its own range of slot sockets, but leases from the whole pool.
+    // page aligned, like the thread data, so each thread can bind the pages of its range to its numa node
+
+    proxy_slot_data_t * slots = (proxy_slot_data_t*) proxy_platform_memory_alloc_pages( sizeof( proxy_slot_data_t ) * num_slot_sockets );
+
+    proxy_slot_pool_t * slot_pool = proxy_slot_pool_create( config.num_threads, config.num_slots_per_thread );
+
+    if ( !slots || !slot_pool )
+    {
+		printf( "error: could not create slot pool\n" );
+		exit(1);
+    }
+
+    // one session directory for every thread. each proxy thread reads it as itself, and the next thread after them
+
+    proxy_session_directory_t * session_directory = proxy_session_directory_create( slots, num_slot_sockets, config.num_threads + 1 );
+
+    if ( !session_directory )
+    {
+		printf( "error: could not create session directory\n" );
+		exit(1);
+    }
+
+	for ( int i = 0; i < num_slot_sockets; ++i )
+	{
+		slots[i].last_packet_receive_time = -1000000000.0;
+		slots[i].socket = config.tunnel ? tunnel_sockets[i / config.num_slots_per_thread] : slot_sockets[i];
+	}
+
+	proxy_steering_t steering;
+
+	proxy_steering_init( &steering );
+
     for ( int i = 0;i < config.num_threads; ++i )
     {
-		thread_data[i] = (proxy_thread_data_t*) calloc( 1, config.proxy_thread_data_bytes );
+		thread_data[i] = (proxy_thread_data_t*) proxy_platform_memory_alloc_pages( config.proxy_thread_data_bytes );
 		if ( !thread_data[i] )
 		{
 			printf( "error: could not allocate thread data\n" );
@@ -1857,17 +6612,42 @@ int main( int argc, char * argv[] )
 
 		thread_data[i]->thread_number = i;
 
-		thread_data[i]->session_table = session_table_create();
+		thread_data[i]->session_directory = session_directory;
+		thread_data[i]->slot_timers = next_timer_wheel_create( NULL, num_slot_sockets, PROXY_SLOT_TIMER_RESOLUTION, proxy_time() );
+
+		if ( !thread_data[i]->slot_timers )
+		{
+			printf( "error: could not create slot timers for thread %d\n", i );
+			exit(1);
+		}
+
+		thread_data[i]->slots = slots;
+		thread_data[i]->slot_pool = slot_pool;
 
-		thread_data[i]->slot_data = (proxy_slot_data_t*) calloc( config.num_slots_per_thread, sizeof( proxy_slot_data_t ) );
-		for ( int j = 0; j < config.num_slots_per_thread; ++j )
+		proxy_thread_init_slots( thread_data[i] );
+
+		if ( !server_mode )
 		{
-			thread_data[i]->slot_data[j].last_packet_receive_time = -1000000000.0;
+			// rings between this proxy thread and the next server thread, in both directions, and the ring other proxy threads hand clients over on
+
+			thread_data[i]->next_ring = proxy_ring_create( PROXY_NEXT_PREFIX_BYTES + config.max_packet_size );
+			thread_data[i]->return_ring = proxy_ring_create( PROXY_NEXT_PREFIX_BYTES + config.max_packet_size );
+			thread_data[i]->return_event = proxy_platform_event_create();
+			thread_data[i]->handoff_ring = proxy_ring_create( PROXY_NEXT_PREFIX_BYTES + config.max_packet_size );
+
+			thread_data[i]->steering = &steering;
+			thread_data[i]->peers = thread_data;
+
+			if ( !thread_data[i]->next_ring || !thread_data[i]->return_ring || !thread_data[i]->return_event || !thread_data[i]->handoff_ring || !proxy_platform_mutex_create( &thread_data[i]->handoff_mutex ) )
+			{
+				printf( "error: could not create rings for proxy thread %d\n", i );
+				exit(1);
+			}
 		}
 
 		if ( server_mode )
 		{
-		    thread_sockets[i] = proxy_platform_socket_create( &config.server_bind_address, PROXY_PLATFORM_SOCKET_REUSE_PORT | PROXY_PLATFORM_SOCKET_NON_BLOCKING, 0.0f, config.socket_send_buffer_size, config.socket_receive_buffer_size );
+		    thread_sockets[i] = proxy_platform_socket_create( &config.server_bind_address, thread_socket_flags, 0.0f, config.socket_send_buffer_size, config.socket_receive_buffer_size );
 
 		    if ( !thread_sockets[i] )
 		    {
@@ -1877,7 +6657,7 @@ int main( int argc, char * argv[] )
 		}
 		else
 		{
-		    thread_sockets[i] = proxy_platform_socket_create( &config.proxy_bind_address, PROXY_PLATFORM_SOCKET_REUSE_PORT, 0.1f, config.socket_send_buffer_size, config.socket_receive_buffer_size );
+		    thread_sockets[i] = proxy_platform_socket_create( &config.proxy_bind_address, thread_socket_flags, 0.0f, config.socket_send_buffer_size, config.socket_receive_buffer_size );
 
 		    if ( !thread_sockets[i] )
 		    {
@@ -1887,6 +6667,55 @@ int main( int argc, char * argv[] )
 		}
     }
 
+    // steer clients to proxy threads with a reuseport program. no bucket has an owner yet, so clients go by the kernel's hash, or with cpu placement, by the cpu that received them
+
+    bool steering_enabled = false;
+
+    if ( !server_mode && ( config.rebalance_interval_seconds > 0 || config.cpu_placement ) )
+    {
+    	steering_enabled = config.proxy_bind_address.type == PROXY_ADDRESS_IPV4 && proxy_platform_socket_steer( thread_sockets[0], steering.owners, PROXY_STEERING_BUCKETS, proxy_steering_cpu_sockets() );
+
+    	if ( !steering_enabled )
+    	{
+    		printf( "reuseport steering is not available. proxy threads will not be rebalanced or steered by cpu\n" );
+    	}
+    }
+
+    // forward established passthrough flows in the kernel with xdp
+
+    proxy_platform_xdp_t * xdp = NULL;
+    proxy_xdp_flows_t * xdp_flows = NULL;
+
+    if ( !server_mode && config.xdp_interface[0] != '\0' && config.tunnel )
+    {
+    	printf( "xdp does not forward tunnel packets. all packets go through the proxy threads\n" );
+    }
+    else if ( !server_mode && config.xdp_interface[0] != '\0' )
+    {
+    	xdp = proxy_platform_xdp_create( config.xdp_interface, config.xdp_driver_mode != 0, config.proxy_bind_address.port, &config.server_address, config.slot_base_port, num_slot_sockets );
+
+    	if ( xdp )
+    	{
+    		xdp_flows = proxy_xdp_flows_create( xdp, num_slot_sockets );
+    		if ( !xdp_flows )
+    		{
+    			printf( "error: could not create xdp flows\n" );
+    			exit(1);
+    		}
+
+    		printf( "forwarding passthrough flows with %s xdp on %s\n", config.xdp_driver_mode ? "driver" : "generic", config.xdp_interface );
+
+    		for ( int i = 0; i < config.num_threads; ++i )
+    		{
+    			thread_data[i]->xdp = xdp;
+    		}
+    	}
+    	else
+    	{
+    		printf( "xdp is not available on %s. all packets go through the proxy threads\n", config.xdp_interface );
+    	}
+    }
+
     // create next server (manages its own internal socket)
 
 	next_server_t * next_server = NULL;
@@ -1907,10 +6736,28 @@ int main( int argc, char * argv[] )
 		}
 
 		next_thread_data->proxy_thread_data = thread_data;
+		next_thread_data->slots = slots;
+		next_thread_data->session_directory = session_directory;
+		next_thread_data->socket_client_addresses = (proxy_address_t*) calloc( size_t(config.num_threads) * config.num_slots_per_thread, sizeof(proxy_address_t) );
+		next_thread_data->socket_handles = (uint32_t*) calloc( size_t(config.num_threads) * config.num_slots_per_thread, sizeof(uint32_t) );
+		next_thread_data->next_rings = (proxy_ring_t**) malloc( sizeof(proxy_ring_t*) * config.num_threads );
+		next_thread_data->source_budget = (int*) calloc( config.num_threads, sizeof(int) );
+
+		if ( !next_thread_data->socket_client_addresses || !next_thread_data->socket_handles || !next_thread_data->next_rings || !next_thread_data->source_budget )
+		{
+			printf( "error: could not create next thread data\n" );
+			exit(1);
+		}
+
+		for ( int i = 0; i < config.num_threads; ++i )
+		{
+			next_thread_data->next_rings[i] = thread_data[i]->next_ring;
+		}
 
 	    next_config_t next_config;
 	    next_default_config( &next_config );
 	    next_config.force_passthrough_direct = true;
+	    next_config.udp_segmentation = config.udp_segmentation != 0;
 	    strncpy( next_config.server_backend_hostname, next_backend_hostname, sizeof(next_config.server_backend_hostname) - 1 );
 	    strncpy( next_config.customer_private_key, next_customer_private_key, sizeof(next_config.customer_private_key) - 1 );
 
@@ -1930,6 +6777,8 @@ int main( int argc, char * argv[] )
 		callbacks.payload_receive_callback_data = next_thread_data;
 		callbacks.route_update_callback = next_route_update_callback;
 		callbacks.route_update_callback_data = next_thread_data;
+		callbacks.packet_source_callback = next_packet_source_callback;
+		callbacks.packet_source_callback_data = next_thread_data;
 
 		char public_address[1024];
 		char bind_address[1024];
@@ -1945,6 +6794,8 @@ int main( int argc, char * argv[] )
 	        exit(1);
 	    }
 
+	    next_thread_data->next_server = next_server;
+
 	    // IMPORTANT: block and wait until server is ready. This means all callbacks are registered and ready to go
 	    while ( !quit )
 	    {
@@ -1964,12 +6815,14 @@ int main( int argc, char * argv[] )
 		thread_data[i]->socket = thread_sockets[i];
 		thread_data[i]->thread_sockets = thread_sockets;
 		thread_data[i]->slot_sockets = slot_sockets;
+		thread_data[i]->tunnel_socket = tunnel_sockets[i];
 
 		if ( !server_mode )
 		{
 			assert( next_server );
 			thread_data[i]->next_socket = next_server_socket( next_server );
 			assert( thread_data[i]->next_socket );
+			thread_data[i]->next_waiting = &next_thread_data->next_waiting;
 		}
 
 	    thread_data[i]->thread = proxy_platform_thread_create( server_mode ? server_thread_function : proxy_thread_function, thread_data[i] );
@@ -1979,6 +6832,25 @@ int main( int argc, char * argv[] )
 	        printf( "error: failed to create thread\n" );
 	        exit(1);
 	    }
+
+	    // server threads spin on their sockets, so they are left to the scheduler
+
+	    if ( config.cpu_placement && !server_mode )
+	    {
+	    	const int core = proxy_thread_core( i );
+
+	    	if ( !proxy_platform_thread_affinity( thread_data[i]->thread, core ) )
+	    	{
+	    		printf( "warning: could not pin thread %d to core %d\n", i, core );
+	    	}
+
+	    	if ( !proxy_platform_thread_high_priority( thread_data[i]->thread ) )
+	    	{
+	    		printf( "warning: could not set thread %d to high priority\n", i );
+	    	}
+
+	    	__atomic_store_n( &thread_data[i]->placed, 1, __ATOMIC_RELEASE );
+	    }
 	}
 
 	proxy_platform_thread_t * next_thread = NULL;
@@ -1987,12 +6859,6 @@ int main( int argc, char * argv[] )
 	{
 		// create next thread
 
-		next_thread_data->next_server = next_server;
-		next_thread_data->thread_sockets = thread_sockets;
-		next_thread_data->slot_sockets = slot_sockets;
-		next_thread_data->session_table = session_table_create();
-		next_thread_data->last_session_table_swap_time = next_time();
-
 	    next_thread = proxy_platform_thread_create( next_thread_function, next_thread_data );
 
 	    if ( !next_thread )
@@ -2000,28 +6866,57 @@ int main( int argc, char * argv[] )
 	        printf( "error: failed to create thread\n" );
 	        exit(1);
 	    }
+
+	    if ( config.cpu_placement && !proxy_platform_thread_affinity( next_thread, proxy_thread_core( config.num_threads ) ) )
+	    {
+	    	printf( "warning: could not pin next thread to core %d\n", proxy_thread_core( config.num_threads ) );
+	    }
 	}
 
-	// wait for CTRL-C
+	// wait for CTRL-C, rebalancing proxy threads along the way
 
     fflush( stdout );
 
+    proxy_load_t * previous_loads = (proxy_load_t*) calloc( config.num_threads, sizeof(proxy_load_t) );
+    proxy_load_t * loads = (proxy_load_t*) calloc( config.num_threads, sizeof(proxy_load_t) );
+
+    if ( !previous_loads || !loads )
+    {
+        printf( "error: could not allocate load samples\n" );
+        exit(1);
+    }
+
+    double last_rebalance_time = proxy_time();
+
 	while ( !quit )
 	{
-		proxy_sleep( 1.0 );
-	}
+		proxy_sleep( xdp_flows ? PROXY_XDP_SYNC_INTERVAL : 1.0 );
 
-	// shut down
+		if ( xdp_flows )
+		{
+			proxy_xdp_flows_sync( xdp_flows, slots );
+		}
 
-	printf( "\nshutting down...\n" );
+		if ( server_mode || config.rebalance_interval_seconds <= 0 )
+			continue;
 
-	debug_printf( "closing sockets\n" );
+		const double current_time = proxy_time();
 
-	for ( int i = 0; i < config.num_threads; i++ )
-	{
-		proxy_platform_socket_close( thread_data[i]->socket );
+		if ( current_time - last_rebalance_time < config.rebalance_interval_seconds )
+			continue;
+
+		proxy_rebalance( thread_data, thread_sockets, &steering, steering_enabled, previous_loads, loads, current_time - last_rebalance_time );
+
+		last_rebalance_time = current_time;
 	}
 
+	free( previous_loads );
+	free( loads );
+
+	// shut down
+
+	printf( "\nshutting down...\n" );
+
 	debug_printf( "joining threads\n" );
 
 	for ( int i = 0; i < config.num_threads; i++ )
@@ -2033,24 +6928,78 @@ int main( int argc, char * argv[] )
 	{
 		proxy_platform_thread_join( next_thread );
 	}
+
+	if ( xdp )
+	{
+		uint64_t packets_to_server = 0, packets_to_client = 0;
+		proxy_platform_xdp_counters( xdp, &packets_to_server, &packets_to_client );
+		printf( "xdp forwarded %" PRIu64 " packets to the server and %" PRIu64 " packets to clients\n", packets_to_server, packets_to_client );
+		proxy_xdp_flows_destroy( xdp_flows );
+		proxy_platform_xdp_destroy( xdp );
+	}
     
 	debug_printf( "destroying threads\n" );
 
 	for ( int i = 0; i < config.num_threads; i++ )
 	{
 		proxy_platform_thread_destroy( thread_data[i]->thread );
-		session_table_destroy( thread_data[i]->session_table );
-		free( thread_data[i]->slot_data );
-		free( thread_data[i] );
+		next_timer_wheel_destroy( thread_data[i]->slot_timers );
+		if ( !server_mode )
+		{
+			proxy_ring_destroy( thread_data[i]->next_ring );
+			proxy_ring_destroy( thread_data[i]->return_ring );
+			proxy_platform_event_destroy( thread_data[i]->return_event );
+			proxy_ring_destroy( thread_data[i]->handoff_ring );
+			proxy_platform_mutex_destroy( &thread_data[i]->handoff_mutex );
+		}
+		proxy_platform_memory_free_pages( thread_data[i], config.proxy_thread_data_bytes );
 		thread_data[i] = NULL;
 	}
 
 	if ( !server_mode )
 	{
 		proxy_platform_thread_destroy( next_thread );
+		free( next_thread_data->socket_client_addresses );
+		free( next_thread_data->socket_handles );
+		free( next_thread_data->next_rings );
+		free( next_thread_data->source_budget );
 		free( next_thread_data );
 	}
 
+	proxy_session_directory_destroy( session_directory );
+
+	proxy_slot_pool_destroy( slot_pool );
+
+	proxy_platform_memory_free_pages( slots, sizeof( proxy_slot_data_t ) * num_slot_sockets );
+
+	// sockets are destroyed only once every thread has stopped, since threads send through each other's sockets
+
+	debug_printf( "destroying sockets\n" );
+
+	for ( int i = 0; i < config.num_threads; i++ )
+	{
+		proxy_platform_socket_destroy( thread_sockets[i] );
+	}
+
+	if ( !server_mode )
+	{
+		for ( int i = 0; i < num_slot_sockets; ++i )
+		{
+			if ( slot_sockets[i] )
+			{
+				proxy_platform_socket_destroy( slot_sockets[i] );
+			}
+		}
+
+		for ( int i = 0; i < config.num_threads; ++i )
+		{
+			if ( tunnel_sockets[i] )
+			{
+				proxy_platform_socket_destroy( tunnel_sockets[i] );
+			}
+		}
+	}
+
 	if ( !server_mode )
 	{
 		next_term();	
@@ -43,6 +43,38 @@
 #include <stdlib.h>
 #include <math.h>
 #include <alloca.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+
+#if defined(__has_include) && defined(__NR_io_uring_setup)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define PROXY_PLATFORM_HAS_IO_URING 1
+#endif
+#endif
+
+#ifndef PROXY_PLATFORM_HAS_IO_URING
+#define PROXY_PLATFORM_HAS_IO_URING 0
+#endif
+
+#if defined(__has_include) && defined(__NR_bpf)
+#if __has_include(<linux/bpf.h>)
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <sched.h>
+#define PROXY_PLATFORM_HAS_XDP 1
+#endif
+#endif
+
+#ifndef PROXY_PLATFORM_HAS_XDP
+#define PROXY_PLATFORM_HAS_XDP 0
+#endif
 
 // ---------------------------------------------------
 
@@ -164,6 +196,24 @@ void proxy_platform_sleep( double time )
 
 // ---------------------------------------------------
 
+/*
+    With PROXY_PLATFORM_SOCKET_GSO, a batch send coalesces packets of the same size to the same address into one
+    message that the kernel (or the nic) splits back into datagrams, one per packet. With PROXY_PLATFORM_SOCKET_GRO,
+    the kernel may hand the socket several datagrams from one sender as one message. A batch receive splits them
+    back out into the caller's packet buffers, so every packet still lands in its own buffer with its own headroom.
+
+    A coalesced message can't be larger than 64k, and a gro message holds at most 64 datagrams. Segments are kept
+    below the ipv6 payload size of a 1500 byte mtu, since a segment that doesn't fit the route's mtu fails the send.
+*/
+
+#define PROXY_PLATFORM_GSO_MAX_SEGMENTS                            64
+#define PROXY_PLATFORM_GSO_MAX_SEGMENT_BYTES                     1452
+#define PROXY_PLATFORM_GSO_MAX_BYTES                            65000
+
+#define PROXY_PLATFORM_GRO_MAX_SEGMENTS                            64
+#define PROXY_PLATFORM_GRO_MESSAGES                                 4
+#define PROXY_PLATFORM_GRO_MESSAGE_BYTES                        65536
+
 void proxy_platform_socket_destroy( proxy_platform_socket_t * socket );
 
 proxy_platform_socket_t * proxy_platform_socket_create( proxy_address_t * address, uint32_t socket_flags, float timeout_seconds, int send_buffer_size, int receive_buffer_size )
@@ -179,6 +229,10 @@ proxy_platform_socket_t * proxy_platform_socket_create( proxy_address_t * addres
 
     socket->flags = socket_flags;
 
+    socket->gro_buffer = NULL;
+
+    memset( &socket->peer, 0, sizeof(proxy_address_t) );
+
     socket->handle = ::socket( ( address->type == PROXY_ADDRESS_IPV6 ) ? AF_INET6 : AF_INET, SOCK_DGRAM, IPPROTO_UDP );
 
     if ( socket->handle < 0 )
@@ -303,6 +357,38 @@ proxy_platform_socket_t * proxy_platform_socket_create( proxy_address_t * addres
         }
     }
 
+    // udp segmentation offload. either flag is dropped if the kernel doesn't support it
+
+    if ( socket_flags & PROXY_PLATFORM_SOCKET_GSO )
+    {
+        const int segment_size = 0;
+        if ( setsockopt( socket->handle, IPPROTO_UDP, UDP_SEGMENT, &segment_size, sizeof(int) ) != 0 )
+        {
+            proxy_printf( PROXY_LOG_LEVEL_DEBUG, "udp gso is not supported" );
+            socket->flags &= ~uint32_t( PROXY_PLATFORM_SOCKET_GSO );
+        }
+    }
+
+    if ( socket_flags & PROXY_PLATFORM_SOCKET_GRO )
+    {
+        int enable = 1;
+        if ( setsockopt( socket->handle, IPPROTO_UDP, UDP_GRO, &enable, sizeof(int) ) == 0 )
+        {
+            socket->gro_buffer = (uint8_t*) malloc( size_t(PROXY_PLATFORM_GRO_MESSAGES) * PROXY_PLATFORM_GRO_MESSAGE_BYTES );
+            if ( !socket->gro_buffer )
+            {
+                enable = 0;
+                setsockopt( socket->handle, IPPROTO_UDP, UDP_GRO, &enable, sizeof(int) );
+            }
+        }
+
+        if ( !socket->gro_buffer )
+        {
+            proxy_printf( PROXY_LOG_LEVEL_DEBUG, "udp gro is not supported" );
+            socket->flags &= ~uint32_t( PROXY_PLATFORM_SOCKET_GRO );
+        }
+    }
+
     // set non-blocking io and receive timeout
 
     if ( socket_flags & PROXY_PLATFORM_SOCKET_NON_BLOCKING )
@@ -348,9 +434,12 @@ void proxy_platform_socket_close( proxy_platform_socket_t * socket )
 void proxy_platform_socket_destroy( proxy_platform_socket_t * socket )
 {
 	proxy_platform_socket_close( socket );
+    free( socket->gro_buffer );
     free( socket );
 }
 
+static bool proxy_platform_socket_sends_to_peer( proxy_platform_socket_t * socket, const proxy_address_t * to, int num_packets );
+
 void proxy_platform_socket_send_packet( proxy_platform_socket_t * socket, const proxy_address_t * to, const void * packet_data, int packet_bytes )
 {
     assert( socket );
@@ -359,6 +448,15 @@ void proxy_platform_socket_send_packet( proxy_platform_socket_t * socket, const
     assert( packet_data );
     assert( packet_bytes > 0 );
 
+    if ( proxy_platform_socket_sends_to_peer( socket, to, 1 ) )
+    {
+        if ( send( socket->handle, packet_data, packet_bytes, 0 ) < 0 )
+        {
+            proxy_printf( PROXY_LOG_LEVEL_DEBUG, "send failed: %s", strerror( errno ) );
+        }
+        return;
+    }
+
     if ( to->type == PROXY_ADDRESS_IPV6 )
     {
         sockaddr_in6 socket_address;
@@ -401,6 +499,245 @@ void proxy_platform_socket_send_packet( proxy_platform_socket_t * socket, const
     }
 }
 
+static socklen_t proxy_platform_socket_address_to_sockaddr( const proxy_address_t * address, sockaddr_storage * socket_address )
+{
+    memset( socket_address, 0, sizeof( sockaddr_storage ) );
+
+    if ( address->type == PROXY_ADDRESS_IPV6 )
+    {
+        sockaddr_in6 * addr_ipv6 = (sockaddr_in6*) socket_address;
+        addr_ipv6->sin6_family = AF_INET6;
+        for ( int i = 0; i < 8; ++i )
+        {
+            ( (uint16_t*) &addr_ipv6->sin6_addr ) [i] = proxy_platform_htons( address->data.ipv6[i] );
+        }
+        addr_ipv6->sin6_port = proxy_platform_htons( address->port );
+        return sizeof( sockaddr_in6 );
+    }
+    else
+    {
+        assert( address->type == PROXY_ADDRESS_IPV4 );
+        sockaddr_in * addr_ipv4 = (sockaddr_in*) socket_address;
+        addr_ipv4->sin_family = AF_INET;
+        addr_ipv4->sin_addr.s_addr = ( ( (uint32_t) address->data.ipv4[0] ) )        | 
+                                     ( ( (uint32_t) address->data.ipv4[1] ) << 8 )   | 
+                                     ( ( (uint32_t) address->data.ipv4[2] ) << 16 )  | 
+                                     ( ( (uint32_t) address->data.ipv4[3] ) << 24 );
+        addr_ipv4->sin_port = proxy_platform_htons( address->port );
+        return sizeof( sockaddr_in );
+    }
+}
+
+static bool proxy_platform_socket_address_from_sockaddr( const sockaddr_storage * socket_address, proxy_address_t * address )
+{
+    if ( socket_address->ss_family == AF_INET6 )
+    {
+        const sockaddr_in6 * addr_ipv6 = (const sockaddr_in6*) socket_address;
+        address->type = PROXY_ADDRESS_IPV6;
+        for ( int i = 0; i < 8; ++i )
+        {
+            address->data.ipv6[i] = proxy_platform_ntohs( ( (const uint16_t*) &addr_ipv6->sin6_addr ) [i] );
+        }
+        address->port = proxy_platform_ntohs( addr_ipv6->sin6_port );
+        return true;
+    }
+    else if ( socket_address->ss_family == AF_INET )
+    {
+        const sockaddr_in * addr_ipv4 = (const sockaddr_in*) socket_address;
+        address->type = PROXY_ADDRESS_IPV4;
+        address->data.ipv4[0] = (uint8_t) ( ( addr_ipv4->sin_addr.s_addr & 0x000000FF ) );
+        address->data.ipv4[1] = (uint8_t) ( ( addr_ipv4->sin_addr.s_addr & 0x0000FF00 ) >> 8 );
+        address->data.ipv4[2] = (uint8_t) ( ( addr_ipv4->sin_addr.s_addr & 0x00FF0000 ) >> 16 );
+        address->data.ipv4[3] = (uint8_t) ( ( addr_ipv4->sin_addr.s_addr & 0xFF000000 ) >> 24 );
+        address->port = proxy_platform_ntohs( addr_ipv4->sin_port );
+        return true;
+    }
+    return false;
+}
+
+// ---------------------------------------------------
+
+/*
+    A socket that only ever talks to one address can be connected to it. Sends to that address then skip building
+    a sockaddr and the route lookup, receives skip the source address, and the kernel drops packets from anywhere
+    else and can demux to the socket early.
+
+    Sending to any other address disconnects the socket for good, so it goes back to accepting packets from anyone.
+    That way a peer that changes at runtime just costs the fast path, never packets. A receive racing the disconnect
+    may still label a packet from a new source with the old peer.
+*/
+
+#define PROXY_PLATFORM_SOCKET_CONNECTED                      (1U<<31)
+
+bool proxy_platform_socket_connect( proxy_platform_socket_t * socket, const proxy_address_t * address )
+{
+    assert( socket );
+    assert( address );
+    assert( address->type == PROXY_ADDRESS_IPV6 || address->type == PROXY_ADDRESS_IPV4 );
+
+    sockaddr_storage socket_address;
+    const socklen_t address_length = proxy_platform_socket_address_to_sockaddr( address, &socket_address );
+
+    if ( connect( socket->handle, (sockaddr*) &socket_address, address_length ) != 0 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_DEBUG, "connect failed: %s", strerror( errno ) );
+        return false;
+    }
+
+    socket->peer = *address;
+
+    __atomic_fetch_or( &socket->flags, PROXY_PLATFORM_SOCKET_CONNECTED, __ATOMIC_RELEASE );
+
+    return true;
+}
+
+void proxy_platform_socket_disconnect( proxy_platform_socket_t * socket )
+{
+    assert( socket );
+
+    // only the caller that clears the flag dissolves the association, so this is safe to race from several threads
+
+    if ( ( __atomic_fetch_and( &socket->flags, ~PROXY_PLATFORM_SOCKET_CONNECTED, __ATOMIC_ACQ_REL ) & PROXY_PLATFORM_SOCKET_CONNECTED ) == 0 )
+        return;
+
+    sockaddr_storage local_address;
+    socklen_t local_address_length = sizeof(local_address);
+    memset( &local_address, 0, sizeof(local_address) );
+    getsockname( socket->handle, (sockaddr*) &local_address, &local_address_length );
+
+    sockaddr unspecified;
+    memset( &unspecified, 0, sizeof(unspecified) );
+    unspecified.sa_family = AF_UNSPEC;
+
+    if ( connect( socket->handle, &unspecified, sizeof(unspecified) ) != 0 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_DEBUG, "disconnect failed: %s", strerror( errno ) );
+        return;
+    }
+
+    // the kernel gives up a port it picked for the socket (bound to port 0) when it disconnects. take it back, on
+    // whatever local address the socket is left with, which is only the one from the connect if that was bound explicitly
+
+    sockaddr_storage disconnected_address;
+    socklen_t disconnected_address_length = sizeof(disconnected_address);
+    memset( &disconnected_address, 0, sizeof(disconnected_address) );
+    getsockname( socket->handle, (sockaddr*) &disconnected_address, &disconnected_address_length );
+
+    uint16_t * port = ( disconnected_address.ss_family == AF_INET6 ) ? &( (sockaddr_in6*) &disconnected_address )->sin6_port : &( (sockaddr_in*) &disconnected_address )->sin_port;
+
+    if ( *port != 0 )
+        return;
+
+    *port = ( local_address.ss_family == AF_INET6 ) ? ( (sockaddr_in6*) &local_address )->sin6_port : ( (sockaddr_in*) &local_address )->sin_port;
+
+    if ( bind( socket->handle, (sockaddr*) &disconnected_address, disconnected_address_length ) != 0 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "could not rebind socket after disconnect: %s", strerror( errno ) );
+    }
+}
+
+static bool proxy_platform_socket_connected( proxy_platform_socket_t * socket )
+{
+    return ( __atomic_load_n( &socket->flags, __ATOMIC_ACQUIRE ) & PROXY_PLATFORM_SOCKET_CONNECTED ) != 0;
+}
+
+static bool proxy_platform_socket_sends_to_peer( proxy_platform_socket_t * socket, const proxy_address_t * to, int num_packets )
+{
+    if ( !proxy_platform_socket_connected( socket ) )
+        return false;
+
+    for ( int i = 0; i < num_packets; ++i )
+    {
+        if ( !proxy_address_equal( &to[i], &socket->peer ) )
+        {
+            char address_string[PROXY_MAX_ADDRESS_STRING_LENGTH];
+            proxy_printf( PROXY_LOG_LEVEL_DEBUG, "connected socket sends to %s. disconnecting", proxy_address_to_string( &to[i], address_string ) );
+            proxy_platform_socket_disconnect( socket );
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// ---------------------------------------------------
+
+static uint32_t proxy_platform_sockaddr_hash( const sockaddr_storage * socket_address, socklen_t length )
+{
+    // fnv-1a. sockaddrs are zeroed before they are filled in, so equal addresses hash the same
+
+    const uint8_t * data = (const uint8_t*) socket_address;
+    uint32_t hash = 2166136261U;
+    for ( socklen_t i = 0; i < length; ++i )
+    {
+        hash ^= data[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static int proxy_platform_socket_coalesce( const sockaddr_storage * socket_address, const socklen_t * address_length, const int * packet_bytes, int num_packets, int * message_first, int * message_count, int * packet_next )
+{
+    // groups packets into messages of up to PROXY_PLATFORM_GSO_MAX_SEGMENTS packets of the same size to the same address.
+    // a packet only joins the last message to its address, so packets to one address keep their order across messages
+
+    int table_size = 1;
+    while ( table_size < num_packets * 2 )
+    {
+        table_size *= 2;
+    }
+
+    int * table = (int*) alloca( sizeof(int) * table_size );
+    for ( int i = 0; i < table_size; ++i )
+    {
+        table[i] = -1;
+    }
+
+    int * message_last = (int*) alloca( sizeof(int) * num_packets );
+    int * message_bytes = (int*) alloca( sizeof(int) * num_packets );
+
+    int num_messages = 0;
+
+    for ( int i = 0; i < num_packets; ++i )
+    {
+        packet_next[i] = -1;
+
+        int index = int( proxy_platform_sockaddr_hash( &socket_address[i], address_length[i] ) & uint32_t( table_size - 1 ) );
+
+        while ( table[index] != -1 )
+        {
+            const int first = message_first[table[index]];
+            if ( address_length[first] == address_length[i] && memcmp( &socket_address[first], &socket_address[i], address_length[i] ) == 0 )
+                break;
+            index = ( index + 1 ) & ( table_size - 1 );
+        }
+
+        const int message = table[index];
+
+        if ( message != -1 &&
+             packet_bytes[message_first[message]] == packet_bytes[i] &&
+             packet_bytes[i] <= PROXY_PLATFORM_GSO_MAX_SEGMENT_BYTES &&
+             message_count[message] < PROXY_PLATFORM_GSO_MAX_SEGMENTS &&
+             message_bytes[message] + packet_bytes[i] <= PROXY_PLATFORM_GSO_MAX_BYTES )
+        {
+            packet_next[message_last[message]] = i;
+            message_last[message] = i;
+            message_count[message]++;
+            message_bytes[message] += packet_bytes[i];
+            continue;
+        }
+
+        message_first[num_messages] = i;
+        message_last[num_messages] = i;
+        message_count[num_messages] = 1;
+        message_bytes[num_messages] = packet_bytes[i];
+        table[index] = num_messages;
+        num_messages++;
+    }
+
+    return num_messages;
+}
+
 void proxy_platform_socket_send_packets( proxy_platform_socket_t * socket, const proxy_address_t * to, void ** packet_data, int * packet_bytes, int num_packets )
 {
     assert( socket );
@@ -414,41 +751,136 @@ void proxy_platform_socket_send_packets( proxy_platform_socket_t * socket, const
 
     iovec * msg = (iovec*) alloca( sizeof(iovec) * num_packets );
 
+    sockaddr_storage * socket_address = (sockaddr_storage*) alloca( sizeof(sockaddr_storage) * num_packets );
+
+    socklen_t * address_length = (socklen_t*) alloca( sizeof(socklen_t) * num_packets );
+
+    mmsghdr * packet_array = (mmsghdr*) alloca( sizeof(mmsghdr) * num_packets );
+
+    memset( packet_array, 0, sizeof(mmsghdr) * num_packets );
+
+    // on a socket connected to every destination in the batch, the messages carry no address at all
+
+    const bool to_peer = proxy_platform_socket_sends_to_peer( socket, to, num_packets );
+
     for ( int i = 0; i < num_packets; ++i )
     {
-        msg[i].iov_base = packet_data[i];
-        msg[i].iov_len = packet_bytes[i];
+        assert( to[i].type == PROXY_ADDRESS_IPV6 || to[i].type == PROXY_ADDRESS_IPV4 );
+        address_length[i] = to_peer ? 0 : proxy_platform_socket_address_to_sockaddr( &to[i], &socket_address[i] );
     }
 
-    sockaddr_in * socket_address = (sockaddr_in*) alloca( sizeof(sockaddr_in) * num_packets );
+    int * message_first = (int*) alloca( sizeof(int) * num_packets );
+    int * message_count = (int*) alloca( sizeof(int) * num_packets );
+    int * packet_next = (int*) alloca( sizeof(int) * num_packets );
 
-    for ( int i = 0; i < num_packets; ++i )
+    int num_messages = num_packets;
+
+    const bool gso = ( __atomic_load_n( &socket->flags, __ATOMIC_RELAXED ) & PROXY_PLATFORM_SOCKET_GSO ) != 0;
+
+    if ( gso )
+    {
+        num_messages = proxy_platform_socket_coalesce( socket_address, address_length, packet_bytes, num_packets, message_first, message_count, packet_next );
+    }
+    else
     {
-        assert( to[i].type == PROXY_ADDRESS_IPV4 );                 // note: ipv6 not supported
-        memset( &socket_address[i], 0, sizeof(sockaddr_in) );
-        socket_address[i].sin_family = AF_INET;
-        socket_address[i].sin_addr.s_addr = ( ( (uint32_t) to[i].data.ipv4[0] ) )        | 
-                                            ( ( (uint32_t) to[i].data.ipv4[1] ) << 8 )   | 
-                                            ( ( (uint32_t) to[i].data.ipv4[2] ) << 16 )  | 
-                                            ( ( (uint32_t) to[i].data.ipv4[3] ) << 24 );
-        socket_address[i].sin_port = proxy_platform_htons( to->port );
+        for ( int i = 0; i < num_packets; ++i )
+        {
+            message_first[i] = i;
+            message_count[i] = 1;
+            packet_next[i] = -1;
+        }
     }
 
-    mmsghdr * packet_array = (mmsghdr*) alloca( sizeof(mmsghdr) * num_packets );
+    const size_t control_size = CMSG_SPACE( sizeof(uint16_t) );
 
-    for ( int i = 0; i < num_packets; ++i )
+    uint8_t * control = gso ? (uint8_t*) alloca( control_size * num_messages ) : NULL;
+
+    int num_iov = 0;
+
+    for ( int i = 0; i < num_messages; ++i )
     {
-        packet_array[i].msg_hdr.msg_name = &socket_address[i];
-        packet_array[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
-        packet_array[i].msg_hdr.msg_iov = &msg[i];
-        packet_array[i].msg_hdr.msg_iovlen = 1;
+        const int first = message_first[i];
+
+        packet_array[i].msg_hdr.msg_name = to_peer ? NULL : &socket_address[first];
+        packet_array[i].msg_hdr.msg_namelen = to_peer ? 0 : address_length[first];
+        packet_array[i].msg_hdr.msg_iov = &msg[num_iov];
+        packet_array[i].msg_hdr.msg_iovlen = message_count[i];
+
+        for ( int packet = first; packet != -1; packet = packet_next[packet] )
+        {
+            msg[num_iov].iov_base = packet_data[packet];
+            msg[num_iov].iov_len = packet_bytes[packet];
+            num_iov++;
+        }
+
+        if ( message_count[i] > 1 )
+        {
+            // the kernel cuts the message into datagrams of the first packet's size
+
+            uint8_t * message_control = control + control_size * i;
+            memset( message_control, 0, control_size );
+            packet_array[i].msg_hdr.msg_control = message_control;
+            packet_array[i].msg_hdr.msg_controllen = control_size;
+            cmsghdr * cmsg = CMSG_FIRSTHDR( &packet_array[i].msg_hdr );
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN( sizeof(uint16_t) );
+            const uint16_t segment_size = uint16_t( packet_bytes[first] );
+            memcpy( CMSG_DATA( cmsg ), &segment_size, sizeof(uint16_t) );
+        }
     }
 
-    int result = sendmmsg( socket->handle, packet_array, num_packets, 0 );
-    
-    if ( result == -1 )
+    // sendmmsg may send fewer packets than requested, so keep going until the whole batch is out
+
+    int num_sent = 0;
+
+    while ( num_sent < num_messages )
     {
-        proxy_printf( PROXY_LOG_LEVEL_ERROR, "sendmmsg failed to send packets" );
+        int result = sendmmsg( socket->handle, packet_array + num_sent, num_messages - num_sent, 0 );
+        
+        if ( result <= 0 )
+        {
+            // a connected socket reports icmp errors from the peer on the next call. the error is consumed, so go again
+
+            if ( result < 0 && ( errno == EINTR || errno == ECONNREFUSED ) )
+                continue;
+
+            if ( result < 0 && gso && ( errno == EIO || errno == EINVAL ) )
+            {
+                // the route can't take segmented sends, eg. no checksum offload or a smaller mtu. send the rest one packet at a time from now on
+
+                proxy_printf( PROXY_LOG_LEVEL_DEBUG, "udp gso send failed (%s). disabling gso on socket", strerror( errno ) );
+
+                __atomic_fetch_and( &socket->flags, ~uint32_t( PROXY_PLATFORM_SOCKET_GSO ), __ATOMIC_RELAXED );
+
+                proxy_address_t * remaining_to = (proxy_address_t*) alloca( sizeof(proxy_address_t) * num_packets );
+                void ** remaining_data = (void**) alloca( sizeof(void*) * num_packets );
+                int * remaining_bytes = (int*) alloca( sizeof(int) * num_packets );
+
+                int num_remaining = 0;
+
+                for ( int i = num_sent; i < num_messages; ++i )
+                {
+                    for ( int packet = message_first[i]; packet != -1; packet = packet_next[packet] )
+                    {
+                        remaining_to[num_remaining] = to[packet];
+                        remaining_data[num_remaining] = packet_data[packet];
+                        remaining_bytes[num_remaining] = packet_bytes[packet];
+                        num_remaining++;
+                    }
+                }
+
+                proxy_platform_socket_send_packets( socket, remaining_to, remaining_data, remaining_bytes, num_remaining );
+
+                return;
+            }
+
+            proxy_printf( PROXY_LOG_LEVEL_DEBUG, "sendmmsg failed to send packets: %s", strerror( errno ) );
+            
+            break;
+        }
+
+        num_sent += result;
     }
 }
 
@@ -507,48 +939,2065 @@ int proxy_platform_socket_receive_packet( proxy_platform_socket_t * socket, prox
     return result;
 }
 
-// ---------------------------------------------------
-
-proxy_platform_thread_t * proxy_platform_thread_create( proxy_platform_thread_func_t * thread_function, void * arg )
+static int proxy_platform_socket_receive_segmented_packets( proxy_platform_socket_t * socket, proxy_address_t * from, uint8_t ** packet_data, int * packet_bytes, int max_packet_size, int max_packets )
 {
-    proxy_platform_thread_t * thread = (proxy_platform_thread_t*) malloc( sizeof( proxy_platform_thread_t) );
+    // each message can hold up to PROXY_PLATFORM_GRO_MAX_SEGMENTS packets, so only take as many messages as the caller has buffers for
 
-    assert( thread );
+    int num_messages = max_packets / PROXY_PLATFORM_GRO_MAX_SEGMENTS;
+    if ( num_messages < 1 )
+        num_messages = 1;
+    if ( num_messages > PROXY_PLATFORM_GRO_MESSAGES )
+        num_messages = PROXY_PLATFORM_GRO_MESSAGES;
 
-    if ( pthread_create( &thread->handle, NULL, thread_function, arg ) != 0 )
+    iovec msg[PROXY_PLATFORM_GRO_MESSAGES];
+    sockaddr_storage sockaddr_from[PROXY_PLATFORM_GRO_MESSAGES];
+    mmsghdr packet_array[PROXY_PLATFORM_GRO_MESSAGES];
+    uint8_t control[PROXY_PLATFORM_GRO_MESSAGES][CMSG_SPACE( sizeof(int) )];
+
+    memset( packet_array, 0, sizeof(packet_array) );
+
+    for ( int i = 0; i < num_messages; ++i )
     {
-        free( thread );
-        return NULL;
+        msg[i].iov_base = socket->gro_buffer + size_t(i) * PROXY_PLATFORM_GRO_MESSAGE_BYTES;
+        msg[i].iov_len = PROXY_PLATFORM_GRO_MESSAGE_BYTES;
+        packet_array[i].msg_hdr.msg_name = &sockaddr_from[i];
+        packet_array[i].msg_hdr.msg_namelen = sizeof( sockaddr_storage );
+        packet_array[i].msg_hdr.msg_iov = &msg[i];
+        packet_array[i].msg_hdr.msg_iovlen = 1;
+        packet_array[i].msg_hdr.msg_control = control[i];
+        packet_array[i].msg_hdr.msg_controllen = sizeof( control[i] );
     }
 
-    return thread;
-}
+    int result = recvmmsg( socket->handle, packet_array, num_messages, ( socket->flags & PROXY_PLATFORM_SOCKET_NON_BLOCKING ) ? MSG_DONTWAIT : MSG_WAITFORONE, NULL );
 
-void proxy_platform_thread_join( proxy_platform_thread_t * thread )
-{
-    assert( thread );
-    pthread_join( thread->handle, NULL );
-}
+    if ( result <= 0 )
+    {
+        // a connected slot socket gets ECONNREFUSED after an icmp port unreachable from its peer. that isn't a socket error
 
-void proxy_platform_thread_destroy( proxy_platform_thread_t * thread )
-{
-    assert( thread );
-    free( thread );
-}
+        if ( result == 0 || errno == EAGAIN || errno == EINTR || errno == ECONNREFUSED )
+        {
+            return 0;
+        }
 
-bool proxy_platform_thread_high_priority( proxy_platform_thread_t * thread )
-{
-    struct sched_param param;
-    param.sched_priority = sched_get_priority_max( SCHED_FIFO );
-    return pthread_setschedparam( thread->handle, SCHED_FIFO, &param ) == 0;
-}
+        proxy_printf( PROXY_LOG_LEVEL_DEBUG, "recvmmsg failed with error %d", errno );
+        
+        return -1;
+    }
 
-bool proxy_platform_thread_affinity( proxy_platform_thread_t * thread, int core )
-{
-	cpu_set_t cpuset;
-	CPU_ZERO( &cpuset );
-	CPU_SET( core, &cpuset );
-	return pthread_setaffinity_np( thread->handle, sizeof(cpu_set_t), &cpuset ) == 0;
+    int num_packets = 0;
+
+    for ( int i = 0; i < result; ++i )
+    {
+        const uint8_t * message_data = (const uint8_t*) msg[i].iov_base;
+        const int message_bytes = int( packet_array[i].msg_len );
+
+        int segment_bytes = message_bytes;
+
+        for ( cmsghdr * cmsg = CMSG_FIRSTHDR( &packet_array[i].msg_hdr ); cmsg; cmsg = CMSG_NXTHDR( &packet_array[i].msg_hdr, cmsg ) )
+        {
+            if ( cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO )
+            {
+                int gso_size;
+                memcpy( &gso_size, CMSG_DATA( cmsg ), sizeof(int) );
+                if ( gso_size > 0 )
+                {
+                    segment_bytes = gso_size;
+                }
+            }
+        }
+
+        proxy_address_t address;
+
+        if ( !proxy_platform_socket_address_from_sockaddr( &sockaddr_from[i], &address ) )
+            continue;
+
+        for ( int offset = 0; offset < message_bytes; offset += segment_bytes )
+        {
+            if ( num_packets == max_packets )
+            {
+                proxy_printf( PROXY_LOG_LEVEL_DEBUG, "dropped %d bytes of coalesced packets. no packet buffers left", message_bytes - offset );
+                break;
+            }
+
+            const int bytes = ( message_bytes - offset < segment_bytes ) ? message_bytes - offset : segment_bytes;
+
+            from[num_packets] = address;
+
+            if ( bytes <= max_packet_size )
+            {
+                memcpy( packet_data[num_packets], message_data + offset, bytes );
+                packet_bytes[num_packets] = bytes;
+            }
+            else
+            {
+                packet_bytes[num_packets] = 0;
+            }
+
+            num_packets++;
+        }
+    }
+
+    return num_packets;
+}
+
+int proxy_platform_socket_receive_packets( proxy_platform_socket_t * socket, proxy_address_t * from, uint8_t ** packet_data, int * packet_bytes, int max_packet_size, int max_packets )
+{
+    assert( socket );
+    assert( from );
+    assert( packet_data );
+    assert( packet_bytes );
+    assert( max_packet_size > 0 );
+    assert( max_packets > 0 );
+
+    if ( socket->gro_buffer )
+        return proxy_platform_socket_receive_segmented_packets( socket, from, packet_data, packet_bytes, max_packet_size, max_packets );
+
+    iovec * msg = (iovec*) alloca( sizeof(iovec) * max_packets );
+
+    sockaddr_storage * sockaddr_from = (sockaddr_storage*) alloca( sizeof(sockaddr_storage) * max_packets );
+
+    mmsghdr * packet_array = (mmsghdr*) alloca( sizeof(mmsghdr) * max_packets );
+
+    memset( packet_array, 0, sizeof(mmsghdr) * max_packets );
+
+    // a connected socket only receives from its peer, so there is no source address to read
+
+    const bool connected = proxy_platform_socket_connected( socket );
+
+    for ( int i = 0; i < max_packets; ++i )
+    {
+        msg[i].iov_base = packet_data[i];
+        msg[i].iov_len = max_packet_size;
+        packet_array[i].msg_hdr.msg_name = connected ? NULL : &sockaddr_from[i];
+        packet_array[i].msg_hdr.msg_namelen = connected ? 0 : sizeof( sockaddr_storage );
+        packet_array[i].msg_hdr.msg_iov = &msg[i];
+        packet_array[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // blocking sockets wait for the first packet only, then take whatever else is already queued
+
+    int result = recvmmsg( socket->handle, packet_array, max_packets, ( socket->flags & PROXY_PLATFORM_SOCKET_NON_BLOCKING ) ? MSG_DONTWAIT : MSG_WAITFORONE, NULL );
+
+    if ( result <= 0 )
+    {
+        if ( result == 0 || errno == EAGAIN || errno == EINTR || errno == ECONNREFUSED )
+        {
+            return 0;
+        }
+
+        proxy_printf( PROXY_LOG_LEVEL_DEBUG, "recvmmsg failed with error %d", errno );
+        
+        return -1;
+    }
+
+    for ( int i = 0; i < result; ++i )
+    {
+        packet_bytes[i] = int( packet_array[i].msg_len );
+
+        if ( connected )
+        {
+            from[i] = socket->peer;
+        }
+        else if ( !proxy_platform_socket_address_from_sockaddr( &sockaddr_from[i], &from[i] ) )
+        {
+            // unknown address family. drop the packet but keep the rest of the batch
+
+            from[i].type = PROXY_ADDRESS_NONE;
+            packet_bytes[i] = 0;
+        }
+    }
+
+    return result;
+}
+
+// ---------------------------------------------------
+
+bool proxy_platform_socket_steer( proxy_platform_socket_t * socket, const int * bucket_threads, int num_buckets, int cpu_sockets )
+{
+    /*
+        Attaches a classic bpf program to the reuseport group the socket belongs to. The kernel runs it for each packet
+        and delivers the packet to the socket it returns, counting sockets in the order they were bound.
+
+        The program folds the ipv4 source address and port into a bucket exactly like proxy_steering_bucket, then
+        looks up the thread that owns the bucket. Buckets without an owner go to the socket for the cpu that received
+        the packet (cpu modulo cpu_sockets), or if cpu_sockets is zero, return an out of range index, which makes the
+        kernel fall back to its own hash. Attaching again replaces the previous program.
+    */
+
+    assert( socket );
+    assert( bucket_threads );
+    assert( num_buckets > 0 );
+    assert( ( num_buckets & ( num_buckets - 1 ) ) == 0 );
+    assert( cpu_sockets >= 0 );
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+
+    const int max_instructions = 14 + 2 * num_buckets;
+
+    sock_filter * code = (sock_filter*) malloc( sizeof(sock_filter) * max_instructions );
+    if ( !code )
+        return false;
+
+    int n = 0;
+
+    code[n++] = BPF_STMT( BPF_LD | BPF_W | BPF_ABS, uint32_t( SKF_NET_OFF + 12 ) );        // source address
+    code[n++] = BPF_STMT( BPF_MISC | BPF_TAX, 0 );
+    code[n++] = BPF_STMT( BPF_LD | BPF_H | BPF_ABS, uint32_t( SKF_NET_OFF + 20 ) );        // source port, assumes no ip options
+    code[n++] = BPF_STMT( BPF_ALU | BPF_XOR | BPF_X, 0 );
+    code[n++] = BPF_STMT( BPF_MISC | BPF_TAX, 0 );
+    code[n++] = BPF_STMT( BPF_ALU | BPF_RSH | BPF_K, 16 );
+    code[n++] = BPF_STMT( BPF_ALU | BPF_XOR | BPF_X, 0 );
+    code[n++] = BPF_STMT( BPF_MISC | BPF_TAX, 0 );
+    code[n++] = BPF_STMT( BPF_ALU | BPF_RSH | BPF_K, 8 );
+    code[n++] = BPF_STMT( BPF_ALU | BPF_XOR | BPF_X, 0 );
+    code[n++] = BPF_STMT( BPF_ALU | BPF_AND | BPF_K, uint32_t( num_buckets - 1 ) );
+
+    for ( int i = 0; i < num_buckets; ++i )
+    {
+        if ( bucket_threads[i] < 0 )
+            continue;
+
+        code[n++] = BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, uint32_t( i ), 0, 1 );
+        code[n++] = BPF_STMT( BPF_RET | BPF_K, uint32_t( bucket_threads[i] ) );
+    }
+
+    if ( cpu_sockets > 0 )
+    {
+        code[n++] = BPF_STMT( BPF_LD | BPF_W | BPF_ABS, uint32_t( SKF_AD_OFF + SKF_AD_CPU ) );
+        code[n++] = BPF_STMT( BPF_ALU | BPF_MOD | BPF_K, uint32_t( cpu_sockets ) );
+        code[n++] = BPF_STMT( BPF_RET | BPF_A, 0 );
+    }
+    else
+    {
+        code[n++] = BPF_STMT( BPF_RET | BPF_K, 0xFFFFFFFFU );
+    }
+
+    assert( n <= max_instructions );
+
+    sock_fprog program;
+    program.len = (unsigned short) n;
+    program.filter = code;
+
+    const bool result = setsockopt( socket->handle, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program) ) == 0;
+
+    if ( !result )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_DEBUG, "failed to attach reuseport steering program (%d)", errno );
+    }
+
+    free( code );
+
+    return result;
+
+#else // #ifdef SO_ATTACH_REUSEPORT_CBPF
+
+    (void) socket;
+    (void) bucket_threads;
+    (void) num_buckets;
+    (void) cpu_sockets;
+
+    return false;
+
+#endif // #ifdef SO_ATTACH_REUSEPORT_CBPF
+}
+
+// ---------------------------------------------------
+
+proxy_platform_poll_t * proxy_platform_poll_create( int max_sockets )
+{
+    (void) max_sockets;
+
+    proxy_platform_poll_t * poll = (proxy_platform_poll_t*) malloc( sizeof( proxy_platform_poll_t ) );
+
+    assert( poll );
+
+    poll->handle = epoll_create1( 0 );
+
+    if ( poll->handle < 0 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "failed to create epoll instance" );
+        free( poll );
+        return NULL;
+    }
+
+    return poll;
+}
+
+void proxy_platform_poll_destroy( proxy_platform_poll_t * poll )
+{
+    assert( poll );
+    close( poll->handle );
+    free( poll );
+}
+
+bool proxy_platform_poll_add( proxy_platform_poll_t * poll, proxy_platform_socket_t * socket, uint64_t id )
+{
+    assert( poll );
+    assert( socket );
+
+    epoll_event event;
+    memset( &event, 0, sizeof( event ) );
+    event.events = EPOLLIN;
+    event.data.u64 = id;
+
+    if ( epoll_ctl( poll->handle, EPOLL_CTL_ADD, socket->handle, &event ) != 0 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "failed to add socket to epoll instance (%d)", errno );
+        return false;
+    }
+
+    return true;
+}
+
+int proxy_platform_poll_wait( proxy_platform_poll_t * poll, uint64_t * ready_ids, int max_ready, float timeout_seconds )
+{
+    assert( poll );
+    assert( ready_ids );
+    assert( max_ready > 0 );
+
+    epoll_event * events = (epoll_event*) alloca( sizeof( epoll_event ) * max_ready );
+
+    int result = epoll_wait( poll->handle, events, max_ready, (int) ( timeout_seconds * 1000.0f ) );
+
+    if ( result < 0 )
+    {
+        if ( errno == EINTR )
+        {
+            return 0;
+        }
+
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "epoll_wait failed with error %d", errno );
+
+        return -1;
+    }
+
+    for ( int i = 0; i < result; ++i )
+    {
+        ready_ids[i] = events[i].data.u64;
+    }
+
+    return result;
+}
+
+// ---------------------------------------------------
+
+proxy_platform_event_t * proxy_platform_event_create()
+{
+    proxy_platform_event_t * event = (proxy_platform_event_t*) malloc( sizeof( proxy_platform_event_t ) );
+
+    assert( event );
+
+    event->handle = eventfd( 0, EFD_NONBLOCK );
+
+    if ( event->handle < 0 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "failed to create eventfd" );
+        free( event );
+        return NULL;
+    }
+
+    return event;
+}
+
+void proxy_platform_event_destroy( proxy_platform_event_t * event )
+{
+    assert( event );
+    close( event->handle );
+    free( event );
+}
+
+void proxy_platform_event_signal( proxy_platform_event_t * event )
+{
+    assert( event );
+    uint64_t value = 1;
+    if ( write( event->handle, &value, sizeof(value) ) != sizeof(value) )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_DEBUG, "failed to signal eventfd (%d)", errno );
+    }
+}
+
+void proxy_platform_event_clear( proxy_platform_event_t * event )
+{
+    assert( event );
+    uint64_t value = 0;
+    if ( read( event->handle, &value, sizeof(value) ) < 0 && errno != EAGAIN )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_DEBUG, "failed to clear eventfd (%d)", errno );
+    }
+}
+
+bool proxy_platform_poll_add_event( proxy_platform_poll_t * poll, proxy_platform_event_t * event, uint64_t id )
+{
+    assert( poll );
+    assert( event );
+
+    epoll_event poll_event;
+    memset( &poll_event, 0, sizeof( poll_event ) );
+    poll_event.events = EPOLLIN;
+    poll_event.data.u64 = id;
+
+    if ( epoll_ctl( poll->handle, EPOLL_CTL_ADD, event->handle, &poll_event ) != 0 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "failed to add event to epoll instance (%d)", errno );
+        return false;
+    }
+
+    return true;
+}
+
+// ---------------------------------------------------
+
+#if PROXY_PLATFORM_HAS_IO_URING
+
+/*
+    io_uring backend. Two rings per instance, driven with the raw syscalls:
+
+    The receive ring keeps one multishot recvmsg armed on every socket added to it, selecting buffers from a provided
+    buffer ring registered with the kernel, plus a multishot poll on each event. Packets complete straight into those
+    buffers, laid out as io_uring_recvmsg_out, then the source address, then the packet. The address area is parsed
+    before the packet is handed out, so the caller may write up to sizeof(sockaddr_storage) bytes in front of the packet.
+    Buffers handed out by a wait go back to the kernel on the next recycle.
+
+    The send ring takes sendmsg requests. Packets are copied into send buffers owned by the ring and the whole batch
+    is submitted with one io_uring_enter. Completions are reaped whenever a send buffer is needed, so a slow send
+    never stalls the receive side.
+*/
+
+#define PROXY_URING_RECEIVE_GROUP 0
+
+#define PROXY_URING_SEND_ENTRIES 256
+
+#define PROXY_URING_EVENT_FLAG ( 1ULL << 63 )
+
+struct proxy_platform_uring_queue_t
+{
+    int handle;
+    void * ring;
+    size_t ring_bytes;
+    io_uring_sqe * sqes;
+    size_t sqes_bytes;
+    uint32_t * sq_head;
+    uint32_t * sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t * sq_array;
+    uint32_t sq_pending;
+    uint32_t * cq_head;
+    uint32_t * cq_tail;
+    uint32_t cq_mask;
+    io_uring_cqe * cqes;
+};
+
+struct proxy_platform_uring_send_t
+{
+    msghdr message;
+    iovec vector;
+    sockaddr_storage to;
+};
+
+struct proxy_platform_uring_t
+{
+    proxy_platform_uring_queue_t receive;
+    proxy_platform_uring_queue_t send;
+
+    int max_sockets;
+    int num_sockets;
+    int * socket_handles;
+    uint64_t * socket_ids;
+    int * disarmed;
+    int num_disarmed;
+    msghdr receive_message;
+
+    io_uring_buf * buffer_ring;
+    size_t buffer_ring_bytes;
+    uint32_t buffer_mask;
+    uint16_t buffer_tail;
+    int num_buffers;
+    int buffer_size;
+    uint8_t * buffers;
+    uint16_t * buffers_out;
+    int num_buffers_out;
+
+    int max_packet_size;
+    int num_send_buffers;
+    proxy_platform_uring_send_t * send_headers;
+    uint8_t * send_buffers;
+    int * send_free;
+    int num_send_free;
+};
+
+static int proxy_platform_uring_setup( uint32_t entries, io_uring_params * params )
+{
+    return int( syscall( __NR_io_uring_setup, entries, params ) );
+}
+
+static int proxy_platform_uring_enter( int handle, uint32_t to_submit, uint32_t min_complete, uint32_t flags, void * arg, size_t arg_bytes )
+{
+    return int( syscall( __NR_io_uring_enter, handle, to_submit, min_complete, flags, arg, arg_bytes ) );
+}
+
+static int proxy_platform_uring_register( int handle, uint32_t opcode, void * arg, uint32_t num_args )
+{
+    return int( syscall( __NR_io_uring_register, handle, opcode, arg, num_args ) );
+}
+
+static void proxy_platform_uring_queue_destroy( proxy_platform_uring_queue_t * queue )
+{
+    if ( queue->sqes )
+    {
+        munmap( queue->sqes, queue->sqes_bytes );
+    }
+
+    if ( queue->ring )
+    {
+        munmap( queue->ring, queue->ring_bytes );
+    }
+
+    if ( queue->handle >= 0 )
+    {
+        close( queue->handle );
+    }
+
+    memset( queue, 0, sizeof(proxy_platform_uring_queue_t) );
+
+    queue->handle = -1;
+}
+
+static bool proxy_platform_uring_queue_create( proxy_platform_uring_queue_t * queue, uint32_t sq_entries, uint32_t cq_entries )
+{
+    memset( queue, 0, sizeof(proxy_platform_uring_queue_t) );
+
+    if ( cq_entries < sq_entries * 2 )
+    {
+        cq_entries = sq_entries * 2;
+    }
+
+    io_uring_params params;
+    memset( &params, 0, sizeof(params) );
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    params.cq_entries = cq_entries;
+
+    queue->handle = proxy_platform_uring_setup( sq_entries, &params );
+
+    if ( queue->handle < 0 && errno == EINVAL )
+    {
+        // older kernels don't know the task run hints
+
+        memset( &params, 0, sizeof(params) );
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = cq_entries;
+        queue->handle = proxy_platform_uring_setup( sq_entries, &params );
+    }
+
+    if ( queue->handle < 0 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_DEBUG, "io_uring_setup failed (%d)", errno );
+        queue->handle = -1;
+        return false;
+    }
+
+    // multishot recvmsg arrived in the same kernel as linked files. older kernels fail every receive
+
+    if ( ( params.features & IORING_FEAT_SINGLE_MMAP ) == 0 || ( params.features & IORING_FEAT_LINKED_FILE ) == 0 || ( params.features & IORING_FEAT_EXT_ARG ) == 0 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_DEBUG, "io_uring is missing required features (%x)", params.features );
+        proxy_platform_uring_queue_destroy( queue );
+        return false;
+    }
+
+    const size_t sq_bytes = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    const size_t cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    queue->ring_bytes = sq_bytes > cq_bytes ? sq_bytes : cq_bytes;
+    queue->ring = mmap( NULL, queue->ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, queue->handle, IORING_OFF_SQ_RING );
+    if ( queue->ring == MAP_FAILED )
+    {
+        queue->ring = NULL;
+        proxy_platform_uring_queue_destroy( queue );
+        return false;
+    }
+
+    queue->sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+    queue->sqes = (io_uring_sqe*) mmap( NULL, queue->sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, queue->handle, IORING_OFF_SQES );
+    if ( queue->sqes == MAP_FAILED )
+    {
+        queue->sqes = NULL;
+        proxy_platform_uring_queue_destroy( queue );
+        return false;
+    }
+
+    uint8_t * ring = (uint8_t*) queue->ring;
+
+    queue->sq_head = (uint32_t*) ( ring + params.sq_off.head );
+    queue->sq_tail = (uint32_t*) ( ring + params.sq_off.tail );
+    queue->sq_mask = *(uint32_t*) ( ring + params.sq_off.ring_mask );
+    queue->sq_entries = params.sq_entries;
+    queue->sq_array = (uint32_t*) ( ring + params.sq_off.array );
+    queue->cq_head = (uint32_t*) ( ring + params.cq_off.head );
+    queue->cq_tail = (uint32_t*) ( ring + params.cq_off.tail );
+    queue->cq_mask = *(uint32_t*) ( ring + params.cq_off.ring_mask );
+    queue->cqes = (io_uring_cqe*) ( ring + params.cq_off.cqes );
+
+    return true;
+}
+
+static bool proxy_platform_uring_queue_submit( proxy_platform_uring_queue_t * queue, bool get_events, uint32_t min_complete, float timeout_seconds )
+{
+    uint32_t flags = 0;
+
+    io_uring_getevents_arg arg;
+    __kernel_timespec timeout;
+
+    if ( get_events )
+    {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        memset( &arg, 0, sizeof(arg) );
+        if ( timeout_seconds >= 0.0f )
+        {
+            timeout.tv_sec = int64_t( timeout_seconds );
+            timeout.tv_nsec = int64_t( ( timeout_seconds - float( timeout.tv_sec ) ) * 1000000000.0f );
+            arg.ts = uint64_t( uintptr_t( &timeout ) );
+        }
+    }
+    else if ( queue->sq_pending == 0 )
+    {
+        return true;
+    }
+
+    const int result = proxy_platform_uring_enter( queue->handle, queue->sq_pending, min_complete, flags, get_events ? &arg : NULL, sizeof(arg) );
+
+    if ( result >= 0 )
+    {
+        queue->sq_pending -= uint32_t( result );
+        return true;
+    }
+
+    // timeouts and interrupts are fine. a backed up completion queue clears once the caller reaps it
+
+    if ( errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY )
+        return true;
+
+    proxy_printf( PROXY_LOG_LEVEL_ERROR, "io_uring_enter failed (%d)", errno );
+
+    return false;
+}
+
+static io_uring_sqe * proxy_platform_uring_queue_get_sqe( proxy_platform_uring_queue_t * queue )
+{
+    const uint32_t head = __atomic_load_n( queue->sq_head, __ATOMIC_ACQUIRE );
+    const uint32_t tail = *queue->sq_tail;
+
+    if ( tail - head >= queue->sq_entries )
+    {
+        proxy_platform_uring_queue_submit( queue, false, 0, 0.0f );
+
+        if ( tail - __atomic_load_n( queue->sq_head, __ATOMIC_ACQUIRE ) >= queue->sq_entries )
+            return NULL;
+    }
+
+    const uint32_t index = tail & queue->sq_mask;
+
+    io_uring_sqe * sqe = &queue->sqes[index];
+    memset( sqe, 0, sizeof(io_uring_sqe) );
+    queue->sq_array[index] = index;
+
+    __atomic_store_n( queue->sq_tail, tail + 1, __ATOMIC_RELEASE );
+
+    queue->sq_pending++;
+
+    return sqe;
+}
+
+static bool proxy_platform_uring_arm_socket( proxy_platform_uring_t * uring, int index )
+{
+    io_uring_sqe * sqe = proxy_platform_uring_queue_get_sqe( &uring->receive );
+    if ( !sqe )
+        return false;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = uring->socket_handles[index];
+    sqe->addr = uint64_t( uintptr_t( &uring->receive_message ) );
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = PROXY_URING_RECEIVE_GROUP;
+    sqe->user_data = uint64_t( index );
+
+    return true;
+}
+
+static bool proxy_platform_uring_arm_event( proxy_platform_uring_t * uring, int index )
+{
+    io_uring_sqe * sqe = proxy_platform_uring_queue_get_sqe( &uring->receive );
+    if ( !sqe )
+        return false;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = uring->socket_handles[index];
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = uint64_t( index ) | PROXY_URING_EVENT_FLAG;
+
+    return true;
+}
+
+static void proxy_platform_uring_provide_buffer( proxy_platform_uring_t * uring, uint16_t buffer_id )
+{
+    io_uring_buf * buffer = &uring->buffer_ring[uring->buffer_tail & uring->buffer_mask];
+    buffer->addr = uint64_t( uintptr_t( uring->buffers + size_t(buffer_id) * uring->buffer_size ) );
+    buffer->len = uint32_t( uring->buffer_size );
+    buffer->bid = buffer_id;
+    uring->buffer_tail++;
+}
+
+void proxy_platform_uring_destroy( proxy_platform_uring_t * uring );
+
+proxy_platform_uring_t * proxy_platform_uring_create( int max_sockets, int num_buffers, int max_packet_size, int num_send_buffers )
+{
+    assert( max_sockets > 0 );
+    assert( num_buffers > 0 && num_buffers <= 32768 );
+    assert( ( num_buffers & ( num_buffers - 1 ) ) == 0 );
+    assert( max_packet_size > 0 );
+    assert( num_send_buffers > 0 );
+
+    proxy_platform_uring_t * uring = (proxy_platform_uring_t*) calloc( 1, sizeof(proxy_platform_uring_t) );
+    if ( !uring )
+        return NULL;
+
+    uring->receive.handle = -1;
+    uring->send.handle = -1;
+
+    uint32_t receive_entries = 64;
+    while ( receive_entries < uint32_t( max_sockets ) && receive_entries < 4096 )
+    {
+        receive_entries *= 2;
+    }
+
+    if ( !proxy_platform_uring_queue_create( &uring->receive, receive_entries, uint32_t( num_buffers ) * 2 ) ||
+         !proxy_platform_uring_queue_create( &uring->send, PROXY_URING_SEND_ENTRIES, uint32_t( num_send_buffers ) * 2 ) )
+    {
+        proxy_platform_uring_destroy( uring );
+        return NULL;
+    }
+
+    uring->max_sockets = max_sockets;
+    uring->socket_handles = (int*) calloc( max_sockets, sizeof(int) );
+    uring->socket_ids = (uint64_t*) calloc( max_sockets, sizeof(uint64_t) );
+    uring->disarmed = (int*) calloc( max_sockets, sizeof(int) );
+
+    uring->receive_message.msg_namelen = sizeof(sockaddr_storage);
+
+    // receive buffers, each with room for the recvmsg header, the source address and the packet
+
+    uring->num_buffers = num_buffers;
+    uring->buffer_mask = uint32_t( num_buffers - 1 );
+    uring->buffer_size = int( ( sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_storage) + max_packet_size + 63 ) & ~size_t(63) );
+    uring->buffers = (uint8_t*) malloc( size_t(num_buffers) * uring->buffer_size );
+    uring->buffers_out = (uint16_t*) calloc( num_buffers, sizeof(uint16_t) );
+
+    // the ring tail overlays the reserved field of the first entry. io_uring_buf_ring says so too, but its flexible array is laid out differently in c++
+
+    uring->buffer_ring_bytes = sizeof(io_uring_buf) * num_buffers;
+    uring->buffer_ring = (io_uring_buf*) mmap( NULL, uring->buffer_ring_bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0 );
+    if ( uring->buffer_ring == MAP_FAILED )
+    {
+        uring->buffer_ring = NULL;
+    }
+
+    // send buffers, free until their sendmsg completes
+
+    uring->max_packet_size = max_packet_size;
+    uring->num_send_buffers = num_send_buffers;
+    uring->send_headers = (proxy_platform_uring_send_t*) calloc( num_send_buffers, sizeof(proxy_platform_uring_send_t) );
+    uring->send_buffers = (uint8_t*) malloc( size_t(num_send_buffers) * max_packet_size );
+    uring->send_free = (int*) calloc( num_send_buffers, sizeof(int) );
+
+    if ( !uring->socket_handles || !uring->socket_ids || !uring->disarmed || !uring->buffers || !uring->buffers_out || !uring->buffer_ring ||
+         !uring->send_headers || !uring->send_buffers || !uring->send_free )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "could not allocate io_uring buffers" );
+        proxy_platform_uring_destroy( uring );
+        return NULL;
+    }
+
+    for ( int i = 0; i < num_send_buffers; ++i )
+    {
+        uring->send_free[i] = num_send_buffers - 1 - i;
+    }
+    uring->num_send_free = num_send_buffers;
+
+    io_uring_buf_reg reg;
+    memset( &reg, 0, sizeof(reg) );
+    reg.ring_addr = uint64_t( uintptr_t( uring->buffer_ring ) );
+    reg.ring_entries = uint32_t( num_buffers );
+    reg.bgid = PROXY_URING_RECEIVE_GROUP;
+
+    if ( proxy_platform_uring_register( uring->receive.handle, IORING_REGISTER_PBUF_RING, &reg, 1 ) != 0 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_DEBUG, "failed to register io_uring buffer ring (%d)", errno );
+        proxy_platform_uring_destroy( uring );
+        return NULL;
+    }
+
+    for ( int i = 0; i < num_buffers; ++i )
+    {
+        proxy_platform_uring_provide_buffer( uring, uint16_t( i ) );
+    }
+
+    __atomic_store_n( &uring->buffer_ring[0].resv, uring->buffer_tail, __ATOMIC_RELEASE );
+
+    return uring;
+}
+
+void proxy_platform_uring_destroy( proxy_platform_uring_t * uring )
+{
+    assert( uring );
+
+    // closing the rings cancels anything still armed before the buffers go away
+
+    proxy_platform_uring_queue_destroy( &uring->receive );
+    proxy_platform_uring_queue_destroy( &uring->send );
+
+    if ( uring->buffer_ring )
+    {
+        munmap( uring->buffer_ring, uring->buffer_ring_bytes );
+    }
+
+    free( uring->socket_handles );
+    free( uring->socket_ids );
+    free( uring->disarmed );
+    free( uring->buffers );
+    free( uring->buffers_out );
+    free( uring->send_headers );
+    free( uring->send_buffers );
+    free( uring->send_free );
+    free( uring );
+}
+
+bool proxy_platform_uring_add( proxy_platform_uring_t * uring, proxy_platform_socket_t * socket, uint64_t id )
+{
+    assert( uring );
+    assert( socket );
+
+    if ( uring->num_sockets == uring->max_sockets )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "io_uring socket set is full" );
+        return false;
+    }
+
+    const int index = uring->num_sockets++;
+    uring->socket_handles[index] = socket->handle;
+    uring->socket_ids[index] = id;
+
+    return proxy_platform_uring_arm_socket( uring, index );
+}
+
+bool proxy_platform_uring_add_event( proxy_platform_uring_t * uring, proxy_platform_event_t * event, uint64_t id )
+{
+    assert( uring );
+    assert( event );
+
+    if ( uring->num_sockets == uring->max_sockets )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "io_uring socket set is full" );
+        return false;
+    }
+
+    const int index = uring->num_sockets++;
+    uring->socket_handles[index] = event->handle;
+    uring->socket_ids[index] = id;
+
+    return proxy_platform_uring_arm_event( uring, index );
+}
+
+int proxy_platform_uring_wait( proxy_platform_uring_t * uring, uint64_t * ids, proxy_address_t * from, uint8_t ** packet_data, int * packet_bytes, int max_packets, float timeout_seconds )
+{
+    assert( uring );
+    assert( ids );
+    assert( from );
+    assert( packet_data );
+    assert( packet_bytes );
+    assert( max_packets > 0 );
+
+    proxy_platform_uring_queue_t * queue = &uring->receive;
+
+    // re-arm anything that stopped since the last wait. multishot receives stop when they run out of buffers
+
+    while ( uring->num_disarmed > 0 && proxy_platform_uring_arm_socket( uring, uring->disarmed[uring->num_disarmed - 1] ) )
+    {
+        uring->num_disarmed--;
+    }
+
+    // only enter the kernel to wait when nothing has completed. entering also runs deferred completion work
+
+    uint32_t head = *queue->cq_head;
+
+    const bool empty = head == __atomic_load_n( queue->cq_tail, __ATOMIC_ACQUIRE );
+
+    if ( !proxy_platform_uring_queue_submit( queue, empty, ( empty && timeout_seconds > 0.0f ) ? 1 : 0, timeout_seconds ) )
+        return -1;
+
+    const uint32_t tail = __atomic_load_n( queue->cq_tail, __ATOMIC_ACQUIRE );
+
+    int num_packets = 0;
+
+    while ( head != tail && num_packets < max_packets && uring->num_buffers_out < uring->num_buffers )
+    {
+        const io_uring_cqe * cqe = &queue->cqes[head & queue->cq_mask];
+
+        head++;
+
+        const uint64_t user_data = cqe->user_data;
+        const int index = int( user_data & ~PROXY_URING_EVENT_FLAG );
+        const bool more = ( cqe->flags & IORING_CQE_F_MORE ) != 0;
+
+        assert( index >= 0 && index < uring->num_sockets );
+
+        if ( !more )
+        {
+            if ( user_data & PROXY_URING_EVENT_FLAG )
+            {
+                proxy_platform_uring_arm_event( uring, index );
+            }
+            else if ( cqe->res >= 0 || cqe->res == -ENOBUFS || cqe->res == -ECONNREFUSED )
+            {
+                // out of buffers, or an icmp error reported on a connected socket. either way, arm it again
+
+                uring->disarmed[uring->num_disarmed++] = index;
+            }
+            else
+            {
+                proxy_printf( PROXY_LOG_LEVEL_ERROR, "io_uring receive failed (%d)", -cqe->res );
+            }
+        }
+
+        if ( user_data & PROXY_URING_EVENT_FLAG )
+        {
+            if ( cqe->res < 0 )
+                continue;
+
+            ids[num_packets] = uring->socket_ids[index];
+            packet_data[num_packets] = NULL;
+            packet_bytes[num_packets] = 0;
+            num_packets++;
+            continue;
+        }
+
+        if ( ( cqe->flags & IORING_CQE_F_BUFFER ) == 0 )
+            continue;
+
+        const uint16_t buffer_id = uint16_t( cqe->flags >> IORING_CQE_BUFFER_SHIFT );
+
+        uring->buffers_out[uring->num_buffers_out++] = buffer_id;
+
+        if ( cqe->res < 0 )
+            continue;
+
+        uint8_t * buffer = uring->buffers + size_t(buffer_id) * uring->buffer_size;
+
+        const io_uring_recvmsg_out * out = (const io_uring_recvmsg_out*) buffer;
+
+        const size_t header_bytes = sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_storage);
+
+        if ( ( out->flags & MSG_TRUNC ) || size_t( cqe->res ) < header_bytes || out->namelen > sizeof(sockaddr_storage) )
+            continue;
+
+        sockaddr_storage address;
+        memset( &address, 0, sizeof(address) );
+        memcpy( &address, buffer + sizeof(io_uring_recvmsg_out), out->namelen );
+
+        if ( !proxy_platform_socket_address_from_sockaddr( &address, &from[num_packets] ) )
+            continue;
+
+        ids[num_packets] = uring->socket_ids[index];
+        packet_data[num_packets] = buffer + header_bytes;
+        packet_bytes[num_packets] = int( out->payloadlen );
+        num_packets++;
+    }
+
+    __atomic_store_n( queue->cq_head, head, __ATOMIC_RELEASE );
+
+    return num_packets;
+}
+
+void proxy_platform_uring_recycle( proxy_platform_uring_t * uring )
+{
+    assert( uring );
+
+    if ( uring->num_buffers_out == 0 )
+        return;
+
+    for ( int i = 0; i < uring->num_buffers_out; ++i )
+    {
+        proxy_platform_uring_provide_buffer( uring, uring->buffers_out[i] );
+    }
+
+    __atomic_store_n( &uring->buffer_ring[0].resv, uring->buffer_tail, __ATOMIC_RELEASE );
+
+    uring->num_buffers_out = 0;
+}
+
+static void proxy_platform_uring_reap_sends( proxy_platform_uring_t * uring )
+{
+    proxy_platform_uring_queue_t * queue = &uring->send;
+
+    uint32_t head = *queue->cq_head;
+
+    const uint32_t tail = __atomic_load_n( queue->cq_tail, __ATOMIC_ACQUIRE );
+
+    while ( head != tail )
+    {
+        const io_uring_cqe * cqe = &queue->cqes[head & queue->cq_mask];
+
+        if ( cqe->res < 0 )
+        {
+            proxy_printf( PROXY_LOG_LEVEL_DEBUG, "io_uring send failed (%d)", -cqe->res );
+        }
+
+        assert( uring->num_send_free < uring->num_send_buffers );
+
+        uring->send_free[uring->num_send_free++] = int( cqe->user_data );
+
+        head++;
+    }
+
+    __atomic_store_n( queue->cq_head, head, __ATOMIC_RELEASE );
+}
+
+void proxy_platform_uring_send_packets( proxy_platform_uring_t * uring, proxy_platform_socket_t * socket, const proxy_address_t * to, void ** packet_data, int * packet_bytes, int num_packets )
+{
+    assert( uring );
+    assert( socket );
+    assert( to );
+    assert( packet_data );
+    assert( packet_bytes );
+
+    const bool to_peer = proxy_platform_socket_sends_to_peer( socket, to, num_packets );
+
+    for ( int i = 0; i < num_packets; ++i )
+    {
+        assert( packet_bytes[i] > 0 );
+        assert( packet_bytes[i] <= uring->max_packet_size );
+
+        if ( uring->num_send_free == 0 )
+        {
+            proxy_platform_uring_reap_sends( uring );
+        }
+
+        if ( uring->num_send_free == 0 )
+        {
+            // every send buffer is in flight. wait for the kernel to finish with one
+
+            proxy_platform_uring_queue_submit( &uring->send, true, 1, 0.1f );
+            proxy_platform_uring_reap_sends( uring );
+
+            if ( uring->num_send_free == 0 )
+            {
+                proxy_printf( PROXY_LOG_LEVEL_DEBUG, "io_uring send buffers exhausted. dropping packet" );
+                continue;
+            }
+        }
+
+        io_uring_sqe * sqe = proxy_platform_uring_queue_get_sqe( &uring->send );
+        if ( !sqe )
+        {
+            proxy_printf( PROXY_LOG_LEVEL_DEBUG, "io_uring send queue full. dropping packet" );
+            continue;
+        }
+
+        const int buffer_index = uring->send_free[--uring->num_send_free];
+
+        proxy_platform_uring_send_t * header = &uring->send_headers[buffer_index];
+        uint8_t * buffer = uring->send_buffers + size_t(buffer_index) * uring->max_packet_size;
+
+        memcpy( buffer, packet_data[i], packet_bytes[i] );
+
+        header->vector.iov_base = buffer;
+        header->vector.iov_len = size_t( packet_bytes[i] );
+        header->message.msg_name = to_peer ? NULL : &header->to;
+        header->message.msg_namelen = to_peer ? 0 : proxy_platform_socket_address_to_sockaddr( &to[i], &header->to );
+        header->message.msg_iov = &header->vector;
+        header->message.msg_iovlen = 1;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = socket->handle;
+        sqe->addr = uint64_t( uintptr_t( &header->message ) );
+        sqe->len = 1;
+        sqe->user_data = uint64_t( buffer_index );
+    }
+}
+
+void proxy_platform_uring_submit( proxy_platform_uring_t * uring )
+{
+    assert( uring );
+
+    proxy_platform_uring_reap_sends( uring );
+
+    proxy_platform_uring_queue_submit( &uring->send, false, 0, 0.0f );
+}
+
+#else // #if PROXY_PLATFORM_HAS_IO_URING
+
+proxy_platform_uring_t * proxy_platform_uring_create( int max_sockets, int num_buffers, int max_packet_size, int num_send_buffers )
+{
+    (void) max_sockets;
+    (void) num_buffers;
+    (void) max_packet_size;
+    (void) num_send_buffers;
+    return NULL;
+}
+
+void proxy_platform_uring_destroy( proxy_platform_uring_t * uring )
+{
+    (void) uring;
+}
+
+bool proxy_platform_uring_add( proxy_platform_uring_t * uring, proxy_platform_socket_t * socket, uint64_t id )
+{
+    (void) uring;
+    (void) socket;
+    (void) id;
+    return false;
+}
+
+bool proxy_platform_uring_add_event( proxy_platform_uring_t * uring, proxy_platform_event_t * event, uint64_t id )
+{
+    (void) uring;
+    (void) event;
+    (void) id;
+    return false;
+}
+
+int proxy_platform_uring_wait( proxy_platform_uring_t * uring, uint64_t * ids, proxy_address_t * from, uint8_t ** packet_data, int * packet_bytes, int max_packets, float timeout_seconds )
+{
+    (void) uring;
+    (void) ids;
+    (void) from;
+    (void) packet_data;
+    (void) packet_bytes;
+    (void) max_packets;
+    (void) timeout_seconds;
+    return -1;
+}
+
+void proxy_platform_uring_recycle( proxy_platform_uring_t * uring )
+{
+    (void) uring;
+}
+
+void proxy_platform_uring_send_packets( proxy_platform_uring_t * uring, proxy_platform_socket_t * socket, const proxy_address_t * to, void ** packet_data, int * packet_bytes, int num_packets )
+{
+    (void) uring;
+    (void) socket;
+    (void) to;
+    (void) packet_data;
+    (void) packet_bytes;
+    (void) num_packets;
+}
+
+void proxy_platform_uring_submit( proxy_platform_uring_t * uring )
+{
+    (void) uring;
+}
+
+#endif // #if PROXY_PLATFORM_HAS_IO_URING
+
+// ---------------------------------------------------
+
+#if PROXY_PLATFORM_HAS_XDP
+
+/*
+    XDP fast path for passthrough packets. The program is assembled here and loaded with the raw bpf syscall, the same
+    way the reuseport steering program is built, so there is no bpf toolchain or library to depend on.
+
+    Established passthrough flows live in two maps. The slot map is an array indexed by slot, holding the client the
+    slot forwards for and when the kernel last forwarded a packet from that client. The client map is a hash from
+    client address and port to slot. Both only cover ipv4 without ip options.
+
+    A passthrough packet from a client to the proxy port whose client maps to an active slot is rewritten to come from
+    that slot's port and go to the server, with the leading zero byte stripped. A packet from the server to an active
+    slot's port is rewritten to come from the proxy port and go to the client, with a zero byte added. The new source
+    address is the address the packet was sent to. Anything else, including every next packet and the first packets
+    of new clients, is passed on to the proxy threads untouched.
+
+    The route to the new destination decides where a rewritten packet goes: out of the interface the fib lookup picks,
+    with its mac addresses, or, if the destination is local, up this host's stack. The program attaches in generic
+    (skb) mode by default, which works on any interface including veth pairs and loopback in a network namespace.
+*/
+
+#define PROXY_XDP_MAX_INSTRUCTIONS 256
+
+#define PROXY_XDP_MAX_JUMPS 64
+
+struct proxy_platform_xdp_slot_t
+{
+    uint32_t client_address;
+    uint16_t client_port;
+    uint16_t active;
+    uint64_t last_forward_time;
+};
+
+struct proxy_platform_xdp_client_t
+{
+    uint32_t address;
+    uint16_t port;
+    uint16_t pad;
+};
+
+struct proxy_platform_xdp_t
+{
+    int num_slots;
+    int slot_map;
+    int client_map;
+    int counter_map;
+    int program;
+    int link;
+};
+
+struct proxy_platform_xdp_program_t
+{
+    bpf_insn insns[PROXY_XDP_MAX_INSTRUCTIONS];
+    int count;
+    int pass_jumps[PROXY_XDP_MAX_JUMPS];
+    int num_pass_jumps;
+    int drop_jumps[PROXY_XDP_MAX_JUMPS];
+    int num_drop_jumps;
+};
+
+static int proxy_platform_bpf( int command, bpf_attr * attr )
+{
+    return int( syscall( __NR_bpf, command, attr, sizeof(bpf_attr) ) );
+}
+
+static int proxy_platform_xdp_emit( proxy_platform_xdp_program_t * program, uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm )
+{
+    assert( program->count < PROXY_XDP_MAX_INSTRUCTIONS );
+    bpf_insn * insn = &program->insns[program->count];
+    memset( insn, 0, sizeof(bpf_insn) );
+    insn->code = code;
+    insn->dst_reg = dst;
+    insn->src_reg = src;
+    insn->off = off;
+    insn->imm = imm;
+    return program->count++;
+}
+
+static void proxy_platform_xdp_patch( proxy_platform_xdp_program_t * program, int jump )
+{
+    // points a forward jump at the next instruction emitted
+
+    program->insns[jump].off = int16_t( program->count - jump - 1 );
+}
+
+static void proxy_platform_xdp_load_map( proxy_platform_xdp_program_t * program, uint8_t dst, int map )
+{
+    proxy_platform_xdp_emit( program, BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, map );
+    proxy_platform_xdp_emit( program, 0, 0, 0, 0, 0 );
+}
+
+static void proxy_platform_xdp_pass_if( proxy_platform_xdp_program_t * program, uint8_t code, uint8_t dst, uint8_t src, int32_t imm )
+{
+    assert( program->num_pass_jumps < PROXY_XDP_MAX_JUMPS );
+    program->pass_jumps[program->num_pass_jumps++] = proxy_platform_xdp_emit( program, code, dst, src, 0, imm );
+}
+
+static void proxy_platform_xdp_drop_if( proxy_platform_xdp_program_t * program, uint8_t code, uint8_t dst, uint8_t src, int32_t imm )
+{
+    assert( program->num_drop_jumps < PROXY_XDP_MAX_JUMPS );
+    program->drop_jumps[program->num_drop_jumps++] = proxy_platform_xdp_emit( program, code, dst, src, 0, imm );
+}
+
+static void proxy_platform_xdp_check_bounds( proxy_platform_xdp_program_t * program, bool drop )
+{
+    // r2 = data, r3 = data_end, and the headers plus one payload byte must fit
+
+    proxy_platform_xdp_emit( program, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6, offsetof( xdp_md, data ), 0 );
+    proxy_platform_xdp_emit( program, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_3, BPF_REG_6, offsetof( xdp_md, data_end ), 0 );
+    proxy_platform_xdp_emit( program, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0 );
+    proxy_platform_xdp_emit( program, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 43 );
+    if ( drop )
+        proxy_platform_xdp_drop_if( program, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0 );
+    else
+        proxy_platform_xdp_pass_if( program, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0 );
+}
+
+static int32_t proxy_platform_xdp_network_u16( uint16_t value )
+{
+    // the value a 16 bit load sees for these bytes in network order
+
+    const uint8_t bytes[2] = { uint8_t( value >> 8 ), uint8_t( value ) };
+    uint16_t result;
+    memcpy( &result, bytes, 2 );
+    return int32_t( result );
+}
+
+static int32_t proxy_platform_xdp_network_u32( const uint8_t * bytes )
+{
+    uint32_t result;
+    memcpy( &result, bytes, 4 );
+    return int32_t( result );
+}
+
+static void proxy_platform_xdp_assemble( proxy_platform_xdp_program_t * program, const proxy_platform_xdp_t * xdp, uint16_t proxy_port, const proxy_address_t * server_address, int slot_base_port )
+{
+    // stack layout, relative to r10
+
+    const int16_t fib = -64;
+    const int16_t client_key = -72;
+    const int16_t slot_key = -76;
+    const int16_t macs = -88;
+    const int16_t new_source_address = -92;
+    const int16_t new_dest_address = -96;
+    const int16_t new_source_port = -98;
+    const int16_t new_dest_port = -100;
+    const int16_t counter_key = -104;
+
+    const int16_t fib_family = int16_t( fib + offsetof( bpf_fib_lookup, family ) );
+    const int16_t fib_protocol = int16_t( fib + offsetof( bpf_fib_lookup, l4_protocol ) );
+    const int16_t fib_source_port = int16_t( fib + offsetof( bpf_fib_lookup, sport ) );
+    const int16_t fib_dest_port = int16_t( fib + offsetof( bpf_fib_lookup, dport ) );
+    const int16_t fib_ifindex = int16_t( fib + offsetof( bpf_fib_lookup, ifindex ) );
+    const int16_t fib_source_address = int16_t( fib + offsetof( bpf_fib_lookup, ipv4_src ) );
+    const int16_t fib_dest_address = int16_t( fib + offsetof( bpf_fib_lookup, ipv4_dst ) );
+    const int16_t fib_source_mac = int16_t( fib + offsetof( bpf_fib_lookup, smac ) );
+    const int16_t fib_dest_mac = int16_t( fib + offsetof( bpf_fib_lookup, dmac ) );
+
+    const int32_t ethernet_ipv4 = proxy_platform_xdp_network_u16( 0x0800 );
+    const int32_t fragment_mask = proxy_platform_xdp_network_u16( 0x3FFF );
+    const int32_t proxy_port_value = proxy_platform_xdp_network_u16( proxy_port );
+    const int32_t server_port_value = proxy_platform_xdp_network_u16( server_address->port );
+    const int32_t server_address_value = proxy_platform_xdp_network_u32( server_address->data.ipv4 );
+
+    proxy_platform_xdp_program_t * p = program;
+
+    memset( p, 0, sizeof(proxy_platform_xdp_program_t) );
+
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0 );
+
+    // ethernet, ipv4 without options or fragments, udp
+
+    proxy_platform_xdp_check_bounds( p, false );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_2, 12, 0 );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, ethernet_ipv4 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_B | BPF_MEM, BPF_REG_4, BPF_REG_2, 14, 0 );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 0x45 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_2, 20, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_4, 0, 0, fragment_mask );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_B | BPF_MEM, BPF_REG_4, BPF_REG_2, 23, 0 );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, IPPROTO_UDP );
+
+    // fib lookup parameters. the new source address is the address the packet was sent to
+
+    for ( int i = 0; i < int( sizeof(bpf_fib_lookup) / 8 ); ++i )
+    {
+        proxy_platform_xdp_emit( p, BPF_ST | BPF_DW | BPF_MEM, BPF_REG_10, 0, int16_t( fib + i * 8 ), 0 );
+    }
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_B | BPF_MEM, BPF_REG_10, 0, fib_family, AF_INET );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_B | BPF_MEM, BPF_REG_10, 0, fib_protocol, IPPROTO_UDP );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_4, BPF_REG_6, offsetof( xdp_md, ingress_ifindex ), 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_4, fib_ifindex, 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_4, BPF_REG_2, 30, 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_4, fib_source_address, 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_4, new_source_address, 0 );
+
+    // the mac addresses, for packets that stay on this host
+
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_DW | BPF_MEM, BPF_REG_4, BPF_REG_2, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_DW | BPF_MEM, BPF_REG_10, BPF_REG_4, macs, 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_4, BPF_REG_2, 8, 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_4, int16_t( macs + 8 ), 0 );
+
+    // r8 = udp length in host order
+
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_8, BPF_REG_2, 38, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_8, 0, 0, 16 );
+
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_2, 36, 0 );
+    const int client_jump = proxy_platform_xdp_emit( p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_4, 0, 0, proxy_port_value );
+
+    // server -> slot port. the slot must be active
+
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_4, BPF_REG_2, 26, 0 );
+    proxy_platform_xdp_pass_if( p, BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_4, 0, server_address_value );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_2, 34, 0 );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, server_port_value );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_2, 36, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_4, 0, 0, 16 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_SUB | BPF_K, BPF_REG_4, 0, 0, slot_base_port );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JGE | BPF_K, BPF_REG_4, 0, xdp->num_slots );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_4, slot_key, 0 );
+    proxy_platform_xdp_load_map( p, BPF_REG_1, xdp->slot_map );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, slot_key );
+    proxy_platform_xdp_emit( p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_0, offsetof( proxy_platform_xdp_slot_t, active ), 0 );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_4, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_4, BPF_REG_0, offsetof( proxy_platform_xdp_slot_t, client_address ), 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_4, fib_dest_address, 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_4, new_dest_address, 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_0, offsetof( proxy_platform_xdp_slot_t, client_port ), 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_H | BPF_MEM, BPF_REG_10, BPF_REG_4, fib_dest_port, 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_H | BPF_MEM, BPF_REG_10, BPF_REG_4, new_dest_port, 0 );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_H | BPF_MEM, BPF_REG_10, 0, fib_source_port, proxy_port_value );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_H | BPF_MEM, BPF_REG_10, 0, new_source_port, proxy_port_value );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_8, 0, 0, 1 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_9, 0, 0, 1 );
+    const int server_done_jump = proxy_platform_xdp_emit( p, BPF_JMP | BPF_JA, 0, 0, 0, 0 );
+
+    // client -> proxy port. passthrough packets only, from a client with an active slot
+
+    proxy_platform_xdp_patch( p, client_jump );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_B | BPF_MEM, BPF_REG_4, BPF_REG_2, 42, 0 );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 0 );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JLT | BPF_K, BPF_REG_8, 0, 10 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_4, BPF_REG_2, 26, 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_4, client_key, 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_2, 34, 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_H | BPF_MEM, BPF_REG_10, BPF_REG_4, int16_t( client_key + 4 ), 0 );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_H | BPF_MEM, BPF_REG_10, 0, int16_t( client_key + 6 ), 0 );
+    proxy_platform_xdp_load_map( p, BPF_REG_1, xdp->client_map );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, client_key );
+    proxy_platform_xdp_emit( p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_7, BPF_REG_0, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_7, slot_key, 0 );
+    proxy_platform_xdp_load_map( p, BPF_REG_1, xdp->slot_map );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, slot_key );
+    proxy_platform_xdp_emit( p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_9, BPF_REG_0, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_9, offsetof( proxy_platform_xdp_slot_t, active ), 0 );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_4, 0, 0 );
+
+    // a client map entry can outlive the client's slot. the slot must still be forwarding for this client
+
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_4, BPF_REG_9, offsetof( proxy_platform_xdp_slot_t, client_address ), 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_5, BPF_REG_10, client_key, 0 );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JNE | BPF_X, BPF_REG_4, BPF_REG_5, 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_9, offsetof( proxy_platform_xdp_slot_t, client_port ), 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_10, int16_t( client_key + 4 ), 0 );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JNE | BPF_X, BPF_REG_4, BPF_REG_5, 0 );
+    proxy_platform_xdp_emit( p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ktime_get_ns );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_DW | BPF_MEM, BPF_REG_9, BPF_REG_0, offsetof( proxy_platform_xdp_slot_t, last_forward_time ), 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_7, 0, 0, slot_base_port );
+    proxy_platform_xdp_emit( p, BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_7, 0, 0, 16 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_H | BPF_MEM, BPF_REG_10, BPF_REG_7, fib_source_port, 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_H | BPF_MEM, BPF_REG_10, BPF_REG_7, new_source_port, 0 );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_H | BPF_MEM, BPF_REG_10, 0, fib_dest_port, server_port_value );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_H | BPF_MEM, BPF_REG_10, 0, new_dest_port, server_port_value );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_W | BPF_MEM, BPF_REG_10, 0, fib_dest_address, server_address_value );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_W | BPF_MEM, BPF_REG_10, 0, new_dest_address, server_address_value );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_SUB | BPF_K, BPF_REG_8, 0, 0, 1 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_9, 0, 0, 0 );
+
+    // route the rewritten packet. r7 = fib result, r8 = new udp length, r9 = 1 if the zero byte is added, 0 if stripped
+
+    proxy_platform_xdp_patch( p, server_done_jump );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, fib );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, sizeof(bpf_fib_lookup) );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_fib_lookup );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0 );
+    const int routed_jump = proxy_platform_xdp_emit( p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_7, 0, 0, BPF_FIB_LKUP_RET_SUCCESS );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_7, 0, BPF_FIB_LKUP_RET_NOT_FWDED );
+    proxy_platform_xdp_patch( p, routed_jump );
+
+    // move the start of the packet back a byte to add the zero byte, or forward a byte to strip it
+
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 1 );
+    const int strip_jump = proxy_platform_xdp_emit( p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_9, 0, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, -1 );
+    proxy_platform_xdp_patch( p, strip_jump );
+    proxy_platform_xdp_emit( p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_xdp_adjust_head );
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0 );
+
+    // from here on the old headers are gone. write new ones in front of the payload
+
+    proxy_platform_xdp_check_bounds( p, true );
+
+    const int local_jump = proxy_platform_xdp_emit( p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_7, 0, 0, BPF_FIB_LKUP_RET_SUCCESS );
+    for ( int i = 0; i < 6; i += 2 )
+    {
+        // the macs in the fib result are only 2 byte aligned on the stack
+        proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_10, int16_t( fib_dest_mac + i ), 0 );
+        proxy_platform_xdp_emit( p, BPF_STX | BPF_H | BPF_MEM, BPF_REG_2, BPF_REG_4, int16_t( i ), 0 );
+        proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_10, int16_t( fib_source_mac + i ), 0 );
+        proxy_platform_xdp_emit( p, BPF_STX | BPF_H | BPF_MEM, BPF_REG_2, BPF_REG_4, int16_t( 6 + i ), 0 );
+    }
+    const int ethernet_jump = proxy_platform_xdp_emit( p, BPF_JMP | BPF_JA, 0, 0, 0, 0 );
+    proxy_platform_xdp_patch( p, local_jump );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_DW | BPF_MEM, BPF_REG_4, BPF_REG_10, macs, 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_DW | BPF_MEM, BPF_REG_2, BPF_REG_4, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_4, BPF_REG_10, int16_t( macs + 8 ), 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_4, 8, 0 );
+    proxy_platform_xdp_patch( p, ethernet_jump );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_H | BPF_MEM, BPF_REG_2, 0, 12, ethernet_ipv4 );
+
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_B | BPF_MEM, BPF_REG_2, 0, 14, 0x45 );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_B | BPF_MEM, BPF_REG_2, 0, 15, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_8, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 20 );
+    proxy_platform_xdp_emit( p, BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_4, 0, 0, 16 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_H | BPF_MEM, BPF_REG_2, BPF_REG_4, 16, 0 );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_H | BPF_MEM, BPF_REG_2, 0, 18, 0 );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_H | BPF_MEM, BPF_REG_2, 0, 20, 0 );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_B | BPF_MEM, BPF_REG_2, 0, 22, 64 );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_B | BPF_MEM, BPF_REG_2, 0, 23, IPPROTO_UDP );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_H | BPF_MEM, BPF_REG_2, 0, 24, 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_4, BPF_REG_10, new_source_address, 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_4, 26, 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_4, BPF_REG_10, new_dest_address, 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_4, 30, 0 );
+
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_10, new_source_port, 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_H | BPF_MEM, BPF_REG_2, BPF_REG_4, 34, 0 );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_10, new_dest_port, 0 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_H | BPF_MEM, BPF_REG_2, BPF_REG_4, 36, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_8, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_4, 0, 0, 16 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_H | BPF_MEM, BPF_REG_2, BPF_REG_4, 38, 0 );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_H | BPF_MEM, BPF_REG_2, 0, 40, 0 );
+    const int prefix_jump = proxy_platform_xdp_emit( p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_9, 0, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ST | BPF_B | BPF_MEM, BPF_REG_2, 0, 42, 0 );
+    proxy_platform_xdp_patch( p, prefix_jump );
+
+    // ip header checksum
+
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_2, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, 14 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 20 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_5, 0, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_csum_diff );
+    for ( int i = 0; i < 2; ++i )
+    {
+        proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_0, 0, 0 );
+        proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_1, 0, 0, 16 );
+        proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_0, 0, 0, 0xFFFF );
+        proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_0, BPF_REG_1, 0, 0 );
+    }
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_XOR | BPF_K, BPF_REG_0, 0, 0, 0xFFFF );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_0, 0, 0, 0xFFFF );
+    proxy_platform_xdp_check_bounds( p, true );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_H | BPF_MEM, BPF_REG_2, BPF_REG_0, 24, 0 );
+
+    // count it. counter 0 is packets to the server, 1 packets to clients
+
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_9, counter_key, 0 );
+    proxy_platform_xdp_load_map( p, BPF_REG_1, xdp->counter_map );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, counter_key );
+    proxy_platform_xdp_emit( p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem );
+    const int counted_jump = proxy_platform_xdp_emit( p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1 );
+    proxy_platform_xdp_emit( p, BPF_STX | BPF_DW | BPF_ATOMIC, BPF_REG_0, BPF_REG_1, 0, BPF_ADD );
+    proxy_platform_xdp_patch( p, counted_jump );
+
+    // local destinations go up the stack, everything else out of the interface the route picked
+
+    proxy_platform_xdp_pass_if( p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_7, 0, BPF_FIB_LKUP_RET_SUCCESS );
+    proxy_platform_xdp_emit( p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_10, fib_ifindex, 0 );
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 0 );
+    proxy_platform_xdp_emit( p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect );
+    proxy_platform_xdp_emit( p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0 );
+
+    for ( int i = 0; i < p->num_pass_jumps; ++i )
+    {
+        proxy_platform_xdp_patch( p, p->pass_jumps[i] );
+    }
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS );
+    proxy_platform_xdp_emit( p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0 );
+
+    for ( int i = 0; i < p->num_drop_jumps; ++i )
+    {
+        proxy_platform_xdp_patch( p, p->drop_jumps[i] );
+    }
+    proxy_platform_xdp_emit( p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_DROP );
+    proxy_platform_xdp_emit( p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0 );
+}
+
+static int proxy_platform_xdp_map_create( uint32_t type, uint32_t key_size, uint32_t value_size, uint32_t max_entries )
+{
+    bpf_attr attr;
+    memset( &attr, 0, sizeof(attr) );
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+    return proxy_platform_bpf( BPF_MAP_CREATE, &attr );
+}
+
+static bool proxy_platform_xdp_map_update( int map, const void * key, const void * value )
+{
+    bpf_attr attr;
+    memset( &attr, 0, sizeof(attr) );
+    attr.map_fd = uint32_t( map );
+    attr.key = uint64_t( uintptr_t( key ) );
+    attr.value = uint64_t( uintptr_t( value ) );
+    attr.flags = BPF_ANY;
+    return proxy_platform_bpf( BPF_MAP_UPDATE_ELEM, &attr ) == 0;
+}
+
+static bool proxy_platform_xdp_map_lookup( int map, const void * key, void * value )
+{
+    bpf_attr attr;
+    memset( &attr, 0, sizeof(attr) );
+    attr.map_fd = uint32_t( map );
+    attr.key = uint64_t( uintptr_t( key ) );
+    attr.value = uint64_t( uintptr_t( value ) );
+    return proxy_platform_bpf( BPF_MAP_LOOKUP_ELEM, &attr ) == 0;
+}
+
+static void proxy_platform_xdp_map_delete( int map, const void * key )
+{
+    bpf_attr attr;
+    memset( &attr, 0, sizeof(attr) );
+    attr.map_fd = uint32_t( map );
+    attr.key = uint64_t( uintptr_t( key ) );
+    proxy_platform_bpf( BPF_MAP_DELETE_ELEM, &attr );
+}
+
+static void proxy_platform_xdp_client_key( const proxy_address_t * client_address, proxy_platform_xdp_client_t * key )
+{
+    memset( key, 0, sizeof(proxy_platform_xdp_client_t) );
+    memcpy( &key->address, client_address->data.ipv4, 4 );
+    const uint8_t port[2] = { uint8_t( client_address->port >> 8 ), uint8_t( client_address->port ) };
+    memcpy( &key->port, port, 2 );
+}
+
+void proxy_platform_xdp_destroy( proxy_platform_xdp_t * xdp );
+
+proxy_platform_xdp_t * proxy_platform_xdp_create( const char * interface_name, bool driver_mode, uint16_t proxy_port, const proxy_address_t * server_address, int slot_base_port, int num_slots )
+{
+    assert( interface_name );
+    assert( server_address );
+    assert( num_slots > 0 );
+
+    if ( server_address->type != PROXY_ADDRESS_IPV4 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "xdp only forwards to ipv4 servers" );
+        return NULL;
+    }
+
+    // the interface index, without net/if.h which clashes with the linux headers above
+
+    ifreq request;
+    memset( &request, 0, sizeof(request) );
+    strncpy( request.ifr_name, interface_name, IFNAMSIZ - 1 );
+
+    int query_socket = socket( AF_INET, SOCK_DGRAM, 0 );
+    const bool found = query_socket >= 0 && ioctl( query_socket, SIOCGIFINDEX, &request ) == 0;
+    if ( query_socket >= 0 )
+    {
+        close( query_socket );
+    }
+
+    if ( !found )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "xdp interface %s not found", interface_name );
+        return NULL;
+    }
+
+    const int ifindex = request.ifr_ifindex;
+
+    // the kernel's route lookup refuses to route for an interface that doesn't forward, and the program then punts everything
+
+    char forwarding_path[256];
+    snprintf( forwarding_path, sizeof(forwarding_path), "/proc/sys/net/ipv4/conf/%s/forwarding", interface_name );
+    FILE * forwarding_file = fopen( forwarding_path, "r" );
+    if ( forwarding_file )
+    {
+        if ( fgetc( forwarding_file ) == '0' )
+        {
+            proxy_printf( PROXY_LOG_LEVEL_INFO, "ipv4 forwarding is off on %s. xdp will pass every packet to the proxy threads", interface_name );
+        }
+        fclose( forwarding_file );
+    }
+
+    proxy_platform_xdp_t * xdp = (proxy_platform_xdp_t*) calloc( 1, sizeof(proxy_platform_xdp_t) );
+    if ( !xdp )
+        return NULL;
+
+    xdp->num_slots = num_slots;
+    xdp->slot_map = proxy_platform_xdp_map_create( BPF_MAP_TYPE_ARRAY, sizeof(uint32_t), sizeof(proxy_platform_xdp_slot_t), uint32_t( num_slots ) );
+    xdp->client_map = proxy_platform_xdp_map_create( BPF_MAP_TYPE_HASH, sizeof(proxy_platform_xdp_client_t), sizeof(uint32_t), uint32_t( num_slots ) );
+    xdp->counter_map = proxy_platform_xdp_map_create( BPF_MAP_TYPE_ARRAY, sizeof(uint32_t), sizeof(uint64_t), 2 );
+    xdp->program = -1;
+    xdp->link = -1;
+
+    if ( xdp->slot_map < 0 || xdp->client_map < 0 || xdp->counter_map < 0 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "failed to create xdp maps (%d)", errno );
+        proxy_platform_xdp_destroy( xdp );
+        return NULL;
+    }
+
+    proxy_platform_xdp_program_t * program = (proxy_platform_xdp_program_t*) malloc( sizeof(proxy_platform_xdp_program_t) );
+    const int log_size = 64 * 1024;
+    char * log = (char*) calloc( 1, log_size );
+    if ( !program || !log )
+    {
+        free( program );
+        free( log );
+        proxy_platform_xdp_destroy( xdp );
+        return NULL;
+    }
+
+    proxy_platform_xdp_assemble( program, xdp, proxy_port, server_address, slot_base_port );
+
+    static char license[] = "Dual BSD/GPL";
+
+    bpf_attr attr;
+    memset( &attr, 0, sizeof(attr) );
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insn_cnt = uint32_t( program->count );
+    attr.insns = uint64_t( uintptr_t( program->insns ) );
+    attr.license = uint64_t( uintptr_t( license ) );
+    attr.log_level = 1;
+    attr.log_size = log_size;
+    attr.log_buf = uint64_t( uintptr_t( log ) );
+
+    xdp->program = proxy_platform_bpf( BPF_PROG_LOAD, &attr );
+
+    if ( xdp->program < 0 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "failed to load xdp program (%d)", errno );
+        proxy_printf( PROXY_LOG_LEVEL_DEBUG, "%s", log );
+    }
+
+    free( program );
+    free( log );
+
+    if ( xdp->program < 0 )
+    {
+        proxy_platform_xdp_destroy( xdp );
+        return NULL;
+    }
+
+    // a bpf link detaches the program when it is closed, including when the process dies
+
+    memset( &attr, 0, sizeof(attr) );
+    attr.link_create.prog_fd = uint32_t( xdp->program );
+    attr.link_create.target_ifindex = uint32_t( ifindex );
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = driver_mode ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+
+    xdp->link = proxy_platform_bpf( BPF_LINK_CREATE, &attr );
+
+    if ( xdp->link < 0 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "failed to attach xdp program to %s (%d)", interface_name, errno );
+        proxy_platform_xdp_destroy( xdp );
+        return NULL;
+    }
+
+    return xdp;
+}
+
+void proxy_platform_xdp_destroy( proxy_platform_xdp_t * xdp )
+{
+    assert( xdp );
+
+    const int handles[] = { xdp->link, xdp->program, xdp->counter_map, xdp->client_map, xdp->slot_map };
+
+    for ( int i = 0; i < int( sizeof(handles) / sizeof(int) ); ++i )
+    {
+        if ( handles[i] >= 0 )
+        {
+            close( handles[i] );
+        }
+    }
+
+    free( xdp );
+}
+
+bool proxy_platform_xdp_slot_set( proxy_platform_xdp_t * xdp, int slot, const proxy_address_t * client_address )
+{
+    assert( xdp );
+    assert( slot >= 0 && slot < xdp->num_slots );
+
+    proxy_platform_xdp_slot_t value;
+    memset( &value, 0, sizeof(value) );
+
+    if ( client_address )
+    {
+        assert( client_address->type == PROXY_ADDRESS_IPV4 );
+        proxy_platform_xdp_client_t key;
+        proxy_platform_xdp_client_key( client_address, &key );
+        value.client_address = key.address;
+        value.client_port = key.port;
+        value.active = 1;
+    }
+
+    const uint32_t index = uint32_t( slot );
+
+    return proxy_platform_xdp_map_update( xdp->slot_map, &index, &value );
+}
+
+bool proxy_platform_xdp_client_set( proxy_platform_xdp_t * xdp, const proxy_address_t * client_address, int slot )
+{
+    assert( xdp );
+    assert( client_address );
+    assert( client_address->type == PROXY_ADDRESS_IPV4 );
+    assert( slot < xdp->num_slots );
+
+    proxy_platform_xdp_client_t key;
+    proxy_platform_xdp_client_key( client_address, &key );
+
+    if ( slot >= 0 )
+    {
+        const uint32_t value = uint32_t( slot );
+        return proxy_platform_xdp_map_update( xdp->client_map, &key, &value );
+    }
+
+    proxy_platform_xdp_map_delete( xdp->client_map, &key );
+
+    return true;
+}
+
+double proxy_platform_xdp_slot_idle_seconds( proxy_platform_xdp_t * xdp, int slot )
+{
+    // seconds since the kernel last forwarded a packet from the slot's client, or -1 if it hasn't
+
+    assert( xdp );
+    assert( slot >= 0 && slot < xdp->num_slots );
+
+    const uint32_t index = uint32_t( slot );
+
+    proxy_platform_xdp_slot_t value;
+
+    if ( !proxy_platform_xdp_map_lookup( xdp->slot_map, &index, &value ) || !value.active || value.last_forward_time == 0 )
+        return -1.0;
+
+    timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    const uint64_t current_time = uint64_t( ts.tv_sec ) * 1000000000ULL + uint64_t( ts.tv_nsec );
+
+    if ( current_time < value.last_forward_time )
+        return 0.0;
+
+    return double( current_time - value.last_forward_time ) / 1000000000.0;
+}
+
+void proxy_platform_xdp_counters( proxy_platform_xdp_t * xdp, uint64_t * packets_to_server, uint64_t * packets_to_client )
+{
+    assert( xdp );
+    assert( packets_to_server );
+    assert( packets_to_client );
+
+    uint32_t index = 0;
+    *packets_to_server = 0;
+    proxy_platform_xdp_map_lookup( xdp->counter_map, &index, packets_to_server );
+
+    index = 1;
+    *packets_to_client = 0;
+    proxy_platform_xdp_map_lookup( xdp->counter_map, &index, packets_to_client );
+}
+
+bool proxy_platform_network_namespace_create()
+{
+    // moves the calling thread into a new network namespace with loopback up and ipv4 forwarding on. the namespace goes away with the thread
+
+    if ( unshare( CLONE_NEWNET ) != 0 )
+        return false;
+
+    int query_socket = socket( AF_INET, SOCK_DGRAM, 0 );
+    if ( query_socket < 0 )
+        return false;
+
+    ifreq request;
+    memset( &request, 0, sizeof(request) );
+    strncpy( request.ifr_name, "lo", IFNAMSIZ - 1 );
+
+    bool result = ioctl( query_socket, SIOCGIFFLAGS, &request ) == 0;
+
+    if ( result )
+    {
+        request.ifr_flags |= IFF_UP;
+        result = ioctl( query_socket, SIOCSIFFLAGS, &request ) == 0;
+    }
+
+    close( query_socket );
+
+    // sysctl files belong to the namespace of the thread that opens them
+
+    FILE * forwarding_file = fopen( "/proc/sys/net/ipv4/conf/all/forwarding", "w" );
+    if ( !forwarding_file )
+        return false;
+
+    result = fputs( "1", forwarding_file ) >= 0 && result;
+    result = fclose( forwarding_file ) == 0 && result;
+
+    return result;
+}
+
+#else // #if PROXY_PLATFORM_HAS_XDP
+
+proxy_platform_xdp_t * proxy_platform_xdp_create( const char * interface_name, bool driver_mode, uint16_t proxy_port, const proxy_address_t * server_address, int slot_base_port, int num_slots )
+{
+    (void) interface_name;
+    (void) driver_mode;
+    (void) proxy_port;
+    (void) server_address;
+    (void) slot_base_port;
+    (void) num_slots;
+    return NULL;
+}
+
+void proxy_platform_xdp_destroy( proxy_platform_xdp_t * xdp )
+{
+    (void) xdp;
+}
+
+bool proxy_platform_xdp_slot_set( proxy_platform_xdp_t * xdp, int slot, const proxy_address_t * client_address )
+{
+    (void) xdp;
+    (void) slot;
+    (void) client_address;
+    return false;
+}
+
+bool proxy_platform_xdp_client_set( proxy_platform_xdp_t * xdp, const proxy_address_t * client_address, int slot )
+{
+    (void) xdp;
+    (void) client_address;
+    (void) slot;
+    return false;
+}
+
+double proxy_platform_xdp_slot_idle_seconds( proxy_platform_xdp_t * xdp, int slot )
+{
+    (void) xdp;
+    (void) slot;
+    return -1.0;
+}
+
+void proxy_platform_xdp_counters( proxy_platform_xdp_t * xdp, uint64_t * packets_to_server, uint64_t * packets_to_client )
+{
+    (void) xdp;
+    *packets_to_server = 0;
+    *packets_to_client = 0;
+}
+
+bool proxy_platform_network_namespace_create()
+{
+    return false;
+}
+
+#endif // #if PROXY_PLATFORM_HAS_XDP
+
+// ---------------------------------------------------
+
+proxy_platform_thread_t * proxy_platform_thread_create( proxy_platform_thread_func_t * thread_function, void * arg )
+{
+    proxy_platform_thread_t * thread = (proxy_platform_thread_t*) malloc( sizeof( proxy_platform_thread_t) );
+
+    assert( thread );
+
+    if ( pthread_create( &thread->handle, NULL, thread_function, arg ) != 0 )
+    {
+        free( thread );
+        return NULL;
+    }
+
+    return thread;
+}
+
+void proxy_platform_thread_join( proxy_platform_thread_t * thread )
+{
+    assert( thread );
+    pthread_join( thread->handle, NULL );
+}
+
+void proxy_platform_thread_destroy( proxy_platform_thread_t * thread )
+{
+    assert( thread );
+    free( thread );
+}
+
+bool proxy_platform_thread_high_priority( proxy_platform_thread_t * thread )
+{
+    struct sched_param param;
+    param.sched_priority = sched_get_priority_max( SCHED_FIFO );
+    return pthread_setschedparam( thread->handle, SCHED_FIFO, &param ) == 0;
+}
+
+bool proxy_platform_thread_affinity( proxy_platform_thread_t * thread, int core )
+{
+	cpu_set_t cpuset;
+	CPU_ZERO( &cpuset );
+	CPU_SET( core, &cpuset );
+	return pthread_setaffinity_np( thread->handle, sizeof(cpu_set_t), &cpuset ) == 0;
+}
+
+// ---------------------------------------------------
+
+bool proxy_platform_memory_bind_local( void * data, size_t bytes )
+{
+    // moves the whole pages in the range to the numa node of the cpu the calling thread runs on, and keeps them there
+
+    assert( data );
+
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+
+    if ( syscall( SYS_getcpu, &cpu, &node, NULL ) != 0 )
+        return false;
+
+    const uintptr_t page_size = uintptr_t( sysconf( _SC_PAGESIZE ) );
+
+    const uintptr_t begin = ( uintptr_t( data ) + page_size - 1 ) & ~( page_size - 1 );
+    const uintptr_t end = ( uintptr_t( data ) + bytes ) & ~( page_size - 1 );
+
+    // a range that holds no whole page binds nothing. report it, rather than claim the memory moved
+
+    if ( end <= begin )
+        return false;
+
+    const int bits_per_word = int( sizeof(unsigned long) * 8 );
+
+    unsigned long node_mask[16];
+    memset( node_mask, 0, sizeof(node_mask) );
+
+    if ( node >= sizeof(node_mask) * 8 )
+        return false;
+
+    node_mask[node / bits_per_word] |= 1UL << ( node % bits_per_word );
+
+    if ( syscall( SYS_mbind, begin, end - begin, MPOL_PREFERRED, node_mask, sizeof(node_mask) * 8, MPOL_MF_MOVE ) != 0 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_DEBUG, "failed to bind memory to numa node %d (%d)", node, errno );
+        return false;
+    }
+
+    return true;
+}
+
+void * proxy_platform_memory_alloc_pages( size_t bytes )
+{
+    // zeroed and page aligned, so proxy_platform_memory_bind_local can bind all of it
+
+    assert( bytes > 0 );
+
+    void * data = mmap( NULL, bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0 );
+
+    return ( data != MAP_FAILED ) ? data : NULL;
+}
+
+void proxy_platform_memory_free_pages( void * data, size_t bytes )
+{
+    if ( data )
+    {
+        munmap( data, bytes );
+    }
 }
 
 // ---------------------------------------------------
@@ -33,6 +33,8 @@
 
 #define PROXY_PLATFORM_SOCKET_NON_BLOCKING       (1<<0)
 #define PROXY_PLATFORM_SOCKET_REUSE_PORT         (1<<1)
+#define PROXY_PLATFORM_SOCKET_GSO                (1<<2)
+#define PROXY_PLATFORM_SOCKET_GRO                (1<<3)
 
 // -------------------------------------
 
@@ -42,10 +44,34 @@ struct proxy_platform_socket_t
 {
     uint32_t flags;
     proxy_platform_socket_handle_t handle;
+    uint8_t * gro_buffer;
+    proxy_address_t peer;
 };
 
 // -------------------------------------
 
+struct proxy_platform_poll_t
+{
+    int handle;
+};
+
+// -------------------------------------
+
+struct proxy_platform_event_t
+{
+    int handle;
+};
+
+// -------------------------------------
+
+struct proxy_platform_uring_t;
+
+// -------------------------------------
+
+struct proxy_platform_xdp_t;
+
+// -------------------------------------
+
 struct proxy_platform_thread_t
 {
     pthread_t handle;
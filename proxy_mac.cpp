@@ -34,7 +34,10 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <mach/mach.h>
 #include <mach/mach_time.h>
 #include <SystemConfiguration/SystemConfiguration.h>
@@ -446,6 +449,356 @@ int proxy_platform_socket_receive_packet( proxy_platform_socket_t * socket, prox
     return result;
 }
 
+void proxy_platform_socket_send_packets( proxy_platform_socket_t * socket, const proxy_address_t * to, void ** packet_data, int * packet_bytes, int num_packets )
+{
+    assert( socket );
+    assert( to );
+    assert( packet_data );
+    assert( packet_bytes );
+    assert( num_packets >= 0 );
+
+    // no sendmmsg on mac
+
+    for ( int i = 0; i < num_packets; ++i )
+    {
+        proxy_platform_socket_send_packet( socket, &to[i], packet_data[i], packet_bytes[i] );
+    }
+}
+
+int proxy_platform_socket_receive_packets( proxy_platform_socket_t * socket, proxy_address_t * from, uint8_t ** packet_data, int * packet_bytes, int max_packet_size, int max_packets )
+{
+    assert( socket );
+    assert( from );
+    assert( packet_data );
+    assert( packet_bytes );
+    assert( max_packet_size > 0 );
+    assert( max_packets > 0 );
+
+    // no recvmmsg on mac. only the first receive may block, then take whatever else is already queued
+
+    int num_packets = 0;
+
+    while ( num_packets < max_packets )
+    {
+        int result = proxy_platform_socket_receive_packet( socket, &from[num_packets], packet_data[num_packets], max_packet_size );
+
+        if ( result < 0 )
+        {
+            return ( num_packets > 0 ) ? num_packets : -1;
+        }
+
+        if ( result == 0 )
+            break;
+
+        packet_bytes[num_packets++] = result;
+
+        int available = 0;
+        if ( ioctl( socket->handle, FIONREAD, &available ) != 0 || available <= 0 )
+            break;
+    }
+
+    return num_packets;
+}
+
+// ---------------------------------------------------
+
+bool proxy_platform_socket_connect( proxy_platform_socket_t * socket, const proxy_address_t * address )
+{
+	// not supported. sockets stay unconnected and send with an explicit address
+	(void) socket;
+	(void) address;
+	return false;
+}
+
+void proxy_platform_socket_disconnect( proxy_platform_socket_t * socket )
+{
+	(void) socket;
+}
+
+bool proxy_platform_socket_steer( proxy_platform_socket_t * socket, const int * bucket_threads, int num_buckets, int cpu_sockets )
+{
+	// not supported. the kernel spreads packets across reuseport sockets by its own hash
+	(void) socket;
+	(void) bucket_threads;
+	(void) num_buckets;
+	(void) cpu_sockets;
+	return false;
+}
+
+// ---------------------------------------------------
+
+proxy_platform_poll_t * proxy_platform_poll_create( int max_sockets )
+{
+    assert( max_sockets > 0 );
+
+    proxy_platform_poll_t * poll = (proxy_platform_poll_t*) malloc( sizeof( proxy_platform_poll_t ) );
+
+    assert( poll );
+
+    poll->num_sockets = 0;
+    poll->max_sockets = max_sockets;
+    poll->fds = (struct pollfd*) malloc( sizeof( struct pollfd ) * max_sockets );
+    poll->ids = (uint64_t*) malloc( sizeof( uint64_t ) * max_sockets );
+
+    assert( poll->fds );
+    assert( poll->ids );
+
+    return poll;
+}
+
+void proxy_platform_poll_destroy( proxy_platform_poll_t * poll )
+{
+    assert( poll );
+    free( poll->fds );
+    free( poll->ids );
+    free( poll );
+}
+
+bool proxy_platform_poll_add( proxy_platform_poll_t * poll, proxy_platform_socket_t * socket, uint64_t id )
+{
+    assert( poll );
+    assert( socket );
+
+    if ( poll->num_sockets == poll->max_sockets )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "poll set is full" );
+        return false;
+    }
+
+    const int index = poll->num_sockets++;
+    poll->fds[index].fd = socket->handle;
+    poll->fds[index].events = POLLIN;
+    poll->fds[index].revents = 0;
+    poll->ids[index] = id;
+
+    return true;
+}
+
+int proxy_platform_poll_wait( proxy_platform_poll_t * poll, uint64_t * ready_ids, int max_ready, float timeout_seconds )
+{
+    assert( poll );
+    assert( ready_ids );
+    assert( max_ready > 0 );
+
+    int result = ::poll( poll->fds, poll->num_sockets, (int) ( timeout_seconds * 1000.0f ) );
+
+    if ( result < 0 )
+    {
+        if ( errno == EINTR )
+        {
+            return 0;
+        }
+
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "poll failed with error %d", errno );
+
+        return -1;
+    }
+
+    int num_ready = 0;
+
+    for ( int i = 0; i < poll->num_sockets && num_ready < max_ready; ++i )
+    {
+        if ( poll->fds[i].revents & POLLIN )
+        {
+            ready_ids[num_ready++] = poll->ids[i];
+        }
+    }
+
+    return num_ready;
+}
+
+// ---------------------------------------------------
+
+proxy_platform_event_t * proxy_platform_event_create()
+{
+    proxy_platform_event_t * event = (proxy_platform_event_t*) malloc( sizeof( proxy_platform_event_t ) );
+
+    assert( event );
+
+    int handles[2];
+
+    if ( pipe( handles ) != 0 )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "failed to create event pipe" );
+        free( event );
+        return NULL;
+    }
+
+    fcntl( handles[0], F_SETFL, O_NONBLOCK );
+    fcntl( handles[1], F_SETFL, O_NONBLOCK );
+
+    event->read_handle = handles[0];
+    event->write_handle = handles[1];
+
+    return event;
+}
+
+void proxy_platform_event_destroy( proxy_platform_event_t * event )
+{
+    assert( event );
+    close( event->read_handle );
+    close( event->write_handle );
+    free( event );
+}
+
+void proxy_platform_event_signal( proxy_platform_event_t * event )
+{
+    assert( event );
+    uint8_t value = 1;
+    if ( write( event->write_handle, &value, 1 ) != 1 && errno != EAGAIN )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_DEBUG, "failed to signal event pipe (%d)", errno );
+    }
+}
+
+void proxy_platform_event_clear( proxy_platform_event_t * event )
+{
+    assert( event );
+    uint8_t buffer[256];
+    while ( read( event->read_handle, buffer, sizeof(buffer) ) > 0 ) {}
+}
+
+bool proxy_platform_poll_add_event( proxy_platform_poll_t * poll, proxy_platform_event_t * event, uint64_t id )
+{
+    assert( poll );
+    assert( event );
+
+    if ( poll->num_sockets == poll->max_sockets )
+    {
+        proxy_printf( PROXY_LOG_LEVEL_ERROR, "poll set is full" );
+        return false;
+    }
+
+    const int index = poll->num_sockets++;
+    poll->fds[index].fd = event->read_handle;
+    poll->fds[index].events = POLLIN;
+    poll->fds[index].revents = 0;
+    poll->ids[index] = id;
+
+    return true;
+}
+
+// ---------------------------------------------------
+
+// io_uring is linux only. the proxy falls back to poll
+
+proxy_platform_uring_t * proxy_platform_uring_create( int max_sockets, int num_buffers, int max_packet_size, int num_send_buffers )
+{
+    (void) max_sockets;
+    (void) num_buffers;
+    (void) max_packet_size;
+    (void) num_send_buffers;
+    return NULL;
+}
+
+void proxy_platform_uring_destroy( proxy_platform_uring_t * uring )
+{
+    (void) uring;
+}
+
+bool proxy_platform_uring_add( proxy_platform_uring_t * uring, proxy_platform_socket_t * socket, uint64_t id )
+{
+    (void) uring;
+    (void) socket;
+    (void) id;
+    return false;
+}
+
+bool proxy_platform_uring_add_event( proxy_platform_uring_t * uring, proxy_platform_event_t * event, uint64_t id )
+{
+    (void) uring;
+    (void) event;
+    (void) id;
+    return false;
+}
+
+int proxy_platform_uring_wait( proxy_platform_uring_t * uring, uint64_t * ids, proxy_address_t * from, uint8_t ** packet_data, int * packet_bytes, int max_packets, float timeout_seconds )
+{
+    (void) uring;
+    (void) ids;
+    (void) from;
+    (void) packet_data;
+    (void) packet_bytes;
+    (void) max_packets;
+    (void) timeout_seconds;
+    return -1;
+}
+
+void proxy_platform_uring_recycle( proxy_platform_uring_t * uring )
+{
+    (void) uring;
+}
+
+void proxy_platform_uring_send_packets( proxy_platform_uring_t * uring, proxy_platform_socket_t * socket, const proxy_address_t * to, void ** packet_data, int * packet_bytes, int num_packets )
+{
+    (void) uring;
+    (void) socket;
+    (void) to;
+    (void) packet_data;
+    (void) packet_bytes;
+    (void) num_packets;
+}
+
+void proxy_platform_uring_submit( proxy_platform_uring_t * uring )
+{
+    (void) uring;
+}
+
+// ---------------------------------------------------
+
+// xdp is linux only. every packet goes through the proxy threads
+
+proxy_platform_xdp_t * proxy_platform_xdp_create( const char * interface_name, bool driver_mode, uint16_t proxy_port, const proxy_address_t * server_address, int slot_base_port, int num_slots )
+{
+    (void) interface_name;
+    (void) driver_mode;
+    (void) proxy_port;
+    (void) server_address;
+    (void) slot_base_port;
+    (void) num_slots;
+    return NULL;
+}
+
+void proxy_platform_xdp_destroy( proxy_platform_xdp_t * xdp )
+{
+    (void) xdp;
+}
+
+bool proxy_platform_xdp_slot_set( proxy_platform_xdp_t * xdp, int slot, const proxy_address_t * client_address )
+{
+    (void) xdp;
+    (void) slot;
+    (void) client_address;
+    return false;
+}
+
+bool proxy_platform_xdp_client_set( proxy_platform_xdp_t * xdp, const proxy_address_t * client_address, int slot )
+{
+    (void) xdp;
+    (void) client_address;
+    (void) slot;
+    return false;
+}
+
+double proxy_platform_xdp_slot_idle_seconds( proxy_platform_xdp_t * xdp, int slot )
+{
+    (void) xdp;
+    (void) slot;
+    return -1.0;
+}
+
+void proxy_platform_xdp_counters( proxy_platform_xdp_t * xdp, uint64_t * packets_to_server, uint64_t * packets_to_client )
+{
+    (void) xdp;
+    *packets_to_server = 0;
+    *packets_to_client = 0;
+}
+
+bool proxy_platform_network_namespace_create()
+{
+    return false;
+}
+
 // ---------------------------------------------------
 
 proxy_platform_thread_t * proxy_platform_thread_create( proxy_platform_thread_func_t * thread_function, void * arg )
@@ -492,6 +845,33 @@ bool proxy_platform_thread_affinity( proxy_platform_thread_t * thread, int core
 
 // ---------------------------------------------------
 
+bool proxy_platform_memory_bind_local( void * data, size_t bytes )
+{
+	// not supported. macs have a single memory node
+	(void) data;
+	(void) bytes;
+	return true;
+}
+
+void * proxy_platform_memory_alloc_pages( size_t bytes )
+{
+	assert( bytes > 0 );
+
+	void * data = mmap( NULL, bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0 );
+
+	return ( data != MAP_FAILED ) ? data : NULL;
+}
+
+void proxy_platform_memory_free_pages( void * data, size_t bytes )
+{
+	if ( data )
+	{
+		munmap( data, bytes );
+	}
+}
+
+// ---------------------------------------------------
+
 bool proxy_platform_mutex_create( proxy_platform_mutex_t * mutex )
 {
     assert( mutex );
@@ -29,9 +29,12 @@
 
 #include <pthread.h>
 #include <unistd.h>
+#include <poll.h>
 
 #define PROXY_PLATFORM_SOCKET_NON_BLOCKING       (1<<0)
 #define PROXY_PLATFORM_SOCKET_REUSE_PORT         (1<<1)
+#define PROXY_PLATFORM_SOCKET_GSO                (1<<2)
+#define PROXY_PLATFORM_SOCKET_GRO                (1<<3)
 
 // -------------------------------------
 
@@ -44,6 +47,32 @@ struct proxy_platform_socket_t
 
 // -------------------------------------
 
+struct proxy_platform_poll_t
+{
+    int num_sockets;
+    int max_sockets;
+    struct pollfd * fds;
+    uint64_t * ids;
+};
+
+// -------------------------------------
+
+struct proxy_platform_event_t
+{
+    int read_handle;
+    int write_handle;
+};
+
+// -------------------------------------
+
+struct proxy_platform_uring_t;
+
+// -------------------------------------
+
+struct proxy_platform_xdp_t;
+
+// -------------------------------------
+
 struct proxy_platform_thread_t
 {
     pthread_t handle;